@@ -35,9 +35,25 @@
 #define KERNEL_SOCKET_PATH "\0flexnic_os"
 #define KERNEL_UXSOCK_MAXQ 8
 
+/** Max. number of contexts created with one request */
+#define KERNEL_UXSOCK_CTX_MAX 16
+
+/** Request flag: reattach existing contexts db_ids after a fast restart */
+#define KERNEL_UXSOCK_REATTACH 0x1
+
+/**
+ * Context creation request, one eventfd per context is passed along. The
+ * kernel answers with one response per context, in the same order.
+ */
 struct kernel_uxsock_request {
   uint32_t rxq_len;
   uint32_t txq_len;
+  /** Number of contexts to create, at most KERNEL_UXSOCK_CTX_MAX */
+  uint16_t ctx_num;
+  /** Flags: see KERNEL_UXSOCK_* */
+  uint16_t flags;
+  /** Doorbell ids of the contexts to reattach */
+  uint16_t db_ids[KERNEL_UXSOCK_CTX_MAX];
 } __attribute__((packed));
 
 struct kernel_uxsock_response {
@@ -69,6 +85,23 @@ enum kernel_appout_type {
   KERNEL_APPOUT_LISTEN_CLOSE,
   KERNEL_APPOUT_ACCEPT_CONN,
   KERNEL_APPOUT_REQ_SCALE,
+  KERNEL_APPOUT_CTX_QOS,
+  KERNEL_APPOUT_ROUTE,
+  KERNEL_APPOUT_CTX_NOTIFY,
+  KERNEL_APPOUT_OBJ_STEER,
+};
+
+/** Congestion control algorithms for conn_open and listen_open */
+enum kernel_appout_cc {
+  /** Algorithm configured for the slow path */
+  KERNEL_APPOUT_CC_DEFAULT = 0,
+  KERNEL_APPOUT_CC_DCTCP_WIN,
+  KERNEL_APPOUT_CC_DCTCP_RATE,
+  KERNEL_APPOUT_CC_TIMELY,
+  KERNEL_APPOUT_CC_CONST_RATE,
+  KERNEL_APPOUT_CC_BBR,
+  KERNEL_APPOUT_CC_SWIFT,
+  KERNEL_APPOUT_CC_NUM,
 };
 
 #define KERNEL_APPOUT_OPEN_OBJSOCK 0x1
@@ -79,6 +112,11 @@ struct kernel_appout_conn_open {
   uint32_t remote_ip;
   uint32_t flags;
   uint16_t remote_port;
+  /** Buffer size hints, 0 for the kernel default */
+  uint32_t rx_len;
+  uint32_t tx_len;
+  /** Congestion control algorithm, see #kernel_appout_cc */
+  uint8_t cc;
 } __attribute__((packed));
 
 #define KERNEL_APPOUT_CLOSE_RESET 0x1
@@ -111,6 +149,12 @@ struct kernel_appout_listen_open {
   uint32_t backlog;
   uint16_t local_port;
   uint8_t  flags;
+  /** Buffer size hints for accepted connections, 0 for the kernel default */
+  uint32_t rx_len;
+  uint32_t tx_len;
+  /** Congestion control algorithm for accepted connections, see
+   * #kernel_appout_cc */
+  uint8_t cc;
 } __attribute__((packed));
 
 /** Close listener */
@@ -131,6 +175,40 @@ struct kernel_appout_req_scale {
   uint32_t num_cores;
 } __attribute__((packed));
 
+/** Set transmit weight and rate cap for this context */
+struct kernel_appout_ctx_qos {
+  uint32_t rate;
+  uint16_t weight;
+} __attribute__((packed));
+
+/** Set notification moderation for this context */
+struct kernel_appout_ctx_notify {
+  /** Max. delay of notifications [us], 0 to disable moderation */
+  uint32_t delay;
+  /** Notify once this many entries are pending, 0 for no limit */
+  uint16_t count;
+} __attribute__((packed));
+
+#define KERNEL_APPOUT_OBJ_STEER_OFF 0x1
+/** Steer objects with key hash in buckets first to last to a context */
+struct kernel_appout_obj_steer {
+  uint16_t first;
+  uint16_t last;
+  uint16_t db_id;
+  uint8_t flags;
+} __attribute__((packed));
+
+#define KERNEL_APPOUT_ROUTE_DEL 0x1
+/** Add or remove route */
+struct kernel_appout_route {
+  uint32_t ip;
+  uint32_t next_hop_ip;
+  /** Egress port index, -1 if not fixed */
+  int16_t port;
+  uint8_t prefix;
+  uint8_t flags;
+} __attribute__((packed));
+
 /** Common struct for events on kernel -> app queue */
 struct kernel_appout {
   union {
@@ -143,6 +221,10 @@ struct kernel_appout {
     struct kernel_appout_accept_conn  accept_conn;
 
     struct kernel_appout_req_scale    req_scale;
+    struct kernel_appout_ctx_qos      ctx_qos;
+    struct kernel_appout_route        route;
+    struct kernel_appout_ctx_notify   ctx_notify;
+    struct kernel_appout_obj_steer    obj_steer;
 
     uint8_t raw[63];
   } __attribute__((packed)) data;
@@ -211,6 +293,8 @@ struct kernel_appin_accept_conn {
   uint32_t remote_ip;
   uint16_t remote_port;
   uint16_t fn_core;
+  /** Fast open payload at the start of the rx buffer, before seq_rx */
+  uint16_t syn_len;
 } __attribute__((packed));
 
 /** Common struct for events on app -> kernel queue */
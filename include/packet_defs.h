@@ -169,7 +169,10 @@ struct tcp_hdr {
 #define TCP_OPT_END_OF_OPTIONS 0
 #define TCP_OPT_NO_OP 1
 #define TCP_OPT_MSS 2
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK 5
 #define TCP_OPT_TIMESTAMP 8
+#define TCP_OPT_FASTOPEN 34
 struct tcp_mss_opt {
   uint8_t kind;
   uint8_t length;
@@ -184,6 +187,32 @@ struct tcp_timestamp_opt {
   beui32_t ts_ecr;
 } __attribute__((packed));
 
+struct tcp_sack_perm_opt {
+  uint8_t kind;
+  uint8_t length;
+} __attribute__((packed));
+
+/** TCP fast open cookie length used by TAS (one 64-bit hash) */
+#define TCP_FASTOPEN_COOKIE_LEN 8
+
+/** TCP fast open option, no cookie for a cookie request */
+struct tcp_fastopen_opt {
+  uint8_t kind;
+  uint8_t length;
+  uint8_t cookie[];
+} __attribute__((packed));
+
+struct tcp_sack_block {
+  beui32_t start;
+  beui32_t end;
+} __attribute__((packed));
+
+struct tcp_sack_opt {
+  uint8_t kind;
+  uint8_t length;
+  struct tcp_sack_block blocks[];
+} __attribute__((packed));
+
 
 /******************************************************************************/
 /* Object framing */
@@ -39,12 +39,19 @@
 #define FLEXNIC_NAME_DMA_MEM "tas_memory"
 /** Name for flexnic internal shared memory region. */
 #define FLEXNIC_NAME_INTERNAL_MEM "tas_internal"
+/** Name for fast path statistics shared memory region. */
+#define FLEXNIC_NAME_STATS "tas_stats"
 
+/** Offset of the rx summaries (one per doorbell) in the info region. */
+#define FLEXNIC_INFO_RXSUM_OFF 0x1000
 /** Size of the info shared memory region. */
-#define FLEXNIC_INFO_BYTES 0x1000
+#define FLEXNIC_INFO_BYTES \
+  (FLEXNIC_INFO_RXSUM_OFF + FLEXNIC_PL_APPCTX_NUM * 64)
 
 /** Indicates that flexnic is done initializing. */
 #define FLEXNIC_FLAG_READY 1
+/** Shared memory is kept on exit so a restarted instance can take it over. */
+#define FLEXNIC_FLAG_PERSIST 2
 
 /** Info struct: layout of info shared memory region */
 struct flexnic_info {
@@ -58,8 +65,32 @@ struct flexnic_info {
   uint32_t qmq_num;
   /** Number of cores in flexnic emulator */
   uint32_t cores_num;
+  /** Number of flow state entries in internal memory */
+  uint32_t flow_num;
+  /** Number of flow lookup table buckets (power of 2) */
+  uint32_t flowht_num;
+  /** Incremented when a restarted instance takes over the shared memory,
+   * applications then have to reattach their contexts. */
+  uint32_t restart_gen;
 } __attribute__((packed));
 
+/**
+ * Rx queue summary of an app context: a fast path core sets its bit after
+ * adding entries to the context's rx queue on that core, the application
+ * clears bits before draining the queues and only polls queues whose bit
+ * is set.
+ */
+struct flextcp_pl_rxsum {
+  volatile uint64_t cores;
+} __attribute__((aligned(64)));
+
+static inline struct flextcp_pl_rxsum *flexnic_info_rxsum(
+    struct flexnic_info *fi, uint16_t db)
+{
+  return (struct flextcp_pl_rxsum *)
+    ((uint8_t *) fi + FLEXNIC_INFO_RXSUM_OFF) + db;
+}
+
 
 
 /******************************************************************************/
@@ -67,6 +98,18 @@ struct flexnic_info {
 
 #define FLEXTCP_PL_KRX_INVALID 0x0
 #define FLEXTCP_PL_KRX_PACKET 0x1
+#define FLEXTCP_PL_KRX_CCACTIVE 0x2
+#define FLEXTCP_PL_KRX_CONNMOVED 0x3
+
+/** Max. number of flows in one FLEXTCP_PL_KRX_CCACTIVE entry */
+#define FLEXTCP_PL_KRX_CCACTIVE_MAX 13
+
+/**
+ * The fast path reports flows with ack or transmit activity to the slow path
+ * congestion control at most once per interval [us]. Flows without reports
+ * are not scheduled for the control loop.
+ */
+#define FLEXNIC_PL_CC_ACTIVE_INTERVAL 10000
 
 /** Kernel RX queue entry */
 struct flextcp_pl_krx {
@@ -76,7 +119,19 @@ struct flextcp_pl_krx {
       uint16_t len;
       uint16_t fn_core;
       uint16_t flow_group;
+      /** Port index packet was received on */
+      uint8_t port;
     } packet;
+    /* flows that became active */
+    struct {
+      uint32_t flow_ids[FLEXTCP_PL_KRX_CCACTIVE_MAX];
+      uint8_t num;
+    } __attribute__((packed)) ccactive;
+    /* flow moved to another app context by the fast path */
+    struct {
+      uint32_t flow_id;
+      uint16_t db_id;
+    } __attribute__((packed)) connmoved;
     uint8_t raw[55];
   } __attribute__((packed)) msg;
   volatile uint8_t type;
@@ -91,6 +146,8 @@ STATIC_ASSERT(sizeof(struct flextcp_pl_krx) == 64, krx_size);
 #define FLEXTCP_PL_KTX_INVALID 0x0
 #define FLEXTCP_PL_KTX_PACKET 0x1
 #define FLEXTCP_PL_KTX_CONNRETRAN 0x2
+#define FLEXTCP_PL_KTX_CONNDISABLE 0x3
+#define FLEXTCP_PL_KTX_CONNRESIZE 0x4
 
 /** Kernel TX queue entry */
 struct flextcp_pl_ktx {
@@ -98,10 +155,34 @@ struct flextcp_pl_ktx {
     struct {
       uint64_t addr;
       uint16_t len;
+      /** Port index to send packet on */
+      uint8_t port;
     } packet;
     struct {
       uint32_t flow_id;
     } connretran;
+    /* disable fast path processing of flow; the owning core fills in the
+     * sequence numbers and last peer timestamp before clearing type */
+    struct {
+      uint32_t flow_id;
+      uint32_t tx_seq;
+      uint32_t rx_seq;
+      uint32_t rx_ts;
+      uint8_t tx_closed;
+      uint8_t rx_closed;
+    } conndisable;
+    /* replace receive buffer of flow; the owning core only does this if the
+     * old buffer is drained, and sets status to 0 if it did. With tx_len set
+     * instead of rx_len, the app is offered a new transmit buffer, which it
+     * switches to itself once drained (FLEXTCP_PL_ATX_TXRESIZE). */
+    struct {
+      uint64_t rx_base;
+      uint32_t flow_id;
+      uint32_t rx_len;
+      uint8_t status;
+      uint64_t tx_base;
+      uint32_t tx_len;
+    } connresize;
     uint8_t raw[63];
   } __attribute__((packed)) msg;
   volatile uint8_t type;
@@ -116,6 +197,10 @@ STATIC_ASSERT(sizeof(struct flextcp_pl_ktx) == 64, ktx_size);
 #define FLEXTCP_PL_ARX_INVALID    0x0
 #define FLEXTCP_PL_ARX_CONNUPDATE 0x1
 #define FLEXTCP_PL_ARX_OBJUPDATE  0x2
+#define FLEXTCP_PL_ARX_CONNRESIZE 0x3
+#define FLEXTCP_PL_ARX_CONNMOVED  0x4
+#define FLEXTCP_PL_ARX_TXOFFER    0x5
+#define FLEXTCP_PL_ARX_TXRESIZED  0x6
 
 #define FLEXTCP_PL_ARX_FLRXDONE  0x1
 
@@ -126,12 +211,53 @@ struct flextcp_pl_arx_connupdate {
   uint32_t rx_pos;
   uint32_t tx_bump;
   uint8_t flags;
+  /** Cycle counter when the fast path wrote the entry. The app replaces it
+   * with the cycles until it consumed the entry before freeing it, the fast
+   * path picks that up when it reuses the entry. */
+  uint64_t tsc;
+} __attribute__((packed));
+
+/** Receive buffer of flow replaced, positions in new buffer start at 0 */
+struct flextcp_pl_arx_connresize {
+  uint64_t opaque;
+  /** Offset of new buffer in dma memory */
+  uint64_t rx_base;
+  uint32_t rx_len;
+} __attribute__((packed));
+
+/** Flow moved away from this context, last entry for the flow here */
+struct flextcp_pl_arx_connmoved {
+  uint64_t opaque;
+  /** 0 if moved, -1 if the destination context was rejected or the slow
+   * path queue was full */
+  int32_t status;
+} __attribute__((packed));
+
+/** Kernel offers a new transmit buffer, the app switches to it with
+ * FLEXTCP_PL_ATX_TXRESIZE once everything it sent was acknowledged */
+struct flextcp_pl_arx_txoffer {
+  uint64_t opaque;
+  /** Offset of new buffer in dma memory */
+  uint64_t tx_base;
+  uint32_t tx_len;
+} __attribute__((packed));
+
+/** Answer to FLEXTCP_PL_ATX_TXRESIZE, positions in the new buffer start at 0
+ * if it was switched to */
+struct flextcp_pl_arx_txresized {
+  uint64_t opaque;
+  /** 0 if switched, -1 if the flow still had data in the old buffer */
+  int32_t status;
 } __attribute__((packed));
 
 /** Application RX queue entry */
 struct flextcp_pl_arx {
   union {
     struct flextcp_pl_arx_connupdate connupdate;
+    struct flextcp_pl_arx_connresize connresize;
+    struct flextcp_pl_arx_connmoved connmoved;
+    struct flextcp_pl_arx_txoffer txoffer;
+    struct flextcp_pl_arx_txresized txresized;
     uint8_t raw[31];
   } __attribute__((packed)) msg;
   volatile uint8_t type;
@@ -143,6 +269,8 @@ STATIC_ASSERT(sizeof(struct flextcp_pl_arx) == 32, arx_size);
 /* App TX queue */
 
 #define FLEXTCP_PL_ATX_CONNUPDATE 0x1
+#define FLEXTCP_PL_ATX_CONNMOVE   0x2
+#define FLEXTCP_PL_ATX_TXRESIZE   0x3
 
 #define FLEXTCP_PL_ATX_FLTXDONE  0x1
 
@@ -156,6 +284,16 @@ struct flextcp_pl_atx {
       uint16_t bump_seq;
       uint8_t  flags;
     } __attribute__((packed)) connupdate;
+    struct {
+      uint32_t flow_id;
+      /** Doorbell of the context to move the flow to */
+      uint16_t db_id;
+    } __attribute__((packed)) connmove;
+    /* switch to the transmit buffer from a FLEXTCP_PL_ARX_TXOFFER, the fast
+     * path keeps the offer itself */
+    struct {
+      uint32_t flow_id;
+    } __attribute__((packed)) txresize;
     uint8_t raw[15];
   } __attribute__((packed)) msg;
   volatile uint8_t type;
@@ -166,13 +304,17 @@ STATIC_ASSERT(sizeof(struct flextcp_pl_atx) == 16, atx_size);
 /******************************************************************************/
 /* Internal flexnic memory */
 
+/* compile time maxima for the shared memory layout, the limits actually used
+ * come from flexnic_info->cores_num and flextcp_pl_mem.appctx_num */
 #define FLEXNIC_PL_APPST_NUM        8
-#define FLEXNIC_PL_APPST_CTX_NUM   31
-#define FLEXNIC_PL_APPST_CTX_MCS   16
-#define FLEXNIC_PL_APPCTX_NUM      16
-#define FLEXNIC_PL_FLOWST_NUM     (128 * 1024)
-#define FLEXNIC_PL_FLOWHT_ENTRIES (FLEXNIC_PL_FLOWST_NUM * 2)
-#define FLEXNIC_PL_FLOWHT_NBSZ      4
+#define FLEXNIC_PL_APPST_CTX_NUM  255
+#define FLEXNIC_PL_APPST_CTX_MCS   64
+#define FLEXNIC_PL_APPCTX_NUM     256
+/** Buckets in object steering tables, indexed by the top bits of key hash */
+#define FLEXNIC_PL_APPST_STEER_BITS   8
+#define FLEXNIC_PL_APPST_STEER_NUM (1 << FLEXNIC_PL_APPST_STEER_BITS)
+#define FLEXNIC_PL_FLOWST_NUM_DEFAULT (128 * 1024)
+#define FLEXNIC_PL_FLOWHT_NBSZ      8
 
 /** Application state */
 struct flextcp_pl_appst {
@@ -184,6 +326,11 @@ struct flextcp_pl_appst {
 
   /** IDs of contexts */
   uint16_t ctx_ids[FLEXNIC_PL_APPST_CTX_NUM];
+
+  /** Object steering table in use instead of hash modulo contexts */
+  uint16_t steer_en;
+  /** Doorbell IDs of contexts for key hash buckets */
+  uint16_t steer_db[FLEXNIC_PL_APPST_STEER_NUM];
 } __attribute__((packed));
 
 
@@ -197,6 +344,14 @@ struct flextcp_pl_appctx {
   uint32_t tx_len;
   uint32_t appst_id;
   int	   evfd;
+  /** Transmit rate cap for all flows of the context [kbps], 0 = none */
+  uint32_t qos_rate;
+  /** Share of transmit capacity for unlimited flows relative to others */
+  uint16_t qos_weight;
+  /** Max. delay of moderated notifications [us], 0 = no moderation */
+  uint32_t notify_delay;
+  /** Notify as soon as this many rx entries are pending, 0 = delay only */
+  uint16_t notify_count;
 
   /********************************************************/
   /* read-write fields */
@@ -204,10 +359,18 @@ struct flextcp_pl_appctx {
   uint32_t tx_head;
   uint32_t last_ts;
   uint32_t rx_avail;
+  /** Time the first moderated, not yet notified entry arrived */
+  uint32_t notify_ts;
+  /** Entries pending notification, 0 if none */
+  uint16_t notify_pending;
 } __attribute__((packed));
 
 /** Enable out of order receive processing members */
 #define FLEXNIC_PL_OOO_RECV 1
+/** Max. number of out of order intervals buffered per flow */
+#define FLEXNIC_PL_OOO_NUM 4
+/** Max. number of selectively acknowledged intervals tracked per flow */
+#define FLEXNIC_PL_SACK_NUM 4
 
 #define FLEXNIC_PL_FLOWST_SLOWPATH 1
 #define FLEXNIC_PL_FLOWST_OBJCONN 2
@@ -217,7 +380,26 @@ struct flextcp_pl_appctx {
 #define FLEXNIC_PL_FLOWST_RXFIN 32
 #define FLEXNIC_PL_FLOWST_RX_MASK (~63ULL)
 
-/** Flow state registers */
+/** flowst steer_core value for flows not steered by a flow rule */
+#define FLEXNIC_PL_FLOWST_NOSTEER 0xffff
+
+/** flowst tcp_opts: peer accepted selective acknowledgements */
+#define FLEXNIC_PL_FLOWST_OPT_SACK 1
+
+/** Interval of sequence numbers, kept in lists sorted by start */
+struct flextcp_pl_seqint {
+  uint32_t start;
+  uint32_t len;
+} __attribute__((packed));
+
+/**
+ * Flow state registers. Fields are grouped into cache lines by who writes
+ * them: set up once by the slow path, written on receive and written on
+ * transmit. Counters for the slow path live in flextcp_pl_flowst_stats.
+ *
+ * Only the fast path core owning the flow group (flow_group_steering) may
+ * modify a flow, other cores and the slow path forward requests to it.
+ */
 struct flextcp_pl_flowst {
   /********************************************************/
   /* read-only fields */
@@ -249,20 +431,23 @@ struct flextcp_pl_flowst {
 
   /** Flow group for this connection (rss bucket) */
   uint16_t flow_group;
-  /** Sequence number of queue pointer bumps */
-  uint16_t bump_seq;
 
-  // 56
+  /** Port index to transmit on */
+  uint8_t port;
 
-  /********************************************************/
-  /* read-write fields */
+  /** Core the flow is steered to by an exact match NIC rule, or
+   * FLEXNIC_PL_FLOWST_NOSTEER if it follows its flow group. Only changed by
+   * the owning core once the flow is in the hash table. */
+  uint16_t steer_core;
 
-  /** spin lock */
-  volatile uint32_t lock;
+  /** TCP options negotiated in the handshake (FLEXNIC_PL_FLOWST_OPT_*) */
+  uint8_t tcp_opts;
+
+  /********************************************************/
+  /* receive fields */
 
   /** Bytes available for received segments at next position */
-  uint32_t rx_avail;
-  // 64
+  uint32_t rx_avail __attribute__((aligned(64)));
   /** Offset in buffer to place next segment */
   uint32_t rx_next_pos;
   /** Next sequence number expected */
@@ -273,26 +458,49 @@ struct flextcp_pl_flowst {
   uint32_t rx_dupack_cnt;
 
 #ifdef FLEXNIC_PL_OOO_RECV
-  /* Start of interval of out-of-order received data */
-  uint32_t rx_ooo_start;
-  /* Length of interval of out-of-order received data */
-  uint32_t rx_ooo_len;
+  /** Intervals of out-of-order received data, sorted by sequence number */
+  struct flextcp_pl_seqint rx_ooo[FLEXNIC_PL_OOO_NUM];
+  /** Number of valid entries in rx_ooo */
+  uint8_t rx_ooo_num;
 #endif
 
+  /** Bytes left in current object */
+  uint32_t rx_objrem;
+  /** Timestamp to echo in next packet */
+  uint32_t tx_next_ts;
+  /** Sequence number of queue pointer bumps */
+  uint16_t bump_seq;
+  /** In-order segments received but not acknowledged yet (delayed ack) */
+  uint8_t rx_ack_pending;
+
+  /********************************************************/
+  /* transmit fields */
+
   /** Number of bytes up to next pos in the buffer that were sent but not
    * acknowledged yet. */
-  uint32_t tx_sent;
+  uint32_t tx_sent __attribute__((aligned(64)));
   /** Offset in buffer for next segment to be sent */
   uint32_t tx_next_pos;
   /** Sequence number of next segment to be sent */
   uint32_t tx_next_seq;
   /** End of data that is ready to be sent */
   uint32_t tx_head;
-  /** Timestamp to echo in next packet */
-  uint32_t tx_next_ts;
-
+  /** Bytes left in current object */
+  uint32_t tx_objrem;
   /** Congestion control rate [kbps] */
   uint32_t tx_rate;
+  /** Sent intervals the peer selectively acknowledged beyond the cumulative
+   * ack, sorted by sequence number */
+  struct flextcp_pl_seqint tx_sack[FLEXNIC_PL_SACK_NUM];
+  /** Number of valid entries in tx_sack */
+  uint8_t tx_sack_num;
+  /** Sequence number sent when loss recovery started, further duplicate acks
+   * do not restart recovery until this is acknowledged */
+  uint32_t tx_recover;
+} __attribute__((packed, aligned(64)));
+
+/** Per-flow counters read by the slow path congestion control */
+struct flextcp_pl_flowst_stats {
   /** Counter drops */
   uint16_t cnt_tx_drops;
   /** Counter acks */
@@ -303,39 +511,85 @@ struct flextcp_pl_flowst {
   uint32_t cnt_rx_ecn_bytes;
   /** RTT estimate */
   uint32_t rtt_est;
-
-
-// 128
-  /** Bytes left in current object */
-  uint32_t tx_objrem;
-  /** Bytes left in current object */
-  uint32_t rx_objrem;
-
+  /** Time activity was last reported to the slow path */
+  uint32_t cc_active_ts;
+  /** Counter retransmission timeouts handled in the fast path */
+  uint16_t cnt_tx_rtos;
+  /** Consecutive retransmission timeouts without progress */
+  uint8_t rto_backoff;
+  /** Transmit buffer offered to the app (FLEXTCP_PL_ARX_TXOFFER), 0 if none */
+  uint64_t tx_offer_base;
+  /** Length of offered transmit buffer */
+  uint32_t tx_offer_len;
 } __attribute__((packed, aligned(64)));
 
-#define FLEXNIC_PL_FLOWHTE_VALID  (1 << 31)
-#define FLEXNIC_PL_FLOWHTE_POSSHIFT 29
+#define FLEXNIC_PL_FLOWHTE_VALID  (1U << 31)
+#define FLEXNIC_PL_FLOWHTE_IDMASK (FLEXNIC_PL_FLOWHTE_VALID - 1)
 
-/** Flow lookup table entry */
-struct flextcp_pl_flowhte {
-  uint32_t flow_id;
-  uint32_t flow_hash;
-} __attribute__((packed));
+/**
+ * Flow lookup table bucket. The table is a bucketized cuckoo hash table, each
+ * flow lives in one of two candidate buckets (see FLEXNIC_PL_FLOWHT_B1/B2).
+ * Hashes are kept together so a lookup can compare all of them at once.
+ */
+struct flextcp_pl_flowhtb {
+  /** Flow hashes (only meaningful if entry is valid) */
+  uint32_t flow_hash[FLEXNIC_PL_FLOWHT_NBSZ];
+  /** Flow ids, FLEXNIC_PL_FLOWHTE_VALID is set for used entries */
+  uint32_t flow_id[FLEXNIC_PL_FLOWHT_NBSZ];
+} __attribute__((packed, aligned(64)));
 
+/** Primary bucket for hash `h` in a table with `n` (power of 2) buckets */
+#define FLEXNIC_PL_FLOWHT_B1(h, n) ((h) & ((n) - 1))
+/** Secondary bucket for hash `h` in a table with `n` (power of 2) buckets */
+#define FLEXNIC_PL_FLOWHT_B2(h, n) \
+    (((h) ^ (((h) >> 16) * 0x5bd1e995U + 1)) & ((n) - 1))
 
 #define FLEXNIC_PL_MAX_FLOWGROUPS 4096
+/** Max. number of NIC ports */
+#define FLEXNIC_PL_NET_PORTS 4
+
+/** Fast path core idle states */
+#define FLEXNIC_PL_CORE_BUSY 0
+#define FLEXNIC_PL_CORE_SPIN 1
+#define FLEXNIC_PL_CORE_PAUSE 2
+#define FLEXNIC_PL_CORE_SLEEP 3
+
+/** Fast path core state, only written by the core itself */
+struct flextcp_pl_corest {
+  /** Current idle state: see FLEXNIC_PL_CORE_* */
+  volatile uint8_t idle_state;
+  /** Number of times the core went to sleep */
+  uint64_t idle_sleeps;
+  /** Total time spent sleeping [us] */
+  uint64_t idle_sleep_us;
+} __attribute__((packed, aligned(64)));
+
+#define FLEXNIC_PL_SCALE_NONE 0
+#define FLEXNIC_PL_SCALE_LOAD 1
+#define FLEXNIC_PL_SCALE_QUEUES 2
+
+/** Autoscaling state and decisions, written by the slow path */
+struct flextcp_pl_scalest {
+  /** Smoothed and predicted fast path load [1/1000 cores] */
+  uint32_t load;
+  uint32_t load_pred;
+  /** Max. nic rx ring and app rx queue fill on active cores [1/1000] */
+  uint16_t rxq_fill;
+  uint16_t arxq_fill;
+  /** Number of scale up and down decisions */
+  uint64_t ups;
+  uint64_t downs;
+  /** Time of last decision [us], cores after it, see FLEXNIC_PL_SCALE_* */
+  uint32_t last_ts;
+  uint16_t last_cores;
+  uint8_t last_reason;
+} __attribute__((packed));
 
 /** Layout of internal pipeline memory */
 struct flextcp_pl_mem {
   /* registers for application context queues */
   struct flextcp_pl_appctx appctx[FLEXNIC_PL_APPST_CTX_MCS][FLEXNIC_PL_APPCTX_NUM];
 
-  /* registers for flow state */
-  struct flextcp_pl_flowst flowst[FLEXNIC_PL_FLOWST_NUM];
-
-  /* flow lookup table */
-  struct flextcp_pl_flowhte flowht[FLEXNIC_PL_FLOWHT_ENTRIES];
-
   /* registers for kernel queues */
   struct flextcp_pl_appctx kctx[FLEXNIC_PL_APPST_CTX_MCS];
 
@@ -343,8 +597,261 @@ struct flextcp_pl_mem {
   struct flextcp_pl_appst appst[FLEXNIC_PL_APPST_NUM];
 
   uint8_t flow_group_steering[FLEXNIC_PL_MAX_FLOWGROUPS];
+
+  /* fast path core states */
+  struct flextcp_pl_corest corest[FLEXNIC_PL_APPST_CTX_MCS];
+
+  /* autoscaling decisions */
+  struct flextcp_pl_scalest scalest;
+
+  /* highest doorbell id in use + 1, fast path only polls contexts below */
+  volatile uint16_t appctx_num;
+
+  /* incremented before and after entries are moved between buckets in the
+   * flow lookup table, lookups that miss retry if it changed */
+  volatile uint32_t flowht_version;
+
+  /* registers for flow state (flow_num entries in flexnic_info), followed by
+   * the flow counters (flow_num entries) and the flow lookup table
+   * (flowht_num buckets) */
+  struct flextcp_pl_flowst flowst[] __attribute__((aligned(64)));
 } __attribute__((packed));
 
+/** Size of internal memory with `fn` flow states and `hn` table buckets */
+#define FLEXNIC_PL_MEM_SIZE(fn, hn) (sizeof(struct flextcp_pl_mem) + \
+    (size_t) (fn) * sizeof(struct flextcp_pl_flowst) + \
+    (size_t) (fn) * sizeof(struct flextcp_pl_flowst_stats) + \
+    (size_t) (hn) * sizeof(struct flextcp_pl_flowhtb))
+
+/** Flow counters in internal memory `m` with `fn` flow states */
+#define FLEXNIC_PL_FLOWST_STATS(m, fn) \
+    ((struct flextcp_pl_flowst_stats *) ((m)->flowst + (fn)))
+
+/** Flow lookup table in internal memory `m` with `fn` flow states */
+#define FLEXNIC_PL_FLOWHT(m, fn) \
+    ((struct flextcp_pl_flowhtb *) (FLEXNIC_PL_FLOWST_STATS(m, fn) + (fn)))
+
+
+/******************************************************************************/
+/* Fast path statistics */
+
+/** Layout version of the statistics region, bumped on incompatible changes */
+#define FLEXNIC_STATS_VERSION 6
+
+/* Fast path drop reasons, index into flexnic_stats_core.drops */
+/** Segment outside of receive window */
+#define FLEXNIC_STATS_DROP_RXSEQ 0
+/** Out of order segment without a free interval */
+#define FLEXNIC_STATS_DROP_RXOOO 1
+/** Payload after FIN */
+#define FLEXNIC_STATS_DROP_RXFIN 2
+/** Slow path rx queue full */
+#define FLEXNIC_STATS_DROP_KRXFULL 3
+/** Slow path rx queue not set up yet */
+#define FLEXNIC_STATS_DROP_KRXNONE 4
+/** Forwarding to owning core failed */
+#define FLEXNIC_STATS_DROP_FWD 5
+/** Transmit buffer and retry ring full */
+#define FLEXNIC_STATS_DROP_TXFULL 6
+/** NIC reported a bad IP or TCP checksum */
+#define FLEXNIC_STATS_DROP_RXCSUM 7
+#define FLEXNIC_STATS_DROP_NUM 8
+
+/** Dataplane loop stages, in polling order (see enum dataplane_stage_id) */
+#define FLEXNIC_STATS_STAGE_NUM 5
+
+/**
+ * Counters of one fast path core. Only written by that core, with plain
+ * stores, and never reset: readers take differences between samples. On its
+ * own cache line so readers don't disturb other cores.
+ */
+struct flexnic_stats_core {
+  /** Packets and bytes received from the NIC */
+  uint64_t rx_pkts;
+  uint64_t rx_bytes;
+  /** Packets and bytes queued for transmission to the NIC */
+  uint64_t tx_pkts;
+  uint64_t tx_bytes;
+  /** Packets handed to the slow path */
+  uint64_t punts;
+  /** Dropped packets, by reason: see FLEXNIC_STATS_DROP_* */
+  uint64_t drops[FLEXNIC_STATS_DROP_NUM];
+  /** Flushes that left entries behind because an app rx queue was full */
+  uint64_t arx_full;
+  /** Queues served by the queue manager */
+  uint64_t qm_served;
+  /** Gauge: rate limited queues waiting in the queue manager timer wheel */
+  uint32_t qm_waiting;
+  /** Loop iterations, and those where no stage found work */
+  uint64_t loops;
+  uint64_t loops_idle;
+  /** Cycles spent in busy loop iterations, and in each stage */
+  uint64_t cyc_busy;
+  uint64_t cyc_stage[FLEXNIC_STATS_STAGE_NUM];
+  /** Times the NIC did not take all packets sent, and cycles until it took
+   * everything again */
+  uint64_t tx_stalls;
+  uint64_t cyc_tx_stall;
+} __attribute__((aligned(64)));
+
+/** Max. number of congestion control algorithms with counters */
+#define FLEXNIC_STATS_CC_NUM 8
+
+/** Slow path congestion control counters of one algorithm */
+struct flexnic_stats_cc {
+  /** Gauge: connections using the algorithm */
+  uint64_t conns;
+  /** Control loop iterations */
+  uint64_t updates;
+  /** Drops detected by the fast path */
+  uint64_t drops;
+  /** ECN marked and total acknowledged bytes */
+  uint64_t ecn_bytes;
+  uint64_t ack_bytes;
+  /** Retransmission timeouts handled in the fast path */
+  uint64_t fast_rto;
+};
+
+/* Latency histograms, index into flexnic_stats.hists */
+/** NIC rx to app rx queue write [cycles] */
+#define FLEXNIC_STATS_HIST_RXARX 0
+/** App rx queue write to the app consuming the entry [cycles] */
+#define FLEXNIC_STATS_HIST_ARXAPP 1
+/** App tx bump on an idle flow to its first segment sent [cycles] */
+#define FLEXNIC_STATS_HIST_ATXTX 2
+/** Round trip time samples from the timestamp option [us] */
+#define FLEXNIC_STATS_HIST_RTT 3
+#define FLEXNIC_STATS_HIST_NUM 4
+
+/** Linear sub-buckets per power of two */
+#define FLEXNIC_STATS_HIST_SUB_BITS 3
+/** Buckets per histogram, covers values up to 2^34 */
+#define FLEXNIC_STATS_HIST_BUCKETS 256
+
+/**
+ * Log-linear histogram: values below 2^SUB_BITS have their own bucket, each
+ * power of two above is split in 2^SUB_BITS equally sized buckets, so
+ * buckets are at most 12.5% wide. Larger values go in the last bucket.
+ */
+struct flexnic_stats_hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t buckets[FLEXNIC_STATS_HIST_BUCKETS];
+};
+
+/** Histogram bucket for value v */
+static inline unsigned flexnic_stats_hist_bucket(uint64_t v)
+{
+  unsigned e, b;
+
+  if (v < (1 << FLEXNIC_STATS_HIST_SUB_BITS))
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  b = ((e - FLEXNIC_STATS_HIST_SUB_BITS + 1) << FLEXNIC_STATS_HIST_SUB_BITS) |
+    ((v >> (e - FLEXNIC_STATS_HIST_SUB_BITS)) &
+     ((1 << FLEXNIC_STATS_HIST_SUB_BITS) - 1));
+  return (b < FLEXNIC_STATS_HIST_BUCKETS ? b : FLEXNIC_STATS_HIST_BUCKETS - 1);
+}
+
+/** Smallest value in histogram bucket b */
+static inline uint64_t flexnic_stats_hist_low(unsigned b)
+{
+  unsigned e;
+
+  if (b < (1 << FLEXNIC_STATS_HIST_SUB_BITS))
+    return b;
+
+  e = (b >> FLEXNIC_STATS_HIST_SUB_BITS) + FLEXNIC_STATS_HIST_SUB_BITS - 1;
+  return (1ULL << e) | ((uint64_t) (b & ((1 << FLEXNIC_STATS_HIST_SUB_BITS) -
+          1)) << (e - FLEXNIC_STATS_HIST_SUB_BITS));
+}
+
+/* Slow path loop stages, index into flexnic_stats_kernel.cyc_stage */
+/** nicif_poll: slow path rx queues and fast path admin completions */
+#define FLEXNIC_STATS_KSTAGE_NIC 0
+/** cc_poll: congestion control loop */
+#define FLEXNIC_STATS_KSTAGE_CC 1
+/** appif_poll: application requests */
+#define FLEXNIC_STATS_KSTAGE_APP 2
+/** arp_poll: queued ARP requests */
+#define FLEXNIC_STATS_KSTAGE_ARP 3
+/** tcp_poll: deferred flow registrations, closes and completions */
+#define FLEXNIC_STATS_KSTAGE_TCP 4
+/** Expired timeouts */
+#define FLEXNIC_STATS_KSTAGE_TIMEOUT 5
+#define FLEXNIC_STATS_KSTAGE_NUM 6
+
+/* Handshake phase histograms, index into flexnic_stats_kernel.hists, all in
+ * cycles. Only successful phases are recorded. */
+/** Connection struct and buffer allocation (packetmem_alloc) */
+#define FLEXNIC_STATS_KHIST_ALLOC 0
+/** routing_resolve call: route lookup and ARP cache lookup */
+#define FLEXNIC_STATS_KHIST_ROUTE 1
+/** Waiting for an ARP reply when the cache missed */
+#define FLEXNIC_STATS_KHIST_ARP 2
+/** Registering the flow with the fast path (nicif_connection_add),
+ * including the wait for the next batch on accepted connections */
+#define FLEXNIC_STATS_KHIST_NICADD 3
+/** Notifying the application (appif_conn_opened/appif_accept_conn) */
+#define FLEXNIC_STATS_KHIST_NOTIFY 4
+/** Whole active open, tcp_open to the application notification */
+#define FLEXNIC_STATS_KHIST_OPEN 5
+/** Whole passive open, SYN (or cookie ACK) received to the notification */
+#define FLEXNIC_STATS_KHIST_ACCEPT 6
+#define FLEXNIC_STATS_KHIST_NUM 7
+
+/** Slow path counters, never reset */
+struct flexnic_stats_kernel {
+  /** drops detected by flextcp on NIC */
+  uint64_t drops;
+  /** kernel re-transmission timeouts */
+  uint64_t kernel_rexmit;
+  /** re-transmission timeouts handled in the fast path */
+  uint64_t fast_rto;
+  /** # of ECN marked ACKs */
+  uint64_t ecn_marked;
+  /** total number of ACKs */
+  uint64_t acks;
+  /** SYN-ACKs sent with a SYN cookie */
+  uint64_t syncookies_sent;
+  /** ACKs with a valid SYN cookie */
+  uint64_t syncookies_ok;
+  /** ACKs to listeners with an invalid SYN cookie */
+  uint64_t syncookies_failed;
+  /** rx buffers replaced by autotuning */
+  uint64_t rxbuf_resizes;
+  /** tx buffers replaced by autotuning */
+  uint64_t txbuf_resizes;
+  /** per algorithm, indexed by config_cc_algorithm */
+  struct flexnic_stats_cc cc[FLEXNIC_STATS_CC_NUM];
+  /** Loop iterations, and those where no stage found work */
+  uint64_t loops;
+  uint64_t loops_idle;
+  /** Cycles spent in busy loop iterations, and in each stage */
+  uint64_t cyc_busy;
+  uint64_t cyc_stage[FLEXNIC_STATS_KSTAGE_NUM];
+  /** Handshake phase histograms, see FLEXNIC_STATS_KHIST_* */
+  struct flexnic_stats_hist hists[FLEXNIC_STATS_KHIST_NUM];
+} __attribute__((aligned(64)));
+
+/** Layout of the statistics region */
+struct flexnic_stats {
+  /** FLEXNIC_STATS_VERSION */
+  uint32_t version;
+  /** Number of cores with counters below */
+  uint32_t cores_num;
+  /** Frequency of the cycle counters [Hz] */
+  uint64_t tsc_hz;
+  /** Slow path counters */
+  struct flexnic_stats_kernel kernel;
+  /** Per core counters */
+  struct flexnic_stats_core cores[FLEXNIC_PL_APPST_CTX_MCS];
+  /** Latency histograms per core and application, written by that core */
+  struct flexnic_stats_hist hists[FLEXNIC_PL_APPST_CTX_MCS]
+    [FLEXNIC_PL_APPST_NUM][FLEXNIC_STATS_HIST_NUM];
+} __attribute__((aligned(64)));
+
 
 void util_flexnic_kick(struct flextcp_pl_appctx *ctx, uint32_t ts_us);
 
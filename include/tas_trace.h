@@ -230,7 +230,157 @@ struct flextcp_pl_trev_aparseobj {
   uint32_t flow_id;
 } __attribute__((packed));
 
+/******************************************************************************/
+/* Lightweight tracing: fixed size records with TSC timestamps, always
+ * compiled in and switched at runtime (see tracetool -e) */
+
+#define FLEXNIC_LTRACE_NAME "tas_ltrace"
+#define FLEXNIC_LTRACE_VERSION 1
+/** Records per core (power of 2) */
+#define FLEXNIC_LTRACE_RECS (64 * 1024)
+/** Flow id for events not tied to a flow, these are never sampled out */
+#define FLEXNIC_LTRACE_NOFLOW UINT32_MAX
+
+/* Event types, enabled by bit (1 << type) in flexnic_ltrace.mask */
+/** Segment received: a=seq b=ack c=len | tcp flags << 16 d=rx_avail */
+#define FLEXNIC_LTRACE_EV_RXSEG 0
+/** Segment sent: a=seq b=ack c=len | tcp flags << 16 d=rx window */
+#define FLEXNIC_LTRACE_EV_TXSEG 1
+/** Pure ack sent: a=seq b=ack c=rx window d=sack seq */
+#define FLEXNIC_LTRACE_EV_TXACK 2
+/** App queue bump: a=rx tail b=tx head c=bump seq | flags << 16 */
+#define FLEXNIC_LTRACE_EV_BUMP 3
+/** App rx notification: a=rx bump b=tx bump c=doorbell */
+#define FLEXNIC_LTRACE_EV_ARX 4
+/** Retransmission timeout: a=tx_next_seq b=tx_sent c=backoff */
+#define FLEXNIC_LTRACE_EV_RTO 5
+/** Packet handed to slow path: a=len */
+#define FLEXNIC_LTRACE_EV_PUNT 6
+#define FLEXNIC_LTRACE_EV_NUM 7
+
+struct flexnic_ltrace_rec {
+  uint64_t tsc;
+  uint32_t flow_id;
+  uint16_t type;
+  uint16_t pad;
+  uint32_t a;
+  uint32_t b;
+  uint32_t c;
+  uint32_t d;
+} __attribute__((packed));
 
+/** Write position of one core, only written by that core */
+struct flexnic_ltrace_core {
+  /** Records written so far, record i is at i % FLEXNIC_LTRACE_RECS */
+  volatile uint64_t head;
+} __attribute__((aligned(64)));
 
+/**
+ * Header of the trace region, followed by cores_num flexnic_ltrace_core and
+ * then FLEXNIC_LTRACE_RECS records for each core. The fast path only reads
+ * mask and sample, tools set them.
+ */
+struct flexnic_ltrace {
+  uint32_t version;
+  uint32_t cores_num;
+  /** Frequency of the timestamp counter [Hz] */
+  uint64_t tsc_hz;
+  /** Enabled event types, see FLEXNIC_LTRACE_EV_* */
+  volatile uint32_t mask;
+  /** Only flows with flow_id % sample == 0 are traced, 0 or 1 for all */
+  volatile uint32_t sample;
+} __attribute__((aligned(64)));
+
+/** Size of the trace region with `n` cores */
+#define FLEXNIC_LTRACE_BYTES(n) (sizeof(struct flexnic_ltrace) + \
+    (size_t) (n) * sizeof(struct flexnic_ltrace_core) + \
+    (size_t) (n) * FLEXNIC_LTRACE_RECS * sizeof(struct flexnic_ltrace_rec))
+
+/** Write position of core `c` in trace region `t` */
+#define FLEXNIC_LTRACE_CORE(t, c) \
+    ((struct flexnic_ltrace_core *) ((t) + 1) + (c))
+
+/** Records of core `c` in trace region `t` */
+#define FLEXNIC_LTRACE_RING(t, c) \
+    ((struct flexnic_ltrace_rec *) FLEXNIC_LTRACE_CORE(t, (t)->cores_num) + \
+     (size_t) (c) * FLEXNIC_LTRACE_RECS)
+
+/******************************************************************************/
+/* Packet capture: truncated packets as received from and handed to the NIC
+ * with TSC timestamps, always compiled in, enabled and filtered at runtime
+ * (see tascap) */
+
+#define FLEXNIC_PCAP_NAME "tas_pcap"
+#define FLEXNIC_PCAP_VERSION 1
+/** Records per core (power of 2) */
+#define FLEXNIC_PCAP_RECS (16 * 1024)
+/** Max. bytes captured per packet */
+#define FLEXNIC_PCAP_SNAPLEN 128
+/** Flow group filter value matching all packets */
+#define FLEXNIC_PCAP_FG_ANY UINT16_MAX
+
+/* Directions, enabled by bit in flexnic_pcap.enable */
+/** Packets received from the NIC, in poll_rx */
+#define FLEXNIC_PCAP_RX 1
+/** Packets handed to the NIC, in tx_flush */
+#define FLEXNIC_PCAP_TX 2
+
+struct flexnic_pcap_rec {
+  uint64_t tsc;
+  /** Original packet length */
+  uint16_t len;
+  /** Bytes captured in data */
+  uint16_t caplen;
+  /** FLEXNIC_PCAP_RX or FLEXNIC_PCAP_TX */
+  uint8_t dir;
+  /** Port (index) */
+  uint8_t port;
+  uint16_t pad;
+  uint8_t data[FLEXNIC_PCAP_SNAPLEN];
+} __attribute__((packed));
+
+/** Write position of one core, only written by that core */
+struct flexnic_pcap_core {
+  /** Records written so far, record i is at i % FLEXNIC_PCAP_RECS */
+  volatile uint64_t head;
+} __attribute__((aligned(64)));
+
+/**
+ * Header of the capture region, followed by cores_num flexnic_pcap_core and
+ * then FLEXNIC_PCAP_RECS records for each core. The fast path only reads the
+ * enable mask and filter, tools set them. Packets match the filter if they
+ * are sent between endpoints (ip[0], port[0]) and (ip[1], port[1]) in either
+ * direction, with 0 matching any address or port, and if they belong to flow
+ * group fg. Received packets have the flow group the NIC assigned, sent ones
+ * that of their flow; sent packets without flow state only match
+ * FLEXNIC_PCAP_FG_ANY. Addresses and ports are in host byte order.
+ */
+struct flexnic_pcap {
+  uint32_t version;
+  uint32_t cores_num;
+  /** Frequency of the timestamp counter [Hz] */
+  uint64_t tsc_hz;
+  /** Enabled directions, FLEXNIC_PCAP_RX | FLEXNIC_PCAP_TX */
+  volatile uint32_t enable;
+  /** Bytes captured per packet, at most FLEXNIC_PCAP_SNAPLEN */
+  volatile uint32_t snaplen;
+  volatile uint32_t ip[2];
+  volatile uint16_t port[2];
+  volatile uint16_t fg;
+} __attribute__((aligned(64)));
+
+/** Size of the capture region with `n` cores */
+#define FLEXNIC_PCAP_BYTES(n) (sizeof(struct flexnic_pcap) + \
+    (size_t) (n) * sizeof(struct flexnic_pcap_core) + \
+    (size_t) (n) * FLEXNIC_PCAP_RECS * sizeof(struct flexnic_pcap_rec))
+
+/** Write position of core `c` in capture region `t` */
+#define FLEXNIC_PCAP_CORE(t, c) \
+    ((struct flexnic_pcap_core *) ((t) + 1) + (c))
+
+/** Records of core `c` in capture region `t` */
+#define FLEXNIC_PCAP_RING(t, c) \
+    ((struct flexnic_pcap_rec *) FLEXNIC_PCAP_CORE(t, (t)->cores_num) + \
+     (size_t) (c) * FLEXNIC_PCAP_RECS)
 
 #endif
@@ -33,6 +33,13 @@
  * @ingroup utils
  * @{ */
 
+/** Timer wheel: slots per level [log2] */
+#define UTIL_TIMEOUT_WHEEL_SHIFT 7
+/** Timer wheel: slots per level */
+#define UTIL_TIMEOUT_WHEEL_SLOTS (1 << UTIL_TIMEOUT_WHEEL_SHIFT)
+/** Timer wheel: number of levels, together covering all timestamp bits */
+#define UTIL_TIMEOUT_WHEEL_LEVELS 4
+
 /** Object for an individual timeout. (opaque) */
 struct timeout {
   /**
@@ -41,6 +48,8 @@ struct timeout {
    * significant bits.
    */
   uint32_t timeout_type;
+  /** Wheel slot (level * #UTIL_TIMEOUT_WHEEL_SLOTS + slot) last inserted in */
+  uint16_t slot;
 
   /** Next pointer for internal list */
   struct timeout *next;
@@ -48,16 +57,31 @@ struct timeout {
   struct timeout *prev;
 };
 
+/** List of timeouts in one timer wheel slot (opaque) */
+struct timeout_slot {
+  struct timeout *first;
+  struct timeout *last;
+};
 
-/** Timeout manager state (opaque) */
+/**
+ * Timeout manager state (opaque).
+ *
+ * Pending timeouts are kept in a hierarchical timer wheel with microsecond
+ * granularity on level 0. Each level covers one full turn of the level below,
+ * timeouts move down a level once the wheel reaches their slot.
+ */
 struct timeout_manager {
-  /** Head of linked list of all pending timeouts */
-  struct timeout *timeouts_first;
-  /** Tail of linked list of all pending timeouts */
-  struct timeout *timeouts_last;
-  /** Head of list of due pending timeouts, no longer in #timeouts */
+  /** Timer wheel slots */
+  struct timeout_slot wheel[UTIL_TIMEOUT_WHEEL_LEVELS]
+    [UTIL_TIMEOUT_WHEEL_SLOTS];
+  /** Bitmaps of non-empty slots for each level */
+  uint64_t wheel_bitmap[UTIL_TIMEOUT_WHEEL_LEVELS]
+    [UTIL_TIMEOUT_WHEEL_SLOTS / 64];
+  /** Time the wheel has been advanced to */
+  uint32_t wheel_ts;
+  /** Head of list of due pending timeouts, no longer in the wheel */
   struct timeout *due_first;
-  /** Tail of list of due pending timeouts, no longer in #timeouts */
+  /** Tail of list of due pending timeouts, no longer in the wheel */
   struct timeout *due_last;
   /** Handler for timeouts. Arguments are the timeout struct and the type of
    * timeout.*/
@@ -30,6 +30,7 @@
 #include <pthread.h>
 
 #include <utils.h>
+#include <utils_timeout.h>
 #include <tas_sockets.h>
 #include <tas_ll.h>
 
@@ -60,6 +61,13 @@ static inline void ev_conn_closed(struct flextcp_context *ctx,
 static __thread struct flextcp_context *local_context;
 static pthread_mutex_t context_init_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* moving average of the us between polls that found events, and when the
+ * last of those was, per thread */
+static __thread uint32_t arrival_gap;
+static __thread uint32_t arrival_last;
+/* start of the current wait without events */
+static __thread uint32_t wait_start;
+
 struct flextcp_context *flextcp_sockctx_get(void)
 {
   struct flextcp_context *ctx = local_context;
@@ -96,6 +104,14 @@ int flextcp_sockctx_poll(struct flextcp_context *ctx)
     abort();
   }
 
+  if (num > 0) {
+    uint32_t now = util_timeout_time_us();
+    /* the first arrival only starts the clock */
+    if (arrival_last != 0)
+      arrival_gap = (arrival_gap * 7 + (now - arrival_last)) / 8;
+    arrival_last = now;
+  }
+
   for (i = 0; i < num; i++) {
     switch (evs[i].event_type) {
       case FLEXTCP_EV_LISTEN_OPEN:
@@ -160,6 +176,36 @@ int flextcp_sockctx_poll_n(struct flextcp_context *ctx, unsigned n)
   return nevents;
 }
 
+int flextcp_sockctx_wait(struct flextcp_context *ctx, uint32_t budget)
+{
+  uint32_t now;
+  int num;
+
+  if ((num = flextcp_sockctx_poll(ctx)) > 0 || budget == SOCK_SPIN_FOREVER) {
+    wait_start = 0;
+    return num;
+  }
+
+  now = util_timeout_time_us();
+  if (wait_start == 0) {
+    wait_start = now;
+  } else if (now - wait_start >= flextcp_sockctx_spin(budget)) {
+    /* bounded, the socket might move to another context meanwhile */
+    flextcp_block(ctx, POLL_CYCLE / 1000);
+    wait_start = 0;
+  }
+  return 0;
+}
+
+uint32_t flextcp_sockctx_spin(uint32_t budget)
+{
+  /* spinning much shorter than events are apart is mostly wasted */
+  if (budget != SOCK_SPIN_FOREVER && arrival_gap / 2 > budget) {
+    return budget / 8;
+  }
+  return budget;
+}
+
 static inline void ev_listen_open(struct flextcp_context *ctx,
     struct flextcp_event *ev)
 {
@@ -172,11 +218,13 @@ static inline void ev_listen_open(struct flextcp_context *ctx,
 
   assert(s->type == SOCK_LISTENER);
   assert(s->data.listener.status == SOL_OPENING);
+  flextcp_sock_lock(s);
   if (ev->ev.listen_open.status == 0) {
     s->data.listener.status = SOL_OPEN;
   } else {
     s->data.listener.status = SOL_FAILED;
   }
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_listen_newconn(struct flextcp_context *ctx,
@@ -191,7 +239,9 @@ static inline void ev_listen_newconn(struct flextcp_context *ctx,
 
   assert(s->type == SOCK_LISTENER);
 
+  flextcp_sock_lock(s);
   flextcp_epoll_set(s, EPOLLIN);
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_listen_accept(struct flextcp_context *ctx,
@@ -209,8 +259,7 @@ static inline void ev_listen_accept(struct flextcp_context *ctx,
   sl = s->data.connection.listener;
   assert(sl != NULL);
 
-  flextcp_epoll_set(sl, EPOLLIN);
-
+  flextcp_sock_lock(s);
   if (ev->ev.listen_accept.status == 0) {
     s->data.connection.status = SOC_CONNECTED;
     flextcp_epoll_set(s, EPOLLOUT);
@@ -218,7 +267,11 @@ static inline void ev_listen_accept(struct flextcp_context *ctx,
     s->data.connection.status = SOC_FAILED;
     flextcp_epoll_set(s, EPOLLERR);
   }
+  flextcp_sock_unlock(s);
 
+  flextcp_sock_lock(sl);
+  flextcp_epoll_set(sl, EPOLLIN);
+  flextcp_sock_unlock(sl);
 }
 
 static inline void ev_conn_open(struct flextcp_context *ctx,
@@ -234,6 +287,7 @@ static inline void ev_conn_open(struct flextcp_context *ctx,
   assert(s->type == SOCK_CONNECTION);
   assert(s->data.connection.status == SOC_CONNECTING);
 
+  flextcp_sock_lock(s);
   if (ev->ev.conn_open.status == 0) {
     s->data.connection.status = SOC_CONNECTED;
     flextcp_epoll_set(s, EPOLLOUT);
@@ -241,7 +295,7 @@ static inline void ev_conn_open(struct flextcp_context *ctx,
     s->data.connection.status = SOC_FAILED;
     flextcp_epoll_set(s, EPOLLERR);
   }
-
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_received(struct flextcp_context *ctx,
@@ -285,6 +339,7 @@ static inline void ev_conn_received(struct flextcp_context *ctx,
   /*   fprintf(stderr, "%s ev_conn_received len = %zu\n", HOSTNAME, len); */
   /* } */
 
+  flextcp_sock_lock(s);
   if (s->data.connection.rx_len_1 == 0) {
     /* if(all_received > 1048000) { */
     /*   fprintf(stderr, "%s: reset buffers\n", HOSTNAME); */
@@ -329,6 +384,7 @@ static inline void ev_conn_received(struct flextcp_context *ctx,
   }
 
   flextcp_epoll_set(s, EPOLLIN);
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_sendbuf(struct flextcp_context *ctx,
@@ -344,7 +400,9 @@ static inline void ev_conn_sendbuf(struct flextcp_context *ctx,
   assert(s->type == SOCK_CONNECTION);
   assert(s->data.connection.status == SOC_CONNECTED);
 
+  flextcp_sock_lock(s);
   flextcp_epoll_set(s, EPOLLOUT);
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_moved(struct flextcp_context *ctx,
@@ -360,7 +418,9 @@ static inline void ev_conn_moved(struct flextcp_context *ctx,
   assert(s->type == SOCK_CONNECTION);
   assert(s->data.connection.status == SOC_CONNECTED);
 
+  flextcp_sock_lock(s);
   s->data.connection.move_status = ev->ev.conn_moved.status;
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_rxclosed(struct flextcp_context *ctx,
@@ -377,6 +437,7 @@ static inline void ev_conn_rxclosed(struct flextcp_context *ctx,
   assert(s->data.connection.status == SOC_CONNECTED ||
       s->data.connection.status == SOC_CLOSED);
 
+  flextcp_sock_lock(s);
   s->data.connection.st_flags |= CSTF_RXCLOSED;
   flextcp_epoll_set(s, EPOLLIN | EPOLLRDHUP);
 
@@ -387,6 +448,7 @@ static inline void ev_conn_rxclosed(struct flextcp_context *ctx,
      * close. */
     flextcp_sockclose_finish(ctx, s);
   }
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_txclosed(struct flextcp_context *ctx,
@@ -403,6 +465,7 @@ static inline void ev_conn_txclosed(struct flextcp_context *ctx,
   assert(s->data.connection.status == SOC_CONNECTED ||
       s->data.connection.status == SOC_CLOSED);
 
+  flextcp_sock_lock(s);
   s->data.connection.st_flags |= CSTF_TXCLOSED_ACK;
 
   if (s->data.connection.status == SOC_CLOSED &&
@@ -412,6 +475,7 @@ static inline void ev_conn_txclosed(struct flextcp_context *ctx,
      * close. */
     flextcp_sockclose_finish(ctx, s);
   }
+  flextcp_sock_unlock(s);
 }
 
 static inline void ev_conn_closed(struct flextcp_context *ctx,
@@ -427,5 +491,5 @@ static inline void ev_conn_closed(struct flextcp_context *ctx,
   assert(s->type == SOCK_CONNECTION);
   assert(s->data.connection.status == SOC_CLOSED);
 
-  free(s);
+  flextcp_sock_free(s);
 }
@@ -31,8 +31,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #include <utils.h>
 #include <tas_sockets.h>
@@ -41,6 +44,16 @@
 #include "internal.h"
 
 static void conn_close(struct flextcp_context *ctx, struct socket *s);
+static int accept_prepost(struct socket *s, struct flextcp_context *ctx);
+static struct connpool *connpool_lookup(uint32_t ip, uint16_t port);
+static void connpool_fill(struct connpool *cp, struct flextcp_context *ctx);
+static int connpool_take(struct connpool *cp, struct flextcp_context *ctx,
+    struct socket *s, int fd);
+
+/* destinations with pre-established connections, see tas_connect_pool(),
+ * the mutex protects the list and the pooled connections of all threads */
+static struct connpool *connpools = NULL;
+static pthread_mutex_t connpool_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int tas_init(void)
 {
@@ -79,6 +92,9 @@ int tas_socket(int domain, int type, int protocol)
 
   s->type = SOCK_SOCKET;
   s->flags = 0;
+  s->rxbuf_len = 0;
+  s->txbuf_len = 0;
+  s->cc = FLEXTCP_CC_DEFAULT;
   flextcp_epoll_sockinit(s);
 
   if (nonblock) {
@@ -100,6 +116,7 @@ int tas_close(int sockfd)
   }
 
   flextcp_fd_close(sockfd);
+  flextcp_sock_lock(s);
 
   /* remove from epoll */
   flextcp_epoll_sockclose(s);
@@ -110,6 +127,7 @@ int tas_close(int sockfd)
   } else {
     fprintf(stderr, "TODO: close for non-connections. (leak)\n");
   }
+  flextcp_sock_unlock(s);
   return 0;
 }
 
@@ -223,6 +241,8 @@ int tas_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
   int ret = 0;
   struct sockaddr_in *sin = (struct sockaddr_in *) addr;
   struct flextcp_context *ctx;
+  struct connpool *cp;
+  int taken;
 
   if (flextcp_fd_slookup(sockfd, &s) != 0) {
     errno = EBADF;
@@ -252,15 +272,30 @@ int tas_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
     goto out;
   }
 
-  /* open flextcp connection */
+  /* hand out pre-established connection if there is one */
   ctx = flextcp_sockctx_get();
-  if (flextcp_connection_open(ctx, &s->data.connection.c,
-        ntohl(sin->sin_addr.s_addr), ntohs(sin->sin_port)))
+  if (s->type == SOCK_SOCKET) {
+    pthread_mutex_lock(&connpool_mutex);
+    taken = (cp = connpool_lookup(ntohl(sin->sin_addr.s_addr),
+          ntohs(sin->sin_port))) != NULL &&
+      connpool_take(cp, ctx, s, sockfd) == 0;
+    pthread_mutex_unlock(&connpool_mutex);
+    if (taken)
+      goto out;
+  }
+
+  /* open flextcp connection, the only failure is a full kernel queue: wait
+   * for the slow path to drain it if blocking */
+  while (flextcp_connection_open_cc(ctx, &s->data.connection.c,
+        ntohl(sin->sin_addr.s_addr), ntohs(sin->sin_port), s->rxbuf_len,
+        s->txbuf_len, s->cc))
   {
-    /* TODO */
-    errno = ECONNREFUSED;
-    ret = -1;
-    goto out;
+    if ((s->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+      errno = EAGAIN;
+      ret = -1;
+      goto out;
+    }
+    flextcp_sockctx_poll(ctx);
   }
 
   assert(s->type == SOCK_CONNECTION || s->type == SOCK_SOCKET);
@@ -269,6 +304,8 @@ int tas_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen)
   s->data.connection.listener = NULL;
   s->data.connection.rx_len_1 = 0;
   s->data.connection.rx_len_2 = 0;
+  s->data.connection.rx_lent = 0;
+  s->data.connection.rx_held = 0;
   s->data.connection.ctx = ctx;
 
   /* check whether the socket is blocking */
@@ -296,6 +333,121 @@ out:
   return ret;
 }
 
+int tas_connect_pool(const struct sockaddr *addr, socklen_t addrlen,
+    unsigned num)
+{
+  const struct sockaddr_in *sin = (const struct sockaddr_in *) addr;
+  struct connpool *cp;
+
+  if (addrlen != sizeof(*sin) || addr->sa_family != AF_INET) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&connpool_mutex);
+  if ((cp = connpool_lookup(ntohl(sin->sin_addr.s_addr),
+          ntohs(sin->sin_port))) == NULL)
+  {
+    if ((cp = calloc(1, sizeof(*cp))) == NULL) {
+      pthread_mutex_unlock(&connpool_mutex);
+      errno = ENOMEM;
+      return -1;
+    }
+    cp->ip = ntohl(sin->sin_addr.s_addr);
+    cp->port = ntohs(sin->sin_port);
+    cp->next = connpools;
+    connpools = cp;
+  }
+
+  /* surplus connections are left alone, they are used up by connects */
+  cp->num = num;
+  connpool_fill(cp, flextcp_sockctx_get());
+  pthread_mutex_unlock(&connpool_mutex);
+  return 0;
+}
+
+int tas_connect_many(const struct sockaddr_in *addrs, unsigned naddrs,
+    int *fds, unsigned num, int flags)
+{
+  struct flextcp_context *ctx;
+  struct socket *s;
+  unsigned i, pending, established = 0;
+  int fd, ret;
+
+  if (naddrs == 0 || (flags & ~SOCK_NONBLOCK) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  ctx = flextcp_sockctx_get();
+
+  /* issue all opens back to back, they share kicks of the slow path */
+  for (i = 0; i < num; i++) {
+    if ((fd = tas_socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+      break;
+    }
+    ret = flextcp_fd_slookup(fd, &s);
+    assert(ret == 0);
+    s->flags |= SOF_NONBLOCK;
+
+    while ((ret = tas_connect(fd, (const struct sockaddr *) &addrs[i % naddrs],
+            sizeof(addrs[0]))) != 0 && errno == EAGAIN)
+    {
+      /* kernel queue full */
+      flextcp_sockctx_poll(ctx);
+    }
+    if (ret != 0 && errno != EINPROGRESS) {
+      flextcp_fd_release(fd);
+      tas_close(fd);
+      break;
+    }
+
+    /* a pooled connection replaces the socket struct behind fd */
+    flextcp_fd_release(fd);
+    ret = flextcp_fd_slookup(fd, &s);
+    assert(ret == 0);
+    if ((flags & SOCK_NONBLOCK) == 0) {
+      s->flags &= ~SOF_NONBLOCK;
+    }
+    flextcp_fd_release(fd);
+    fds[i] = fd;
+  }
+  num = i;
+
+  /* non-blocking callers get the completions through epoll */
+  if ((flags & SOCK_NONBLOCK) == SOCK_NONBLOCK) {
+    return num;
+  }
+
+  do {
+    pending = 0;
+    for (i = 0; i < num; i++) {
+      if (fds[i] < 0 || flextcp_fd_slookup(fds[i], &s) != 0) {
+        continue;
+      }
+
+      if (s->data.connection.status == SOC_CONNECTING) {
+        pending++;
+      } else if (s->data.connection.status == SOC_FAILED) {
+        flextcp_fd_release(fds[i]);
+        tas_close(fds[i]);
+        fds[i] = -1;
+        continue;
+      } else {
+        established++;
+      }
+      flextcp_fd_release(fds[i]);
+    }
+
+    if (pending > 0) {
+      flextcp_sockctx_poll(ctx);
+      established = 0;
+    }
+  } while (pending > 0);
+
+  return established;
+}
+
 int tas_listen(int sockfd, int backlog)
 {
   struct socket *s;
@@ -335,8 +487,9 @@ int tas_listen(int sockfd, int backlog)
 
   /* open flextcp listener */
   ctx = flextcp_sockctx_get();
-  if (flextcp_listen_open(ctx, &s->data.listener.l, ntohs(s->addr.sin_port),
-        backlog, flags))
+  if (flextcp_listen_open_cc(ctx, &s->data.listener.l,
+        ntohs(s->addr.sin_port), backlog, flags, s->rxbuf_len, s->txbuf_len,
+        s->cc))
   {
     /* TODO */
     errno = ECONNREFUSED;
@@ -372,8 +525,8 @@ int tas_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
 {
   struct socket *s, *ns;
   struct flextcp_context *ctx;
-  struct socket_pending *sp, *spp;
-  int ret = 0, nonblock = 0, newfd;
+  struct socket_pending *sp, **psp;
+  int ret = 0, nonblock = 0, newfd, n, max;
 
   if (flextcp_fd_slookup(sockfd, &s) != 0) {
     errno = EBADF;
@@ -400,102 +553,72 @@ int tas_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
   }
 
   ctx = flextcp_sockctx_get();
-
-  /* lookup pending connection for this context/thread */
-  for (sp = s->data.listener.pending; sp != NULL; sp = sp->next) {
-    if (sp->ctx == ctx) {
-      break;
-    }
-  }
-
-  /* if there is no pending request, send out a request */
-  if (sp == NULL) {
-    if ((sp = malloc(sizeof(*sp))) == NULL) {
-      errno = ENOMEM;
-      ret = -1;
-      goto out;
+  flextcp_sock_lock(s);
+  max = MIN(s->data.listener.backlog, SOCKET_ACCEPT_PREPOST);
+
+  while (1) {
+    /* keep accept requests for this context outstanding, so connections
+     * are accepted ahead of the accept calls that pick them up */
+    n = 0;
+    for (sp = s->data.listener.pending; sp != NULL; sp = sp->next) {
+      n += (sp->ctx == ctx);
     }
-
-    /* allocate socket structure */
-    if ((newfd = flextcp_fd_salloc(&ns)) < 0) {
-      free(sp);
-      ret = -1;
-      goto out;
+    for (; n < max; n++) {
+      if (accept_prepost(s, ctx) != 0) {
+        if (n == 0) {
+          ret = -1;
+          goto out_unlock;
+        }
+        break;
+      }
     }
 
-    ns->type = SOCK_CONNECTION;
-    ns->flags = (nonblock ? SOF_NONBLOCK : 0);
-    ns->data.connection.status = SOC_CONNECTING;
-    ns->data.connection.listener = s;
-    ns->data.connection.rx_len_1 = 0;
-    ns->data.connection.rx_len_2 = 0;
-    ns->data.connection.ctx = ctx;
-
-    sp->fd = newfd;
-    sp->s = ns;
-    sp->ctx = ctx;
-    sp->next = NULL;
-
-    /* send accept request to kernel */
-    if (flextcp_listen_accept(ctx, &s->data.listener.l,
-          &ns->data.connection.c) != 0)
+    /* look for first completed accept for this context/thread */
+    for (psp = &s->data.listener.pending; (sp = *psp) != NULL;
+        psp = &sp->next)
     {
-      /* TODO */
-      errno = ENOBUFS;
-      ret = -1;
-      free(sp);
-      flextcp_fd_close(newfd);
-      free(s);
-      goto out;
+      if (sp->ctx == ctx &&
+          sp->s->data.connection.status != SOC_CONNECTING)
+      {
+        break;
+      }
     }
 
-    /* append entry to pending list */
-    spp = s->data.listener.pending;
-    if (spp == NULL) {
-      s->data.listener.pending = sp;
-    } else {
-      while (spp->next != NULL) {
-        spp = spp->next;
+    if (sp == NULL) {
+      flextcp_epoll_clear(s, EPOLLIN);
+      if ((s->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+        /* if non-blocking, just return */
+        errno = EAGAIN;
+        ret = -1;
+        goto out_unlock;
       }
-      spp->next = sp;
+
+      /* if this is blocking, wait for a connection to complete */
+      flextcp_sock_unlock(s);
+      flextcp_sockctx_wait(ctx, flextcp_sock_spin_budget(s));
+      flextcp_sock_lock(s);
+      continue;
     }
-  } else {
+
+    /* remove entry from pending list */
+    *psp = sp->next;
     ns = sp->s;
     newfd = sp->fd;
-  }
+    free(sp);
 
-  /* check if connection is still pending */
-  if (ns->data.connection.status == SOC_CONNECTING) {
-    flextcp_epoll_clear(s, EPOLLIN);
-    if ((s->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
-      /* if non-blocking, just return */
-      errno = EAGAIN;
-      ret = -1;
-      goto out;
-    } else {
-      /* if this is blocking, wait for connection to complete */
-      do {
-        flextcp_sockctx_poll(ctx);
-      } while (ns->data.connection.status == SOC_CONNECTING);
+    if (ns->data.connection.status == SOC_CONNECTED) {
+      break;
     }
-  }
 
-  /* connection is opened now */
-  assert(ns->data.connection.status == SOC_CONNECTED);
+    /* accept failed, drop the socket and try again */
+    flextcp_fd_close(newfd);
+    flextcp_sock_free(ns);
+  }
+  flextcp_sock_unlock(s);
 
-  /* remove entry from pending list */
-  if (s->data.listener.pending == sp) {
-    s->data.listener.pending = sp->next;
-  } else {
-    spp = s->data.listener.pending;
-    assert(spp != NULL);
-    while (spp->next != sp) {
-      assert(spp->next != NULL);
-      spp = spp->next;
-    }
-    spp->next = sp->next;
+  if (nonblock) {
+    ns->flags |= SOF_NONBLOCK;
   }
-  free(sp);
   flextcp_fd_release(newfd);
 
   // fill in addr if given
@@ -508,6 +631,173 @@ int tas_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen,
 out:
   flextcp_fd_release(sockfd);
   return ret;
+
+out_unlock:
+  flextcp_sock_unlock(s);
+  goto out;
+}
+
+/* allocate socket for a connection and send accept request to kernel */
+static int accept_prepost(struct socket *s, struct flextcp_context *ctx)
+{
+  struct socket *ns;
+  struct socket_pending *sp, **psp;
+  int newfd;
+
+  if ((sp = malloc(sizeof(*sp))) == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  /* allocate socket structure */
+  if ((newfd = flextcp_fd_salloc(&ns)) < 0) {
+    free(sp);
+    return -1;
+  }
+
+  ns->type = SOCK_CONNECTION;
+  ns->flags = s->flags & (SOF_ZEROCOPY | SOF_PREFER_BUSY_POLL);
+  ns->busy_poll_us = s->busy_poll_us;
+  ns->rxbuf_len = s->rxbuf_len;
+  ns->txbuf_len = s->txbuf_len;
+  ns->cc = s->cc;
+  ns->data.connection.status = SOC_CONNECTING;
+  ns->data.connection.listener = s;
+  ns->data.connection.rx_len_1 = 0;
+  ns->data.connection.rx_len_2 = 0;
+  ns->data.connection.rx_lent = 0;
+  ns->data.connection.rx_held = 0;
+  ns->data.connection.ctx = ctx;
+
+  sp->fd = newfd;
+  sp->s = ns;
+  sp->ctx = ctx;
+  sp->next = NULL;
+
+  /* send accept request to kernel */
+  if (flextcp_listen_accept(ctx, &s->data.listener.l,
+        &ns->data.connection.c) != 0)
+  {
+    errno = ENOBUFS;
+    free(sp);
+    flextcp_fd_close(newfd);
+    flextcp_sock_free(ns);
+    return -1;
+  }
+
+  /* append entry to pending list */
+  for (psp = &s->data.listener.pending; *psp != NULL; psp = &(*psp)->next);
+  *psp = sp;
+  return 0;
+}
+
+static struct connpool *connpool_lookup(uint32_t ip, uint16_t port)
+{
+  struct connpool *cp;
+
+  for (cp = connpools; cp != NULL; cp = cp->next) {
+    if (cp->ip == ip && cp->port == port) {
+      return cp;
+    }
+  }
+  return NULL;
+}
+
+/* open connections until the context has cp->num pooled, called with
+ * connpool_mutex held */
+static void connpool_fill(struct connpool *cp, struct flextcp_context *ctx)
+{
+  struct socket_pending *sp;
+  struct socket *ps;
+  unsigned n = 0;
+
+  for (sp = cp->conns; sp != NULL; sp = sp->next) {
+    n += (sp->ctx == ctx);
+  }
+
+  for (; n < cp->num; n++) {
+    if ((sp = malloc(sizeof(*sp))) == NULL) {
+      return;
+    }
+    if ((ps = flextcp_sock_alloc()) == NULL) {
+      free(sp);
+      return;
+    }
+
+    ps->type = SOCK_CONNECTION;
+    ps->cc = FLEXTCP_CC_DEFAULT;
+    flextcp_epoll_sockinit(ps);
+    ps->data.connection.status = SOC_CONNECTING;
+    ps->data.connection.ctx = ctx;
+
+    if (flextcp_connection_open_cc(ctx, &ps->data.connection.c, cp->ip,
+          cp->port, 0, 0, FLEXTCP_CC_DEFAULT) != 0)
+    {
+      flextcp_sock_free(ps);
+      free(sp);
+      return;
+    }
+
+    sp->s = ps;
+    sp->ctx = ctx;
+    sp->fd = -1;
+    sp->next = cp->conns;
+    cp->conns = sp;
+  }
+}
+
+/* hand established pooled connection to socket s on fd, and replace it,
+ * called with connpool_mutex held */
+static int connpool_take(struct connpool *cp, struct flextcp_context *ctx,
+    struct socket *s, int fd)
+{
+  struct socket_pending *sp, **psp;
+  struct socket *ps = NULL;
+
+  /* pooled connections all use defaults and are not registered with epoll
+   * fds, sockets that differ open their own */
+  if (s->eps != NULL || s->rxbuf_len != 0 || s->txbuf_len != 0 ||
+      s->cc != FLEXTCP_CC_DEFAULT)
+  {
+    return -1;
+  }
+
+  psp = &cp->conns;
+  while ((sp = *psp) != NULL) {
+    if (sp->ctx != ctx ||
+        sp->s->data.connection.status == SOC_CONNECTING)
+    {
+      psp = &sp->next;
+      continue;
+    }
+
+    *psp = sp->next;
+    ps = sp->s;
+    free(sp);
+
+    if (ps->data.connection.status == SOC_CONNECTED &&
+        !(ps->data.connection.st_flags & CSTF_RXCLOSED))
+    {
+      break;
+    }
+
+    /* failed, or closed by the peer while pooled */
+    if (ps->data.connection.status == SOC_FAILED) {
+      flextcp_sock_free(ps);
+    } else {
+      conn_close(ctx, ps);
+    }
+    ps = NULL;
+  }
+
+  if (ps != NULL) {
+    ps->flags = s->flags;
+    flextcp_fd_sreplace(fd, ps);
+    flextcp_sock_free(s);
+  }
+
+  connpool_fill(cp, ctx);
+  return (ps != NULL ? 0 : -1);
 }
 
 /** map: accept  -->  accept4 */
@@ -572,11 +862,44 @@ out:
   return ret;
 }
 
+/* fill in what we know of struct tcp_info, from library state and the fast
+ * path flow state */
+static int sock_tcp_info(struct socket *s, void *optval, socklen_t *optlen)
+{
+  struct tcp_info ti;
+  struct flextcp_conn_info ci;
+  socklen_t len;
+
+  memset(&ti, 0, sizeof(ti));
+  if (s->type != SOCK_CONNECTION) {
+    ti.tcpi_state = (s->type == SOCK_LISTENER ? TCP_LISTEN : TCP_CLOSE);
+  } else if (s->data.connection.status == SOC_CONNECTING) {
+    ti.tcpi_state = TCP_SYN_SENT;
+  } else if (s->data.connection.status != SOC_CONNECTED ||
+      flextcp_connection_info(&s->data.connection.c, &ci) != 0)
+  {
+    ti.tcpi_state = TCP_CLOSE;
+  } else {
+    ti.tcpi_state = ((s->data.connection.st_flags & CSTF_RXCLOSED) ?
+        TCP_CLOSE_WAIT : TCP_ESTABLISHED);
+    ti.tcpi_retransmits = ci.rto_backoff;
+    ti.tcpi_rtt = ci.rtt_us;
+    ti.tcpi_lost = ci.tx_drops + ci.tx_rtos;
+    ti.tcpi_rcv_space = s->data.connection.c.rxb_len - ci.rx_ready;
+  }
+
+  len = MIN(*optlen, sizeof(ti));
+  memcpy(optval, &ti, len);
+  *optlen = len;
+  return 0;
+}
+
 int tas_getsockopt(int sockfd, int level, int optname, void *optval,
     socklen_t *optlen)
 {
   struct socket *s;
   int ret = 0, res, len;
+  const char *name;
 
   if (flextcp_fd_slookup(sockfd, &s) != 0) {
     errno = EBADF;
@@ -587,11 +910,34 @@ int tas_getsockopt(int sockfd, int level, int optname, void *optval,
     /* check nodelay flag: always set */
     res = 1;
 
+  } else if (level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+    /* algorithm name instead of an int */
+    name = flextcp_cc_name(s->cc);
+    len = MIN(*optlen, strlen(name) + 1);
+    memcpy(optval, name, len);
+    *optlen = len;
+    goto out;
+  } else if (level == IPPROTO_TCP && optname == TCP_INFO) {
+    /* struct instead of an int */
+    if ((ret = sock_tcp_info(s, optval, optlen)) != 0) {
+      errno = ENOTCONN;
+    }
+    goto out;
+
   } else if(level == SOL_SOCKET &&
       (optname == SO_RCVBUF || optname == SO_SNDBUF))
   {
-    /* read receive or transmit buffer size: TODO */
-    res = 1024 * 1024;
+    /* actual buffer size once connected, otherwise the hint if set */
+    if (s->type == SOCK_CONNECTION &&
+        s->data.connection.status == SOC_CONNECTED)
+    {
+      res = (optname == SO_RCVBUF ? s->data.connection.c.rxb_len :
+          s->data.connection.c.txb_len);
+    } else {
+      res = (optname == SO_RCVBUF ? s->rxbuf_len : s->txbuf_len);
+      if (res == 0)
+        res = 1024 * 1024;
+    }
   } else if (level == SOL_SOCKET && optname == SO_ERROR) {
     /* check socket error */
     if (s->type == SOCK_LISTENER) {
@@ -611,6 +957,12 @@ int tas_getsockopt(int sockfd, int level, int optname, void *optval,
     }
   } else if (level == SOL_SOCKET && optname == SO_REUSEPORT) {
     res = !!(s->flags & SOF_REUSEPORT);
+  } else if (level == SOL_SOCKET && optname == SO_ZEROCOPY) {
+    res = !!(s->flags & SOF_ZEROCOPY);
+  } else if (level == SOL_SOCKET && optname == SO_BUSY_POLL) {
+    res = s->busy_poll_us;
+  } else if (level == SOL_SOCKET && optname == SO_PREFER_BUSY_POLL) {
+    res = !!(s->flags & SOF_PREFER_BUSY_POLL);
   } else {
     /* unknown option */
     fprintf(stderr, "flextcp getsockopt: unknown level optname combination "
@@ -630,11 +982,54 @@ out:
   return ret;
 }
 
+int tas_ioctl(int sockfd, unsigned long request, void *arg)
+{
+  struct socket *s;
+  struct flextcp_conn_info ci;
+  int ret = 0;
+
+  if (flextcp_fd_slookup(sockfd, &s) != 0) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (request == FIONBIO) {
+    /* same as fcntl(O_NONBLOCK) */
+    if (*(int *) arg == 0) {
+      s->flags &= ~SOF_NONBLOCK;
+    } else {
+      s->flags |= SOF_NONBLOCK;
+    }
+  } else if (s->type != SOCK_CONNECTION) {
+    errno = EINVAL;
+    ret = -1;
+  } else if (request == FIONREAD) {
+    /* what the next read can return */
+    *(int *) arg = s->data.connection.rx_len_1 + s->data.connection.rx_len_2;
+  } else if (request == SIOCOUTQ) {
+    /* not acknowledged yet */
+    if (s->data.connection.status != SOC_CONNECTED ||
+        flextcp_connection_info(&s->data.connection.c, &ci) != 0)
+    {
+      *(int *) arg = 0;
+    } else {
+      *(int *) arg = ci.tx_queued;
+    }
+  } else {
+    errno = ENOTTY;
+    ret = -1;
+  }
+
+  flextcp_fd_release(sockfd);
+  return ret;
+}
+
 int tas_setsockopt(int sockfd, int level, int optname, const void *optval,
     socklen_t optlen)
 {
   struct socket *s;
   int ret = 0, res;
+  char name[16];
 
   if (flextcp_fd_slookup(sockfd, &s) != 0) {
     errno = EBADF;
@@ -648,6 +1043,22 @@ int tas_setsockopt(int sockfd, int level, int optname, const void *optval,
       ret = -1;
       goto out;
     }
+  } else if (level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+    /* name is not necessarily terminated, applied on connect/listen */
+    if (optlen == 0 || optlen >= sizeof(name)) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+    }
+    memcpy(name, optval, optlen);
+    name[optlen] = 0;
+
+    if ((res = flextcp_cc_lookup(name)) < 0) {
+      errno = ENOENT;
+      ret = -1;
+      goto out;
+    }
+    s->cc = res;
   } else if(level == SOL_SOCKET &&
       (optname == SO_RCVBUF || optname == SO_SNDBUF))
   {
@@ -657,15 +1068,19 @@ int tas_setsockopt(int sockfd, int level, int optname, const void *optval,
       goto out;
     }
 
-    /* we allow "resizing" up to 1MB */
+    /* only a hint for the kernel, applied on connect/listen */
     res = * ((int *) optval);
-    if (res <= 1024 * 1024) {
-      return 0;
-    } else {
-      errno = ENOMEM;
+    if (res < 0) {
+      errno = EINVAL;
       ret = -1;
       goto out;
     }
+
+    if (optname == SO_RCVBUF) {
+      s->rxbuf_len = res;
+    } else {
+      s->txbuf_len = res;
+    }
   } else if (level == SOL_SOCKET && optname == SO_REUSEPORT) {
     if (optlen != sizeof(int)) {
       errno = EINVAL;
@@ -678,6 +1093,37 @@ int tas_setsockopt(int sockfd, int level, int optname, const void *optval,
     } else {
       s->flags &= ~SOF_REUSEPORT;
     }
+  } else if (level == SOL_SOCKET && optname == SO_ZEROCOPY) {
+    if (optlen != sizeof(int)) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+    }
+
+    if (*(int *) optval != 0) {
+      s->flags |= SOF_ZEROCOPY;
+    } else {
+      s->flags &= ~SOF_ZEROCOPY;
+    }
+  } else if (level == SOL_SOCKET && optname == SO_BUSY_POLL) {
+    if (optlen != sizeof(int) || *(int *) optval < 0) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+    }
+    s->busy_poll_us = *(int *) optval;
+  } else if (level == SOL_SOCKET && optname == SO_PREFER_BUSY_POLL) {
+    if (optlen != sizeof(int)) {
+      errno = EINVAL;
+      ret = -1;
+      goto out;
+    }
+
+    if (*(int *) optval != 0) {
+      s->flags |= SOF_PREFER_BUSY_POLL;
+    } else {
+      s->flags &= ~SOF_PREFER_BUSY_POLL;
+    }
   } else if (level == SOL_SOCKET && optname == SO_REUSEADDR) {
     fprintf(stderr, "flextcp setsockopt: Ignoring REUSEADDR\n");
     // Ignore...
@@ -778,6 +1224,7 @@ int tas_move_conn(int sockfd)
     errno = EBADF;
     return -1;
   }
+  flextcp_sock_lock(s);
 
   /* if not connection or not currently connected then there is no peername */
   if (s->type != SOCK_CONNECTION ||
@@ -795,23 +1242,44 @@ int tas_move_conn(int sockfd)
     goto out;
   }
 
-  s->data.connection.move_status = INT_MIN;
-  if (flextcp_connection_move(ctx, &s->data.connection.c) != 0) {
-    /* TODO */
-    errno = EINVAL;
-    ret = -1;
-    goto out;
-  }
-
-  do {
-    flextcp_sockctx_poll(ctx);
-  } while (s->data.connection.move_status == INT_MIN);
-  ret = s->data.connection.move_status;
-  if (ret == 0) {
-    s->data.connection.ctx = ctx;
-  }
+  ret = flextcp_sock_adopt(ctx, s);
 
 out:
+  flextcp_sock_unlock(s);
   flextcp_fd_release(sockfd);
   return ret;
 }
+
+int flextcp_sock_adopt(struct flextcp_context *ctx, struct socket *s)
+{
+  while (s->data.connection.ctx != ctx) {
+    if (s->data.connection.move_status == INT_MIN) {
+      /* another thread is moving it, wait and then take it from there */
+      flextcp_sock_unlock(s);
+      flextcp_sockctx_poll(ctx);
+      flextcp_sock_lock(s);
+      continue;
+    }
+
+    s->data.connection.move_status = INT_MIN;
+    if (flextcp_connection_move(ctx, &s->data.connection.c) != 0) {
+      s->data.connection.move_status = 0;
+      errno = ENOBUFS;
+      return -1;
+    }
+
+    /* the completion is delivered on ctx, its handler needs the lock */
+    do {
+      flextcp_sock_unlock(s);
+      flextcp_sockctx_poll(ctx);
+      flextcp_sock_lock(s);
+    } while (s->data.connection.move_status == INT_MIN);
+
+    if (s->data.connection.move_status != 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    s->data.connection.ctx = ctx;
+  }
+  return 0;
+}
@@ -38,6 +38,10 @@
 
 #define LINUX_POLL_DELAY 10
 
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
+
 #define EPOLL_DEBUG(x...) do {} while (0)
 //#define EPOLL_DEBUG(x...) fprintf(stderr, x)
 
@@ -47,7 +51,12 @@ static inline void es_activate(struct epoll_socket *es);
 static inline void es_deactivate(struct epoll_socket *es);
 static inline void es_active_pushback(struct epoll_socket *es);
 static inline void es_remove_ep(struct epoll_socket *es);
+static void epoll_busy_poll_update(struct epoll *ep);
+static void epoll_set_exclusive(struct socket *s, uint32_t evts);
+static inline void es_add_sock(struct epoll_socket *es);
 static inline void es_remove_sock(struct epoll_socket *es);
+static inline struct epoll_socket *es_lookup_sock(struct socket *s,
+    struct epoll *ep);
 static inline uint64_t get_msecs(void);
 
 static int (*libc_epoll_create1)(int flags) = NULL;
@@ -125,28 +134,45 @@ int tas_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
     }
 
     /* make sure num_linux is accurate */
+    util_spin_lock(&ep->lock);
     if (op == EPOLL_CTL_ADD) {
       ep->num_linux++;
     } else if (op == EPOLL_CTL_DEL) {
       assert(ep->num_linux > 0);
       ep->num_linux--;
     }
+    util_spin_unlock(&ep->lock);
     goto out;
   }
 
+  flextcp_sock_lock(s);
+  util_spin_lock(&ep->lock);
+
   /* look up socket on epoll */
-  for (es = s->eps; es != NULL && es->ep != ep; es = es->so_next);
+  es = es_lookup_sock(s, ep);
 
   /* validate events */
   if (op == EPOLL_CTL_ADD || op == EPOLL_CTL_MOD) {
-    em = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
-    event->events &= (~EPOLLET);	// XXX: Mask edge-triggered
+    em = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP | EPOLLET;
+    if ((event->events & EPOLLEXCLUSIVE) != 0) {
+      /* same restrictions as linux: only on add, and not with RDHUP */
+      em = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLET | EPOLLEXCLUSIVE;
+      if (op != EPOLL_CTL_ADD) {
+        errno = EINVAL;
+        ret = -1;
+        goto out_unlock;
+      }
+    } else if (op == EPOLL_CTL_MOD && es != NULL && es->exclusive) {
+      errno = EINVAL;
+      ret = -1;
+      goto out_unlock;
+    }
     if ((event->events & (~em)) != 0) {
       fprintf(stderr, "flextcp epoll_ctl: unsupported events: %x\n",
           (event->events & (~em)));
       errno = EINVAL;
       ret = -1;
-      goto out;
+      goto out_unlock;
     }
   }
 
@@ -157,31 +183,30 @@ int tas_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
       /* socket not on this epoll */
       errno = EEXIST;
       ret = -1;
-      goto out;
+      goto out_unlock;
     }
 
     /* allocate epoll_socket */
     if ((es = calloc(1, sizeof(*es))) == NULL) {
       errno = ENOMEM;
       ret = -1;
-      goto out;
+      goto out_unlock;
     }
 
     es->ep = ep;
     es->s = s;
     es->data = event->data;
-    es->mask = event->events | EPOLLERR;
+    es->mask = (event->events & ~(EPOLLEXCLUSIVE | EPOLLET)) | EPOLLERR;
     es->active = 0;
+    es->exclusive = !!(event->events & EPOLLEXCLUSIVE);
+    es->edge = !!(event->events & EPOLLET);
 
     /* add to list on socket */
-    es->so_prev = NULL;
-    if (s->eps == NULL) {
-      es->so_next = NULL;
-      s->eps = es;
-    } else {
-      es->so_next = s->eps;
-      s->eps->so_prev = es;
-      s->eps = es;
+    es_add_sock(es);
+
+    /* spin as long as the most latency sensitive socket asks for */
+    if (s->busy_poll_us != 0 || (s->flags & SOF_PREFER_BUSY_POLL)) {
+      ep->busy_poll_us = MAX(ep->busy_poll_us, flextcp_sock_spin_budget(s));
     }
 
     /* add to inactive queue */
@@ -198,10 +223,11 @@ int tas_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
       /* socket not on this epoll */
       errno = ENOENT;
       ret = -1;
-      goto out;
+      goto out_unlock;
     }
 
-    es->mask = event->events | EPOLLERR;
+    es->mask = (event->events & ~EPOLLET) | EPOLLERR;
+    es->edge = !!(event->events & EPOLLET);
     if ((s->ep_events & es->mask) != 0) {
       es_activate(es);
     }
@@ -212,18 +238,24 @@ int tas_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
       /* socket not on this epoll */
       errno = ENOENT;
       ret = -1;
-      goto out;
+      goto out_unlock;
     }
 
     es_remove_sock(es);
     es_remove_ep(es);
     free(es);
+
+    /* the socket might have been the one asking for the longest spin */
+    epoll_busy_poll_update(ep);
   } else {
     /* unknown operation */
     errno = EINVAL;
     ret = -1;
-    goto out;
+    goto out_unlock;
   }
+out_unlock:
+  util_spin_unlock(&ep->lock);
+  flextcp_sock_unlock(s);
 out:
   flextcp_fd_release(epfd);
   return ret;
@@ -257,11 +289,6 @@ int tas_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
     return -1;
   }
 
-  if(ep->num_linux > 0) {
-    // XXX: Has Linux FDs - go straight to Linux
-    return libc_epoll_wait(epfd, events, maxevents, timeout);
-  }
-
   util_prefetch0(ep->active_first);
 
   /* calculate timeout */
@@ -270,23 +297,35 @@ int tas_epoll_wait(int epfd, struct epoll_event *events, int maxevents,
   }
 
   ctx = flextcp_sockctx_get();
+  ep->ctx = ctx;
 
   do {
-    /* check whether we have to give priority to linux fds */
-    /* TODO */
-    /*if (ep->num_linux > 0) {
-      if (
-    }*/
+again:
+    /* linux fds are checked with a non-blocking epoll_wait every
+     * LINUX_POLL_DELAY rounds, and always before blocking */
+    if (ep->num_linux > 0 && ++ep->linux_cnt >= LINUX_POLL_DELAY) {
+      ep->linux_cnt = 0;
+      if ((ret = libc_epoll_wait(epfd, events + n, maxevents - n, 0)) < 0) {
+        if (n == 0)
+          goto out;
+      } else {
+        n += ret;
+      }
+    }
 
     /* make sure to poll for some events even if there is already enough on the
-     * epoll */
-again:
-    nevents = flextcp_sockctx_poll_n(ctx, maxevents);
+     * epoll, but only one batch in that case */
+    nevents = flextcp_sockctx_poll_n(ctx, (ep->num_active >= maxevents ? 1 :
+          maxevents - ep->num_active));
 
     static uint32_t __thread startwait = 0;
     if (LIKELY(nevents != 0))
         startwait = 0;
 
+    /* socket locks are not needed here: an event reported right after it
+     * was cleared only results in EAGAIN. Edge triggered entries leave the
+     * active list once reported, so only ready sockets are visited. */
+    util_spin_lock(&ep->lock);
     num_active = ep->num_active;
     for (i = 0; i < num_active && n < maxevents; i++) {
       es = ep->active_first;
@@ -303,33 +342,54 @@ again:
         events[n].events = s->ep_events & es->mask;
         events[n].data = es->data;
         n++;
-        es_active_pushback(es);
+        if (es->edge) {
+          es_deactivate(es);
+        } else {
+          es_active_pushback(es);
+        }
       } else {
         es_deactivate(es);
       }
     }
+    util_spin_unlock(&ep->lock);
 
     // Block thread if nothing received for a while
     if (nevents == 0 && n == 0 && timeout != 0) {
       uint64_t cur_ms = get_msecs();
-      if (timeout == -1 || mtimeout < cur_ms) {
+      if (timeout == -1 || cur_ms < mtimeout) {
         uint32_t cur_ts = util_timeout_time_us();
+        int block_ms = (timeout == -1 ? -1 : (int) (mtimeout - cur_ms));
+
+        uint32_t budget = flextcp_sockctx_spin(ep->busy_poll_us != 0 ?
+            ep->busy_poll_us : POLL_CYCLE);
 
-        if(startwait == 0) {
+        if (budget == SOCK_SPIN_FOREVER) {
+          /* busy polling preferred, never block */
+        } else if(startwait == 0) {
           startwait = cur_ts;
-        } else if(cur_ts - startwait >= POLL_CYCLE) {
-          // Idle -- wait for data from apps/flexnic
-          flextcp_block(ctx, cur_ms - mtimeout);
+        } else if(cur_ts - startwait >= budget) {
+          if (ep->num_linux > 0) {
+            // Idle -- wait for data from apps/flexnic or the linux fds
+            if ((ret = libc_epoll_wait(epfd, events, maxevents, 0)) != 0) {
+              n = ret;
+              goto out;
+            }
+            flextcp_block_fd(ctx, epfd, block_ms);
+            ep->linux_cnt = LINUX_POLL_DELAY;
+          } else {
+            // Idle -- wait for data from apps/flexnic
+            flextcp_block(ctx, block_ms);
+          }
           // Gotta check again now that we woke up
           startwait = 0;
           goto again;
         }
       }
     }
-  } while (n == 0 && timeout != 0 && (timeout == -1 || mtimeout < get_msecs()));
+  } while (n == 0 && timeout != 0 && (timeout == -1 || get_msecs() < mtimeout));
 
   ret = n;
-/*out:*/
+out:
   flextcp_fd_release(epfd);
   EPOLL_DEBUG("        = %d\n", ret);
   return ret;
@@ -347,10 +407,8 @@ void flextcp_epoll_sockinit(struct socket *s)
 {
   s->ep_events = 0;
   s->eps = NULL;
-#if 0
   s->eps_exc_first = NULL;
   s->eps_exc_last = NULL;
-#endif
 }
 
 void flextcp_epoll_set(struct socket *s, uint32_t evts)
@@ -361,21 +419,62 @@ void flextcp_epoll_set(struct socket *s, uint32_t evts)
   newevs = (~s->ep_events) & evts;
 
   EPOLL_DEBUG("flextcp_epoll_set(%p, %x) ne=%x\n", s, evts, newevs);
-  if (newevs == 0) {
-    /* no new events */
-    return;
-  }
   s->ep_events |= evts;
 
+  /* like linux, every event wakes up one more exclusive waiter, even if it
+   * was already pending */
+  if (s->eps_exc_first != NULL) {
+    epoll_set_exclusive(s, evts);
+  }
+
   for (es = s->eps; es != NULL; es = es->so_next) {
-    if ((newevs & es->mask) == 0) {
+    /* edge triggered entries fire again on every event */
+    if (((es->edge ? evts : newevs) & es->mask) == 0) {
       continue;
     }
 
+    util_spin_lock(&es->ep->lock);
     es_activate(es);
+    util_spin_unlock(&es->ep->lock);
   }
 }
 
+/* wake up only one of the exclusive epolls for the new events: the first
+ * inactive one in round robin order, preferring an epoll last waited on
+ * by this thread, since it is the one that got the event on its context */
+static void epoll_set_exclusive(struct socket *s, uint32_t evts)
+{
+  struct flextcp_context *ctx = flextcp_sockctx_get();
+  struct epoll_socket *es, *first = NULL;
+
+  for (es = s->eps_exc_first; es != NULL; es = es->so_next) {
+    if ((evts & es->mask) == 0 || es->active) {
+      continue;
+    }
+    if (first == NULL) {
+      first = es;
+    }
+    if (es->ep->ctx == ctx) {
+      break;
+    }
+  }
+  if (es == NULL) {
+    es = first;
+  }
+  if (es == NULL) {
+    /* everyone is already awake */
+    return;
+  }
+
+  util_spin_lock(&es->ep->lock);
+  es_activate(es);
+  util_spin_unlock(&es->ep->lock);
+
+  /* rotate to the end of the list */
+  es_remove_sock(es);
+  es_add_sock(es);
+}
+
 void flextcp_epoll_clear(struct socket *s, uint32_t evts)
 {
   EPOLL_DEBUG("flextcp_epoll_clear(%p, %x)\n", s, evts);
@@ -385,14 +484,40 @@ void flextcp_epoll_clear(struct socket *s, uint32_t evts)
 void flextcp_epoll_sockclose(struct socket *s)
 {
   struct epoll_socket *es;
+  struct epoll *ep;
 
-  while ((es = s->eps) != NULL) {
+  while ((es = s->eps) != NULL || (es = s->eps_exc_first) != NULL) {
     es_remove_sock(es);
+    ep = es->ep;
+    util_spin_lock(&ep->lock);
     es_remove_ep(es);
+    epoll_busy_poll_update(ep);
+    util_spin_unlock(&ep->lock);
     free(es);
   }
 }
 
+/* recalculate the spin budget from the sockets left on the epoll, called
+ * with the epoll lock held */
+static void epoll_busy_poll_update(struct epoll *ep)
+{
+  struct epoll_socket *es;
+  struct socket *s;
+  uint32_t budget = 0;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    es = (i == 0 ? ep->inactive : ep->active_first);
+    for (; es != NULL; es = es->ep_next) {
+      s = es->s;
+      if (s->busy_poll_us != 0 || (s->flags & SOF_PREFER_BUSY_POLL)) {
+        budget = MAX(budget, flextcp_sock_spin_budget(s));
+      }
+    }
+  }
+  ep->busy_poll_us = budget;
+}
+
 /* remove es from epoll's inactive list */
 static inline void es_remove_inactive(struct epoll_socket *es)
 {
@@ -518,14 +643,41 @@ static inline void es_remove_ep(struct epoll_socket *es)
   }
 }
 
+/* add es to the socket's list, exclusive ones at the end of their own */
+static inline void es_add_sock(struct epoll_socket *es)
+{
+  struct socket *s = es->s;
+
+  if (es->exclusive) {
+    es->so_next = NULL;
+    es->so_prev = s->eps_exc_last;
+    if (s->eps_exc_last == NULL) {
+      s->eps_exc_first = es;
+    } else {
+      s->eps_exc_last->so_next = es;
+    }
+    s->eps_exc_last = es;
+    return;
+  }
+
+  es->so_prev = NULL;
+  es->so_next = s->eps;
+  if (s->eps != NULL) {
+    s->eps->so_prev = es;
+  }
+  s->eps = es;
+}
+
 /* remove es from socket lists */
 static inline void es_remove_sock(struct epoll_socket *es)
 {
   struct socket *s = es->s;
+  struct epoll_socket **pfirst =
+    (es->exclusive ? &s->eps_exc_first : &s->eps);
 
   /* update predecessor's next pointer on socket list */
   if (es->so_prev == NULL) {
-    s->eps = es->so_next;
+    *pfirst = es->so_next;
   } else {
     es->so_prev->so_next = es->so_next;
   }
@@ -533,7 +685,23 @@ static inline void es_remove_sock(struct epoll_socket *es)
   /* update successor's prev pointer on socket list */
   if (es->so_next != NULL) {
     es->so_next->so_prev = es->so_prev;
+  } else if (es->exclusive) {
+    s->eps_exc_last = es->so_prev;
+  }
+}
+
+/* find es for socket on epoll */
+static inline struct epoll_socket *es_lookup_sock(struct socket *s,
+    struct epoll *ep)
+{
+  struct epoll_socket *es;
+
+  for (es = s->eps; es != NULL && es->ep != ep; es = es->so_next);
+  if (es == NULL) {
+    for (es = s->eps_exc_first; es != NULL && es->ep != ep;
+        es = es->so_next);
   }
+  return es;
 }
 
 static inline uint64_t get_msecs(void)
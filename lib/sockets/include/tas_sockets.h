@@ -28,6 +28,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <netinet/in.h>
 
 
 int tas_init(void);
@@ -52,6 +53,9 @@ int tas_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
 int tas_fcntl(int sockfd, int cmd, ...);
 
+/* FIONBIO, and FIONREAD and SIOCOUTQ (TIOCOUTQ) on connections */
+int tas_ioctl(int sockfd, unsigned long request, void *arg);
+
 int tas_getsockopt(int sockfd, int level, int optname, void *optval,
     socklen_t *optlen);
 
@@ -64,6 +68,18 @@ int tas_getpeername(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 
 int tas_move_conn(int sockfd);
 
+/* keep num established connections to addr per thread, tas_connect() to addr
+ * hands them out */
+int tas_connect_pool(const struct sockaddr *addr, socklen_t addrlen,
+    unsigned num);
+
+/* open num connections round robin over naddrs addresses, filling in fds.
+ * Returns the number opened: with SOCK_NONBLOCK in flags they are still
+ * connecting and complete through epoll, otherwise all are waited for and
+ * failed ones are closed and set to -1 in fds. */
+int tas_connect_many(const struct sockaddr_in *addrs, unsigned naddrs,
+    int *fds, unsigned num, int flags);
+
 
 ssize_t tas_read(int fd, void *buf, size_t count);
 
@@ -84,6 +100,26 @@ ssize_t tas_sendto(int sockfd, const void *buf, size_t len, int flags,
 
 ssize_t tas_sendmsg(int sockfd, const struct msghdr *msg, int flags);
 
+ssize_t tas_readv(int sockfd, const struct iovec *iov, int iovcnt);
+
+ssize_t tas_writev(int sockfd, const struct iovec *iov, int iovcnt);
+
+/* out_fd has to be a connection, the file is read directly into its transmit
+ * buffer */
+ssize_t tas_sendfile(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/* zero copy receive: points iov[0] and iov[1] at up to len received bytes in
+ * the receive buffer, which stay valid until handed back in order with
+ * tas_recv_zc_release(). flags must be 0. Returns 0 only on EOF, len 0 fails
+ * with EAGAIN if nothing was received and EINVAL otherwise. */
+ssize_t tas_recv_zc(int sockfd, struct iovec *iov, size_t len, int flags);
+
+int tas_recv_zc_release(int sockfd, size_t len);
+
+/* move up to len received bytes from in_fd to out_fd in one copy, flags must
+ * be 0 */
+ssize_t tas_forward(int in_fd, int out_fd, size_t len, int flags);
+
 
 int tas_epoll_create(int size);
 
@@ -29,8 +29,11 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
 
 #include <tas_ll.h>
+#include <utils.h>
+#include <utils_sync.h>
 
 enum filehandle_type {
   SOCK_UNUSED = 0,
@@ -43,8 +46,33 @@ enum socket_flags {
   SOF_NONBLOCK = 1,
   SOF_BOUND = 2,
   SOF_REUSEPORT = 4,
+  SOF_ZEROCOPY = 8,
+  SOF_PREFER_BUSY_POLL = 16,
 };
 
+/** Spin budget for never blocking */
+#define SOCK_SPIN_FOREVER UINT32_MAX
+
+/* for older headers */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
 enum conn_status {
   SOC_CONNECTING = 0,
   SOC_CONNECTED = 1,
@@ -64,6 +92,9 @@ enum conn_stflags {
   CSTF_TXCLOSED_ACK = 4,
 };
 
+/** Max. number of accepts kept outstanding per listener and context */
+#define SOCKET_ACCEPT_PREPOST 16
+
 struct socket_pending {
   struct socket *s;
   struct flextcp_context *ctx;
@@ -81,8 +112,20 @@ struct socket_conn {
   void *rx_buf_2;
   size_t rx_len_1;
   size_t rx_len_2;
+  /* lent out by tas_recv_zc() and not released yet, and everything
+   * consumed since the first of those: freed once all are released */
+  size_t rx_lent;
+  size_t rx_held;
+  /** context the connection is currently bound to */
   struct flextcp_context *ctx;
+  /** INT_MIN while a move to another context is in flight */
   int move_status;
+  /** MSG_ZEROCOPY: id of the next send, and range of completed sends not
+   * reported on the error queue yet */
+  uint32_t zc_next;
+  uint32_t zc_lo;
+  uint32_t zc_hi;
+  uint8_t zc_pending;
 };
 
 struct socket_listen {
@@ -92,6 +135,17 @@ struct socket_listen {
   uint8_t status;
 };
 
+/** Pre-established connections to one destination */
+struct connpool {
+  uint32_t ip;
+  uint16_t port;
+  /** Connections to keep per context */
+  unsigned num;
+  /** Pooled connections of all contexts */
+  struct socket_pending *conns;
+  struct connpool *next;
+};
+
 struct socket {
   union {
     struct socket_conn connection;
@@ -100,17 +154,26 @@ struct socket {
   struct sockaddr_in addr;
   uint8_t flags;
   uint8_t type;
+  /** SO_RCVBUF/SO_SNDBUF hints for connect/listen, 0 for default */
+  uint32_t rxbuf_len;
+  uint32_t txbuf_len;
+  /** TCP_CONGESTION algorithm for connect/listen, FLEXTCP_CC_* */
+  uint8_t cc;
+  /** SO_BUSY_POLL: us to spin before blocking, 0 for default */
+  uint32_t busy_poll_us;
+
+  /** protects the socket against concurrent threads and their event
+   * handlers, never held while polling a context */
+  volatile uint32_t lock;
 
   /** epoll events currently active on this socket */
   uint32_t ep_events;
   /** epoll fds without EPOLLEXCLUSIVE */
   struct epoll_socket *eps;
-#if 0
-  /** first epoll fd with EPOLLEXCLUSIVE */
+  /** first epoll fd with EPOLLEXCLUSIVE, next one to be woken up */
   struct epoll_socket *eps_exc_first;
   /** last epoll fd with EPOLLEXCLUSIVE */
   struct epoll_socket *eps_exc_last;
-#endif
 };
 
 struct epoll {
@@ -123,6 +186,12 @@ struct epoll {
   uint32_t num_linux;
   uint32_t num_active;
   uint8_t linux_cnt;
+  /** protects the lists, taken after the socket lock */
+  volatile uint32_t lock;
+  /** context of the thread that last waited on this epoll */
+  struct flextcp_context *ctx;
+  /** largest spin budget of the sockets added, 0 for default */
+  uint32_t busy_poll_us;
 };
 
 struct epoll_socket {
@@ -138,6 +207,10 @@ struct epoll_socket {
   epoll_data_t data;
   uint32_t mask;
   uint8_t active;
+  /** added with EPOLLEXCLUSIVE, on the socket's exclusive list */
+  uint8_t exclusive;
+  /** EPOLLET: taken off the active list once reported */
+  uint8_t edge;
 };
 
 int flextcp_fd_init(void);
@@ -146,13 +219,42 @@ int flextcp_fd_ealloc(struct epoll **pe, int fd);
 int flextcp_fd_slookup(int fd, struct socket **ps);
 int flextcp_fd_elookup(int fd, struct epoll **pe);
 void flextcp_fd_release(int fd);
+void flextcp_fd_sreplace(int fd, struct socket *s);
 void flextcp_fd_close(int fd);
+/** Allocate zeroed socket struct without fd */
+struct socket *flextcp_sock_alloc(void);
+void flextcp_sock_free(struct socket *s);
 
 struct flextcp_context *flextcp_sockctx_get(void);
 int flextcp_sockctx_poll(struct flextcp_context *ctx);
 int flextcp_sockctx_poll_n(struct flextcp_context *ctx, unsigned n);
+/** Poll once while waiting, blocking after budget us without events */
+int flextcp_sockctx_wait(struct flextcp_context *ctx, uint32_t budget);
+/** Spin budget to use, shortened if events arrive much further apart */
+uint32_t flextcp_sockctx_spin(uint32_t budget);
 
 void flextcp_sockclose_finish(struct flextcp_context *ctx, struct socket *s);
+/** Bind connection to ctx, moving it if needed. Called with the socket lock
+ * held, which is dropped while waiting for the move. */
+int flextcp_sock_adopt(struct flextcp_context *ctx, struct socket *s);
+
+static inline uint32_t flextcp_sock_spin_budget(struct socket *s)
+{
+  if ((s->flags & SOF_PREFER_BUSY_POLL) == SOF_PREFER_BUSY_POLL) {
+    return SOCK_SPIN_FOREVER;
+  }
+  return (s->busy_poll_us != 0 ? s->busy_poll_us : POLL_CYCLE);
+}
+
+static inline void flextcp_sock_lock(struct socket *s)
+{
+  util_spin_lock(&s->lock);
+}
+
+static inline void flextcp_sock_unlock(struct socket *s)
+{
+  util_spin_unlock(&s->lock);
+}
 
 void flextcp_epoll_sockinit(struct socket *s);
 void flextcp_epoll_sockclose(struct socket *s);
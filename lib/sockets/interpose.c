@@ -30,6 +30,7 @@
 #include <dlfcn.h>
 #include <pthread.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 
 #include <utils.h>
 #include <tas_sockets.h>
@@ -50,6 +51,7 @@ static int (*libc_accept4)(int sockfd, struct sockaddr *addr,
 static int (*libc_accept)(int sockfd, struct sockaddr *addr,
     socklen_t *addrlen) = NULL;
 static int (*libc_fcntl)(int sockfd, int cmd, ...) = NULL;
+static int (*libc_ioctl)(int fd, unsigned long request, ...) = NULL;
 static int (*libc_getsockopt)(int sockfd, int level, int optname, void *optval,
     socklen_t *optlen) = NULL;
 static int (*libc_setsockopt)(int sockfd, int level, int optname,
@@ -72,6 +74,12 @@ static ssize_t (*libc_sendto)(int sockfd, const void *buf, size_t len,
     int flags, const struct sockaddr *dest_addr, socklen_t addrlen) = NULL;
 static ssize_t (*libc_sendmsg)(int sockfd, const struct msghdr *msg, int flags)
     = NULL;
+static ssize_t (*libc_readv)(int fd, const struct iovec *iov, int iovcnt)
+    = NULL;
+static ssize_t (*libc_writev)(int fd, const struct iovec *iov, int iovcnt)
+    = NULL;
+static ssize_t (*libc_sendfile)(int out_fd, int in_fd, off_t *offset,
+    size_t count) = NULL;
 static int (*libc_select)(int nfds, fd_set *readfds, fd_set *writefds,
 			  fd_set *exceptfds, struct timeval *timeout) = NULL;
 
@@ -176,6 +184,23 @@ int fcntl(int sockfd, int cmd, ...)
   return ret;
 }
 
+int ioctl(int fd, unsigned long request, ...)
+{
+  int ret;
+  void *arg;
+  va_list val;
+  ensure_init();
+
+  va_start(val, request);
+  arg = va_arg(val, void *);
+  va_end(val);
+
+  if ((ret = tas_ioctl(fd, request, arg)) == -1 && errno == EBADF) {
+    return libc_ioctl(fd, request, arg);
+  }
+  return ret;
+}
+
 int getsockopt(int sockfd, int level, int optname, void *optval,
     socklen_t *optlen)
 {
@@ -308,6 +333,38 @@ ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
   return ret;
 }
 
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+  ssize_t ret;
+  ensure_init();
+  if ((ret = tas_readv(fd, iov, iovcnt)) == -1 && errno == EBADF) {
+    return libc_readv(fd, iov, iovcnt);
+  }
+  return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  ssize_t ret;
+  ensure_init();
+  if ((ret = tas_writev(fd, iov, iovcnt)) == -1 && errno == EBADF) {
+    return libc_writev(fd, iov, iovcnt);
+  }
+  return ret;
+}
+
+ssize_t sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+  ssize_t ret;
+  ensure_init();
+  if ((ret = tas_sendfile(out_fd, in_fd, offset, count)) == -1 &&
+      errno == EBADF)
+  {
+    return libc_sendfile(out_fd, in_fd, offset, count);
+  }
+  return ret;
+}
+
 int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
     struct timeval *timeout)
 {
@@ -365,6 +422,7 @@ static void init(void)
   libc_accept4 = bind_symbol("accept4");
   libc_accept = bind_symbol("accept");
   libc_fcntl = bind_symbol("fcntl");
+  libc_ioctl = bind_symbol("ioctl");
   libc_getsockopt = bind_symbol("getsockopt");
   libc_setsockopt = bind_symbol("setsockopt");
   libc_getsockname = bind_symbol("getsockname");
@@ -377,6 +435,9 @@ static void init(void)
   libc_send = bind_symbol("send");
   libc_sendto = bind_symbol("sendto");
   libc_sendmsg = bind_symbol("sendmsg");
+  libc_readv = bind_symbol("readv");
+  libc_writev = bind_symbol("writev");
+  libc_sendfile = bind_symbol("sendfile");
   libc_select = bind_symbol("select");
 
   if (tas_init() != 0) {
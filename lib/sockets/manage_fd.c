@@ -25,14 +25,28 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <dlfcn.h>
 #include <utils.h>
+#include <utils_sync.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
 
 #include "internal.h"
 
-#define MAXSOCK 1024 * 1024
+/* file handles are kept in a two level table, second level tables are
+ * allocated on first use and never freed, so lookups need no locks */
+#define FH_L2_BITS 12
+#define FH_L2_NUM (1 << FH_L2_BITS)
+#define FH_L1_NUM 4096
+#define MAXSOCK (FH_L1_NUM * FH_L2_NUM)
+
+/* number of fds reserved in the kernel at once */
+#define FD_RESERVE_NUM 256
+/* number of sockets allocated at once */
+#define SOCK_SLAB_NUM 256
 
 enum fh_type {
   FH_UNUSED,
@@ -48,42 +62,200 @@ struct filehandle {
   uint8_t type;
 };
 
-static struct filehandle fhs[MAXSOCK];
+static struct filehandle *fhs[FH_L1_NUM];
+static volatile uint32_t fhs_lock = 0;
+
+/* fds reserved in the kernel as duplicates of fd_placeholder, but not used
+ * for a socket right now */
+static int fd_placeholder = -1;
+static int *fd_free = NULL;
+static unsigned fd_free_num = 0;
+static unsigned fd_free_cap = 0;
+static volatile uint32_t fd_lock = 0;
+/* with interposition close is ours, fds we never handed out go to libc */
+static int (*libc_close)(int fd) = NULL;
+
+/* free sockets, linked through their first bytes */
+static void *sock_free = NULL;
+static volatile uint32_t sock_lock = 0;
 
 int flextcp_fd_init(void)
 {
+  void *handle;
+
+  if ((handle = dlopen("libc.so.6", RTLD_LAZY)) == NULL) {
+    perror("flextcp_fd_init: dlopen on libc failed");
+    return -1;
+  }
+  if ((libc_close = dlsym(handle, "close")) == NULL) {
+    perror("flextcp_fd_init: dlsym close failed");
+    return -1;
+  }
+
+  if ((fd_placeholder = eventfd(0, 0)) < 0) {
+    perror("flextcp_fd_init: eventfd failed");
+    return -1;
+  }
   return 0;
 }
 
+static inline struct filehandle *fh_lookup(int fd)
+{
+  struct filehandle *t;
+
+  if (fd < 0 || fd >= MAXSOCK ||
+      (t = fhs[fd >> FH_L2_BITS]) == NULL)
+  {
+    return NULL;
+  }
+  return &t[fd & (FH_L2_NUM - 1)];
+}
+
+/* get file handle for fd, allocating its table if necessary */
+static struct filehandle *fh_get(int fd)
+{
+  struct filehandle *fh, *t;
+
+  if (fd < 0 || fd >= MAXSOCK) {
+    errno = EMFILE;
+    return NULL;
+  }
+
+  if ((fh = fh_lookup(fd)) != NULL) {
+    return fh;
+  }
+
+  util_spin_lock(&fhs_lock);
+  if ((t = fhs[fd >> FH_L2_BITS]) == NULL) {
+    if ((t = calloc(FH_L2_NUM, sizeof(*t))) == NULL) {
+      util_spin_unlock(&fhs_lock);
+      errno = ENOMEM;
+      return NULL;
+    }
+    MEM_BARRIER();
+    fhs[fd >> FH_L2_BITS] = t;
+  }
+  util_spin_unlock(&fhs_lock);
+
+  return &t[fd & (FH_L2_NUM - 1)];
+}
+
+/* reserve more fds in the kernel, called with fd_lock held */
+static int fd_reserve(void)
+{
+  unsigned i;
+  int *nf, fd;
+
+  if (fd_free_cap - fd_free_num < FD_RESERVE_NUM) {
+    nf = realloc(fd_free, (fd_free_cap + FD_RESERVE_NUM) * sizeof(*nf));
+    if (nf == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    fd_free = nf;
+    fd_free_cap += FD_RESERVE_NUM;
+  }
+
+  /* duplicates only take up slots in the fd table, not new files */
+  for (i = 0; i < FD_RESERVE_NUM; i++) {
+    if ((fd = fcntl(fd_placeholder, F_DUPFD, 0)) < 0) {
+      break;
+    }
+
+    if (fd >= MAXSOCK) {
+      libc_close(fd);
+      errno = EMFILE;
+      break;
+    }
+    fd_free[fd_free_num++] = fd;
+  }
+
+  return (fd_free_num > 0 ? 0 : -1);
+}
+
+static int fd_alloc(void)
+{
+  int fd = -1;
+
+  util_spin_lock(&fd_lock);
+  if (fd_free_num > 0 || fd_reserve() == 0) {
+    fd = fd_free[--fd_free_num];
+  }
+  util_spin_unlock(&fd_lock);
+
+  return fd;
+}
+
+static void fd_free_put(int fd)
+{
+  /* room was made when the fd was reserved */
+  util_spin_lock(&fd_lock);
+  assert(fd_free_num < fd_free_cap);
+  fd_free[fd_free_num++] = fd;
+  util_spin_unlock(&fd_lock);
+}
+
+struct socket *flextcp_sock_alloc(void)
+{
+  struct socket *s, *slab;
+  unsigned i;
+
+  util_spin_lock(&sock_lock);
+  if (sock_free == NULL) {
+    if ((slab = calloc(SOCK_SLAB_NUM, sizeof(*slab))) == NULL) {
+      util_spin_unlock(&sock_lock);
+      errno = ENOMEM;
+      return NULL;
+    }
+
+    for (i = 0; i < SOCK_SLAB_NUM; i++) {
+      *(void **) &slab[i] = sock_free;
+      sock_free = &slab[i];
+    }
+  }
+
+  s = sock_free;
+  sock_free = *(void **) s;
+  util_spin_unlock(&sock_lock);
+
+  memset(s, 0, sizeof(*s));
+  return s;
+}
+
+void flextcp_sock_free(struct socket *s)
+{
+  util_spin_lock(&sock_lock);
+  *(void **) s = sock_free;
+  sock_free = s;
+  util_spin_unlock(&sock_lock);
+}
 
 int flextcp_fd_salloc(struct socket **ps)
 {
+  struct filehandle *fh;
   struct socket *s;
   int fd;
 
-  if ((s = calloc(1, sizeof(*s))) == NULL) {
-    errno = ENOMEM;
+  if ((s = flextcp_sock_alloc()) == NULL) {
     return -1;
   }
 
-  /* get eventfd so we reserve the FD in the kernel to avoid overlap */
-  if ((fd = eventfd(0, 0)) < 0) {
-    free(s);
+  /* fds come from a range reserved in the kernel to avoid overlap */
+  if ((fd = fd_alloc()) < 0) {
+    flextcp_sock_free(s);
     return -1;
   }
 
-  /* no more file handles available */
-  if (fd >= MAXSOCK) {
-    free(s);
-    /* TODO: enusure this is the libc close */
-    close(fd);
-    errno = EMFILE;
+  if ((fh = fh_get(fd)) == NULL) {
+    fd_free_put(fd);
+    flextcp_sock_free(s);
     return -1;
   }
 
   s->type = SOCK_SOCKET;
-  fhs[fd].data.s = s;
-  fhs[fd].type = FH_SOCKET;
+  fh->data.s = s;
+  MEM_BARRIER();
+  fh->type = FH_SOCKET;
 
   *ps = s;
 
@@ -92,34 +264,37 @@ int flextcp_fd_salloc(struct socket **ps)
 
 int flextcp_fd_slookup(int fd, struct socket **ps)
 {
-  if (fd >= MAXSOCK || fhs[fd].type != FH_SOCKET) {
+  struct filehandle *fh = fh_lookup(fd);
+
+  if (fh == NULL || fh->type != FH_SOCKET) {
     errno = EBADF;
     return -1;
   }
 
-  *ps = fhs[fd].data.s;
+  *ps = fh->data.s;
   return 0;
 }
 
 int flextcp_fd_ealloc(struct epoll **pe, int fd)
 {
+  struct filehandle *fh;
   struct epoll *e;
 
   /* no more file handles available */
-  if (fd >= MAXSOCK) {
-    errno = EMFILE;
+  if ((fh = fh_get(fd)) == NULL) {
     return -1;
   }
 
-  assert(fhs[fd].type == FH_UNUSED);
+  assert(fh->type == FH_UNUSED);
 
   if ((e = calloc(1, sizeof(*e))) == NULL) {
     errno = ENOMEM;
     return -1;
   }
 
-  fhs[fd].data.e = e;
-  fhs[fd].type = FH_EPOLL;
+  fh->data.e = e;
+  MEM_BARRIER();
+  fh->type = FH_EPOLL;
 
   *pe = e;
 
@@ -128,12 +303,14 @@ int flextcp_fd_ealloc(struct epoll **pe, int fd)
 
 int flextcp_fd_elookup(int fd, struct epoll **pe)
 {
-  if (fd >= MAXSOCK || fhs[fd].type != FH_EPOLL) {
+  struct filehandle *fh = fh_lookup(fd);
+
+  if (fh == NULL || fh->type != FH_EPOLL) {
     errno = EBADF;
     return -1;
   }
 
-  *pe = fhs[fd].data.e;
+  *pe = fh->data.e;
   return 0;
 }
 
@@ -141,11 +318,25 @@ void flextcp_fd_release(int fd)
 {
 }
 
+/* point fd to a different socket struct, the old one is not freed */
+void flextcp_fd_sreplace(int fd, struct socket *s)
+{
+  struct filehandle *fh = fh_lookup(fd);
+
+  assert(fh != NULL && fh->type == FH_SOCKET);
+  fh->data.s = s;
+  MEM_BARRIER();
+}
+
 void flextcp_fd_close(int fd)
 {
-  fhs[fd].data.s = NULL;
-  fhs[fd].type = FH_UNUSED;
+  struct filehandle *fh = fh_lookup(fd);
+
+  assert(fh != NULL);
+  fh->data.s = NULL;
+  fh->type = FH_UNUSED;
   MEM_BARRIER();
-  /* TODO: enusure this is the libc close */
-  close(fd);
+
+  /* the fd stays reserved in the kernel for the next socket */
+  fd_free_put(fd);
 }
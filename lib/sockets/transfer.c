@@ -28,6 +28,8 @@
 #include <stddef.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <utils.h>
 #include <utils_circ.h>
@@ -37,6 +39,33 @@
 #include "internal.h"
 #include "../tas/internal.h"
 
+static inline void conn_rx_done(struct flextcp_context *ctx, struct socket *s,
+    size_t len);
+static inline void conn_zc_sent(struct socket *s, int flags);
+static ssize_t conn_zc_errqueue(struct socket *s, struct msghdr *msg);
+
+/* poll the context without holding the socket lock, so event handlers on
+ * this and other threads can get to the socket */
+static inline void sock_poll(struct flextcp_context *ctx, struct socket *s)
+{
+  flextcp_sock_unlock(s);
+  flextcp_sockctx_poll(ctx);
+  flextcp_sock_lock(s);
+}
+
+/* same as sock_poll() while waiting, blocking after the socket's spin budget,
+ * and take the socket back if another thread moved it to its context
+ * meanwhile */
+static inline int sock_wait(struct flextcp_context *ctx, struct socket *s)
+{
+  uint32_t budget = flextcp_sock_spin_budget(s);
+
+  flextcp_sock_unlock(s);
+  flextcp_sockctx_wait(ctx, budget);
+  flextcp_sock_lock(s);
+  return flextcp_sock_adopt(ctx, s);
+}
+
 ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
 {
   struct socket *s;
@@ -49,6 +78,7 @@ ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
     errno = EBADF;
     return -1;
   }
+  flextcp_sock_lock(s);
 
   /* not a connection, or not connected */
   if (s->type != SOCK_CONNECTION ||
@@ -59,6 +89,11 @@ ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
     goto out;
   }
 
+  if ((flags & MSG_ERRQUEUE) == MSG_ERRQUEUE) {
+    ret = conn_zc_errqueue(s, msg);
+    goto out;
+  }
+
   /* return 0 if 0 length */
   len = 0;
   iov = msg->msg_iov;
@@ -70,6 +105,10 @@ ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
   }
 
   ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
 
   /* wait for data if necessary, or abort if non-blocking */
   if (s->data.connection.rx_len_1 == 0 &&
@@ -85,7 +124,10 @@ ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
       while (s->data.connection.rx_len_1 == 0 &&
         !(s->data.connection.st_flags & CSTF_RXCLOSED))
       {
-        flextcp_sockctx_poll(ctx);
+        if (sock_wait(ctx, s) != 0) {
+          ret = -1;
+          goto out;
+        }
       }
     }
   }
@@ -120,9 +162,10 @@ ssize_t tas_recvmsg(int sockfd, struct msghdr *msg, int flags)
     {
       flextcp_epoll_clear(s, EPOLLIN);
     }
-    flextcp_connection_rx_done(ctx, &s->data.connection.c, ret);
+    conn_rx_done(ctx, s, ret);
   }
 out:
+  flextcp_sock_unlock(s);
   flextcp_fd_release(sockfd);
   return ret;
 }
@@ -138,6 +181,7 @@ static inline ssize_t recv_simple(int sockfd, void *buf, size_t len, int flags)
     errno = EBADF;
     return -1;
   }
+  flextcp_sock_lock(s);
 
   /* not a connection, or not connected */
   if (s->type != SOCK_CONNECTION ||
@@ -154,6 +198,10 @@ static inline ssize_t recv_simple(int sockfd, void *buf, size_t len, int flags)
   }
 
   ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
 
   /* wait for data if necessary, or abort if non-blocking */
   if (s->data.connection.rx_len_1 == 0 &&
@@ -168,7 +216,10 @@ static inline ssize_t recv_simple(int sockfd, void *buf, size_t len, int flags)
       while (s->data.connection.rx_len_1 == 0 &&
         !(s->data.connection.st_flags & CSTF_RXCLOSED))
       {
-        flextcp_sockctx_poll(ctx);
+        if (sock_wait(ctx, s) != 0) {
+          ret = -1;
+          goto out;
+        }
       }
     }
   }
@@ -196,9 +247,10 @@ static inline ssize_t recv_simple(int sockfd, void *buf, size_t len, int flags)
     {
       flextcp_epoll_clear(s, EPOLLIN);
     }
-    flextcp_connection_rx_done(ctx, &s->data.connection.c, ret);
+    conn_rx_done(ctx, s, ret);
   }
 out:
+  flextcp_sock_unlock(s);
   flextcp_fd_release(sockfd);
   return ret;
 }
@@ -219,6 +271,7 @@ ssize_t tas_sendmsg(int sockfd, const struct msghdr *msg, int flags)
     errno = EBADF;
     return -1;
   }
+  flextcp_sock_lock(s);
 
   /* not a connection, or not connected */
   if (s->type != SOCK_CONNECTION ||
@@ -241,6 +294,10 @@ ssize_t tas_sendmsg(int sockfd, const struct msghdr *msg, int flags)
   }
 
   ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
 
   /* make sure there is space in the transmit queue if the socket is
    * non-blocking */
@@ -267,7 +324,10 @@ ssize_t tas_sendmsg(int sockfd, const struct msghdr *msg, int flags)
       goto out;
     } else {
       do {
-        flextcp_sockctx_poll(ctx);
+        if (sock_wait(ctx, s) != 0) {
+          ret = -1;
+          goto out;
+        }
 
         ret = flextcp_connection_tx_alloc2(&s->data.connection.c, len, &dst_1,
             &len_1, &dst_2);
@@ -295,10 +355,12 @@ ssize_t tas_sendmsg(int sockfd, const struct msghdr *msg, int flags)
   /* send out */
   /* TODO: this should not block for non-blocking sockets */
   while (flextcp_connection_tx_send(ctx, &s->data.connection.c, ret) != 0) {
-    flextcp_sockctx_poll(ctx);
+    sock_poll(ctx, s);
   }
+  conn_zc_sent(s, flags);
 
 out:
+  flextcp_sock_unlock(s);
   flextcp_fd_release(sockfd);
   return ret;
 }
@@ -316,6 +378,7 @@ static inline ssize_t send_simple(int sockfd, const void *buf, size_t len,
     errno = EBADF;
     return -1;
   }
+  flextcp_sock_lock(s);
 
   /* not a connection, or not connected */
   if (s->type != SOCK_CONNECTION ||
@@ -333,6 +396,10 @@ static inline ssize_t send_simple(int sockfd, const void *buf, size_t len,
   }
 
   ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
 
   /* make sure there is space in the transmit queue if the socket is
    * non-blocking */
@@ -359,7 +426,10 @@ static inline ssize_t send_simple(int sockfd, const void *buf, size_t len,
       goto out;
     } else {
       do {
-        flextcp_sockctx_poll(ctx);
+        if (sock_wait(ctx, s) != 0) {
+          ret = -1;
+          goto out;
+        }
 
         ret = flextcp_connection_tx_alloc2(&s->data.connection.c, len, &dst_1,
             &len_1, &dst_2);
@@ -379,10 +449,12 @@ static inline ssize_t send_simple(int sockfd, const void *buf, size_t len,
   /* send out */
   /* TODO: this should not block for non-blocking sockets */
   while (flextcp_connection_tx_send(ctx, &s->data.connection.c, ret) != 0) {
-    flextcp_sockctx_poll(ctx);
+    sock_poll(ctx, s);
   }
+  conn_zc_sent(s, flags);
 
 out:
+  flextcp_sock_unlock(s);
   flextcp_fd_release(sockfd);
   return ret;
 }
@@ -431,3 +503,531 @@ ssize_t tas_sendto(int sockfd, const void *buf, size_t len, int flags,
 {
   return send_simple(sockfd, buf, len, flags);
 }
+
+ssize_t tas_readv(int sockfd, const struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+  return tas_recvmsg(sockfd, &msg, 0);
+}
+
+ssize_t tas_writev(int sockfd, const struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec *) iov;
+  msg.msg_iovlen = iovcnt;
+  return tas_sendmsg(sockfd, &msg, 0);
+}
+
+/******************************************************************************/
+/* MSG_ZEROCOPY: the payload always goes through the transmit buffer, which
+ * the fast path sends from without another copy. User buffers are not
+ * pinned, since the NIC can only reach the shared memory region, so sends
+ * complete right away and are reported as copied, the same way linux
+ * reports sends it fell back to copying for. */
+
+static inline void conn_zc_sent(struct socket *s, int flags)
+{
+  uint32_t id;
+
+  if ((flags & MSG_ZEROCOPY) == 0 || (s->flags & SOF_ZEROCOPY) == 0) {
+    return;
+  }
+
+  id = s->data.connection.zc_next++;
+  if (s->data.connection.zc_pending) {
+    s->data.connection.zc_hi = id;
+  } else {
+    s->data.connection.zc_lo = s->data.connection.zc_hi = id;
+    s->data.connection.zc_pending = 1;
+  }
+  flextcp_epoll_set(s, EPOLLERR);
+}
+
+/* report pending completions as one coalesced range, like linux does */
+static ssize_t conn_zc_errqueue(struct socket *s, struct msghdr *msg)
+{
+  struct cmsghdr *cm;
+  struct sock_extended_err *ee;
+
+  if (!s->data.connection.zc_pending) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  msg->msg_flags = MSG_ERRQUEUE;
+  if (msg->msg_control == NULL ||
+      msg->msg_controllen < CMSG_SPACE(sizeof(*ee)))
+  {
+    msg->msg_flags |= MSG_CTRUNC;
+    msg->msg_controllen = 0;
+    return 0;
+  }
+
+  cm = CMSG_FIRSTHDR(msg);
+  cm->cmsg_level = SOL_IP;
+  cm->cmsg_type = IP_RECVERR;
+  cm->cmsg_len = CMSG_LEN(sizeof(*ee));
+  ee = (struct sock_extended_err *) CMSG_DATA(cm);
+  memset(ee, 0, sizeof(*ee));
+  ee->ee_origin = SO_EE_ORIGIN_ZEROCOPY;
+  ee->ee_code = SO_EE_CODE_ZEROCOPY_COPIED;
+  ee->ee_info = s->data.connection.zc_lo;
+  ee->ee_data = s->data.connection.zc_hi;
+  msg->msg_controllen = CMSG_SPACE(sizeof(*ee));
+
+  /* a failed connection keeps reporting its error */
+  s->data.connection.zc_pending = 0;
+  if (s->data.connection.status != SOC_FAILED) {
+    flextcp_epoll_clear(s, EPOLLERR);
+  }
+  return 0;
+}
+
+/******************************************************************************/
+/* zero copy receive and forwarding */
+
+/* free received bytes in the rx buffer, unless some are still lent out */
+static inline void conn_rx_done(struct flextcp_context *ctx, struct socket *s,
+    size_t len)
+{
+  if (s->data.connection.rx_lent > 0) {
+    s->data.connection.rx_held += len;
+    return;
+  }
+
+  flextcp_connection_rx_done(ctx, &s->data.connection.c, len);
+}
+
+/* remove len received bytes from the socket, without freeing them */
+static inline void conn_rx_consume(struct socket *s, size_t len)
+{
+  size_t l;
+
+  l = MIN(len, s->data.connection.rx_len_1);
+  s->data.connection.rx_buf_1 = (uint8_t *) s->data.connection.rx_buf_1 + l;
+  s->data.connection.rx_len_1 -= l;
+  len -= l;
+
+  if (s->data.connection.rx_len_1 == 0) {
+    s->data.connection.rx_buf_1 =
+      (uint8_t *) s->data.connection.rx_buf_2 + len;
+    s->data.connection.rx_len_1 = s->data.connection.rx_len_2 - len;
+    s->data.connection.rx_buf_2 = NULL;
+    s->data.connection.rx_len_2 = 0;
+  }
+
+  if (s->data.connection.rx_len_1 == 0 &&
+      !(s->data.connection.st_flags & CSTF_RXCLOSED))
+  {
+    flextcp_epoll_clear(s, EPOLLIN);
+  }
+}
+
+/* returns 0 once data is available or the socket is closed for receiving */
+static inline int conn_rx_wait(struct flextcp_context *ctx, struct socket *s)
+{
+  if (s->data.connection.rx_len_1 != 0 ||
+      (s->data.connection.st_flags & CSTF_RXCLOSED))
+  {
+    return 0;
+  }
+
+  flextcp_epoll_clear(s, EPOLLIN);
+  if ((s->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  while (s->data.connection.rx_len_1 == 0 &&
+    !(s->data.connection.st_flags & CSTF_RXCLOSED))
+  {
+    if (sock_wait(ctx, s) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+ssize_t tas_recv_zc(int sockfd, struct iovec *iov, size_t len, int flags)
+{
+  struct socket *s;
+  struct flextcp_context *ctx;
+  ssize_t ret = 0;
+
+  /* no flags defined yet */
+  if (flags != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (flextcp_fd_slookup(sockfd, &s) != 0) {
+    errno = EBADF;
+    return -1;
+  }
+  flextcp_sock_lock(s);
+
+  /* not a connection, or not connected */
+  if (s->type != SOCK_CONNECTION ||
+      s->data.connection.status != SOC_CONNECTED)
+  {
+    errno = ENOTCONN;
+    ret = -1;
+    goto out;
+  }
+
+  /* nothing can be lent for len 0, and returning 0 would look like EOF */
+  iov[0].iov_len = iov[1].iov_len = 0;
+  if (len == 0) {
+    if (s->data.connection.rx_len_1 != 0) {
+      errno = EINVAL;
+      ret = -1;
+    } else if (!(s->data.connection.st_flags & CSTF_RXCLOSED)) {
+      errno = EAGAIN;
+      ret = -1;
+    }
+    goto out;
+  }
+
+  ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
+  if (conn_rx_wait(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
+
+  /* lend out at most both pieces of the rx buffer */
+  iov[0].iov_base = s->data.connection.rx_buf_1;
+  iov[0].iov_len = MIN(len, s->data.connection.rx_len_1);
+  iov[1].iov_base = s->data.connection.rx_buf_2;
+  iov[1].iov_len = MIN(len - iov[0].iov_len, s->data.connection.rx_len_2);
+  ret = iov[0].iov_len + iov[1].iov_len;
+
+  if (ret > 0) {
+    conn_rx_consume(s, ret);
+    s->data.connection.rx_lent += ret;
+    s->data.connection.rx_held += ret;
+  }
+out:
+  flextcp_sock_unlock(s);
+  flextcp_fd_release(sockfd);
+  return ret;
+}
+
+int tas_recv_zc_release(int sockfd, size_t len)
+{
+  struct socket *s;
+  struct flextcp_context *ctx;
+  int ret = 0;
+
+  if (flextcp_fd_slookup(sockfd, &s) != 0) {
+    errno = EBADF;
+    return -1;
+  }
+  flextcp_sock_lock(s);
+
+  if (s->type != SOCK_CONNECTION || len > s->data.connection.rx_lent) {
+    errno = EINVAL;
+    ret = -1;
+    goto out;
+  }
+
+  s->data.connection.rx_lent -= len;
+  if (s->data.connection.rx_lent == 0 && s->data.connection.rx_held > 0) {
+    ctx = flextcp_sockctx_get();
+    flextcp_connection_rx_done(ctx, &s->data.connection.c,
+        s->data.connection.rx_held);
+    s->data.connection.rx_held = 0;
+  }
+out:
+  flextcp_sock_unlock(s);
+  flextcp_fd_release(sockfd);
+  return ret;
+}
+
+/* bind both sockets to ctx and lock them in address order */
+static int forward_lock(struct flextcp_context *ctx, struct socket *in,
+    struct socket *out)
+{
+  struct socket *first = (in < out ? in : out);
+  struct socket *second = (in < out ? out : in);
+
+  do {
+    flextcp_sock_lock(in);
+    if (flextcp_sock_adopt(ctx, in) != 0) {
+      flextcp_sock_unlock(in);
+      return -1;
+    }
+    flextcp_sock_unlock(in);
+
+    flextcp_sock_lock(out);
+    if (flextcp_sock_adopt(ctx, out) != 0) {
+      flextcp_sock_unlock(out);
+      return -1;
+    }
+    flextcp_sock_unlock(out);
+
+    flextcp_sock_lock(first);
+    flextcp_sock_lock(second);
+    if (in->data.connection.ctx == ctx && out->data.connection.ctx == ctx) {
+      return 0;
+    }
+
+    /* lost one of them to another thread in between */
+    flextcp_sock_unlock(second);
+    flextcp_sock_unlock(first);
+  } while (1);
+}
+
+static inline void forward_unlock(struct socket *in, struct socket *out)
+{
+  flextcp_sock_unlock(in);
+  flextcp_sock_unlock(out);
+}
+
+static inline void forward_poll(struct flextcp_context *ctx, struct socket *in,
+    struct socket *out)
+{
+  forward_unlock(in, out);
+  flextcp_sockctx_poll(ctx);
+  flextcp_sock_lock(in < out ? in : out);
+  flextcp_sock_lock(in < out ? out : in);
+}
+
+ssize_t tas_forward(int in_fd, int out_fd, size_t len, int flags)
+{
+  struct socket *in, *out;
+  struct flextcp_context *ctx;
+  ssize_t ret = 0;
+  size_t len_1, len_2, l;
+  void *dst_1, *dst_2;
+
+  /* no flags defined yet */
+  if (in_fd == out_fd || flags != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (flextcp_fd_slookup(in_fd, &in) != 0) {
+    errno = EBADF;
+    return -1;
+  }
+  if (flextcp_fd_slookup(out_fd, &out) != 0) {
+    flextcp_fd_release(in_fd);
+    errno = EBADF;
+    return -1;
+  }
+
+  /* both need to be connected, and out still open for sending */
+  if (in->type != SOCK_CONNECTION ||
+      in->data.connection.status != SOC_CONNECTED ||
+      out->type != SOCK_CONNECTION ||
+      out->data.connection.status != SOC_CONNECTED ||
+      (out->data.connection.st_flags & CSTF_TXCLOSED) == CSTF_TXCLOSED)
+  {
+    errno = ENOTCONN;
+    ret = -1;
+    goto out_release;
+  }
+
+  if (len == 0) {
+    goto out_release;
+  }
+
+  ctx = flextcp_sockctx_get();
+again:
+  if (forward_lock(ctx, in, out) != 0) {
+    ret = -1;
+    goto out_release;
+  }
+
+  /* wait for data, with both sockets unlocked while polling */
+  if (in->data.connection.rx_len_1 == 0 &&
+      !(in->data.connection.st_flags & CSTF_RXCLOSED))
+  {
+    flextcp_epoll_clear(in, EPOLLIN);
+    if ((in->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+      errno = EAGAIN;
+      ret = -1;
+      goto out;
+    }
+    forward_unlock(in, out);
+    flextcp_sockctx_poll(ctx);
+    goto again;
+  }
+  len = MIN(len, in->data.connection.rx_len_1 + in->data.connection.rx_len_2);
+  if (len == 0) {
+    /* closed for receiving */
+    goto out;
+  }
+
+  /* allocate transmit buffer, waiting for space if blocking */
+  ret = flextcp_connection_tx_alloc2(&out->data.connection.c, len,
+          &dst_1, &len_1, &dst_2);
+  if (ret == 0) {
+    if ((out->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+      errno = EAGAIN;
+      ret = -1;
+      goto out;
+    }
+    forward_unlock(in, out);
+    flextcp_sockctx_poll(ctx);
+    goto again;
+  }
+  if (ret < 0) {
+    fprintf(stderr, "tas_forward: flextcp_connection_tx_alloc failed\n");
+    abort();
+  }
+  len_2 = ret - len_1;
+
+  /* copy straight from the rx into the tx buffer */
+  l = MIN((size_t) ret, in->data.connection.rx_len_1);
+  split_write(in->data.connection.rx_buf_1, l, dst_1, len_1, dst_2, len_2, 0);
+  if (l < (size_t) ret) {
+    split_write(in->data.connection.rx_buf_2, ret - l, dst_1, len_1, dst_2,
+        len_2, l);
+  }
+
+  conn_rx_consume(in, ret);
+  conn_rx_done(ctx, in, ret);
+
+  while (flextcp_connection_tx_send(ctx, &out->data.connection.c, ret) != 0) {
+    forward_poll(ctx, in, out);
+  }
+
+out:
+  forward_unlock(in, out);
+out_release:
+  flextcp_fd_release(out_fd);
+  flextcp_fd_release(in_fd);
+  return ret;
+}
+
+/* give back the last len allocated but unsent bytes of the tx buffer */
+static inline void conn_tx_unalloc(struct flextcp_connection *c, size_t len)
+{
+  if (c->txb_head_alloc >= len) {
+    c->txb_head_alloc -= len;
+  } else {
+    c->txb_head_alloc += c->txb_len - len;
+  }
+}
+
+ssize_t tas_sendfile(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+  struct socket *s, *si;
+  struct flextcp_context *ctx;
+  struct stat st;
+  ssize_t ret = 0, r;
+  size_t len_1, len_2;
+  void *dst_1, *dst_2;
+  off_t off;
+
+  if (flextcp_fd_slookup(out_fd, &s) != 0) {
+    errno = EBADF;
+    return -1;
+  }
+  flextcp_sock_lock(s);
+
+  /* in_fd has to be a file we can read from at an offset */
+  if (flextcp_fd_slookup(in_fd, &si) == 0) {
+    errno = EINVAL;
+    ret = -1;
+    goto out;
+  }
+
+  if (s->type != SOCK_CONNECTION ||
+      s->data.connection.status != SOC_CONNECTED ||
+      (s->data.connection.st_flags & CSTF_TXCLOSED) == CSTF_TXCLOSED)
+  {
+    errno = ENOTCONN;
+    ret = -1;
+    goto out;
+  }
+
+  if (offset != NULL) {
+    off = *offset;
+  } else if ((off = lseek(in_fd, 0, SEEK_CUR)) < 0) {
+    ret = -1;
+    goto out;
+  }
+
+  /* do not allocate past the end of regular files */
+  if (fstat(in_fd, &st) != 0) {
+    ret = -1;
+    goto out;
+  }
+  if (S_ISREG(st.st_mode)) {
+    count = (off < st.st_size ? MIN(count, (size_t) (st.st_size - off)) : 0);
+  }
+  if (count == 0) {
+    goto out;
+  }
+
+  ctx = flextcp_sockctx_get();
+  if (flextcp_sock_adopt(ctx, s) != 0) {
+    ret = -1;
+    goto out;
+  }
+
+  /* allocate transmit buffer, waiting for space if blocking */
+  while ((ret = flextcp_connection_tx_alloc2(&s->data.connection.c, count,
+          &dst_1, &len_1, &dst_2)) == 0)
+  {
+    if ((s->flags & SOF_NONBLOCK) == SOF_NONBLOCK) {
+      errno = EAGAIN;
+      ret = -1;
+      goto out;
+    }
+    if (sock_wait(ctx, s) != 0) {
+      ret = -1;
+      goto out;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "tas_sendfile: flextcp_connection_tx_alloc failed\n");
+    abort();
+  }
+  len_2 = ret - len_1;
+
+  /* read the file straight into the tx buffer */
+  r = pread(in_fd, dst_1, len_1, off);
+  if (r == (ssize_t) len_1 && len_2 > 0) {
+    r = pread(in_fd, dst_2, len_2, off + len_1);
+    r = (r >= 0 ? r + len_1 : (ssize_t) len_1);
+  }
+  if (r <= 0) {
+    conn_tx_unalloc(&s->data.connection.c, ret);
+    ret = (r == 0 ? 0 : -1);
+    goto out;
+  }
+  if (r < ret) {
+    /* file got shorter */
+    conn_tx_unalloc(&s->data.connection.c, ret - r);
+    ret = r;
+  }
+
+  while (flextcp_connection_tx_send(ctx, &s->data.connection.c, ret) != 0) {
+    sock_poll(ctx, s);
+  }
+
+  off += ret;
+  if (offset != NULL) {
+    *offset = off;
+  } else if (lseek(in_fd, off, SEEK_SET) < 0) {
+    perror("tas_sendfile: lseek failed");
+  }
+
+out:
+  flextcp_sock_unlock(s);
+  flextcp_fd_release(out_fd);
+  return ret;
+}
@@ -0,0 +1,431 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tas_async.h>
+#include "internal.h"
+
+#define AR_POLL_BATCH 32
+
+#define ACONN(conn) ((struct flextcp_aconn *) \
+    ((uint8_t *) (conn) - offsetof(struct flextcp_aconn, c)))
+#define ALISTENER(lst) ((struct flextcp_alistener *) \
+    ((uint8_t *) (lst) - offsetof(struct flextcp_alistener, l)))
+
+struct flextcp_aop_slot {
+  struct flextcp_aop op;
+  /* bytes of a send already in the send buffer */
+  size_t done;
+  struct flextcp_aop_slot *next;
+};
+
+static void aop_submit(struct flextcp_aring *r, struct flextcp_aop_slot *s);
+static void aop_complete(struct flextcp_aring *r, struct flextcp_aop_slot *s,
+    int32_t res);
+static void aconn_init(struct flextcp_aconn *ac);
+static void aconn_received(struct flextcp_aconn *ac, void *buf, size_t len);
+static void aconn_recv_progress(struct flextcp_aring *r,
+    struct flextcp_aconn *ac);
+static void aconn_send_progress(struct flextcp_aring *r,
+    struct flextcp_aconn *ac);
+static void aconn_cancel(struct flextcp_aring *r,
+    struct flextcp_aop_slot **first, struct flextcp_aop_slot **last);
+
+int flextcp_aring_init(struct flextcp_aring *r, struct flextcp_context *ctx,
+    unsigned entries)
+{
+  unsigned i;
+
+  if (entries == 0) {
+    fprintf(stderr, "flextcp_aring_init: need at least one entry\n");
+    return -1;
+  }
+
+  memset(r, 0, sizeof(*r));
+  r->ctx = ctx;
+  r->entries = entries;
+
+  if ((r->slots = calloc(entries, sizeof(*r->slots))) == NULL ||
+      (r->cq = calloc(entries, sizeof(*r->cq))) == NULL)
+  {
+    perror("flextcp_aring_init: calloc failed");
+    free(r->slots);
+    return -1;
+  }
+
+  for (i = 0; i < entries; i++) {
+    r->slots[i].next = r->free_slots;
+    r->free_slots = &r->slots[i];
+  }
+  return 0;
+}
+
+void flextcp_aring_destroy(struct flextcp_aring *r)
+{
+  free(r->slots);
+  free(r->cq);
+  r->slots = r->free_slots = NULL;
+  r->cq = NULL;
+}
+
+unsigned flextcp_aring_submit(struct flextcp_aring *r,
+    const struct flextcp_aop *ops, unsigned num)
+{
+  struct flextcp_aop_slot *s;
+  unsigned i;
+
+  /* completions take up room until reaped, so the cq never overflows */
+  for (i = 0; i < num && r->inflight + r->cq_num < r->entries; i++) {
+    s = r->free_slots;
+    r->free_slots = s->next;
+    r->inflight++;
+
+    s->op = ops[i];
+    s->done = 0;
+    s->next = NULL;
+    aop_submit(r, s);
+  }
+
+  return i;
+}
+
+unsigned flextcp_aring_reap(struct flextcp_aring *r, struct flextcp_acqe *cqes,
+    unsigned max)
+{
+  struct flextcp_event evs[AR_POLL_BATCH];
+  struct flextcp_event *ev;
+  struct flextcp_alistener *al;
+  struct flextcp_aconn *ac;
+  int i, n;
+  int16_t status;
+  unsigned k;
+
+  if (r->cq_num < max) {
+    n = flextcp_context_poll(r->ctx, AR_POLL_BATCH, evs);
+    for (i = 0; i < n; i++) {
+      ev = &evs[i];
+      switch (ev->event_type) {
+        case FLEXTCP_EV_LISTEN_OPEN:
+          al = ALISTENER(ev->ev.listen_open.listener);
+          if (al->open != NULL) {
+            aop_complete(r, al->open, ev->ev.listen_open.status);
+            al->open = NULL;
+          }
+          break;
+
+        case FLEXTCP_EV_LISTEN_ACCEPT:
+        case FLEXTCP_EV_CONN_OPEN:
+          if (ev->event_type == FLEXTCP_EV_LISTEN_ACCEPT) {
+            ac = ACONN(ev->ev.listen_accept.conn);
+            status = ev->ev.listen_accept.status;
+          } else {
+            ac = ACONN(ev->ev.conn_open.conn);
+            status = ev->ev.conn_open.status;
+          }
+          if (ac->open != NULL) {
+            aop_complete(r, ac->open, status);
+            ac->open = NULL;
+          }
+          break;
+
+        case FLEXTCP_EV_CONN_RECEIVED:
+          ac = ACONN(ev->ev.conn_received.conn);
+          aconn_received(ac, ev->ev.conn_received.buf,
+              ev->ev.conn_received.len);
+          aconn_recv_progress(r, ac);
+          break;
+
+        case FLEXTCP_EV_CONN_SENDBUF:
+          aconn_send_progress(r, ACONN(ev->ev.conn_sendbuf.conn));
+          break;
+
+        case FLEXTCP_EV_CONN_RXCLOSED:
+          ac = ACONN(ev->ev.conn_rxclosed.conn);
+          ac->rx_closed = 1;
+          aconn_recv_progress(r, ac);
+          break;
+
+        case FLEXTCP_EV_CONN_CLOSED:
+          ac = ACONN(ev->ev.conn_closed.conn);
+          if (ac->close != NULL) {
+            aop_complete(r, ac->close, ev->ev.conn_closed.status);
+            ac->close = NULL;
+          }
+          break;
+
+        default:
+          /* new connections are picked up by pre-posted accepts, other
+           * events need no completion */
+          break;
+      }
+    }
+  }
+
+  for (k = 0; k < max && r->cq_num > 0; k++) {
+    cqes[k] = r->cq[r->cq_head];
+    r->cq_head = (r->cq_head + 1 < r->entries ? r->cq_head + 1 : 0);
+    r->cq_num--;
+  }
+  return k;
+}
+
+static void aop_submit(struct flextcp_aring *r, struct flextcp_aop_slot *s)
+{
+  struct flextcp_aop *op = &s->op;
+  struct flextcp_context *ctx = r->ctx;
+  struct flextcp_aconn *ac;
+  struct flextcp_alistener *al;
+  int ret;
+
+  switch (op->op) {
+    case FLEXTCP_AOP_LISTEN:
+      al = op->u.listen.lst;
+      if (al->open != NULL) {
+        aop_complete(r, s, -EBUSY);
+        return;
+      }
+      al->open = s;
+      if (flextcp_listen_open(ctx, &al->l, op->u.listen.port,
+            op->u.listen.backlog, op->u.listen.flags) != 0)
+      {
+        al->open = NULL;
+        aop_complete(r, s, -EIO);
+      }
+      return;
+
+    case FLEXTCP_AOP_ACCEPT:
+    case FLEXTCP_AOP_CONNECT:
+      if (op->op == FLEXTCP_AOP_ACCEPT) {
+        ac = op->u.accept.conn;
+        aconn_init(ac);
+        ac->open = s;
+        ret = flextcp_listen_accept(ctx, &op->u.accept.lst->l, &ac->c);
+      } else {
+        ac = op->u.connect.conn;
+        aconn_init(ac);
+        ac->open = s;
+        ret = flextcp_connection_open(ctx, &ac->c, op->u.connect.ip,
+            op->u.connect.port);
+      }
+      if (ret != 0) {
+        ac->open = NULL;
+        aop_complete(r, s, -EIO);
+      }
+      return;
+
+    case FLEXTCP_AOP_RECV:
+      ac = op->u.recv.conn;
+      /* a zero length receive would complete with 0 like EOF, so it
+       * completes right away and only reports 0 if the stream has ended */
+      if (op->u.recv.len == 0) {
+        if (ac->rx_len_1 != 0)
+          aop_complete(r, s, -EINVAL);
+        else
+          aop_complete(r, s, ac->rx_closed ? 0 : -EAGAIN);
+        return;
+      }
+      if (ac->recv_last != NULL)
+        ac->recv_last->next = s;
+      else
+        ac->recv_first = s;
+      ac->recv_last = s;
+      aconn_recv_progress(r, ac);
+      return;
+
+    case FLEXTCP_AOP_SEND:
+      ac = op->u.send.conn;
+      if (ac->send_last != NULL)
+        ac->send_last->next = s;
+      else
+        ac->send_first = s;
+      ac->send_last = s;
+      aconn_send_progress(r, ac);
+      return;
+
+    case FLEXTCP_AOP_CLOSE:
+      ac = op->u.close.conn;
+      if (ac->close != NULL) {
+        aop_complete(r, s, -EBUSY);
+        return;
+      }
+
+      /* nothing else completes on a closed connection */
+      aconn_cancel(r, &ac->recv_first, &ac->recv_last);
+      aconn_cancel(r, &ac->send_first, &ac->send_last);
+
+      ac->close = s;
+      if (flextcp_connection_close(ctx, &ac->c) != 0) {
+        ac->close = NULL;
+        aop_complete(r, s, -EIO);
+      }
+      return;
+
+    default:
+      aop_complete(r, s, -EINVAL);
+      return;
+  }
+}
+
+static void aop_complete(struct flextcp_aring *r, struct flextcp_aop_slot *s,
+    int32_t res)
+{
+  struct flextcp_acqe *cqe;
+  unsigned pos;
+
+  pos = r->cq_head + r->cq_num;
+  if (pos >= r->entries)
+    pos -= r->entries;
+
+  cqe = &r->cq[pos];
+  cqe->tag = s->op.tag;
+  cqe->res = res;
+  cqe->op = s->op.op;
+  r->cq_num++;
+
+  r->inflight--;
+  s->next = r->free_slots;
+  r->free_slots = s;
+}
+
+static void aconn_init(struct flextcp_aconn *ac)
+{
+  ac->rx_buf_1 = ac->rx_buf_2 = NULL;
+  ac->rx_len_1 = ac->rx_len_2 = 0;
+  ac->rx_closed = 0;
+  ac->recv_first = ac->recv_last = NULL;
+  ac->send_first = ac->send_last = NULL;
+  ac->open = ac->close = NULL;
+}
+
+/* data arrives in order, in at most two pieces of the circular buffer */
+static void aconn_received(struct flextcp_aconn *ac, void *buf, size_t len)
+{
+  if (ac->rx_len_1 == 0) {
+    ac->rx_buf_1 = buf;
+    ac->rx_len_1 = len;
+    ac->rx_len_2 = 0;
+  } else if (ac->rx_len_2 == 0 &&
+      buf == (uint8_t *) ac->rx_buf_1 + ac->rx_len_1)
+  {
+    ac->rx_len_1 += len;
+  } else if (ac->rx_len_2 != 0 &&
+      buf == (uint8_t *) ac->rx_buf_2 + ac->rx_len_2)
+  {
+    ac->rx_len_2 += len;
+  } else {
+    if (ac->rx_len_2 != 0) {
+      fprintf(stderr, "aconn_received: more than two buffer pieces\n");
+      abort();
+    }
+    ac->rx_buf_2 = buf;
+    ac->rx_len_2 = len;
+  }
+}
+
+static void aconn_recv_progress(struct flextcp_aring *r,
+    struct flextcp_aconn *ac)
+{
+  struct flextcp_aop_slot *s;
+  size_t len, l, res;
+
+  while ((s = ac->recv_first) != NULL) {
+    if (ac->rx_len_1 == 0 && !ac->rx_closed)
+      break;
+
+    len = s->op.u.recv.len;
+    res = 0;
+    while (res < len && ac->rx_len_1 > 0) {
+      l = MIN(len - res, ac->rx_len_1);
+      memcpy((uint8_t *) s->op.u.recv.buf + res, ac->rx_buf_1, l);
+      res += l;
+
+      ac->rx_buf_1 = (uint8_t *) ac->rx_buf_1 + l;
+      ac->rx_len_1 -= l;
+      if (ac->rx_len_1 == 0) {
+        ac->rx_buf_1 = ac->rx_buf_2;
+        ac->rx_len_1 = ac->rx_len_2;
+        ac->rx_buf_2 = NULL;
+        ac->rx_len_2 = 0;
+      }
+    }
+    if (res > 0)
+      flextcp_connection_rx_done(r->ctx, &ac->c, res);
+
+    ac->recv_first = s->next;
+    if (ac->recv_first == NULL)
+      ac->recv_last = NULL;
+    aop_complete(r, s, res);
+  }
+}
+
+static void aconn_send_progress(struct flextcp_aring *r,
+    struct flextcp_aconn *ac)
+{
+  struct flextcp_aop_slot *s;
+  const uint8_t *src;
+  void *dst_1, *dst_2;
+  size_t len_1;
+  ssize_t ret;
+
+  while ((s = ac->send_first) != NULL) {
+    ret = flextcp_connection_tx_alloc2(&ac->c, s->op.u.send.len - s->done,
+        &dst_1, &len_1, &dst_2);
+    if (ret > 0) {
+      src = (const uint8_t *) s->op.u.send.buf + s->done;
+      memcpy(dst_1, src, len_1);
+      if (ret > len_1)
+        memcpy(dst_2, src + len_1, ret - len_1);
+      flextcp_connection_tx_send(r->ctx, &ac->c, ret);
+      s->done += ret;
+    } else if (ret == 0 && s->done < s->op.u.send.len) {
+      /* wait for FLEXTCP_EV_CONN_SENDBUF */
+      break;
+    }
+
+    if (ret >= 0 && s->done < s->op.u.send.len)
+      break;
+
+    ac->send_first = s->next;
+    if (ac->send_first == NULL)
+      ac->send_last = NULL;
+    aop_complete(r, s, (ret < 0 ? -EPIPE : (int32_t) s->done));
+  }
+}
+
+static void aconn_cancel(struct flextcp_aring *r,
+    struct flextcp_aop_slot **first, struct flextcp_aop_slot **last)
+{
+  struct flextcp_aop_slot *s;
+
+  while ((s = *first) != NULL) {
+    *first = s->next;
+    aop_complete(r, s, -ECANCELED);
+  }
+  *last = NULL;
+}
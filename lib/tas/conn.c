@@ -26,6 +26,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 #include <tas_ll.h>
 #include <kernel_appif.h>
@@ -33,13 +36,15 @@
 
 static int listen_open(struct flextcp_context *ctx,
     struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
-    uint32_t flags, int obj, void *opptr);
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc, int obj,
+    void *opptr);
 static int listen_accept(struct flextcp_context *ctx,
     struct flextcp_listener *lst, struct flextcp_connection *conn,
     int obj, void *opptr_l, void *opptr_c);
 static int connection_open(struct flextcp_context *ctx,
     struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
-    uint32_t flags, int obj, void *opptr);
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc, int obj,
+    void *opptr);
 static int connection_close(struct flextcp_context *ctx,
     struct flextcp_connection *conn, int reset);
 static void connection_init(struct flextcp_connection *conn);
@@ -55,7 +60,24 @@ int flextcp_listen_open(struct flextcp_context *ctx,
     struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
     uint32_t flags)
 {
-  return listen_open(ctx, lst, port, backlog, flags, 0, lst);
+  return listen_open(ctx, lst, port, backlog, flags, 0, 0, FLEXTCP_CC_DEFAULT,
+      0, lst);
+}
+
+int flextcp_listen_open_bufs(struct flextcp_context *ctx,
+    struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len)
+{
+  return listen_open(ctx, lst, port, backlog, flags, rxb_len, txb_len,
+      FLEXTCP_CC_DEFAULT, 0, lst);
+}
+
+int flextcp_listen_open_cc(struct flextcp_context *ctx,
+    struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc)
+{
+  return listen_open(ctx, lst, port, backlog, flags, rxb_len, txb_len, cc, 0,
+      lst);
 }
 
 int flextcp_listen_accept(struct flextcp_context *ctx,
@@ -69,7 +91,57 @@ int flextcp_connection_open(struct flextcp_context *ctx,
     struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port)
 {
   connection_init(conn);
-  return connection_open(ctx, conn, dst_ip, dst_port, 0, 0, conn);
+  return connection_open(ctx, conn, dst_ip, dst_port, 0, 0, 0,
+      FLEXTCP_CC_DEFAULT, 0, conn);
+}
+
+int flextcp_connection_open_bufs(struct flextcp_context *ctx,
+    struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
+    uint32_t rxb_len, uint32_t txb_len)
+{
+  connection_init(conn);
+  return connection_open(ctx, conn, dst_ip, dst_port, 0, rxb_len, txb_len,
+      FLEXTCP_CC_DEFAULT, 0, conn);
+}
+
+int flextcp_connection_open_cc(struct flextcp_context *ctx,
+    struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
+    uint32_t rxb_len, uint32_t txb_len, uint8_t cc)
+{
+  connection_init(conn);
+  return connection_open(ctx, conn, dst_ip, dst_port, 0, rxb_len, txb_len, cc,
+      0, conn);
+}
+
+STATIC_ASSERT(FLEXTCP_CC_SWIFT == KERNEL_APPOUT_CC_SWIFT &&
+    FLEXTCP_CC_DEFAULT == KERNEL_APPOUT_CC_DEFAULT, flextcp_cc_values);
+
+/* indexed by FLEXTCP_CC_*, same names as the slow path --cc option */
+static const char *cc_names[KERNEL_APPOUT_CC_NUM] = {
+  [FLEXTCP_CC_DEFAULT] = "default",
+  [FLEXTCP_CC_DCTCP_WIN] = "dctcp-win",
+  [FLEXTCP_CC_DCTCP_RATE] = "dctcp-rate",
+  [FLEXTCP_CC_TIMELY] = "timely",
+  [FLEXTCP_CC_CONST_RATE] = "const-rate",
+  [FLEXTCP_CC_BBR] = "bbr",
+  [FLEXTCP_CC_SWIFT] = "swift",
+};
+
+int flextcp_cc_lookup(const char *name)
+{
+  int i;
+
+  for (i = 0; i < KERNEL_APPOUT_CC_NUM; i++) {
+    if (!strcmp(name, cc_names[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const char *flextcp_cc_name(uint8_t cc)
+{
+  return (cc < KERNEL_APPOUT_CC_NUM ? cc_names[cc] : NULL);
 }
 
 int flextcp_connection_close(struct flextcp_context *ctx,
@@ -189,6 +261,64 @@ int flextcp_connection_tx_send(struct flextcp_context *ctx,
   return 0;
 }
 
+ssize_t flextcp_connection_tx_sendv(struct flextcp_context *ctx,
+    struct flextcp_sendv *sends, unsigned num)
+{
+  struct flextcp_connection *conn;
+  struct flextcp_sendv *s;
+  uint32_t avail, pos, n, l;
+  ssize_t total = 0;
+  unsigned i;
+  int j;
+
+  for (i = 0; i < num; i++) {
+    s = &sends[i];
+    conn = s->conn;
+
+    if ((conn->flags & CONN_FLAG_TXEOS) == CONN_FLAG_TXEOS ||
+        conn_tx_sendbytes(conn) != 0)
+    {
+      s->sent = -1;
+      continue;
+    }
+
+    avail = conn_tx_allocbytes(conn);
+    pos = conn->txb_head_alloc;
+    n = 0;
+    for (j = 0; j < s->iovcnt && n < avail; j++) {
+      l = MIN(s->iov[j].iov_len, avail - n);
+
+      /* split at the end of the buffer */
+      if (pos + l > conn->txb_len) {
+        memcpy(conn->txb_base + pos, s->iov[j].iov_base, conn->txb_len - pos);
+        memcpy(conn->txb_base, (const uint8_t *) s->iov[j].iov_base +
+            (conn->txb_len - pos), l - (conn->txb_len - pos));
+      } else {
+        memcpy(conn->txb_base + pos, s->iov[j].iov_base, l);
+      }
+
+      pos += l;
+      if (pos >= conn->txb_len) {
+        pos -= conn->txb_len;
+      }
+      n += l;
+    }
+
+    s->sent = n;
+    if (n == 0)
+      continue;
+
+    conn->txb_head_alloc = pos;
+    conn->txb_head = pos;
+    conn_mark_bump(ctx, conn);
+    total += n;
+  }
+
+  if (ctx->cork_budget == 0)
+    flextcp_conns_bump(ctx);
+  return total;
+}
+
 int flextcp_connection_tx_close(struct flextcp_context *ctx,
         struct flextcp_connection *conn)
 {
@@ -204,6 +334,9 @@ int flextcp_connection_tx_close(struct flextcp_context *ctx,
     return -1;
   }
 
+  /* the fin goes out of the current buffer, unless a switch is in flight */
+  conn->flags &= ~CONN_FLAG_TXOFFER;
+  conn->txb_offer_len = 0;
   conn->flags |= CONN_FLAG_TXEOS;
 
   /* try to push out to fastpath */
@@ -236,6 +369,46 @@ int flextcp_conn_pushtxeos(struct flextcp_context *ctx,
   return 0;
 }
 
+/* switch to the offered tx buffer once everything sent from the current one
+ * was acknowledged, allocations wait until then. The fast path answers with
+ * FLEXTCP_PL_ARX_TXRESIZED. */
+int flextcp_conn_txresize(struct flextcp_context *ctx,
+        struct flextcp_connection *conn)
+{
+  struct flextcp_pl_atx *atx;
+
+  if (conn->txb_offer_len == 0 || (conn->flags & CONN_FLAG_TXRESIZE) != 0)
+    return 0;
+
+  /* closed for tx, not worth switching anymore */
+  if ((conn->flags & CONN_FLAG_TXEOS) != 0) {
+    conn->flags &= ~CONN_FLAG_TXOFFER;
+    conn->txb_offer_len = 0;
+    return 0;
+  }
+
+  conn->flags |= CONN_FLAG_TXOFFER;
+  if (conn->txb_tail != conn->txb_head ||
+      conn->txb_head != conn->txb_head_alloc)
+  {
+    return 0;
+  }
+
+  if (flextcp_context_tx_alloc(ctx, &atx, conn->fn_core) != 0) {
+    /* no queue space, don't block the app, retry on the next tx bump */
+    conn->flags &= ~CONN_FLAG_TXOFFER;
+    return -1;
+  }
+
+  atx->msg.txresize.flow_id = conn->flow_id;
+  MEM_BARRIER();
+  atx->type = FLEXTCP_PL_ATX_TXRESIZE;
+  flextcp_context_tx_done(ctx, conn->fn_core);
+
+  conn->flags = (conn->flags & ~CONN_FLAG_TXOFFER) | CONN_FLAG_TXRESIZE;
+  return 0;
+}
+
 int flextcp_connection_tx_possible(struct flextcp_context *ctx,
     struct flextcp_connection *conn)
 {
@@ -279,11 +452,118 @@ int flextcp_connection_move(struct flextcp_context *ctx,
   return 0;
 }
 
+int flextcp_connection_handoff(struct flextcp_context *ctx,
+        struct flextcp_connection *conn, struct flextcp_context *dst)
+{
+  struct flextcp_pl_atx *atx;
+
+  if (conn->status != CONN_OPEN) {
+    fprintf(stderr, "flextcp_connection_handoff: connection not open\n");
+    return -1;
+  }
+
+  /* pending updates have to go out before the move on the same queue */
+  if (conn->bump_pending != 0) {
+    flextcp_conns_bump(ctx);
+    if (conn->bump_pending != 0) {
+      fprintf(stderr, "flextcp_connection_handoff: no queue space\n");
+      return -1;
+    }
+  }
+
+  if (flextcp_context_tx_alloc(ctx, &atx, conn->fn_core) != 0) {
+    fprintf(stderr, "flextcp_connection_handoff: no queue space\n");
+    return -1;
+  }
+
+  atx->msg.connmove.flow_id = conn->flow_id;
+  atx->msg.connmove.db_id = dst->db_id;
+  MEM_BARRIER();
+  atx->type = FLEXTCP_PL_ATX_CONNMOVE;
+  flextcp_context_tx_done(ctx, conn->fn_core);
+
+  return 0;
+}
+
+int flextcp_connection_info(struct flextcp_connection *conn,
+    struct flextcp_conn_info *info)
+{
+  const struct flextcp_pl_flowst *fs;
+  const struct flextcp_pl_flowst_stats *st;
+
+  if (conn->status != CONN_OPEN) {
+    return -1;
+  }
+
+  info->rx_ready = conn_rx_recvdbytes(conn);
+  info->tx_queued = (conn->txb_tail <= conn->txb_head ?
+      conn->txb_head - conn->txb_tail :
+      conn->txb_len - conn->txb_tail + conn->txb_head);
+  info->tx_free = conn_tx_allocbytes(conn);
+
+  if (flextcp_flowstate(conn->flow_id, &fs, &st) != 0) {
+    return -1;
+  }
+  info->rtt_us = st->rtt_est;
+  info->tx_rate_kbps = fs->tx_rate;
+  info->tx_drops = st->cnt_tx_drops;
+  info->tx_rtos = st->cnt_tx_rtos;
+  info->rto_backoff = st->rto_backoff;
+  return 0;
+}
+
+#if FLEXTCP_OBJ_STEER_BUCKETS != FLEXNIC_PL_APPST_STEER_NUM
+#error "FLEXTCP_OBJ_STEER_BUCKETS does not match the fast path"
+#endif
+
+/* same as the fast path: CRC32-C without inversion, starting at 0 */
+uint32_t flextcp_obj_key_hash(const void *key, uint8_t len)
+{
+  const uint8_t *p = key;
+  uint32_t crc = 0;
+  uint8_t i;
+#ifndef __SSE4_2__
+  int b;
+#endif
+
+  for (i = 0; i < len; i++) {
+#ifdef __SSE4_2__
+    crc = _mm_crc32_u8(crc, p[i]);
+#else
+    crc ^= p[i];
+    for (b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+#endif
+  }
+
+  return crc;
+}
+
+int flextcp_obj_steer(struct flextcp_context *ctx, uint32_t hash_first,
+    uint32_t hash_last, struct flextcp_context *dst)
+{
+  uint16_t shift = 32 - __builtin_ctz(FLEXTCP_OBJ_STEER_BUCKETS);
+
+  if (hash_first > hash_last) {
+    fprintf(stderr, "flextcp_obj_steer: invalid hash range\n");
+    return -1;
+  }
+
+  return flextcp_kernel_objsteer(ctx, hash_first >> shift, hash_last >> shift,
+      dst->db_id, 0);
+}
+
+int flextcp_obj_steer_reset(struct flextcp_context *ctx)
+{
+  return flextcp_kernel_objsteer(ctx, 0, 0, 0, 1);
+}
+
 int flextcp_obj_listen_open(struct flextcp_context *ctx,
     struct flextcp_obj_listener *lst, uint16_t port, uint32_t backlog,
     uint32_t flags)
 {
-  return listen_open(ctx, &lst->l, port, backlog, flags, 1, lst);
+  return listen_open(ctx, &lst->l, port, backlog, flags, 0, 0,
+      FLEXTCP_CC_DEFAULT, 1, lst);
 }
 
 int flextcp_obj_listen_accept(struct flextcp_context *ctx,
@@ -298,7 +578,8 @@ int flextcp_obj_connection_open(struct flextcp_context *ctx,
     uint32_t flags)
 {
   oconn_init(conn);
-  return connection_open(ctx, &conn->c, dst_ip, dst_port, flags, 1, conn);
+  return connection_open(ctx, &conn->c, dst_ip, dst_port, flags, 0, 0,
+      FLEXTCP_CC_DEFAULT, 1, conn);
 }
 
 void flextcp_obj_connection_rx_done(struct flextcp_context *ctx,
@@ -348,22 +629,19 @@ void flextcp_obj_connection_rx_done(struct flextcp_context *ctx,
   oconn_unlock(oconn);
 }
 
-int flextcp_obj_connection_tx_alloc(struct flextcp_obj_connection *oconn,
+/* caller holds object connection lock */
+static inline int obj_tx_alloc(struct flextcp_connection *conn,
     uint8_t dstlen, size_t len, void **buf1, size_t *len1, void **buf2,
     struct flextcp_obj_handle *oh)
 {
-  struct flextcp_connection *conn = &oconn->c;
   struct obj_hdr ohdr;
   uint32_t avail, total, pos;
 
   total = sizeof(ohdr) + dstlen + len;
 
-  oconn_lock(oconn);
-
   /* Check if there is enough space */
   avail = conn_tx_allocbytes(conn);
   if (avail < total) {
-    oconn_unlock(oconn);
     return -1;
   }
 
@@ -389,15 +667,45 @@ int flextcp_obj_connection_tx_alloc(struct flextcp_obj_connection *oconn,
   conn->txb_head_alloc = circ_offset(conn->txb_head_alloc, conn->txb_len,
       total);
 
+  return 0;
+}
+
+int flextcp_obj_connection_tx_alloc(struct flextcp_obj_connection *oconn,
+    uint8_t dstlen, size_t len, void **buf1, size_t *len1, void **buf2,
+    struct flextcp_obj_handle *oh)
+{
+  int ret;
+
+  oconn_lock(oconn);
+  ret = obj_tx_alloc(&oconn->c, dstlen, len, buf1, len1, buf2, oh);
   oconn_unlock(oconn);
 
-  return 0;
+  return ret;
 }
 
-void flextcp_obj_connection_tx_send(struct flextcp_context *ctx,
-        struct flextcp_obj_connection *oconn, struct flextcp_obj_handle *oh)
+int flextcp_obj_connection_tx_alloc_n(struct flextcp_obj_connection *oconn,
+    struct flextcp_obj_alloc *allocs, unsigned num)
+{
+  unsigned i;
+
+  oconn_lock(oconn);
+  for (i = 0; i < num; i++) {
+    if (obj_tx_alloc(&oconn->c, allocs[i].dstlen, allocs[i].len,
+          &allocs[i].buf_1, &allocs[i].len_1, &allocs[i].buf_2,
+          &allocs[i].handle) != 0)
+    {
+      break;
+    }
+  }
+  oconn_unlock(oconn);
+
+  return i;
+}
+
+/* caller holds object connection lock */
+static inline void obj_tx_send(struct flextcp_connection *conn,
+    struct flextcp_obj_handle *oh)
 {
-  struct flextcp_connection *conn = &oconn->c;
   struct obj_hdr ohdr;
   uint32_t pos;
 
@@ -409,8 +717,6 @@ void flextcp_obj_connection_tx_send(struct flextcp_context *ctx,
    *     + only flag this object as ready
    */
 
-  oconn_lock(oconn);
-
   /* read object header */
   pos = oh->pos;
   circ_read(&ohdr, conn->txb_base, conn->txb_len, pos, sizeof(ohdr));
@@ -441,7 +747,28 @@ void flextcp_obj_connection_tx_send(struct flextcp_context *ctx,
     ohdr.magic = t_beui16(OBJ_FLAG_DONE);
     circ_write(&ohdr, conn->txb_base, conn->txb_len, pos, sizeof(ohdr));
   }
+}
 
+void flextcp_obj_connection_tx_send(struct flextcp_context *ctx,
+        struct flextcp_obj_connection *oconn, struct flextcp_obj_handle *oh)
+{
+  oconn_lock(oconn);
+  obj_tx_send(&oconn->c, oh);
+  oconn_unlock(oconn);
+}
+
+void flextcp_obj_connection_tx_send_n(struct flextcp_context *ctx,
+        struct flextcp_obj_connection *oconn, struct flextcp_obj_alloc *allocs,
+        unsigned num)
+{
+  unsigned i;
+
+  /* in reverse, so the head only moves once if these are the first unsent
+   * objects */
+  oconn_lock(oconn);
+  for (i = num; i > 0; i--) {
+    obj_tx_send(&oconn->c, &allocs[i - 1].handle);
+  }
   oconn_unlock(oconn);
 }
 
@@ -487,7 +814,8 @@ out:
 
 static int listen_open(struct flextcp_context *ctx,
     struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
-    uint32_t flags, int obj, void *opptr)
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc, int obj,
+    void *opptr)
 {
   uint32_t pos = ctx->kin_head;
   struct kernel_appout *kin = ctx->kin_base;
@@ -523,6 +851,9 @@ static int listen_open(struct flextcp_context *ctx,
   kin->data.listen_open.local_port = port;
   kin->data.listen_open.backlog = backlog;
   kin->data.listen_open.flags = f;
+  kin->data.listen_open.rx_len = rxb_len;
+  kin->data.listen_open.tx_len = txb_len;
+  kin->data.listen_open.cc = cc;
   MEM_BARRIER();
   kin->type = KERNEL_APPOUT_LISTEN_OPEN;
   flextcp_kernel_kick();
@@ -571,15 +902,17 @@ static int listen_accept(struct flextcp_context *ctx,
 
 static int connection_open(struct flextcp_context *ctx,
     struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
-    uint32_t flags, int obj, void *opptr)
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc, int obj,
+    void *opptr)
 {
   uint32_t pos = ctx->kin_head, f = 0;
   struct kernel_appout *kin = ctx->kin_base;
 
   kin += pos;
 
+  /* queue full, callers retry after polling (EAGAIN for the sockets
+   * interface), so this is not worth a message */
   if (kin->type != KERNEL_APPOUT_INVALID) {
-    fprintf(stderr, "flextcp_connection_open: no queue space\n");
     return -1;
   }
 
@@ -598,6 +931,9 @@ static int connection_open(struct flextcp_context *ctx,
   kin->data.conn_open.remote_ip = dst_ip;
   kin->data.conn_open.remote_port = dst_port;
   kin->data.conn_open.flags = f;
+  kin->data.conn_open.rx_len = rxb_len;
+  kin->data.conn_open.tx_len = txb_len;
+  kin->data.conn_open.cc = cc;
   MEM_BARRIER();
   kin->type = KERNEL_APPOUT_CONN_OPEN;
   flextcp_kernel_kick();
@@ -622,6 +958,9 @@ static int connection_close(struct flextcp_context *ctx,
   if (conn->bump_pending != 0) {
     if (conn == ctx->bump_pending_first) {
       ctx->bump_pending_first = conn->bump_next;
+      if (conn->bump_next == NULL) {
+        ctx->bump_pending_last = NULL;
+      }
     } else {
       for (p_c = ctx->bump_pending_first;
           p_c != NULL && p_c->bump_next != conn;
@@ -640,6 +979,7 @@ static int connection_close(struct flextcp_context *ctx,
     }
 
     conn->bump_pending = 0;
+    ctx->bump_pending_num--;
   }
 
   kin += pos;
@@ -682,6 +1022,8 @@ static void connection_init(struct flextcp_connection *conn)
   conn->txb_head_alloc = 0;
   conn->txb_tail = 0;
   conn->txb_nichead = 0;
+  conn->txb_offer_base = NULL;
+  conn->txb_offer_len = 0;
   conn->bump_seq = 0;
   conn->status = CONN_CLOSED;
   conn->flags = 0;
@@ -714,6 +1056,11 @@ static inline void conn_mark_bump(struct flextcp_context *ctx,
   ctx->bump_pending_last = conn;
 
   conn->bump_pending = 1;
+
+  /* corked contexts flush once the budget is used up */
+  if (++ctx->bump_pending_num >= ctx->cork_budget && ctx->cork_budget != 0) {
+    flextcp_conns_bump(ctx);
+  }
 }
 
 /** Number of bytes in receive buffer that have been received */
@@ -729,6 +1076,10 @@ static inline uint32_t conn_rx_recvdbytes(struct flextcp_connection *conn)
 /** Number of bytes in send buffer that can be allocated */
 static inline uint32_t conn_tx_allocbytes(struct flextcp_connection *conn)
 {
+  /* draining for a tx buffer switch */
+  if ((conn->flags & (CONN_FLAG_TXOFFER | CONN_FLAG_TXRESIZE)) != 0)
+    return 0;
+
   if (conn->txb_tail <= conn->txb_head_alloc) {
     return conn->txb_len - conn->txb_head_alloc + conn->txb_tail - 1;
   } else {
@@ -36,8 +36,8 @@
 #include <tas_ll_connect.h>
 #include <tas_memif.h>
 
-static void *map_region(const char *name, size_t len);
-static void *map_region_huge(const char *name, size_t len)
+static void *map_region(const char *name, size_t len, int ro);
+static void *map_region_huge(const char *name, size_t len, int ro)
   __attribute__((used));
 
 static struct flexnic_info *info = NULL;
@@ -55,7 +55,7 @@ int flexnic_driver_connect(struct flexnic_info **p_info, void **p_mem_start)
   }
 
   /* open and map flexnic info shm region */
-  if ((m = map_region(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES)) == NULL) {
+  if ((m = map_region(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES, 0)) == NULL) {
     perror("flexnic_driver_connect: map_region info failed");
     goto error_exit;
   }
@@ -69,9 +69,9 @@ int flexnic_driver_connect(struct flexnic_info **p_info, void **p_mem_start)
 
   /* open and map flexnic info shm region */
 #ifdef FLEXNIC_USE_HUGEPAGES
-  if ((m = map_region_huge(FLEXNIC_NAME_DMA_MEM, fi->dma_mem_size)) == NULL)
+  if ((m = map_region_huge(FLEXNIC_NAME_DMA_MEM, fi->dma_mem_size, 0)) == NULL)
 #else
-  if ((m = map_region(FLEXNIC_NAME_DMA_MEM, fi->dma_mem_size)) == NULL)
+  if ((m = map_region(FLEXNIC_NAME_DMA_MEM, fi->dma_mem_size, 0)) == NULL)
 #endif
   {
     perror("flexnic_driver_connect: mapping dma memory failed");
@@ -88,7 +88,53 @@ error_exit:
   return err_ret;
 }
 
-int flexnic_driver_internal(void **int_mem_start)
+int flexnic_driver_connect_ro(const struct flexnic_info **p_info)
+{
+  void *m;
+
+  if (info != NULL) {
+    fprintf(stderr, "flexnic_driver_connect_ro: already connected\n");
+    return -1;
+  }
+
+  if ((m = map_region(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES, 1)) == NULL) {
+    perror("flexnic_driver_connect_ro: map_region info failed");
+    return -1;
+  }
+
+  /* abort if not ready yet */
+  if ((((volatile struct flexnic_info *) m)->flags & FLEXNIC_FLAG_READY) !=
+      FLEXNIC_FLAG_READY)
+  {
+    munmap(m, FLEXNIC_INFO_BYTES);
+    return 1;
+  }
+
+  *p_info = info = m;
+  return 0;
+}
+
+int flexnic_driver_stats(const struct flexnic_stats **stats)
+{
+  const struct flexnic_stats *m;
+
+  if ((m = map_region(FLEXNIC_NAME_STATS, sizeof(*m), 1)) == NULL) {
+    perror("flexnic_driver_stats: map_region failed");
+    return -1;
+  }
+
+  if (m->version != FLEXNIC_STATS_VERSION) {
+    fprintf(stderr, "flexnic_driver_stats: unexpected version %u\n",
+        m->version);
+    munmap((void *) m, sizeof(*m));
+    return -1;
+  }
+
+  *stats = m;
+  return 0;
+}
+
+static int driver_internal(void **int_mem_start, int ro)
 {
   void *m;
 
@@ -99,10 +145,10 @@ int flexnic_driver_internal(void **int_mem_start)
 
   /* open and map flexnic internal memory shm region */
 #ifdef FLEXNIC_USE_HUGEPAGES
-  if ((m = map_region_huge(FLEXNIC_NAME_INTERNAL_MEM, info->internal_mem_size))
-      == NULL)
+  if ((m = map_region_huge(FLEXNIC_NAME_INTERNAL_MEM, info->internal_mem_size,
+          ro)) == NULL)
 #else
-  if ((m = map_region(FLEXNIC_NAME_INTERNAL_MEM, info->internal_mem_size))
+  if ((m = map_region(FLEXNIC_NAME_INTERNAL_MEM, info->internal_mem_size, ro))
       == NULL)
 #endif
   {
@@ -114,16 +160,27 @@ int flexnic_driver_internal(void **int_mem_start)
   return 0;
 }
 
-static void *map_region(const char *name, size_t len)
+int flexnic_driver_internal(void **int_mem_start)
+{
+  return driver_internal(int_mem_start, 0);
+}
+
+int flexnic_driver_internal_ro(const void **int_mem_start)
+{
+  return driver_internal((void **) int_mem_start, 1);
+}
+
+static void *map_region(const char *name, size_t len, int ro)
 {
   int fd;
   void *m;
 
-  if ((fd = shm_open(name, O_RDWR, 0)) == -1) {
+  if ((fd = shm_open(name, (ro ? O_RDONLY : O_RDWR), 0)) == -1) {
     perror("map_region: shm_open memory failed");
     return NULL;
   }
-  m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  m = mmap(NULL, len, PROT_READ | (ro ? 0 : PROT_WRITE),
+      MAP_SHARED | (ro ? 0 : MAP_POPULATE), fd, 0);
   close(fd);
   if (m == (void *) -1) {
     perror("flexnic_driver_connect: mmap failed");
@@ -133,7 +190,7 @@ static void *map_region(const char *name, size_t len)
   return m;
 }
 
-static void *map_region_huge(const char *name, size_t len)
+static void *map_region_huge(const char *name, size_t len, int ro)
 {
   int fd;
   void *m;
@@ -141,11 +198,12 @@ static void *map_region_huge(const char *name, size_t len)
 
   snprintf(path, sizeof(path), "%s/%s", FLEXNIC_HUGE_PREFIX, name);
 
-  if ((fd = open(path, O_RDWR)) == -1) {
+  if ((fd = open(path, (ro ? O_RDONLY : O_RDWR))) == -1) {
     perror("map_region: shm_open memory failed");
     return NULL;
   }
-  m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  m = mmap(NULL, len, PROT_READ | (ro ? 0 : PROT_WRITE),
+      MAP_SHARED | (ro ? 0 : MAP_POPULATE), fd, 0);
   close(fd);
   if (m == (void *) -1) {
     perror("flexnic_driver_connect: mmap failed");
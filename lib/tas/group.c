@@ -0,0 +1,156 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include <tas_ll.h>
+#include "internal.h"
+
+int flextcp_group_init(struct flextcp_context_group *g)
+{
+  memset(g, 0, sizeof(*g));
+  if ((g->epfd = epoll_create1(0)) == -1) {
+    perror("flextcp_group_init: epoll_create1 failed");
+    return -1;
+  }
+  return 0;
+}
+
+void flextcp_group_destroy(struct flextcp_context_group *g)
+{
+  close(g->epfd);
+  free(g->ctxs);
+  g->ctxs = NULL;
+  g->num = g->cap = 0;
+}
+
+int flextcp_group_add(struct flextcp_context_group *g,
+    struct flextcp_context *ctx)
+{
+  struct flextcp_context **ctxs;
+  struct epoll_event ev = {
+    .events = EPOLLIN,
+    .data.ptr = ctx,
+  };
+  unsigned cap;
+
+  if (g->num == g->cap) {
+    cap = (g->cap == 0 ? 4 : 2 * g->cap);
+    if ((ctxs = realloc(g->ctxs, cap * sizeof(*ctxs))) == NULL) {
+      perror("flextcp_group_add: realloc failed");
+      return -1;
+    }
+    g->ctxs = ctxs;
+    g->cap = cap;
+  }
+
+  if (epoll_ctl(g->epfd, EPOLL_CTL_ADD, ctx->evfd, &ev) != 0) {
+    perror("flextcp_group_add: epoll_ctl failed");
+    return -1;
+  }
+
+  g->ctxs[g->num++] = ctx;
+  return 0;
+}
+
+int flextcp_group_remove(struct flextcp_context_group *g,
+    struct flextcp_context *ctx)
+{
+  unsigned i;
+
+  for (i = 0; i < g->num && g->ctxs[i] != ctx; i++);
+  if (i == g->num) {
+    fprintf(stderr, "flextcp_group_remove: context not in group\n");
+    return -1;
+  }
+
+  if (epoll_ctl(g->epfd, EPOLL_CTL_DEL, ctx->evfd, NULL) != 0) {
+    perror("flextcp_group_remove: epoll_ctl failed");
+    return -1;
+  }
+
+  /* keep the polling order of the others */
+  memmove(&g->ctxs[i], &g->ctxs[i + 1], (g->num - i - 1) * sizeof(g->ctxs[0]));
+  g->num--;
+  if (g->next >= g->num)
+    g->next = 0;
+  return 0;
+}
+
+int flextcp_group_poll(struct flextcp_context_group *g, int num,
+    struct flextcp_event *events, struct flextcp_context **ev_ctxs)
+{
+  struct flextcp_context *ctx;
+  unsigned k, left;
+  int i = 0, n, quota, j;
+
+  /* split the event space evenly over contexts still to poll, space left
+   * unused by idle contexts goes to the later ones */
+  for (k = 0; k < g->num && i < num; k++) {
+    ctx = g->ctxs[(g->next + k) % g->num];
+    left = g->num - k;
+    quota = (num - i + left - 1) / left;
+
+    if ((n = flextcp_context_poll(ctx, quota, events + i)) < 0)
+      return -1;
+
+    if (ev_ctxs != NULL) {
+      for (j = 0; j < n; j++)
+        ev_ctxs[i + j] = ctx;
+    }
+    i += n;
+  }
+
+  /* start with the next context next time */
+  if (g->num > 0)
+    g->next = (g->next + 1) % g->num;
+  return i;
+}
+
+void flextcp_group_block(struct flextcp_context_group *g, int timeout_ms)
+{
+  struct epoll_event evs[8];
+  struct flextcp_context *ctx;
+  uint64_t val;
+  int i, n, r;
+
+  do {
+    n = epoll_wait(g->epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout_ms);
+  } while (n == -1 && errno == EINTR);
+  assert(n != -1);
+
+  /* the group is the only waiter on its contexts, so this does not block */
+  for (i = 0; i < n; i++) {
+    ctx = evs[i].data.ptr;
+    r = read(ctx->evfd, &val, sizeof(val));
+    assert(r == sizeof(val));
+    (void) r;
+  }
+}
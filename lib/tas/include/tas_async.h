@@ -0,0 +1,178 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef TAS_ASYNC_H_
+#define TAS_ASYNC_H_
+
+/**
+ * @file tas_async.h
+ * @brief Asynchronous submission/completion interface on top of a flextcp
+ * context.
+ *
+ * Operations are submitted with a user tag and complete in a completion
+ * queue that is reaped in batches. Connections and listeners driven by a
+ * ring have to be struct flextcp_aconn / struct flextcp_alistener, and all
+ * events of the context are consumed by the ring.
+ *
+ * @addtogroup app-stack
+ */
+
+#include <stddef.h>
+#include <tas_ll.h>
+
+enum flextcp_aop_type {
+  /** Open a listener */
+  FLEXTCP_AOP_LISTEN,
+  /** Accept a connection on a listener into a connection handle */
+  FLEXTCP_AOP_ACCEPT,
+  /** Open a connection */
+  FLEXTCP_AOP_CONNECT,
+  /** Receive at most len bytes, completes once any are available (0: EOF).
+   * With len 0 completes right away, -EAGAIN if nothing was received. */
+  FLEXTCP_AOP_RECV,
+  /** Send len bytes, completes once all are in the send buffer */
+  FLEXTCP_AOP_SEND,
+  /** Close a connection */
+  FLEXTCP_AOP_CLOSE,
+};
+
+struct flextcp_aop_slot;
+
+/** Connection driven by an async ring. (opaque except for c) */
+struct flextcp_aconn {
+  struct flextcp_connection c;
+
+  /* received data not yet returned (two pieces of the circular buffer) */
+  void *rx_buf_1;
+  void *rx_buf_2;
+  size_t rx_len_1;
+  size_t rx_len_2;
+  uint8_t rx_closed;
+
+  /* pending operations */
+  struct flextcp_aop_slot *recv_first, *recv_last;
+  struct flextcp_aop_slot *send_first, *send_last;
+  struct flextcp_aop_slot *open;
+  struct flextcp_aop_slot *close;
+};
+
+/** Listener driven by an async ring. (opaque except for l) */
+struct flextcp_alistener {
+  struct flextcp_listener l;
+  struct flextcp_aop_slot *open;
+};
+
+/** Submission entry */
+struct flextcp_aop {
+  uint8_t op;
+  /** Returned with the completion */
+  uint64_t tag;
+  union {
+    struct {
+      struct flextcp_alistener *lst;
+      uint16_t port;
+      uint32_t backlog;
+      uint32_t flags;
+    } listen;
+    struct {
+      struct flextcp_alistener *lst;
+      struct flextcp_aconn *conn;
+    } accept;
+    struct {
+      struct flextcp_aconn *conn;
+      uint32_t ip;
+      uint16_t port;
+    } connect;
+    struct {
+      struct flextcp_aconn *conn;
+      void *buf;
+      size_t len;
+    } recv;
+    struct {
+      struct flextcp_aconn *conn;
+      const void *buf;
+      size_t len;
+    } send;
+    struct {
+      struct flextcp_aconn *conn;
+    } close;
+  } u;
+};
+
+/** Completion entry */
+struct flextcp_acqe {
+  uint64_t tag;
+  /** Bytes for recv/send, 0 or status for other operations, < 0: -errno */
+  int32_t res;
+  uint8_t op;
+};
+
+/** Submission/completion ring over a context. (opaque) */
+struct flextcp_aring {
+  struct flextcp_context *ctx;
+  unsigned entries;
+  unsigned inflight;
+
+  struct flextcp_aop_slot *slots;
+  struct flextcp_aop_slot *free_slots;
+
+  struct flextcp_acqe *cq;
+  unsigned cq_head;
+  unsigned cq_num;
+};
+
+/**
+ * Set up a ring over a context.
+ *
+ * @param r       Ring
+ * @param ctx     Context, its events are consumed by the ring from now on
+ * @param entries Max. number of operations in flight (bounds completions)
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_aring_init(struct flextcp_aring *r, struct flextcp_context *ctx,
+    unsigned entries);
+
+/** Free ring resources, operations still in flight are dropped. */
+void flextcp_aring_destroy(struct flextcp_aring *r);
+
+/**
+ * Submit operations. Sends and receives that can be served right away
+ * complete immediately, updates to the fast path are batched until the next
+ * flextcp_aring_reap().
+ *
+ * @return Number of operations submitted (fewer if the ring is full)
+ */
+unsigned flextcp_aring_submit(struct flextcp_aring *r,
+    const struct flextcp_aop *ops, unsigned num);
+
+/**
+ * Poll the context once and return completions.
+ *
+ * @return Number of completions stored in cqes
+ */
+unsigned flextcp_aring_reap(struct flextcp_aring *r, struct flextcp_acqe *cqes,
+    unsigned max);
+
+#endif /* ndef TAS_ASYNC_H_ */
@@ -34,9 +34,22 @@
  */
 
 #include <stdint.h>
-
-#define FLEXTCP_MAX_CONTEXTS 32
-#define FLEXTCP_MAX_FTCPCORES 16
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FLEXTCP_MAX_CONTEXTS 256
+/** Granularity of object steering, see flextcp_obj_steer() */
+#define FLEXTCP_OBJ_STEER_BUCKETS 256
+
+/** Queue pair between a context and one fast path core. (opaque) */
+struct flextcp_context_queue {
+  void *txq_base;
+  void *rxq_base;
+  uint32_t rxq_head;
+  uint32_t txq_tail;
+  uint32_t txq_avail;
+  uint32_t last_ts;
+};
 
 /**
  * A flextcp context is per-thread state for the stack. (opaque)
@@ -55,21 +68,21 @@ struct flextcp_context {
   uint32_t kout_len;
   uint32_t kout_head;
 
-  /* queues from NIC cores */
+  /* queues from NIC cores (num_queues entries, one per fast path core) */
   uint32_t rxq_len;
   uint32_t txq_len;
-  struct {
-    void *txq_base;
-    void *rxq_base;
-    uint32_t rxq_head;
-    uint32_t txq_tail;
-    uint32_t txq_avail;
-    uint32_t last_ts;
-  } queues[FLEXTCP_MAX_FTCPCORES];
+  struct flextcp_context_queue *queues;
+  /* fast path cores that added rx entries (see flextcp_pl_rxsum), and
+   * queues known to have entries left after the last poll */
+  volatile uint64_t *rxsum;
+  uint64_t rx_pending;
 
   /* list of connections with pending updates for NIC */
   struct flextcp_connection *bump_pending_first;
   struct flextcp_connection *bump_pending_last;
+  uint16_t bump_pending_num;
+  /* corked: flush once this many connections are pending, 0 = not corked */
+  uint16_t cork_budget;
 
   /* other */
   uint16_t db_id;
@@ -105,6 +118,9 @@ struct flextcp_connection {
   uint32_t txb_head_alloc;
   uint32_t txb_tail;
   uint32_t txb_nichead;
+  /* tx buffer offered by autotuning, switched to once drained */
+  uint8_t *txb_offer_base;
+  uint32_t txb_offer_len;
 
   uint32_t local_ip;
   uint32_t remote_ip;
@@ -136,6 +152,8 @@ struct flextcp_obj_listener {
 struct flextcp_obj_conn_ctx {
   uint32_t obj_pos;
   uint32_t obj_len_rem;
+  /* bytes of the next object's header received so far */
+  uint32_t obj_hdr_len;
 };
 
 /** Object TCP connection. (opaque) */
@@ -150,6 +168,20 @@ struct flextcp_obj_handle {
   uint32_t pos;
 };
 
+/** One object for flextcp_obj_connection_tx_alloc_n() */
+struct flextcp_obj_alloc {
+  /** Length of destination, set by caller */
+  uint8_t dstlen;
+  /** Length of object data, set by caller */
+  size_t len;
+
+  /** Buffers for destination and data, len_2 is dstlen + len - len_1 */
+  void *buf_1;
+  size_t len_1;
+  void *buf_2;
+  struct flextcp_obj_handle handle;
+};
+
 /** Types of events that can occur in flextcp contexts */
 enum flextcp_event_type {
   /** flextcp_listen_open() result. */
@@ -288,6 +320,15 @@ struct flextcp_event {
 
 #define FLEXTCP_CONNECT_OBJNOHASH 0x1
 
+/** Congestion control algorithms for flextcp_*_open_cc() */
+#define FLEXTCP_CC_DEFAULT    0
+#define FLEXTCP_CC_DCTCP_WIN  1
+#define FLEXTCP_CC_DCTCP_RATE 2
+#define FLEXTCP_CC_TIMELY     3
+#define FLEXTCP_CC_CONST_RATE 4
+#define FLEXTCP_CC_BBR        5
+#define FLEXTCP_CC_SWIFT      6
+
 /**
  * Initializes global flextcp state, must only be called once.
  * @return 0 on success, < 0 on failure
@@ -295,10 +336,95 @@ struct flextcp_event {
 int flextcp_init(void);
 
 /**
- * Create a flextcp context.
+ * Create a flextcp context. Takes one of the contexts preallocated with
+ * flextcp_context_prealloc() if any are left.
  */
 int flextcp_context_create(struct flextcp_context *ctx);
 
+/**
+ * Create multiple flextcp contexts, up to KERNEL_UXSOCK_CTX_MAX of them are
+ * requested from the kernel in one round trip.
+ *
+ * @param ctxs Array of contexts to initialize
+ * @param num  Number of contexts
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_contexts_create(struct flextcp_context *ctxs, unsigned num);
+
+/**
+ * Create num contexts ahead of time, handed out by later calls to
+ * flextcp_context_create() without contacting the kernel. Must be called
+ * once, before other threads create contexts.
+ *
+ * @param num Number of contexts, at most FLEXTCP_MAX_CONTEXTS
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_context_prealloc(unsigned num);
+
+/**
+ * Create a flextcp context with a transmit weight and rate cap, see
+ * flextcp_context_qos().
+ */
+int flextcp_context_create_qos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate);
+
+/**
+ * Set transmit weight and rate cap for all connections of a context
+ * (asynchronous). Flows are still paced individually by congestion control,
+ * the weight sets the context's share among contexts with unpaced flows.
+ *
+ * @param ctx    Context
+ * @param weight Relative share (0 is treated as 1)
+ * @param rate   Rate cap [kbps], 0 for no cap
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_context_qos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate);
+
+/**
+ * Set notification moderation for a context (asynchronous). A context
+ * blocked in flextcp_block() is then not woken for every event, but once
+ * `count` events are pending or `delay_us` has passed since the first one.
+ * Contexts that are polling are not affected.
+ *
+ * @param ctx      Context
+ * @param delay_us Max. notification delay [us], 0 to disable moderation
+ * @param count    Wake up once this many events are pending, 0 for no limit
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_context_notify(struct flextcp_context *ctx, uint32_t delay_us,
+    uint16_t count);
+
+/**
+ * Reattach all contexts of this process to a restarted TAS instance (only
+ * with --fast-restart). Called by flextcp_context_poll() once it notices
+ * the restart, established connections remain usable afterwards.
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_reattach(void);
+
+/**
+ * Cork a context: updates from flextcp_connection_rx_done(),
+ * flextcp_connection_tx_send() and flextcp_connection_tx_close() are no
+ * longer written to the fast path on every flextcp_context_poll(), but
+ * folded into one update per connection until flextcp_context_flush() is
+ * called or `budget` connections have updates pending.
+ *
+ * @param ctx    Context
+ * @param budget Auto-flush after this many connections, 0 to uncork
+ *
+ * @return 0 on success, < 0 on failure
+ */
+int flextcp_context_cork(struct flextcp_context *ctx, uint16_t budget);
+
+/** Write pending connection updates to the fast path (see cork). */
+void flextcp_context_flush(struct flextcp_context *ctx);
+
 /**
  * Poll events from a flextcp socket.
  */
@@ -315,6 +441,18 @@ int flextcp_listen_open(struct flextcp_context *ctx,
     struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
     uint32_t flags);
 
+/** Open a listening socket with buffer size hints for accepted connections
+ * (asynchronous). 0 uses the default size. */
+int flextcp_listen_open_bufs(struct flextcp_context *ctx,
+    struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len);
+
+/** Open a listening socket with buffer size hints and congestion control
+ * algorithm (FLEXTCP_CC_*) for accepted connections (asynchronous). */
+int flextcp_listen_open_cc(struct flextcp_context *ctx,
+    struct flextcp_listener *lst, uint16_t port, uint32_t backlog,
+    uint32_t flags, uint32_t rxb_len, uint32_t txb_len, uint8_t cc);
+
 /** Accept connections on a listening socket (asynchronous). This can be called
  * more than once to register multiple connection handles. */
 int flextcp_listen_accept(struct flextcp_context *ctx,
@@ -325,6 +463,25 @@ int flextcp_listen_accept(struct flextcp_context *ctx,
 int flextcp_connection_open(struct flextcp_context *ctx,
     struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port);
 
+/** Open a connection with buffer size hints (asynchronous). 0 uses the
+ * default size. */
+int flextcp_connection_open_bufs(struct flextcp_context *ctx,
+    struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
+    uint32_t rxb_len, uint32_t txb_len);
+
+/** Open a connection with buffer size hints and congestion control algorithm
+ * (FLEXTCP_CC_*) (asynchronous). */
+int flextcp_connection_open_cc(struct flextcp_context *ctx,
+    struct flextcp_connection *conn, uint32_t dst_ip, uint16_t dst_port,
+    uint32_t rxb_len, uint32_t txb_len, uint8_t cc);
+
+/** Look up congestion control algorithm by name, returns FLEXTCP_CC_* or -1 if
+ * unknown. */
+int flextcp_cc_lookup(const char *name);
+
+/** Name of congestion control algorithm FLEXTCP_CC_*, NULL if unknown. */
+const char *flextcp_cc_name(uint8_t cc);
+
 /** Close a connection (asynchronous). */
 int flextcp_connection_close(struct flextcp_context *ctx,
     struct flextcp_connection *conn);
@@ -349,6 +506,31 @@ ssize_t flextcp_connection_tx_alloc2(struct flextcp_connection *conn, size_t len
 int flextcp_connection_tx_send(struct flextcp_context *ctx,
         struct flextcp_connection *conn, size_t len);
 
+/** One send in a flextcp_connection_tx_sendv() batch. */
+struct flextcp_sendv {
+  struct flextcp_connection *conn;
+  const struct iovec *iov;
+  int iovcnt;
+  /** Set to the number of bytes sent, or -1 if the connection is closed for
+   * sending or still has allocated bytes that were not sent. */
+  ssize_t sent;
+};
+
+/**
+ * Copy and send data for a batch of connections. Sends are truncated if a
+ * transmit buffer fills up. Each connection is bumped once per batch, and
+ * every fast path core is kicked at most once at the end. A connection may
+ * appear several times in the batch.
+ *
+ * @param ctx   Context
+ * @param sends Sends, `sent` is filled in for every entry
+ * @param num   Number of sends
+ *
+ * @return Total number of bytes sent.
+ */
+ssize_t flextcp_connection_tx_sendv(struct flextcp_context *ctx,
+    struct flextcp_sendv *sends, unsigned num);
+
 /** Send previously allocated bytes in transmit buffer */
 int flextcp_connection_tx_close(struct flextcp_context *ctx,
         struct flextcp_connection *conn);
@@ -364,6 +546,51 @@ int flextcp_connection_tx_possible(struct flextcp_context *ctx,
 int flextcp_connection_move(struct flextcp_context *ctx,
         struct flextcp_connection *conn);
 
+/**
+ * Hand connection off from its current context ctx to dst, in the fast path
+ * only. Once done, ctx gets #FLEXTCP_EV_CONN_MOVED as the last event for the
+ * connection, all later events are delivered to dst. Until then, the
+ * connection must still be used through ctx only.
+ *
+ * @param ctx  Context the connection currently belongs to
+ * @param conn Connection
+ * @param dst  Context of the same application to move to
+ *
+ * @return 0 if the move was issued, -1 otherwise.
+ */
+int flextcp_connection_handoff(struct flextcp_context *ctx,
+        struct flextcp_connection *conn, struct flextcp_context *dst);
+
+/** Connection state, see flextcp_connection_info() */
+struct flextcp_conn_info {
+  /** Received bytes not freed with flextcp_connection_rx_done() yet */
+  uint32_t rx_ready;
+  /** Bytes handed to the fast path but not acknowledged yet */
+  uint32_t tx_queued;
+  /** Bytes that can currently be allocated in the transmit buffer */
+  uint32_t tx_free;
+  /** Smoothed RTT estimate [us] */
+  uint32_t rtt_us;
+  /** Congestion control rate [kbps] */
+  uint32_t tx_rate_kbps;
+  /** Drops and retransmission timeouts in the current control interval */
+  uint16_t tx_drops;
+  uint16_t tx_rtos;
+  /** Consecutive retransmission timeouts without progress */
+  uint8_t rto_backoff;
+};
+
+/**
+ * Query connection state without a round trip to the slow path. Buffer
+ * levels come from library state, the rest is read from a read-only mapping
+ * of the fast path flow state, made on first use.
+ *
+ * @return 0 on success, -1 if the connection is not open or the flow state
+ *         could not be mapped.
+ */
+int flextcp_connection_info(struct flextcp_connection *conn,
+    struct flextcp_conn_info *info);
+
 
 
 /*****************************************************************************/
@@ -399,10 +626,100 @@ int flextcp_obj_connection_tx_alloc(struct flextcp_obj_connection *oconn,
 void flextcp_obj_connection_tx_send(struct flextcp_context *ctx,
         struct flextcp_obj_connection *conn, struct flextcp_obj_handle *oh);
 
+/** Allocate up to num objects for transmission at once, returns the number
+ * allocated. */
+int flextcp_obj_connection_tx_alloc_n(struct flextcp_obj_connection *oconn,
+    struct flextcp_obj_alloc *allocs, unsigned num);
+
+/** Send out num objects allocated with flextcp_obj_connection_tx_alloc_n() */
+void flextcp_obj_connection_tx_send_n(struct flextcp_context *ctx,
+        struct flextcp_obj_connection *conn, struct flextcp_obj_alloc *allocs,
+        unsigned num);
+
 /** Bump NIC pointers for rx and tx if necessary */
 int flextcp_obj_connection_bump(struct flextcp_context *ctx,
         struct flextcp_obj_connection *conn);
 
+/** Hash of object destination (key) the fast path steers objects by. */
+uint32_t flextcp_obj_key_hash(const void *key, uint8_t len);
+
+/**
+ * Deliver received objects with key hashes in [hash_first, hash_last] to
+ * context dst, for all object connections of this application that don't
+ * use FLEXTCP_LISTEN_OBJNOHASH / FLEXTCP_CONNECT_OBJNOHASH (asynchronous).
+ * Ranges are rounded to FLEXTCP_OBJ_STEER_BUCKETS equal parts of the hash
+ * space. On the first call, keys outside the range stay spread over all
+ * contexts.
+ *
+ * @param ctx        Context to issue the request on
+ * @param hash_first First key hash of range
+ * @param hash_last  Last key hash of range (inclusive)
+ * @param dst        Context of this application owning the range
+ *
+ * @return 0 if the request was issued, -1 otherwise.
+ */
+int flextcp_obj_steer(struct flextcp_context *ctx, uint32_t hash_first,
+    uint32_t hash_last, struct flextcp_context *dst);
+
+/** Go back to spreading objects by key hash modulo contexts (asynchronous). */
+int flextcp_obj_steer_reset(struct flextcp_context *ctx);
+
 void flextcp_block(struct flextcp_context *ctx, int timeout_ms);
 
+/**
+ * Like flextcp_block(), but also wake up once fd is readable.
+ *
+ * @return 1 if fd is readable, 0 if not, -1 on failure
+ */
+int flextcp_block_fd(struct flextcp_context *ctx, int fd, int timeout_ms);
+
+/*****************************************************************************/
+/* Context groups */
+
+/**
+ * A set of contexts polled and blocked on together by one thread. A context
+ * can be moved to another thread's group cheaply (remove, then add), without
+ * moving its connections in the fast path, as long as only one thread polls
+ * it at a time.
+ */
+struct flextcp_context_group {
+  struct flextcp_context **ctxs;
+  unsigned num;
+  unsigned cap;
+  /* context to poll first next time */
+  unsigned next;
+  int epfd;
+};
+
+/** Initialize an empty context group. */
+int flextcp_group_init(struct flextcp_context_group *g);
+
+/** Free group resources, the contexts are not touched. */
+void flextcp_group_destroy(struct flextcp_context_group *g);
+
+/** Add a context to a group. */
+int flextcp_group_add(struct flextcp_context_group *g,
+    struct flextcp_context *ctx);
+
+/** Remove a context from a group. */
+int flextcp_group_remove(struct flextcp_context_group *g,
+    struct flextcp_context *ctx);
+
+/**
+ * Poll all contexts in the group. The event space is shared evenly among
+ * the contexts and the first context polled rotates on every call.
+ *
+ * @param g       Group
+ * @param num     Size of events
+ * @param events  Events
+ * @param ev_ctxs If not NULL, filled with the context each event is for
+ *
+ * @return Number of events, < 0 on failure
+ */
+int flextcp_group_poll(struct flextcp_context_group *g, int num,
+    struct flextcp_event *events, struct flextcp_context **ev_ctxs);
+
+/** Block until any context in the group is notified or timeout_ms passed. */
+void flextcp_group_block(struct flextcp_context_group *g, int timeout_ms);
+
 #endif /* ndef TAS_LL_H_ */
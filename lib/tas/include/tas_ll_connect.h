@@ -34,7 +34,20 @@
  */
 int flexnic_driver_connect(struct flexnic_info **info, void **mem_start);
 
+/**
+ * Map only the flexnic info region, read-only, for monitoring tools. Return
+ * values as for flexnic_driver_connect, the internal memory can be mapped
+ * afterwards with flexnic_driver_internal_ro.
+ */
+int flexnic_driver_connect_ro(const struct flexnic_info **info);
+
+/** Map the fast and slow path statistics region read-only. */
+int flexnic_driver_stats(const struct flexnic_stats **stats);
+
 /** Connect to flexnic internal memory. */
 int flexnic_driver_internal(void **int_mem_start);
 
+/** Map flexnic internal memory read-only, pages are faulted in on use. */
+int flexnic_driver_internal_ro(const void **int_mem_start);
+
 #endif /* ndef FLEXNIC_DRIVER_H_ */
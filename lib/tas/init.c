@@ -31,6 +31,7 @@
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <tas_ll_connect.h>
 #include <kernel_appif.h>
@@ -59,21 +60,38 @@ static inline int event_arx_connupdate(struct flextcp_context *ctx,
     struct flextcp_event *outevs, int outn, uint16_t fn_core);
 static inline int event_arx_objupdate(struct flextcp_context *ctx,
     struct flextcp_pl_arx_connupdate *inev, struct flextcp_event *outevs,
+    int outn, int *more);
+static inline void event_arx_connresize(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_connresize *inev);
+static inline int event_arx_connmoved(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_connmoved *inev, struct flextcp_event *outev,
+    int outn);
+static inline void event_arx_txoffer(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_txoffer *inev);
+static inline int event_arx_txresized(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_txresized *inev, struct flextcp_event *outev,
     int outn);
 
 static int kernel_poll(struct flextcp_context *ctx, int num,
     struct flextcp_event *events, int *used) __attribute__((noinline));
-static int fastpath_poll(struct flextcp_context *ctx, int num,
-    struct flextcp_event *events, int *used)
-    __attribute__((used,noinline));
-static int fastpath_poll_vec(struct flextcp_context *ctx, int num,
-    struct flextcp_event *events, int *used) __attribute__((used,noinline));
-static void conns_bump(struct flextcp_context *ctx) __attribute__((noinline));
+static int fastpath_poll_pending(struct flextcp_context *ctx, int num,
+    struct flextcp_event *events, int *used) __attribute__((noinline));
 static void txq_probe(struct flextcp_context *ctx, unsigned n) __attribute__((noinline));
 
 void *flexnic_mem = NULL;
 static struct flexnic_info *flexnic_info = NULL;
-int flexnic_evfd[FLEXTCP_MAX_FTCPCORES];
+int *flexnic_evfd = NULL;
+unsigned flexnic_evfd_num = 0;
+
+/* contexts to reattach after a kernel restart, indexed by ctx_id */
+static struct {
+  uint16_t db_id;
+  int evfd;
+} ctx_reg[FLEXTCP_MAX_CONTEXTS];
+static uint32_t restart_gen;
+static pthread_mutex_t restart_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void context_register(struct flextcp_context *ctx);
 
 void flextcp_block(struct flextcp_context *ctx, int timeout_ms)
 {
@@ -102,6 +120,68 @@ again:
   }
 }
 
+int flextcp_block_fd(struct flextcp_context *ctx, int fd, int timeout_ms)
+{
+  struct epoll_event event[2];
+  uint64_t val;
+  int i, n, r, ret = 0;
+
+  event[0].events = EPOLLIN;
+  event[0].data.fd = fd;
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &event[0]) != 0) {
+    perror("flextcp_block_fd: epoll_ctl add failed");
+    return -1;
+  }
+
+  do {
+    n = epoll_wait(ctx->epfd, event, 2, timeout_ms);
+  } while (n == -1 && errno == EINTR);
+  assert(n != -1);
+
+  for (i = 0; i < n; i++) {
+    if (event[i].data.fd == ctx->evfd) {
+      r = read(ctx->evfd, &val, sizeof(uint64_t));
+      assert(r == sizeof(uint64_t));
+      (void) r;
+    } else {
+      ret = 1;
+    }
+  }
+
+  if (epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL) != 0) {
+    perror("flextcp_block_fd: epoll_ctl del failed");
+    return -1;
+  }
+  return ret;
+}
+
+int flextcp_flowstate(uint32_t flow_id, const struct flextcp_pl_flowst **fs,
+    const struct flextcp_pl_flowst_stats **st)
+{
+  static const struct flextcp_pl_mem *volatile int_mem = NULL;
+  static pthread_mutex_t int_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+  const void *m;
+  uint32_t num = flexnic_info->flow_num;
+
+  if (UNLIKELY(int_mem == NULL)) {
+    pthread_mutex_lock(&int_mem_mutex);
+    if (int_mem == NULL && flexnic_driver_internal_ro(&m) == 0) {
+      int_mem = m;
+    }
+    pthread_mutex_unlock(&int_mem_mutex);
+    if (int_mem == NULL) {
+      return -1;
+    }
+  }
+
+  if (flow_id >= num) {
+    return -1;
+  }
+  *fs = &int_mem->flowst[flow_id];
+  *st = &FLEXNIC_PL_FLOWST_STATS(int_mem, num)[flow_id];
+  return 0;
+}
+
 int flextcp_init(void)
 {
   if (flextcp_kernel_connect() != 0) {
@@ -114,20 +194,81 @@ int flextcp_init(void)
     return -1;
   }
 
+  restart_gen = flexnic_info->restart_gen;
   return 0;
 }
 
-int flextcp_context_create(struct flextcp_context *ctx)
+int flextcp_reattach(void)
 {
-  static uint16_t ctx_id = 0;
+  volatile struct flexnic_info *fi = flexnic_info;
+  uint16_t db_ids[KERNEL_UXSOCK_CTX_MAX];
+  int evfds[KERNEL_UXSOCK_CTX_MAX];
+  uint16_t i, num;
+  unsigned n;
+  int ret = 0;
+
+  pthread_mutex_lock(&restart_mutex);
+  if (fi->restart_gen == restart_gen) {
+    goto out;
+  }
+
+  /* wait for the new instance to finish taking over */
+  while ((fi->flags & FLEXNIC_FLAG_READY) != FLEXNIC_FLAG_READY) {
+    usleep(1000);
+  }
+
+  if (flextcp_kernel_reconnect() != 0) {
+    fprintf(stderr, "flextcp_reattach: reconnecting to kernel failed\n");
+    ret = -1;
+    goto out;
+  }
+
+  num = FLEXTCP_MAX_CONTEXTS;
+  for (i = 0, n = 0; i < num; i++) {
+    if (ctx_reg[i].evfd == 0) {
+      continue;
+    }
+
+    db_ids[n] = ctx_reg[i].db_id;
+    evfds[n] = ctx_reg[i].evfd;
+    if (++n == KERNEL_UXSOCK_CTX_MAX) {
+      if (flextcp_kernel_reattach(db_ids, evfds, n) != 0) {
+        ret = -1;
+        goto out;
+      }
+      n = 0;
+    }
+  }
+  if (n > 0 && flextcp_kernel_reattach(db_ids, evfds, n) != 0) {
+    ret = -1;
+    goto out;
+  }
+
+  restart_gen = fi->restart_gen;
+out:
+  pthread_mutex_unlock(&restart_mutex);
+  return ret;
+}
+
+/* contexts created ahead of time with flextcp_context_prealloc() */
+static struct flextcp_context ctx_pool[FLEXTCP_MAX_CONTEXTS];
+static unsigned ctx_pool_num = 0;
+static unsigned ctx_pool_next = 0;
+static uint16_t ctx_id_next = 0;
 
-  ctx->ctx_id = __sync_fetch_and_add(&ctx_id, 1);
+static int context_init_local(struct flextcp_context *ctx)
+{
+  ctx->ctx_id = __sync_fetch_and_add(&ctx_id_next, 1);
   if (ctx->ctx_id >= FLEXTCP_MAX_CONTEXTS) {
     fprintf(stderr, "flextcp_context_create: maximum number of contexts "
         "exeeded\n");
     return -1;
   }
 
+  ctx->bump_pending_first = ctx->bump_pending_last = NULL;
+  ctx->bump_pending_num = 0;
+  ctx->cork_budget = 0;
+
   ctx->evfd = eventfd(0, 0);
   assert(ctx->evfd != -1);
 
@@ -141,11 +282,105 @@ int flextcp_context_create(struct flextcp_context *ctx)
 
   int r = epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->evfd, &ev);
   assert(r == 0);
+  return 0;
+}
 
-  return flextcp_kernel_newctx(ctx);
+/* finish setting up a context handed out by the kernel */
+static void context_register(struct flextcp_context *ctx)
+{
+  /* poll every queue once, entries might predate the summary */
+  ctx->rxsum = &flexnic_info_rxsum(flexnic_info, ctx->db_id)->cores;
+  ctx->rx_pending = (ctx->num_queues >= 64 ? UINT64_MAX :
+      (1ULL << ctx->num_queues) - 1);
+
+  ctx_reg[ctx->ctx_id].db_id = ctx->db_id;
+  MEM_BARRIER();
+  ctx_reg[ctx->ctx_id].evfd = ctx->evfd;
 }
 
-#include <pthread.h>
+int flextcp_context_create(struct flextcp_context *ctx)
+{
+  unsigned i;
+
+  /* hand out preallocated contexts first */
+  if (ctx_pool_next < ctx_pool_num &&
+      (i = __sync_fetch_and_add(&ctx_pool_next, 1)) < ctx_pool_num)
+  {
+    *ctx = ctx_pool[i];
+    return 0;
+  }
+
+  if (context_init_local(ctx) != 0 || flextcp_kernel_newctx(ctx) != 0) {
+    return -1;
+  }
+
+  context_register(ctx);
+  return 0;
+}
+
+int flextcp_contexts_create(struct flextcp_context *ctxs, unsigned num)
+{
+  struct flextcp_context *batch[KERNEL_UXSOCK_CTX_MAX];
+  unsigned i, j, n;
+
+  for (i = 0; i < num; i += n) {
+    n = MIN(num - i, KERNEL_UXSOCK_CTX_MAX);
+    for (j = 0; j < n; j++) {
+      if (context_init_local(&ctxs[i + j]) != 0) {
+        return -1;
+      }
+      batch[j] = &ctxs[i + j];
+    }
+
+    if (flextcp_kernel_newctxs(batch, n) != 0) {
+      return -1;
+    }
+    for (j = 0; j < n; j++) {
+      context_register(batch[j]);
+    }
+  }
+
+  return 0;
+}
+
+int flextcp_context_prealloc(unsigned num)
+{
+  if (ctx_pool_num != 0 || num > FLEXTCP_MAX_CONTEXTS) {
+    fprintf(stderr, "flextcp_context_prealloc: already called or too many "
+        "contexts (%u)\n", num);
+    return -1;
+  }
+
+  if (flextcp_contexts_create(ctx_pool, num) != 0) {
+    return -1;
+  }
+
+  MEM_BARRIER();
+  ctx_pool_num = num;
+  return 0;
+}
+
+int flextcp_context_create_qos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate)
+{
+  if (flextcp_context_create(ctx) != 0) {
+    return -1;
+  }
+
+  return flextcp_context_qos(ctx, weight, rate);
+}
+
+int flextcp_context_qos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate)
+{
+  return flextcp_kernel_ctxqos(ctx, weight, rate);
+}
+
+int flextcp_context_notify(struct flextcp_context *ctx, uint32_t delay_us,
+    uint16_t count)
+{
+  return flextcp_kernel_ctxnotify(ctx, delay_us, count);
+}
 
 int debug_flextcp_on = 0;
 
@@ -208,31 +443,66 @@ static int kernel_poll(struct flextcp_context *ctx, int num,
   return (j == -1 ? -1 : 0);
 }
 
-static int fastpath_poll(struct flextcp_context *ctx, int num,
+/* hand rx queue entry back to the fast path, leaving it how long the entry
+ * waited for its delivery latency histogram */
+static inline void arx_free(struct flextcp_pl_arx *arx)
+{
+  uint64_t tsc = arx->msg.connupdate.tsc;
+
+  if (tsc != 0) {
+    arx->msg.connupdate.tsc = util_rdtsc() - tsc;
+    MEM_BARRIER();
+  }
+  arx->type = 0;
+}
+
+/* only polls queues in rx_pending, and clears the bits of queues drained */
+static int fastpath_poll_pending(struct flextcp_context *ctx, int num,
     struct flextcp_event *events, int *used)
 {
-  int i, j, ran_out;
+  int i, j, ran_out, more;
   struct flextcp_pl_arx *arx_q, *arx;
   uint32_t head;
-  uint16_t k;
+  uint16_t k, q;
 
   i = 0;
+  q = ctx->next_queue;
   for (k = 0; k < ctx->num_queues && i < num; k++) {
-    ran_out = 0;
+    if ((ctx->rx_pending & (1ULL << q)) == 0)
+      goto next;
 
-    arx_q = (struct flextcp_pl_arx *) ctx->queues[ctx->next_queue].rxq_base;
-    head = ctx->queues[ctx->next_queue].rxq_head;
+    ran_out = 0;
+    arx_q = (struct flextcp_pl_arx *) ctx->queues[q].rxq_base;
+    head = ctx->queues[q].rxq_head;
     for (; i < num;) {
       j = 0;
       arx = &arx_q[head / sizeof(*arx)];
       if (arx->type == FLEXTCP_PL_ARX_INVALID) {
         break;
       } else if (arx->type == FLEXTCP_PL_ARX_CONNUPDATE) {
-        j = event_arx_connupdate(ctx, &arx->msg.connupdate, events + i, num - i, ctx->next_queue);
+        j = event_arx_connupdate(ctx, &arx->msg.connupdate, events + i,
+            num - i, q);
       } else if (arx->type == FLEXTCP_PL_ARX_OBJUPDATE) {
-        j = event_arx_objupdate(ctx, &arx->msg.connupdate, events + i, num - i);
+        j = event_arx_objupdate(ctx, &arx->msg.connupdate, events + i,
+            num - i, &more);
+        /* rest of the objects stay in the entry for the next poll */
+        if (more) {
+          i += j;
+          ran_out = 1;
+          break;
+        }
+      } else if (arx->type == FLEXTCP_PL_ARX_CONNRESIZE) {
+        event_arx_connresize(ctx, &arx->msg.connresize);
+      } else if (arx->type == FLEXTCP_PL_ARX_CONNMOVED) {
+        j = event_arx_connmoved(ctx, &arx->msg.connmoved, events + i, num - i);
+      } else if (arx->type == FLEXTCP_PL_ARX_TXOFFER) {
+        event_arx_txoffer(ctx, &arx->msg.txoffer);
+      } else if (arx->type == FLEXTCP_PL_ARX_TXRESIZED) {
+        j = event_arx_txresized(ctx, &arx->msg.txresized, events + i,
+            num - i);
       } else {
-        fprintf(stderr, "flextcp_context_poll: kout type=%u head=%x\n", arx->type, head);
+        fprintf(stderr, "flextcp_context_poll: kout type=%u head=%x\n",
+            arx->type, head);
       }
 
       if (j == -1) {
@@ -241,7 +511,7 @@ static int fastpath_poll(struct flextcp_context *ctx, int num,
       }
       i += j;
 
-      arx->type = 0;
+      arx_free(arx);
 
       /* next entry */
       head += sizeof(*arx);
@@ -250,242 +520,37 @@ static int fastpath_poll(struct flextcp_context *ctx, int num,
       }
     }
 
-    ctx->queues[ctx->next_queue].rxq_head = head;
-    if (ran_out) {
+    ctx->queues[q].rxq_head = head;
+    /* out of event space, continue with this queue next time */
+    if (ran_out || i >= num) {
+      ctx->next_queue = q;
       *used = i;
-      return -1;
+      return (ran_out ? -1 : 0);
     }
+    ctx->rx_pending &= ~(1ULL << q);
 
-    ctx->next_queue = ctx->next_queue + 1;
-    if (ctx->next_queue >= ctx->num_queues)
-      ctx->next_queue -= ctx->num_queues;
+next:
+    q = (q + 1 < ctx->num_queues ? q + 1 : 0);
   }
 
+  ctx->next_queue = q;
   *used = i;
   return 0;
 }
 
-static inline void fetch_8ts(struct flextcp_context *ctx, uint32_t *heads,
-    uint16_t q, uint8_t *ts)
+int flextcp_context_cork(struct flextcp_context *ctx, uint16_t budget)
 {
-  struct flextcp_pl_arx *p0, *p1, *p2, *p3, *p4, *p5, *p6, *p7;
-
-  p0 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p1 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p2 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p3 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p4 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p5 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p6 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p7 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-
-  asm volatile(
-      "prefetcht0 32(%0);"
-      "prefetcht0 32(%1);"
-      "prefetcht0 32(%2);"
-      "prefetcht0 32(%3);"
-      "prefetcht0 32(%4);"
-      "prefetcht0 32(%5);"
-      "prefetcht0 32(%6);"
-      "prefetcht0 32(%7);"
-      "movb 31(%0), %b0;"
-      "movb 31(%1), %b1;"
-      "movb 31(%2), %b2;"
-      "movb 31(%3), %b3;"
-      "movb 31(%4), %b4;"
-      "movb 31(%5), %b5;"
-      "movb 31(%6), %b6;"
-      "movb 31(%7), %b7;"
-
-      "movb %b0, 0(%8);"
-      "movb %b1, 1(%8);"
-      "movb %b2, 2(%8);"
-      "movb %b3, 3(%8);"
-      "movb %b4, 4(%8);"
-      "movb %b5, 5(%8);"
-      "movb %b6, 6(%8);"
-      "movb %b7, 7(%8);"
-      :
-      : "r" (p0), "r" (p1), "r" (p2), "r" (p3),
-        "r" (p4), "r" (p5), "r" (p6), "r" (p7), "r" (ts)
-      : "memory");
-
+  ctx->cork_budget = budget;
+  if (budget == 0 || ctx->bump_pending_num >= budget)
+    flextcp_conns_bump(ctx);
+  return 0;
 }
 
-static inline void fetch_4ts(struct flextcp_context *ctx, uint32_t *heads,
-    uint16_t q, uint8_t *ts)
+void flextcp_context_flush(struct flextcp_context *ctx)
 {
-  struct flextcp_pl_arx *p0, *p1, *p2, *p3;
-
-  p0 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p1 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p2 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  p3 = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + heads[q]);
-  q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-
-  asm volatile(
-      "prefetcht0 32(%0);"
-      "prefetcht0 32(%1);"
-      "prefetcht0 32(%2);"
-      "prefetcht0 32(%3);"
-      "movb 31(%0), %b0;"
-      "movb 31(%1), %b1;"
-      "movb 31(%2), %b2;"
-      "movb 31(%3), %b3;"
-      "movb %b0, 0(%4);"
-      "movb %b1, 1(%4);"
-      "movb %b2, 2(%4);"
-      "movb %b3, 3(%4);"
-      :
-      : "r" (p0), "r" (p1), "r" (p2), "r" (p3), "r" (ts)
-      : "memory");
+  flextcp_conns_bump(ctx);
 }
 
-
-static int fastpath_poll_vec(struct flextcp_context *ctx, int num,
-    struct flextcp_event *events, int *used)
-{
-  int i, j, ran_out, found;
-  struct flextcp_pl_arx *arx;
-  uint32_t head;
-  uint16_t l, k, q;
-  uint8_t t;
-  uint8_t types[ctx->num_queues];
-  uint32_t qheads[ctx->num_queues];
-
-  struct flextcp_pl_arx *arxs[num];
-  uint8_t arx_qs[num];
-
-  for (q = 0; q < ctx->num_queues; q++) {
-    qheads[q] = ctx->queues[q].rxq_head;
-  }
-
-  ran_out = found = 0;
-  i = 0;
-  q = ctx->next_queue;
-  while (i < num && !ran_out) {
-    l = 0;
-    for (found = 1; found && i + l < num; ) {
-      found = 0;
-
-      /* fetch types from all n queues */
-      uint16_t qs = ctx->num_queues;
-      q = ctx->next_queue;
-      k = 0;
-      while (qs > 8) {
-        fetch_8ts(ctx, qheads, q, types + k);
-
-        q = (q + 8 < ctx->num_queues ? q + 8 : q + 8 - ctx->num_queues);
-        k += 8;
-        qs -= 8;
-      }
-      while (qs > 4) {
-        fetch_4ts(ctx, qheads, q, types + k);
-
-        q = (q + 4 < ctx->num_queues ? q + 4 : q + 4 - ctx->num_queues);
-        k += 4;
-        qs -= 4;
-      }
-      while (qs > 0) {
-        arx = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base + qheads[q]);
-        q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-        types[k] = arx->type;
-        k++;
-        qs--;
-      }
-
-      /* prefetch connection state for all entries */
-      for (k = 0, q = ctx->next_queue; k < ctx->num_queues && i + l < num; k++) {
-        if (types[k] == FLEXTCP_PL_ARX_CONNUPDATE ||
-            types[k] == FLEXTCP_PL_ARX_OBJUPDATE)
-        {
-          arx = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base +
-              qheads[q]);
-          util_prefetch0(OPAQUE_PTR(arx->msg.connupdate.opaque) + 64);
-          util_prefetch0(OPAQUE_PTR(arx->msg.connupdate.opaque));
-
-          arxs[l] = arx;
-          arx_qs[l] = q;
-          l++;
-          found = 1;
-
-          qheads[q] = qheads[q] + sizeof(*arx);
-          if (qheads[q] >= ctx->rxq_len) {
-            qheads[q] -= ctx->rxq_len;
-          }
-        }
-        q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-      }
-    }
-
-    if (l == 0)
-      break;
-
-    for (k = 0; k < l && i < num; k++) {
-      arx = arxs[k];
-      q = arx_qs[k];
-      head = ctx->queues[q].rxq_head;
-
-      t = arx->type;
-      assert(t != FLEXTCP_PL_ARX_INVALID);
-
-      if (t == FLEXTCP_PL_ARX_CONNUPDATE) {
-        j = event_arx_connupdate(ctx, &arx->msg.connupdate, events + i,
-            num - i, q);
-      } else if (t == FLEXTCP_PL_ARX_OBJUPDATE) {
-        j = event_arx_objupdate(ctx, &arx->msg.connupdate, events + i, num - i);
-      } else {
-        j = 0;
-        fprintf(stderr, "flextcp_context_poll: kout type=%u head=%x\n",
-            arx->type, head);
-      }
-
-      if (j == -1) {
-        ran_out = 1;
-        break;
-      }
-      i += j;
-
-      arx->type = 0;
-
-      /* next entry */
-      head += sizeof(*arx);
-      if (head >= ctx->rxq_len) {
-        head -= ctx->rxq_len;
-      }
-      ctx->queues[q].rxq_head = head;
-      found = 1;
-    }
-    q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-  }
-
-  ctx->next_queue = q;
-
-  if (found) {
-    for (k = 0, q = ctx->next_queue; k < ctx->num_queues; k++) {
-      arx = (struct flextcp_pl_arx *) (ctx->queues[q].rxq_base +
-          ctx->queues[q].rxq_head);
-      util_prefetch0(arx);
-      q = (q + 1 < ctx->num_queues ? q + 1 : 0);
-    }
-  }
-
-  *used = i;
-  return 0;
-}
-
-
 int flextcp_context_poll(struct flextcp_context *ctx, int num,
     struct flextcp_event *events)
 {
@@ -493,11 +558,24 @@ int flextcp_context_poll(struct flextcp_context *ctx, int num,
 
   i = 0;
 
-  /* prefetch queues */
+  /* kernel was restarted, hand our contexts to the new instance */
+  if (UNLIKELY(*(volatile uint32_t *) &flexnic_info->restart_gen !=
+        restart_gen))
+  {
+    flextcp_reattach();
+  }
+
+  /* pick up queues with new entries, and prefetch those */
   uint32_t k, q;
-  for (k = 0, q = ctx->next_queue; k < ctx->num_queues; k++) {
-    util_prefetch0((struct flextcp_pl_arx *) (ctx->queues[q].rxq_base +
-        ctx->queues[q].rxq_head));
+  if (*ctx->rxsum != 0)
+    ctx->rx_pending |= __atomic_exchange_n(ctx->rxsum, 0, __ATOMIC_SEQ_CST);
+  for (k = 0, q = ctx->next_queue; k < ctx->num_queues &&
+      ctx->rx_pending != 0; k++)
+  {
+    if ((ctx->rx_pending & (1ULL << q)) != 0) {
+      util_prefetch0((struct flextcp_pl_arx *) (ctx->queues[q].rxq_base +
+          ctx->queues[q].rxq_head));
+    }
     q = (q + 1 < ctx->num_queues ? q + 1 : 0);
   }
 
@@ -508,10 +586,13 @@ int flextcp_context_poll(struct flextcp_context *ctx, int num,
   }
 
   /* poll NIC queues */
-  fastpath_poll_vec(ctx, num - i, events + i, &j);
+  j = 0;
+  if (ctx->rx_pending != 0)
+    fastpath_poll_pending(ctx, num - i, events + i, &j);
 
   txq_probe(ctx, num);
-  conns_bump(ctx);
+  if (ctx->cork_budget == 0)
+    flextcp_conns_bump(ctx);
 
   return i + j;
 }
@@ -529,10 +610,9 @@ int flextcp_context_tx_alloc(struct flextcp_context *ctx,
   return 0;
 }
 
-static void flextcp_flexnic_kick(struct flextcp_context *ctx, int core)
+static void flextcp_flexnic_kick(struct flextcp_context *ctx, int core,
+    uint32_t now)
 {
-  uint32_t now = util_timeout_time_us();
-
   if(now - ctx->queues[core].last_ts > POLL_CYCLE) {
     // Kick
     uint64_t val = 1;
@@ -543,7 +623,8 @@ static void flextcp_flexnic_kick(struct flextcp_context *ctx, int core)
   ctx->queues[core].last_ts = now;
 }
 
-void flextcp_context_tx_done(struct flextcp_context *ctx, uint16_t core)
+static inline void context_tx_advance(struct flextcp_context *ctx,
+    uint16_t core)
 {
   ctx->queues[core].txq_tail += sizeof(struct flextcp_pl_atx);
   if (ctx->queues[core].txq_tail >= ctx->txq_len) {
@@ -551,8 +632,12 @@ void flextcp_context_tx_done(struct flextcp_context *ctx, uint16_t core)
   }
 
   ctx->queues[core].txq_avail -= sizeof(struct flextcp_pl_atx);
+}
 
-  flextcp_flexnic_kick(ctx, core);
+void flextcp_context_tx_done(struct flextcp_context *ctx, uint16_t core)
+{
+  context_tx_advance(ctx, core);
+  flextcp_flexnic_kick(ctx, core, util_timeout_time_us());
 }
 
 static inline int event_kappin_conn_opened(
@@ -658,6 +743,7 @@ static inline int event_kappin_accept_conn(
 {
   struct flextcp_obj_connection *oconn;
   struct flextcp_connection *conn;
+  uint32_t rx_head;
   int j = 1;
 
   /* depending on whether this is an object connection, we issue different
@@ -677,18 +763,22 @@ static inline int event_kappin_accept_conn(
     outev->ev.listen_accept.conn = conn;
   }
 
+  /* fast open payload from the SYN precedes anything received since */
+  rx_head = conn->rxb_head + inev->syn_len;
+
   if (inev->status != 0) {
     conn->status = CONN_CLOSED;
     return 1;
-  } else if (conn->rxb_head > 0 && conn->rx_closed && avail < 3) {
+  } else if (rx_head > 0 && conn->rx_closed && avail < 3) {
     /* if we've already received updates, we'll need to inject them */
     return -1;
-  } else if ((conn->rxb_head > 0 || conn->rx_closed) && avail < 2) {
+  } else if ((rx_head > 0 || conn->rx_closed) && avail < 2) {
     /* if we've already received updates, we'll need to inject them */
     return -1;
   }
 
   conn->status = CONN_OPEN;
+  conn->rxb_head = rx_head;
   conn->local_ip = inev->local_ip;
   conn->remote_ip = inev->remote_ip;
   conn->remote_port = inev->remote_port;
@@ -774,6 +864,90 @@ static inline void event_kappin_st_conn_closed(
   conn->status = CONN_CLOSED;
 }
 
+/* kernel autotuning replaced the rx buffer, the fast path only does this once
+ * all data in the old one has been consumed and released */
+static inline void event_arx_connresize(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_connresize *inev)
+{
+  struct flextcp_connection *conn;
+
+  conn = OPAQUE_PTR(inev->opaque);
+  assert(conn->rxb_head == conn->rxb_tail);
+
+  conn->rxb_base = (uint8_t *) flexnic_mem + inev->rx_base;
+  conn->rxb_len = inev->rx_len;
+  conn->rxb_head = 0;
+  conn->rxb_tail = 0;
+  conn->rxb_nictail = 0;
+}
+
+/* last entry for a connection handed off to another context */
+static inline int event_arx_connmoved(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_connmoved *inev, struct flextcp_event *outev,
+    int outn)
+{
+  if (outn < 1)
+    return -1;
+
+  outev->event_type = FLEXTCP_EV_CONN_MOVED;
+  outev->ev.conn_moved.status = inev->status;
+  outev->ev.conn_moved.conn = OPAQUE_PTR(inev->opaque);
+  return 1;
+}
+
+/* kernel autotuning offers a new tx buffer, switched to once drained */
+static inline void event_arx_txoffer(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_txoffer *inev)
+{
+  struct flextcp_connection *conn;
+
+  if (OPAQUE_ISOBJ(inev->opaque))
+    return;
+
+  conn = OPAQUE_PTR(inev->opaque);
+  if (conn->status != CONN_OPEN)
+    return;
+
+  conn->txb_offer_base = (uint8_t *) flexnic_mem + inev->tx_base;
+  conn->txb_offer_len = inev->tx_len;
+  flextcp_conn_txresize(ctx, conn);
+}
+
+/* answer to a tx buffer switch, allocations can continue either way */
+static inline int event_arx_txresized(struct flextcp_context *ctx,
+    struct flextcp_pl_arx_txresized *inev, struct flextcp_event *outev,
+    int outn)
+{
+  struct flextcp_connection *conn;
+
+  if (outn < 1)
+    return -1;
+
+  conn = OPAQUE_PTR(inev->opaque);
+  conn->flags &= ~CONN_FLAG_TXRESIZE;
+  if (inev->status == 0) {
+    conn->txb_base = conn->txb_offer_base;
+    conn->txb_len = conn->txb_offer_len;
+    conn->txb_head = 0;
+    conn->txb_head_alloc = 0;
+    conn->txb_tail = 0;
+    conn->txb_nichead = 0;
+    conn->txb_offer_len = 0;
+  }
+
+  /* tx close came in while the switch was in flight */
+  if ((conn->flags & CONN_FLAG_TXEOS) == CONN_FLAG_TXEOS &&
+      !(conn->flags & CONN_FLAG_TXEOS_ALLOC))
+  {
+    conn->txb_offer_len = 0;
+    flextcp_conn_pushtxeos(ctx, conn);
+  }
+
+  outev->event_type = FLEXTCP_EV_CONN_SENDBUF;
+  outev->ev.conn_sendbuf.conn = conn;
+  return 1;
+}
+
 static inline int event_arx_connupdate(struct flextcp_context *ctx,
     struct flextcp_pl_arx_connupdate *inev, struct flextcp_event *outevs,
     int outn, uint16_t fn_core)
@@ -818,8 +992,10 @@ static inline int event_arx_connupdate(struct flextcp_context *ctx,
     }
   }
 
-  /* if tx buffer was depleted, we'll generate a tx avail event */
-  tx_avail_ev = (tx_bump > 0 && flextcp_conn_txbuf_available(conn) == 0);
+  /* if tx buffer was depleted, we'll generate a tx avail event; while
+   * draining for a buffer switch that comes with the switch instead */
+  tx_avail_ev = (tx_bump > 0 && flextcp_conn_txbuf_available(conn) == 0 &&
+      (conn->flags & (CONN_FLAG_TXOFFER | CONN_FLAG_TXRESIZE)) == 0);
   if (tx_avail_ev) {
     evs_needed++;
   }
@@ -878,6 +1054,8 @@ static inline int event_arx_connupdate(struct flextcp_context *ctx,
   /* bump tx */
   if (tx_bump > 0) {
     conn->txb_tail = tx_tail;
+    if (conn->txb_offer_len != 0)
+      flextcp_conn_txresize(ctx, conn);
 
     if (tx_avail_ev) {
       outevs[i].event_type = FLEXTCP_EV_CONN_SENDBUF;
@@ -887,7 +1065,7 @@ static inline int event_arx_connupdate(struct flextcp_context *ctx,
 
     /* if we were previously unable to push out TX EOS, do so now. */
     if ((conn->flags & CONN_FLAG_TXEOS) == CONN_FLAG_TXEOS &&
-        !(conn->flags & CONN_FLAG_TXEOS_ALLOC))
+        !(conn->flags & (CONN_FLAG_TXEOS_ALLOC | CONN_FLAG_TXRESIZE)))
     {
       if (flextcp_conn_pushtxeos(ctx, conn) != 0) {
         /* should never happen */
@@ -921,19 +1099,24 @@ static inline int event_arx_connupdate(struct flextcp_context *ctx,
   return i;
 }
 
+/* An entry covers any number of objects, if they don't all fit in outevs the
+ * ones that do are delivered, the entry is updated to start at the next
+ * object and *more is set. */
 static inline int event_arx_objupdate(struct flextcp_context *ctx,
     struct flextcp_pl_arx_connupdate *inev, struct flextcp_event *outevs,
-    int outn)
+    int outn, int *more)
 {
   int i = 0, txev;
   struct flextcp_obj_connection *oc;
   struct flextcp_connection *conn;
   struct flextcp_obj_conn_ctx *cc;
   struct obj_hdr oh;
-  uint32_t obj_pos, obj_len = 0, data_start, data_len, rx_bump, tx_bump,
-           obj_end;
+  uint32_t obj_pos, obj_len = 0, hdr_len, data_start, data_len, rx_bump,
+           tx_bump, obj_end = 0, rx_pos, n, start_pos, start_bump;
+  int complete = 0;
   size_t l;
 
+  *more = 0;
   if (outn < 2) {
     return -1;
   }
@@ -964,37 +1147,57 @@ static inline int event_arx_objupdate(struct flextcp_context *ctx,
     return i;
   }
 
-  /* Now we know that there is definitely an RX bump */
-
-  /* Check if this is a new object */
+  /* Now we know that there is definitely an RX bump. It covers one or more
+   * objects back to back: the first one may continue an earlier object, and
+   * the last one may not be complete yet. */
   obj_len = cc->obj_len_rem;
   obj_pos = cc->obj_pos;
-  if (obj_len == 0) {
-    if (inev->rx_bump < sizeof(oh)) {
-      fprintf(stderr, "event_arx_objupdate: rx bump for new object smaller"
-          " than object header (got %u expect %zu)\n", inev->rx_bump,
-          sizeof(oh));
-      abort();
-    }
+  hdr_len = cc->obj_hdr_len;
+  rx_pos = inev->rx_pos;
+  while (rx_bump > 0) {
+    start_pos = rx_pos;
+    start_bump = rx_bump;
+
+    /* Check if this is a new object */
+    if (obj_len == 0) {
+      if (hdr_len == 0)
+        obj_pos = rx_pos;
+
+      /* header split over updates, wait for the rest */
+      if (hdr_len + rx_bump < sizeof(oh)) {
+        hdr_len += rx_bump;
+        rx_pos = circ_offset(rx_pos, conn->rxb_len, rx_bump);
+        rx_bump = 0;
+        break;
+      }
 
-    /* get object header */
-    circ_read(&oh, conn->rxb_base, conn->rxb_len, inev->rx_pos, sizeof(oh));
+      /* get object header */
+      circ_read(&oh, conn->rxb_base, conn->rxb_len, obj_pos, sizeof(oh));
 
-    /* calculate object length */
-    obj_len = sizeof(oh) + oh.dstlen + f_beui32(oh.len);
-    obj_pos = inev->rx_pos;
-  }
+      /* calculate remaining object length */
+      obj_len = sizeof(oh) + oh.dstlen + f_beui32(oh.len) - hdr_len;
+      hdr_len = 0;
+    }
 
-  if (rx_bump > obj_len) {
-    fprintf(stderr, "event_arx_objupdate: rx bump larger than object (got %u "
-        " expect %u)\n", rx_bump, obj_len);
-    abort();
-  }
+    n = MIN(rx_bump, obj_len);
+    obj_len -= n;
+    rx_bump -= n;
+    rx_pos = circ_offset(rx_pos, conn->rxb_len, n);
 
-  obj_len -= rx_bump;
+    if (obj_len != 0)
+      break;
+
+    /* Object complete, keep room for the sendbuf event. If there is none
+     * left, this object started in the entry after an earlier one, so the
+     * entry can restart at it. */
+    if (i + 2 > outn) {
+      inev->rx_pos = start_pos;
+      inev->rx_bump = start_bump;
+      obj_len = 0;
+      *more = 1;
+      break;
+    }
 
-  /* Check if this object is complete */
-  if (obj_len == 0) {
     /* get object header */
     circ_read(&oh, conn->rxb_base, conn->rxb_len, obj_pos, sizeof(oh));
 
@@ -1017,16 +1220,19 @@ static inline int event_arx_objupdate(struct flextcp_context *ctx,
 
     /* calculate object end position to update rx head */
     obj_end = circ_offset(obj_pos, conn->rxb_len, sizeof(oh) + data_len);
+    complete = 1;
   }
 
   /* update context local state */
   cc->obj_len_rem = obj_len;
   cc->obj_pos = obj_pos;
+  cc->obj_hdr_len = hdr_len;
 
   oconn_lock(oc);
 
-  /* if this object is beyond any previously received objects, bump rxb_head */
-  if (obj_len == 0 && circ_in_interval(conn->rxb_head, conn->rxb_tail,
+  /* if the last complete object is beyond any previously received objects,
+   * bump rxb_head */
+  if (complete && circ_in_interval(conn->rxb_head, conn->rxb_tail,
         conn->rxb_len, obj_end))
   {
     conn->rxb_head = obj_end;
@@ -1037,6 +1243,7 @@ static inline int event_arx_objupdate(struct flextcp_context *ctx,
     txev = flextcp_conn_txbuf_available(conn) == 0;
 
     conn->txb_tail = circ_offset(conn->txb_tail, conn->txb_len, tx_bump);
+    inev->tx_bump = 0;
 
     if (txev) {
       outevs[i].event_type = FLEXTCP_EV_OBJ_CONN_SENDBUF;
@@ -1089,10 +1296,13 @@ static void txq_probe(struct flextcp_context *ctx, unsigned n)
   }
 }
 
-static void conns_bump(struct flextcp_context *ctx)
+void flextcp_conns_bump(struct flextcp_context *ctx)
 {
   struct flextcp_connection *c;
   struct flextcp_pl_atx *atx;
+  uint64_t kick = 0;
+  uint32_t now;
+  uint16_t core;
   uint8_t flags;
 
   while ((c = ctx->bump_pending_first) != NULL) {
@@ -1116,14 +1326,25 @@ static void conns_bump(struct flextcp_context *ctx)
     MEM_BARRIER();
     atx->type = FLEXTCP_PL_ATX_CONNUPDATE;
 
-    flextcp_context_tx_done(ctx, c->fn_core);
+    /* kick each core once after all entries are written */
+    context_tx_advance(ctx, c->fn_core);
+    kick |= 1ULL << c->fn_core;
 
     c->rxb_nictail = c->rxb_tail;
     c->bump_pending = 0;
+    ctx->bump_pending_num--;
 
     if (c->bump_next == NULL) {
       ctx->bump_pending_last = NULL;
     }
     ctx->bump_pending_first = c->bump_next;
   }
+
+  if (kick != 0) {
+    now = util_timeout_time_us();
+    for (core = 0; kick != 0; core++, kick >>= 1) {
+      if ((kick & 1) != 0)
+        flextcp_flexnic_kick(ctx, core, now);
+    }
+  }
 }
@@ -43,6 +43,10 @@
 #define CONN_FLAG_TXEOS_ALLOC 2
 #define CONN_FLAG_TXEOS_ACK 4
 #define CONN_FLAG_RXEOS 8
+/* tx buffer offered, no allocations until drained and switched */
+#define CONN_FLAG_TXOFFER 16
+/* tx buffer switch sent to fast path, waiting for the answer */
+#define CONN_FLAG_TXRESIZE 32
 
 enum conn_state {
   CONN_CLOSED,
@@ -53,19 +57,43 @@ enum conn_state {
 };
 
 extern void *flexnic_mem;
-extern int flexnic_evfd[FLEXTCP_MAX_FTCPCORES];
+
+/** Fast path flow state and counters for flow_id, mapped read-only on first
+ * use */
+int flextcp_flowstate(uint32_t flow_id, const struct flextcp_pl_flowst **fs,
+    const struct flextcp_pl_flowst_stats **st);
+extern int *flexnic_evfd;
+extern unsigned flexnic_evfd_num;
 
 int flextcp_kernel_connect(void);
 int flextcp_kernel_newctx(struct flextcp_context *ctx);
+int flextcp_kernel_newctxs(struct flextcp_context **ctxs, unsigned num);
+/** Connect to a restarted kernel, replacing the socket and eventfds */
+int flextcp_kernel_reconnect(void);
+/** Reattach contexts db_ids with their eventfds after a restart */
+int flextcp_kernel_reattach(const uint16_t *db_ids, const int *evfds,
+    unsigned num);
+int flextcp_kernel_ctxqos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate);
+int flextcp_kernel_ctxnotify(struct flextcp_context *ctx, uint32_t delay,
+    uint16_t count);
+int flextcp_kernel_objsteer(struct flextcp_context *ctx, uint16_t first,
+    uint16_t last, uint16_t db_id, int off);
+int flextcp_kernel_route(struct flextcp_context *ctx, uint32_t ip,
+    uint8_t prefix, uint32_t next_hop_ip, int16_t port, int del);
 void flextcp_kernel_kick(void);
 
 int flextcp_context_tx_alloc(struct flextcp_context *ctx,
     struct flextcp_pl_atx **atx, uint16_t core);
 void flextcp_context_tx_done(struct flextcp_context *ctx, uint16_t core);
+void flextcp_conns_bump(struct flextcp_context *ctx)
+    __attribute__((noinline));
 
 uint32_t flextcp_conn_txbuf_available(struct flextcp_connection *conn);
 int flextcp_conn_pushtxeos(struct flextcp_context *ctx,
         struct flextcp_connection *conn);
+int flextcp_conn_txresize(struct flextcp_context *ctx,
+        struct flextcp_connection *conn);
 
 static inline void oconn_lock(struct flextcp_obj_connection *oc)
 {
@@ -35,10 +35,15 @@
 
 #define NIC_RXQ_LEN (64 * 32 * 1024)
 #define NIC_TXQ_LEN (64 * 8192)
+#define KERNEL_RECONNECT_TRIES 10000
 
 static int ksock_fd = -1;
 static int kernel_evfd = 0;
 
+static int uxsocket_connect(void);
+static int uxsocket_setup(int fd);
+static int uxsocket_resp_read(struct kernel_uxsock_response *resp);
+
 void flextcp_kernel_kick(void)
 {
   static uint32_t __thread last_ts = 0;
@@ -60,12 +65,101 @@ void flextcp_kernel_kick(void)
 
 int flextcp_kernel_connect(void)
 {
-  int fd, *pfd;
-  uint8_t b;
-  ssize_t r;
-  uint32_t num_fds, off, i, n;
+  int fd;
+
+  if ((fd = uxsocket_connect()) < 0) {
+    perror("flextcp_kernel_connect: connect failed");
+    return -1;
+  }
+
+  return uxsocket_setup(fd);
+}
+
+int flextcp_kernel_reconnect(void)
+{
+  int fd;
+  unsigned i;
+
+  /* the new instance accepts connections some time after it is ready */
+  for (i = 0; (fd = uxsocket_connect()) < 0; i++) {
+    if (i >= KERNEL_RECONNECT_TRIES) {
+      perror("flextcp_kernel_reconnect: connect failed");
+      return -1;
+    }
+    usleep(1000);
+  }
+
+  /* old eventfds are left open, other threads might still kick them */
+  close(ksock_fd);
+  return uxsocket_setup(fd);
+}
+
+int flextcp_kernel_reattach(const uint16_t *db_ids, const int *evfds,
+    unsigned num)
+{
+  ssize_t sz;
+  struct kernel_uxsock_response *resp;
+  uint8_t resp_buf[sizeof(*resp) +
+      flexnic_evfd_num * sizeof(resp->flexnic_qs[0])];
+  struct kernel_uxsock_request req = {
+      .ctx_num = num,
+      .flags = KERNEL_UXSOCK_REATTACH,
+    };
+  unsigned k;
+
+  assert(num > 0 && num <= KERNEL_UXSOCK_CTX_MAX);
+  for (k = 0; k < num; k++) {
+    req.db_ids[k] = db_ids[k];
+  }
+
+  struct iovec iov = {
+    .iov_base = &req,
+    .iov_len = sizeof(req),
+  };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * KERNEL_UXSOCK_CTX_MAX)];
+    struct cmsghdr align;
+  } u;
+  struct msghdr msg = {
+    .msg_name = NULL,
+    .msg_namelen = 0,
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = u.buf,
+    .msg_controllen = CMSG_SPACE(sizeof(int) * num),
+    .msg_flags = 0,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+  memcpy(CMSG_DATA(cmsg), evfds, sizeof(int) * num);
+  sz = sendmsg(ksock_fd, &msg, 0);
+  if (sz != sizeof(req)) {
+    perror("flextcp_kernel_reattach: sendmsg failed");
+    return -1;
+  }
+
+  /* queues stay where they were, the responses are only checked */
+  resp = (struct kernel_uxsock_response *) resp_buf;
+  for (k = 0; k < num; k++) {
+    if (uxsocket_resp_read(resp) != 0) {
+      return -1;
+    }
+    if (resp->status != 0 || resp->flexnic_db_id != db_ids[k]) {
+      fprintf(stderr, "flextcp_kernel_reattach: reattaching context %u "
+          "failed\n", db_ids[k]);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int uxsocket_connect(void)
+{
+  int fd;
   struct sockaddr_un saun;
-  struct cmsghdr *cmsg;
 
   /* prepare socket address */
   memset(&saun, 0, sizeof(saun));
@@ -73,15 +167,26 @@ int flextcp_kernel_connect(void)
   memcpy(saun.sun_path, KERNEL_SOCKET_PATH, sizeof(KERNEL_SOCKET_PATH));
 
   if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-    perror("flextcp_kernel_connect: socket failed");
     return -1;
   }
 
   if (connect(fd, (struct sockaddr *) &saun, sizeof(saun)) != 0) {
-    perror("flextcp_kernel_connect: connect failed");
+    close(fd);
     return -1;
   }
 
+  return fd;
+}
+
+/* receive kernel and fast path eventfds on new connection */
+static int uxsocket_setup(int fd)
+{
+  int *pfd, *evfds;
+  uint8_t b;
+  ssize_t r;
+  uint32_t num_fds, off, i, n;
+  struct cmsghdr *cmsg;
+
   struct iovec iov = {
     .iov_base = &num_fds,
     .iov_len = sizeof(uint32_t),
@@ -117,6 +222,12 @@ int flextcp_kernel_connect(void)
   }
   kernel_evfd = *pfd;
 
+  /* one fd per fast path core */
+  if ((evfds = calloc(num_fds, sizeof(*evfds))) == NULL) {
+    perror("flextcp_kernel_connect: allocating fd array failed");
+    abort();
+  }
+
   /* receive fast path fds in batches of 4 */
   off = 0;
   for (off = 0 ; off < num_fds; ) {
@@ -147,33 +258,47 @@ int flextcp_kernel_connect(void)
     }
 
     for (i = 0; i < n; i++) {
-      flexnic_evfd[off++] = pfd[i];
+      evfds[off++] = pfd[i];
     }
   }
 
+  /* fast path core count does not change across restarts */
+  flexnic_evfd_num = num_fds;
+  MEM_BARRIER();
+  flexnic_evfd = evfds;
   ksock_fd = fd;
   return 0;
 }
 
 int flextcp_kernel_newctx(struct flextcp_context *ctx)
 {
-  ssize_t sz, off, total_sz;
+  return flextcp_kernel_newctxs(&ctx, 1);
+}
+
+int flextcp_kernel_newctxs(struct flextcp_context **ctxs, unsigned num)
+{
+  ssize_t sz;
   struct kernel_uxsock_response *resp;
+  struct flextcp_context *ctx;
   uint8_t resp_buf[sizeof(*resp) +
-      FLEXTCP_MAX_FTCPCORES * sizeof(resp->flexnic_qs[0])];
+      flexnic_evfd_num * sizeof(resp->flexnic_qs[0])];
   struct kernel_uxsock_request req = {
       .rxq_len = NIC_RXQ_LEN,
       .txq_len = NIC_TXQ_LEN,
+      .ctx_num = num,
     };
   uint16_t i;
+  unsigned k;
+
+  assert(num > 0 && num <= KERNEL_UXSOCK_CTX_MAX);
 
-  /* send request on kernel socket */
+  /* send request on kernel socket, with the eventfds of all contexts */
   struct iovec iov = {
     .iov_base = &req,
     .iov_len = sizeof(req),
   };
   union {
-    char buf[CMSG_SPACE(sizeof(int))];
+    char buf[CMSG_SPACE(sizeof(int) * KERNEL_UXSOCK_CTX_MAX)];
     struct cmsghdr align;
   } u;
   struct msghdr msg = {
@@ -182,78 +307,220 @@ int flextcp_kernel_newctx(struct flextcp_context *ctx)
     .msg_iov = &iov,
     .msg_iovlen = 1,
     .msg_control = u.buf,
-    .msg_controllen = sizeof(u.buf),
+    .msg_controllen = CMSG_SPACE(sizeof(int) * num),
     .msg_flags = 0,
   };
   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
   cmsg->cmsg_level = SOL_SOCKET;
   cmsg->cmsg_type = SCM_RIGHTS;
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
   int *myfd = (int *)CMSG_DATA(cmsg);
-  *myfd = ctx->evfd;
+  for (k = 0; k < num; k++) {
+    myfd[k] = ctxs[k]->evfd;
+  }
   sz = sendmsg(ksock_fd, &msg, 0);
   assert(sz == sizeof(req));
 
-  /* receive response on kernel socket */
+  /* one response per context, in request order */
   resp = (struct kernel_uxsock_response *) resp_buf;
+  for (k = 0; k < num; k++) {
+    ctx = ctxs[k];
+
+    if (uxsocket_resp_read(resp) != 0) {
+      return -1;
+    }
+
+    if (resp->status != 0) {
+      fprintf(stderr, "flextcp_kernel_newctxs: request failed\n");
+      return -1;
+    }
+
+    /* fill in ctx struct */
+    ctx->kin_base = (uint8_t *) flexnic_mem + resp->app_out_off;
+    ctx->kin_len = resp->app_out_len / sizeof(struct kernel_appout);
+    ctx->kin_head = 0;
+
+    ctx->kout_base = (uint8_t *) flexnic_mem + resp->app_in_off;
+    ctx->kout_len = resp->app_in_len /  sizeof(struct kernel_appin);
+    ctx->kout_head = 0;
+
+    ctx->db_id = resp->flexnic_db_id;
+    ctx->num_queues = resp->flexnic_qs_num;
+    if ((ctx->queues = calloc(ctx->num_queues, sizeof(*ctx->queues)))
+        == NULL)
+    {
+      perror("flextcp_kernel_newctxs: allocating queues failed");
+      return -1;
+    }
+    ctx->next_queue = 0;
+
+    ctx->rxq_len = NIC_RXQ_LEN;
+    ctx->txq_len = NIC_TXQ_LEN;
+
+    for (i = 0; i < resp->flexnic_qs_num; i++) {
+      ctx->queues[i].rxq_base =
+        (uint8_t *) flexnic_mem + resp->flexnic_qs[i].rxq_off;
+      ctx->queues[i].txq_base =
+        (uint8_t *) flexnic_mem + resp->flexnic_qs[i].txq_off;
+
+      ctx->queues[i].rxq_head = 0;
+      ctx->queues[i].txq_tail = 0;
+      ctx->queues[i].txq_avail = ctx->txq_len;
+      ctx->queues[i].last_ts = 0;
+    }
+  }
+
+  return 0;
+}
+
+/* read one context response including its queues */
+static int uxsocket_resp_read(struct kernel_uxsock_response *resp)
+{
+  ssize_t sz, off, total_sz;
+
   off = 0;
   while (off < sizeof(*resp)) {
     sz = read(ksock_fd, (uint8_t *) resp + off, sizeof(*resp) - off);
-    if (sz < 0) {
-      perror("flextcp_kernel_newctx: read failed");
+    if (sz <= 0) {
+      perror("uxsocket_resp_read: read failed");
       return -1;
     }
     off += sz;
   }
 
-  if (resp->flexnic_qs_num > FLEXTCP_MAX_FTCPCORES) {
-    fprintf(stderr, "flextcp_kernel_newctx: stack only supports up to %u "
-        "queues, got %u\n", FLEXTCP_MAX_FTCPCORES, resp->flexnic_qs_num);
+  if (resp->flexnic_qs_num > flexnic_evfd_num) {
+    fprintf(stderr, "uxsocket_resp_read: got %u queues for %u fast path "
+        "cores\n", resp->flexnic_qs_num, flexnic_evfd_num);
     abort();
   }
   /* receive queues in response */
-  total_sz = sizeof(*resp) + resp->flexnic_qs_num * sizeof(resp->flexnic_qs[0]);
+  total_sz = sizeof(*resp) +
+    resp->flexnic_qs_num * sizeof(resp->flexnic_qs[0]);
   while (off < total_sz) {
     sz = read(ksock_fd, (uint8_t *) resp + off, total_sz - off);
-    if (sz < 0) {
-      perror("flextcp_kernel_newctx: read failed");
+    if (sz <= 0) {
+      perror("uxsocket_resp_read: read failed");
       return -1;
     }
     off += sz;
   }
 
-  if (resp->status != 0) {
-    fprintf(stderr, "flextcp_kernel_newctx: request failed\n");
+  return 0;
+}
+
+int flextcp_kernel_ctxqos(struct flextcp_context *ctx, uint16_t weight,
+    uint32_t rate)
+{
+  uint32_t pos = ctx->kin_head;
+  struct kernel_appout *kin = ctx->kin_base;
+
+  kin += pos;
+
+  if (kin->type != KERNEL_APPOUT_INVALID) {
+    fprintf(stderr, "flextcp_kernel_ctxqos: no queue space\n");
+    return -1;
+  }
+
+  kin->data.ctx_qos.weight = weight;
+  kin->data.ctx_qos.rate = rate;
+  MEM_BARRIER();
+  kin->type = KERNEL_APPOUT_CTX_QOS;
+  flextcp_kernel_kick();
+
+  pos = pos + 1;
+  if (pos >= ctx->kin_len) {
+    pos = 0;
+  }
+  ctx->kin_head = pos;
+
+  return 0;
+}
+
+int flextcp_kernel_ctxnotify(struct flextcp_context *ctx, uint32_t delay,
+    uint16_t count)
+{
+  uint32_t pos = ctx->kin_head;
+  struct kernel_appout *kin = ctx->kin_base;
+
+  kin += pos;
+
+  if (kin->type != KERNEL_APPOUT_INVALID) {
+    fprintf(stderr, "flextcp_kernel_ctxnotify: no queue space\n");
+    return -1;
+  }
+
+  kin->data.ctx_notify.delay = delay;
+  kin->data.ctx_notify.count = count;
+  MEM_BARRIER();
+  kin->type = KERNEL_APPOUT_CTX_NOTIFY;
+  flextcp_kernel_kick();
+
+  pos = pos + 1;
+  if (pos >= ctx->kin_len) {
+    pos = 0;
+  }
+  ctx->kin_head = pos;
+
+  return 0;
+}
+
+int flextcp_kernel_objsteer(struct flextcp_context *ctx, uint16_t first,
+    uint16_t last, uint16_t db_id, int off)
+{
+  uint32_t pos = ctx->kin_head;
+  struct kernel_appout *kin = ctx->kin_base;
+
+  kin += pos;
+
+  if (kin->type != KERNEL_APPOUT_INVALID) {
+    fprintf(stderr, "flextcp_kernel_objsteer: no queue space\n");
     return -1;
   }
 
-  /* fill in ctx struct */
-  ctx->kin_base = (uint8_t *) flexnic_mem + resp->app_out_off;
-  ctx->kin_len = resp->app_out_len / sizeof(struct kernel_appout);
-  ctx->kin_head = 0;
+  kin->data.obj_steer.first = first;
+  kin->data.obj_steer.last = last;
+  kin->data.obj_steer.db_id = db_id;
+  kin->data.obj_steer.flags = (off ? KERNEL_APPOUT_OBJ_STEER_OFF : 0);
+  MEM_BARRIER();
+  kin->type = KERNEL_APPOUT_OBJ_STEER;
+  flextcp_kernel_kick();
 
-  ctx->kout_base = (uint8_t *) flexnic_mem + resp->app_in_off;
-  ctx->kout_len = resp->app_in_len /  sizeof(struct kernel_appin);
-  ctx->kout_head = 0;
+  pos = pos + 1;
+  if (pos >= ctx->kin_len) {
+    pos = 0;
+  }
+  ctx->kin_head = pos;
+
+  return 0;
+}
+
+int flextcp_kernel_route(struct flextcp_context *ctx, uint32_t ip,
+    uint8_t prefix, uint32_t next_hop_ip, int16_t port, int del)
+{
+  uint32_t pos = ctx->kin_head;
+  struct kernel_appout *kin = ctx->kin_base;
 
-  ctx->db_id = resp->flexnic_db_id;
-  ctx->num_queues = resp->flexnic_qs_num;
-  ctx->next_queue = 0;
+  kin += pos;
 
-  ctx->rxq_len = NIC_RXQ_LEN;
-  ctx->txq_len = NIC_TXQ_LEN;
+  if (kin->type != KERNEL_APPOUT_INVALID) {
+    fprintf(stderr, "flextcp_kernel_route: no queue space\n");
+    return -1;
+  }
 
-  for (i = 0; i < resp->flexnic_qs_num; i++) {
-    ctx->queues[i].rxq_base =
-      (uint8_t *) flexnic_mem + resp->flexnic_qs[i].rxq_off;
-    ctx->queues[i].txq_base =
-      (uint8_t *) flexnic_mem + resp->flexnic_qs[i].txq_off;
+  kin->data.route.ip = ip;
+  kin->data.route.next_hop_ip = next_hop_ip;
+  kin->data.route.port = port;
+  kin->data.route.prefix = prefix;
+  kin->data.route.flags = (del ? KERNEL_APPOUT_ROUTE_DEL : 0);
+  MEM_BARRIER();
+  kin->type = KERNEL_APPOUT_ROUTE;
+  flextcp_kernel_kick();
 
-    ctx->queues[i].rxq_head = 0;
-    ctx->queues[i].txq_tail = 0;
-    ctx->queues[i].txq_avail = ctx->txq_len;
-    ctx->queues[i].last_ts = 0;
+  pos = pos + 1;
+  if (pos >= ctx->kin_len) {
+    pos = 0;
   }
+  ctx->kin_head = pos;
 
   return 0;
 }
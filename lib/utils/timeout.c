@@ -41,21 +41,32 @@
 /** maximum number of timestamps to handle per call to timeout_poll() */
 #define MAX_TIMEOUTS 64
 
+#define WHEEL_SHIFT UTIL_TIMEOUT_WHEEL_SHIFT
+#define WHEEL_SLOTS UTIL_TIMEOUT_WHEEL_SLOTS
+#define WHEEL_LEVELS UTIL_TIMEOUT_WHEEL_LEVELS
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+
+STATIC_ASSERT(WHEEL_SHIFT * WHEEL_LEVELS == TIMEOUT_BITS, wheel_covers_ts);
+
 /** rdtsc cycles per microsecond */
 static uint64_t tsc_per_us = 0;
 
-/** Move due timeouts from #timeouts to due list. */
-static inline void move_due_timeouts(struct timeout_manager *mgr,
+/** Advance wheel to #cur_ts, moving due timeouts to the due list. */
+static inline void wheel_advance(struct timeout_manager *mgr,
     uint32_t cur_ts);
-/** Is this timeout due? */
-static inline int timeout_due(struct timeout *to, uint32_t ts);
+/** Insert armed timeout into wheel, or due list if it is already due. */
+static inline void wheel_insert(struct timeout_manager *mgr,
+    struct timeout *to);
+/** Offset from wheel_ts to start of earliest non-empty slot, or -1 */
+static inline int wheel_next(struct timeout_manager *mgr, uint32_t *delta,
+    unsigned *level, unsigned *slot);
 
 /** Timestamp in microseconds (full 32 bits) */
 static inline uint32_t timestamp_us_long(void);
 /** #TIMEOUT_BITS bits Timestamp in microseconds */
 static inline uint32_t timestamp_us(void);
-/** "relative" time ignoring wrap arounds */
-static inline int32_t rel_time(uint32_t cur, struct timeout *to);
+/** "relative" time from #cur to #ts ignoring wrap arounds */
+static inline int32_t rel_time(uint32_t cur, uint32_t ts);
 /** Estimate tsc frequency: fills in tsc_per_us */
 static inline void calibrate_tsc(void);
 
@@ -64,6 +75,7 @@ int util_timeout_init(struct timeout_manager *mgr,
 {
   calibrate_tsc();
   memset(mgr, 0, sizeof(*mgr));
+  mgr->wheel_ts = timestamp_us();
   mgr->handler = handler;
   mgr->handler_opaque = handler_opaque;
   return 0;
@@ -88,8 +100,8 @@ void util_timeout_poll_ts(struct timeout_manager *mgr, uint32_t cur_ts)
 
   cur_ts &= TIMEOUT_MASK;
 
-  /* check for potential due timeouts in #timeouts */
-  move_due_timeouts(mgr, cur_ts);
+  /* move due slots from the wheel to the due list */
+  wheel_advance(mgr, cur_ts);
 
   /* process due queue */
   while ((to = mgr->due_first) != NULL && num < MAX_TIMEOUTS) {
@@ -116,8 +128,6 @@ void util_timeout_arm(struct timeout_manager *mgr, struct timeout *to,
 void util_timeout_arm_ts(struct timeout_manager *mgr, struct timeout *to,
     uint32_t us, uint8_t type, uint32_t cur_ts)
 {
-  struct timeout *tp, *tn;
-
   cur_ts &= TIMEOUT_MASK;
 
   /* make sure #us is not out of range */
@@ -127,44 +137,33 @@ void util_timeout_arm_ts(struct timeout_manager *mgr, struct timeout *to,
     abort();
   }
 
-  /* step 1: move all due timeouts to due queue */
-  move_due_timeouts(mgr, cur_ts);
-
-  /* step 2: find predecessor and successor in list */
-  for (tp = mgr->timeouts_last; tp != NULL && rel_time(cur_ts, tp) > us;
-      tp = tp->prev);
-  tn = (tp != NULL ? tp->next : mgr->timeouts_first);
+  /* step 1: bring wheel up to date so slots are relative to cur_ts */
+  wheel_advance(mgr, cur_ts);
 
-  /* step 3: insert */
+  /* step 2: insert */
   to->timeout_type = ((uint32_t) type) << TIMEOUT_BITS;
   to->timeout_type |= (cur_ts + us) & TIMEOUT_MASK;
-  to->next = tn;
-  to->prev = tp;
-  if (tp == NULL) {
-    mgr->timeouts_first = to;
-  } else {
-    tp->next = to;
-  }
-  if (tn == NULL) {
-    mgr->timeouts_last = to;
-  } else {
-    tn->prev = to;
-  }
+  wheel_insert(mgr, to);
 }
 
 void util_timeout_disarm(struct timeout_manager *mgr, struct timeout *to)
 {
   struct timeout *prev, *next;
+  struct timeout_slot *ws;
+  unsigned l = to->slot / WHEEL_SLOTS, s = to->slot % WHEEL_SLOTS;
 
+  /* slot is stale for timeouts moved to the due list, but then the timeout
+   * can't be the head or tail of that slot either */
+  ws = &mgr->wheel[l][s];
   prev = to->prev;
   next = to->next;
   if (prev == NULL) {
-    if (mgr->timeouts_first == to) {
-      mgr->timeouts_first = next;
+    if (ws->first == to) {
+      ws->first = next;
     } else if (mgr->due_first == to) {
       mgr->due_first = next;
     } else {
-      fprintf(stderr, "timeout_disarm: timeout neither in timeouts_first nor "
+      fprintf(stderr, "timeout_disarm: timeout neither in wheel nor "
           "due_first\n");
       abort();
     }
@@ -173,67 +172,192 @@ void util_timeout_disarm(struct timeout_manager *mgr, struct timeout *to)
   }
 
   if (next == NULL) {
-    if (mgr->timeouts_last == to) {
-      mgr->timeouts_last = prev;
+    if (ws->last == to) {
+      ws->last = prev;
     } else if (mgr->due_last == to) {
       mgr->due_last = prev;
     } else {
-      fprintf(stderr, "timeout_disarm: timeout neither in timeouts_last nor "
+      fprintf(stderr, "timeout_disarm: timeout neither in wheel nor "
           "due_last\n");
       abort();
     }
   } else {
     next->prev = prev;
   }
+
+  if (ws->first == NULL) {
+    mgr->wheel_bitmap[l][s / 64] &= ~(1ULL << (s % 64));
+  }
 }
 
 uint32_t util_timeout_next(struct timeout_manager *mgr, uint32_t cur_ts)
 {
+  uint32_t delta;
+  unsigned l, s;
+  int32_t next;
+
   if(mgr->due_first != NULL) {
     // We have timeouts due immediately
     return 0;
   }
 
-  if(mgr->timeouts_first == NULL) {
+  if(wheel_next(mgr, &delta, &l, &s) != 0) {
     // Nothing due
     return -1U;
   }
 
+  /* for higher levels this is the start of the slot, so we might wake up
+   * early and just cascade the slot down */
   cur_ts &= TIMEOUT_MASK;
-  int32_t next = rel_time(cur_ts, mgr->timeouts_first);
+  next = rel_time(cur_ts, (mgr->wheel_ts + delta) & TIMEOUT_MASK);
   return (next < 0 ? 0 : next);
 }
 
-static inline void move_due_timeouts(struct timeout_manager *mgr, uint32_t cur_ts)
+static inline void slot_push(struct timeout_manager *mgr, unsigned l,
+    unsigned s, struct timeout *to)
 {
-  struct timeout *to, *next;
-
-  while ((to = mgr->timeouts_first) != NULL &&
-      timeout_due(mgr->timeouts_first, cur_ts))
-  {
-    /* remove from timeouts list */
-    mgr->timeouts_first = next = to->next;
-    if (next != NULL) {
-      next->prev = NULL;
-    } else {
-      mgr->timeouts_last = NULL;
-    }
+  struct timeout_slot *ws = &mgr->wheel[l][s];
+
+  to->slot = l * WHEEL_SLOTS + s;
+  to->next = NULL;
+  to->prev = ws->last;
+  if (ws->last == NULL) {
+    ws->first = to;
+    mgr->wheel_bitmap[l][s / 64] |= 1ULL << (s % 64);
+  } else {
+    ws->last->next = to;
+  }
+  ws->last = to;
+}
+
+/** Remove all timeouts from slot, returns head of the list. */
+static inline struct timeout *slot_take(struct timeout_manager *mgr,
+    unsigned l, unsigned s, struct timeout **last)
+{
+  struct timeout_slot *ws = &mgr->wheel[l][s];
+  struct timeout *to = ws->first;
+
+  *last = ws->last;
+  ws->first = ws->last = NULL;
+  mgr->wheel_bitmap[l][s / 64] &= ~(1ULL << (s % 64));
+  return to;
+}
+
+/** Append list of timeouts to due list. */
+static inline void due_append(struct timeout_manager *mgr,
+    struct timeout *first, struct timeout *last)
+{
+  first->prev = mgr->due_last;
+  if (mgr->due_last == NULL) {
+    mgr->due_first = first;
+  } else {
+    mgr->due_last->next = first;
+  }
+  mgr->due_last = last;
+}
+
+static inline void wheel_insert(struct timeout_manager *mgr,
+    struct timeout *to)
+{
+  uint32_t ts = to->timeout_type & TIMEOUT_MASK;
+  uint32_t x;
+  unsigned l;
 
-    /* add to due list */
+  if (rel_time(mgr->wheel_ts, ts) <= 0) {
     to->next = NULL;
-    to->prev = mgr->due_last;
-    if (mgr->due_last == NULL) {
-      mgr->due_first = to;
-    } else {
-      mgr->due_last->next = to;
+    due_append(mgr, to, to);
+    return;
+  }
+
+  /* level is determined by the highest bit that differs from the wheel, so
+   * a slot always lies within the current slot of the level above */
+  x = ts ^ mgr->wheel_ts;
+  l = (31 - __builtin_clz(x)) / WHEEL_SHIFT;
+  slot_push(mgr, l, (ts >> (l * WHEEL_SHIFT)) & WHEEL_SLOT_MASK, to);
+}
+
+/** First non-empty slot in [from, WHEEL_SLOTS) on level l, or -1 */
+static inline int wheel_next_slot(struct timeout_manager *mgr, unsigned l,
+    unsigned from)
+{
+  const uint64_t *bm = mgr->wheel_bitmap[l];
+  unsigned i = from / 64;
+  uint64_t x;
+
+  if (from >= WHEEL_SLOTS)
+    return -1;
+
+  x = bm[i] & (~0ULL << (from % 64));
+  while (x == 0) {
+    if (++i >= WHEEL_SLOTS / 64)
+      return -1;
+    x = bm[i];
+  }
+  return i * 64 + __builtin_ctzll(x);
+}
+
+static inline int wheel_next(struct timeout_manager *mgr, uint32_t *delta,
+    unsigned *level, unsigned *slot)
+{
+  uint32_t start, c;
+  unsigned l;
+  int s;
+
+  /* timeouts on a level are all due before the ones on the next, and only
+   * slots after the current one can be occupied (level 0 aside, where the
+   * current slot is emptied on advance) */
+  for (l = 0; l < WHEEL_LEVELS; l++) {
+    c = (mgr->wheel_ts >> (l * WHEEL_SHIFT)) & WHEEL_SLOT_MASK;
+    s = wheel_next_slot(mgr, l, (l == 0 ? c : c + 1));
+    if (s < 0 && l == WHEEL_LEVELS - 1) {
+      /* top level wraps around */
+      s = wheel_next_slot(mgr, l, 0);
     }
-    mgr->due_last = to;
+    if (s < 0)
+      continue;
+
+    start = (mgr->wheel_ts >> ((l + 1) * WHEEL_SHIFT)) << WHEEL_SHIFT;
+    start = (start | s) << (l * WHEEL_SHIFT);
+    *delta = (start - mgr->wheel_ts) & TIMEOUT_MASK;
+    *level = l;
+    *slot = s;
+    return 0;
   }
+  return -1;
 }
 
-static inline int timeout_due(struct timeout *to, uint32_t ts)
+static inline void wheel_advance(struct timeout_manager *mgr, uint32_t cur_ts)
 {
-  return rel_time(ts, to) <= 0;
+  struct timeout *to, *next, *last;
+  uint32_t delta;
+  int32_t d;
+  unsigned l, s;
+
+  while ((d = rel_time(mgr->wheel_ts, cur_ts)) >= 0) {
+    if (wheel_next(mgr, &delta, &l, &s) != 0 || delta > (uint32_t) d) {
+      mgr->wheel_ts = cur_ts;
+      return;
+    }
+    mgr->wheel_ts = (mgr->wheel_ts + delta) & TIMEOUT_MASK;
+
+    to = slot_take(mgr, l, s, &last);
+    if (l == 0) {
+      /* whole slot is due at once */
+      due_append(mgr, to, last);
+    } else {
+      /* cascade down to lower levels */
+      for (; to != NULL; to = next) {
+        next = to->next;
+        wheel_insert(mgr, to);
+      }
+    }
+  }
+
+  /* wheel is ahead of cur_ts, only possible with an empty wheel or stale
+   * timestamps */
+  if (wheel_next(mgr, &delta, &l, &s) != 0) {
+    mgr->wheel_ts = cur_ts;
+  }
 }
 
 static inline uint32_t timestamp_us_long(void)
@@ -246,38 +370,11 @@ static inline uint32_t timestamp_us(void)
   return timestamp_us_long() & TIMEOUT_MASK;
 }
 
-static inline int32_t rel_time(uint32_t cur_ts, struct timeout *to)
+static inline int32_t rel_time(uint32_t cur_ts, uint32_t ts)
 {
-  const uint32_t middle = (1 << (TIMEOUT_BITS - 1));
-  uint32_t to_ts = to->timeout_type & TIMEOUT_MASK;
-  uint32_t start, end;
-
-  if (cur_ts < middle) {
-    /* negative interval is split in half */
-    start = (cur_ts - middle) & TIMEOUT_MASK;
-    end = (1 << TIMEOUT_BITS);
-    if (start <= to_ts && to_ts < end) {
-      /* in first half of negative interval, smallest timestamps */
-      return to_ts - start - middle;
-    } else {
-      /* in second half or in positive interval */
-      return to_ts - cur_ts;
-    }
-  } else if (cur_ts == middle) {
-    /* intervals not split */
-    return to_ts - cur_ts;
-  } else {
-    /* higher interval is split */
-    start = 0;
-    end = ((cur_ts + middle) & TIMEOUT_MASK) + 1;
-    if (start <= cur_ts && to_ts < end) {
-      /* in second half of positive interval, largest timestamps */
-      return to_ts + ((1 << TIMEOUT_BITS) - cur_ts);
-    } else {
-      /* in negative interval or first half of positive interval */
-      return to_ts - cur_ts;
-    }
-  }
+  /* sign extend the #TIMEOUT_BITS bit difference */
+  return ((int32_t) (((ts - cur_ts) & TIMEOUT_MASK) << (32 - TIMEOUT_BITS))) >>
+    (32 - TIMEOUT_BITS);
 }
 
 /** Estimate tsc frequency: fills in tsc_per_us */
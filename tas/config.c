@@ -32,20 +32,31 @@
 #include <utils.h>
 
 #include <config.h>
+#include <tas_memif.h>
 
+/* values start above the character range, getopt returns '?' on errors */
 enum cfg_params {
-  CP_NIC_RX_LEN,
+  CP_NIC_RX_LEN = 0x100,
   CP_NIC_TX_LEN,
   CP_APP_KIN_LEN,
   CP_APP_KOUT_LEN,
   CP_ARP_TO,
   CP_ARP_TO_MAX,
+  CP_ARP_AGE,
+  CP_ARP_FILE,
   CP_TCP_RTT_INIT,
   CP_TCP_LINK_BW,
   CP_TCP_RXBUF_LEN,
   CP_TCP_TXBUF_LEN,
+  CP_TCP_RXBUF_MAX,
+  CP_TCP_TXBUF_MAX,
   CP_TCP_HANDSHAKE_TO,
   CP_TCP_HANDSHAKE_RETRIES,
+  CP_TCP_SYN_COOKIES,
+  CP_TCP_NO_SACK,
+  CP_TCP_FASTOPEN,
+  CP_TCP_CLOSE_HOLD,
+  CP_TCP_FLOW_GRACE,
   CP_CC,
   CP_CC_CONTROL_GRANULARITY,
   CP_CC_CONTROL_INTERVAL,
@@ -65,9 +76,36 @@ enum cfg_params {
   CP_CC_TIMELY_BETA,
   CP_CC_TIMELY_MINRTT,
   CP_CC_TIMELY_MINRATE,
+  CP_CC_SWIFT_TARGET,
+  CP_CC_SWIFT_AI,
+  CP_CC_SWIFT_BETA,
+  CP_CC_SWIFT_MAXMDF,
+  CP_CC_THREADS,
   CP_IP_ROUTE,
   CP_IP_ADDR,
   CP_FP_CORES_MAX,
+  CP_FP_TSO,
+  CP_FP_TX_ZEROCOPY,
+  CP_FP_RX_NT_THRESHOLD,
+  CP_FP_RX_TSTAMP,
+  CP_FP_SW_RSS,
+  CP_FP_FLOWS,
+  CP_FP_SCHED,
+  CP_FP_SCHED_LATENCY,
+  CP_FP_IDLE_SPIN,
+  CP_FP_RTO_MIN,
+  CP_FP_DELACK_SEGS,
+  CP_FP_DELACK_US,
+  CP_FP_QMAN,
+  CP_FP_BOND,
+  CP_FP_FLOW_RULES,
+  CP_FP_FG_REBALANCE,
+  CP_FP_AUTOSCALE,
+  CP_FP_AUTOSCALE_DWELL,
+  CP_FP_AUTOSCALE_QUEUES,
+  CP_FP_NUMA,
+  CP_FP_NUMA_PIN,
+  CP_FAST_RESTART,
   CP_DPDK_EXTRA,
 };
 
@@ -89,7 +127,13 @@ static struct option opts[] = {
       .val = CP_ARP_TO },
     { .name = "arp-timeout-max",
       .has_arg = required_argument,
-      .val = CP_ARP_TO },
+      .val = CP_ARP_TO_MAX },
+    { .name = "arp-age",
+      .has_arg = required_argument,
+      .val = CP_ARP_AGE },
+    { .name = "arp-file",
+      .has_arg = required_argument,
+      .val = CP_ARP_FILE },
     { .name = "tcp-rtt-init",
       .has_arg = required_argument,
       .val = CP_TCP_RTT_INIT },
@@ -102,12 +146,33 @@ static struct option opts[] = {
     { .name = "tcp-txbuf-len",
       .has_arg = required_argument,
       .val = CP_TCP_TXBUF_LEN },
+    { .name = "tcp-rxbuf-max",
+      .has_arg = required_argument,
+      .val = CP_TCP_RXBUF_MAX },
+    { .name = "tcp-txbuf-max",
+      .has_arg = required_argument,
+      .val = CP_TCP_TXBUF_MAX },
     { .name = "tcp-handshake-timeout",
       .has_arg = required_argument,
       .val = CP_TCP_HANDSHAKE_TO },
     { .name = "tcp-handshake-retries",
       .has_arg = required_argument,
       .val = CP_TCP_HANDSHAKE_RETRIES },
+    { .name = "tcp-syn-cookies",
+      .has_arg = required_argument,
+      .val = CP_TCP_SYN_COOKIES },
+    { .name = "tcp-no-sack",
+      .has_arg = no_argument,
+      .val = CP_TCP_NO_SACK },
+    { .name = "tcp-fastopen",
+      .has_arg = no_argument,
+      .val = CP_TCP_FASTOPEN },
+    { .name = "tcp-close-hold",
+      .has_arg = required_argument,
+      .val = CP_TCP_CLOSE_HOLD },
+    { .name = "tcp-flow-grace",
+      .has_arg = required_argument,
+      .val = CP_TCP_FLOW_GRACE },
     { .name = "cc",
       .has_arg = required_argument,
       .val = CP_CC },
@@ -165,6 +230,21 @@ static struct option opts[] = {
     { .name = "cc-timely-minrate",
       .has_arg = required_argument,
       .val = CP_CC_TIMELY_MINRATE },
+    { .name = "cc-swift-target",
+      .has_arg = required_argument,
+      .val = CP_CC_SWIFT_TARGET },
+    { .name = "cc-swift-ai",
+      .has_arg = required_argument,
+      .val = CP_CC_SWIFT_AI },
+    { .name = "cc-swift-beta",
+      .has_arg = required_argument,
+      .val = CP_CC_SWIFT_BETA },
+    { .name = "cc-swift-maxmdf",
+      .has_arg = required_argument,
+      .val = CP_CC_SWIFT_MAXMDF },
+    { .name = "cc-threads",
+      .has_arg = required_argument,
+      .val = CP_CC_THREADS },
     { .name = "ip-route",
       .has_arg = required_argument,
       .val = CP_IP_ROUTE },
@@ -174,6 +254,72 @@ static struct option opts[] = {
     { .name = "fp-cores-max",
       .has_arg = required_argument,
       .val = CP_FP_CORES_MAX },
+    { .name = "fp-tso",
+      .has_arg = no_argument,
+      .val = CP_FP_TSO },
+    { .name = "fp-tx-zerocopy",
+      .has_arg = no_argument,
+      .val = CP_FP_TX_ZEROCOPY },
+    { .name = "fp-rx-nt-threshold",
+      .has_arg = required_argument,
+      .val = CP_FP_RX_NT_THRESHOLD },
+    { .name = "fp-rx-tstamp",
+      .has_arg = required_argument,
+      .val = CP_FP_RX_TSTAMP },
+    { .name = "fp-sw-rss",
+      .has_arg = required_argument,
+      .val = CP_FP_SW_RSS },
+    { .name = "fp-flows",
+      .has_arg = required_argument,
+      .val = CP_FP_FLOWS },
+    { .name = "fp-sched",
+      .has_arg = required_argument,
+      .val = CP_FP_SCHED },
+    { .name = "fp-sched-latency",
+      .has_arg = required_argument,
+      .val = CP_FP_SCHED_LATENCY },
+    { .name = "fp-idle-spin",
+      .has_arg = required_argument,
+      .val = CP_FP_IDLE_SPIN },
+    { .name = "fp-rto-min",
+      .has_arg = required_argument,
+      .val = CP_FP_RTO_MIN },
+    { .name = "fp-delack-segs",
+      .has_arg = required_argument,
+      .val = CP_FP_DELACK_SEGS },
+    { .name = "fp-delack-us",
+      .has_arg = required_argument,
+      .val = CP_FP_DELACK_US },
+    { .name = "fp-qman",
+      .has_arg = required_argument,
+      .val = CP_FP_QMAN },
+    { .name = "fp-bond",
+      .has_arg = no_argument,
+      .val = CP_FP_BOND },
+    { .name = "fp-flow-rules",
+      .has_arg = required_argument,
+      .val = CP_FP_FLOW_RULES },
+    { .name = "fp-fg-rebalance",
+      .has_arg = required_argument,
+      .val = CP_FP_FG_REBALANCE },
+    { .name = "fp-autoscale",
+      .has_arg = required_argument,
+      .val = CP_FP_AUTOSCALE },
+    { .name = "fp-autoscale-dwell",
+      .has_arg = required_argument,
+      .val = CP_FP_AUTOSCALE_DWELL },
+    { .name = "fp-autoscale-queues",
+      .has_arg = no_argument,
+      .val = CP_FP_AUTOSCALE_QUEUES },
+    { .name = "fp-numa",
+      .has_arg = no_argument,
+      .val = CP_FP_NUMA },
+    { .name = "fp-numa-pin",
+      .has_arg = no_argument,
+      .val = CP_FP_NUMA_PIN },
+    { .name = "fast-restart",
+      .has_arg = no_argument,
+      .val = CP_FAST_RESTART },
     { .name = "dpdk-extra",
       .has_arg = required_argument,
       .val = CP_DPDK_EXTRA },
@@ -239,6 +385,15 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           goto failed;
         }
         break;
+      case CP_ARP_AGE:
+        if (parse_int32(optarg, &c->arp_age) != 0) {
+          fprintf(stderr, "arp age parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_ARP_FILE:
+        c->arp_file = strdup(optarg);
+        break;
       case CP_TCP_RTT_INIT:
         if (parse_int32(optarg, &c->tcp_rtt_init) != 0) {
           fprintf(stderr, "tcp rtt init parsing failed\n");
@@ -263,6 +418,18 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           goto failed;
         }
         break;
+      case CP_TCP_RXBUF_MAX:
+        if (parse_int64(optarg, &c->tcp_rxbuf_max) != 0) {
+          fprintf(stderr, "tcp rxbuf max parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_TCP_TXBUF_MAX:
+        if (parse_int64(optarg, &c->tcp_txbuf_max) != 0) {
+          fprintf(stderr, "tcp txbuf max parsing failed\n");
+          goto failed;
+        }
+        break;
       case CP_TCP_HANDSHAKE_TO:
         if (parse_int32(optarg, &c->tcp_handshake_to) != 0) {
           fprintf(stderr, "tcp handshake timeout parsing failed\n");
@@ -275,6 +442,36 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           goto failed;
         }
         break;
+      case CP_TCP_SYN_COOKIES:
+        if (!strcmp(optarg, "off")) {
+          c->tcp_syn_cookies = CONFIG_SYN_COOKIES_OFF;
+        } else if (!strcmp(optarg, "overflow")) {
+          c->tcp_syn_cookies = CONFIG_SYN_COOKIES_OVERFLOW;
+        } else if (!strcmp(optarg, "always")) {
+          c->tcp_syn_cookies = CONFIG_SYN_COOKIES_ALWAYS;
+        } else {
+          fprintf(stderr, "tcp syn cookies mode parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_TCP_NO_SACK:
+        c->tcp_sack = 0;
+        break;
+      case CP_TCP_FASTOPEN:
+        c->tcp_fastopen = 1;
+        break;
+      case CP_TCP_CLOSE_HOLD:
+        if (parse_int32(optarg, &c->tcp_close_hold) != 0) {
+          fprintf(stderr, "tcp close hold parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_TCP_FLOW_GRACE:
+        if (parse_int32(optarg, &c->tcp_flow_grace) != 0) {
+          fprintf(stderr, "tcp flow grace parsing failed\n");
+          goto failed;
+        }
+        break;
       case CP_CC:
         if (!strcmp(optarg, "dctcp-win")) {
           c->cc_algorithm = CONFIG_CC_DCTCP_WIN;
@@ -284,6 +481,10 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           c->cc_algorithm = CONFIG_CC_CONST_RATE;
         } else if (!strcmp(optarg, "timely")) {
           c->cc_algorithm = CONFIG_CC_TIMELY;
+        } else if (!strcmp(optarg, "bbr")) {
+          c->cc_algorithm = CONFIG_CC_BBR;
+        } else if (!strcmp(optarg, "swift")) {
+          c->cc_algorithm = CONFIG_CC_SWIFT;
         } else {
           fprintf(stderr, "cc algorithm parsing failed\n");
           goto failed;
@@ -401,6 +602,42 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           goto failed;
         }
         break;
+      case CP_CC_SWIFT_TARGET:
+        if (parse_int32(optarg, &c->cc_swift_target) != 0 ||
+            c->cc_swift_target == 0)
+        {
+          fprintf(stderr, "cc swift target parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_CC_SWIFT_AI:
+        if (parse_int32(optarg, &c->cc_swift_ai) != 0) {
+          fprintf(stderr, "cc swift ai parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_CC_SWIFT_BETA:
+        if (parse_double(optarg, &d) != 0 || d < 0 || d > 1) {
+          fprintf(stderr, "cc swift beta parsing failed\n");
+          goto failed;
+        }
+        c->cc_swift_beta = UINT32_MAX * d;
+        break;
+      case CP_CC_SWIFT_MAXMDF:
+        if (parse_double(optarg, &d) != 0 || d < 0 || d > 1) {
+          fprintf(stderr, "cc swift max mdf parsing failed\n");
+          goto failed;
+        }
+        c->cc_swift_max_mdf = UINT32_MAX * d;
+        break;
+      case CP_CC_THREADS:
+        if (parse_int32(optarg, &c->cc_threads) != 0 ||
+            c->cc_threads > CONFIG_CC_THREADS_MAX)
+        {
+          fprintf(stderr, "cc threads parsing failed\n");
+          goto failed;
+        }
+        break;
       case CP_IP_ROUTE:
         if (parse_route(optarg, c) != 0) {
           goto failed;
@@ -419,6 +656,143 @@ int config_parse(struct configuration *c, int argc, char *argv[])
           goto failed;
         }
         break;
+      case CP_FP_TSO:
+        c->fp_tso = 1;
+        break;
+      case CP_FP_TX_ZEROCOPY:
+        c->fp_tx_zerocopy = 1;
+        break;
+      case CP_FP_RX_NT_THRESHOLD:
+        if (parse_int32(optarg, &c->fp_rx_nt_threshold) != 0) {
+          fprintf(stderr, "fp rx nt threshold parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_RX_TSTAMP:
+        if (parse_int32(optarg, &c->fp_rx_tstamp) != 0) {
+          fprintf(stderr, "fp rx tstamp parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_SW_RSS:
+        if (parse_int32(optarg, &c->fp_sw_rss) != 0) {
+          fprintf(stderr, "fp sw rss parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_FLOWS:
+        if (parse_int32(optarg, &c->fp_flows) != 0) {
+          fprintf(stderr, "fp flows parsing failed\n");
+          goto failed;
+        }
+        /* flow ids have to fit below the flags in flow table entries */
+        if (c->fp_flows == 0 || c->fp_flows > FLEXNIC_PL_FLOWHTE_IDMASK) {
+          fprintf(stderr, "fp flows has to be between 1 and %u\n",
+              FLEXNIC_PL_FLOWHTE_IDMASK);
+          goto failed;
+        }
+        break;
+      case CP_FP_SCHED:
+        if (!strcmp(optarg, "fixed")) {
+          c->fp_sched = CONFIG_FP_SCHED_FIXED;
+        } else if (!strcmp(optarg, "adaptive")) {
+          c->fp_sched = CONFIG_FP_SCHED_ADAPTIVE;
+        } else {
+          fprintf(stderr, "fp sched policy parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_SCHED_LATENCY:
+        if (parse_int32(optarg, &c->fp_sched_latency) != 0 ||
+            c->fp_sched_latency == 0)
+        {
+          fprintf(stderr, "fp sched latency parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_IDLE_SPIN:
+        if (parse_int32(optarg, &c->fp_idle_spin) != 0) {
+          fprintf(stderr, "fp idle spin parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_RTO_MIN:
+        if (parse_int32(optarg, &c->fp_rto_min) != 0) {
+          fprintf(stderr, "fp rto min parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_DELACK_SEGS:
+        if (parse_int32(optarg, &c->fp_delack_segs) != 0 ||
+            c->fp_delack_segs == 0 || c->fp_delack_segs > UINT8_MAX)
+        {
+          fprintf(stderr, "fp delack segs parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_DELACK_US:
+        if (parse_int32(optarg, &c->fp_delack_us) != 0) {
+          fprintf(stderr, "fp delack us parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_QMAN:
+        if (!strcmp(optarg, "skiplist")) {
+          c->fp_qman = CONFIG_FP_QMAN_SKIPLIST;
+        } else if (!strcmp(optarg, "wheel")) {
+          c->fp_qman = CONFIG_FP_QMAN_WHEEL;
+        } else {
+          fprintf(stderr, "fp qman backend parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_BOND:
+        c->fp_bond = 1;
+        break;
+      case CP_FP_FLOW_RULES:
+        if (parse_int32(optarg, &c->fp_flow_rules) != 0) {
+          fprintf(stderr, "fp flow rules parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_FG_REBALANCE:
+        if (parse_int32(optarg, &c->fp_fg_rebalance) != 0) {
+          fprintf(stderr, "fp flow group rebalance parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_AUTOSCALE:
+        if (!strcmp(optarg, "threshold")) {
+          c->fp_autoscale = CONFIG_FP_AUTOSCALE_THRESHOLD;
+        } else if (!strcmp(optarg, "ewma")) {
+          c->fp_autoscale = CONFIG_FP_AUTOSCALE_EWMA;
+        } else if (!strcmp(optarg, "off")) {
+          c->fp_autoscale = CONFIG_FP_AUTOSCALE_OFF;
+        } else {
+          fprintf(stderr, "fp autoscale policy parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_AUTOSCALE_DWELL:
+        if (parse_int32(optarg, &c->fp_autoscale_dwell) != 0 ||
+            c->fp_autoscale_dwell == 0)
+        {
+          fprintf(stderr, "fp autoscale dwell parsing failed\n");
+          goto failed;
+        }
+        break;
+      case CP_FP_AUTOSCALE_QUEUES:
+        c->fp_autoscale_queues = 1;
+        break;
+      case CP_FP_NUMA:
+        c->fp_numa = 1;
+        break;
+      case CP_FP_NUMA_PIN:
+        c->fp_numa_pin = 1;
+        break;
+      case CP_FAST_RESTART:
+        c->fast_restart = 1;
+        break;
       case CP_DPDK_EXTRA:
         if (parse_arg_append(optarg, c) != 0) {
           goto failed;
@@ -460,12 +834,21 @@ static int config_defaults(struct configuration *c, char *progname)
   c->app_kout_len = 1024 * 1024;
   c->arp_to = 500;
   c->arp_to_max = 10000000;
+  c->arp_age = 60000000;
+  c->arp_file = NULL;
   c->tcp_rtt_init = 50;
   c->tcp_link_bw = 10;
   c->tcp_rxbuf_len = 8192;
   c->tcp_txbuf_len = 8192;
+  c->tcp_rxbuf_max = 0;
+  c->tcp_txbuf_max = 0;
   c->tcp_handshake_to = 10000;
   c->tcp_handshake_retries = 10;
+  c->tcp_syn_cookies = CONFIG_SYN_COOKIES_OFF;
+  c->tcp_sack = 1;
+  c->tcp_fastopen = 0;
+  c->tcp_close_hold = 10000;
+  c->tcp_flow_grace = 1000;
   c->cc_algorithm = CONFIG_CC_DCTCP_RATE;
   c->cc_control_granularity = 50;
   c->cc_control_interval = 2;
@@ -485,7 +868,34 @@ static int config_defaults(struct configuration *c, char *progname)
   c->cc_timely_beta = 0.8 * UINT32_MAX;
   c->cc_timely_min_rtt = 11;
   c->cc_timely_min_rate = 10000;
+  c->cc_swift_target = 50;
+  c->cc_swift_ai = 1400;
+  c->cc_swift_beta = 0.8 * UINT32_MAX;
+  c->cc_swift_max_mdf = 0.5 * UINT32_MAX;
+  c->cc_threads = 0;
   c->fp_cores_max = 1;
+  c->fp_tso = 0;
+  c->fp_tx_zerocopy = 0;
+  c->fp_rx_nt_threshold = 0;
+  c->fp_rx_tstamp = 0;
+  c->fp_sw_rss = 0;
+  c->fp_flows = FLEXNIC_PL_FLOWST_NUM_DEFAULT;
+  c->fp_sched = CONFIG_FP_SCHED_FIXED;
+  c->fp_sched_latency = 20;
+  c->fp_idle_spin = 100;
+  c->fp_rto_min = 1000;
+  c->fp_delack_segs = 1;
+  c->fp_delack_us = 10;
+  c->fp_qman = CONFIG_FP_QMAN_SKIPLIST;
+  c->fp_bond = 0;
+  c->fp_flow_rules = 0;
+  c->fp_fg_rebalance = 4;
+  c->fp_autoscale = CONFIG_FP_AUTOSCALE_THRESHOLD;
+  c->fp_autoscale_dwell = 100;
+  c->fp_autoscale_queues = 0;
+  c->fp_numa = 0;
+  c->fp_numa_pin = 0;
+  c->fast_restart = 0;
 
   c->dpdk_argc = 1;
   if ((c->dpdk_argv = calloc(2, sizeof(*c->dpdk_argv))) == NULL) {
@@ -520,15 +930,31 @@ static void print_usage(struct configuration *c, char *progname)
           "[default: %"PRIu64"]\n"
       "  --tcp-txbuf-len             Flow tx buffer len "
           "[default: %"PRIu64"]\n"
+      "  --tcp-rxbuf-max=LEN         Autotune rx buffers up to LEN, 0 to "
+          "disable. Without window scaling at most 64KB are used "
+          "[default: %"PRIu64"]\n"
+      "  --tcp-txbuf-max=LEN         Autotune tx buffers up to LEN, 0 to "
+          "disable. Capped at 64KB like rx [default: %"PRIu64"]\n"
       "  --tcp-handshake-timeout=TIMEOUT  Handshake timeout (us) "
           "[default: %"PRIu32"]\n"
       "  --tcp-handshake-retries=RETRIES  Handshake retries "
           "[default: %"PRIu32"]\n"
+      "  --tcp-syn-cookies=MODE      Answer SYNs with cookies instead of "
+          "listener backlog entries [default: off]\n"
+      "     Options: off, overflow (backlog full), always\n"
+      "  --tcp-no-sack               Do not negotiate selective "
+          "acknowledgements\n"
+      "  --tcp-fastopen              Accept data in SYNs from clients with a "
+          "valid fast open cookie\n"
+      "  --tcp-close-hold=TIME       Keep closed connections to absorb late "
+          "segments (us) [default: %"PRIu32"]\n"
+      "  --tcp-flow-grace=TIME       Release flow state of closed connections "
+          "after (us) [default: %"PRIu32"]\n"
       "\n"
       "Congestion control parameters:\n"
       "  --cc=ALGORITHM              Congestion-control algorithm "
           "[default: dctcp-rate]\n"
-      "     Options: dctcp-win, dctcp-rate, const-rate, timely\n"
+      "     Options: dctcp-win, dctcp-rate, const-rate, timely, bbr, swift\n"
       "  --cc-control-granularity=G  Minimal control iteration "
           "[default: %"PRIu32"]\n"
       "  --cc-control-interval=INT   Control interval (multiples of RTT) "
@@ -559,9 +985,22 @@ static void print_usage(struct configuration *c, char *progname)
           "[default: %"PRIu32"]\n"
       "  --cc-timely-minrate=RTT     Timely: minimal rate to use "
           "[default: %"PRIu32"]\n"
+      "  --cc-swift-target=TIME      Swift: target delay (us) "
+          "[default: %"PRIu32"]\n"
+      "  --cc-swift-ai=BYTES         Swift: additive increment per rtt "
+          "[default: %"PRIu32"]\n"
+      "  --cc-swift-beta=FRAC        Swift: mult. decr. factor "
+          "[default: %f]\n"
+      "  --cc-swift-maxmdf=FRAC      Swift: max. mult. decrease per rtt "
+          "[default: %f]\n"
+      "  --cc-threads=NUM            Threads running the control loop, "
+          "connections sharded by flow group, 0 to run it on the main slow "
+          "path thread. Packet processing and connection setup always run on "
+          "the main thread [default: %"PRIu32"]\n"
       "\n"
       "IP protocol parameters:\n"
-      "  --ip-route=DEST[/PREFIX],NEXTHOP  Add route\n"
+      "  --ip-route=DEST[/PREFIX],NEXTHOP[,PORT]  Add route, optionally "
+          "fixing the NIC port\n"
       "  --ip-addr=ADDR[/PREFIXLEN]        Set local IP address\n"
       "\n"
       "ARP protocol parameters:\n"
@@ -569,23 +1008,84 @@ static void print_usage(struct configuration *c, char *progname)
           "[default: %"PRIu32"]\n"
       "  --arp-timeout-max=TIMEOUT   ARP request max timeout (us) "
           "[default: %"PRIu32"]\n"
+      "  --arp-age=TIME              Age of resolved entries (us), refreshed "
+          "if in use, 0 for no aging [default: %"PRIu32"]\n"
+      "  --arp-file=PATH             Preload static entries from neighbor "
+          "file with IP MAC [PORT] lines\n"
       "\n"
       "Fast path:\n"
       "  --fp-cores-max=CORES        Max cores used for fast path "
           "[default: %"PRIu32"]\n"
+      "  --fp-tso                    Use TCP segmentation offload if "
+          "supported [default: disabled]\n"
+      "  --fp-tx-zerocopy            Transmit payload without copying "
+          "[default: disabled]\n"
+      "  --fp-rx-nt-threshold=BYTES  Min. payload size for non-temporal rx "
+          "copies, 0 disables [default: %"PRIu32"]\n"
+      "  --fp-rx-tstamp=KHZ          Take rtt samples from NIC rx timestamps "
+          "ticking at this rate, 0 uses poll times [default: %"PRIu32"]\n"
+      "  --fp-sw-rss=CORES           Cores receiving from the NIC and steering "
+          "packets in software, 0 uses the RETA [default: %"PRIu32"]\n"
+      "  --fp-flows=NUM              Max. number of flows "
+          "[default: %"PRIu32"]\n"
+      "  --fp-sched=POLICY           Stage batch size policy "
+          "[default: fixed]\n"
+      "     Options: fixed, adaptive\n"
+      "  --fp-sched-latency=TIME     Adaptive: target poll loop duration "
+          "(us) [default: %"PRIu32"]\n"
+      "  --fp-idle-spin=TIME         Busy spin time before idle cores "
+          "pause (us) [default: %"PRIu32"]\n"
+      "  --fp-rto-min=TIME           Min. retransmission timeout in the fast "
+          "path (us), 0 to leave timeouts to the slow path "
+          "[default: %"PRIu32"]\n"
+      "  --fp-delack-segs=NUM        Max. in-order segments acknowledged "
+          "with one delayed ack, 1 acks every run [default: %"PRIu32"]\n"
+      "  --fp-delack-us=TIME         Max. time an ack is delayed (us) "
+          "[default: %"PRIu32"]\n"
+      "  --fp-qman=BACKEND           Queue manager for rate limited flows "
+          "[default: skiplist]\n"
+      "     Options: skiplist, wheel\n"
+      "  --fp-bond                   Bond all NIC ports, balancing flows "
+          "[default: disabled]\n"
+      "  --fp-flow-rules=NUM         Max. connections steered to their app "
+          "core with NIC flow rules, 0 disables [default: %"PRIu32"]\n"
+      "  --fp-fg-rebalance=NUM       Max. flow groups moved between cores "
+          "per rebalancing round, 0 disables [default: %"PRIu32"]\n"
+      "  --fp-autoscale=POLICY       Policy for scaling fast path cores "
+          "[default: threshold]\n"
+      "     Options: threshold, ewma, off\n"
+      "  --fp-autoscale-dwell=TIME   Ewma: min. time between scaling "
+          "decisions (ms) [default: %"PRIu32"]\n"
+      "  --fp-autoscale-queues       Ewma: also scale up on nic and app rx "
+          "queue fill [default: disabled]\n"
+      "  --fp-numa                   Place buffers and flow state on the "
+          "numa node of the serving core [default: disabled]\n"
+      "  --fp-numa-pin               Prefer fast path cores on the NIC's "
+          "numa node [default: disabled]\n"
+      "  --fast-restart              Keep shared memory on exit and take over "
+          "connections of a previous instance [default: disabled]\n"
       "  --dpdk-extra=ARG            Add extra DPDK argument\n",
       progname,
       c->nic_rx_len, c->nic_tx_len, c->app_kin_len, c->app_kout_len,
       c->tcp_rtt_init, c->tcp_link_bw, c->tcp_rxbuf_len, c->tcp_txbuf_len,
-      c->tcp_handshake_to, c->tcp_handshake_retries,
+      c->tcp_rxbuf_max, c->tcp_txbuf_max, c->tcp_handshake_to,
+      c->tcp_handshake_retries,
+      c->tcp_close_hold, c->tcp_flow_grace,
       c->cc_control_granularity, c->cc_control_interval, c->cc_rexmit_ints,
       (double) c->cc_dctcp_weight / UINT32_MAX, c->cc_dctcp_min,
       c->cc_const_rate, c->cc_timely_tlow, c->cc_timely_thigh,
       c->cc_timely_step, c->cc_timely_init,
       (double) c->cc_timely_alpha / UINT32_MAX,
       (double) c->cc_timely_beta / UINT32_MAX, c->cc_timely_min_rtt,
-      c->cc_timely_min_rate, c->arp_to, c->arp_to_max,
-      c->fp_cores_max);
+      c->cc_timely_min_rate, c->cc_swift_target, c->cc_swift_ai,
+      (double) c->cc_swift_beta / UINT32_MAX,
+      (double) c->cc_swift_max_mdf / UINT32_MAX,
+      c->cc_threads, c->arp_to, c->arp_to_max, c->arp_age,
+      c->fp_cores_max, c->fp_rx_nt_threshold, c->fp_rx_tstamp, c->fp_sw_rss,
+      c->fp_flows,
+      c->fp_sched_latency, c->fp_idle_spin, c->fp_rto_min, c->fp_delack_segs,
+      c->fp_delack_us, c->fp_flow_rules,
+      c->fp_fg_rebalance, c->fp_autoscale_dwell);
 }
 
 static inline int parse_int64(const char *s, uint64_t *pi)
@@ -648,7 +1148,8 @@ static inline int parse_cidr(char *s, uint32_t *ip, uint8_t *prefix)
 static inline int parse_route(char *s, struct configuration *c)
 {
   struct config_route *r, *r_p;
-  char *comma;
+  char *comma, *port;
+  uint8_t port_idx;
 
   if ((r = calloc(1, sizeof(*r))) == NULL) {
     fprintf(stderr, "parse_route: alloc failed\n");
@@ -669,6 +1170,17 @@ static inline int parse_route(char *s, struct configuration *c)
     goto failed;
   }
 
+  /* parse optional port */
+  r->port = -1;
+  if ((port = strchr(comma + 1, ',')) != NULL) {
+    *port = 0;
+    if (parse_int8(port + 1, &port_idx) != 0) {
+      fprintf(stderr, "parse_route: parsing port (%s) failed\n", port + 1);
+      goto failed;
+    }
+    r->port = port_idx;
+  }
+
   /* parse next hop */
   if (util_parse_ipv4(comma + 1, &r->next_hop_ip) != 0) {
     fprintf(stderr, "parse_route: parsing next hop (%s) failed\n", comma + 1);
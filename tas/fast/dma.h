@@ -32,6 +32,10 @@
 #include <rte_memcpy.h>
 #include <tas.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #ifdef DATAPLANE_STATS
 void dma_dump_stats(void);
 #endif
@@ -68,6 +72,68 @@ static inline void dma_write(uintptr_t addr, size_t len, const void *buf)
 #endif
 }
 
+/**
+ * Like dma_write, but use non-temporal stores for the aligned part of the
+ * destination so large payloads do not evict the fast path working set from
+ * the LLC. Caller must ensure a store fence before making the data visible.
+ */
+static inline void dma_write_nt(uintptr_t addr, size_t len, const void *buf)
+{
+#ifdef __SSE2__
+  uint8_t *dst = (uint8_t *) tas_shm + addr;
+  const uint8_t *src = buf;
+  size_t part, n = len;
+
+  assert(addr + len >= addr && addr + len <= FLEXNIC_DMA_MEM_SIZE);
+
+  /* copy unaligned head normally */
+  part = (16 - ((uintptr_t) dst & 15)) & 15;
+  if (part > n)
+    part = n;
+  rte_memcpy(dst, src, part);
+  dst += part;
+  src += part;
+  n -= part;
+
+  for (; n >= 64; n -= 64, dst += 64, src += 64) {
+    _mm_stream_si128((__m128i *) dst,
+        _mm_loadu_si128((const __m128i *) src));
+    _mm_stream_si128((__m128i *) (dst + 16),
+        _mm_loadu_si128((const __m128i *) (src + 16)));
+    _mm_stream_si128((__m128i *) (dst + 32),
+        _mm_loadu_si128((const __m128i *) (src + 32)));
+    _mm_stream_si128((__m128i *) (dst + 48),
+        _mm_loadu_si128((const __m128i *) (src + 48)));
+  }
+  for (; n >= 16; n -= 16, dst += 16, src += 16) {
+    _mm_stream_si128((__m128i *) dst,
+        _mm_loadu_si128((const __m128i *) src));
+  }
+
+  /* and the tail */
+  rte_memcpy(dst, src, n);
+
+#ifdef FLEXNIC_TRACE_DMA
+  struct flexnic_trace_entry_dma evt = {
+      .addr = addr,
+      .len = len,
+    };
+  trace_event2(FLEXNIC_TRACE_EV_DMAWR, sizeof(evt), &evt,
+      MIN(len, UINT16_MAX - sizeof(evt)), buf);
+#endif
+#else
+  dma_write(addr, len, buf);
+#endif
+}
+
+/** Order preceding non-temporal stores before subsequent stores. */
+static inline void dma_write_nt_fence(void)
+{
+#ifdef __SSE2__
+  _mm_sfence();
+#endif
+}
+
 static inline void *dma_pointer(uintptr_t addr, size_t len)
 {
   /* validate address */
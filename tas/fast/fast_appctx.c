@@ -23,6 +23,7 @@
  */
 
 #include <assert.h>
+#include <emmintrin.h>
 #include <rte_config.h>
 
 #include <tas_memif.h>
@@ -36,49 +37,89 @@ void fast_appctx_poll_pf(struct dataplane_context *ctx, uint32_t id)
   rte_prefetch0(dma_pointer(actx->tx_base + actx->tx_head, 1));
 }
 
-int fast_appctx_poll_fetch(struct dataplane_context *ctx, uint32_t id,
-    void **pqe)
+/* mask of entries in *line (4 x 16 bytes) with type byte equal to t */
+static inline unsigned atx_line_types(const __m128i *line, uint8_t t)
+{
+  __m128i v = _mm_set1_epi8(t);
+
+  return ((_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(line), v)) >> 15) |
+      ((_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(line + 1), v)) >> 14) &
+       2) |
+      ((_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(line + 2), v)) >> 13) &
+       4) |
+      ((_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128(line + 3), v)) >> 12) &
+       8));
+}
+
+/**
+ * Fetch up to max entries from the tx queue of context id, as far as they are
+ * in the cache line the queue head is in. The types of all four entries in
+ * the line are checked at once, and the flow states of fetched entries are
+ * prefetched for the bumps. Returns the number of entries fetched.
+ */
+unsigned fast_appctx_poll_fetch(struct dataplane_context *ctx, uint32_t id,
+    void **pqes, unsigned max)
 {
   struct flextcp_pl_appctx *actx = &fp_state->appctx[ctx->id][id];
   struct flextcp_pl_atx *atx;
-  uint8_t type;
-  uint32_t flow_id  = -1;
+  const __m128i *line;
+  unsigned first, num, valid, known, move, resize, i;
+  uint32_t flow_id;
+  void *fs;
 
   /* stop if context is not in use */
   if (actx->tx_len == 0)
-    return -1;
+    return 0;
 
   atx = dma_pointer(actx->tx_base + actx->tx_head, sizeof(*atx));
-
-  type = atx->type;
+  line = (const __m128i *) ((uintptr_t) atx & ~(uintptr_t) 63);
+  first = ((uintptr_t) atx & 63) / sizeof(*atx);
+
+  /* don't go beyond the end of the line or the queue */
+  num = 4 - first;
+  num = MIN(num, (actx->tx_len - actx->tx_head) / sizeof(*atx));
+  num = MIN(num, max);
+
+  /* entries in use, starting from the head */
+  valid = (~atx_line_types(line, 0) >> first) & ((1u << num) - 1);
+  known = atx_line_types(line, FLEXTCP_PL_ATX_CONNUPDATE) >> first;
+  move = atx_line_types(line, FLEXTCP_PL_ATX_CONNMOVE) >> first;
+  resize = atx_line_types(line, FLEXTCP_PL_ATX_TXRESIZE) >> first;
   MEM_BARRIER();
 
-  if (type == 0) {
-    return -1;
-  } else if (type != FLEXTCP_PL_ATX_CONNUPDATE) {
-    fprintf(stderr, "fast_appctx_poll: unknown type: %u id=%u\n", type,
-        id);
-    abort();
-  }
+  for (i = 0; i < num && (valid & (1u << i)) != 0; i++) {
+    if ((known & (1u << i)) != 0) {
+      /* update RX/TX queue pointers for connection */
+      flow_id = atx[i].msg.connupdate.flow_id;
+    } else if ((move & (1u << i)) != 0) {
+      flow_id = atx[i].msg.connmove.flow_id;
+    } else if ((resize & (1u << i)) != 0) {
+      flow_id = atx[i].msg.txresize.flow_id;
+    } else {
+      fprintf(stderr, "fast_appctx_poll: unknown type: %u id=%u\n",
+          atx[i].type, id);
+      abort();
+    }
 
-  *pqe = atx;
+    if (flow_id >= config.fp_flows) {
+      fprintf(stderr, "fast_appctx_poll: invalid flow id=%u\n", flow_id);
+      abort();
+    }
 
-  /* update RX/TX queue pointers for connection */
-  flow_id = atx->msg.connupdate.flow_id;
-  if (flow_id >= FLEXNIC_PL_FLOWST_NUM) {
-    fprintf(stderr, "fast_appctx_poll: invalid flow id=%u\n", flow_id);
-    abort();
+    fs = &fp_state->flowst[flow_id];
+    rte_prefetch0(fs);
+    rte_prefetch0(fs + 64);
+    rte_prefetch0(fs + 128);
+    pqes[i] = &atx[i];
   }
 
-  void *fs = &fp_state->flowst[flow_id];
-  rte_prefetch0(fs);
-  rte_prefetch0(fs + 64);
-
-  actx->tx_head += sizeof(*atx);
-  if (actx->tx_head >= actx->tx_len)
-    actx->tx_head -= actx->tx_len;
+  if (i > 0) {
+    actx->tx_head += i * sizeof(*atx);
+    if (actx->tx_head >= actx->tx_len)
+      actx->tx_head -= actx->tx_len;
+  }
 
-  return 0;
+  return i;
 }
 
 int fast_appctx_poll_bump(struct dataplane_context *ctx, void *pqe,
@@ -87,6 +128,23 @@ int fast_appctx_poll_bump(struct dataplane_context *ctx, void *pqe,
   struct flextcp_pl_atx *atx = pqe;
   int ret;
 
+  if (atx->type == FLEXTCP_PL_ATX_CONNMOVE) {
+    /* entry is released by the flow owner if forwarded */
+    if (fast_flows_move(ctx, atx, ts) == 0) {
+      MEM_BARRIER();
+      atx->type = 0;
+    }
+    return 1;
+  }
+
+  if (atx->type == FLEXTCP_PL_ATX_TXRESIZE) {
+    if (fast_flows_txresize(ctx, atx, ts) == 0) {
+      MEM_BARRIER();
+      atx->type = 0;
+    }
+    return 1;
+  }
+
   ret = fast_flows_bump(ctx, atx->msg.connupdate.flow_id,
       atx->msg.connupdate.bump_seq, atx->msg.connupdate.rx_tail,
       atx->msg.connupdate.tx_head, atx->msg.connupdate.flags, nbh, ts);
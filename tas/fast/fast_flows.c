@@ -27,6 +27,10 @@
 #include <rte_ip.h>
 #include <rte_hash_crc.h>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include <tas_memif.h>
 #include <utils_sync.h>
 
@@ -36,6 +40,12 @@
 
 #define TCP_MSS 1448
 #define TCP_MAX_RTT 100000
+/** Maximum payload for a single TSO segment (has to fit in IP length) */
+#define TCP_TSO_MAX (45 * TCP_MSS)
+/** Upper bound for the retransmission timeout with backoff [us] */
+#define TCP_RTO_MAX 1000000
+/** Max. number of times the retransmission timeout is doubled */
+#define TCP_RTO_BACKOFF_MAX 10
 
 #define HWXSUM_EN 1
 
@@ -48,17 +58,21 @@ struct flow_key {
   beui16_t remote_port;
 } __attribute__((packed));
 
-#if 1
-#define fs_lock(fs) util_spin_lock(&fs->lock)
-#define fs_unlock(fs) util_spin_unlock(&fs->lock)
-#else
-#define fs_lock(fs) do {} while (0)
-#define fs_unlock(fs) do {} while (0)
-#endif
+/** Bump request forwarded to owning core, stored in the buffer data */
+struct flow_fwd_bump {
+  uint32_t flow_id;
+  uint32_t rx_tail;
+  uint32_t tx_head;
+  uint16_t bump_seq;
+  uint8_t flags;
+} __attribute__((packed));
 
 
 static void flow_tx_read(struct flextcp_pl_flowst *fs, uint32_t pos,
     uint16_t len, void *dst);
+static int flow_tx_zc(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, struct flextcp_pl_flowst *fs, uint32_t pos,
+    uint16_t len);
 static void flow_rx_write(struct flextcp_pl_flowst *fs, uint32_t pos,
     uint16_t len, const void *src);
 #ifdef FLEXNIC_PL_OOO_RECV
@@ -71,19 +85,198 @@ static void flow_tx_segment(struct dataplane_context *ctx,
     uint32_t payload_pos, uint32_t ts_echo, uint32_t ts_my, uint8_t fin);
 static void flow_tx_ack(struct dataplane_context *ctx, uint32_t seq,
     uint32_t ack, uint32_t rxwnd, uint32_t echo_ts, uint32_t my_ts,
-    struct network_buf_handle *nbh, struct tcp_timestamp_opt *ts_opt);
+    struct network_buf_handle *nbh, struct tcp_timestamp_opt *ts_opt,
+    const struct flextcp_pl_flowst *fs, uint32_t sack_seq);
 static void flow_reset_retransmit(struct flextcp_pl_flowst *fs);
+static void flow_rx_sack(struct flextcp_pl_flowst *fs,
+    const struct tcp_sack_opt *opt, uint32_t ack);
+static uint32_t flow_tx_sack_skip(struct flextcp_pl_flowst *fs,
+    uint32_t *avail);
+
+/** Accumulated updates while processing a run of segments of one flow */
+struct flow_rx_run {
+  uint32_t rx_bump;
+  uint32_t tx_bump;
+  /* start of the last out of order segment buffered, reported first in SACK */
+  uint32_t sack_seq;
+  int trigger_ack;
+  /* set if the ack can't be delayed, e.g. for out of order segments */
+  int ack_now;
+  /* in-order segments with payload in the run, for delayed acks */
+  uint16_t ack_segs;
+  int fin_bump;
+};
+static inline int flow_rx_segment(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, struct flextcp_pl_flowst *fs,
+    struct tcp_opts *opts, uint32_t ts, struct flow_rx_run *run,
+    const int objconn) __attribute__((always_inline));
+
+/*
+ * Receive and queue manager paths are generated once per flow variant with
+ * the mode as a constant, so the stream variant carries none of the object
+ * connection handling. fast_flows_packet and fast_flows_qman dispatch on the
+ * variant of the flow state, see flow_variant().
+ */
+#define FLOW_VARIANT_STREAM 0
+#define FLOW_VARIANT_OBJ 1
+#define FLOW_VARIANT_NUM 2
+
+struct flow_variant_ops {
+  void (*packet)(struct dataplane_context *ctx,
+      struct network_buf_handle **nbhs, struct flextcp_pl_flowst *fs,
+      struct tcp_opts *opts, uint16_t n, uint32_t ts, int *rets);
+  int (*qman)(struct dataplane_context *ctx, struct flextcp_pl_flowst *fs,
+      struct network_buf_handle *nbh, uint32_t ts);
+};
+static const struct flow_variant_ops flow_variants[FLOW_VARIANT_NUM];
+
+/** Variant of the specialized paths handling the flow */
+static inline unsigned flow_variant(const struct flextcp_pl_flowst *fs)
+{
+  return ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJCONN) != 0 ?
+      FLOW_VARIANT_OBJ : FLOW_VARIANT_STREAM);
+}
 
 static inline void tcp_checksums(struct network_buf_handle *nbh,
     struct pkt_tcp *p, beui32_t ip_s, beui32_t ip_d, uint16_t l3_paylen);
 
+/** Maximum number of payload bytes sent for one queue manager event */
+static inline uint16_t tcp_seg_max(void)
+{
+  return (net_tso_enabled ? TCP_TSO_MAX : TCP_MSS);
+}
+
+/** Core currently owning the flow */
+static inline uint16_t fast_flows_owner(struct flextcp_pl_flowst *fs)
+{
+  uint16_t c = fs->steer_core;
+
+  if (c != FLEXNIC_PL_FLOWST_NOSTEER)
+    return c;
+  return fp_state->flow_group_steering[fs->flow_group];
+}
+
+/** Counters for flow, these are kept outside of the flow state */
+static inline struct flextcp_pl_flowst_stats *flow_stats(
+    struct flextcp_pl_flowst *fs)
+{
+  return &fp_flowst_stats[fs - fp_state->flowst];
+}
+
+/** Report flow as active to the slow path congestion control, once per
+ * FLEXNIC_PL_CC_ACTIVE_INTERVAL at most */
+static inline void flow_cc_active(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts)
+{
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
+
+  if (LIKELY(ts - st->cc_active_ts < FLEXNIC_PL_CC_ACTIVE_INTERVAL))
+    return;
+
+  /* on failure we retry with the next segment */
+  if (fast_kernel_ccactive(ctx, fs - fp_state->flowst) == 0)
+    st->cc_active_ts = ts;
+}
+
+/** Retransmission timeout for flow: twice the rtt estimate but at least the
+ * configured min., doubled for every timeout without progress */
+static inline uint32_t flow_rto(struct flextcp_pl_flowst *fs)
+{
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
+  uint32_t rtt = (st->rtt_est != 0 ? st->rtt_est : config.tcp_rtt_init);
+  uint64_t rto = MAX(2 * (uint64_t) rtt, config.fp_rto_min);
+
+  rto <<= st->rto_backoff;
+  return MIN(rto, TCP_RTO_MAX);
+}
+
+/** Start retransmission timer if not running, restart it if rearm is set */
+static inline void flow_rto_arm(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts, int rearm)
+{
+  if (config.fp_rto_min == 0)
+    return;
+
+  qman_rto_set(&ctx->qman, fs - fp_state->flowst, ts + flow_rto(fs), rearm);
+}
+
+/* Queue delayed ack for flow, -1 if the queue is full */
+static inline int flow_ack_queue(struct dataplane_context *ctx,
+    uint32_t flow_id, uint32_t deadline)
+{
+  uint32_t i;
+
+  if (ctx->dack_tail - ctx->dack_head >= DACK_QUEUE_SIZE)
+    return -1;
+
+  i = ctx->dack_tail++ % DACK_QUEUE_SIZE;
+  ctx->dack_ids[i] = flow_id;
+  ctx->dack_ts[i] = deadline;
+  return 0;
+}
+
+/* Hold back the ack for in-order segments until fp_delack_segs are pending
+ * or fp_delack_us passed, returns 0 if the ack was deferred */
+static inline int flow_ack_defer(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t flow_id, uint16_t segs,
+    uint32_t ts)
+{
+  uint32_t pending = fs->rx_ack_pending + segs;
+
+  /* a closing window is reported without delay, the app is falling behind */
+  if (pending >= config.fp_delack_segs || fs->rx_avail < fs->rx_len / 2)
+    return -1;
+
+  /* the timer runs from the first unacknowledged segment */
+  if (fs->rx_ack_pending == 0 &&
+      flow_ack_queue(ctx, flow_id, ts + config.fp_delack_us) != 0)
+    return -1;
+
+  fs->rx_ack_pending = pending;
+  return 0;
+}
+
+/** Account segment to the flow group load, for rebalancing flow groups.
+ * Flows steered by flow rules stay put when their group moves, so they are
+ * not counted. */
+static inline void flow_group_count(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t bytes)
+{
+  struct dataplane_fg_stats *fgs;
+
+  if (fs->steer_core != FLEXNIC_PL_FLOWST_NOSTEER)
+    return;
+
+  fgs = &ctx->fg_stats[fs->flow_group];
+  fgs->pkts++;
+  fgs->bytes += bytes;
+}
+
+int fast_flows_fwd(struct dataplane_context *ctx, uint16_t core,
+    uintptr_t type, void *p, uint32_t ts)
+{
+  void *msg[2] = { (void *) type, p };
+
+  /* both entries go in at once so the consumer always sees pairs */
+  if (rte_ring_enqueue_bulk(ctxs[core]->flow_fwd_ring, msg, 2, NULL) != 2) {
+    return -1;
+  }
+
+  util_flexnic_kick(&fp_state->kctx[core], ts);
+  return 0;
+}
+
 void fast_flows_qman_pf(struct dataplane_context *ctx, uint32_t *queues,
     uint16_t n)
 {
+  struct flextcp_pl_flowst *fs;
   uint16_t i;
 
   for (i = 0; i < n; i++) {
-    rte_prefetch0(&fp_state->flowst[queues[i]]);
+    fs = &fp_state->flowst[queues[i]];
+    rte_prefetch0(fs);
+    rte_prefetch0((uint8_t *) fs + 64);
+    rte_prefetch0((uint8_t *) fs + 128);
   }
 }
 
@@ -108,23 +301,17 @@ int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
 {
   uint32_t flow_id = queue;
   struct flextcp_pl_flowst *fs = &fp_state->flowst[flow_id];
-  struct obj_hdr oh;
-  uint32_t avail, len, tx_pos, tx_seq, ack, rx_wnd, hdrlen, objlen;
   uint16_t new_core;
-  uint8_t fin;
-  int ret = 0;
-
-  fs_lock(fs);
 
   /* if connection has been moved, add to forwarding queue and stop */
-  new_core = fp_state->flow_group_steering[fs->flow_group];
+  new_core = fast_flows_owner(fs);
   if (new_core != ctx->id) {
     /*fprintf(stderr, "fast_flows_qman: arrived on wrong core, forwarding "
         "%u -> %u (fs=%p, fg=%u)\n", ctx->id, new_core, fs, fs->flow_group);*/
 
     /* enqueue flo state on forwarding queue */
-    if (rte_ring_enqueue(ctxs[new_core]->qman_fwd_ring, fs) != 0) {
-      fprintf(stderr, "fast_flows_qman: rte_ring_enqueue failed\n");
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_QMAN, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_qman: fast_flows_fwd failed\n");
       abort();
     }
 
@@ -136,12 +323,25 @@ int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
       abort();
     }
 
-    util_flexnic_kick(&fp_state->kctx[new_core], ts);
-
-    ret = -1;
-    goto unlock;
+    return -1;
   }
 
+  return flow_variants[flow_variant(fs)].qman(ctx, fs, nbh, ts);
+}
+
+/* Send segment for a queue manager event on the core owning the flow */
+static inline __attribute__((always_inline)) int flow_qman(
+    struct dataplane_context *ctx, struct flextcp_pl_flowst *fs,
+    struct network_buf_handle *nbh, uint32_t ts, const int objconn)
+{
+  uint32_t flow_id = fs - fp_state->flowst;
+  struct obj_hdr oh;
+  uint32_t avail, len, tx_pos, tx_seq, ack, rx_wnd, hdrlen, objlen;
+  uint32_t sack_lim = UINT32_MAX;
+  struct network_buf_handle *tso_nbh;
+  uint8_t fin;
+  int ret = 0;
+
   /* calculate how much is available to be sent */
   avail = tcp_txavail(fs, NULL);
 
@@ -166,16 +366,57 @@ int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
   trace_event(FLEXNIC_PL_TREV_AFLOQMAN, sizeof(te_afloqman), &te_afloqman);
 #endif
 
+  /* when retransmitting, skip data the receiver already has and stop before
+   * the next selectively acknowledged interval */
+  if (UNLIKELY(fs->tx_sack_num != 0)) {
+    sack_lim = flow_tx_sack_skip(fs, &avail);
+  }
+
   /* if there is no data available, stop */
   if (avail == 0) {
     ret = -1;
-    goto unlock;
+    goto out;
+  }
+
+  /* object connections are paced per object, so stick to MSS for those */
+  if (!objconn) {
+    len = MIN(avail, tcp_seg_max());
+  } else {
+    len = MIN(avail, TCP_MSS);
+  }
+
+  /* return what the queue manager charged us for beyond the hole */
+  if (UNLIKELY(len > sack_lim)) {
+    if (qman_set(&ctx->qman, flow_id, 0, len - sack_lim, 0,
+          QMAN_ADD_AVAIL) != 0)
+    {
+      fprintf(stderr, "flast_flows_qman: qman_set sack failed, UNEXPECTED\n");
+      abort();
+    }
+    len = sack_lim;
+  }
+
+  /* larger segments need a TSO buffer, fall back to MSS if we're out */
+  if (len > TCP_MSS) {
+    if ((tso_nbh = network_buf_alloc_tso(&ctx->net)) != NULL) {
+      /* pre-allocated buffer is not used */
+      nbh = tso_nbh;
+      ret = 1;
+    } else {
+      /* return what the queue manager charged us for, but we can't send */
+      if (qman_set(&ctx->qman, flow_id, 0, len - TCP_MSS, 0,
+            QMAN_ADD_AVAIL) != 0)
+      {
+        fprintf(stderr, "flast_flows_qman: qman_set tso failed, UNEXPECTED\n");
+        abort();
+      }
+      len = TCP_MSS;
+    }
   }
-  len = MIN(avail, TCP_MSS);
 
   /* this is an object connection, we need to be careful to make segments end on
    * segment boundaries*/
-  if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJCONN)) {
+  if (objconn) {
     /* if we're starting a new object, need to fetch header first to determine
      * length */
     if (fs->tx_objrem == 0) {
@@ -233,6 +474,7 @@ int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
     fs->tx_next_pos -= fs->tx_len;
   }
   fs->tx_sent += len;
+  flow_rto_arm(ctx, fs, ts, 0);
 
   fin = (fs->rx_base_sp & FLEXNIC_PL_FLOWST_TXFIN) == FLEXNIC_PL_FLOWST_TXFIN &&
     fs->tx_next_pos == fs->tx_head;
@@ -243,35 +485,50 @@ int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
     len--;
   }
 
+  /* first segment since a bump found the flow idle */
+  if (dataplane_bump_tsc[flow_id] != 0) {
+    stats_hist_add(ctx, fp_state->appctx[ctx->id][fs->db_id].appst_id,
+        FLEXNIC_STATS_HIST_ATXTX,
+        (uint32_t) (rte_get_tsc_cycles() - dataplane_bump_tsc[flow_id]));
+    dataplane_bump_tsc[flow_id] = 0;
+  }
+
   /* send out segment */
   flow_tx_segment(ctx, nbh, fs, tx_seq, ack, rx_wnd, len, tx_pos,
       fs->tx_next_ts, ts, fin);
-unlock:
-  fs_unlock(fs);
+out:
   return ret;
 }
 
 int fast_flows_qman_fwd(struct dataplane_context *ctx,
-    struct flextcp_pl_flowst *fs)
+    struct flextcp_pl_flowst *fs, uint32_t ts)
 {
   unsigned avail;
-  uint16_t flow_id = fs - fp_state->flowst;
+  uint32_t flow_id = fs - fp_state->flowst;
+  uint16_t new_core;
 
   /*fprintf(stderr, "fast_flows_qman_fwd: fs=%p\n", fs);*/
 
-  fs_lock(fs);
+  /* flow group might have moved on again while this was queued */
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_QMAN, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_qman_fwd: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 0;
+  }
 
   avail = tcp_txavail(fs, NULL);
 
   /* re-arm queue manager */
-  if (qman_set(&ctx->qman, flow_id, fs->tx_rate, avail, TCP_MSS,
+  if (qman_set(&ctx->qman, flow_id, fs->tx_rate, avail, tcp_seg_max(),
         QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_SET_AVAIL) != 0)
   {
     fprintf(stderr, "fast_flows_qman_fwd: qman_set failed, UNEXPECTED\n");
     abort();
   }
 
-  fs_unlock(fs);
   return 0;
 }
 
@@ -324,22 +581,202 @@ void fast_flows_packet_pfbufs(struct dataplane_context *ctx,
   }
 }
 
-/* Received packet */
-int fast_flows_packet(struct dataplane_context *ctx,
-    struct network_buf_handle *nbh, void *fsp, struct tcp_opts *opts,
-    uint32_t ts)
+/* Check if received segment directly continues the previous one */
+int fast_flows_packet_gro_check(struct network_buf_handle *prev,
+    struct network_buf_handle *next)
+{
+  struct pkt_tcp *pp = network_buf_bufoff(prev);
+  struct pkt_tcp *pn = network_buf_bufoff(next);
+  uint16_t pp_payload, pn_payload;
+  const uint16_t fl_ok = TCP_ACK | TCP_PSH | TCP_ECE | TCP_CWR;
+
+  /* only plain data segments are merged */
+  if ((TCPH_FLAGS(&pp->tcp) & ~fl_ok) != 0 ||
+      (TCPH_FLAGS(&pn->tcp) & ~fl_ok) != 0)
+  {
+    return 0;
+  }
+
+  pp_payload = f_beui16(pp->ip.len) - sizeof(pp->ip) -
+    TCPH_HDRLEN(&pp->tcp) * 4;
+  pn_payload = f_beui16(pn->ip.len) - sizeof(pn->ip) -
+    TCPH_HDRLEN(&pn->tcp) * 4;
+  if (pp_payload == 0 || pn_payload == 0)
+    return 0;
+
+  return f_beui32(pn->tcp.seqno) == f_beui32(pp->tcp.seqno) + pp_payload;
+}
+
+/* Received run of segments for the same flow */
+void fast_flows_packet(struct dataplane_context *ctx,
+    struct network_buf_handle **nbhs, void *fsp, struct tcp_opts *opts,
+    uint16_t n, uint32_t ts, int *rets)
 {
-  struct pkt_tcp *p = network_buf_bufoff(nbh);
   struct flextcp_pl_flowst *fs = fsp;
+
+  flow_variants[flow_variant(fs)].packet(ctx, nbhs, fs, opts, n, ts, rets);
+}
+
+static inline __attribute__((always_inline)) void flow_packet(
+    struct dataplane_context *ctx, struct network_buf_handle **nbhs,
+    struct flextcp_pl_flowst *fs, struct tcp_opts *opts, uint16_t n,
+    uint32_t ts, int *rets, const int objconn)
+{
+  struct network_buf_handle *nbh = NULL;
+  struct flow_rx_run run = { .rx_bump = 0, .tx_bump = 0, .sack_seq = 0,
+    .trigger_ack = 0, .ack_now = 0, .ack_segs = 0, .fin_bump = 0 };
+  uint32_t old_avail, new_avail, rx_pos, seg_pos, prev_rx, prev_tx;
+  uint32_t flow_id = fs - fp_state->flowst;
+  uint16_t i, last = 0, prev_db;
+
+  /* calculate how much data is available to be sent before processing these
+   * packets, to detect whether more data can be sent afterwards */
+  old_avail = tcp_txavail(fs, NULL);
+  rx_pos = fs->rx_next_pos;
+
+  for (i = 0; i < n; i++) {
+    rets[i] = 0;
+    prev_db = fs->db_id;
+    prev_rx = run.rx_bump;
+    prev_tx = run.tx_bump;
+    seg_pos = fs->rx_next_pos;
+    if (flow_rx_segment(ctx, nbhs[i], fs, &opts[i], ts, &run, objconn) != 0)
+      break;
+
+    /* an object steered to a different context starts here, objects so far
+     * go out in one update for the previous context */
+    if (objconn && UNLIKELY(fs->db_id != prev_db) &&
+        (prev_rx != 0 || prev_tx != 0))
+    {
+      arx_cache_add(ctx, prev_db, fs->opaque, prev_rx, rx_pos, prev_tx,
+          FLEXTCP_PL_ARX_OBJUPDATE);
+      run.rx_bump -= prev_rx;
+      run.tx_bump -= prev_tx;
+      rx_pos = seg_pos;
+    }
+
+    nbh = nbhs[i];
+    last = i;
+  }
+
+  /* once we hit the slow path the rest of the run goes there as well */
+  for (; i < n; i++) {
+    rets[i] = -1;
+  }
+
+  if (nbh == NULL) {
+    /* TODO: should pass current flow state to kernel as well */
+    return;
+  }
+
+  /* new data acknowledged: restart retransmission timer, or stop it once
+   * everything is acknowledged */
+  if (run.tx_bump != 0 && config.fp_rto_min != 0) {
+    flow_stats(fs)->rto_backoff = 0;
+    if (fs->tx_sent == 0) {
+      qman_rto_clear(&ctx->qman, flow_id);
+    } else {
+      flow_rto_arm(ctx, fs, ts, 1);
+    }
+  }
+
+  /* if we bumped at least one, then we need to add a notification to the
+   * queue */
+  if (LIKELY(run.rx_bump != 0 || run.tx_bump != 0 || run.fin_bump)) {
+#if PL_DEBUG_ARX
+    fprintf(stderr, "dma_krx_pkt_fastpath: updating application state\n");
+#endif
+
+#ifdef FLEXNIC_TRACING
+    struct pkt_tcp *p = network_buf_bufoff(nbh);
+    struct flextcp_pl_trev_arx te_arx = {
+        .rx_bump = run.rx_bump,
+        .tx_bump = run.tx_bump,
+
+        .db_id = fs->db_id,
+
+        .local_ip = f_beui32(p->ip.dest),
+        .remote_ip = f_beui32(p->ip.src),
+        .local_port = f_beui16(p->tcp.dest),
+        .remote_port = f_beui16(p->tcp.src),
+      };
+    trace_event(FLEXNIC_PL_TREV_ARX, sizeof(te_arx), &te_arx);
+#endif
+
+    uint16_t type;
+    if (!objconn) {
+      type = FLEXTCP_PL_ARX_CONNUPDATE;
+    } else {
+      type = FLEXTCP_PL_ARX_OBJUPDATE;
+    }
+
+    if (run.fin_bump) {
+      type |= FLEXTCP_PL_ARX_FLRXDONE << 8;
+    }
+
+    arx_cache_add(ctx, fs->db_id, fs->opaque, run.rx_bump, rx_pos,
+        run.tx_bump, type);
+    LTRACE(ctx, FLEXNIC_LTRACE_EV_ARX, flow_id, run.rx_bump, run.tx_bump,
+        fs->db_id, 0);
+  }
+
+  /* Flow control: More receiver space? -> might need to start sending */
+  new_avail = tcp_txavail(fs, NULL);
+  if (new_avail > old_avail) {
+    if (!objconn) {
+      /* update qman queue */
+      if (qman_set(&ctx->qman, flow_id, fs->tx_rate, new_avail -
+            old_avail, tcp_seg_max(), QMAN_SET_RATE | QMAN_SET_MAXCHUNK
+            | QMAN_ADD_AVAIL) != 0)
+      {
+        fprintf(stderr, "fast_flows_packet: qman_set 1 failed, UNEXPECTED\n");
+        abort();
+      }
+    } else if (old_avail == 0) {
+      /* for object connections we only need to re-arm the qman queue if flow
+       * control previously capped it to zero. */
+      if (qman_set(&ctx->qman, flow_id, 0, 1, 1,
+            QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_ADD_AVAIL) != 0)
+      {
+        fprintf(stderr, "flast_flows_packet: qman_set 1 failed, UNEXPECTED\n");
+        abort();
+      }
+    }
+  }
+
+  /* if we need to send an ack, send one for the whole run, re-using the last
+   * packet's buffer, unless it can be delayed */
+  if (run.trigger_ack) {
+    if (config.fp_delack_segs > 1 && !run.ack_now &&
+        flow_ack_defer(ctx, fs, flow_id, run.ack_segs, ts) == 0)
+      return;
+
+    fs->rx_ack_pending = 0;
+    flow_tx_ack(ctx, fs->tx_next_seq, fs->rx_next_seq, fs->rx_avail,
+        fs->tx_next_ts, ts, nbh, opts[last].ts, fs, run.sack_seq);
+    rets[last] = 1;
+  }
+}
+
+/* Process one received segment, caller runs on the core owning the flow */
+static inline int flow_rx_segment(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, struct flextcp_pl_flowst *fs,
+    struct tcp_opts *opts, uint32_t ts, struct flow_rx_run *run,
+    const int objconn)
+{
+  struct pkt_tcp *p = network_buf_bufoff(nbh);
   struct flextcp_pl_appst *appst = NULL;
-  uint32_t payload_bytes, payload_off, seq, ack, old_avail, new_avail,
-           orig_payload;
-  uint32_t rx_bump = 0, tx_bump = 0, i, rx_pos, rtt;
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
+  uint32_t payload_bytes, payload_off, seq, ack, orig_payload;
+  uint32_t rx_bump = 0, tx_bump = 0, i, rtt;
+#ifdef FLEXNIC_PL_OOO_RECV
+  uint32_t ooo_end, ooo_bytes;
+#endif
   int no_permanent_sp = 0;
   uint16_t tcp_extra_hlen, trim_start, trim_end;
-  uint16_t flow_id = fs - fp_state->flowst;
   struct obj_hdr *oh;
-  int trigger_ack = 0, fin_bump = 0;
+  int trigger_ack = 0, ack_now = 0, fin_bump = 0;
+  uint16_t ack_segs = 0;
   uint64_t steer_id;
 
   tcp_extra_hlen = (TCPH_HDRLEN(&p->tcp) - 5) * 4;
@@ -347,6 +784,7 @@ int fast_flows_packet(struct dataplane_context *ctx,
   payload_bytes =
       f_beui16(p->ip.len) - (sizeof(p->ip) + sizeof(p->tcp) + tcp_extra_hlen);
   orig_payload = payload_bytes;
+  flow_group_count(ctx, fs, payload_bytes);
 
 #if PL_DEBUG_ARX
   fprintf(stderr, "FLOW local=%08x:%05u remote=%08x:%05u  RX: seq=%u ack=%u "
@@ -356,8 +794,6 @@ int fast_flows_packet(struct dataplane_context *ctx,
       f_beui32(p->tcp.ackno), TCPH_FLAGS(&p->tcp), payload_bytes);
 #endif
 
-  fs_lock(fs);
-
 #ifdef FLEXNIC_TRACING
   struct flextcp_pl_trev_rxfs te_rxfs = {
       .local_ip = f_beui32(p->ip.dest),
@@ -379,6 +815,9 @@ int fast_flows_packet(struct dataplane_context *ctx,
     };
   trace_event(FLEXNIC_PL_TREV_RXFS, sizeof(te_rxfs), &te_rxfs);
 #endif
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_RXSEG, fs - fp_state->flowst,
+      f_beui32(p->tcp.seqno), f_beui32(p->tcp.ackno),
+      payload_bytes | (TCPH_FLAGS(&p->tcp) << 16), fs->rx_avail);
 
 #if PL_DEBUG_ARX
   fprintf(stderr, "FLOW local=%08x:%05u remote=%08x:%05u  ST: op=%"PRIx64
@@ -410,13 +849,8 @@ int fast_flows_packet(struct dataplane_context *ctx,
     goto slowpath;
   }
 
-  /* calculate how much data is available to be sent before processing this
-   * packet, to detect whether more data can be sent afterwards */
-  old_avail = tcp_txavail(fs, NULL);
-
   seq = f_beui32(p->tcp.seqno);
   ack = f_beui32(p->tcp.ackno);
-  rx_pos = fs->rx_next_pos;
 
   /* trigger an ACK if there is payload (even if we discard it) */
 #ifndef SKIP_ACK
@@ -426,16 +860,17 @@ int fast_flows_packet(struct dataplane_context *ctx,
 
   /* Stats for CC */
   if ((TCPH_FLAGS(&p->tcp) & TCP_ACK) == TCP_ACK) {
-    fs->cnt_rx_acks++;
+    st->cnt_rx_acks++;
+    flow_cc_active(ctx, fs, ts);
   }
 
   /* if there is a valid ack, process it */
   if (LIKELY((TCPH_FLAGS(&p->tcp) & TCP_ACK) == TCP_ACK &&
       tcp_valid_rxack(fs, ack, &tx_bump) == 0))
   {
-    fs->cnt_rx_ack_bytes += tx_bump;
+    st->cnt_rx_ack_bytes += tx_bump;
     if ((TCPH_FLAGS(&p->tcp) & TCP_ECE) == TCP_ECE) {
-      fs->cnt_rx_ecn_bytes += tx_bump;
+      st->cnt_rx_ecn_bytes += tx_bump;
     }
 
     if (LIKELY(tx_bump <= fs->tx_sent)) {
@@ -454,13 +889,26 @@ int fast_flows_packet(struct dataplane_context *ctx,
 #endif
     }
 
+    /* update scoreboard of selectively acknowledged data */
+    if (UNLIKELY(opts->sack != NULL || fs->tx_sack_num != 0)) {
+      flow_rx_sack(fs, opts->sack, ack);
+    }
+
     /* duplicate ack */
     if (UNLIKELY(tx_bump != 0)) {
       fs->rx_dupack_cnt = 0;
+      if (!tcp_seq_lt(ack, fs->tx_recover))
+        fs->tx_recover = ack;
     } else if (UNLIKELY(orig_payload == 0 && ++fs->rx_dupack_cnt >= 3)) {
-      /* reset to last acknowledged position */
-      flow_reset_retransmit(fs);
-      goto unlock;
+      /* with SACK one pass repairs all holes in the window, so duplicate acks
+       * for it do not restart recovery */
+      if ((fs->tcp_opts & FLEXNIC_PL_FLOWST_OPT_SACK) == 0 ||
+          !tcp_seq_lt(ack, fs->tx_recover))
+      {
+        /* reset to last acknowledged position */
+        flow_reset_retransmit(fs);
+        goto out;
+      }
     }
   }
 
@@ -468,7 +916,8 @@ int fast_flows_packet(struct dataplane_context *ctx,
   /* check if we should drop this segment */
   if (UNLIKELY(tcp_trim_rxbuf(fs, seq, payload_bytes, &trim_start, &trim_end) != 0)) {
     /* packet is completely outside of unused receive buffer */
-    goto unlock;
+    ctx->stats->drops[FLEXNIC_STATS_DROP_RXSEQ]++;
+    goto out;
   }
 
   /* trim payload to what we can actually use */
@@ -483,35 +932,22 @@ int fast_flows_packet(struct dataplane_context *ctx,
 
     /* if there is no payload abort immediately */
     if (payload_bytes == 0) {
-      goto unlock;
+      goto out;
     }
 
-    /* otherwise check if we can add it to the out of order interval */
-    if (fs->rx_ooo_len == 0) {
-      fs->rx_ooo_start = seq;
-      fs->rx_ooo_len = payload_bytes;
-      flow_rx_seq_write(fs, seq, payload_bytes, oh);
-      /*fprintf(stderr, "created OOO interval (%p start=%u len=%u)\n",
-          fs, fs->rx_ooo_start, fs->rx_ooo_len);*/
-    } else if (seq + payload_bytes == fs->rx_ooo_start) {
-      /* TODO: those two overlap checks should be more sophisticated */
-      fs->rx_ooo_start = seq;
-      fs->rx_ooo_len += payload_bytes;
-      flow_rx_seq_write(fs, seq, payload_bytes, oh);
-      /*fprintf(stderr, "extended OOO interval (%p start=%u len=%u)\n",
-          fs, fs->rx_ooo_start, fs->rx_ooo_len);*/
-    } else if (fs->rx_ooo_start + fs->rx_ooo_len == seq) {
-      /* TODO: those two overlap checks should be more sophisticated */
-      fs->rx_ooo_len += payload_bytes;
+    /* otherwise add it to the out of order intervals, overlapping data is
+     * identical so it can just be written again */
+    if (tcp_seqint_add(fs->rx_ooo, &fs->rx_ooo_num, FLEXNIC_PL_OOO_NUM, seq,
+          payload_bytes) == 0)
+    {
       flow_rx_seq_write(fs, seq, payload_bytes, oh);
-      /*fprintf(stderr, "extended OOO interval (%p start=%u len=%u)\n",
-          fs, fs->rx_ooo_start, fs->rx_ooo_len);*/
+      run->sack_seq = seq;
     } else {
-      /*fprintf(stderr, "Sad, no luck with OOO interval (%p ooo.start=%u "
-          "ooo.len=%u seq=%u bytes=%u)\n", fs, fs->rx_ooo_start,
-          fs->rx_ooo_len, seq, payload_bytes);*/
+      ctx->stats->drops[FLEXNIC_STATS_DROP_RXOOO]++;
+      /*fprintf(stderr, "Sad, no free OOO interval (%p seq=%u bytes=%u)\n",
+          fs, seq, payload_bytes);*/
     }
-    goto unlock;
+    goto out;
   }
 
 #else
@@ -522,7 +958,8 @@ int fast_flows_packet(struct dataplane_context *ctx,
         "(got %u, expect %u, avail %u, payload %u)\n", seq, fs->rx_next_seq,
         fs->rx_avail, payload_bytes);
 #endif
-    goto unlock;
+    ctx->stats->drops[FLEXNIC_STATS_DROP_RXSEQ]++;
+    goto out;
   }
 
   /* trim payload to what we can actually use */
@@ -536,14 +973,18 @@ int fast_flows_packet(struct dataplane_context *ctx,
   if (LIKELY((TCPH_FLAGS(&p->tcp) & TCP_ACK) == TCP_ACK &&
       f_beui32(opts->ts->ts_ecr) != 0))
   {
-    rtt = ts - f_beui32(opts->ts->ts_ecr);
+    /* from the NIC timestamp if there is one, so the time the segment
+     * waited for the poll is not counted */
+    rtt = network_buf_rx_time(nbh, ts) - f_beui32(opts->ts->ts_ecr);
     if (rtt < TCP_MAX_RTT) {
-      if (LIKELY(fs->rtt_est != 0)) {
-        fs->rtt_est = (fs->rtt_est * 7 + rtt) / 8;
+      if (LIKELY(st->rtt_est != 0)) {
+        st->rtt_est = (st->rtt_est * 7 + rtt) / 8;
       } else {
-        fs->rtt_est = rtt;
+        st->rtt_est = rtt;
       }
     }
+    stats_hist_add(ctx, fp_state->appctx[ctx->id][fs->db_id].appst_id,
+        FLEXNIC_STATS_HIST_RTT, rtt);
   }
 
   fs->rx_remote_avail = f_beui16(p->tcp.wnd);
@@ -553,7 +994,8 @@ int fast_flows_packet(struct dataplane_context *ctx,
       payload_bytes > 0)
   {
     fprintf(stderr, "fast_flows_packet: data after FIN dropped\n");
-    goto unlock;
+    ctx->stats->drops[FLEXNIC_STATS_DROP_RXFIN]++;
+    goto out;
   }
 
   /* if this is an object connection, we can be in one of three cases:
@@ -561,7 +1003,7 @@ int fast_flows_packet(struct dataplane_context *ctx,
    *   - the current object neither starts nor ends in this segment
    *   - the current object ends in this segment
    */
-  if (UNLIKELY((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJCONN))) {
+  if (objconn) {
     if (fs->rx_objrem == 0 && payload_bytes > 0) {
       /* a new object starts in this segment: make a steering decision */
       if (payload_bytes < sizeof(*oh) ||
@@ -587,7 +1029,14 @@ int fast_flows_packet(struct dataplane_context *ctx,
       assert(appst->ctx_num <= FLEXNIC_PL_APPST_CTX_NUM);
 
       /* make steering decision */
-      if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJNOHASH) == 0) {
+      if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJNOHASH) == 0 &&
+          appst->steer_en)
+      {
+        /* shard of the key picks the context */
+        i = rte_hash_crc(oh->dst, oh->dstlen, 0);
+        i = appst->steer_db[i >> (32 - FLEXNIC_PL_APPST_STEER_BITS)];
+        goto steered;
+      } else if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJNOHASH) == 0) {
         i = rte_hash_crc(oh->dst, oh->dstlen, 0);
         /* TODO: this division is a problem */
         i = i % appst->ctx_num;
@@ -608,6 +1057,7 @@ int fast_flows_packet(struct dataplane_context *ctx,
         i = steer_id;
       }
       i = appst->ctx_ids[i];
+steered:
       assert(i < FLEXNIC_PL_APPCTX_NUM);
       fs->db_id = i;
 
@@ -639,42 +1089,36 @@ int fast_flows_packet(struct dataplane_context *ctx,
 #ifndef SKIP_ACK
     trigger_ack = 1;
 #endif
+    /* the sender waits for an ack after a push, and DCTCP needs congestion
+     * marks echoed without delay */
+    ack_segs = 1;
+    if ((TCPH_FLAGS(&p->tcp) & TCP_PSH) == TCP_PSH ||
+        IPH_ECN(&p->ip) == IP_ECN_CE)
+      ack_now = 1;
 
 #ifdef FLEXNIC_PL_OOO_RECV
     /* if we have out of order segments, check whether buffer is continuous
-     * or superfluous */
-    if (UNLIKELY(fs->rx_ooo_len != 0)) {
-      if (tcp_trim_rxbuf(fs, fs->rx_ooo_start, fs->rx_ooo_len, &trim_start,
-            &trim_end) != 0) {
-          /*fprintf(stderr, "dropping ooo (%p ooo.start=%u ooo.len=%u seq=%u "
-              "len=%u next_seq=%u)\n", fs, fs->rx_ooo_start, fs->rx_ooo_len, seq,
-              payload_bytes, fs->rx_next_seq);*/
-        /* completely superfluous: drop out of order interval */
-        fs->rx_ooo_len = 0;
-      } else {
-        /* adjust based on overlap */
-        fs->rx_ooo_start += trim_start;
-        fs->rx_ooo_len -= trim_start + trim_end;
-        /*fprintf(stderr, "adjusting ooo (%p ooo.start=%u ooo.len=%u seq=%u "
-            "len=%u next_seq=%u)\n", fs, fs->rx_ooo_start, fs->rx_ooo_len, seq,
-            payload_bytes, fs->rx_next_seq);*/
-        if (fs->rx_ooo_len > 0 && fs->rx_ooo_start == fs->rx_next_seq) {
-          /* yay, we caught up, make continuous and drop OOO interval */
-          /*fprintf(stderr, "caught up with ooo buffer (%p start=%u len=%u)\n",
-              fs, fs->rx_ooo_start, fs->rx_ooo_len);*/
-
-          rx_bump += fs->rx_ooo_len;
-          fs->rx_avail -= fs->rx_ooo_len;
-          fs->rx_next_pos += fs->rx_ooo_len;
-          if (fs->rx_next_pos >= fs->rx_len) {
-            fs->rx_next_pos -= fs->rx_len;
-          }
-          assert(fs->rx_next_pos < fs->rx_len);
-          fs->rx_next_seq += fs->rx_ooo_len;
-
-          fs->rx_ooo_len = 0;
+     * now, intervals covered by this segment are superfluous */
+    while (UNLIKELY(fs->rx_ooo_num != 0) &&
+        !tcp_seq_lt(fs->rx_next_seq, fs->rx_ooo[0].start))
+    {
+      ooo_end = fs->rx_ooo[0].start + fs->rx_ooo[0].len;
+      if (tcp_seq_lt(fs->rx_next_seq, ooo_end)) {
+        /* yay, we caught up, make continuous */
+        ooo_bytes = ooo_end - fs->rx_next_seq;
+        rx_bump += ooo_bytes;
+        fs->rx_avail -= ooo_bytes;
+        fs->rx_next_pos += ooo_bytes;
+        if (fs->rx_next_pos >= fs->rx_len) {
+          fs->rx_next_pos -= fs->rx_len;
         }
+        assert(fs->rx_next_pos < fs->rx_len);
+        fs->rx_next_seq = ooo_end;
+        /* hole filled, let the sender know right away */
+        ack_now = 1;
       }
+
+      tcp_seqint_trim(fs->rx_ooo, &fs->rx_ooo_num, fs->rx_next_seq);
     }
 #endif
   }
@@ -682,96 +1126,63 @@ int fast_flows_packet(struct dataplane_context *ctx,
   if ((TCPH_FLAGS(&p->tcp) & TCP_FIN) == TCP_FIN &&
       !(fs->rx_base_sp & FLEXNIC_PL_FLOWST_RXFIN))
   {
-    if (fs->rx_next_seq == f_beui32(p->tcp.seqno) + orig_payload && !fs->rx_ooo_len) {
+    if (fs->rx_next_seq == f_beui32(p->tcp.seqno) + orig_payload &&
+        fs->rx_ooo_num == 0)
+    {
       fin_bump = 1;
       fs->rx_base_sp |= FLEXNIC_PL_FLOWST_RXFIN;
       /* FIN takes up sequence number space */
       fs->rx_next_seq++;
       trigger_ack = 1;
+      ack_now = 1;
     } else {
       fprintf(stderr, "fast_flows_packet: ignored fin because out of order\n");
     }
   }
 
-unlock:
-  /* if we bumped at least one, then we need to add a notification to the
-   * queue */
-  if (LIKELY(rx_bump != 0 || tx_bump != 0 || fin_bump)) {
-#if PL_DEBUG_ARX
-    fprintf(stderr, "dma_krx_pkt_fastpath: updating application state\n");
-#endif
-
-#ifdef FLEXNIC_TRACING
-    struct flextcp_pl_trev_arx te_arx = {
-        .rx_bump = rx_bump,
-        .tx_bump = tx_bump,
+out:
+  /* only acks for in-order payload may be delayed, not those for duplicate,
+   * out of order or dropped segments */
+  if (trigger_ack && ack_segs == 0)
+    ack_now = 1;
+
+  run->rx_bump += rx_bump;
+  run->tx_bump += tx_bump;
+  run->trigger_ack |= trigger_ack;
+  run->ack_now |= ack_now;
+  run->ack_segs += ack_segs;
+  run->fin_bump |= fin_bump;
+  return 0;
 
-        .db_id = fs->db_id,
+slowpath:
+  if (!no_permanent_sp) {
+    fs->rx_base_sp |= FLEXNIC_PL_FLOWST_SLOWPATH;
+  }
 
-        .local_ip = f_beui32(p->ip.dest),
-        .remote_ip = f_beui32(p->ip.src),
-        .local_port = f_beui16(p->tcp.dest),
-        .remote_port = f_beui16(p->tcp.src),
-      };
-    trace_event(FLEXNIC_PL_TREV_ARX, sizeof(te_arx), &te_arx);
-#endif
+  return -1;
+}
 
-    uint16_t type;
-    if (!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJCONN)) {
-      type = FLEXTCP_PL_ARX_CONNUPDATE;
-    } else {
-      type = FLEXTCP_PL_ARX_OBJUPDATE;
-    }
+#define FLOW_VARIANT_GEN(name, objconn) \
+  static void flow_packet_##name(struct dataplane_context *ctx, \
+      struct network_buf_handle **nbhs, struct flextcp_pl_flowst *fs, \
+      struct tcp_opts *opts, uint16_t n, uint32_t ts, int *rets) \
+  { \
+    flow_packet(ctx, nbhs, fs, opts, n, ts, rets, objconn); \
+  } \
+  static int flow_qman_##name(struct dataplane_context *ctx, \
+      struct flextcp_pl_flowst *fs, struct network_buf_handle *nbh, \
+      uint32_t ts) \
+  { \
+    return flow_qman(ctx, fs, nbh, ts, objconn); \
+  }
 
-    if (fin_bump) {
-      type |= FLEXTCP_PL_ARX_FLRXDONE << 8;
-    }
+FLOW_VARIANT_GEN(stream, 0)
+FLOW_VARIANT_GEN(obj, 1)
 
-    arx_cache_add(ctx, fs->db_id, fs->opaque, rx_bump, rx_pos, tx_bump, type);
-  }
-
-  /* Flow control: More receiver space? -> might need to start sending */
-  new_avail = tcp_txavail(fs, NULL);
-  if (new_avail > old_avail) {
-    if (!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_OBJCONN)) {
-      /* update qman queue */
-      if (qman_set(&ctx->qman, flow_id, fs->tx_rate, new_avail -
-            old_avail, TCP_MSS, QMAN_SET_RATE | QMAN_SET_MAXCHUNK
-            | QMAN_ADD_AVAIL) != 0)
-      {
-        fprintf(stderr, "fast_flows_packet: qman_set 1 failed, UNEXPECTED\n");
-        abort();
-      }
-    } else if (old_avail == 0) {
-      /* for object connections we only need to re-arm the qman queue if flow
-       * control previously capped it to zero. */
-      if (qman_set(&ctx->qman, flow_id, 0, 1, 1,
-            QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_ADD_AVAIL) != 0)
-      {
-        fprintf(stderr, "flast_flows_packet: qman_set 1 failed, UNEXPECTED\n");
-        abort();
-      }
-    }
-  }
-
-  /* if we need to send an ack, also send packet to TX pipeline to do so */
-  if (trigger_ack) {
-    flow_tx_ack(ctx, fs->tx_next_seq, fs->rx_next_seq, fs->rx_avail,
-        fs->tx_next_ts, ts, nbh, opts->ts);
-  }
-
-  fs_unlock(fs);
-  return trigger_ack;
-
-slowpath:
-  if (!no_permanent_sp) {
-    fs->rx_base_sp |= FLEXNIC_PL_FLOWST_SLOWPATH;
-  }
-
-  fs_unlock(fs);
-  /* TODO: should pass current flow state to kernel as well */
-  return -1;
-}
+static const struct flow_variant_ops flow_variants[FLOW_VARIANT_NUM] = {
+  [FLOW_VARIANT_STREAM] = { flow_packet_stream, flow_qman_stream },
+  [FLOW_VARIANT_OBJ] = { flow_packet_obj, flow_qman_obj },
+};
 
 /* Update receive and transmit queue pointers from application */
 int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
@@ -779,10 +1190,27 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
     struct network_buf_handle *nbh, uint32_t ts)
 {
   struct flextcp_pl_flowst *fs = &fp_state->flowst[flow_id];
+  struct flow_fwd_bump *fb;
   uint32_t tail, rx_avail_prev, old_avail, new_avail;
+  uint16_t new_core;
   int ret = -1;
 
-  fs_lock(fs);
+  /* flow owned by another core, hand the bump over in the buffer */
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    fb = network_buf_buf(nbh);
+    fb->flow_id = flow_id;
+    fb->rx_tail = rx_tail;
+    fb->tx_head = tx_head;
+    fb->bump_seq = bump_seq;
+    fb->flags = flags;
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_BUMP, nbh, ts) != 0) {
+      fprintf(stderr, "fast_flows_bump: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 0;
+  }
+
 #ifdef FLEXNIC_TRACING
   struct flextcp_pl_trev_atx te_atx = {
       .rx_tail = rx_tail,
@@ -810,6 +1238,8 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
     };
   trace_event(FLEXNIC_PL_TREV_ATX, sizeof(te_atx), &te_atx);
 #endif
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_BUMP, flow_id, rx_tail, tx_head,
+      bump_seq | (flags << 16), 0);
 
   /* catch out of order bumps */
   if ((bump_seq >= fs->bump_seq &&
@@ -818,7 +1248,7 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
        (fs->bump_seq < ((UINT16_MAX / 4) * 3) ||
        bump_seq > (UINT16_MAX / 4))))
   {
-    goto unlock;
+    goto out;
   }
   fs->bump_seq = bump_seq;
 
@@ -834,13 +1264,18 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
   {
     /* Closing TX requires at least one byte (dummy) */
     fprintf(stderr, "fast_flows_bump: tx eos without dummy byte\n");
-    goto unlock;
+    goto out;
   }
 
   /* calculate how many bytes can be sent before and after this bump */
   old_avail = tcp_txavail(fs, NULL);
   new_avail = tcp_txavail(fs, &tx_head);
 
+  /* latency to the first segment is measured from bumps on idle flows */
+  if (old_avail == 0 && new_avail != 0 && dataplane_bump_tsc[flow_id] == 0) {
+    dataplane_bump_tsc[flow_id] = (uint32_t) rte_get_tsc_cycles() | 1;
+  }
+
   /* mark connection as closed if requested */
   if ((flags & FLEXTCP_PL_ATX_FLTXDONE) == FLEXTCP_PL_ATX_FLTXDONE &&
       !(fs->rx_base_sp & FLEXNIC_PL_FLOWST_TXFIN))
@@ -854,7 +1289,7 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
     if (old_avail < new_avail) {
       /* update qman queue */
       if (qman_set(&ctx->qman, flow_id, fs->tx_rate, new_avail -
-            old_avail, TCP_MSS, QMAN_SET_RATE | QMAN_SET_MAXCHUNK
+            old_avail, tcp_seg_max(), QMAN_SET_RATE | QMAN_SET_MAXCHUNK
             | QMAN_ADD_AVAIL) != 0)
       {
         fprintf(stderr, "flast_flows_bump: qman_set 1 failed, UNEXPECTED\n");
@@ -896,18 +1331,36 @@ int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
     ret = 0;
   }
 
-unlock:
-  fs_unlock(fs);
+out:
   return ret;
 }
 
+/* Apply bump forwarded from another core */
+int fast_flows_bump_fwd(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, uint32_t ts)
+{
+  struct flow_fwd_bump fb = *(struct flow_fwd_bump *) network_buf_buf(nbh);
+
+  return fast_flows_bump(ctx, fb.flow_id, fb.bump_seq, fb.rx_tail, fb.tx_head,
+      fb.flags, nbh, ts);
+}
+
 /* start retransmitting */
-void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id)
+void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id,
+    uint32_t ts)
 {
   struct flextcp_pl_flowst *fs = &fp_state->flowst[flow_id];
   uint32_t old_avail, new_avail = -1;
+  uint16_t new_core;
 
-  fs_lock(fs);
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_RETRANSMIT, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_retransmit: fast_flows_fwd failed\n");
+      abort();
+    }
+    return;
+  }
 
   /*    uint32_t old_head = fs->tx_head;
       uint32_t old_sent = fs->tx_sent;
@@ -928,6 +1381,9 @@ void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id)
 
 
   flow_reset_retransmit(fs);
+  /* after a timeout the receiver may have dropped what it selectively
+   * acknowledged, so everything is sent again (RFC 2018) */
+  fs->tx_sack_num = 0;
   new_avail = tcp_txavail(fs, NULL);
 
   /*    fprintf(stderr, "fast_flows_retransmit: "
@@ -939,7 +1395,7 @@ void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id)
   /* update queue manager */
   if (new_avail > old_avail) {
     if (qman_set(&ctx->qman, flow_id, fs->tx_rate, new_avail - old_avail,
-          TCP_MSS, QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_ADD_AVAIL) != 0)
+          tcp_seg_max(), QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_ADD_AVAIL) != 0)
     {
       fprintf(stderr, "flast_flows_bump: qman_set 1 failed, UNEXPECTED\n");
       abort();
@@ -947,10 +1403,274 @@ void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id)
   }
 
 out:
-  fs_unlock(fs);
   return;
 }
 
+/* retransmission timer expired, go back to the last acknowledged position */
+void fast_flows_rto(struct dataplane_context *ctx, uint32_t flow_id,
+    uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[flow_id];
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
+  uint16_t new_core;
+
+  /* flow group moved since the timer was armed, acks now arrive on the new
+   * owner, so it has to run its own timer */
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_RTO, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_rto: fast_flows_fwd failed\n");
+      abort();
+    }
+    return;
+  }
+
+  if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_SLOWPATH) != 0 || fs->tx_sent == 0)
+    return;
+
+  /* slow path picks this up for accounting and congestion control */
+  st->cnt_tx_rtos++;
+  if (st->rto_backoff < TCP_RTO_BACKOFF_MAX)
+    st->rto_backoff++;
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_RTO, flow_id, fs->tx_next_seq, fs->tx_sent,
+      st->rto_backoff, 0);
+
+  /* the timer is started again with the backoff once segments go out */
+  fast_flows_retransmit(ctx, flow_id, ts);
+}
+
+/* timer forwarded from the previous owner of the flow */
+void fast_flows_rto_fwd(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts)
+{
+  uint16_t new_core;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_RTO, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_rto_fwd: fast_flows_fwd failed\n");
+      abort();
+    }
+    return;
+  }
+
+  if ((fs->rx_base_sp & FLEXNIC_PL_FLOWST_SLOWPATH) == 0 && fs->tx_sent != 0)
+    flow_rto_arm(ctx, fs, ts, 0);
+}
+
+/* Delayed ack is due, returns 0 if the buffer was used */
+int fast_flows_delack(struct dataplane_context *ctx, uint32_t flow_id,
+    struct network_buf_handle *nbh, uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[flow_id];
+  uint16_t new_core;
+
+  /* flow group moved since the ack was delayed, the new owner sends it */
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_DELACK, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_delack: fast_flows_fwd failed\n");
+      abort();
+    }
+    return -1;
+  }
+
+  /* already acknowledged by a later ack or a data segment */
+  if (fs->rx_ack_pending == 0 ||
+      (fs->rx_base_sp & FLEXNIC_PL_FLOWST_SLOWPATH) != 0)
+    return -1;
+
+  flow_tx_segment(ctx, nbh, fs, fs->tx_next_seq, fs->rx_next_seq,
+      fs->rx_avail, 0, 0, fs->tx_next_ts, ts, 0);
+  return 0;
+}
+
+/* delayed ack forwarded from the previous owner of the flow */
+void fast_flows_delack_fwd(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts)
+{
+  uint16_t new_core;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_DELACK, fs, ts) != 0) {
+      fprintf(stderr, "fast_flows_delack_fwd: fast_flows_fwd failed\n");
+      abort();
+    }
+    return;
+  }
+
+  if (fs->rx_ack_pending == 0)
+    return;
+
+  /* already due, if the queue is full have the next segment acked right
+   * away instead */
+  if (flow_ack_queue(ctx, fs - fp_state->flowst, ts) != 0)
+    fs->rx_ack_pending = UINT8_MAX;
+}
+
+/* disable connection and report final sequence numbers back to kernel */
+int fast_flows_disable(struct dataplane_context *ctx,
+    struct flextcp_pl_ktx *ktx, uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs =
+    &fp_state->flowst[ktx->msg.conndisable.flow_id];
+  uint16_t new_core;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_DISABLE, ktx, ts) != 0) {
+      fprintf(stderr, "fast_flows_disable: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 1;
+  }
+
+  if (config.fp_rto_min != 0)
+    qman_rto_clear(&ctx->qman, ktx->msg.conndisable.flow_id);
+  dataplane_bump_tsc[ktx->msg.conndisable.flow_id] = 0;
+
+  /* slow path removes the flow from the lookup table once it sees this */
+  ktx->msg.conndisable.tx_seq = fs->tx_next_seq;
+  ktx->msg.conndisable.rx_seq = fs->rx_next_seq;
+  ktx->msg.conndisable.rx_ts = fs->tx_next_ts;
+  ktx->msg.conndisable.tx_closed =
+    !!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_TXFIN) && fs->tx_sent == 0;
+  ktx->msg.conndisable.rx_closed = !!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_RXFIN);
+  fs->rx_base_sp |= FLEXNIC_PL_FLOWST_SLOWPATH;
+  return 0;
+}
+
+/* replace receive buffer if all data in it was consumed by the app, or pass
+ * a transmit buffer offer on to the app */
+int fast_flows_resize(struct dataplane_context *ctx,
+    struct flextcp_pl_ktx *ktx, uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs =
+    &fp_state->flowst[ktx->msg.connresize.flow_id];
+  struct flextcp_pl_flowst_stats *st;
+  uint16_t new_core;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_RESIZE, ktx, ts) != 0) {
+      fprintf(stderr, "fast_flows_resize: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 1;
+  }
+
+  /* the app switches transmit buffers itself, it knows when it is done with
+   * the old one */
+  if (ktx->msg.connresize.tx_len != 0) {
+    st = flow_stats(fs);
+    st->tx_offer_base = ktx->msg.connresize.tx_base;
+    st->tx_offer_len = ktx->msg.connresize.tx_len;
+    arx_cache_add_txoffer(ctx, fs->db_id, fs->opaque,
+        ktx->msg.connresize.tx_base, ktx->msg.connresize.tx_len);
+    ktx->msg.connresize.status = 0;
+    return 0;
+  }
+
+  /* nothing may reference the old buffer anymore: no undelivered or
+   * unreleased data and no out of order segments */
+  if (fs->rx_avail != fs->rx_len || fs->rx_ooo_num != 0 ||
+      (fs->rx_base_sp & (FLEXNIC_PL_FLOWST_SLOWPATH |
+          FLEXNIC_PL_FLOWST_OBJCONN | FLEXNIC_PL_FLOWST_RXFIN)) != 0)
+  {
+    ktx->msg.connresize.status = 1;
+    return 0;
+  }
+
+  fs->rx_base_sp = ktx->msg.connresize.rx_base |
+    (fs->rx_base_sp & ~FLEXNIC_PL_FLOWST_RX_MASK);
+  fs->rx_len = ktx->msg.connresize.rx_len;
+  fs->rx_avail = fs->rx_len;
+  fs->rx_next_pos = 0;
+
+  arx_cache_add_resize(ctx, fs->db_id, fs->opaque, ktx->msg.connresize.rx_base,
+      fs->rx_len);
+  ktx->msg.connresize.status = 0;
+  return 0;
+}
+
+/* switch to the transmit buffer the app was offered, only if everything sent
+ * so far is acknowledged, so nothing references the old buffer anymore. The
+ * app does not add data in the meantime and waits for the answer. */
+int fast_flows_txresize(struct dataplane_context *ctx,
+    struct flextcp_pl_atx *atx, uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs =
+    &fp_state->flowst[atx->msg.txresize.flow_id];
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
+  uint16_t new_core;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_TXRESIZE, atx, ts) != 0) {
+      fprintf(stderr, "fast_flows_txresize: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 1;
+  }
+
+  if (st->tx_offer_len == 0 || fs->tx_sent != 0 ||
+      fs->tx_head != fs->tx_next_pos ||
+      (fs->rx_base_sp & (FLEXNIC_PL_FLOWST_SLOWPATH |
+          FLEXNIC_PL_FLOWST_OBJCONN | FLEXNIC_PL_FLOWST_TXFIN)) != 0)
+  {
+    arx_cache_add_txresized(ctx, fs->db_id, fs->opaque, -1);
+    return 0;
+  }
+
+  fs->tx_base = st->tx_offer_base;
+  fs->tx_len = st->tx_offer_len;
+  fs->tx_next_pos = 0;
+  fs->tx_head = 0;
+  fs->tx_sack_num = 0;
+  st->tx_offer_base = 0;
+  st->tx_offer_len = 0;
+
+  arx_cache_add_txresized(ctx, fs->db_id, fs->opaque, 0);
+  return 0;
+}
+
+/* point flow at another context of the same application, the old context gets
+ * a final moved entry after everything delivered to it so far. The slow path
+ * is told too, so its connection follows the flow, the move is rejected if
+ * that can't be queued. */
+int fast_flows_move(struct dataplane_context *ctx,
+    struct flextcp_pl_atx *atx, uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[atx->msg.connmove.flow_id];
+  struct flextcp_pl_appctx *old_actx, *new_actx;
+  uint16_t new_core, db = atx->msg.connmove.db_id;
+
+  new_core = fast_flows_owner(fs);
+  if (new_core != ctx->id) {
+    if (fast_flows_fwd(ctx, new_core, FLOW_FWD_MOVE, atx, ts) != 0) {
+      fprintf(stderr, "fast_flows_move: fast_flows_fwd failed\n");
+      abort();
+    }
+    return 1;
+  }
+
+  old_actx = &fp_state->appctx[ctx->id][fs->db_id];
+  new_actx = &fp_state->appctx[ctx->id][db];
+  if (db >= fp_state->appctx_num || new_actx->rx_len == 0 ||
+      new_actx->appst_id != old_actx->appst_id ||
+      (fs->rx_base_sp & FLEXNIC_PL_FLOWST_SLOWPATH) != 0 ||
+      fast_kernel_connmoved(ctx, atx->msg.connmove.flow_id, db) != 0)
+  {
+    arx_cache_add_moved(ctx, fs->db_id, fs->opaque, -1);
+    return 0;
+  }
+
+  arx_cache_add_moved(ctx, fs->db_id, fs->opaque, 0);
+  fs->db_id = db;
+  return 0;
+}
+
 /* read `len` bytes from position `pos` in cirucular transmit buffer */
 static void flow_tx_read(struct flextcp_pl_flowst *fs, uint32_t pos,
     uint16_t len, void *dst)
@@ -966,6 +1686,31 @@ static void flow_tx_read(struct flextcp_pl_flowst *fs, uint32_t pos,
   }
 }
 
+/* attach `len` bytes from position `pos` in circular transmit buffer to
+ * packet without copying */
+static int flow_tx_zc(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, struct flextcp_pl_flowst *fs, uint32_t pos,
+    uint16_t len)
+{
+  uintptr_t addrs[2];
+  uint16_t lens[2];
+  unsigned num;
+
+  if (LIKELY(pos + len <= fs->tx_len)) {
+    addrs[0] = fs->tx_base + pos;
+    lens[0] = len;
+    num = 1;
+  } else {
+    addrs[0] = fs->tx_base + pos;
+    lens[0] = fs->tx_len - pos;
+    addrs[1] = fs->tx_base;
+    lens[1] = len - lens[0];
+    num = 2;
+  }
+
+  return network_buf_zc_attach(&ctx->net, nbh, num, addrs, lens);
+}
+
 /* write `len` bytes to position `pos` in cirucular receive buffer */
 static void flow_rx_write(struct flextcp_pl_flowst *fs, uint32_t pos,
     uint16_t len, const void *src)
@@ -973,6 +1718,21 @@ static void flow_rx_write(struct flextcp_pl_flowst *fs, uint32_t pos,
   uint32_t part;
   uint64_t rx_base = fs->rx_base_sp & FLEXNIC_PL_FLOWST_RX_MASK;
 
+  /* large payloads are streamed past the cache, the app will usually not
+   * touch them before they would have been evicted anyways */
+  if (config.fp_rx_nt_threshold != 0 && len >= config.fp_rx_nt_threshold) {
+    if (LIKELY(pos + len <= fs->rx_len)) {
+      dma_write_nt(rx_base + pos, len, src);
+    } else {
+      part = fs->rx_len - pos;
+      dma_write_nt(rx_base + pos, part, src);
+      dma_write_nt(rx_base, len - part, (const uint8_t *) src + part);
+    }
+    /* make sure payload is visible before the arx entry is */
+    dma_write_nt_fence();
+    return;
+  }
+
   if (LIKELY(pos + len <= fs->rx_len)) {
     dma_write(rx_base + pos, len, src);
   } else {
@@ -1000,9 +1760,18 @@ static void flow_tx_segment(struct dataplane_context *ctx,
     uint32_t seq, uint32_t ack, uint32_t rxwnd, uint16_t payload,
     uint32_t payload_pos, uint32_t ts_echo, uint32_t ts_my, uint8_t fin)
 {
-  uint16_t hdrs_len, optlen, fin_fl;
+  uint16_t hdrs_len, optlen, fin_fl, psh_fl;
   struct pkt_tcp *p = network_buf_buf(nbh);
   struct tcp_timestamp_opt *opt_ts;
+  int zc = 0;
+
+  flow_group_count(ctx, fs, payload);
+  if (payload > 0)
+    flow_cc_active(ctx, fs, ts_my);
+
+  /* segment acknowledges everything received so far */
+  if (UNLIKELY(fs->rx_ack_pending != 0))
+    fs->rx_ack_pending = 0;
 
   /* calculate header length depending on options */
   optlen = (sizeof(*opt_ts) + 3) & ~3;
@@ -1010,7 +1779,7 @@ static void flow_tx_segment(struct dataplane_context *ctx,
 
   /* fill headers */
   p->eth.dest = fs->remote_mac;
-  memcpy(&p->eth.src, &eth_addr, ETH_ADDR_LEN);
+  memcpy(&p->eth.src, &net_port_macs[fs->port], ETH_ADDR_LEN);
   p->eth.type = t_beui16(ETH_TYPE_IP);
 
   IPH_VHL_SET(&p->ip, 4, 5);
@@ -1030,12 +1799,15 @@ static void flow_tx_segment(struct dataplane_context *ctx,
   }
 
   fin_fl = (fin ? TCP_FIN : 0);
+  /* push only once everything ready to be sent is out, receivers delaying
+   * acks send them right away for these */
+  psh_fl = (payload > 0 && fs->tx_next_pos == fs->tx_head ? TCP_PSH : 0);
 
   p->tcp.src = fs->local_port;
   p->tcp.dest = fs->remote_port;
   p->tcp.seqno = t_beui32(seq);
   p->tcp.ackno = t_beui32(ack);
-  TCPH_HDRLEN_FLAGS_SET(&p->tcp, 5 + optlen / 4, TCP_PSH | TCP_ACK | fin_fl);
+  TCPH_HDRLEN_FLAGS_SET(&p->tcp, 5 + optlen / 4, psh_fl | TCP_ACK | fin_fl);
   p->tcp.wnd = t_beui16(MIN(0xFFFF, rxwnd));
   p->tcp.chksum = 0;
   p->tcp.urgp = t_beui16(0);
@@ -1048,14 +1820,27 @@ static void flow_tx_segment(struct dataplane_context *ctx,
   opt_ts->ts_val = t_beui32(ts_my);
   opt_ts->ts_ecr = t_beui32(ts_echo);
 
-  /* add payload if requested */
+  /* add payload if requested, with zero-copy we just reference it in the tx
+   * buffer */
   if (payload > 0) {
-    flow_tx_read(fs, payload_pos, payload, (uint8_t *) p + hdrs_len);
+#ifdef HWXSUM_EN
+    if (net_tx_zerocopy)
+      zc = (flow_tx_zc(ctx, nbh, fs, payload_pos, payload) == 0);
+#endif
+    if (!zc)
+      flow_tx_read(fs, payload_pos, payload, (uint8_t *) p + hdrs_len);
   }
 
-  /* checksums */
-  tcp_checksums(nbh, p, fs->local_ip, fs->remote_ip, hdrs_len - offsetof(struct
-        pkt_tcp, tcp) + payload);
+  /* checksums, let the NIC cut segments larger than the MSS */
+  if (payload > TCP_MSS) {
+    p->ip.chksum = 0;
+    p->tcp.chksum = network_buf_tso(nbh, sizeof(p->eth), sizeof(p->ip),
+        hdrs_len - offsetof(struct pkt_tcp, tcp), TCP_MSS, fs->local_ip,
+        fs->remote_ip, IP_PROTO_TCP);
+  } else {
+    tcp_checksums(nbh, p, fs->local_ip, fs->remote_ip, hdrs_len -
+        offsetof(struct pkt_tcp, tcp) + payload);
+  }
 
 #ifdef FLEXNIC_TRACING
   struct flextcp_pl_trev_txseg te_txseg = {
@@ -1071,13 +1856,76 @@ static void flow_tx_segment(struct dataplane_context *ctx,
     };
   trace_event(FLEXNIC_PL_TREV_TXSEG, sizeof(te_txseg), &te_txseg);
 #endif
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_TXSEG, fs - fp_state->flowst, seq, ack,
+      payload | (TCPH_FLAGS(&p->tcp) << 16), rxwnd);
 
-  tx_send(ctx, nbh, 0, hdrs_len + payload);
+  network_buf_setport(nbh, fs->port);
+  if (!zc) {
+    tx_send(ctx, nbh, 0, hdrs_len + payload);
+  } else {
+    if (tx_send(ctx, nbh, 0, hdrs_len) == 0)
+      network_buf_setpktlen(nbh, hdrs_len + payload);
+  }
 }
 
+#ifdef FLEXNIC_PL_OOO_RECV
+/** SACK blocks that fit into the option space next to the timestamp */
+#define TCP_SACK_TX_BLOCKS 3
+
+/* write timestamp and SACK options for the out of order intervals, the one
+ * with the most recently received segment goes first. Returns options length. */
+static uint16_t flow_tx_ack_sack(struct pkt_tcp *p,
+    const struct flextcp_pl_flowst *fs, uint32_t sack_seq, uint32_t echots,
+    uint32_t myts)
+{
+  uint8_t *opt = (uint8_t *) (p + 1);
+  struct tcp_timestamp_opt *opt_ts;
+  struct tcp_sack_opt *opt_sack;
+  const struct flextcp_pl_seqint *si;
+  unsigned i, n, first = 0;
+
+  opt[0] = opt[1] = TCP_OPT_NO_OP;
+  opt_ts = (struct tcp_timestamp_opt *) (opt + 2);
+  opt_ts->kind = TCP_OPT_TIMESTAMP;
+  opt_ts->length = sizeof(*opt_ts);
+  opt_ts->ts_val = t_beui32(myts);
+  opt_ts->ts_ecr = t_beui32(echots);
+
+  opt[12] = opt[13] = TCP_OPT_NO_OP;
+  opt_sack = (struct tcp_sack_opt *) (opt + 14);
+  opt_sack->kind = TCP_OPT_SACK;
+
+  for (i = 0; i < fs->rx_ooo_num; i++) {
+    si = &fs->rx_ooo[i];
+    if (!tcp_seq_lt(sack_seq, si->start) &&
+        tcp_seq_lt(sack_seq, si->start + si->len))
+    {
+      first = i;
+      break;
+    }
+  }
+
+  si = &fs->rx_ooo[first];
+  opt_sack->blocks[0].start = t_beui32(si->start);
+  opt_sack->blocks[0].end = t_beui32(si->start + si->len);
+  for (i = 0, n = 1; i < fs->rx_ooo_num && n < TCP_SACK_TX_BLOCKS; i++) {
+    if (i == first)
+      continue;
+    si = &fs->rx_ooo[i];
+    opt_sack->blocks[n].start = t_beui32(si->start);
+    opt_sack->blocks[n].end = t_beui32(si->start + si->len);
+    n++;
+  }
+  opt_sack->length = 2 + n * sizeof(opt_sack->blocks[0]);
+
+  return 14 + opt_sack->length;
+}
+#endif
+
 static void flow_tx_ack(struct dataplane_context *ctx, uint32_t seq,
     uint32_t ack, uint32_t rxwnd, uint32_t echots, uint32_t myts,
-    struct network_buf_handle *nbh, struct tcp_timestamp_opt *ts_opt)
+    struct network_buf_handle *nbh, struct tcp_timestamp_opt *ts_opt,
+    const struct flextcp_pl_flowst *fs, uint32_t sack_seq)
 {
   struct pkt_tcp *p;
   struct eth_addr eth;
@@ -1115,17 +1963,27 @@ static void flow_tx_ack(struct dataplane_context *ctx, uint32_t seq,
   /* mark ACKs as ECN in-capable */
   IPH_ECN_SET(&p->ip, IP_ECN_NONE);
 
+  /* fill in timestamp option, in place unless we report SACK blocks */
+#ifdef FLEXNIC_PL_OOO_RECV
+  if (UNLIKELY(fs->rx_ooo_num != 0) &&
+      (fs->tcp_opts & FLEXNIC_PL_FLOWST_OPT_SACK) != 0)
+  {
+    hdrlen = sizeof(*p) + flow_tx_ack_sack(p, fs, sack_seq, echots, myts);
+  } else
+#endif
+  {
+    ts_opt->ts_val = t_beui32(myts);
+    ts_opt->ts_ecr = t_beui32(echots);
+  }
+
   /* change TCP header to ACK */
   p->tcp.seqno = t_beui32(seq);
   p->tcp.ackno = t_beui32(ack);
-  TCPH_HDRLEN_FLAGS_SET(&p->tcp, TCPH_HDRLEN(&p->tcp), TCP_ACK | ecn_flags);
+  TCPH_HDRLEN_FLAGS_SET(&p->tcp, (hdrlen - sizeof(*p)) / 4 + 5,
+      TCP_ACK | ecn_flags);
   p->tcp.wnd = t_beui16(MIN(0xFFFF, rxwnd));
   p->tcp.urgp = t_beui16(0);
 
-  /* fill in timestamp option */
-  ts_opt->ts_val = t_beui32(myts);
-  ts_opt->ts_ecr = t_beui32(echots);
-
   p->ip.len = t_beui16(hdrlen - offsetof(struct pkt_tcp, ip));
   p->ip.ttl = 0xff;
 
@@ -1146,15 +2004,23 @@ static void flow_tx_ack(struct dataplane_context *ctx, uint32_t seq,
     };
   trace_event(FLEXNIC_PL_TREV_TXACK, sizeof(te_txack), &te_txack);
 #endif
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_TXACK, fs - fp_state->flowst, seq, ack,
+      rxwnd, sack_seq);
 
   tx_send(ctx, nbh, network_buf_off(nbh), hdrlen);
 }
 
 static void flow_reset_retransmit(struct flextcp_pl_flowst *fs)
 {
+  struct flextcp_pl_flowst_stats *st = flow_stats(fs);
   uint32_t x;
 
-  /* reset flow state as if we never transmitted those segments */
+  /* recovery ends once everything sent so far is acknowledged */
+  if (tcp_seq_lt(fs->tx_recover, fs->tx_next_seq))
+    fs->tx_recover = fs->tx_next_seq;
+
+  /* reset flow state as if we never transmitted those segments, except for
+   * selectively acknowledged ones which fast_flows_qman skips */
   fs->rx_dupack_cnt = 0;
 
   fs->tx_next_seq -= fs->tx_sent;
@@ -1167,11 +2033,74 @@ static void flow_reset_retransmit(struct flextcp_pl_flowst *fs)
   fs->tx_sent = 0;
 
   /* cut rate by half if first drop in control interval */
-  if (fs->cnt_tx_drops == 0) {
+  if (st->cnt_tx_drops == 0) {
     fs->tx_rate /= 2;
   }
 
-  fs->cnt_tx_drops++;
+  st->cnt_tx_drops++;
+}
+
+/* merge SACK blocks into the scoreboard and drop acknowledged entries */
+static void flow_rx_sack(struct flextcp_pl_flowst *fs,
+    const struct tcp_sack_opt *opt, uint32_t ack)
+{
+  uint32_t start, end;
+  unsigned i, n;
+
+  if (opt != NULL && (fs->tcp_opts & FLEXNIC_PL_FLOWST_OPT_SACK) != 0) {
+    n = (opt->length - 2) / sizeof(opt->blocks[0]);
+    for (i = 0; i < n; i++) {
+      start = f_beui32(opt->blocks[i].start);
+      end = f_beui32(opt->blocks[i].end);
+
+      /* ignore blocks below the cumulative ack (D-SACK) or beyond what could
+       * have been sent */
+      if (!tcp_seq_lt(ack, start) || !tcp_seq_lt(start, end) ||
+          end - ack > fs->tx_len)
+      {
+        continue;
+      }
+
+      /* if the scoreboard is full we'll just retransmit a bit more */
+      tcp_seqint_add(fs->tx_sack, &fs->tx_sack_num, FLEXNIC_PL_SACK_NUM, start,
+          end - start);
+    }
+  }
+
+  tcp_seqint_trim(fs->tx_sack, &fs->tx_sack_num, ack);
+}
+
+/* advance over selectively acknowledged data at the next transmit position,
+ * returns bytes that can be sent before the next such interval */
+static uint32_t flow_tx_sack_skip(struct flextcp_pl_flowst *fs,
+    uint32_t *avail)
+{
+  struct flextcp_pl_seqint *si;
+  uint32_t skip;
+  unsigned i;
+
+  for (i = 0; i < fs->tx_sack_num; i++) {
+    si = &fs->tx_sack[i];
+
+    /* hole before this interval */
+    if (tcp_seq_lt(fs->tx_next_seq, si->start))
+      return si->start - fs->tx_next_seq;
+
+    /* interval already passed */
+    if (!tcp_seq_lt(fs->tx_next_seq, si->start + si->len))
+      continue;
+
+    /* receiver has this, account it as sent without sending it again */
+    skip = MIN(si->start + si->len - fs->tx_next_seq, *avail);
+    fs->tx_next_seq += skip;
+    fs->tx_next_pos += skip;
+    if (fs->tx_next_pos >= fs->tx_len)
+      fs->tx_next_pos -= fs->tx_len;
+    fs->tx_sent += skip;
+    *avail -= skip;
+  }
+
+  return UINT32_MAX;
 }
 
 static inline void tcp_checksums(struct network_buf_handle *nbh,
@@ -1193,83 +2122,195 @@ static inline uint32_t flow_hash(struct flow_key *k)
       crc32c_sse42_u64(k->local_ip.x | (((uint64_t) k->remote_ip.x) << 32), 0));
 }
 
+/* hash of the flow a received packet belongs to */
+static inline uint32_t flow_hash_rx(const struct pkt_tcp *p)
+{
+  struct flow_key key;
+
+  key.local_ip = p->ip.dest;
+  key.remote_ip = p->ip.src;
+  key.local_port = p->tcp.dest;
+  key.remote_port = p->tcp.src;
+  return flow_hash(&key);
+}
+
+/* bitmask of entries in bucket with hash `h` */
+static inline uint32_t flowht_match(const struct flextcp_pl_flowhtb *htb,
+    uint32_t h)
+{
+#ifdef __AVX2__
+  __m256i hs = _mm256_load_si256((const __m256i *) htb->flow_hash);
+  return _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpeq_epi32(hs, _mm256_set1_epi32(h))));
+#else
+  uint32_t j, m = 0;
+  for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
+    m |= (uint32_t) (htb->flow_hash[j] == h) << j;
+  }
+  return m;
+#endif
+}
+
+/* prefetch flow states for matching entries in bucket */
+static inline void flowht_prefetch(const struct flextcp_pl_flowhtb *htb,
+    uint32_t h)
+{
+  uint32_t m, j, ffid;
+
+  m = flowht_match(htb, h);
+  while (m != 0) {
+    j = __builtin_ctz(m);
+    m &= m - 1;
+
+    MEM_BARRIER();
+    ffid = htb->flow_id[j];
+    if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) != 0) {
+      rte_prefetch0(&fp_state->flowst[ffid & FLEXNIC_PL_FLOWHTE_IDMASK]);
+    }
+  }
+}
+
+/* find flow for packet in bucket by checking 5-tuple in flow state */
+static inline struct flextcp_pl_flowst *flowht_lookup(
+    const struct flextcp_pl_flowhtb *htb, uint32_t h, const struct pkt_tcp *p)
+{
+  uint32_t m, j, ffid;
+  struct flextcp_pl_flowst *fs;
+
+  m = flowht_match(htb, h);
+  while (m != 0) {
+    j = __builtin_ctz(m);
+    m &= m - 1;
+
+    MEM_BARRIER();
+    ffid = htb->flow_id[j];
+    if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0) {
+      continue;
+    }
+
+    MEM_BARRIER();
+    fs = &fp_state->flowst[ffid & FLEXNIC_PL_FLOWHTE_IDMASK];
+    if ((fs->local_ip.x == p->ip.dest.x) &
+        (fs->remote_ip.x == p->ip.src.x) &
+        (fs->local_port.x == p->tcp.dest.x) &
+        (fs->remote_port.x == p->tcp.src.x))
+    {
+      return fs;
+    }
+  }
+
+  return NULL;
+}
+
+/* flow group of the flow a sent packet belongs to, looked up by 5-tuple */
+int fast_flows_tx_flowgroup(struct network_buf_handle *nbh, uint16_t *fg)
+{
+  struct pkt_tcp *p = network_buf_bufoff(nbh);
+  struct flextcp_pl_flowhtb *htb;
+  struct flextcp_pl_flowst *fs;
+  struct flow_key key;
+  uint32_t h, m, j, ffid, nb = fp_flowht_num;
+  unsigned i;
+
+  if (network_buf_len(nbh) < sizeof(*p) ||
+      f_beui16(p->eth.type) != ETH_TYPE_IP || p->ip.proto != IP_PROTO_TCP)
+    return -1;
+
+  key.local_ip = p->ip.src;
+  key.remote_ip = p->ip.dest;
+  key.local_port = p->tcp.src;
+  key.remote_port = p->tcp.dest;
+  h = flow_hash(&key);
+
+  for (i = 0; i < 2; i++) {
+    htb = &fp_flowht[i == 0 ? FLEXNIC_PL_FLOWHT_B1(h, nb) :
+      FLEXNIC_PL_FLOWHT_B2(h, nb)];
+    m = flowht_match(htb, h);
+    while (m != 0) {
+      j = __builtin_ctz(m);
+      m &= m - 1;
+
+      ffid = htb->flow_id[j];
+      if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0)
+        continue;
+
+      fs = &fp_state->flowst[ffid & FLEXNIC_PL_FLOWHTE_IDMASK];
+      if (fs->local_ip.x == key.local_ip.x &&
+          fs->remote_ip.x == key.remote_ip.x &&
+          fs->local_port.x == key.local_port.x &&
+          fs->remote_port.x == key.remote_port.x)
+      {
+        *fg = fs->flow_group;
+        return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/* packets that are not TCP hash to some group too, any works as long as all
+ * packets of a flow get the same */
+void fast_flows_packet_hash(struct network_buf_handle **nbhs,
+    uint32_t *hashes, uint16_t n)
+{
+  uint16_t i;
+
+  for (i = 0; i < n; i++) {
+    hashes[i] = flow_hash_rx(network_buf_bufoff(nbhs[i]));
+  }
+}
+
 void fast_flows_packet_fss(struct dataplane_context *ctx,
     struct network_buf_handle **nbhs, void **fss, uint16_t n)
 {
   uint32_t hashes[n];
-  uint32_t h, k, j, eh, fid, ffid;
+  uint32_t h, ver, nb = fp_flowht_num;
   uint16_t i;
   struct pkt_tcp *p;
-  struct flow_key key;
-  struct flextcp_pl_flowhte *e;
+  struct flextcp_pl_flowhtb *b1, *b2;
   struct flextcp_pl_flowst *fs;
 
-  /* calculate hashes and prefetch hash table buckets */
+  /* calculate hashes and prefetch both candidate buckets */
   for (i = 0; i < n; i++) {
-    p = network_buf_bufoff(nbhs[i]);
+    h = flow_hash_rx(network_buf_bufoff(nbhs[i]));
 
-    key.local_ip = p->ip.dest;
-    key.remote_ip = p->ip.src;
-    key.local_port = p->tcp.dest;
-    key.remote_port = p->tcp.src;
-    h = flow_hash(&key);
-
-    rte_prefetch0(&fp_state->flowht[h % FLEXNIC_PL_FLOWHT_ENTRIES]);
-    rte_prefetch0(&fp_state->flowht[(h + 3) % FLEXNIC_PL_FLOWHT_ENTRIES]);
+    rte_prefetch0(&fp_flowht[FLEXNIC_PL_FLOWHT_B1(h, nb)]);
+    rte_prefetch0(&fp_flowht[FLEXNIC_PL_FLOWHT_B2(h, nb)]);
     hashes[i] = h;
   }
 
-  /* prefetch flow state for buckets with matching hashes
+  /* prefetch flow state for entries with matching hashes
    * (usually 1 per packet, except in case of collisions) */
   for (i = 0; i < n; i++) {
     h = hashes[i];
-    for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
-      k = (h + j) % FLEXNIC_PL_FLOWHT_ENTRIES;
-      e = &fp_state->flowht[k];
-
-      ffid = e->flow_id;
-      MEM_BARRIER();
-      eh = e->flow_hash;
-
-      fid = ffid & ((1 << FLEXNIC_PL_FLOWHTE_POSSHIFT) - 1);
-      if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0 || eh != h) {
-        continue;
-      }
-
-      rte_prefetch0(&fp_state->flowst[fid]);
-    }
+    flowht_prefetch(&fp_flowht[FLEXNIC_PL_FLOWHT_B1(h, nb)], h);
+    flowht_prefetch(&fp_flowht[FLEXNIC_PL_FLOWHT_B2(h, nb)], h);
   }
 
-  /* finish hash table lookup by checking 5-tuple in flow state */
+  /* finish hash table lookup */
   for (i = 0; i < n; i++) {
     p = network_buf_bufoff(nbhs[i]);
-    fss[i] = NULL;
     h = hashes[i];
+    b1 = &fp_flowht[FLEXNIC_PL_FLOWHT_B1(h, nb)];
+    b2 = &fp_flowht[FLEXNIC_PL_FLOWHT_B2(h, nb)];
 
-    for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
-      k = (h + j) % FLEXNIC_PL_FLOWHT_ENTRIES;
-      e = &fp_state->flowht[k];
-
-      ffid = e->flow_id;
+    /* retry misses that raced with the slow path moving entries */
+    do {
+      ver = fp_state->flowht_version;
       MEM_BARRIER();
-      eh = e->flow_hash;
-
-      fid = ffid & ((1 << FLEXNIC_PL_FLOWHTE_POSSHIFT) - 1);
-      if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0 || eh != h) {
-        continue;
+      if ((fs = flowht_lookup(b1, h, p)) == NULL) {
+        fs = flowht_lookup(b2, h, p);
       }
-
       MEM_BARRIER();
-      fs = &fp_state->flowst[fid];
-      if ((fs->local_ip.x == p->ip.dest.x) &
-          (fs->remote_ip.x == p->ip.src.x) &
-          (fs->local_port.x == p->tcp.dest.x) &
-          (fs->remote_port.x == p->tcp.src.x))
-      {
-        rte_prefetch0((uint8_t *) fs + 64);
-        fss[i] = &fp_state->flowst[fid];
-        break;
-      }
+    } while (fs == NULL &&
+        ((ver & 1) != 0 || ver != fp_state->flowht_version));
+
+    if (fs != NULL) {
+      rte_prefetch0((uint8_t *) fs + 64);
+      rte_prefetch0((uint8_t *) fs + 128);
+      rte_prefetch0(flow_stats(fs));
     }
+    fss[i] = fs;
   }
 }
@@ -23,6 +23,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 #include <unistd.h>
 #include <rte_config.h>
 
@@ -63,16 +64,42 @@ int fast_kernel_poll(struct dataplane_context *ctx,
 
     ret = 0;
     inject_tcp_ts(buf, len, ts, nbh);
+    network_buf_setport(nbh, ktx->msg.packet.port);
     tx_send(ctx, nbh, 0, len);
   } else if (ktx->type == FLEXTCP_PL_KTX_CONNRETRAN) {
     flow_id = ktx->msg.connretran.flow_id;
-    if (flow_id >= FLEXNIC_PL_FLOWST_NUM) {
+    if (flow_id >= config.fp_flows) {
       fprintf(stderr, "fast_kernel_qman: invalid flow id=%u\n", flow_id);
       abort();
     }
 
-    fast_flows_retransmit(ctx, flow_id);
+    fast_flows_retransmit(ctx, flow_id, ts);
     ret = 1;
+  } else if (ktx->type == FLEXTCP_PL_KTX_CONNDISABLE) {
+    flow_id = ktx->msg.conndisable.flow_id;
+    if (flow_id >= config.fp_flows) {
+      fprintf(stderr, "fast_kernel_qman: invalid flow id=%u\n", flow_id);
+      abort();
+    }
+
+    /* if forwarded, the owning core completes the entry */
+    ret = 1;
+    if (fast_flows_disable(ctx, ktx, ts) != 0)
+      goto out;
+  } else if (ktx->type == FLEXTCP_PL_KTX_CONNRESIZE) {
+    flow_id = ktx->msg.connresize.flow_id;
+    if (flow_id >= config.fp_flows) {
+      fprintf(stderr, "fast_kernel_qman: invalid flow id=%u\n", flow_id);
+      abort();
+    }
+
+    /* app notification goes through the arx cache, retry once it has room */
+    if (arx_cache_room(ctx) == 0)
+      return -1;
+
+    ret = 1;
+    if (fast_flows_resize(ctx, ktx, ts) != 0)
+      goto out;
   } else {
     fprintf(stderr, "fast_appctx_poll: unknown type: %u\n", ktx->type);
     abort();
@@ -81,6 +108,7 @@ int fast_kernel_poll(struct dataplane_context *ctx,
   MEM_BARRIER();
   ktx->type = 0;
 
+out:
   kctx->tx_head += sizeof(*ktx);
   if (kctx->tx_head >= kctx->tx_len)
     kctx->tx_head -= kctx->tx_len;
@@ -116,6 +144,7 @@ void fast_kernel_packet(struct dataplane_context *ctx,
 
   /* queue not initialized yet */
   if (kctx->rx_len == 0) {
+    ctx->stats->drops[FLEXNIC_STATS_DROP_KRXNONE]++;
     return;
   }
 
@@ -124,8 +153,12 @@ void fast_kernel_packet(struct dataplane_context *ctx,
   /* queue full */
   if (krx->type != 0) {
     ctx->kernel_drop++;
+    ctx->stats->drops[FLEXNIC_STATS_DROP_KRXFULL]++;
     return;
   }
+  ctx->stats->punts++;
+  LTRACE(ctx, FLEXNIC_LTRACE_EV_PUNT, FLEXNIC_LTRACE_NOFLOW,
+      network_buf_len(nbh), 0, 0, 0);
 
   kctx->rx_head += sizeof(*krx);
   if (kctx->rx_head >= kctx->rx_len)
@@ -142,6 +175,7 @@ void fast_kernel_packet(struct dataplane_context *ctx,
 
   krx->msg.packet.len = len;
   krx->msg.packet.fn_core = ctx->id;
+  krx->msg.packet.port = network_buf_port(nbh);
   MEM_BARRIER();
 
   /* krx queue header */
@@ -149,6 +183,85 @@ void fast_kernel_packet(struct dataplane_context *ctx,
   fast_kernel_kick();
 }
 
+/* queue flow to be reported as active, returns -1 if the batch is full and
+ * can't be flushed */
+int fast_kernel_ccactive(struct dataplane_context *ctx, uint32_t flow_id)
+{
+  if (ctx->cc_active_num == FLEXTCP_PL_KRX_CCACTIVE_MAX &&
+      fast_kernel_ccactive_flush(ctx) != 0)
+  {
+    return -1;
+  }
+
+  ctx->cc_active[ctx->cc_active_num++] = flow_id;
+  return 0;
+}
+
+int fast_kernel_ccactive_flush(struct dataplane_context *ctx)
+{
+  struct flextcp_pl_appctx *kctx = &fp_state->kctx[ctx->id];
+  struct flextcp_pl_krx *krx;
+
+  /* queue not initialized yet */
+  if (kctx->rx_len == 0) {
+    ctx->cc_active_num = 0;
+    return 0;
+  }
+
+  krx = dma_pointer(kctx->rx_base + kctx->rx_head, sizeof(*krx));
+
+  /* queue full, try again later */
+  if (krx->type != 0) {
+    return -1;
+  }
+
+  kctx->rx_head += sizeof(*krx);
+  if (kctx->rx_head >= kctx->rx_len)
+    kctx->rx_head -= kctx->rx_len;
+
+  memcpy(krx->msg.ccactive.flow_ids, ctx->cc_active,
+      ctx->cc_active_num * sizeof(ctx->cc_active[0]));
+  krx->msg.ccactive.num = ctx->cc_active_num;
+  MEM_BARRIER();
+
+  krx->type = FLEXTCP_PL_KRX_CCACTIVE;
+  fast_kernel_kick();
+
+  ctx->cc_active_num = 0;
+  return 0;
+}
+
+/* tell the slow path about a flow moved to another context, returns -1 if
+ * the queue is full */
+int fast_kernel_connmoved(struct dataplane_context *ctx, uint32_t flow_id,
+    uint16_t db)
+{
+  struct flextcp_pl_appctx *kctx = &fp_state->kctx[ctx->id];
+  struct flextcp_pl_krx *krx;
+
+  /* queue not initialized yet */
+  if (kctx->rx_len == 0) {
+    return 0;
+  }
+
+  krx = dma_pointer(kctx->rx_base + kctx->rx_head, sizeof(*krx));
+  if (krx->type != 0) {
+    return -1;
+  }
+
+  kctx->rx_head += sizeof(*krx);
+  if (kctx->rx_head >= kctx->rx_len)
+    kctx->rx_head -= kctx->rx_len;
+
+  krx->msg.connmoved.flow_id = flow_id;
+  krx->msg.connmoved.db_id = db;
+  MEM_BARRIER();
+
+  krx->type = FLEXTCP_PL_KRX_CONNMOVED;
+  fast_kernel_kick();
+  return 0;
+}
+
 static inline void inject_tcp_ts(void *buf, uint16_t len, uint32_t ts,
     struct network_buf_handle *nbh)
 {
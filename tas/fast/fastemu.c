@@ -24,20 +24,39 @@
 
 #include <assert.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <rte_config.h>
 #include <rte_malloc.h>
 #include <rte_cycles.h>
+#include <rte_pause.h>
+#ifdef __WAITPKG__
+#include <immintrin.h>
+#endif
 
 #include <tas_memif.h>
+#include <tas_trace.h>
+#include <utils_timeout.h>
 
 #include "internal.h"
 #include "fastemu.h"
 
 #define DATAPLANE_TSCS
 
+/** Pause instructions per idle pause without WAITPKG */
+#define IDLE_PAUSE_ITERS 64
+/** Don't go to sleep for qman deadlines closer than this [us] */
+#define IDLE_SLEEP_MIN_US 20
+/** Buffer cache operations between adapting the fill target */
+#define BUFCACHE_ADAPT_OPS 4096
+/** Grow the fill target above this many mempool accesses per interval */
+#define BUFCACHE_ADAPT_GROW 8
+/** Interval after which the rx timestamp offset is re-established [us] */
+#define RX_TSTAMP_EPOCH_US 10000
+
 #ifdef DATAPLANE_STATS
 # ifdef DATAPLANE_TSCS
 #   define STATS_TS(n) uint64_t n = rte_get_tsc_cycles()
@@ -58,57 +77,147 @@ static unsigned poll_rx(struct dataplane_context *ctx, uint32_t ts) __attribute_
 static unsigned poll_queues(struct dataplane_context *ctx, uint32_t ts)  __attribute__((noinline));
 static unsigned poll_kernel(struct dataplane_context *ctx, uint32_t ts) __attribute__((noinline));
 static unsigned poll_qman(struct dataplane_context *ctx, uint32_t ts) __attribute__((noinline));
-static unsigned poll_qman_fwd(struct dataplane_context *ctx, uint32_t ts) __attribute__((noinline));
-static void poll_scale(struct dataplane_context *ctx);
+static unsigned poll_fwd(struct dataplane_context *ctx, uint32_t ts) __attribute__((noinline));
+static unsigned poll_rto(struct dataplane_context *ctx, uint32_t ts);
+static unsigned poll_delack(struct dataplane_context *ctx, uint32_t ts);
+static void poll_scale(struct dataplane_context *ctx, uint32_t ts);
+static inline unsigned stage_done(struct dataplane_context *ctx,
+    enum dataplane_stage_id id, unsigned num, uint64_t *pcyc);
+static void sched_adapt(struct dataplane_context *ctx);
+static inline void idle_state_set(struct dataplane_context *ctx, uint8_t st);
+static void idle_pause(struct dataplane_context *ctx);
+static int idle_sleep(struct dataplane_context *ctx, uint32_t ts);
+static void flow_group_handoff(struct dataplane_context *ctx);
+static void rx_process(struct dataplane_context *ctx,
+    struct network_buf_handle **bhs, unsigned n, uint32_t ts);
 
 static inline uint8_t bufcache_prealloc(struct dataplane_context *ctx, uint16_t num,
     struct network_buf_handle ***handles);
 static inline void bufcache_alloc(struct dataplane_context *ctx, uint16_t num);
 static inline void bufcache_free(struct dataplane_context *ctx,
     struct network_buf_handle *handle);
+static inline void bufcache_adapt(struct dataplane_context *ctx, int miss);
+
+static inline void rx_tstamp(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, uint32_t ts);
+
+static unsigned sw_rss_dispatch(struct dataplane_context *ctx, uint32_t ts);
+static int sw_rss_poll(struct dataplane_context *ctx, unsigned num,
+    struct network_buf_handle **bhs);
 
 static inline void tx_flush(struct dataplane_context *ctx);
-static inline void tx_send(struct dataplane_context *ctx,
+static inline uint16_t tx_budget(struct dataplane_context *ctx, uint16_t max,
+    int bulk);
+static inline int tx_send(struct dataplane_context *ctx,
     struct network_buf_handle *nbh, uint16_t off, uint16_t len);
 
-static void arx_cache_flush(struct dataplane_context *ctx, uint32_t ts) __attribute__((noinline));
+static int dataplane_reattach(void);
+
+static void pcap_capture(struct dataplane_context *ctx,
+    struct network_buf_handle **bhs, unsigned n, uint8_t dir)
+  __attribute__((noinline));
+
+uint32_t *dataplane_bump_tsc = NULL;
+/* NIC rx timestamp ticks to us, 32.32 fixed point */
+static uint64_t rx_tstamp_mult;
 
 int dataplane_init(void)
 {
-  if (FLEXNIC_INTERNAL_MEM_SIZE < sizeof(struct flextcp_pl_mem)) {
-    fprintf(stderr, "dataplane_init: internal flexnic memory size not "
-        "sufficient (got %x, need %zx)\n", FLEXNIC_INTERNAL_MEM_SIZE,
-        sizeof(struct flextcp_pl_mem));
-    return -1;
-  }
-
   if (fp_cores_max > FLEXNIC_PL_APPST_CTX_MCS) {
     fprintf(stderr, "dataplane_init: more cores than FLEXNIC_PL_APPST_CTX_MCS "
         "(%u)\n", FLEXNIC_PL_APPST_CTX_MCS);
     return -1;
   }
-  if (FLEXNIC_PL_FLOWST_NUM > FLEXNIC_NUM_QMQUEUES) {
-    fprintf(stderr, "dataplane_init: more flow states than queue manager queues"
-        "(%u > %u)\n", FLEXNIC_PL_FLOWST_NUM, FLEXNIC_NUM_QMQUEUES);
+
+  if ((dataplane_bump_tsc = rte_calloc("bump tsc", config.fp_flows,
+          sizeof(*dataplane_bump_tsc), 0)) == NULL)
+  {
+    fprintf(stderr, "dataplane_init: rte_calloc bump tsc failed\n");
+    return -1;
+  }
+
+  if (shm_reattached && dataplane_reattach() != 0) {
     return -1;
   }
 
+  if (config.fp_rx_tstamp != 0)
+    rx_tstamp_mult = (1000ULL << 32) / config.fp_rx_tstamp;
+
+  return 0;
+}
+
+/* fix up state taken over from a previous instance before any core runs */
+static int dataplane_reattach(void)
+{
+  struct flextcp_pl_appctx *actx;
+  uint32_t i, j;
+  int evfd;
+
+  /* app eventfds were only valid in the previous process, kicks go nowhere
+   * until the apps reattach */
+  if ((evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+    perror("dataplane_reattach: eventfd failed");
+    return -1;
+  }
+  for (i = 0; i < FLEXNIC_PL_APPST_CTX_MCS; i++) {
+    for (j = 0; j < FLEXNIC_PL_APPCTX_NUM; j++) {
+      actx = &fp_state->appctx[i][j];
+      if (actx->rx_len == 0)
+        continue;
+      actx->evfd = evfd;
+      actx->notify_pending = 0;
+    }
+  }
+
+  /* flow rules of the previous instance are gone */
+  for (i = 0; i < config.fp_flows; i++) {
+    fp_state->flowst[i].steer_core = FLEXNIC_PL_FLOWST_NOSTEER;
+  }
+
   return 0;
 }
 
 int dataplane_context_init(struct dataplane_context *ctx)
 {
   char name[32];
+  unsigned i;
+
+  /* adaptive policy starts out with the fixed batch sizes as well */
+  for (i = 0; i < DP_STAGE_NUM; i++) {
+    ctx->stages[i].batch = BATCH_SIZE_FIXED;
+  }
+  ctx->sched_lat_cycles = (uint64_t) config.fp_sched_latency *
+    rte_get_tsc_hz() / 1000000;
 
   /* initialize forwarding queue */
-  sprintf(name, "qman_fwd_ring_%u", ctx->id);
-  if ((ctx->qman_fwd_ring = rte_ring_create(name, 32 * 1024, rte_socket_id(),
+  sprintf(name, "flow_fwd_ring_%u", ctx->id);
+  if ((ctx->flow_fwd_ring = rte_ring_create(name, 32 * 1024, rte_socket_id(),
           RING_F_SC_DEQ)) == NULL)
   {
     fprintf(stderr, "initializing rte_ring_create");
     return -1;
   }
 
+  /* rings from the cores receiving for everyone with software steering,
+   * before the NIC is started with the last network queue below */
+  for (i = 0; i < net_sw_rss; i++) {
+    sprintf(name, "sw_rx_ring_%u_%u", i, ctx->id);
+    if ((ctx->sw_rx_rings[i] = rte_ring_create(name, SW_RSS_RING_SIZE,
+            rte_socket_id(), RING_F_SP_ENQ | RING_F_SC_DEQ)) == NULL)
+    {
+      fprintf(stderr, "dataplane_context_init: creating sw rx ring "
+          "failed\n");
+      return -1;
+    }
+  }
+
+  if ((ctx->fg_stats = rte_calloc("fg stats", FLEXNIC_PL_MAX_FLOWGROUPS,
+          sizeof(*ctx->fg_stats), 64)) == NULL)
+  {
+    fprintf(stderr, "allocating flow group stats failed\n");
+    return -1;
+  }
+
   /* initialize queue manager */
   if (qman_thread_init(ctx) != 0) {
     fprintf(stderr, "initializing qman thread failed\n");
@@ -122,6 +231,7 @@ int dataplane_context_init(struct dataplane_context *ctx)
   }
 
   ctx->poll_next_ctx = ctx->id;
+  ctx->bufcache_target = BUFCACHE_MIN;
 
   ctx->evfd = eventfd(0, 0);
   assert(ctx->evfd != -1);
@@ -130,17 +240,35 @@ int dataplane_context_init(struct dataplane_context *ctx)
   assert(r == 0);
   fp_state->kctx[ctx->id].evfd = ctx->evfd;
 
+  /* timer for waking up for qman deadlines while sleeping */
+  ctx->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  assert(ctx->timerfd != -1);
+  ctx->timer_ev.epdata.event = EPOLLIN;
+  r = rte_epoll_ctl(RTE_EPOLL_PER_THREAD, EPOLL_CTL_ADD, ctx->timerfd,
+      &ctx->timer_ev);
+  assert(r == 0);
+
+  ctx->idle_pause_cycles = rte_get_tsc_hz() / 1000000;
+  ctx->stats = &fp_stats->cores[ctx->id];
+  ctx->hists = fp_stats->hists[ctx->id];
+  ctx->ltrace_core = FLEXNIC_LTRACE_CORE(fp_ltrace, ctx->id);
+  ctx->ltrace_recs = FLEXNIC_LTRACE_RING(fp_ltrace, ctx->id);
+  ctx->pcap_core = FLEXNIC_PCAP_CORE(fp_pcap, ctx->id);
+  ctx->pcap_recs = FLEXNIC_PCAP_RING(fp_pcap, ctx->id);
+  fp_state->corest[ctx->id].idle_state = FLEXNIC_PL_CORE_BUSY;
+
   return 0;
 }
 
 void dataplane_context_destroy(struct dataplane_context *ctx)
 {
+  rte_free(ctx->fg_stats);
 }
 
 void dataplane_loop(struct dataplane_context *ctx)
 {
   uint32_t ts, startwait = 0;
-  uint64_t cyc, prev_cyc;
+  uint64_t cyc, prev_cyc, scyc;
   int was_idle = 1;
 
   while (!exited) {
@@ -149,78 +277,186 @@ void dataplane_loop(struct dataplane_context *ctx)
     /* count cycles of previous iteration if it was busy */
     prev_cyc = cyc;
     cyc = rte_get_tsc_cycles();
-    if (!was_idle)
+    if (!was_idle) {
       ctx->loadmon_cyc_busy += cyc - prev_cyc;
+      ctx->stats->cyc_busy += cyc - prev_cyc;
+    }
+    ctx->stats->loops++;
 
 
     ts = qman_timestamp(cyc);
+    ctx->ltrace_mask = fp_ltrace->mask;
+    ctx->ltrace_sample = fp_ltrace->sample;
+    ctx->pcap_enable = fp_pcap->enable;
 
+    if (UNLIKELY(ctx->fg_handoff))
+      flow_group_handoff(ctx);
+
+    scyc = cyc;
     STATS_TS(start);
-    n += poll_rx(ctx, ts);
+    n += stage_done(ctx, DP_STAGE_RX, poll_rx(ctx, ts), &scyc);
     STATS_TS(rx);
     tx_flush(ctx);
 
-    n += poll_qman_fwd(ctx, ts);
+    n += stage_done(ctx, DP_STAGE_FWD, poll_fwd(ctx, ts), &scyc);
+    n += poll_rto(ctx, ts);
+    n += poll_delack(ctx, ts);
 
     STATS_TSADD(ctx, cyc_rx, rx - start);
-    n += poll_qman(ctx, ts);
+    n += stage_done(ctx, DP_STAGE_QMAN, poll_qman(ctx, ts), &scyc);
     STATS_TS(qm);
     STATS_TSADD(ctx, cyc_qm, qm - rx);
-    n += poll_queues(ctx, ts);
+    n += stage_done(ctx, DP_STAGE_QUEUES, poll_queues(ctx, ts), &scyc);
     STATS_TS(qs);
     STATS_TSADD(ctx, cyc_qs, qs - qm);
-    n += poll_kernel(ctx, ts);
+    n += stage_done(ctx, DP_STAGE_KERNEL, poll_kernel(ctx, ts), &scyc);
 
     /* flush transmit buffer */
     tx_flush(ctx);
 
+    /* report flows that became active to the slow path */
+    if (ctx->cc_active_num > 0)
+      fast_kernel_ccactive_flush(ctx);
+
+    if (UNLIKELY(ctx->notify_num != 0))
+      fast_notify_poll(ctx, ts);
+
+    if (config.fp_sched == CONFIG_FP_SCHED_ADAPTIVE && n > 0)
+      sched_adapt(ctx);
+
     if (ctx->id == 0)
-      poll_scale(ctx);
+      poll_scale(ctx, ts);
 
     if(UNLIKELY(n == 0)) {
       was_idle = 1;
-
+      ctx->stats->loops_idle++;
+
+      /* idle cores spin for a bit, then pause until POLL_CYCLE has passed,
+       * and only then sleep: kicks from apps and the kernel are skipped if
+       * the same core was kicked less than POLL_CYCLE ago. A backlog for
+       * app rx queues keeps the core from sleeping, as freed entries are
+       * only found by probing, and so do moderated app notifications,
+       * delayed acks and packets the NIC has not taken yet. */
       if(startwait == 0) {
-	startwait = ts;
-      } else if(ts - startwait >= POLL_CYCLE) {
-	// Idle -- wait for interrupt or data from apps/kernel
-	int r = network_rx_interrupt_ctl(&ctx->net, 1);
-
-	// Only if device running
-	if(r == 0) {
-	  uint32_t timeout_us = qman_next_ts(&ctx->qman, ts);
-	  /* fprintf(stderr, "[%u] fastemu idle - timeout %d ms\n", ctx->core, */
-	  /* 	  timeout_us == (uint32_t)-1 ? -1 : timeout_us / 1000); */
-	  struct rte_epoll_event event[2];
-	  int n = rte_epoll_wait(RTE_EPOLL_PER_THREAD, event, 2,
-				 timeout_us == (uint32_t)-1 ? -1 : timeout_us / 1000);
-	  assert(n != -1);
-	  /* fprintf(stderr, "[%u] fastemu busy - %u events\n", ctx->core, n); */
-	  for(int i = 0; i < n; i++) {
-	    if(event[i].fd == ctx->evfd) {
-	      /* fprintf(stderr, "[%u] fastemu - woken up by event FD = %d\n", */
-	      /* 	      ctx->core, event[i].fd); */
-	      uint64_t val;
-	      int r = read(ctx->evfd, &val, sizeof(uint64_t));
-	      assert(r == sizeof(uint64_t));
-	    /* } else { */
-	    /*   fprintf(stderr, "[%u] fastemu - woken up by RX interrupt FD = %d\n", */
-	    /* 	      ctx->core, event[i].fd); */
-	    }
-	  }
-
-          /*fprintf(stderr, "dataplane_loop: woke up %u n=%u fd=%d evfd=%d\n", ctx->id, n, event[0].fd, ctx->evfd);*/
-	   network_rx_interrupt_ctl(&ctx->net, 0);
-	}
-      startwait = 0;
+        startwait = ts;
+        idle_state_set(ctx, FLEXNIC_PL_CORE_SPIN);
+      } else if(ts - startwait >= POLL_CYCLE && ctx->arx_num == 0 &&
+          ctx->notify_num == 0 && ctx->dack_head == ctx->dack_tail &&
+          ctx->tx_num == 0)
+      {
+        if (idle_sleep(ctx, ts) == 0)
+          startwait = 0;
+        else
+          idle_pause(ctx);
+      } else if(ts - startwait >= config.fp_idle_spin) {
+        idle_pause(ctx);
       }
     } else {
       was_idle = 0;
       startwait = 0;
+      idle_state_set(ctx, FLEXNIC_PL_CORE_BUSY);
     }
   }
 }
 
+static inline void idle_state_set(struct dataplane_context *ctx, uint8_t st)
+{
+  uint16_t id = ctx->id;
+
+  /* avoid dirtying the line on every busy iteration, fields are accessed
+   * directly as the state region is packed */
+  if (fp_state->corest[id].idle_state != st)
+    fp_state->corest[id].idle_state = st;
+}
+
+/* wait a short while, ideally until the kernel doorbell is written */
+static void idle_pause(struct dataplane_context *ctx)
+{
+#ifdef __WAITPKG__
+  struct flextcp_pl_appctx *kctx = &fp_state->kctx[ctx->id];
+  void *db;
+#endif
+  unsigned i;
+
+  idle_state_set(ctx, FLEXNIC_PL_CORE_PAUSE);
+
+#ifdef __WAITPKG__
+  if (kctx->tx_len != 0) {
+    db = dma_pointer(kctx->tx_base + kctx->tx_head,
+        sizeof(struct flextcp_pl_ktx));
+    _umonitor(db);
+    _umwait(1, rte_get_tsc_cycles() + ctx->idle_pause_cycles);
+    return;
+  }
+#endif
+
+  for (i = 0; i < IDLE_PAUSE_ITERS; i++)
+    rte_pause();
+}
+
+/* sleep until kicked or the next qman deadline, returns -1 if the deadline is
+ * too close to be worth sleeping for */
+static int idle_sleep(struct dataplane_context *ctx, uint32_t ts)
+{
+  struct rte_epoll_event event[4];
+  struct itimerspec its;
+  uint32_t timeout_us, start;
+  uint64_t val;
+  int i, n, r;
+
+  timeout_us = qman_next_ts(&ctx->qman, ts);
+  if (timeout_us != (uint32_t) -1 && timeout_us < IDLE_SLEEP_MIN_US)
+    return -1;
+
+  // Idle -- wait for interrupt or data from apps/kernel
+  r = network_rx_interrupt_ctl(&ctx->net, 1);
+
+  // Only if device running
+  if(r != 0)
+    return 0;
+
+  /* arm timer with the qman deadline at microsecond granularity (or disarm
+   * it), epoll only does milliseconds */
+  memset(&its, 0, sizeof(its));
+  if (timeout_us != (uint32_t) -1) {
+    its.it_value.tv_sec = timeout_us / 1000000;
+    its.it_value.tv_nsec = (timeout_us % 1000000) * 1000;
+  }
+  r = timerfd_settime(ctx->timerfd, 0, &its, NULL);
+  assert(r == 0);
+
+  idle_state_set(ctx, FLEXNIC_PL_CORE_SLEEP);
+  start = util_timeout_time_us();
+
+  /* fprintf(stderr, "[%u] fastemu idle - timeout %d us\n", ctx->core, */
+  /* 	  timeout_us); */
+  n = rte_epoll_wait(RTE_EPOLL_PER_THREAD, event, 4, -1);
+  assert(n != -1);
+  /* fprintf(stderr, "[%u] fastemu busy - %u events\n", ctx->core, n); */
+  for(i = 0; i < n; i++) {
+    if(event[i].fd == ctx->evfd) {
+      /* fprintf(stderr, "[%u] fastemu - woken up by event FD = %d\n", */
+      /* 	      ctx->core, event[i].fd); */
+      r = read(ctx->evfd, &val, sizeof(uint64_t));
+      assert(r == sizeof(uint64_t));
+    } else if(event[i].fd == ctx->timerfd) {
+      /* non-blocking, might have been re-armed in the meantime */
+      r = read(ctx->timerfd, &val, sizeof(uint64_t));
+    /* } else { */
+    /*   fprintf(stderr, "[%u] fastemu - woken up by RX interrupt FD = %d\n", */
+    /* 	      ctx->core, event[i].fd); */
+    }
+  }
+
+  fp_state->corest[ctx->id].idle_sleeps++;
+  fp_state->corest[ctx->id].idle_sleep_us += util_timeout_time_us() - start;
+  idle_state_set(ctx, FLEXNIC_PL_CORE_SPIN);
+
+  /*fprintf(stderr, "dataplane_loop: woke up %u n=%u fd=%d evfd=%d\n", ctx->id, n, event[0].fd, ctx->evfd);*/
+  network_rx_interrupt_ctl(&ctx->net, 0);
+  return 0;
+}
+
 #ifdef DATAPLANE_STATS
 static inline uint64_t read_stat(uint64_t *p)
 {
@@ -229,52 +465,296 @@ static inline uint64_t read_stat(uint64_t *p)
 
 void dataplane_dump_stats(void)
 {
+  static const char *stage_names[DP_STAGE_NUM] = {
+    "rx", "fwd", "qman", "queues", "kernel" };
   struct dataplane_context *ctx;
-  unsigned i;
+  struct dataplane_stage *st;
+  unsigned i, j;
 
   for (i = 0; i < fp_cores_max; i++) {
     ctx = ctxs[i];
     fprintf(stderr, "dp stats %u: "
         "qm=(%"PRIu64",%"PRIu64",%"PRIu64")  "
-        "rx=(%"PRIu64",%"PRIu64",%"PRIu64")  "
+        "rx=(%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64")  "
         "qs=(%"PRIu64",%"PRIu64",%"PRIu64")  "
         "cyc=(%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64")\n", i,
         read_stat(&ctx->stat_qm_poll), read_stat(&ctx->stat_qm_empty),
         read_stat(&ctx->stat_qm_total),
         read_stat(&ctx->stat_rx_poll), read_stat(&ctx->stat_rx_empty),
-        read_stat(&ctx->stat_rx_total),
+        read_stat(&ctx->stat_rx_total), read_stat(&ctx->stat_rx_gro),
         read_stat(&ctx->stat_qs_poll), read_stat(&ctx->stat_qs_empty),
         read_stat(&ctx->stat_qs_total),
         read_stat(&ctx->stat_cyc_db), read_stat(&ctx->stat_cyc_qm),
         read_stat(&ctx->stat_cyc_rx), read_stat(&ctx->stat_cyc_qs));
+
+    for (j = 0; j < DP_STAGE_NUM; j++) {
+      st = &ctx->stages[j];
+      fprintf(stderr, "dp stage %u/%s: batch=%u polls=%"PRIu64" "
+          "empty=%"PRIu64" full=%"PRIu64" items=%"PRIu64" cyc=%"PRIu64"\n",
+          i, stage_names[j], st->batch, read_stat(&st->cnt_polls),
+          read_stat(&st->cnt_empty), read_stat(&st->cnt_full),
+          read_stat(&st->cnt_items), read_stat(&st->cnt_cycles));
+    }
+
+    fprintf(stderr, "dp bufcache %u: target=%u num=%u hit=%"PRIu64" "
+        "miss=%"PRIu64" flush=%"PRIu64"\n", i, ctx->bufcache_target,
+        ctx->bufcache_num, read_stat(&ctx->bufcache_hit),
+        read_stat(&ctx->bufcache_miss), read_stat(&ctx->bufcache_flush));
   }
 }
 #endif
 
+/* account for a completed stage poll, returns num */
+static inline unsigned stage_done(struct dataplane_context *ctx,
+    enum dataplane_stage_id id, unsigned num, uint64_t *pcyc)
+{
+  struct dataplane_stage *st = &ctx->stages[id];
+  uint64_t now, cyc;
+
+  st->cnt_polls++;
+  st->cnt_items += num;
+  if (num == 0)
+    st->cnt_empty++;
+  else if (num >= st->batch)
+    st->cnt_full++;
+  st->last = num;
+
+  /* stage cycles are always counted for the stats region */
+  now = rte_get_tsc_cycles();
+  cyc = now - *pcyc;
+  *pcyc = now;
+  ctx->stats->cyc_stage[id] += cyc;
+
+  if (config.fp_sched == CONFIG_FP_SCHED_ADAPTIVE) {
+    st->cnt_cycles += cyc;
+    st->occ = st->occ - (st->occ >> 3) + ((num << 8) >> 3);
+    if (num > 0) {
+      st->cyc_item = st->cyc_item - (st->cyc_item >> 3) + (cyc / num >> 3);
+    }
+  }
+
+  return num;
+}
+
+/* size stage batches from their occupancy, within the latency target */
+static void sched_adapt(struct dataplane_context *ctx)
+{
+  struct dataplane_stage *st;
+  uint64_t budget = ctx->sched_lat_cycles / DP_STAGE_NUM;
+  uint32_t want;
+  unsigned i;
+
+  for (i = 0; i < DP_STAGE_NUM; i++) {
+    st = &ctx->stages[i];
+
+    /* grow while polls come back full, otherwise track twice the average so
+     * bursts still fit */
+    if (st->last >= st->batch) {
+      want = st->batch * 2;
+    } else {
+      want = ((st->occ >> 8) + 1) * 2;
+    }
+
+    /* but don't let one stage hold up the others beyond its share */
+    if (st->cyc_item > 0 && budget / st->cyc_item < want) {
+      want = budget / st->cyc_item;
+    }
+
+    st->batch = MAX(BATCH_SIZE_MIN, MIN(want, BATCH_SIZE));
+  }
+}
+
 static unsigned poll_rx(struct dataplane_context *ctx, uint32_t ts)
 {
   int ret;
-  unsigned i, n;
-  uint8_t freebuf[BATCH_SIZE] = { 0 };
-  void *fss[BATCH_SIZE];
-  struct tcp_opts tcpopts[BATCH_SIZE];
+  unsigned i, k, n, disp = 0;
+  uint64_t bytes = 0;
   struct network_buf_handle *bhs[BATCH_SIZE];
 
-  n = BATCH_SIZE;
-  if (TXBUF_SIZE - ctx->tx_num < n)
-    n = TXBUF_SIZE - ctx->tx_num;
+  /* receiving for the other cores can't wait for room on this one */
+  if (UNLIKELY(net_sw_rss > 0) && ctx->net.rx_nic)
+    disp = sw_rss_dispatch(ctx, ts);
+
+  n = tx_budget(ctx, ctx->stages[DP_STAGE_RX].batch, 0);
+
+  /* app rx queues full: retry the backlog, and leave the rest in the nic
+   * queue until there is room */
+  if (UNLIKELY(ctx->arx_num > 0)) {
+    arx_cache_flush(ctx, ts);
+    if (arx_cache_room(ctx) < n)
+      n = arx_cache_room(ctx);
+    if (n == 0)
+      return disp;
+  }
 
   STATS_ADD(ctx, rx_poll, 1);
 
   /* receive packets */
-  ret = network_poll(&ctx->net, n, bhs);
+  if (LIKELY(net_sw_rss == 0))
+    ret = network_poll(&ctx->net, n, bhs);
+  else
+    ret = sw_rss_poll(ctx, n, bhs);
   if (ret <= 0) {
     STATS_ADD(ctx, rx_empty, 1);
-    return 0;
+    return disp;
   }
   STATS_ADD(ctx, rx_total, n);
   n = ret;
 
+  ctx->stats->rx_pkts += n;
+  for (i = 0; i < n; i++) {
+    bytes += network_buf_len(bhs[i]);
+  }
+  ctx->stats->rx_bytes += bytes;
+
+  if (UNLIKELY(ctx->pcap_enable & FLEXNIC_PCAP_RX))
+    pcap_capture(ctx, bhs, n, FLEXNIC_PCAP_RX);
+
+  /* drop what the NIC found corrupted, without it validating checksums
+   * packets are taken as they are */
+  for (i = 0, k = 0; i < n; i++) {
+    if (UNLIKELY(network_buf_rx_xsum_bad(bhs[i]))) {
+      ctx->stats->drops[FLEXNIC_STATS_DROP_RXCSUM]++;
+      bufcache_free(ctx, bhs[i]);
+      continue;
+    }
+    if (rx_tstamp_mult != 0)
+      rx_tstamp(ctx, bhs[i], ts);
+    bhs[k++] = bhs[i];
+  }
+  n = k;
+  if (n == 0)
+    return disp + ret;
+
+  ctx->rx_tsc = rte_get_tsc_cycles();
+  rx_process(ctx, bhs, n, ts);
+  ctx->rx_tsc = 0;
+  return disp + n;
+}
+
+/* Software steering for NICs whose RETA can't be changed (--fp-sw-rss): the
+ * first cores receive from the NIC and hand every packet over to the core
+ * owning its flow group, their own included so everyone picks up packets
+ * the same way. Flow groups are the low bits of the flow table hash, which
+ * the buffers then carry in place of the NIC's RSS hash. Rings are single
+ * producer and consumer, and each receiving core pushes one burst per core
+ * so packets of a flow stay in order. Returns the number of packets
+ * received. */
+static unsigned sw_rss_dispatch(struct dataplane_context *ctx, uint32_t ts)
+{
+  struct network_buf_handle *bhs[BATCH_SIZE], *out[BATCH_SIZE];
+  uint32_t hashes[BATCH_SIZE];
+  uint8_t owners[BATCH_SIZE];
+  uint64_t cores = 0;
+  unsigned i, n, m, sent;
+  uint16_t c;
+  int ret;
+
+  ret = network_poll(&ctx->net, BATCH_SIZE, bhs);
+  if (ret <= 0)
+    return 0;
+  n = ret;
+
+  fast_flows_packet_hash(bhs, hashes, n);
+  for (i = 0; i < n; i++) {
+    network_buf_set_flowhash(bhs[i], hashes[i]);
+    owners[i] = fp_state->flow_group_steering[hashes[i] & (rss_reta_size - 1)];
+    cores |= 1ULL << owners[i];
+  }
+
+  while (cores != 0) {
+    c = __builtin_ctzll(cores);
+    cores &= cores - 1;
+
+    for (i = 0, m = 0; i < n; i++) {
+      if (owners[i] == c)
+        out[m++] = bhs[i];
+    }
+
+    sent = rte_ring_sp_enqueue_burst(ctxs[c]->sw_rx_rings[ctx->id],
+        (void **) out, m, NULL);
+    for (i = sent; i < m; i++) {
+      ctx->stats->drops[FLEXNIC_STATS_DROP_FWD]++;
+      bufcache_free(ctx, out[i]);
+    }
+
+    if (c != ctx->id && sent > 0)
+      util_flexnic_kick(&fp_state->kctx[c], ts);
+  }
+
+  return n;
+}
+
+/* receive with software steering: take up to num packets handed over to this
+ * core, rotating which ring goes first */
+static int sw_rss_poll(struct dataplane_context *ctx, unsigned num,
+    struct network_buf_handle **bhs)
+{
+  unsigned i, r, n = 0;
+
+  r = ctx->sw_rx_next;
+  for (i = 0; i < net_sw_rss && n < num; i++) {
+    n += rte_ring_sc_dequeue_burst(ctx->sw_rx_rings[r], (void **) bhs + n,
+        num - n, NULL);
+    r = (r + 1 < net_sw_rss ? r + 1 : 0);
+  }
+  ctx->sw_rx_next = (ctx->sw_rx_next + 1 < net_sw_rss ?
+      ctx->sw_rx_next + 1 : 0);
+
+  return n;
+}
+
+/* Convert the NIC timestamp of a received packet to its arrival in qman
+ * time. The NIC clock has an unknown offset, so packets are placed relative
+ * to the one that waited least for the poll in the last epoch (~0 delay);
+ * starting over every epoch keeps clock drift out. */
+static inline void rx_tstamp(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, uint32_t ts)
+{
+  struct dataplane_rx_tstamp *rt;
+  uint64_t hw;
+  uint32_t nic_us, off;
+
+  if (network_buf_rx_tstamp(nbh, &hw) != 0)
+    return;
+
+  nic_us = ((unsigned __int128) hw * rx_tstamp_mult) >> 32;
+  off = ts - nic_us;
+
+  rt = &ctx->rx_tstamps[network_buf_port(nbh)];
+  if (UNLIKELY(!rt->valid)) {
+    rt->base = rt->next = off;
+    rt->epoch_ts = ts;
+    rt->valid = 1;
+  } else if (UNLIKELY(ts - rt->epoch_ts >= RX_TSTAMP_EPOCH_US)) {
+    rt->base = rt->next;
+    rt->next = off;
+    rt->epoch_ts = ts;
+  }
+
+  if ((int32_t) (off - rt->next) < 0)
+    rt->next = off;
+  if ((int32_t) (off - rt->base) < 0)
+    rt->base = off;
+
+  network_buf_set_rx_tstamp(nbh, nic_us + rt->base);
+}
+
+/* process batch of received packets, either from the NIC or forwarded */
+static void rx_process(struct dataplane_context *ctx,
+    struct network_buf_handle **bhs, unsigned n, uint32_t ts)
+{
+  unsigned i, j, k;
+  uint16_t owner;
+  uint8_t freebuf[BATCH_SIZE] = { 0 };
+  uint8_t done[BATCH_SIZE] = { 0 };
+  void *fss[BATCH_SIZE];
+  struct tcp_opts tcpopts[BATCH_SIZE];
+  struct tcp_opts run_opts[BATCH_SIZE];
+  struct network_buf_handle *run_bhs[BATCH_SIZE];
+  uint8_t run_idx[BATCH_SIZE];
+  int run_rets[BATCH_SIZE];
+
   /* prefetch packet contents (1st cache line) */
   for (i = 0; i < n; i++) {
     rte_prefetch0(network_buf_bufoff(bhs[i]));
@@ -292,17 +772,59 @@ static unsigned poll_rx(struct dataplane_context *ctx, uint32_t ts)
   fast_flows_packet_parse(ctx, bhs, fss, tcpopts, n);
 
   for (i = 0; i < n; i++) {
-    /* run fast-path for flows with flow state */
-    if (fss[i] != NULL) {
-      ret = fast_flows_packet(ctx, bhs[i], fss[i], &tcpopts[i], ts);
-    } else {
-      ret = -1;
-    }
+    if (done[i])
+      continue;
 
-    if (ret > 0) {
-      freebuf[i] = 1;
-    } else if (ret < 0) {
+    /* packets without flow state go to the kernel */
+    if (fss[i] == NULL) {
       fast_kernel_packet(ctx, bhs[i]);
+      continue;
+    }
+
+    /* flows are only modified by the core owning their flow group, this
+     * differs from the receiving core while groups are being moved */
+    owner = fp_state->flow_group_steering[
+      ((struct flextcp_pl_flowst *) fss[i])->flow_group];
+    if (UNLIKELY(owner != ctx->id)) {
+      if (fast_flows_fwd(ctx, owner, FLOW_FWD_PACKET, bhs[i], ts) == 0) {
+        freebuf[i] = 1;
+      } else {
+        ctx->stats->drops[FLEXNIC_STATS_DROP_FWD]++;
+      }
+      continue;
+    }
+
+    /* gather in-order segments for the same flow in this batch, so they are
+     * processed with one notification and ACK */
+    run_bhs[0] = bhs[i];
+    run_opts[0] = tcpopts[i];
+    run_idx[0] = i;
+    k = 1;
+    for (j = i + 1; j < n; j++) {
+      if (done[j] || fss[j] != fss[i])
+        continue;
+
+      /* stop at first segment we can't merge to keep per flow order */
+      if (!fast_flows_packet_gro_check(run_bhs[k - 1], bhs[j]))
+        break;
+
+      run_bhs[k] = bhs[j];
+      run_opts[k] = tcpopts[j];
+      run_idx[k] = j;
+      done[j] = 1;
+      k++;
+    }
+    STATS_ADD(ctx, rx_gro, k - 1);
+
+    /* run fast-path for flows with flow state */
+    fast_flows_packet(ctx, run_bhs, fss[i], run_opts, k, ts, run_rets);
+
+    for (j = 0; j < k; j++) {
+      if (run_rets[j] > 0) {
+        freebuf[run_idx[j]] = 1;
+      } else if (run_rets[j] < 0) {
+        fast_kernel_packet(ctx, run_bhs[j]);
+      }
     }
   }
 
@@ -313,44 +835,48 @@ static unsigned poll_rx(struct dataplane_context *ctx, uint32_t ts)
     if (freebuf[i] == 0)
       bufcache_free(ctx, bhs[i]);
   }
-
-  return n;
 }
 
 static unsigned poll_queues(struct dataplane_context *ctx, uint32_t ts)
 {
   struct network_buf_handle **handles;
   void *aqes[BATCH_SIZE];
-  unsigned n, i, total = 0;
+  unsigned n, i, num, total = 0, num_ctxs;
   uint16_t max, k = 0, num_bufs = 0, j;
   int ret;
 
   STATS_ADD(ctx, qs_poll, 1);
 
-  max = BATCH_SIZE;
-  if (TXBUF_SIZE - ctx->tx_num < max)
-    max = TXBUF_SIZE - ctx->tx_num;
+  /* only contexts with doorbells handed out so far */
+  num_ctxs = fp_state->appctx_num;
+  if (ctx->poll_next_ctx >= num_ctxs)
+    ctx->poll_next_ctx = 0;
+
+  max = tx_budget(ctx, ctx->stages[DP_STAGE_QUEUES].batch, 1);
+  /* moves and tx buffer switches add an rx entry */
+  if (arx_cache_room(ctx) < max)
+    max = arx_cache_room(ctx);
 
   /* allocate buffers contents */
   max = bufcache_prealloc(ctx, max, &handles);
 
-  for (n = 0; n < FLEXNIC_PL_APPCTX_NUM; n++) {
-    fast_appctx_poll_pf(ctx, (ctx->poll_next_ctx + n) % FLEXNIC_PL_APPCTX_NUM);
+  for (n = 0; n < num_ctxs; n++) {
+    fast_appctx_poll_pf(ctx, (ctx->poll_next_ctx + n) % num_ctxs);
   }
 
-  for (n = 0; n < FLEXNIC_PL_APPCTX_NUM && k < max; n++) {
-    for (i = 0; i < BATCH_SIZE && k < max; i++) {
-      ret = fast_appctx_poll_fetch(ctx, ctx->poll_next_ctx, &aqes[k]);
-      if (ret == 0)
-        k++;
-      else
+  for (n = 0; n < num_ctxs && k < max; n++) {
+    /* up to a cache line of entries at a time */
+    for (i = 0; i < BATCH_SIZE && k < max; i += num) {
+      num = fast_appctx_poll_fetch(ctx, ctx->poll_next_ctx, &aqes[k],
+          max - k);
+      if (num == 0)
         break;
 
-      total++;
+      k += num;
+      total += num;
     }
 
-    ctx->poll_next_ctx = (ctx->poll_next_ctx + 1) %
-      FLEXNIC_PL_APPCTX_NUM;
+    ctx->poll_next_ctx = (ctx->poll_next_ctx + 1) % num_ctxs;
   }
 
   for (j = 0; j < k; j++) {
@@ -362,7 +888,7 @@ static unsigned poll_queues(struct dataplane_context *ctx, uint32_t ts)
   /* apply buffer reservations */
   bufcache_alloc(ctx, num_bufs);
 
-  for (n = 0; n < FLEXNIC_PL_APPCTX_NUM; n++)
+  for (n = 0; n < num_ctxs; n++)
     fast_actx_rxq_probe(ctx, n);
 
   STATS_ADD(ctx, qs_total, total);
@@ -379,9 +905,7 @@ static unsigned poll_kernel(struct dataplane_context *ctx, uint32_t ts)
   uint16_t max, k = 0;
   int ret;
 
-  max = BATCH_SIZE;
-  if (TXBUF_SIZE - ctx->tx_num < max)
-    max = TXBUF_SIZE - ctx->tx_num;
+  max = tx_budget(ctx, ctx->stages[DP_STAGE_KERNEL].batch, 0);
 
   max = (max > 8 ? 8 : max);
   /* allocate buffers contents */
@@ -412,9 +936,7 @@ static unsigned poll_qman(struct dataplane_context *ctx, uint32_t ts)
   uint16_t off = 0, max;
   int ret, i, use;
 
-  max = BATCH_SIZE;
-  if (TXBUF_SIZE - ctx->tx_num < max)
-    max = TXBUF_SIZE - ctx->tx_num;
+  max = tx_budget(ctx, ctx->stages[DP_STAGE_QMAN].batch, 1);
 
   STATS_ADD(ctx, qm_poll, 1);
 
@@ -423,12 +945,14 @@ static unsigned poll_qman(struct dataplane_context *ctx, uint32_t ts)
 
   /* poll queue manager */
   ret = qman_poll(&ctx->qman, max, q_ids, q_bytes);
+  ctx->stats->qm_waiting = qman_waiting(&ctx->qman);
   if (ret <= 0) {
     STATS_ADD(ctx, qm_empty, 1);
     return 0;
   }
 
   STATS_ADD(ctx, qm_total, ret);
+  ctx->stats->qm_served += ret;
 
   for (i = 0; i < ret; i++) {
     rte_prefetch0(handles[i]);
@@ -460,18 +984,192 @@ static unsigned poll_qman(struct dataplane_context *ctx, uint32_t ts)
   return ret;
 }
 
-static unsigned poll_qman_fwd(struct dataplane_context *ctx, uint32_t ts)
+/* expired retransmission timers, retransmits go out through qman */
+static unsigned poll_rto(struct dataplane_context *ctx, uint32_t ts)
+{
+  uint32_t ids[BATCH_SIZE];
+  unsigned i, n;
+
+  if (ctx->qman.rto_wheel == NULL)
+    return 0;
+
+  n = qman_rto_poll(&ctx->qman, ts, BATCH_SIZE, ids);
+  for (i = 0; i < n; i++) {
+    fast_flows_rto(ctx, ids[i], ts);
+  }
+
+  return n;
+}
+
+/* delayed acks that are due, pure acks go out in freshly allocated buffers */
+static unsigned poll_delack(struct dataplane_context *ctx, uint32_t ts)
+{
+  struct network_buf_handle **handles;
+  uint16_t max, k = 0;
+  unsigned n = 0;
+  uint32_t i;
+
+  if (ctx->dack_head == ctx->dack_tail ||
+      (int32_t) (ts - ctx->dack_ts[ctx->dack_head % DACK_QUEUE_SIZE]) < 0)
+    return 0;
+
+  max = tx_budget(ctx, BATCH_SIZE, 0);
+
+  /* allocate buffers contents */
+  max = bufcache_prealloc(ctx, max, &handles);
+
+  while (k < max && ctx->dack_head != ctx->dack_tail) {
+    i = ctx->dack_head % DACK_QUEUE_SIZE;
+    if ((int32_t) (ts - ctx->dack_ts[i]) < 0)
+      break;
+
+    ctx->dack_head++;
+    if (fast_flows_delack(ctx, ctx->dack_ids[i], handles[k], ts) == 0)
+      k++;
+    n++;
+  }
+
+  /* apply buffer reservations */
+  bufcache_alloc(ctx, k);
+
+  return n;
+}
+
+static unsigned poll_fwd(struct dataplane_context *ctx, uint32_t ts)
 {
-  void *flow_states[4 * BATCH_SIZE];
+  void *msgs[2 * BATCH_SIZE];
+  struct network_buf_handle *pkts[BATCH_SIZE];
+  struct flextcp_pl_flowst *fs;
+  struct flextcp_pl_ktx *ktx;
+  struct flextcp_pl_atx *atx;
+  unsigned max, num_pkts = 0;
   int ret, i;
 
-  /* poll queue manager forwarding ring */
-  ret = rte_ring_dequeue_burst(ctx->qman_fwd_ring, flow_states, 4 * BATCH_SIZE, NULL);
-  for (i = 0; i < ret; i++) {
-    fast_flows_qman_fwd(ctx, flow_states[i]);
+  /* forwarded packets and bumps may be sent out on this core */
+  max = tx_budget(ctx, ctx->stages[DP_STAGE_FWD].batch, 0);
+  if (arx_cache_room(ctx) < max)
+    max = arx_cache_room(ctx);
+
+  /* poll forwarding ring, entries always come in (type, pointer) pairs */
+  ret = rte_ring_dequeue_burst(ctx->flow_fwd_ring, msgs, 2 * max, NULL);
+  assert(ret % 2 == 0);
+  for (i = 0; i < ret; i += 2) {
+    switch ((uintptr_t) msgs[i]) {
+      case FLOW_FWD_QMAN:
+        fast_flows_qman_fwd(ctx, msgs[i + 1], ts);
+        break;
+
+      case FLOW_FWD_PACKET:
+        pkts[num_pkts++] = msgs[i + 1];
+        break;
+
+      case FLOW_FWD_BUMP:
+        if (fast_flows_bump_fwd(ctx, msgs[i + 1], ts) != 0)
+          bufcache_free(ctx, msgs[i + 1]);
+        break;
+
+      case FLOW_FWD_RETRANSMIT:
+        fs = msgs[i + 1];
+        fast_flows_retransmit(ctx, fs - fp_state->flowst, ts);
+        break;
+
+      case FLOW_FWD_DISABLE:
+        ktx = msgs[i + 1];
+        if (fast_flows_disable(ctx, ktx, ts) == 0) {
+          MEM_BARRIER();
+          ktx->type = 0;
+        }
+        break;
+
+      case FLOW_FWD_RESIZE:
+        ktx = msgs[i + 1];
+        if (fast_flows_resize(ctx, ktx, ts) == 0) {
+          MEM_BARRIER();
+          ktx->type = 0;
+        }
+        break;
+
+      case FLOW_FWD_RTO:
+        fast_flows_rto_fwd(ctx, msgs[i + 1], ts);
+        break;
+
+      case FLOW_FWD_DELACK:
+        fast_flows_delack_fwd(ctx, msgs[i + 1], ts);
+        break;
+
+      case FLOW_FWD_MOVE:
+        atx = msgs[i + 1];
+        if (fast_flows_move(ctx, atx, ts) == 0) {
+          MEM_BARRIER();
+          atx->type = 0;
+        }
+        break;
+
+      case FLOW_FWD_TXRESIZE:
+        atx = msgs[i + 1];
+        if (fast_flows_txresize(ctx, atx, ts) == 0) {
+          MEM_BARRIER();
+          atx->type = 0;
+        }
+        break;
+
+      default:
+        fprintf(stderr, "poll_fwd: unknown message type %"PRIuPTR"\n",
+            (uintptr_t) msgs[i]);
+        abort();
+    }
   }
 
-  return ret;
+  if (num_pkts > 0)
+    rx_process(ctx, pkts, num_pkts, ts);
+
+  return ret / 2;
+}
+
+/* hand flow groups over to the cores the NIC now steers them to */
+static void flow_group_handoff(struct dataplane_context *ctx)
+{
+  uint16_t i, c;
+
+  ctx->fg_handoff = 0;
+  MEM_BARRIER();
+
+  for (i = 0; i < rss_reta_size; i++) {
+    if (fp_state->flow_group_steering[i] != ctx->id)
+      continue;
+
+    c = network_flow_group_core(i);
+    if (c != ctx->id) {
+      /* flow state updates by this core need to be visible before the new
+       * owner can start working on the group */
+      MEM_BARRIER();
+      fp_state->flow_group_steering[i] = c;
+    }
+  }
+
+  network_flow_steer_handoff(ctx->id);
+}
+
+/* Adapt the cache fill target: grow it if the mempool had to be accessed
+ * often in the last BUFCACHE_ADAPT_OPS operations, shrink it if not at all */
+static inline void bufcache_adapt(struct dataplane_context *ctx, int miss)
+{
+  ctx->bufcache_misses += miss;
+  if (++ctx->bufcache_ops < BUFCACHE_ADAPT_OPS)
+    return;
+
+  if (ctx->bufcache_misses > BUFCACHE_ADAPT_GROW &&
+      ctx->bufcache_target < BUFCACHE_SIZE)
+  {
+    ctx->bufcache_target *= 2;
+  } else if (ctx->bufcache_misses == 0 &&
+      ctx->bufcache_target > BUFCACHE_MIN)
+  {
+    ctx->bufcache_target /= 2;
+  }
+
+  ctx->bufcache_ops = 0;
+  ctx->bufcache_misses = 0;
 }
 
 static inline uint8_t bufcache_prealloc(struct dataplane_context *ctx, uint16_t num,
@@ -480,9 +1178,9 @@ static inline uint8_t bufcache_prealloc(struct dataplane_context *ctx, uint16_t
   uint16_t grow, res, head, g, i;
   struct network_buf_handle *nbh;
 
-  /* try refilling buffer cache */
+  /* try refilling buffer cache up to the target in one bulk allocation */
   if (ctx->bufcache_num < num) {
-    grow = BUFCACHE_SIZE - ctx->bufcache_num;
+    grow = MAX(ctx->bufcache_target, num) - ctx->bufcache_num;
     head = (ctx->bufcache_head + ctx->bufcache_num) & (BUFCACHE_SIZE - 1);
 
     if (head + grow <= BUFCACHE_SIZE) {
@@ -503,6 +1201,11 @@ static inline uint8_t bufcache_prealloc(struct dataplane_context *ctx, uint16_t
     }
 
     ctx->bufcache_num += res;
+    ctx->bufcache_miss++;
+    bufcache_adapt(ctx, 1);
+  } else {
+    ctx->bufcache_hit++;
+    bufcache_adapt(ctx, 0);
   }
   num = MIN(num, (ctx->bufcache_head + ctx->bufcache_num <= BUFCACHE_SIZE ?
         ctx->bufcache_num : BUFCACHE_SIZE - ctx->bufcache_head));
@@ -523,30 +1226,51 @@ static inline void bufcache_alloc(struct dataplane_context *ctx, uint16_t num)
 static inline void bufcache_free(struct dataplane_context *ctx,
     struct network_buf_handle *handle)
 {
-  uint32_t head, num;
+  uint32_t head, num, keep, tail;
 
   num = ctx->bufcache_num;
-  if (num < BUFCACHE_SIZE) {
-    /* free to cache */
-    head = (ctx->bufcache_head + num) & (BUFCACHE_SIZE - 1);
-    ctx->bufcache_handles[head] = handle;
-    ctx->bufcache_num = num + 1;
-    network_buf_reset(handle);
-  } else {
-    /* free to network buffer manager */
-    network_free(1, &handle);
+  if (num >= ctx->bufcache_target) {
+    /* flush most recently freed buffers in bulk, down to half the target */
+    keep = ctx->bufcache_target / 2;
+    head = (ctx->bufcache_head + keep) & (BUFCACHE_SIZE - 1);
+    tail = (ctx->bufcache_head + num) & (BUFCACHE_SIZE - 1);
+    if (head < tail) {
+      network_free(tail - head, ctx->bufcache_handles + head);
+    } else {
+      network_free(BUFCACHE_SIZE - head, ctx->bufcache_handles + head);
+      network_free(tail, ctx->bufcache_handles);
+    }
+    num = keep;
+    ctx->bufcache_flush++;
+    bufcache_adapt(ctx, 1);
   }
+
+  /* free to cache */
+  head = (ctx->bufcache_head + num) & (BUFCACHE_SIZE - 1);
+  ctx->bufcache_handles[head] = handle;
+  ctx->bufcache_num = num + 1;
+  network_buf_reset(handle);
 }
 
 static inline void tx_flush(struct dataplane_context *ctx)
 {
   int ret;
   unsigned i;
+  uint64_t tsc;
 
   if (ctx->tx_num == 0) {
     return;
   }
 
+  /* capture before the NIC owns the buffers, unsent packets stay at the
+   * front and are only captured once */
+  if (UNLIKELY(ctx->pcap_enable & FLEXNIC_PCAP_TX) &&
+      ctx->pcap_tx_next < ctx->tx_num)
+  {
+    pcap_capture(ctx, ctx->tx_handles + ctx->pcap_tx_next,
+        ctx->tx_num - ctx->pcap_tx_next, FLEXNIC_PCAP_TX);
+  }
+
   /* try to send out packets */
   ret = network_send(&ctx->net, ctx->tx_num, ctx->tx_handles);
 
@@ -560,9 +1284,45 @@ static inline void tx_flush(struct dataplane_context *ctx)
     }
     ctx->tx_num -= ret;
   }
+  ctx->pcap_tx_next = ctx->tx_num;
+
+  /* NIC ring is full, account the time until it takes everything again */
+  if (UNLIKELY(ctx->tx_num != 0)) {
+    if (ctx->tx_stall_tsc == 0) {
+      ctx->tx_stall_tsc = rte_get_tsc_cycles();
+      ctx->stats->tx_stalls++;
+    }
+  } else if (UNLIKELY(ctx->tx_stall_tsc != 0)) {
+    tsc = rte_get_tsc_cycles();
+    ctx->stats->cyc_tx_stall += tsc - ctx->tx_stall_tsc;
+    ctx->tx_stall_tsc = 0;
+  }
+
+  /* held back packets were queued after those in the buffer, and new ones
+   * only go into the buffer once the retry ring is empty */
+  while (UNLIKELY(ctx->tx_retry_head != ctx->tx_retry_tail) &&
+      ctx->tx_num < TXBUF_SIZE)
+  {
+    ctx->tx_handles[ctx->tx_num++] =
+      ctx->tx_retry[ctx->tx_retry_head++ % TXRETRY_SIZE];
+  }
 }
 
-static void poll_scale(struct dataplane_context *ctx)
+/* Batch size for a stage given the room left in the send buffer, none until
+ * the retry ring is drained. While the NIC is backed up bulk stages (queue
+ * manager, app queues) only get half of the room, so acks and control
+ * packets keep flowing. */
+static inline uint16_t tx_budget(struct dataplane_context *ctx, uint16_t max,
+    int bulk)
+{
+  uint16_t room = TXBUF_SIZE - ctx->tx_num;
+
+  if (UNLIKELY(ctx->tx_stall_tsc != 0) && bulk)
+    room /= 2;
+  return MIN(max, room);
+}
+
+static void poll_scale(struct dataplane_context *ctx, uint32_t ts)
 {
   unsigned st = fp_scale_to;
 
@@ -586,35 +1346,185 @@ static void poll_scale(struct dataplane_context *ctx)
 
   fp_cores_cur = st;
   fp_scale_to = 0;
+  network_flow_steer_rescale();
+
+  /* let current owners hand off their flow groups */
+  dataplane_handoff(ts);
 }
 
-static void arx_cache_flush(struct dataplane_context *ctx, uint32_t ts)
+void dataplane_handoff(uint32_t ts)
 {
-  uint16_t i;
+  unsigned i;
+
+  MEM_BARRIER();
+  for (i = 0; i < fp_cores_max; i++) {
+    ctxs[i]->fg_handoff = 1;
+    util_flexnic_kick(&fp_state->kctx[i], ts);
+  }
+}
+
+/* one summary bit per fast path core */
+STATIC_ASSERT(FLEXNIC_PL_APPST_CTX_MCS <= 64, rxsum_cores);
+
+/**
+ * Write cached entries to the app rx queues and kick each context once.
+ * Entries for contexts with a full queue stay in the cache, in order, and
+ * the rx stages only receive as much as fits in the remaining cache space
+ * until the app catches up.
+ */
+void arx_cache_flush(struct dataplane_context *ctx, uint32_t ts)
+{
+  uint16_t i, k = 0, n = 0, id, c, num_ids = 0;
   struct flextcp_pl_appctx *actx;
-  struct flextcp_pl_arx *parx[BATCH_SIZE];
+  struct flextcp_pl_rxsum *rxsum;
+  struct flextcp_pl_arx *parx[BATCH_SIZE], *arx;
+  uint16_t src[BATCH_SIZE];
+  uint8_t appst[BATCH_SIZE];
+  uint64_t now, tsc;
+  /* distinct contexts in this flush (a handful at most in practice) with
+   * their written entry count and whether their queue filled up */
+  uint16_t ids[BATCH_SIZE];
+  uint8_t cnt[BATCH_SIZE], full[BATCH_SIZE], any_full = 0;
+  uint8_t slot[BATCH_SIZE];
 
   for (i = 0; i < ctx->arx_num; i++) {
-    actx = &fp_state->appctx[ctx->id][ctx->arx_ctx[i]];
-    if (fast_actx_rxq_alloc(ctx, actx, &parx[i]) != 0) {
-      /* TODO: how do we handle this? */
-      fprintf(stderr, "arx_cache_flush: no space in app rx queue\n");
-      abort();
+    id = ctx->arx_ctx[i];
+    for (c = 0; c < num_ids && ids[c] != id; c++);
+    if (c == num_ids) {
+      ids[c] = id;
+      cnt[c] = 0;
+      full[c] = 0;
+      num_ids++;
+    }
+    slot[i] = c;
+
+    actx = &fp_state->appctx[ctx->id][id];
+    if (full[c] == 0 && fast_actx_rxq_alloc(ctx, actx, &parx[k]) == 0) {
+      appst[k] = actx->appst_id;
+      src[k++] = i;
+      cnt[c]++;
+    } else {
+      full[c] = 1;
+      any_full = 1;
     }
   }
 
-  for (i = 0; i < ctx->arx_num; i++) {
+  for (i = 0; i < k; i++) {
     rte_prefetch0(parx[i]);
   }
 
-  for (i = 0; i < ctx->arx_num; i++) {
-    *parx[i] = ctx->arx_cache[i];
+  now = (k > 0 ? rte_get_tsc_cycles() : 0);
+  for (i = 0; i < k; i++) {
+    arx = &ctx->arx_cache[src[i]];
+    if (ctx->arx_tsc[src[i]] != 0) {
+      stats_hist_add(ctx, appst[i], FLEXNIC_STATS_HIST_RXARX,
+          now - ctx->arx_tsc[src[i]]);
+    }
+
+    /* the app left how long the previous entry in this slot waited */
+    tsc = parx[i]->msg.connupdate.tsc;
+    if (tsc != 0) {
+      stats_hist_add(ctx, appst[i], FLEXNIC_STATS_HIST_ARXAPP, tsc);
+    }
+
+    if (arx->type == FLEXTCP_PL_ARX_CONNUPDATE ||
+        arx->type == FLEXTCP_PL_ARX_OBJUPDATE)
+      arx->msg.connupdate.tsc = now;
+    else
+      arx->msg.connupdate.tsc = 0;
+    *parx[i] = *arx;
   }
 
-  for (i = 0; i < ctx->arx_num; i++) {
-    actx = &fp_state->appctx[ctx->id][ctx->arx_ctx[i]];
-    actx_kick(actx, ts);
+  /* entries have to be visible before the app can see the summary bit
+   * unchanged, or it might clear it and miss them */
+  if (k > 0)
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for (c = 0; c < num_ids; c++) {
+    if (cnt[c] != 0) {
+      rxsum = flexnic_info_rxsum(tas_info, ids[c]);
+      if ((rxsum->cores & (1ULL << ctx->id)) == 0)
+        __sync_fetch_and_or(&rxsum->cores, 1ULL << ctx->id);
+      actx_kick(ctx, ids[c], cnt[c], ts);
+    }
+  }
+
+  if (UNLIKELY(any_full)) {
+    /* keep the entries that didn't fit */
+    for (i = 0; i < ctx->arx_num; i++) {
+      if (full[slot[i]] == 0)
+        continue;
+
+      ctx->arx_cache[n] = ctx->arx_cache[i];
+      ctx->arx_ctx[n] = ctx->arx_ctx[i];
+      ctx->arx_tsc[n] = ctx->arx_tsc[i];
+      n++;
+    }
+    ctx->arx_backlog++;
+    ctx->stats->arx_full++;
+  }
+  ctx->arx_num = n;
+}
+
+/* endpoint (ip, port) of the capture filter, 0 matches anything */
+static inline int pcap_ep_match(uint32_t f_ip, uint16_t f_port, beui32_t ip,
+    beui16_t port)
+{
+  return (f_ip == 0 || f_ip == f_beui32(ip)) &&
+    (f_port == 0 || f_port == f_beui16(port));
+}
+
+/* record packets that match the capture filter */
+static void pcap_capture(struct dataplane_context *ctx,
+    struct network_buf_handle **bhs, unsigned n, uint8_t dir)
+{
+  struct flexnic_pcap_rec *r;
+  struct pkt_tcp *p;
+  uint64_t head = ctx->pcap_core->head, tsc = rte_get_tsc_cycles();
+  uint32_t ip0 = fp_pcap->ip[0], ip1 = fp_pcap->ip[1];
+  uint16_t port0 = fp_pcap->port[0], port1 = fp_pcap->port[1];
+  uint16_t f_fg = fp_pcap->fg, fg, len;
+  uint32_t snaplen = MIN(fp_pcap->snaplen, FLEXNIC_PCAP_SNAPLEN);
+  int tuple = (ip0 | ip1 | port0 | port1) != 0;
+  unsigned i;
+
+  for (i = 0; i < n; i++) {
+    p = network_buf_bufoff(bhs[i]);
+    len = network_buf_len(bhs[i]);
+
+    /* only TCP packets can match a 5-tuple */
+    if (tuple) {
+      if (len < sizeof(*p) || f_beui16(p->eth.type) != ETH_TYPE_IP ||
+          p->ip.proto != IP_PROTO_TCP)
+        continue;
+      if (!(pcap_ep_match(ip0, port0, p->ip.src, p->tcp.src) &&
+            pcap_ep_match(ip1, port1, p->ip.dest, p->tcp.dest)) &&
+          !(pcap_ep_match(ip1, port1, p->ip.src, p->tcp.src) &&
+            pcap_ep_match(ip0, port0, p->ip.dest, p->tcp.dest)))
+        continue;
+    }
+
+    if (f_fg != FLEXNIC_PCAP_FG_ANY) {
+      if (dir == FLEXNIC_PCAP_RX) {
+        network_buf_flowgroup(bhs[i], &fg);
+      } else if (fast_flows_tx_flowgroup(bhs[i], &fg) != 0) {
+        continue;
+      }
+      if (fg != f_fg)
+        continue;
+    }
+
+    r = &ctx->pcap_recs[head & (FLEXNIC_PCAP_RECS - 1)];
+    r->tsc = tsc;
+    r->len = MIN(network_buf_pktlen(bhs[i]), UINT16_MAX);
+    r->caplen = MIN(len, snaplen);
+    r->dir = dir;
+    r->port = network_buf_port(bhs[i]);
+    memcpy(r->data, p, r->caplen);
+    head++;
   }
 
-  ctx->arx_num = 0;
+  /* readers drop records the head has moved past by a full ring */
+  MEM_BARRIER();
+  ctx->pcap_core->head = head;
 }
@@ -26,19 +26,31 @@
 #define FASTEMU_H_
 
 
+#include <tas_trace.h>
+#include <rte_cycles.h>
+
 #include "tcp_common.h"
 
 /*****************************************************************************/
+/* fastemu.c */
+/** Write cached app rx queue entries, entries that don't fit are kept */
+void arx_cache_flush(struct dataplane_context *ctx, uint32_t ts)
+  __attribute__((noinline));
+
 /* fast_kernel.c */
 int fast_kernel_poll(struct dataplane_context *ctx,
     struct network_buf_handle *nbh, uint32_t ts);
 void fast_kernel_packet(struct dataplane_context *ctx,
     struct network_buf_handle *nbh);
+int fast_kernel_ccactive(struct dataplane_context *ctx, uint32_t flow_id);
+int fast_kernel_ccactive_flush(struct dataplane_context *ctx);
+int fast_kernel_connmoved(struct dataplane_context *ctx, uint32_t flow_id,
+    uint16_t db);
 
 /* fast_appctx.c */
 void fast_appctx_poll_pf(struct dataplane_context *ctx, uint32_t id);
-int fast_appctx_poll_fetch(struct dataplane_context *ctx, uint32_t id,
-    void **pqe);
+unsigned fast_appctx_poll_fetch(struct dataplane_context *ctx, uint32_t id,
+    void **pqes, unsigned max);
 int fast_appctx_poll_bump(struct dataplane_context *ctx, void *pqe,
     struct network_buf_handle *nbh, uint32_t ts);
 
@@ -56,40 +68,144 @@ void fast_flows_qman_pfbufs(struct dataplane_context *ctx, uint32_t *queues,
 int fast_flows_qman(struct dataplane_context *ctx, uint32_t queue,
     struct network_buf_handle *nbh, uint32_t ts);
 int fast_flows_qman_fwd(struct dataplane_context *ctx,
-    struct flextcp_pl_flowst *fs);
-int fast_flows_packet(struct dataplane_context *ctx,
-    struct network_buf_handle *nbh, void *fs, struct tcp_opts *opts,
-    uint32_t ts);
+    struct flextcp_pl_flowst *fs, uint32_t ts);
+void fast_flows_packet(struct dataplane_context *ctx,
+    struct network_buf_handle **nbhs, void *fs, struct tcp_opts *opts,
+    uint16_t n, uint32_t ts, int *rets);
+int fast_flows_packet_gro_check(struct network_buf_handle *prev,
+    struct network_buf_handle *next);
 void fast_flows_packet_fss(struct dataplane_context *ctx,
     struct network_buf_handle **nbhs, void **fss, uint16_t n);
+/** Flow table hash of received packets, used for software steering */
+void fast_flows_packet_hash(struct network_buf_handle **nbhs,
+    uint32_t *hashes, uint16_t n);
 void fast_flows_packet_parse(struct dataplane_context *ctx,
     struct network_buf_handle **nbhs, void **fss, struct tcp_opts *tos,
     uint16_t n);
 void fast_flows_packet_pfbufs(struct dataplane_context *ctx,
     void **fss, uint16_t n);
+/** Flow group of the flow a sent packet belongs to, -1 if it has none */
+int fast_flows_tx_flowgroup(struct network_buf_handle *nbh, uint16_t *fg);
 
 int fast_flows_bump(struct dataplane_context *ctx, uint32_t flow_id,
     uint16_t bump_seq, uint32_t rx_tail, uint32_t tx_head, uint8_t flags,
     struct network_buf_handle *nbh, uint32_t ts);
-void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id);
+int fast_flows_bump_fwd(struct dataplane_context *ctx,
+    struct network_buf_handle *nbh, uint32_t ts);
+void fast_flows_retransmit(struct dataplane_context *ctx, uint32_t flow_id,
+    uint32_t ts);
+void fast_flows_rto(struct dataplane_context *ctx, uint32_t flow_id,
+    uint32_t ts);
+void fast_flows_rto_fwd(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts);
+int fast_flows_delack(struct dataplane_context *ctx, uint32_t flow_id,
+    struct network_buf_handle *nbh, uint32_t ts);
+void fast_flows_delack_fwd(struct dataplane_context *ctx,
+    struct flextcp_pl_flowst *fs, uint32_t ts);
+int fast_flows_disable(struct dataplane_context *ctx,
+    struct flextcp_pl_ktx *ktx, uint32_t ts);
+int fast_flows_resize(struct dataplane_context *ctx,
+    struct flextcp_pl_ktx *ktx, uint32_t ts);
+int fast_flows_move(struct dataplane_context *ctx,
+    struct flextcp_pl_atx *atx, uint32_t ts);
+int fast_flows_txresize(struct dataplane_context *ctx,
+    struct flextcp_pl_atx *atx, uint32_t ts);
+
+/** Forwarding ring message types, ring carries (type, pointer) pairs */
+/** Queue manager event, pointer is flow state */
+#define FLOW_FWD_QMAN 1
+/** Received packet, pointer is network buffer handle */
+#define FLOW_FWD_PACKET 2
+/** Application bump, pointer is network buffer handle holding the bump */
+#define FLOW_FWD_BUMP 3
+/** Kernel retransmit request, pointer is flow state */
+#define FLOW_FWD_RETRANSMIT 4
+/** Kernel connection disable, pointer is kernel tx queue entry */
+#define FLOW_FWD_DISABLE 5
+/** Kernel receive buffer resize, pointer is kernel tx queue entry */
+#define FLOW_FWD_RESIZE 6
+/** Retransmission timer expired on previous owner, pointer is flow state */
+#define FLOW_FWD_RTO 7
+/** Application connection move, pointer is app tx queue entry */
+#define FLOW_FWD_MOVE 8
+/** Delayed ack due on previous owner, pointer is flow state */
+#define FLOW_FWD_DELACK 9
+/** Application transmit buffer switch, pointer is app tx queue entry */
+#define FLOW_FWD_TXRESIZE 10
+int fast_flows_fwd(struct dataplane_context *ctx, uint16_t core,
+    uintptr_t type, void *p, uint32_t ts);
 
 /*****************************************************************************/
 /* Helpers */
 
-static inline void tx_send(struct dataplane_context *ctx,
+/** Trace event if its type is enabled, arguments are only evaluated then */
+#define LTRACE(ctx, ev, flow, a, b, c, d) \
+  do { \
+    if (UNLIKELY((ctx)->ltrace_mask & (1U << (ev)))) \
+      ltrace_record(ctx, ev, flow, a, b, c, d); \
+  } while (0)
+
+static inline void ltrace_record(struct dataplane_context *ctx, uint16_t type,
+    uint32_t flow_id, uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  struct flexnic_ltrace_rec *r;
+  uint64_t head;
+
+  if (ctx->ltrace_sample > 1 && flow_id != FLEXNIC_LTRACE_NOFLOW &&
+      flow_id % ctx->ltrace_sample != 0)
+    return;
+
+  head = ctx->ltrace_core->head;
+  r = &ctx->ltrace_recs[head & (FLEXNIC_LTRACE_RECS - 1)];
+  r->tsc = rte_get_tsc_cycles();
+  r->flow_id = flow_id;
+  r->type = type;
+  r->a = a;
+  r->b = b;
+  r->c = c;
+  r->d = d;
+
+  /* readers drop records the head has moved past by a full ring */
+  MEM_BARRIER();
+  ctx->ltrace_core->head = head + 1;
+}
+
+/** Add sample to latency histogram `h` (FLEXNIC_STATS_HIST_*) of app `appst` */
+static inline void stats_hist_add(struct dataplane_context *ctx,
+    uint32_t appst, unsigned h, uint64_t v)
+{
+  struct flexnic_stats_hist *hist = &ctx->hists[appst][h];
+
+  hist->count++;
+  hist->sum += v;
+  hist->buckets[flexnic_stats_hist_bucket(v)]++;
+}
+
+/** Queue packet for transmission, returns -1 if it was dropped and freed */
+static inline int tx_send(struct dataplane_context *ctx,
     struct network_buf_handle *nbh, uint16_t off, uint16_t len)
 {
   uint32_t i = ctx->tx_num;
 
-  if (i >= TXBUF_SIZE) {
-    fprintf(stderr, "tx_send: transmit buffer full, unexpected\n");
-    abort();
-  }
-
   network_buf_setoff(nbh, off);
   network_buf_setlen(nbh, len);
-  ctx->tx_handles[i] = nbh;
-  ctx->tx_num = i + 1;
+
+  /* stages size their batches to the room left, but if the NIC is backed up
+   * the packet waits in the retry ring, or is dropped once that is full */
+  if (UNLIKELY(i >= TXBUF_SIZE)) {
+    if (ctx->tx_retry_tail - ctx->tx_retry_head >= TXRETRY_SIZE) {
+      ctx->stats->drops[FLEXNIC_STATS_DROP_TXFULL]++;
+      network_buf_free(nbh);
+      return -1;
+    }
+    ctx->tx_retry[ctx->tx_retry_tail++ % TXRETRY_SIZE] = nbh;
+  } else {
+    ctx->tx_handles[i] = nbh;
+    ctx->tx_num = i + 1;
+  }
+  ctx->stats->tx_pkts++;
+  ctx->stats->tx_bytes += len;
+  return 0;
 }
 
 static inline uint16_t tx_xsum_enable(struct network_buf_handle *nbh,
@@ -99,13 +215,65 @@ static inline uint16_t tx_xsum_enable(struct network_buf_handle *nbh,
       ip_s, ip_d, IP_PROTO_TCP, l3_paylen);
 }
 
+/* callers make sure there is room for one entry per received run, see
+ * arx_cache_room */
 static inline void arx_cache_add(struct dataplane_context *ctx, uint16_t ctx_id,
     uint64_t opaque, uint32_t rx_bump, uint32_t rx_pos, uint32_t tx_bump,
     uint16_t type_flags)
 {
-  uint16_t id = ctx->arx_num++;
+  struct flextcp_pl_arx_connupdate *cu;
+  uint16_t id;
+
+  /* merge with pending update for the same connection, the first rx_pos is
+   * kept as that's where the new data starts. Only the last entry for the
+   * connection can take it, anything queued after an update (resize, offer,
+   * move) has to be seen by the app before the data that follows it. */
+  if ((type_flags & 0xff) == FLEXTCP_PL_ARX_CONNUPDATE) {
+    for (id = ctx->arx_num; id > 0; id--) {
+      cu = &ctx->arx_cache[id - 1].msg.connupdate;
+      if (cu->opaque != opaque)
+        continue;
+
+      if (ctx->arx_ctx[id - 1] == ctx_id &&
+          ctx->arx_cache[id - 1].type == FLEXTCP_PL_ARX_CONNUPDATE)
+      {
+        cu->rx_bump += rx_bump;
+        cu->tx_bump += tx_bump;
+        cu->flags |= type_flags >> 8;
+        if (ctx->arx_tsc[id - 1] == 0)
+          ctx->arx_tsc[id - 1] = ctx->rx_tsc;
+        return;
+      }
+      break;
+    }
+  }
+
+  /* objects of a flow can go to different contexts, so only the last update
+   * for the flow can take more objects, the app splits them up again */
+  if ((type_flags & 0xff) == FLEXTCP_PL_ARX_OBJUPDATE) {
+    for (id = ctx->arx_num; id > 0; id--) {
+      cu = &ctx->arx_cache[id - 1].msg.connupdate;
+      if (cu->opaque != opaque)
+        continue;
+
+      if (ctx->arx_ctx[id - 1] == ctx_id &&
+          ctx->arx_cache[id - 1].type == FLEXTCP_PL_ARX_OBJUPDATE)
+      {
+        cu->rx_bump += rx_bump;
+        cu->tx_bump += tx_bump;
+        cu->flags |= type_flags >> 8;
+        if (ctx->arx_tsc[id - 1] == 0)
+          ctx->arx_tsc[id - 1] = ctx->rx_tsc;
+        return;
+      }
+      break;
+    }
+  }
+
+  id = ctx->arx_num++;
 
   ctx->arx_ctx[id] = ctx_id;
+  ctx->arx_tsc[id] = ctx->rx_tsc;
   ctx->arx_cache[id].type = type_flags & 0xff;
   ctx->arx_cache[id].msg.connupdate.opaque = opaque;
   ctx->arx_cache[id].msg.connupdate.rx_bump = rx_bump;
@@ -114,14 +282,137 @@ static inline void arx_cache_add(struct dataplane_context *ctx, uint16_t ctx_id,
   ctx->arx_cache[id].msg.connupdate.flags = type_flags >> 8;
 }
 
-static inline void actx_kick(struct flextcp_pl_appctx *ctx, uint32_t ts_us)
+/* notify app that the receive buffer was replaced, ordered after all
+ * earlier updates for the flow from this core */
+static inline void arx_cache_add_resize(struct dataplane_context *ctx,
+    uint16_t ctx_id, uint64_t opaque, uint64_t rx_base, uint32_t rx_len)
 {
-  if(UNLIKELY(ts_us - ctx->last_ts > POLL_CYCLE)) {
-    util_flexnic_kick(ctx, ts_us);
+  uint16_t id = ctx->arx_num++;
+
+  ctx->arx_ctx[id] = ctx_id;
+  ctx->arx_tsc[id] = 0;
+  ctx->arx_cache[id].type = FLEXTCP_PL_ARX_CONNRESIZE;
+  ctx->arx_cache[id].msg.connresize.opaque = opaque;
+  ctx->arx_cache[id].msg.connresize.rx_base = rx_base;
+  ctx->arx_cache[id].msg.connresize.rx_len = rx_len;
+}
+
+/* offer the app a new transmit buffer for the flow */
+static inline void arx_cache_add_txoffer(struct dataplane_context *ctx,
+    uint16_t ctx_id, uint64_t opaque, uint64_t tx_base, uint32_t tx_len)
+{
+  uint16_t id = ctx->arx_num++;
+
+  ctx->arx_ctx[id] = ctx_id;
+  ctx->arx_tsc[id] = 0;
+  ctx->arx_cache[id].type = FLEXTCP_PL_ARX_TXOFFER;
+  ctx->arx_cache[id].msg.txoffer.opaque = opaque;
+  ctx->arx_cache[id].msg.txoffer.tx_base = tx_base;
+  ctx->arx_cache[id].msg.txoffer.tx_len = tx_len;
+}
+
+/* answer a transmit buffer switch, ordered after all earlier updates for the
+ * flow from this core */
+static inline void arx_cache_add_txresized(struct dataplane_context *ctx,
+    uint16_t ctx_id, uint64_t opaque, int32_t status)
+{
+  uint16_t id = ctx->arx_num++;
+
+  ctx->arx_ctx[id] = ctx_id;
+  ctx->arx_tsc[id] = 0;
+  ctx->arx_cache[id].type = FLEXTCP_PL_ARX_TXRESIZED;
+  ctx->arx_cache[id].msg.txresized.opaque = opaque;
+  ctx->arx_cache[id].msg.txresized.status = status;
+}
+
+/* tell the app context the flow was moved away, ordered after all earlier
+ * updates for the flow from this core */
+static inline void arx_cache_add_moved(struct dataplane_context *ctx,
+    uint16_t ctx_id, uint64_t opaque, int32_t status)
+{
+  uint16_t id = ctx->arx_num++;
+
+  ctx->arx_ctx[id] = ctx_id;
+  ctx->arx_tsc[id] = 0;
+  ctx->arx_cache[id].type = FLEXTCP_PL_ARX_CONNMOVED;
+  ctx->arx_cache[id].msg.connmoved.opaque = opaque;
+  ctx->arx_cache[id].msg.connmoved.status = status;
+}
+
+/* number of arx entries that can still be added before the next flush */
+static inline uint16_t arx_cache_room(struct dataplane_context *ctx)
+{
+  return BATCH_SIZE - ctx->arx_num;
+}
+
+static inline void actx_notify(struct dataplane_context *ctx, uint16_t id,
+    uint32_t ts_us)
+{
+  struct flextcp_pl_appctx *actx = &fp_state->appctx[ctx->id][id];
+
+  actx->notify_pending = 0;
+  ctx->notify_mask[id / 64] &= ~(1ULL << (id % 64));
+  ctx->notify_num--;
+  util_flexnic_kick(actx, ts_us);
+}
+
+/* Kick app context after num rx entries were added. An app that saw entries
+ * within the last POLL_CYCLE is still polling and not kicked. A blocked app
+ * with moderation is only woken once notify_count entries are pending or
+ * notify_delay has passed since the first one, see fast_notify_poll. */
+static inline void actx_kick(struct dataplane_context *ctx, uint16_t id,
+    uint16_t num, uint32_t ts_us)
+{
+  struct flextcp_pl_appctx *actx = &fp_state->appctx[ctx->id][id];
+  uint32_t pending;
+
+  if (UNLIKELY(actx->notify_pending != 0)) {
+    pending = actx->notify_pending + num;
+    actx->notify_pending = MIN(pending, UINT16_MAX);
+    if ((actx->notify_count != 0 && pending >= actx->notify_count) ||
+        ts_us - actx->notify_ts >= actx->notify_delay)
+    {
+      actx_notify(ctx, id, ts_us);
+    }
     return;
   }
 
-  ctx->last_ts = ts_us;
+  if(UNLIKELY(ts_us - actx->last_ts > POLL_CYCLE)) {
+    if (actx->notify_delay != 0 &&
+        (actx->notify_count == 0 || num < actx->notify_count))
+    {
+      actx->notify_pending = num;
+      actx->notify_ts = ts_us;
+      ctx->notify_mask[id / 64] |= 1ULL << (id % 64);
+      ctx->notify_num++;
+      return;
+    }
+    util_flexnic_kick(actx, ts_us);
+    return;
+  }
+
+  actx->last_ts = ts_us;
+}
+
+/* deliver moderated notifications whose delay has passed */
+static inline void fast_notify_poll(struct dataplane_context *ctx,
+    uint32_t ts_us)
+{
+  struct flextcp_pl_appctx *actx;
+  uint64_t m;
+  uint16_t id, w;
+
+  for (w = 0; w < FLEXNIC_PL_APPCTX_NUM / 64; w++) {
+    m = ctx->notify_mask[w];
+    while (m != 0) {
+      id = w * 64 + __builtin_ctzll(m);
+      m &= m - 1;
+
+      actx = &fp_state->appctx[ctx->id][id];
+      if (ts_us - actx->notify_ts >= actx->notify_delay)
+        actx_notify(ctx, id, ts_us);
+    }
+  }
 }
 
 #endif /* ndef FASTEMU_H_ */
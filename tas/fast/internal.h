@@ -32,6 +32,8 @@
 #include <rte_ether.h>
 
 #define BUFFER_SIZE 2048
+/** Buffer size for TSO segments, data room has to fit in 16 bits */
+#define TSO_BUFFER_SIZE (64 * 1024 - 256)
 
 //#define FLEXNIC_TRACING
 #ifdef FLEXNIC_TRACING
@@ -69,6 +71,17 @@ int qman_poll(struct qman_thread *t, unsigned num, unsigned *q_ids,
 int qman_set(struct qman_thread *t, uint32_t id, uint32_t rate, uint32_t avail,
     uint16_t max_chunk, uint8_t flags);
 uint32_t qman_next_ts(struct qman_thread *t, uint32_t cur_ts);
+/** Number of rate limited queues waiting for their next transmission */
+uint32_t qman_waiting(struct qman_thread *t);
+
+/** Arm retransmission timer for queue, if already armed only if rearm != 0 */
+void qman_rto_set(struct qman_thread *t, uint32_t id, uint32_t deadline,
+    int rearm);
+/** Disarm retransmission timer for queue */
+void qman_rto_clear(struct qman_thread *t, uint32_t id);
+/** Collect up to num queues with expired retransmission timers */
+unsigned qman_rto_poll(struct qman_thread *t, uint32_t cur_ts, unsigned num,
+    uint32_t *ids);
 
 void *util_create_shmsiszed(const char *name, size_t size, void *addr);
 
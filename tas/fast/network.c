@@ -23,6 +23,8 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include <rte_config.h>
@@ -34,19 +36,46 @@
 #include <rte_mempool.h>
 #include <rte_mbuf.h>
 #include <rte_ip.h>
+#include <rte_spinlock.h>
+#include <rte_version.h>
 
 #include <utils.h>
 #include <utils_rng.h>
+#include <utils_timeout.h>
 #include <tas_memif.h>
 #include "internal.h"
 
-#define PERTHREAD_MBUFS 2048
+#define PERTHREAD_MBUFS 4096
 #define MBUF_SIZE (BUFFER_SIZE + sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
+#define PERTHREAD_TSO_MBUFS 128
+#define TSO_MBUF_SIZE (TSO_BUFFER_SIZE + sizeof(struct rte_mbuf) + \
+    RTE_PKTMBUF_HEADROOM)
+#define PERTHREAD_ZC_MBUFS 4096
+#define ZC_MBUF_SIZE (sizeof(struct rte_mbuf) + RTE_PKTMBUF_HEADROOM)
+#define ZC_PAGE_SIZE (2 * 1024 * 1024)
 #define RX_DESCRIPTORS 256
+/* per lcore mempool cache, buffers freed by the PMD on tx completion go
+ * back there first. Capped at 1/8 of the pool for small pools. */
+#define MEMPOOL_CACHE_MAX 256
+#define MEMPOOL_CACHE_MIN 32
+
+/* zero-copy transmit needs external buffers in mbufs and pinned memory */
+#if RTE_VERSION >= RTE_VERSION_NUM(18, 5, 0, 0) && \
+    defined(FLEXNIC_USE_HUGEPAGES)
+# define NET_ZEROCOPY_SUPPORTED 1
+#endif
 #define TX_DESCRIPTORS 128
+/* flow groups with software steering, the packet hash has no limit */
+#define SW_RSS_FLOWGROUPS 512
 
 static int device_running = 0;
-uint8_t net_port_id = 0;
+uint8_t net_ports_num = 0;
+uint16_t net_port_ids[FLEXNIC_PL_NET_PORTS];
+uint8_t net_port_idx[RTE_MAX_ETHPORTS];
+struct ether_addr net_port_macs[FLEXNIC_PL_NET_PORTS];
+uint8_t net_tso_enabled = 0;
+uint8_t net_tx_zerocopy = 0;
+uint8_t net_sw_rss = 0;
 static const struct rte_eth_conf port_conf = {
     .rxmode = {
       .split_hdr_size = 0,
@@ -74,52 +103,175 @@ static unsigned num_threads;
 static volatile unsigned next_id;
 static struct network_rx_thread **net_threads;
 
+/** Per port device state, each port has its own copy of the RETA */
+struct network_port {
+  struct rte_eth_dev_info devinfo;
+  uint16_t reta_size;
+  struct rte_eth_rss_reta_entry64 *reta;
+};
+static struct network_port ports[FLEXNIC_PL_NET_PORTS];
 static struct rte_eth_dev_info eth_devinfo;
 struct ether_addr eth_addr;
 
+/* flow group -> core mapping, applied to the RETA of every port */
 uint16_t rss_reta_size;
 static struct rte_eth_rss_reta_entry64 *rss_reta = NULL;
 static uint16_t *rss_core_buckets = NULL;
 
-static struct rte_mempool *mempool_alloc(void);
+/** Exact match rules steering one connection to a core, on all ports */
+struct network_flow_rule {
+  uint32_t flow_id;
+  /* app context the flow should follow */
+  uint16_t db;
+  /* core rules point to, FLEXNIC_PL_FLOWST_NOSTEER if none installed */
+  uint16_t core;
+  struct rte_flow *flows[FLEXNIC_PL_NET_PORTS];
+};
+/* rules are changed by the slow path and by core 0 when scaling */
+static rte_spinlock_t flow_rules_lock = RTE_SPINLOCK_INITIALIZER;
+static struct network_flow_rule *flow_rules = NULL;
+static unsigned flow_rules_num = 0;
+
+#ifdef NET_ZEROCOPY_SUPPORTED
+/** IO addresses for each page in the dma memory region */
+static rte_iova_t *zc_iovas = NULL;
+#endif
+
+static struct rte_mempool *mempool_alloc(const char *prefix, unsigned num,
+    size_t mbuf_size);
+static int zerocopy_init(void);
 static int reta_setup(void);
+static int reta_update(void);
+static int flow_rule_install(struct network_flow_rule *r, uint16_t core);
+static void flow_rule_remove(struct network_flow_rule *r);
 
 int network_init(unsigned n_threads)
 {
-  uint8_t count;
+  uint8_t count, i;
+  uint16_t port, rx_queues = n_threads;
+  struct rte_eth_conf conf;
+  uint64_t rx_offloads;
   int ret;
 
   num_threads = n_threads;
   next_id = 0;
 
+  /* with software steering only the first cores get rx queues, the NIC can
+   * spread packets over those with whatever RSS it has */
+  if (config.fp_sw_rss > SW_RSS_MAX) {
+    fprintf(stderr, "network_init: at most %u cores can receive with "
+        "software steering\n", SW_RSS_MAX);
+    return -1;
+  }
+  net_sw_rss = MIN(config.fp_sw_rss, n_threads);
+  if (net_sw_rss > 0) {
+    rx_queues = net_sw_rss;
+    /* set up front, cores already dispatch while the last one finishes
+     * reta_setup */
+    rss_reta_size = SW_RSS_FLOWGROUPS;
+  }
+
   /* allocate thread pointer arrays */
   net_threads = rte_calloc("net thread ptrs", n_threads, sizeof(*net_threads), 0);
   if (net_threads == NULL) {
     goto error_exit;
   }
 
-  /* make sure there is only one port */
   count = rte_eth_dev_count();
   if (count == 0) {
     fprintf(stderr, "No ethernet devices\n");
     goto error_exit;
-  } else if (count > 1) {
-    fprintf(stderr, "Multiple ethernet devices\n");
+  } else if (count > FLEXNIC_PL_NET_PORTS) {
+    fprintf(stderr, "network_init: %u ethernet devices, at most %u "
+        "supported\n", count, FLEXNIC_PL_NET_PORTS);
     goto error_exit;
   }
+  net_ports_num = count;
+
+  for (i = 0; i < net_ports_num; i++) {
+    port = net_port_ids[i] = i;
+    net_port_idx[port] = i;
+
+    /* virtual devices (--vdev=net_ring0, net_pcap0, net_null0) have no RSS,
+     * everything they receive ends up on the first queue in flow group 0 */
+    rte_eth_dev_info_get(port, &ports[i].devinfo);
+    conf = port_conf;
+    if (ports[i].devinfo.flow_type_rss_offloads == 0 || rx_queues == 1) {
+      conf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+      conf.rx_adv_conf.rss_conf.rss_hf = 0;
+    }
 
-  /* initialize port */
-  ret = rte_eth_dev_configure(net_port_id, n_threads, n_threads, &port_conf);
-  if (ret < 0) {
-    fprintf(stderr, "rte_eth_dev_configure failed\n");
-    goto error_exit;
+    /* have the NIC validate checksums and timestamp packets where it can,
+     * packets tell from their flags whether it did */
+    rx_offloads = ports[i].devinfo.rx_offload_capa &
+      (DEV_RX_OFFLOAD_IPV4_CKSUM | DEV_RX_OFFLOAD_TCP_CKSUM);
+    if (config.fp_rx_tstamp != 0) {
+      if ((ports[i].devinfo.rx_offload_capa & DEV_RX_OFFLOAD_TIMESTAMP) != 0) {
+        rx_offloads |= DEV_RX_OFFLOAD_TIMESTAMP;
+      } else {
+        fprintf(stderr, "network_init: rx timestamps requested but not "
+            "supported by port %u, using poll times\n", port);
+      }
+    }
+    if (rx_offloads != 0) {
+      conf.rxmode.ignore_offload_bitfield = 1;
+      conf.rxmode.offloads = rx_offloads;
+    }
+
+    /* initialize port */
+    ret = rte_eth_dev_configure(port, rx_queues, n_threads, &conf);
+    if (ret < 0) {
+      fprintf(stderr, "rte_eth_dev_configure(%u) failed\n", port);
+      goto error_exit;
+    }
+
+    rte_eth_dev_info_get(port, &ports[i].devinfo);
+    ports[i].devinfo.default_txconf.txq_flags = ETH_TXQ_FLAGS_NOVLANOFFL;
+
+    /* bonded ports all use the mac address of the first port, so the peer
+     * can't tell which one a flow went out on */
+    if (config.fp_bond && i > 0 &&
+        rte_eth_dev_default_mac_addr_set(port, &net_port_macs[0]) != 0)
+    {
+      fprintf(stderr, "network_init: setting mac address on port %u "
+          "failed\n", port);
+      goto error_exit;
+    }
+    rte_eth_macaddr_get(port, &net_port_macs[i]);
+  }
+
+  /* first port is used for the primary address, and offloads are only used
+   * if supported on all ports */
+  eth_addr = net_port_macs[0];
+  eth_devinfo = ports[0].devinfo;
+  for (i = 1; i < net_ports_num; i++) {
+    eth_devinfo.tx_offload_capa &= ports[i].devinfo.tx_offload_capa;
   }
 
-  /* get mac address and device info */
-  rte_eth_macaddr_get(net_port_id, &eth_addr);
-  rte_eth_dev_info_get(net_port_id, &eth_devinfo);
-  eth_devinfo.default_txconf.txq_flags = ETH_TXQ_FLAGS_NOVLANOFFL;
+  /* only use TSO if the NIC can actually do it */
+  if (config.fp_tso) {
+    if ((eth_devinfo.tx_offload_capa & DEV_TX_OFFLOAD_TCP_TSO) != 0) {
+      net_tso_enabled = 1;
+    } else {
+      fprintf(stderr, "network_init: TSO requested but not supported by NIC, "
+          "disabling\n");
+    }
+  }
 
+  if (config.fp_tx_zerocopy && zerocopy_init() != 0) {
+    fprintf(stderr, "network_init: zero-copy transmit not available, "
+        "disabling\n");
+  }
+
+  /* rules steer to the rx queue of a core, which most don't have here */
+  if (config.fp_flow_rules > 0 && net_sw_rss > 0) {
+    fprintf(stderr, "network_init: no flow rules with software steering\n");
+  } else if (config.fp_flow_rules > 0 && (flow_rules = rte_calloc("flow rules",
+          config.fp_flow_rules, sizeof(*flow_rules), 0)) == NULL)
+  {
+    fprintf(stderr, "network_init: allocating flow rules failed\n");
+    goto error_exit;
+  }
 
   return 0;
 
@@ -130,56 +282,111 @@ error_exit:
 
 void network_cleanup(void)
 {
-  rte_eth_dev_stop(net_port_id);
+  unsigned i;
+
+  for (i = 0; i < flow_rules_num; i++) {
+    flow_rule_remove(&flow_rules[i]);
+  }
+  rte_free(flow_rules);
+
+  for (i = 0; i < net_ports_num; i++) {
+    rte_eth_dev_stop(net_port_ids[i]);
+  }
   rte_free(net_threads);
 }
 
+const struct ether_addr *network_port_mac(uint8_t port)
+{
+  return &net_port_macs[port < net_ports_num ? port : 0];
+}
+
+int network_port_node(void)
+{
+  return rte_eth_dev_socket_id(net_port_ids[0]);
+}
+
 void network_dump_stats(void)
 {
   struct rte_eth_stats stats;
-  if (rte_eth_stats_get(0, &stats) == 0) {
-    fprintf(stderr, "network stats: ipackets=%"PRIu64" opackets=%"PRIu64
-        " ibytes=%"PRIu64" obytes=%"PRIu64" imissed=%"PRIu64" ierrors=%"PRIu64
-        " oerrors=%"PRIu64" rx_nombuf=%"PRIu64"\n", stats.ipackets,
-        stats.opackets, stats.ibytes, stats.obytes, stats.imissed,
-        stats.ierrors, stats.oerrors, stats.rx_nombuf);
-  } else {
-    fprintf(stderr, "failed to get stats\n");
+  uint8_t i;
+
+  for (i = 0; i < net_ports_num; i++) {
+    if (rte_eth_stats_get(net_port_ids[i], &stats) == 0) {
+      fprintf(stderr, "network stats port %u: ipackets=%"PRIu64" opackets=%"
+          PRIu64" ibytes=%"PRIu64" obytes=%"PRIu64" imissed=%"PRIu64
+          " ierrors=%"PRIu64" oerrors=%"PRIu64" rx_nombuf=%"PRIu64"\n", i,
+          stats.ipackets, stats.opackets, stats.ibytes, stats.obytes,
+          stats.imissed, stats.ierrors, stats.oerrors, stats.rx_nombuf);
+    } else {
+      fprintf(stderr, "failed to get stats for port %u\n", i);
+    }
   }
 }
 
 int network_thread_init(struct dataplane_context *ctx)
 {
   struct network_thread *t = &ctx->net;
+  unsigned mbufs = PERTHREAD_MBUFS;
+  uint8_t i;
   int ret;
 
+  /* cores receiving for others with software steering need buffers for the
+   * packets sitting in their rings and buffer caches too */
+  t->rx_nic = (net_sw_rss == 0 || ctx->id < net_sw_rss);
+  if (net_sw_rss > 0 && t->rx_nic) {
+    mbufs *= (num_threads + net_sw_rss - 1) / net_sw_rss;
+  }
+
   /* allocate mempool */
-  if ((t->pool = mempool_alloc()) == NULL) {
+  if ((t->pool = mempool_alloc("mbuf_pool", mbufs, MBUF_SIZE)) == NULL) {
     goto error_mpool;
   }
 
-  /* initialize rx queue */
-  t->queue_id = ctx->id;
-  ret = rte_eth_rx_queue_setup(net_port_id, t->queue_id, RX_DESCRIPTORS,
-          rte_socket_id(), &eth_devinfo.default_rxconf, t->pool);
-  if (ret != 0) {
-    goto error_rx_queue;
+  /* allocate mempool for large TSO segments */
+  if (net_tso_enabled && (t->tso_pool = mempool_alloc("mbuf_tso_pool",
+          PERTHREAD_TSO_MBUFS, TSO_MBUF_SIZE)) == NULL)
+  {
+    fprintf(stderr, "network_thread_init: allocating tso pool failed\n");
+    goto error_mpool;
   }
 
-  /* initialize queue */
+  /* allocate mempool for mbufs referencing flow tx buffers */
+  if (net_tx_zerocopy && (t->zc_pool = mempool_alloc("mbuf_zc_pool",
+          PERTHREAD_ZC_MBUFS, ZC_MBUF_SIZE)) == NULL)
+  {
+    fprintf(stderr, "network_thread_init: allocating zc pool failed\n");
+    goto error_mpool;
+  }
+
+  /* one rx and tx queue per port, with the same queue id on all ports */
   t->queue_id = ctx->id;
-  ret = rte_eth_tx_queue_setup(net_port_id, t->queue_id, TX_DESCRIPTORS,
-          rte_socket_id(), &eth_devinfo.default_txconf);
-  if (ret != 0) {
-    fprintf(stderr, "network_tx_thread_init: rte_eth_tx_queue_setup failed\n");
-    goto error_tx_queue;
+  t->rx_port = 0;
+  for (i = 0; i < net_ports_num; i++) {
+    /* initialize rx queue */
+    ret = (t->rx_nic ? rte_eth_rx_queue_setup(net_port_ids[i], t->queue_id,
+          RX_DESCRIPTORS, rte_socket_id(), &ports[i].devinfo.default_rxconf,
+          t->pool) : 0);
+    if (ret != 0) {
+      goto error_rx_queue;
+    }
+
+    /* initialize tx queue */
+    ret = rte_eth_tx_queue_setup(net_port_ids[i], t->queue_id, TX_DESCRIPTORS,
+            rte_socket_id(), &ports[i].devinfo.default_txconf);
+    if (ret != 0) {
+      fprintf(stderr, "network_tx_thread_init: rte_eth_tx_queue_setup "
+          "failed\n");
+      goto error_tx_queue;
+    }
   }
 
-  /* start device if this was the last queue */
+  /* start devices if this was the last queue */
   if (num_threads == __sync_add_and_fetch(&next_id, 1)) {
-    if (rte_eth_dev_start(net_port_id) != 0) {
-      fprintf(stderr, "rte_eth_dev_start failed\n");
-      goto error_tx_queue;
+    for (i = 0; i < net_ports_num; i++) {
+      if (rte_eth_dev_start(net_port_ids[i]) != 0) {
+        fprintf(stderr, "rte_eth_dev_start(%u) failed\n", net_port_ids[i]);
+        goto error_tx_queue;
+      }
     }
 
     /* setting up RETA failed */
@@ -205,33 +412,182 @@ error_mpool:
 int network_rx_interrupt_ctl(struct network_thread *t, int turnon)
 {
   static int __thread initialized = 0;
+  static int __thread unsupported = 0;
+  uint8_t i;
+  int ret = 0;
 
-  if(!device_running) {
+  if(!device_running || unsupported) {
     return 1;
   }
 
+  /* nothing to arm, dispatching cores kick this one */
+  if (!t->rx_nic) {
+    return 0;
+  }
+
   if(turnon) {
     if(!initialized) {
-      int ret = rte_eth_dev_rx_intr_ctl_q(net_port_id, t->queue_id,
-          RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL);
-      assert(ret == 0);
+      for (i = 0; i < net_ports_num; i++) {
+        ret = rte_eth_dev_rx_intr_ctl_q(net_port_ids[i], t->queue_id,
+            RTE_EPOLL_PER_THREAD, RTE_INTR_EVENT_ADD, NULL);
+        /* most virtual devices can't interrupt, the core keeps polling */
+        if (ret != 0) {
+          fprintf(stderr, "network_rx_interrupt_ctl: no rx interrupts on "
+              "port %u, not sleeping\n", net_port_ids[i]);
+          unsupported = 1;
+          return 1;
+        }
+      }
       initialized = 1;
     }
 
-    return rte_eth_dev_rx_intr_enable(net_port_id, t->queue_id);
+    for (i = 0; i < net_ports_num && ret == 0; i++) {
+      ret = rte_eth_dev_rx_intr_enable(net_port_ids[i], t->queue_id);
+    }
   } else {
-    return rte_eth_dev_rx_intr_disable(net_port_id, t->queue_id);
+    for (i = 0; i < net_ports_num; i++) {
+      ret |= rte_eth_dev_rx_intr_disable(net_port_ids[i], t->queue_id);
+    }
   }
+  return ret;
 }
 
-static struct rte_mempool *mempool_alloc(void)
+/* send consecutive runs of packets for the same port, stopping at the first
+ * one the tx queue doesn't take completely so ordering is preserved */
+int network_send_ports(struct network_thread *t, unsigned num,
+    struct rte_mbuf **mbs)
+{
+  unsigned i, j, n;
+  uint16_t port;
+
+  for (i = 0; i < num; i += n) {
+    port = mbs[i]->port;
+    for (j = i + 1; j < num && mbs[j]->port == port; j++);
+
+    n = rte_eth_tx_burst(port, t->queue_id, mbs + i, j - i);
+    if (n < j - i) {
+      return i + n;
+    }
+  }
+
+  return num;
+}
+
+#ifdef NET_ZEROCOPY_SUPPORTED
+/* nothing to release, the buffer is owned by the flow tx buffer, which only
+ * gets reused after the payload has been acknowledged */
+static void zerocopy_free(void *addr, void *opaque)
+{
+}
+
+int network_buf_zc_attach(struct network_thread *t,
+    struct network_buf_handle *bh, unsigned num, const uintptr_t *addrs,
+    const uint16_t *lens)
+{
+  struct rte_mbuf *mbs[8];
+  struct rte_mbuf *head = (struct rte_mbuf *) bh, *tail;
+  struct rte_mbuf_ext_shared_info *shinfo;
+  uintptr_t addr, page_off;
+  uint16_t len, part;
+  unsigned i, j, n = 0;
+
+  /* split up ranges at page boundaries, since pages are not contiguous */
+  for (i = 0; i < num; i++) {
+    for (addr = addrs[i], len = lens[i]; len > 0; addr += part, len -= part) {
+      page_off = addr % ZC_PAGE_SIZE;
+      part = MIN(len, ZC_PAGE_SIZE - page_off);
+
+      if (n >= sizeof(mbs) / sizeof(mbs[0]) ||
+          (mbs[n] = rte_pktmbuf_alloc(t->zc_pool)) == NULL)
+      {
+        goto error_free;
+      }
+
+      /* shared info lives in the otherwise unused mbuf data room */
+      shinfo = (struct rte_mbuf_ext_shared_info *) mbs[n]->buf_addr;
+      shinfo->free_cb = zerocopy_free;
+      shinfo->fcb_opaque = NULL;
+      rte_mbuf_ext_refcnt_set(shinfo, 1);
+
+      rte_pktmbuf_attach_extbuf(mbs[n], (uint8_t *) tas_shm + addr,
+          zc_iovas[addr / ZC_PAGE_SIZE] + page_off, part, shinfo);
+      mbs[n]->data_off = 0;
+      mbs[n]->data_len = part;
+      n++;
+    }
+  }
+
+  /* link segments to the header buffer */
+  for (tail = head; tail->next != NULL; tail = tail->next);
+  for (j = 0; j < n; j++) {
+    tail->next = mbs[j];
+    tail = mbs[j];
+  }
+  head->nb_segs += n;
+  return 0;
+
+error_free:
+  for (j = 0; j < n; j++) {
+    rte_pktmbuf_free_seg(mbs[j]);
+  }
+  return -1;
+}
+
+static int zerocopy_init(void)
+{
+  size_t i, n = FLEXNIC_DMA_MEM_SIZE / ZC_PAGE_SIZE;
+
+  if ((eth_devinfo.tx_offload_capa & DEV_TX_OFFLOAD_MULTI_SEGS) == 0) {
+    fprintf(stderr, "zerocopy_init: NIC does not support multi-segment "
+        "transmit\n");
+    return -1;
+  }
+
+  if ((zc_iovas = calloc(n, sizeof(*zc_iovas))) == NULL) {
+    fprintf(stderr, "zerocopy_init: allocating iova table failed\n");
+    return -1;
+  }
+
+  /* translate each huge page of the dma region once */
+  for (i = 0; i < n; i++) {
+    zc_iovas[i] = rte_mem_virt2iova((uint8_t *) tas_shm + i * ZC_PAGE_SIZE);
+    if (zc_iovas[i] == RTE_BAD_IOVA) {
+      fprintf(stderr, "zerocopy_init: translating dma memory failed\n");
+      free(zc_iovas);
+      zc_iovas = NULL;
+      return -1;
+    }
+  }
+
+  net_tx_zerocopy = 1;
+  return 0;
+}
+#else
+int network_buf_zc_attach(struct network_thread *t,
+    struct network_buf_handle *bh, unsigned num, const uintptr_t *addrs,
+    const uint16_t *lens)
+{
+  return -1;
+}
+
+static int zerocopy_init(void)
+{
+  fprintf(stderr, "zerocopy_init: not supported with this DPDK version or "
+      "without huge pages\n");
+  return -1;
+}
+#endif
+
+static struct rte_mempool *mempool_alloc(const char *prefix, unsigned num,
+    size_t mbuf_size)
 {
   static unsigned pool_id = 0;
   unsigned n;
   char name[32];
   n = __sync_fetch_and_add(&pool_id, 1);
-  snprintf(name, 32, "mbuf_pool_%u\n", n);
-  return rte_mempool_create(name, PERTHREAD_MBUFS, MBUF_SIZE, 32,
+  snprintf(name, 32, "%s_%u\n", prefix, n);
+  return rte_mempool_create(name, num, mbuf_size,
+          MAX(MEMPOOL_CACHE_MIN, MIN(MEMPOOL_CACHE_MAX, num / 8)),
           sizeof(struct rte_pktmbuf_pool_private), rte_pktmbuf_pool_init, NULL,
           rte_pktmbuf_init, NULL, rte_socket_id(), 0);
 
@@ -286,7 +642,6 @@ int network_scale_up(uint16_t old, uint16_t new)
         if (rss_reta[outer].reta[inner] == c) {
           rss_reta[outer].mask |= 1ULL << inner;
           rss_reta[outer].reta[inner] = j;
-          fp_state->flow_group_steering[k] = j;
           break;
         }
       }
@@ -296,8 +651,8 @@ int network_scale_up(uint16_t old, uint16_t new)
     }
   }
 
-  if (rte_eth_dev_rss_reta_update(net_port_id, rss_reta, rss_reta_size) != 0) {
-    fprintf(stderr, "network_scale_up: rte_eth_dev_rss_reta_update failed\n");
+  if (reta_update() != 0) {
+    fprintf(stderr, "network_scale_up: reta_update failed\n");
     return -1;
   }
 
@@ -324,18 +679,311 @@ int network_scale_down(uint16_t old, uint16_t new)
       rss_reta[outer].reta[inner] = n_c;
       rss_reta[outer].mask |= 1ULL << inner;
 
-      fp_state->flow_group_steering[i] = n_c;
-
       rss_core_buckets[o_c]--;
       rss_core_buckets[n_c]++;
     }
   }
 
-  if (rte_eth_dev_rss_reta_update(net_port_id, rss_reta, rss_reta_size) != 0) {
-    fprintf(stderr, "network_scale_down: rte_eth_dev_rss_reta_update failed\n");
+  if (reta_update() != 0) {
+    fprintf(stderr, "network_scale_down: reta_update failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+unsigned network_rx_queue_fill(uint16_t core)
+{
+  int n, max = 0;
+  unsigned f, fill = 0;
+  uint8_t i;
+
+  /* with software steering the backlog of a core is in its rings */
+  for (i = 0; i < net_sw_rss; i++) {
+    f = rte_ring_count(ctxs[core]->sw_rx_rings[i]) * 1000 / SW_RSS_RING_SIZE;
+    fill = MAX(fill, f);
+  }
+  if (net_sw_rss > 0 && core >= net_sw_rss) {
+    return fill;
+  }
+
+  for (i = 0; i < net_ports_num; i++) {
+    n = rte_eth_rx_queue_count(net_port_ids[i], core);
+    if (n > max) {
+      max = n;
+    }
+  }
+  return MAX(fill, max * 1000 / RX_DESCRIPTORS);
+}
+
+/* ownership of flow groups is handed over by the dataplane cores
+ * themselves, see dataplane_loop */
+uint16_t network_flow_group_core(uint16_t fg)
+{
+  return rss_reta[fg / RTE_RETA_GROUP_SIZE].reta[fg % RTE_RETA_GROUP_SIZE];
+}
+
+/* called from the slow path, never while a scaling request is pending */
+int network_flow_groups_move(unsigned num, const uint16_t *fgs,
+    const uint16_t *cores)
+{
+  uint16_t i, fg, o_c, outer, inner;
+
+  if (num == 0) {
+    return 0;
+  }
+
+  /* clear mask */
+  for (i = 0; i < rss_reta_size; i += RTE_RETA_GROUP_SIZE) {
+    rss_reta[i / RTE_RETA_GROUP_SIZE].mask = 0;
+  }
+
+  for (i = 0; i < num; i++) {
+    fg = fgs[i];
+    outer = fg / RTE_RETA_GROUP_SIZE;
+    inner = fg % RTE_RETA_GROUP_SIZE;
+    assert(fg < rss_reta_size && cores[i] < fp_cores_cur);
+
+    o_c = rss_reta[outer].reta[inner];
+    rss_reta[outer].reta[inner] = cores[i];
+    rss_reta[outer].mask |= 1ULL << inner;
+
+    rss_core_buckets[o_c]--;
+    rss_core_buckets[cores[i]]++;
+  }
+
+  if (reta_update() != 0) {
+    fprintf(stderr, "network_flow_groups_move: reta_update failed\n");
     return -1;
   }
 
+  dataplane_handoff(util_timeout_time_us());
+  return 0;
+}
+
+static inline struct network_flow_rule *flow_rule_lookup(uint32_t flow_id)
+{
+  unsigned i;
+
+  for (i = 0; i < flow_rules_num; i++) {
+    if (flow_rules[i].flow_id == flow_id) {
+      return &flow_rules[i];
+    }
+  }
+  return NULL;
+}
+
+int network_flow_steer(uint32_t flow_id, uint16_t db, int live)
+{
+  struct network_flow_rule *r;
+  uint16_t core;
+  int ret = -1, moved = 0, added = 0;
+
+  if (flow_rules == NULL) {
+    return -1;
+  }
+
+  rte_spinlock_lock(&flow_rules_lock);
+  if ((r = flow_rule_lookup(flow_id)) == NULL) {
+    if (flow_rules_num >= config.fp_flow_rules) {
+      goto out;
+    }
+
+    r = &flow_rules[flow_rules_num++];
+    memset(r, 0, sizeof(*r));
+    r->flow_id = flow_id;
+    r->core = FLEXNIC_PL_FLOWST_NOSTEER;
+    added = 1;
+  }
+
+  /* contexts are spread round robin over the active cores */
+  r->db = db;
+  core = db % fp_cores_cur;
+  if (r->core != core) {
+    if (flow_rule_install(r, core) != 0) {
+      /* keep the old rules if there are any */
+      if (added) {
+        *r = flow_rules[--flow_rules_num];
+      }
+      goto out;
+    }
+    moved = live;
+  }
+  ret = r->core;
+
+out:
+  rte_spinlock_unlock(&flow_rules_lock);
+
+  /* owner of a live flow has to hand it over to the new core */
+  if (moved) {
+    dataplane_handoff(util_timeout_time_us());
+  }
+  return ret;
+}
+
+void network_flow_unsteer(uint32_t flow_id)
+{
+  network_flow_unsteer_batch(1, &flow_id);
+}
+
+void network_flow_unsteer_batch(unsigned num, const uint32_t *flow_ids)
+{
+  struct network_flow_rule *r;
+  unsigned i;
+
+  if (flow_rules == NULL) {
+    return;
+  }
+
+  rte_spinlock_lock(&flow_rules_lock);
+  for (i = 0; i < num; i++) {
+    if ((r = flow_rule_lookup(flow_ids[i])) != NULL) {
+      flow_rule_remove(r);
+      *r = flow_rules[--flow_rules_num];
+    }
+  }
+  rte_spinlock_unlock(&flow_rules_lock);
+}
+
+/* re-point rules after the number of active cores changed, called on core 0
+ * before the cores are asked to hand off their flows */
+void network_flow_steer_rescale(void)
+{
+  struct network_flow_rule *r;
+  uint16_t core;
+  unsigned i;
+
+  rte_spinlock_lock(&flow_rules_lock);
+  for (i = 0; i < flow_rules_num; i++) {
+    r = &flow_rules[i];
+    core = r->db % fp_cores_cur;
+    if (r->core == core) {
+      continue;
+    }
+
+    /* without a rule the flow goes back to its flow group */
+    if (flow_rule_install(r, core) != 0) {
+      flow_rule_remove(r);
+    }
+  }
+  rte_spinlock_unlock(&flow_rules_lock);
+}
+
+/* hand over steered flows owned by core whose rules point elsewhere now */
+void network_flow_steer_handoff(uint16_t core)
+{
+  struct flextcp_pl_flowst *fs;
+  struct network_flow_rule *r;
+  uint16_t owner;
+  unsigned i;
+
+  if (flow_rules == NULL) {
+    return;
+  }
+
+  rte_spinlock_lock(&flow_rules_lock);
+  for (i = 0; i < flow_rules_num; i++) {
+    r = &flow_rules[i];
+    fs = &fp_state->flowst[r->flow_id];
+
+    owner = fs->steer_core;
+    if (owner == FLEXNIC_PL_FLOWST_NOSTEER) {
+      owner = fp_state->flow_group_steering[fs->flow_group];
+    }
+    if (owner != core || r->core == fs->steer_core) {
+      continue;
+    }
+
+    /* same as for flow groups, our updates to the flow state need to be
+     * visible before the new owner starts working on it */
+    MEM_BARRIER();
+    fs->steer_core = r->core;
+  }
+  rte_spinlock_unlock(&flow_rules_lock);
+}
+
+/* create rules on all ports matching segments from the peer and sending them
+ * to the rx queue of core, replacing the flow's current rules */
+static int flow_rule_install(struct network_flow_rule *r, uint16_t core)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[r->flow_id];
+  struct rte_flow *flows[FLEXNIC_PL_NET_PORTS];
+  uint8_t i;
+
+  for (i = 0; i < net_ports_num; i++) {
+    flows[i] = network_flow_rule_create(net_port_ids[i], fs->remote_ip.x,
+        fs->local_ip.x, fs->remote_port.x, fs->local_port.x, core);
+    if (flows[i] == NULL) {
+      while (i-- > 0) {
+        network_flow_rule_destroy(net_port_ids[i], flows[i]);
+      }
+      return -1;
+    }
+  }
+
+  /* new rules are in place before the old ones go, so segments never fall
+   * back to RSS in between */
+  flow_rule_remove(r);
+  memcpy(r->flows, flows, sizeof(flows));
+  r->core = core;
+  return 0;
+}
+
+static void flow_rule_remove(struct network_flow_rule *r)
+{
+  uint8_t i;
+
+  if (r->core == FLEXNIC_PL_FLOWST_NOSTEER) {
+    return;
+  }
+
+  for (i = 0; i < net_ports_num; i++) {
+    network_flow_rule_destroy(net_port_ids[i], r->flows[i]);
+    r->flows[i] = NULL;
+  }
+  r->core = FLEXNIC_PL_FLOWST_NOSTEER;
+}
+
+/**
+ * Write changed entries (mask bits) of the flow group table to the RETAs of
+ * all ports. Ports with a larger RETA repeat the table, as the flow group is
+ * the low bits of the RSS hash.
+ */
+static int reta_update(void)
+{
+  struct network_port *np;
+  uint16_t i, j, fg, outer, inner;
+
+  for (i = 0; i < net_ports_num; i++) {
+    np = &ports[i];
+    if (np->reta_size == 0)
+      continue;
+
+    for (j = 0; j < np->reta_size; j++) {
+      fg = j & (rss_reta_size - 1);
+      outer = j / RTE_RETA_GROUP_SIZE;
+      inner = j % RTE_RETA_GROUP_SIZE;
+      if (j % RTE_RETA_GROUP_SIZE == 0) {
+        np->reta[outer].mask = 0;
+      }
+      if ((rss_reta[fg / RTE_RETA_GROUP_SIZE].mask &
+            (1ULL << (fg % RTE_RETA_GROUP_SIZE))) != 0)
+      {
+        np->reta[outer].mask |= 1ULL << inner;
+        np->reta[outer].reta[inner] =
+          rss_reta[fg / RTE_RETA_GROUP_SIZE].reta[fg % RTE_RETA_GROUP_SIZE];
+      }
+    }
+
+    if (rte_eth_dev_rss_reta_update(net_port_ids[i], np->reta, np->reta_size)
+        != 0)
+    {
+      fprintf(stderr, "reta_update: rte_eth_dev_rss_reta_update(%u) "
+          "failed\n", net_port_ids[i]);
+      return -1;
+    }
+  }
+
   return 0;
 }
 
@@ -343,10 +991,33 @@ static int reta_setup()
 {
   uint16_t i, c;
 
+  /* flow groups are limited by the smallest RETA of all ports, ports without
+   * one only deliver flow group 0, and without any there is only that one.
+   * Software steering leaves the RETAs alone. */
+  rss_reta_size = (net_sw_rss > 0 ? SW_RSS_FLOWGROUPS : 0);
+  for (i = 0; i < net_ports_num && net_sw_rss == 0; i++) {
+    ports[i].reta_size = ports[i].devinfo.reta_size;
+    if (ports[i].reta_size == 0)
+      continue;
+    if (rss_reta_size == 0 || ports[i].reta_size < rss_reta_size) {
+      rss_reta_size = ports[i].reta_size;
+    }
+
+    ports[i].reta = rte_calloc("port reta", (ports[i].reta_size /
+          RTE_RETA_GROUP_SIZE), sizeof(*ports[i].reta), 0);
+    if (ports[i].reta == NULL) {
+      fprintf(stderr, "reta_setup: port reta alloc failed\n");
+      return -1;
+    }
+  }
+
+  if (rss_reta_size == 0) {
+    rss_reta_size = 1;
+  }
+
   /* allocate RSS redirection table and core-bucket count table */
-  rss_reta_size = eth_devinfo.reta_size;
-  rss_reta = rte_calloc("rss reta", (rss_reta_size / RTE_RETA_GROUP_SIZE),
-      sizeof(*rss_reta), 0);
+  rss_reta = rte_calloc("rss reta", (rss_reta_size + RTE_RETA_GROUP_SIZE - 1)
+      / RTE_RETA_GROUP_SIZE, sizeof(*rss_reta), 0);
   rss_core_buckets = rte_calloc("rss core buckets", fp_cores_max,
       sizeof(*rss_core_buckets), 0);
 
@@ -370,8 +1041,9 @@ static int reta_setup()
     c = (c + 1) % fp_cores_cur;
   }
 
-  if (rte_eth_dev_rss_reta_update(net_port_id, rss_reta, rss_reta_size) != 0) {
-    fprintf(stderr, "reta_setup: rte_eth_dev_rss_reta_update failed\n");
+  if (reta_update() != 0) {
+    fprintf(stderr, "reta_setup: reta_update failed, without a writable RETA "
+        "try --fp-sw-rss\n");
     return -1;
   }
 
@@ -36,14 +36,42 @@
 
 struct network_buf_handle;
 
-extern uint8_t net_port_id;
+/** Number of ports in use */
+extern uint8_t net_ports_num;
+/** Port index -> DPDK port id */
+extern uint16_t net_port_ids[FLEXNIC_PL_NET_PORTS];
+/** DPDK port id -> port index */
+extern uint8_t net_port_idx[RTE_MAX_ETHPORTS];
+/** MAC address for each port */
+extern struct ether_addr net_port_macs[FLEXNIC_PL_NET_PORTS];
 extern uint16_t rss_reta_size;
+/** Cores receiving from the NIC and steering in software, 0 if the NIC
+ * spreads packets by its RETA */
+extern uint8_t net_sw_rss;
+extern uint8_t net_tso_enabled;
+extern uint8_t net_tx_zerocopy;
 
 int network_thread_init(struct dataplane_context *ctx);
 int network_rx_interrupt_ctl(struct network_thread *t, int turnon);
+int network_send_ports(struct network_thread *t, unsigned num,
+    struct rte_mbuf **mbs);
+
+int network_buf_zc_attach(struct network_thread *t,
+    struct network_buf_handle *bh, unsigned num, const uintptr_t *addrs,
+    const uint16_t *lens);
 
 int network_scale_up(uint16_t old, uint16_t new);
 int network_scale_down(uint16_t old, uint16_t new);
+uint16_t network_flow_group_core(uint16_t fg);
+void network_flow_steer_rescale(void);
+void network_flow_steer_handoff(uint16_t core);
+
+/* network_flow.c: exact match rule on port steering a TCP flow to rx queue,
+ * addresses and ports in network byte order */
+struct rte_flow;
+struct rte_flow *network_flow_rule_create(uint16_t port, uint32_t ip_src,
+    uint32_t ip_dst, uint16_t port_src, uint16_t port_dst, uint16_t queue);
+int network_flow_rule_destroy(uint16_t port, struct rte_flow *flow);
 
 
 static inline void network_buf_reset(struct network_buf_handle *bh)
@@ -62,6 +90,12 @@ static inline uint16_t network_buf_len(struct network_buf_handle *bh)
   return ((struct rte_mbuf *) bh)->data_len;
 }
 
+/** Total packet length, including chained segments */
+static inline uint32_t network_buf_pktlen(struct network_buf_handle *bh)
+{
+  return ((struct rte_mbuf *) bh)->pkt_len;
+}
+
 static inline void *network_buf_buf(struct network_buf_handle *bh)
 {
   return ((struct rte_mbuf *) bh)->buf_addr;
@@ -86,19 +120,48 @@ static inline void network_buf_setlen(struct network_buf_handle *bh,
   mb->pkt_len = mb->data_len = len;
 }
 
+/** Set port (index) buffer is to be sent out on */
+static inline void network_buf_setport(struct network_buf_handle *bh,
+    uint8_t port)
+{
+  ((struct rte_mbuf *) bh)->port =
+    net_port_ids[port < net_ports_num ? port : 0];
+}
+
+/** Port (index) buffer was received on */
+static inline uint8_t network_buf_port(struct network_buf_handle *bh)
+{
+  return net_port_idx[((struct rte_mbuf *) bh)->port];
+}
+
+/** Set total packet length, for buffers with chained segments */
+static inline void network_buf_setpktlen(struct network_buf_handle *bh,
+    uint32_t len)
+{
+  ((struct rte_mbuf *) bh)->pkt_len = len;
+}
+
 
 static inline int network_poll(struct network_thread *t, unsigned num,
     struct network_buf_handle **bhs)
 {
   struct rte_mbuf **mbs = (struct rte_mbuf **) bhs;
+  unsigned i, n = 0;
+  uint8_t p = t->rx_port;
+
+  /* poll all ports, rotating which goes first */
+  for (i = 0; i < net_ports_num && n < num; i++) {
+    n += rte_eth_rx_burst(net_port_ids[p], t->queue_id, mbs + n, num - n);
+    p = (p + 1 < net_ports_num ? p + 1 : 0);
+  }
+  t->rx_port = (t->rx_port + 1 < net_ports_num ? t->rx_port + 1 : 0);
 
-  num = rte_eth_rx_burst(net_port_id, t->queue_id, mbs, num);
+  num = n;
   if (num == 0) {
     return 0;
   }
 
 #ifdef FLEXNIC_TRACE_TX
-  unsigned i;
   for (i = 0; i < num; i++) {
     trace_event(FLEXNIC_TRACE_EV_RXPKT, network_buf_len(bhs[i]),
         network_buf_bufoff(bhs[i]));
@@ -121,7 +184,10 @@ static inline int network_send(struct network_thread *t, unsigned num,
   }
 #endif
 
-  return rte_eth_tx_burst(net_port_id, t->queue_id, mbs, num);
+  if (net_ports_num == 1) {
+    return rte_eth_tx_burst(net_port_ids[0], t->queue_id, mbs, num);
+  }
+  return network_send_ports(t, num, mbs);
 }
 
 
@@ -145,6 +211,13 @@ static inline int network_buf_alloc(struct network_thread *t, unsigned num,
   return i;
 }
 
+/** Allocate one large buffer for TSO segments, returns NULL if none left. */
+static inline struct network_buf_handle *network_buf_alloc_tso(
+    struct network_thread *t)
+{
+  return (struct network_buf_handle *) rte_pktmbuf_alloc(t->tso_pool);
+}
+
 static inline void network_free(unsigned num, struct network_buf_handle **bufs)
 {
   unsigned i;
@@ -153,6 +226,46 @@ static inline void network_free(unsigned num, struct network_buf_handle **bufs)
   }
 }
 
+/** NIC found a bad IP or TCP checksum in a received packet */
+static inline int network_buf_rx_xsum_bad(struct network_buf_handle *bh)
+{
+  uint64_t fl = ((struct rte_mbuf *) bh)->ol_flags;
+  return (fl & PKT_RX_IP_CKSUM_MASK) == PKT_RX_IP_CKSUM_BAD ||
+    (fl & PKT_RX_L4_CKSUM_MASK) == PKT_RX_L4_CKSUM_BAD;
+}
+
+/** NIC receive timestamp in device units, -1 if the packet has none */
+static inline int network_buf_rx_tstamp(struct network_buf_handle *bh,
+    uint64_t *ts)
+{
+  struct rte_mbuf *mb = (struct rte_mbuf *) bh;
+  if ((mb->ol_flags & PKT_RX_TIMESTAMP) == 0)
+    return -1;
+  *ts = mb->timestamp;
+  return 0;
+}
+
+/** Replace receive timestamp, poll_rx stores arrival in qman time here */
+static inline void network_buf_set_rx_tstamp(struct network_buf_handle *bh,
+    uint64_t ts)
+{
+  ((struct rte_mbuf *) bh)->timestamp = ts;
+}
+
+/** Arrival of a received packet in qman time, `now` if not timestamped */
+static inline uint32_t network_buf_rx_time(struct network_buf_handle *bh,
+    uint32_t now)
+{
+  uint64_t ts;
+  return (network_buf_rx_tstamp(bh, &ts) == 0 ? (uint32_t) ts : now);
+}
+
+/** free packet, including chained segments */
+static inline void network_buf_free(struct network_buf_handle *bh)
+{
+  rte_pktmbuf_free((struct rte_mbuf *) bh);
+}
+
 /** calculate ip pseudo header xsum */
 static inline uint16_t network_ip_phdr_xsum(beui32_t ip_src, beui32_t ip_dst,
     uint8_t proto, uint16_t l3_paylen)
@@ -186,6 +299,32 @@ static inline uint16_t network_buf_tcpxsums(struct network_buf_handle *bh, uint8
   return network_ip_phdr_xsum(ip_s, ip_d, ip_proto, l3_paylen);
 }
 
+/** Enable TSO for buffer, returns pseudo header checksum for tcp header */
+static inline uint16_t network_buf_tso(struct network_buf_handle *bh,
+    uint8_t l2l, uint8_t l3l, uint8_t l4l, uint16_t mss, beui32_t ip_s,
+    beui32_t ip_d, uint8_t ip_proto)
+{
+  struct rte_mbuf * restrict mb = (struct rte_mbuf *) bh;
+  mb->l2_len = l2l;
+  mb->l3_len = l3l;
+  mb->l4_len = l4l;
+  mb->tso_segsz = mss;
+  mb->ol_flags = PKT_TX_IPV4 | PKT_TX_IP_CKSUM | PKT_TX_TCP_CKSUM |
+    PKT_TX_TCP_SEG;
+
+  /* NIC fills in the length for every segment it generates */
+  return network_ip_phdr_xsum(ip_s, ip_d, ip_proto, 0);
+}
+
+/** Replace the RSS hash with the one computed in software */
+static inline void network_buf_set_flowhash(struct network_buf_handle *bh,
+    uint32_t h)
+{
+  struct rte_mbuf *mb = (struct rte_mbuf *) bh;
+  mb->hash.rss = h;
+  mb->ol_flags |= PKT_RX_RSS_HASH;
+}
+
 static inline int network_buf_flowgroup(struct network_buf_handle *bh,
     uint16_t *fg)
 {
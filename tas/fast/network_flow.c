@@ -0,0 +1,99 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * rte_flow rules are kept in their own file, as rte_flow.h pulls in DPDK's
+ * protocol headers that clash with the ones in packet_defs.h. So this can't
+ * include network.h either, the prototypes are in there.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_config.h>
+#include <rte_flow.h>
+
+struct rte_flow *network_flow_rule_create(uint16_t port, uint32_t ip_src,
+    uint32_t ip_dst, uint16_t port_src, uint16_t port_dst, uint16_t queue)
+{
+  struct rte_flow_attr attr;
+  struct rte_flow_item_ipv4 ip_spec, ip_mask;
+  struct rte_flow_item_tcp tcp_spec, tcp_mask;
+  struct rte_flow_item pattern[4];
+  struct rte_flow_action_queue act_queue;
+  struct rte_flow_action actions[2];
+  struct rte_flow_error err;
+  struct rte_flow *flow;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.ingress = 1;
+
+  memset(&ip_spec, 0, sizeof(ip_spec));
+  memset(&ip_mask, 0, sizeof(ip_mask));
+  ip_spec.hdr.src_addr = ip_src;
+  ip_spec.hdr.dst_addr = ip_dst;
+  ip_mask.hdr.src_addr = ip_mask.hdr.dst_addr = 0xffffffff;
+
+  memset(&tcp_spec, 0, sizeof(tcp_spec));
+  memset(&tcp_mask, 0, sizeof(tcp_mask));
+  tcp_spec.hdr.src_port = port_src;
+  tcp_spec.hdr.dst_port = port_dst;
+  tcp_mask.hdr.src_port = tcp_mask.hdr.dst_port = 0xffff;
+
+  memset(pattern, 0, sizeof(pattern));
+  pattern[0].type = RTE_FLOW_ITEM_TYPE_ETH;
+  pattern[1].type = RTE_FLOW_ITEM_TYPE_IPV4;
+  pattern[1].spec = &ip_spec;
+  pattern[1].mask = &ip_mask;
+  pattern[2].type = RTE_FLOW_ITEM_TYPE_TCP;
+  pattern[2].spec = &tcp_spec;
+  pattern[2].mask = &tcp_mask;
+  pattern[3].type = RTE_FLOW_ITEM_TYPE_END;
+
+  act_queue.index = queue;
+  memset(actions, 0, sizeof(actions));
+  actions[0].type = RTE_FLOW_ACTION_TYPE_QUEUE;
+  actions[0].conf = &act_queue;
+  actions[1].type = RTE_FLOW_ACTION_TYPE_END;
+
+  memset(&err, 0, sizeof(err));
+  if ((flow = rte_flow_create(port, &attr, pattern, actions, &err)) == NULL) {
+    fprintf(stderr, "network_flow_rule_create: rte_flow_create(%u) failed: "
+        "%s\n", port, (err.message != NULL ? err.message : "unknown"));
+  }
+  return flow;
+}
+
+int network_flow_rule_destroy(uint16_t port, struct rte_flow *flow)
+{
+  struct rte_flow_error err;
+
+  if (rte_flow_destroy(port, flow, &err) != 0) {
+    fprintf(stderr, "network_flow_rule_destroy: rte_flow_destroy(%u) "
+        "failed\n", port);
+    return -1;
+  }
+  return 0;
+}
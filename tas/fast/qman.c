@@ -29,26 +29,58 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <rte_config.h>
 #include <rte_malloc.h>
 #include <rte_cycles.h>
 
+#include <tas_memif.h>
 #include <utils.h>
 
 #include "internal.h"
 
 #define dprintf(...) do { } while (0)
 
+/* also used for queues in the timer wheel */
 #define FLAG_INSKIPLIST 1
 #define FLAG_INNOLIMITL 2
 
+/** Classes: invalid class index */
+#define CLS_INVAL 0xffff
+/** Classes: bytes per round for a class with weight 1 */
+#define CLS_QUANTUM 4096
+/** Classes: rate cap credit further ahead is treated as stale [ns] */
+#define CLS_MAX_AHEAD 1000000000
+
 /** Skiplist: bits per level */
 #define SKIPLIST_BITS 3
 /** Index list: invalid index */
 #define IDXLIST_INVAL (-1U)
 
+/** Timer wheel: level 0 slot width [log2 ns] */
+#define WHEEL_L0_SHIFT 10
+/** Timer wheel: slots per level [log2] */
+#define WHEEL_SLOTS_SHIFT 10
+#define WHEEL_SLOTS (1U << WHEEL_SLOTS_SHIFT)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+/** Timer wheel: level 1 slot width, one full level 0 turn [log2 ns] */
+#define WHEEL_L1_SHIFT (WHEEL_L0_SHIFT + WHEEL_SLOTS_SHIFT)
+#define WHEEL_L0_MASK ((1U << WHEEL_L0_SHIFT) - 1)
+#define WHEEL_L1_MASK ((1U << WHEEL_L1_SHIFT) - 1)
+/** Timer wheel: furthest a queue can be scheduled out */
+#define WHEEL_HORIZON ((WHEEL_SLOTS - 1) << WHEEL_L1_SHIFT)
+
+/** RTO wheel: slot width [us], as a shift */
+#define RTO_SLOT_SHIFT 6
+/** RTO wheel: number of slots, timers further out wrap around */
+#define RTO_SLOTS 4096
+#define RTO_SLOT_MASK (RTO_SLOTS - 1)
+
+#define RTO_ARMED 1
+#define RTO_QUEUED 2
+
 #define RNG_SEED 0x12345678
 #define TIMESTAMP_BITS 32
 #define TIMESTAMP_MASK 0xFFFFFFFF
@@ -66,10 +98,77 @@ struct queue {
   /** Maximum chunk size when de-queueing */
   uint16_t max_chunk;
   /** Flags: FLAG_INSKIPLIST, FLAG_INNOLIMITL */
-  uint16_t flags;
+  uint8_t flags;
+  /** Class (application context) the queue belongs to */
+  uint8_t cls;
 } __attribute__((packed));
 STATIC_ASSERT((sizeof(struct queue) == 32), queue_size);
 
+/**
+ * Queue class, one per application context. No-limit queues are kept in a
+ * per-class fifo and classes are served with deficit round robin according
+ * to their weight. Classes with a rate cap additionally track the earliest
+ * time they may send again.
+ */
+struct qman_class {
+  /** Fifo of active no-limit queues, linked through next_idxs[0] */
+  uint32_t nl_head_idx;
+  uint32_t nl_tail_idx;
+  /** Earliest virtual time class may send again (with rate cap) */
+  uint32_t next_ts;
+  /** Remaining bytes this round */
+  int32_t deficit;
+  /** Next class in list of active classes */
+  uint16_t next_cls;
+  /** Class is in the list of active classes */
+  uint8_t active;
+};
+
+/** Timer wheel slot: fifo of queues linked through next_idxs[0] */
+struct wheel_slot {
+  uint32_t head_idx;
+  uint32_t tail_idx;
+};
+
+/**
+ * Two-level timer wheel. Level 0 holds queues due in the level 1 slot the
+ * wheel is currently in, level 1 holds the rest and is cascaded into level 0
+ * once reached. Bitmaps mark non-empty slots so we can skip ahead.
+ */
+struct qman_wheel {
+  struct wheel_slot slots[2][WHEEL_SLOTS];
+  uint64_t bitmap[2][WHEEL_SLOTS / 64];
+  /** Number of queues in the wheel */
+  uint32_t num;
+};
+
+/** Retransmission timer of a flow */
+struct qman_rto {
+  /** Links in RTO wheel slot */
+  uint32_t next_idx;
+  uint32_t prev_idx;
+  /** Expiry time [us] */
+  uint32_t deadline;
+  /** Slot the timer is queued in (absolute, in slot units) */
+  uint32_t slot;
+  /** Flags: RTO_ARMED, RTO_QUEUED */
+  uint8_t flags;
+};
+
+/**
+ * Single-level wheel for retransmission timers. Timers are re-armed on most
+ * ACKs, so a timer re-armed to a later deadline stays in its slot and is only
+ * moved once that slot is reached. Timers fire once their slot has passed, so
+ * up to one slot late.
+ */
+struct qman_rto_wheel {
+  uint32_t slots[RTO_SLOTS];
+  /** Next slot to process (absolute, in slot units) */
+  uint32_t cur;
+  /** Number of queued timers */
+  uint32_t num;
+};
+
 
 /** Actually update queue state: must run on queue's home core */
 static inline void set_impl(struct qman_thread *t, uint32_t id, uint32_t rate,
@@ -81,13 +180,30 @@ static inline void queue_activate_nolimit(struct qman_thread *t,
 static inline unsigned poll_nolimit(struct qman_thread *t, uint32_t cur_ts,
     unsigned num, unsigned *q_ids, uint16_t *q_bytes);
 
+/** Per class rate cap: defer queue if class is over its cap */
+static inline int class_throttle(struct qman_thread *t, struct queue *q,
+    uint32_t idx, uint32_t max_vts);
+static inline void class_charge(struct qman_thread *t, struct queue *q,
+    uint32_t bytes);
+
 /** Add queue to the skip list list */
 static inline void queue_activate_skiplist(struct qman_thread *t,
     struct queue *q, uint32_t idx);
+static inline void skiplist_insert(struct qman_thread *t, struct queue *q,
+    uint32_t idx);
 static inline unsigned poll_skiplist(struct qman_thread *t, uint32_t cur_ts,
     unsigned num, unsigned *q_ids, uint16_t *q_bytes);
 static inline uint8_t queue_level(struct qman_thread *t);
 
+/** Add queue to the timer wheel */
+static inline void queue_activate_wheel(struct qman_thread *t,
+    struct queue *q, uint32_t idx);
+static inline void wheel_insert(struct qman_thread *t, struct queue *q,
+    uint32_t idx);
+static inline unsigned poll_wheel(struct qman_thread *t, uint32_t cur_ts,
+    unsigned num, unsigned *q_ids, uint16_t *q_bytes);
+static inline int wheel_next_ts(struct qman_thread *t, uint32_t *ts);
+
 static inline void queue_fire(struct qman_thread *t,
     struct queue *q, uint32_t idx, unsigned *q_id, uint16_t *q_bytes);
 static inline void queue_activate(struct qman_thread *t, struct queue *q,
@@ -96,6 +212,8 @@ static inline uint32_t timestamp(void);
 static inline int timestamp_lessthaneq(struct qman_thread *t, uint32_t a,
     uint32_t b);
 static inline int64_t rel_time(uint32_t cur_ts, uint32_t ts_in);
+static uint32_t queues_next_ts(struct qman_thread *t, uint32_t cur_ts);
+static uint32_t rto_next_ts(struct qman_thread *t, uint32_t cur_ts);
 
 
 int qman_thread_init(struct dataplane_context *ctx)
@@ -103,7 +221,7 @@ int qman_thread_init(struct dataplane_context *ctx)
   struct qman_thread *t = &ctx->qman;
   unsigned i;
 
-  if ((t->queues = calloc(1, sizeof(*t->queues) * FLEXNIC_NUM_QMQUEUES))
+  if ((t->queues = calloc(config.fp_flows, sizeof(*t->queues)))
       == NULL)
   {
     fprintf(stderr, "qman_thread_init: queues malloc failed\n");
@@ -113,10 +231,44 @@ int qman_thread_init(struct dataplane_context *ctx)
   for (i = 0; i < QMAN_SKIPLIST_LEVELS; i++) {
     t->head_idx[i] = IDXLIST_INVAL;
   }
-  t->nolimit_head_idx = t->nolimit_tail_idx = IDXLIST_INVAL;
+  if ((t->classes = calloc(FLEXNIC_PL_APPCTX_NUM, sizeof(*t->classes)))
+      == NULL)
+  {
+    fprintf(stderr, "qman_thread_init: classes malloc failed\n");
+    return -1;
+  }
+  for (i = 0; i < FLEXNIC_PL_APPCTX_NUM; i++) {
+    t->classes[i].nl_head_idx = t->classes[i].nl_tail_idx = IDXLIST_INVAL;
+    t->classes[i].next_cls = CLS_INVAL;
+  }
+  t->actx = fp_state->appctx[ctx->id];
+  t->cls_head = t->cls_tail = CLS_INVAL;
   utils_rng_init(&t->rng, RNG_SEED * ctx->id + ctx->id);
 
+  if (config.fp_qman == CONFIG_FP_QMAN_WHEEL) {
+    if ((t->wheel = calloc(1, sizeof(*t->wheel))) == NULL) {
+      fprintf(stderr, "qman_thread_init: wheel malloc failed\n");
+      return -1;
+    }
+    memset(t->wheel->slots, 0xff, sizeof(t->wheel->slots));
+  }
+
+  if (config.fp_rto_min != 0) {
+    if ((t->rtos = calloc(config.fp_flows, sizeof(*t->rtos))) == NULL ||
+        (t->rto_wheel = calloc(1, sizeof(*t->rto_wheel))) == NULL)
+    {
+      fprintf(stderr, "qman_thread_init: rto malloc failed\n");
+      return -1;
+    }
+    memset(t->rto_wheel->slots, 0xff, sizeof(t->rto_wheel->slots));
+    t->rto_wheel->cur = qman_timestamp(rte_get_tsc_cycles()) >> RTO_SLOT_SHIFT;
+  } else {
+    t->rtos = NULL;
+    t->rto_wheel = NULL;
+  }
+
   t->ts_virtual = 0;
+  t->wheel_ts = 0;
   t->ts_real = timestamp();
 
   return 0;
@@ -135,16 +287,43 @@ uint32_t qman_timestamp(uint64_t cycles)
 }
 
 uint32_t qman_next_ts(struct qman_thread *t, uint32_t cur_ts)
+{
+  uint32_t ts = queues_next_ts(t, cur_ts);
+
+  if (t->rto_wheel != NULL)
+    ts = MIN(ts, rto_next_ts(t, cur_ts));
+  return ts;
+}
+
+uint32_t qman_waiting(struct qman_thread *t)
+{
+  return t->wheel->num;
+}
+
+static uint32_t queues_next_ts(struct qman_thread *t, uint32_t cur_ts)
 {
   uint32_t ts = timestamp();
   uint32_t ret_ts = t->ts_virtual + (ts - t->ts_real);
 
-  if(t->nolimit_head_idx != IDXLIST_INVAL) {
+  if(t->cls_head != CLS_INVAL) {
     // Nolimit queue has work - immediate timeout
     fprintf(stderr, "QMan nolimit has work\n");
     return 0;
   }
 
+  if (config.fp_qman == CONFIG_FP_QMAN_WHEEL) {
+    if (wheel_next_ts(t, &ts) != 0) {
+      // Wheel empty - no timeout
+      return -1;
+    }
+
+    if(timestamp_lessthaneq(t, ts, ret_ts)) {
+      return 0;
+    } else {
+      return rel_time(ret_ts, ts) / 1000;
+    }
+  }
+
   uint32_t idx = t->head_idx[0];
   if(idx != IDXLIST_INVAL) {
     struct queue *q = &t->queues[idx];
@@ -168,6 +347,18 @@ int qman_poll(struct qman_thread *t, unsigned num, unsigned *q_ids,
   unsigned x, y;
   uint32_t ts = timestamp();
 
+  if (config.fp_qman == CONFIG_FP_QMAN_WHEEL) {
+    if (t->nolimit_first) {
+      x = poll_nolimit(t, ts, num, q_ids, q_bytes);
+      y = poll_wheel(t, ts, num - x, q_ids + x, q_bytes + x);
+    } else {
+      x = poll_wheel(t, ts, num, q_ids, q_bytes);
+      y = poll_nolimit(t, ts, num - x, q_ids + x, q_bytes + x);
+    }
+    t->nolimit_first = !t->nolimit_first;
+    return x + y;
+  }
+
   /* poll nolimit list and skiplist alternating the order between */
   if (t->nolimit_first) {
     x = poll_nolimit(t, ts, num, q_ids, q_bytes);
@@ -195,9 +386,9 @@ int qman_set(struct qman_thread *t, uint32_t id, uint32_t rate, uint32_t avail,
   dprintf("qman_set: id=%u rate=%u avail=%u max_chunk=%u qidx=%u tid=%u\n",
       id, rate, avail, max_chunk, qidx, tid);
 
-  if (id >= FLEXNIC_NUM_QMQUEUES) {
+  if (id >= config.fp_flows) {
     fprintf(stderr, "qman_set: invalid queue id: %u >= %u\n", id,
-        FLEXNIC_NUM_QMQUEUES);
+        config.fp_flows);
     return -1;
   }
 
@@ -206,6 +397,146 @@ int qman_set(struct qman_thread *t, uint32_t id, uint32_t rate, uint32_t avail,
   return 0;
 }
 
+static inline void rto_link(struct qman_thread *t, uint32_t idx,
+    uint32_t slot)
+{
+  struct qman_rto_wheel *w = t->rto_wheel;
+  struct qman_rto *r = &t->rtos[idx];
+  uint32_t *head = &w->slots[slot & RTO_SLOT_MASK];
+
+  r->slot = slot;
+  r->prev_idx = IDXLIST_INVAL;
+  r->next_idx = *head;
+  if (*head != IDXLIST_INVAL)
+    t->rtos[*head].prev_idx = idx;
+  *head = idx;
+  r->flags |= RTO_QUEUED;
+  w->num++;
+}
+
+static inline void rto_unlink(struct qman_thread *t, uint32_t idx)
+{
+  struct qman_rto_wheel *w = t->rto_wheel;
+  struct qman_rto *r = &t->rtos[idx];
+
+  if (r->prev_idx != IDXLIST_INVAL)
+    t->rtos[r->prev_idx].next_idx = r->next_idx;
+  else
+    w->slots[r->slot & RTO_SLOT_MASK] = r->next_idx;
+  if (r->next_idx != IDXLIST_INVAL)
+    t->rtos[r->next_idx].prev_idx = r->prev_idx;
+  r->flags &= ~RTO_QUEUED;
+  w->num--;
+}
+
+/** Signed difference of slot numbers, these wrap with the timestamps */
+static inline int32_t rto_slot_diff(uint32_t a, uint32_t b)
+{
+  return (int32_t) ((a - b) << RTO_SLOT_SHIFT) >> RTO_SLOT_SHIFT;
+}
+
+/** Slot for deadline, deadlines in the past go to the next slot processed */
+static inline uint32_t rto_slot(struct qman_rto_wheel *w, uint32_t deadline)
+{
+  uint32_t slot = deadline >> RTO_SLOT_SHIFT;
+
+  return (rto_slot_diff(slot, w->cur) < 0 ? w->cur : slot);
+}
+
+void qman_rto_set(struct qman_thread *t, uint32_t id, uint32_t deadline,
+    int rearm)
+{
+  struct qman_rto *r = &t->rtos[id];
+  uint32_t slot;
+
+  if ((r->flags & RTO_ARMED) && !rearm)
+    return;
+
+  r->deadline = deadline;
+  r->flags |= RTO_ARMED;
+  slot = rto_slot(t->rto_wheel, deadline);
+  if ((r->flags & RTO_QUEUED)) {
+    /* later deadline: moved once the current slot is reached */
+    if (rto_slot_diff(slot, r->slot) >= 0)
+      return;
+    rto_unlink(t, id);
+  }
+  rto_link(t, id, slot);
+}
+
+void qman_rto_clear(struct qman_thread *t, uint32_t id)
+{
+  struct qman_rto *r = &t->rtos[id];
+
+  if ((r->flags & RTO_QUEUED))
+    rto_unlink(t, id);
+  r->flags = 0;
+}
+
+unsigned qman_rto_poll(struct qman_thread *t, uint32_t cur_ts, unsigned num,
+    uint32_t *ids)
+{
+  struct qman_rto_wheel *w = t->rto_wheel;
+  struct qman_rto *r;
+  uint32_t now = cur_ts >> RTO_SLOT_SHIFT, idx, next;
+  int32_t i, steps;
+  unsigned n = 0;
+
+  if (w->num == 0) {
+    w->cur = now;
+    return 0;
+  }
+
+  /* after a long sleep one pass over all slots is enough */
+  steps = MIN(rto_slot_diff(now, w->cur), RTO_SLOTS);
+  for (i = 0; i < steps; i++, w->cur++) {
+    for (idx = w->slots[w->cur & RTO_SLOT_MASK]; idx != IDXLIST_INVAL;
+        idx = next)
+    {
+      r = &t->rtos[idx];
+      next = r->next_idx;
+
+      /* timer for a later round of the wheel */
+      if (rto_slot_diff(r->slot, now) >= 0)
+        continue;
+
+      /* leave the rest of this slot for the next poll */
+      if (n >= num)
+        return n;
+
+      rto_unlink(t, idx);
+      if ((int32_t) (r->deadline - cur_ts) > 0) {
+        /* re-armed since it was queued */
+        rto_link(t, idx, rto_slot(w, r->deadline));
+      } else {
+        r->flags = 0;
+        ids[n++] = idx;
+      }
+    }
+  }
+  w->cur = now;
+
+  return n;
+}
+
+/** Time until the first non-empty RTO wheel slot has passed [us] */
+static uint32_t rto_next_ts(struct qman_thread *t, uint32_t cur_ts)
+{
+  struct qman_rto_wheel *w = t->rto_wheel;
+  uint32_t i, end;
+
+  if (w->num == 0)
+    return -1;
+
+  for (i = 0; i < RTO_SLOTS; i++) {
+    if (w->slots[(w->cur + i) & RTO_SLOT_MASK] != IDXLIST_INVAL)
+      break;
+  }
+
+  end = (w->cur + i + 1) << RTO_SLOT_SHIFT;
+  return ((int32_t) (end - cur_ts) > 0 ? end - cur_ts : 0);
+}
+
 /** Actually update queue state: must run on queue's home core */
 static void inline set_impl(struct qman_thread *t, uint32_t idx, uint32_t rate,
     uint32_t avail, uint16_t max_chunk, uint8_t flags)
@@ -233,6 +564,8 @@ static void inline set_impl(struct qman_thread *t, uint32_t idx, uint32_t rate,
 
   if (new_avail && q->avail > 0
       && ((q->flags & (FLAG_INSKIPLIST | FLAG_INNOLIMITL)) == 0)) {
+    q->cls = fp_state->flowst[idx].db_id < FLEXNIC_PL_APPCTX_NUM ?
+      fp_state->flowst[idx].db_id : 0;
     queue_activate(t, q, idx);
   }
 }
@@ -244,7 +577,7 @@ static void inline set_impl(struct qman_thread *t, uint32_t idx, uint32_t rate,
 static inline void queue_activate_nolimit(struct qman_thread *t,
     struct queue *q, uint32_t idx)
 {
-  struct queue *q_tail;
+  struct qman_class *c = &t->classes[q->cls];
 
   assert((q->flags & (FLAG_INSKIPLIST | FLAG_INNOLIMITL)) == 0);
 
@@ -252,43 +585,152 @@ static inline void queue_activate_nolimit(struct qman_thread *t,
 
   q->flags |= FLAG_INNOLIMITL;
   q->next_idxs[0] = IDXLIST_INVAL;
-  if (t->nolimit_tail_idx == IDXLIST_INVAL) {
-    t->nolimit_head_idx = t->nolimit_tail_idx = idx;
-    return;
+  if (c->nl_tail_idx == IDXLIST_INVAL) {
+    c->nl_head_idx = c->nl_tail_idx = idx;
+  } else {
+    t->queues[c->nl_tail_idx].next_idxs[0] = idx;
+    c->nl_tail_idx = idx;
   }
 
-  q_tail = &t->queues[t->nolimit_tail_idx];
-  q_tail->next_idxs[0] = idx;
-  t->nolimit_tail_idx = idx;
+  /* add class to the end of the active list */
+  if (!c->active) {
+    c->active = 1;
+    c->deficit = 0;
+    c->next_cls = CLS_INVAL;
+    if (t->cls_tail == CLS_INVAL) {
+      t->cls_head = q->cls;
+    } else {
+      t->classes[t->cls_tail].next_cls = q->cls;
+    }
+    t->cls_tail = q->cls;
+  }
 }
 
-/** Poll no-limit queues */
+/** Remove first no-limit queue from class */
+static inline uint32_t class_pop(struct qman_thread *t, struct qman_class *c)
+{
+  uint32_t idx = c->nl_head_idx;
+  struct queue *q = &t->queues[idx];
+
+  c->nl_head_idx = q->next_idxs[0];
+  if (c->nl_head_idx == IDXLIST_INVAL)
+    c->nl_tail_idx = IDXLIST_INVAL;
+
+  q->flags &= ~FLAG_INNOLIMITL;
+  return idx;
+}
+
+/** Poll no-limit queues, deficit round robin across classes */
 static inline unsigned poll_nolimit(struct qman_thread *t, uint32_t cur_ts,
     unsigned num, unsigned *q_ids, uint16_t *q_bytes)
 {
   unsigned cnt;
   struct queue *q;
-  uint32_t idx;
+  struct qman_class *c;
+  uint32_t idx, max_vts;
+  uint16_t ci, weight;
 
-  for (cnt = 0; cnt < num && t->nolimit_head_idx != IDXLIST_INVAL;) {
-    idx = t->nolimit_head_idx;
-    q = t->queues + idx;
+  max_vts = t->ts_virtual + (cur_ts - t->ts_real);
 
-    t->nolimit_head_idx = q->next_idxs[0];
-    if (q->next_idxs[0] == IDXLIST_INVAL)
-      t->nolimit_tail_idx = IDXLIST_INVAL;
+  for (cnt = 0; cnt < num && t->cls_head != CLS_INVAL;) {
+    ci = t->cls_head;
+    c = &t->classes[ci];
+
+    /* class is out of queues: remove from active list */
+    if (c->nl_head_idx == IDXLIST_INVAL) {
+      t->cls_head = c->next_cls;
+      if (t->cls_head == CLS_INVAL)
+        t->cls_tail = CLS_INVAL;
+      c->active = 0;
+      continue;
+    }
+
+    /* used up this round: refill and move to the end of the list */
+    if (c->deficit <= 0) {
+      weight = t->actx[ci].qos_weight;
+      c->deficit += (weight > 0 ? weight : 1) * CLS_QUANTUM;
+      if (c->next_cls != CLS_INVAL) {
+        t->cls_head = c->next_cls;
+        t->classes[t->cls_tail].next_cls = ci;
+        t->cls_tail = ci;
+        c->next_cls = CLS_INVAL;
+      }
+      continue;
+    }
+
+    idx = class_pop(t, c);
+    q = t->queues + idx;
 
-    q->flags &= ~FLAG_INNOLIMITL;
     dprintf("poll_nolimit: t=%p q=%p idx=%u avail=%u rate=%u flags=%x\n", t, q, idx, q->avail, q->rate, q->flags);
-    if (q->avail > 0) {
-      queue_fire(t, q, idx, q_ids + cnt, q_bytes + cnt);
-      cnt++;
+    if (q->avail == 0)
+      continue;
+
+    /* class over its rate cap: park all its queues until it may send */
+    if (class_throttle(t, q, idx, max_vts)) {
+      while (c->nl_head_idx != IDXLIST_INVAL) {
+        idx = class_pop(t, c);
+        class_throttle(t, &t->queues[idx], idx, max_vts);
+      }
+      continue;
     }
+
+    c->deficit -= (q->avail <= q->max_chunk ? q->avail : q->max_chunk);
+    queue_fire(t, q, idx, q_ids + cnt, q_bytes + cnt);
+    cnt++;
   }
 
   return cnt;
 }
 
+/*****************************************************************************/
+/* Per class rate caps */
+
+/**
+ * If the queue's class has a rate cap and may not send before max_vts,
+ * schedule the queue for when it can and return 1.
+ */
+static inline int class_throttle(struct qman_thread *t, struct queue *q,
+    uint32_t idx, uint32_t max_vts)
+{
+  struct qman_class *c = &t->classes[q->cls];
+
+  if (t->actx[q->cls].qos_rate == 0 ||
+      timestamp_lessthaneq(t, c->next_ts, max_vts) ||
+      rel_time(t->ts_virtual, c->next_ts) > CLS_MAX_AHEAD)
+  {
+    return 0;
+  }
+
+  /* bypasses queue_activate, no-limit queues have no rate to adjust by */
+  q->next_ts = c->next_ts;
+  if (config.fp_qman == CONFIG_FP_QMAN_WHEEL) {
+    wheel_insert(t, q, idx);
+  } else {
+    skiplist_insert(t, q, idx);
+  }
+  q->flags |= FLAG_INSKIPLIST;
+  return 1;
+}
+
+/** Charge bytes sent from queue against its class' rate cap */
+static inline void class_charge(struct qman_thread *t, struct queue *q,
+    uint32_t bytes)
+{
+  struct qman_class *c = &t->classes[q->cls];
+  uint32_t rate = t->actx[q->cls].qos_rate;
+
+  if (rate == 0)
+    return;
+
+  /* don't accumulate credit while idle */
+  if (timestamp_lessthaneq(t, c->next_ts, t->ts_virtual) ||
+      rel_time(t->ts_virtual, c->next_ts) > CLS_MAX_AHEAD)
+  {
+    c->next_ts = t->ts_virtual;
+  }
+  c->next_ts += ((uint64_t) bytes * 8 * 1000000) / rate;
+}
+
 /*****************************************************************************/
 /* Managing skiplist queues */
 
@@ -298,32 +740,47 @@ static inline uint32_t queue_new_ts(struct qman_thread *t, struct queue *q,
   return t->ts_virtual + ((uint64_t) bytes * 8 * 1000000) / q->rate;
 }
 
+/**
+ * Make sure queue has a reasonable next_ts:
+ *  - not in the past
+ *  - not more than if it just sent max_chunk at the current rate
+ */
+static inline uint32_t queue_adjust_ts(struct qman_thread *t, struct queue *q)
+{
+  uint32_t ts, max_ts;
+
+  ts = q->next_ts;
+  max_ts = queue_new_ts(t, q, q->max_chunk);
+  if (timestamp_lessthaneq(t, ts, t->ts_virtual)) {
+    ts = t->ts_virtual;
+  } else if (!timestamp_lessthaneq(t, ts, max_ts)) {
+    ts = max_ts;
+  }
+  q->next_ts = ts;
+  return ts;
+}
+
 /** Add queue to the skip list list */
 static inline void queue_activate_skiplist(struct qman_thread *t,
     struct queue *q, uint32_t q_idx)
 {
-  uint8_t level;
-  int8_t l;
-  uint32_t preds[QMAN_SKIPLIST_LEVELS];
-  uint32_t pred, idx, ts, max_ts;
-
   assert((q->flags & (FLAG_INSKIPLIST | FLAG_INNOLIMITL)) == 0);
 
   dprintf("queue_activate_skiplist: t=%p q=%p idx=%u avail=%u rate=%u flags=%x ts_virt=%u next_ts=%u\n", t, q, q_idx, q->avail, q->rate, q->flags,
       t->ts_virtual, q->next_ts);
 
-  /* make sure queue has a reasonable next_ts:
-   *  - not in the past
-   *  - not more than if it just sent max_chunk at the current rate
-   */
-  ts = q->next_ts;
-  max_ts = queue_new_ts(t, q, q->max_chunk);
-  if (timestamp_lessthaneq(t, ts, t->ts_virtual)) {
-    ts = q->next_ts = t->ts_virtual;
-  } else if (!timestamp_lessthaneq(t, ts, max_ts)) {
-    ts = q->next_ts = max_ts;
-  }
-  q->next_ts = ts;
+  queue_adjust_ts(t, q);
+  skiplist_insert(t, q, q_idx);
+}
+
+/** Insert queue into skiplist at its next_ts */
+static inline void skiplist_insert(struct qman_thread *t, struct queue *q,
+    uint32_t q_idx)
+{
+  uint8_t level;
+  int8_t l;
+  uint32_t preds[QMAN_SKIPLIST_LEVELS];
+  uint32_t pred, idx, ts = q->next_ts;
 
   /* find predecessors at all levels top-down */
   pred = IDXLIST_INVAL;
@@ -405,7 +862,7 @@ static inline unsigned poll_skiplist(struct qman_thread *t, uint32_t cur_ts,
 
     dprintf("poll_skiplist: t=%p q=%p idx=%u avail=%u rate=%u flags=%x\n", t, q, idx, q->avail, q->rate, q->flags);
 
-    if (q->avail > 0) {
+    if (q->avail > 0 && !class_throttle(t, q, idx, max_vts)) {
       queue_fire(t, q, idx, q_ids + cnt, q_bytes + cnt);
       cnt++;
     }
@@ -434,6 +891,227 @@ static inline uint8_t queue_level(struct qman_thread *t)
   return (x < QMAN_SKIPLIST_LEVELS ? x : QMAN_SKIPLIST_LEVELS - 1);
 }
 
+/*****************************************************************************/
+/* Managing timer wheel queues */
+
+static inline void wheel_push(struct qman_thread *t, unsigned l, uint32_t s,
+    struct queue *q, uint32_t idx)
+{
+  struct qman_wheel *w = t->wheel;
+  struct wheel_slot *ws = &w->slots[l][s];
+
+  q->next_idxs[0] = IDXLIST_INVAL;
+  if (ws->tail_idx == IDXLIST_INVAL) {
+    ws->head_idx = ws->tail_idx = idx;
+    w->bitmap[l][s / 64] |= 1ULL << (s % 64);
+  } else {
+    t->queues[ws->tail_idx].next_idxs[0] = idx;
+    ws->tail_idx = idx;
+  }
+  w->num++;
+}
+
+static inline uint32_t wheel_pop(struct qman_thread *t, unsigned l, uint32_t s)
+{
+  struct qman_wheel *w = t->wheel;
+  struct wheel_slot *ws = &w->slots[l][s];
+  uint32_t idx = ws->head_idx;
+
+  assert(idx != IDXLIST_INVAL);
+  ws->head_idx = t->queues[idx].next_idxs[0];
+  if (ws->head_idx == IDXLIST_INVAL) {
+    ws->tail_idx = IDXLIST_INVAL;
+    w->bitmap[l][s / 64] &= ~(1ULL << (s % 64));
+  }
+  w->num--;
+  return idx;
+}
+
+/** First non-empty slot in [from, WHEEL_SLOTS) on level l, or -1 */
+static inline int wheel_next_slot(struct qman_thread *t, unsigned l,
+    uint32_t from)
+{
+  const uint64_t *bm = t->wheel->bitmap[l];
+  uint32_t i = from / 64;
+  uint64_t x;
+
+  if (from >= WHEEL_SLOTS)
+    return -1;
+
+  x = bm[i] & (~0ULL << (from % 64));
+  while (x == 0) {
+    if (++i >= WHEEL_SLOTS / 64)
+      return -1;
+    x = bm[i];
+  }
+  return i * 64 + __builtin_ctzll(x);
+}
+
+/** Start of the next non-empty level 1 slot after the current one. */
+static inline uint32_t wheel_next_l1(struct qman_thread *t, uint32_t *ps)
+{
+  uint32_t nb = (t->wheel_ts | WHEEL_L1_MASK) + 1;
+  uint32_t c = (nb >> WHEEL_L1_SHIFT) & WHEEL_SLOT_MASK;
+  int s;
+
+  if ((s = wheel_next_slot(t, 1, c)) < 0) {
+    s = wheel_next_slot(t, 1, 0);
+  }
+  assert(s >= 0);
+
+  *ps = s;
+  return nb + ((((uint32_t) s - c) & WHEEL_SLOT_MASK) << WHEEL_L1_SHIFT);
+}
+
+static inline void wheel_insert(struct qman_thread *t, struct queue *q,
+    uint32_t idx)
+{
+  int64_t d = rel_time(t->wheel_ts, q->next_ts);
+  uint32_t ts;
+
+  /* overdue queues go in the current slot, too far out ones are capped */
+  if (d < 0) {
+    d = 0;
+  } else if (d > WHEEL_HORIZON) {
+    d = WHEEL_HORIZON;
+    q->next_ts = t->wheel_ts + WHEEL_HORIZON;
+  }
+  ts = t->wheel_ts + d;
+
+  if ((ts >> WHEEL_L1_SHIFT) == (t->wheel_ts >> WHEEL_L1_SHIFT)) {
+    wheel_push(t, 0, (ts >> WHEEL_L0_SHIFT) & WHEEL_SLOT_MASK, q, idx);
+  } else {
+    wheel_push(t, 1, (ts >> WHEEL_L1_SHIFT) & WHEEL_SLOT_MASK, q, idx);
+  }
+}
+
+/** Add queue to the timer wheel */
+static inline void queue_activate_wheel(struct qman_thread *t,
+    struct queue *q, uint32_t idx)
+{
+  assert((q->flags & (FLAG_INSKIPLIST | FLAG_INNOLIMITL)) == 0);
+
+  dprintf("queue_activate_wheel: t=%p q=%p idx=%u avail=%u rate=%u flags=%x ts_virt=%u next_ts=%u\n", t, q, idx, q->avail, q->rate, q->flags,
+      t->ts_virtual, q->next_ts);
+
+  queue_adjust_ts(t, q);
+  wheel_insert(t, q, idx);
+  q->flags |= FLAG_INSKIPLIST;
+}
+
+/** Poll timer wheel queues */
+static inline unsigned poll_wheel(struct qman_thread *t, uint32_t cur_ts,
+    unsigned num, unsigned *q_ids, uint16_t *q_bytes)
+{
+  struct qman_wheel *w = t->wheel;
+  unsigned cnt;
+  uint32_t idx, max_vts, slot_ts, s;
+  struct queue *q;
+  int s0;
+
+  /* maximum virtual time stamp that can be reached */
+  max_vts = t->ts_virtual + (cur_ts - t->ts_real);
+
+  for (cnt = 0; cnt < num;) {
+    /* no more queues */
+    if (w->num == 0) {
+      t->ts_virtual = max_vts;
+      t->wheel_ts = max_vts & ~WHEEL_L0_MASK;
+      break;
+    }
+
+    s0 = wheel_next_slot(t, 0,
+        (t->wheel_ts >> WHEEL_L0_SHIFT) & WHEEL_SLOT_MASK);
+    if (s0 < 0) {
+      /* nothing left in this turn of level 0, go to next level 1 slot */
+      slot_ts = wheel_next_l1(t, &s);
+      if (!timestamp_lessthaneq(t, slot_ts, max_vts)) {
+        t->ts_virtual = max_vts;
+        t->wheel_ts = max_vts & ~WHEEL_L0_MASK;
+        break;
+      }
+
+      /* cascade into level 0 */
+      t->wheel_ts = slot_ts;
+      if (timestamp_lessthaneq(t, t->ts_virtual, slot_ts))
+        t->ts_virtual = slot_ts;
+      while (w->slots[1][s].head_idx != IDXLIST_INVAL) {
+        idx = wheel_pop(t, 1, s);
+        wheel_insert(t, &t->queues[idx], idx);
+      }
+      continue;
+    }
+
+    /* beyond max_vts */
+    slot_ts = (t->wheel_ts & ~WHEEL_L1_MASK) | ((uint32_t) s0 << WHEEL_L0_SHIFT);
+    if (!timestamp_lessthaneq(t, slot_ts, max_vts)) {
+      t->ts_virtual = max_vts;
+      t->wheel_ts = max_vts & ~WHEEL_L0_MASK;
+      break;
+    }
+    t->wheel_ts = slot_ts;
+
+    idx = wheel_pop(t, 0, s0);
+    q = &t->queues[idx];
+    assert((q->flags & FLAG_INSKIPLIST) != 0);
+    q->flags &= ~FLAG_INSKIPLIST;
+
+    /* advance virtual timestamp, queues within a slot are not ordered, and
+     * never let it fall behind the wheel */
+    if (timestamp_lessthaneq(t, t->ts_virtual, slot_ts))
+      t->ts_virtual = slot_ts;
+    if (timestamp_lessthaneq(t, t->ts_virtual, q->next_ts)) {
+      t->ts_virtual = (timestamp_lessthaneq(t, q->next_ts, max_vts) ?
+          q->next_ts : max_vts);
+    }
+
+    dprintf("poll_wheel: t=%p q=%p idx=%u avail=%u rate=%u flags=%x\n", t, q, idx, q->avail, q->rate, q->flags);
+
+    /* class caps only at slot granularity, or a throttled queue could land
+     * in the slot we are polling again */
+    if (q->avail > 0 &&
+        !class_throttle(t, q, idx, max_vts | WHEEL_L0_MASK))
+    {
+      queue_fire(t, q, idx, q_ids + cnt, q_bytes + cnt);
+      cnt++;
+    }
+  }
+
+  /* if we reached the limit, update the virtual timestamp correctly */
+  if (cnt == num) {
+    if (wheel_next_ts(t, &slot_ts) == 0 &&
+        timestamp_lessthaneq(t, slot_ts, max_vts))
+    {
+      if (timestamp_lessthaneq(t, t->ts_virtual, slot_ts))
+        t->ts_virtual = slot_ts;
+    } else {
+      t->ts_virtual = max_vts;
+      t->wheel_ts = max_vts & ~WHEEL_L0_MASK;
+    }
+  }
+
+  t->ts_real = cur_ts;
+  return cnt;
+}
+
+/** Start of the earliest non-empty slot, returns -1 if wheel is empty */
+static inline int wheel_next_ts(struct qman_thread *t, uint32_t *ts)
+{
+  uint32_t s;
+  int s0;
+
+  if (t->wheel->num == 0)
+    return -1;
+
+  s0 = wheel_next_slot(t, 0, (t->wheel_ts >> WHEEL_L0_SHIFT) & WHEEL_SLOT_MASK);
+  if (s0 >= 0) {
+    *ts = (t->wheel_ts & ~WHEEL_L1_MASK) | ((uint32_t) s0 << WHEEL_L0_SHIFT);
+  } else {
+    *ts = wheel_next_l1(t, &s);
+  }
+  return 0;
+}
+
 /*****************************************************************************/
 
 static inline void queue_fire(struct qman_thread *t,
@@ -445,6 +1123,7 @@ static inline void queue_fire(struct qman_thread *t,
 
   bytes = (q->avail <= q->max_chunk ? q->avail : q->max_chunk);
   q->avail -= bytes;
+  class_charge(t, q, bytes);
 
   dprintf("queue_fire: t=%p q=%p idx=%u gidx=%u bytes=%u avail=%u rate=%u\n", t, q, idx, idx, bytes, q->avail, q->rate);
   if (q->rate > 0) {
@@ -471,6 +1150,8 @@ static inline void queue_activate(struct qman_thread *t, struct queue *q,
 {
   if (q->rate == 0) {
     queue_activate_nolimit(t, q, idx);
+  } else if (config.fp_qman == CONFIG_FP_QMAN_WHEEL) {
+    queue_activate_wheel(t, q, idx);
   } else {
     queue_activate_skiplist(t, q, idx);
   }
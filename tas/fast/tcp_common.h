@@ -233,10 +233,85 @@ static inline uint32_t tcp_txavail(const struct flextcp_pl_flowst *fs,
   return MIN(buf_avail, fc_avail);
 }
 
+/** Check if sequence number a comes before b, wrap-around safe */
+static inline int tcp_seq_lt(uint32_t a, uint32_t b)
+{
+  return (int32_t) (a - b) < 0;
+}
+
+/**
+ * Add interval to list of disjoint intervals sorted by start, merging it with
+ * overlapping or adjacent entries.
+ *
+ * @param ints  Interval list.
+ * @param num   Number of valid entries, updated.
+ * @param max   Capacity of the list.
+ * @param start First sequence number of new interval.
+ * @param len   Length of new interval.
+ *
+ * @return 0 if added, -1 if it would need a new entry but the list is full.
+ */
+static inline int tcp_seqint_add(struct flextcp_pl_seqint *ints, uint8_t *num,
+    uint8_t max, uint32_t start, uint32_t len)
+{
+  uint32_t end = start + len, e;
+  uint8_t i, j, k, n = *num;
+
+  /* first entry not ending before the new interval */
+  for (i = 0; i < n && tcp_seq_lt(ints[i].start + ints[i].len, start); i++);
+
+  if (i == n || tcp_seq_lt(end, ints[i].start)) {
+    /* no overlap, insert new entry at i */
+    if (n == max)
+      return -1;
+    for (j = n; j > i; j--)
+      ints[j] = ints[j - 1];
+    ints[i].start = start;
+    ints[i].len = len;
+    *num = n + 1;
+    return 0;
+  }
+
+  /* merge into entry i and absorb the following ones it now reaches */
+  if (tcp_seq_lt(ints[i].start, start))
+    start = ints[i].start;
+  for (j = i; j < n && !tcp_seq_lt(end, ints[j].start); j++) {
+    e = ints[j].start + ints[j].len;
+    if (tcp_seq_lt(end, e))
+      end = e;
+  }
+  ints[i].start = start;
+  ints[i].len = end - start;
+
+  /* close gap left by absorbed entries */
+  k = j - i - 1;
+  for (j = i + 1; j + k < n; j++)
+    ints[j] = ints[j + k];
+  *num = n - k;
+  return 0;
+}
+
+/** Remove entries at the front of interval list that end at or before seq. */
+static inline void tcp_seqint_trim(struct flextcp_pl_seqint *ints,
+    uint8_t *num, uint32_t seq)
+{
+  uint8_t i, k, n = *num;
+
+  for (k = 0; k < n && !tcp_seq_lt(seq, ints[k].start + ints[k].len); k++);
+  if (k == 0)
+    return;
+
+  for (i = 0; i + k < n; i++)
+    ints[i] = ints[i + k];
+  *num = n - k;
+}
+
 /** Pointers to parsed TCP options */
 struct tcp_opts {
   /** Timestamp option */
   struct tcp_timestamp_opt *ts;
+  /** Selective acknowledgement option */
+  struct tcp_sack_opt *sack;
 };
 
 /**
@@ -258,6 +333,7 @@ static inline int tcp_parse_options(const struct pkt_tcp *p, uint16_t len,
   uint8_t opt_kind, opt_len, opt_avail;
 
   opts->ts = NULL;
+  opts->sack = NULL;
 
   /* whole header not in buf */
   if (TCPH_HDRLEN(&p->tcp) < 5 || opts_len > (len - sizeof(*p))) {
@@ -289,6 +365,16 @@ static inline int tcp_parse_options(const struct pkt_tcp *p, uint16_t len,
         }
 
         opts->ts = (struct tcp_timestamp_opt *) (opt + off);
+      } else if (opt_kind == TCP_OPT_SACK) {
+        if (opt_len < 2 + sizeof(struct tcp_sack_block) ||
+            (opt_len - 2) % sizeof(struct tcp_sack_block) != 0 ||
+            opt_len > opt_avail)
+        {
+          fprintf(stderr, "parse_options: sack opt_len=%u\n", opt_len);
+          return -1;
+        }
+
+        opts->sack = (struct tcp_sack_opt *) (opt + off);
       }
     }
     off += opt_len;
@@ -0,0 +1,965 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Fast path microbenchmarks: runs individual fast path operations on
+ * synthetic flows and generated TCP segments, without slow path or apps, and
+ * reports cycles per operation. TAS options go after --, with a DPDK virtual
+ * device no NIC is needed, e.g.:
+ *
+ *   tas/fast/tests/fp_bench -f 4096 -- --ip-addr=10.0.0.1/24 \
+ *       --fp-flows=8192 --dpdk-extra=--no-huge --dpdk-extra=--vdev=net_null0
+ *
+ * This uses the same shared memory regions as tas, so it can't run next to
+ * it. Where perf events are permitted (perf_event_paranoid), instructions
+ * per cycle and L1 instruction cache misses per operation are reported too.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <rte_config.h>
+#include <rte_eal.h>
+#include <rte_malloc.h>
+#include <rte_cycles.h>
+#include <rte_hash_crc.h>
+
+#include <tas.h>
+#include <fastpath.h>
+#include <tas_memif.h>
+#include <utils_rng.h>
+
+#include "../internal.h"
+#include "../fastemu.h"
+
+/** Entries in the app rx queue of the benchmark context */
+#define ARX_ENTRIES 4096
+/** Max. segment payload, same as the fast path's MSS with timestamps */
+#define SEG_MAX 1448
+
+enum {
+  BENCH_LOOKUP,
+  BENCH_GRO,
+  BENCH_RX,
+  BENCH_ARX,
+  BENCH_QMAN,
+  BENCH_QMANRL,
+  BENCH_FSCONTEND,
+  BENCH_NUM,
+};
+
+/* what the second core reads while core 0 receives, see bench_fscontend */
+enum {
+  CONTEND_NONE,
+  CONTEND_STATS,
+  CONTEND_FLOWST,
+  CONTEND_NUM,
+};
+
+/* user space hardware counters around the measured sections */
+enum {
+  PMU_CYCLES,
+  PMU_INSNS,
+  PMU_ICMISS,
+  PMU_NUM,
+};
+
+struct pmu_acc {
+  uint64_t start[PMU_NUM];
+  uint64_t total[PMU_NUM];
+};
+
+static const char *bench_names[BENCH_NUM] = {
+  [BENCH_LOOKUP] = "lookup",
+  [BENCH_GRO] = "gro",
+  [BENCH_RX] = "rx",
+  [BENCH_ARX] = "arx",
+  [BENCH_QMAN] = "qman",
+  [BENCH_QMANRL] = "qmanrl",
+  [BENCH_FSCONTEND] = "fscontend",
+};
+
+/* symbols tas.c and the slow path provide for the fast path */
+struct configuration config;
+unsigned fp_cores_max;
+volatile unsigned fp_cores_cur = 1;
+volatile unsigned fp_scale_to = 0;
+int exited = 0;
+struct dataplane_context **ctxs = NULL;
+int kernel_notifyfd = 0;
+
+static struct dataplane_context *ctx;
+static struct utils_rng rng;
+/* sequence number of the next segment the generator sends on each flow */
+static uint32_t *gen_seqs;
+
+static unsigned opt_flows = 1024;
+static unsigned opt_rounds = 100000;
+static unsigned opt_payload = 64;
+static unsigned opt_run = 1;
+static unsigned opt_rxbuf = 16384;
+/* needs a second core, so only run when asked for */
+static unsigned opt_benches = ((1 << BENCH_NUM) - 1) &
+    ~(1 << BENCH_FSCONTEND);
+static unsigned opt_cpu = 1;
+
+/* state shared with the contending thread */
+static volatile int contend_stop;
+static unsigned contend_mode;
+static uint64_t contend_reads;
+static uint64_t contend_cycles;
+
+static int pmu_fds[PMU_NUM];
+static struct perf_event_mmap_page *pmu_pages[PMU_NUM];
+static int pmu_ok = 0;
+
+static void usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [OPTION]... -- TAS-OPTION...\n"
+      "  -f FLOWS   Number of synthetic flows [default: %u]\n"
+      "  -n ROUNDS  Batches of %u packets per benchmark "
+          "[default: %u]\n"
+      "  -s BYTES   Payload per segment [default: %u]\n"
+      "  -g SEGS    Consecutive segments per flow in a batch "
+          "[default: %u]\n"
+      "  -r BYTES   Receive buffer per flow [default: %u]\n"
+      "  -b LIST    Benchmarks to run, comma separated from lookup,gro,rx,"
+          "arx,qman,\n"
+      "             qmanrl,fscontend [default: all but fscontend]\n"
+      "  -c CPU     CPU for the second core in fscontend [default: %u]\n",
+      progname, opt_flows, BATCH_SIZE, opt_rounds, opt_payload, opt_run,
+      opt_rxbuf, opt_cpu);
+}
+
+static int parse_benches(char *str, unsigned *mask)
+{
+  char *tok, *save = NULL;
+  unsigned i;
+
+  *mask = 0;
+  for (tok = strtok_r(str, ",", &save); tok != NULL;
+      tok = strtok_r(NULL, ",", &save))
+  {
+    for (i = 0; i < BENCH_NUM && strcmp(tok, bench_names[i]) != 0; i++);
+    if (i == BENCH_NUM) {
+      fprintf(stderr, "parse_benches: unknown benchmark %s\n", tok);
+      return -1;
+    }
+    *mask |= 1 << i;
+  }
+  return 0;
+}
+
+static int parse_uint(const char *str, unsigned min, unsigned *val)
+{
+  char *end;
+  unsigned long v;
+
+  v = strtoul(str, &end, 10);
+  if (*str == 0 || *end != 0 || v < min || v > UINT32_MAX) {
+    fprintf(stderr, "parse_uint: invalid value %s\n", str);
+    return -1;
+  }
+  *val = v;
+  return 0;
+}
+
+/* app context 0 on core 0 receives the notifications of all flows, its rx
+ * queue is at the start of dma memory */
+static int appctx_setup(void)
+{
+  struct flextcp_pl_appctx *actx = &fp_state->appctx[0][0];
+
+  actx->rx_base = 0;
+  actx->rx_len = ARX_ENTRIES * sizeof(struct flextcp_pl_arx);
+  actx->rx_avail = actx->rx_len;
+  actx->appst_id = 0;
+  if ((actx->evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+    perror("appctx_setup: eventfd failed");
+    return -1;
+  }
+  return 0;
+}
+
+/* fill in flow state and lookup table entry, as the slow path does on
+ * connection setup, receive and transmit buffers follow the app rx queue */
+static int flows_setup(void)
+{
+  struct flextcp_pl_flowst *fs;
+  struct flextcp_pl_flowhtb *htb;
+  uint64_t base = ARX_ENTRIES * sizeof(struct flextcp_pl_arx);
+  uint32_t i, j, b, h;
+  struct {
+    ip_addr_t lip;
+    ip_addr_t rip;
+    beui16_t lp;
+    beui16_t rp;
+  } __attribute__((packed)) hk;
+
+  if (opt_flows > config.fp_flows) {
+    fprintf(stderr, "flows_setup: %u flows, but only %u flow states "
+        "(--fp-flows)\n", opt_flows, config.fp_flows);
+    return -1;
+  }
+  if (base + 2ULL * opt_flows * opt_rxbuf > FLEXNIC_DMA_MEM_SIZE) {
+    fprintf(stderr, "flows_setup: flow buffers don't fit in dma memory\n");
+    return -1;
+  }
+
+  if ((gen_seqs = calloc(opt_flows, sizeof(*gen_seqs))) == NULL) {
+    perror("flows_setup: calloc failed");
+    return -1;
+  }
+
+  for (i = 0; i < opt_flows; i++) {
+    fs = &fp_state->flowst[i];
+    memset(fs, 0, sizeof(*fs));
+    memset(&fp_flowst_stats[i], 0, sizeof(fp_flowst_stats[i]));
+
+    fs->opaque = i;
+    fs->rx_base_sp = base + 2ULL * i * opt_rxbuf;
+    fs->tx_base = fs->rx_base_sp + opt_rxbuf;
+    fs->rx_len = opt_rxbuf;
+    fs->tx_len = opt_rxbuf;
+    memset(&fs->remote_mac, 0x02, ETH_ADDR_LEN);
+    fs->db_id = 0;
+
+    fs->local_ip = t_beui32(config.ip);
+    fs->remote_ip = t_beui32(config.ip + 1 + i / 60000);
+    fs->local_port = t_beui16(1234);
+    fs->remote_port = t_beui16(1024 + i % 60000);
+
+    fs->flow_group = 0;
+    fs->port = 0;
+    fs->rx_avail = opt_rxbuf;
+    fs->rx_next_seq = utils_rng_gen32(&rng);
+    fs->rx_remote_avail = opt_rxbuf;
+    fs->tx_next_seq = utils_rng_gen32(&rng);
+    fs->tx_recover = fs->tx_next_seq;
+    fs->steer_core = FLEXNIC_PL_FLOWST_NOSTEER;
+
+    /* insert in the first candidate bucket with room */
+    hk.lip = fs->local_ip;
+    hk.rip = fs->remote_ip;
+    hk.lp = fs->local_port;
+    hk.rp = fs->remote_port;
+    h = rte_hash_crc(&hk, sizeof(hk), 0);
+
+    b = FLEXNIC_PL_FLOWHT_B1(h, fp_flowht_num);
+    for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ &&
+        (fp_flowht[b].flow_id[j] & FLEXNIC_PL_FLOWHTE_VALID) != 0; j++);
+    if (j == FLEXNIC_PL_FLOWHT_NBSZ) {
+      b = FLEXNIC_PL_FLOWHT_B2(h, fp_flowht_num);
+      for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ &&
+          (fp_flowht[b].flow_id[j] & FLEXNIC_PL_FLOWHTE_VALID) != 0; j++);
+    }
+    if (j == FLEXNIC_PL_FLOWHT_NBSZ) {
+      fprintf(stderr, "flows_setup: no lookup table slot for flow %u\n", i);
+      return -1;
+    }
+
+    htb = &fp_flowht[b];
+    htb->flow_hash[j] = h;
+    htb->flow_id[j] = FLEXNIC_PL_FLOWHTE_VALID | i;
+  }
+
+  return 0;
+}
+
+/* generator continues where the fast path expects the next segment */
+static void gen_reset(void)
+{
+  uint32_t i;
+
+  for (i = 0; i < opt_flows; i++) {
+    gen_seqs[i] = fp_state->flowst[i].rx_next_seq;
+  }
+}
+
+/* in-order data segment from the remote end of flow f */
+static void gen_segment(struct network_buf_handle *nbh, uint32_t f,
+    uint32_t ts)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[f];
+  struct pkt_tcp *p = network_buf_bufoff(nbh);
+  struct tcp_timestamp_opt *opt_ts;
+  uint16_t optlen, hdrs_len;
+
+  optlen = (sizeof(*opt_ts) + 3) & ~3;
+  hdrs_len = sizeof(*p) + optlen;
+
+  memcpy(&p->eth.dest, &eth_addr, ETH_ADDR_LEN);
+  p->eth.src = fs->remote_mac;
+  p->eth.type = t_beui16(ETH_TYPE_IP);
+
+  IPH_VHL_SET(&p->ip, 4, 5);
+  p->ip._tos = 0;
+  p->ip.len = t_beui16(hdrs_len - offsetof(struct pkt_tcp, ip) +
+      opt_payload);
+  p->ip.id = t_beui16(0);
+  p->ip.offset = t_beui16(0);
+  p->ip.ttl = 0xff;
+  p->ip.proto = IP_PROTO_TCP;
+  p->ip.chksum = 0;
+  p->ip.src = fs->remote_ip;
+  p->ip.dest = fs->local_ip;
+
+  p->tcp.src = fs->remote_port;
+  p->tcp.dest = fs->local_port;
+  p->tcp.seqno = t_beui32(gen_seqs[f]);
+  p->tcp.ackno = t_beui32(fs->tx_next_seq);
+  TCPH_HDRLEN_FLAGS_SET(&p->tcp, 5 + optlen / 4, TCP_PSH | TCP_ACK);
+  p->tcp.wnd = t_beui16(0xffff);
+  p->tcp.chksum = 0;
+  p->tcp.urgp = t_beui16(0);
+
+  memset(p + 1, 0, optlen);
+  opt_ts = (struct tcp_timestamp_opt *) (p + 1);
+  opt_ts->kind = TCP_OPT_TIMESTAMP;
+  opt_ts->length = sizeof(*opt_ts);
+  opt_ts->ts_val = t_beui32(ts);
+  opt_ts->ts_ecr = t_beui32(0);
+
+  network_buf_setlen(nbh, hdrs_len + opt_payload);
+  gen_seqs[f] += opt_payload;
+}
+
+/* batch of segments on random flows, opt_run in a row on each */
+static int gen_batch(struct network_buf_handle **bhs, uint32_t ts)
+{
+  unsigned i;
+  uint32_t f = 0;
+
+  if (network_buf_alloc(&ctx->net, BATCH_SIZE, bhs) != BATCH_SIZE) {
+    fprintf(stderr, "gen_batch: buffer alloc failed\n");
+    return -1;
+  }
+
+  for (i = 0; i < BATCH_SIZE; i++) {
+    if (i % opt_run == 0)
+      f = utils_rng_gen32(&rng) % opt_flows;
+    gen_segment(bhs[i], f, ts);
+  }
+  return 0;
+}
+
+/* counters only count in user space, so they are read with rdpmc where the
+ * kernel allows it to keep the syscalls out of the measured i-cache misses */
+static void pmu_init(void)
+{
+  static const struct {
+    uint32_t type;
+    uint64_t config;
+  } evs[PMU_NUM] = {
+    [PMU_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PMU_INSNS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PMU_ICMISS] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+  };
+  struct perf_event_attr attr;
+  unsigned i;
+
+  for (i = 0; i < PMU_NUM; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = evs[i].type;
+    attr.config = evs[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    pmu_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pmu_fds[i] < 0) {
+      perror("pmu_init: perf_event_open failed, not reporting counters");
+      return;
+    }
+    pmu_pages[i] = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+        pmu_fds[i], 0);
+    if (pmu_pages[i] == MAP_FAILED)
+      pmu_pages[i] = NULL;
+  }
+  pmu_ok = 1;
+}
+
+static uint64_t pmu_read(unsigned i)
+{
+  struct perf_event_mmap_page *pc = pmu_pages[i];
+  uint64_t v = 0;
+#if defined(__x86_64__)
+  uint32_t seq, idx;
+  int64_t c;
+
+  if (pc != NULL && pc->cap_user_rdpmc) {
+    do {
+      seq = pc->lock;
+      __sync_synchronize();
+      idx = pc->index;
+      v = pc->offset;
+      if (idx != 0) {
+        c = __builtin_ia32_rdpmc(idx - 1);
+        c <<= 64 - pc->pmc_width;
+        c >>= 64 - pc->pmc_width;
+        v += c;
+      }
+      __sync_synchronize();
+    } while (pc->lock != seq);
+    if (idx != 0)
+      return v;
+  }
+#endif
+
+  if (read(pmu_fds[i], &v, sizeof(v)) != sizeof(v))
+    return 0;
+  return v;
+}
+
+static inline void pmu_start(struct pmu_acc *pm)
+{
+  unsigned i;
+
+  if (!pmu_ok)
+    return;
+  for (i = 0; i < PMU_NUM; i++)
+    pm->start[i] = pmu_read(i);
+}
+
+static inline void pmu_stop(struct pmu_acc *pm)
+{
+  unsigned i;
+
+  if (!pmu_ok)
+    return;
+  for (i = 0; i < PMU_NUM; i++)
+    pm->total[i] += pmu_read(i) - pm->start[i];
+}
+
+static void report(const char *name, uint64_t ops, uint64_t cycles,
+    const struct pmu_acc *pm)
+{
+  double cyc = (ops > 0 ? (double) cycles / ops : 0);
+
+  printf("%-12s %12"PRIu64" %12.1f %12.1f", name, ops, cyc,
+      cyc * 1000000000. / rte_get_tsc_hz());
+  if (pmu_ok && pm != NULL) {
+    printf(" %8.2f %10.2f", (pm->total[PMU_CYCLES] > 0 ?
+          (double) pm->total[PMU_INSNS] / pm->total[PMU_CYCLES] : 0),
+        (ops > 0 ? (double) pm->total[PMU_ICMISS] / ops : 0));
+  }
+  printf("\n");
+}
+
+/* flow lookup for a batch of received segments */
+static int bench_lookup(void)
+{
+  struct network_buf_handle *bhs[BATCH_SIZE];
+  void *fss[BATCH_SIZE];
+  struct pmu_acc pm = { .total = { 0 } };
+  uint64_t tsc, cycles = 0;
+  unsigned r, i;
+
+  gen_reset();
+  for (r = 0; r < opt_rounds; r++) {
+    if (gen_batch(bhs, r) != 0)
+      return -1;
+
+    pmu_start(&pm);
+    tsc = rte_get_tsc_cycles();
+    fast_flows_packet_fss(ctx, bhs, fss, BATCH_SIZE);
+    cycles += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm);
+
+    for (i = 0; i < BATCH_SIZE; i++) {
+      if (fss[i] == NULL) {
+        fprintf(stderr, "bench_lookup: lookup failed\n");
+        return -1;
+      }
+    }
+    network_free(BATCH_SIZE, bhs);
+  }
+
+  report("lookup", (uint64_t) opt_rounds * BATCH_SIZE, cycles, &pm);
+  return 0;
+}
+
+/* checks whether consecutive segments in a batch can be merged */
+static int bench_gro(void)
+{
+  struct network_buf_handle *bhs[BATCH_SIZE];
+  struct pmu_acc pm = { .total = { 0 } };
+  uint64_t tsc, cycles = 0, merged = 0;
+  unsigned r, i;
+
+  gen_reset();
+  for (r = 0; r < opt_rounds; r++) {
+    if (gen_batch(bhs, r) != 0)
+      return -1;
+
+    pmu_start(&pm);
+    tsc = rte_get_tsc_cycles();
+    for (i = 1; i < BATCH_SIZE; i++) {
+      merged += fast_flows_packet_gro_check(bhs[i - 1], bhs[i]);
+    }
+    cycles += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm);
+
+    network_free(BATCH_SIZE, bhs);
+  }
+
+  report("gro", (uint64_t) opt_rounds * (BATCH_SIZE - 1), cycles, &pm);
+  printf("  %"PRIu64" segments merged\n", merged);
+  return 0;
+}
+
+/* one batch of receive processing as in rx_process: lookup, parse and the
+ * flow update for each run of segments including the ACK, but without the
+ * arx flush */
+static int rx_round(struct pmu_acc *pm, uint64_t *cycles, uint64_t *slowpath)
+{
+  struct network_buf_handle *bhs[BATCH_SIZE];
+  void *fss[BATCH_SIZE];
+  struct tcp_opts opts[BATCH_SIZE];
+  int rets[BATCH_SIZE];
+  uint64_t tsc;
+  unsigned i, k, n;
+  uint32_t ts;
+  int ret;
+
+  ts = qman_timestamp(rte_get_tsc_cycles());
+  if (gen_batch(bhs, ts) != 0)
+    return -1;
+
+  pmu_start(pm);
+  tsc = rte_get_tsc_cycles();
+  fast_flows_packet_fss(ctx, bhs, fss, BATCH_SIZE);
+  fast_flows_packet_parse(ctx, bhs, fss, opts, BATCH_SIZE);
+  for (i = 0; i < BATCH_SIZE; i += k) {
+    for (k = 1; i + k < BATCH_SIZE && fss[i + k] == fss[i] &&
+        fast_flows_packet_gro_check(bhs[i + k - 1], bhs[i + k]); k++);
+    if (fss[i] == NULL) {
+      rets[i] = -1;
+      continue;
+    }
+    fast_flows_packet(ctx, bhs + i, fss[i], opts + i, k, ts, rets + i);
+  }
+  *cycles += rte_get_tsc_cycles() - tsc;
+  pmu_stop(pm);
+
+  /* buffers with ACKs are on the transmit list now */
+  for (i = 0; i < BATCH_SIZE; i++) {
+    if (rets[i] < 0)
+      (*slowpath)++;
+    if (rets[i] <= 0)
+      network_free(1, &bhs[i]);
+  }
+  if (ctx->tx_num > 0) {
+    n = ctx->tx_num;
+    ret = network_send(&ctx->net, n, ctx->tx_handles);
+    if (ret < 0)
+      ret = 0;
+    network_free(n - ret, ctx->tx_handles + ret);
+    ctx->tx_num = 0;
+  }
+
+  /* the app consumes everything, slow path is not there to report to */
+  ctx->arx_num = 0;
+  ctx->cc_active_num = 0;
+  for (i = 0; i < BATCH_SIZE; i++) {
+    if (fss[i] != NULL)
+      ((struct flextcp_pl_flowst *) fss[i])->rx_avail = opt_rxbuf;
+  }
+  return 0;
+}
+
+static int bench_rx(void)
+{
+  struct pmu_acc pm = { .total = { 0 } };
+  uint64_t cycles = 0, slowpath = 0;
+  unsigned r;
+
+  gen_reset();
+  for (r = 0; r < opt_rounds; r++) {
+    if (rx_round(&pm, &cycles, &slowpath) != 0)
+      return -1;
+  }
+
+  report("rx", (uint64_t) opt_rounds * BATCH_SIZE, cycles, &pm);
+  if (slowpath > 0)
+    printf("  %"PRIu64" segments went to the slow path\n", slowpath);
+  return 0;
+}
+
+/* writing a full arx cache to the app rx queue */
+static int bench_arx(void)
+{
+  struct flextcp_pl_appctx *actx = &fp_state->appctx[0][0];
+  struct pmu_acc pm = { .total = { 0 } };
+  uint64_t tsc, cycles = 0;
+  unsigned r, i;
+  uint32_t ts;
+
+  ctx->rx_tsc = 0;
+  for (r = 0; r < opt_rounds; r++) {
+    ts = qman_timestamp(rte_get_tsc_cycles());
+    for (i = 0; i < BATCH_SIZE; i++) {
+      /* distinct connections, so entries are not merged */
+      arx_cache_add(ctx, 0, (r * BATCH_SIZE + i) % opt_flows, opt_payload,
+          0, 0, FLEXTCP_PL_ARX_CONNUPDATE);
+    }
+
+    pmu_start(&pm);
+    tsc = rte_get_tsc_cycles();
+    arx_cache_flush(ctx, ts);
+    cycles += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm);
+
+    if (ctx->arx_num != 0) {
+      fprintf(stderr, "bench_arx: app rx queue full\n");
+      return -1;
+    }
+    actx->rx_avail = actx->rx_len;
+  }
+
+  report("arx", (uint64_t) opt_rounds * BATCH_SIZE, cycles, &pm);
+  return 0;
+}
+
+/* activating queues with data to send, and polling them again */
+static int bench_qman(void)
+{
+  unsigned q_ids[BATCH_SIZE];
+  uint16_t q_bytes[BATCH_SIZE];
+  struct pmu_acc pm_set = { .total = { 0 } }, pm_poll = { .total = { 0 } };
+  uint64_t tsc, cyc_set = 0, cyc_poll = 0, polled = 0;
+  unsigned r, i;
+  int n;
+
+  for (r = 0; r < opt_rounds; r++) {
+    pmu_start(&pm_set);
+    tsc = rte_get_tsc_cycles();
+    for (i = 0; i < BATCH_SIZE; i++) {
+      if (qman_set(&ctx->qman, utils_rng_gen32(&rng) % opt_flows, 0,
+            opt_payload, SEG_MAX, QMAN_SET_RATE | QMAN_SET_MAXCHUNK |
+            QMAN_ADD_AVAIL) != 0)
+      {
+        fprintf(stderr, "bench_qman: qman_set failed\n");
+        return -1;
+      }
+    }
+    cyc_set += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm_set);
+
+    pmu_start(&pm_poll);
+    tsc = rte_get_tsc_cycles();
+    while ((n = qman_poll(&ctx->qman, BATCH_SIZE, q_ids, q_bytes)) > 0) {
+      polled += n;
+    }
+    cyc_poll += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm_poll);
+  }
+
+  report("qman_set", (uint64_t) opt_rounds * BATCH_SIZE, cyc_set, &pm_set);
+  report("qman_poll", polled, cyc_poll, &pm_poll);
+  return 0;
+}
+
+/* polling rate limited queues: every flow stays backlogged with a rate
+ * spread log-uniformly over 1Mbps to 1Gbps, compare backends with
+ * --fp-qman=skiplist/wheel and -f for the number of queues */
+static int bench_qmanrl(void)
+{
+  unsigned q_ids[BATCH_SIZE];
+  uint16_t q_bytes[BATCH_SIZE];
+  struct pmu_acc pm = { .total = { 0 } };
+  uint64_t tsc, cycles = 0, polled = 0;
+  uint32_t rate;
+  unsigned r, i;
+  int n;
+
+  for (i = 0; i < opt_flows; i++) {
+    rate = 1000. * pow(1000., (double) utils_rng_gen32(&rng) / UINT32_MAX);
+    if (qman_set(&ctx->qman, i, rate, UINT32_MAX / 2, SEG_MAX,
+          QMAN_SET_RATE | QMAN_SET_MAXCHUNK | QMAN_SET_AVAIL) != 0)
+    {
+      fprintf(stderr, "bench_qmanrl: qman_set failed\n");
+      return -1;
+    }
+  }
+
+  for (r = 0; r < opt_rounds; r++) {
+    pmu_start(&pm);
+    tsc = rte_get_tsc_cycles();
+    n = qman_poll(&ctx->qman, BATCH_SIZE, q_ids, q_bytes);
+    cycles += rte_get_tsc_cycles() - tsc;
+    pmu_stop(&pm);
+    if (n > 0)
+      polled += n;
+  }
+
+  report("qmanrl_poll", opt_rounds, cycles, &pm);
+  printf("%-12s %12"PRIu64"\n", "qmanrl_deq", polled);
+
+  /* leave the queues empty again */
+  for (i = 0; i < opt_flows; i++) {
+    qman_set(&ctx->qman, i, 0, 0, SEG_MAX, QMAN_SET_RATE | QMAN_SET_AVAIL);
+  }
+  return 0;
+}
+
+/* plays the slow path congestion control loop on another core: reads the
+ * per-flow counters of all flows over and over, either from the separate
+ * stats array as nicif_connection_stats does, or from the flow state lines
+ * the fast path writes on receive, where they were before the hot/cold
+ * split */
+static void *contend_thread(void *arg)
+{
+  volatile struct flextcp_pl_flowst *fs;
+  volatile struct flextcp_pl_flowst_stats *st;
+  uint64_t tsc, reads = 0;
+  uint32_t sum = 0, i;
+
+  tsc = rte_get_tsc_cycles();
+  while (!contend_stop) {
+    for (i = 0; i < opt_flows; i++) {
+      if (contend_mode == CONTEND_STATS) {
+        st = &fp_flowst_stats[i];
+        sum += st->cnt_rx_ack_bytes + st->cnt_rx_acks + st->rtt_est;
+      } else {
+        fs = &fp_state->flowst[i];
+        sum += fs->rx_next_seq + fs->rx_avail + fs->tx_sent;
+      }
+    }
+    reads += opt_flows;
+  }
+  contend_cycles = rte_get_tsc_cycles() - tsc;
+  contend_reads = reads;
+
+  return (void *) (uintptr_t) sum;
+}
+
+static int contend_start(pthread_t *thread, unsigned mode)
+{
+  pthread_attr_t attr;
+  cpu_set_t set;
+  int ret;
+
+  CPU_ZERO(&set);
+  CPU_SET(opt_cpu, &set);
+  contend_mode = mode;
+  contend_stop = 0;
+
+  pthread_attr_init(&attr);
+  ret = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+  if (ret == 0)
+    ret = pthread_create(thread, &attr, contend_thread, NULL);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    fprintf(stderr, "contend_start: starting thread on cpu %u failed: %s\n",
+        opt_cpu, strerror(ret));
+    return -1;
+  }
+  return 0;
+}
+
+/* receive processing on core 0 while a second core reads flow counters, to
+ * show what sharing flow state cache lines across cores costs. cycles/op of
+ * the rx rows are per segment on core 0, of the rd rows per flow read on the
+ * second core (no hardware counters there, they are per thread). Running
+ * under perf c2c record shows the HITM loads per cache line. */
+static int bench_fscontend(void)
+{
+  static const char *rx_names[CONTEND_NUM] = {
+    [CONTEND_NONE] = "fsc_rx",
+    [CONTEND_STATS] = "fsc_rx_stats",
+    [CONTEND_FLOWST] = "fsc_rx_fs",
+  };
+  static const char *rd_names[CONTEND_NUM] = {
+    [CONTEND_STATS] = "fsc_rd_stats",
+    [CONTEND_FLOWST] = "fsc_rd_fs",
+  };
+  struct pmu_acc pm;
+  pthread_t thread;
+  uint64_t cycles, slowpath = 0;
+  unsigned m, r;
+
+  if (sched_getcpu() == (int) opt_cpu) {
+    fprintf(stderr, "bench_fscontend: already running on cpu %u, pick "
+        "another with -c\n", opt_cpu);
+    return -1;
+  }
+
+  for (m = 0; m < CONTEND_NUM; m++) {
+    if (m != CONTEND_NONE && contend_start(&thread, m) != 0)
+      return -1;
+
+    memset(&pm, 0, sizeof(pm));
+    cycles = 0;
+    gen_reset();
+    for (r = 0; r < opt_rounds && rx_round(&pm, &cycles, &slowpath) == 0;
+        r++);
+
+    if (m != CONTEND_NONE) {
+      contend_stop = 1;
+      pthread_join(thread, NULL);
+    }
+    if (r < opt_rounds)
+      return -1;
+
+    report(rx_names[m], (uint64_t) opt_rounds * BATCH_SIZE, cycles, &pm);
+    if (m != CONTEND_NONE)
+      report(rd_names[m], contend_reads, contend_cycles, NULL);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt, ret = 0;
+
+  while ((opt = getopt(argc, argv, "f:n:s:g:r:b:c:h")) != -1) {
+    switch (opt) {
+      case 'f':
+        ret = parse_uint(optarg, 1, &opt_flows);
+        break;
+      case 'n':
+        ret = parse_uint(optarg, 1, &opt_rounds);
+        break;
+      case 's':
+        ret = parse_uint(optarg, 1, &opt_payload);
+        if (ret == 0 && opt_payload > SEG_MAX) {
+          fprintf(stderr, "payload has to be at most %u\n", SEG_MAX);
+          ret = -1;
+        }
+        break;
+      case 'g':
+        ret = parse_uint(optarg, 1, &opt_run);
+        break;
+      case 'r':
+        ret = parse_uint(optarg, 1, &opt_rxbuf);
+        break;
+      case 'b':
+        ret = parse_benches(optarg, &opt_benches);
+        break;
+      case 'c':
+        ret = parse_uint(optarg, 0, &opt_cpu);
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (ret != 0)
+      return EXIT_FAILURE;
+  }
+  if (opt_rxbuf < BATCH_SIZE * opt_payload) {
+    fprintf(stderr, "receive buffer has to fit a batch of segments (%u)\n",
+        BATCH_SIZE * opt_payload);
+    return EXIT_FAILURE;
+  }
+
+  /* rest is for tas, getopt stopped after -- */
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+  optind = 1;
+  if (config_parse(&config, argc, argv) != 0)
+    return EXIT_FAILURE;
+  /* operations are measured on one core */
+  config.fp_cores_max = fp_cores_max = 1;
+
+  utils_rng_init(&rng, 1);
+
+  if (shm_preinit() != 0)
+    return EXIT_FAILURE;
+  if (rte_eal_init(config.dpdk_argc, config.dpdk_argv) < 0) {
+    fprintf(stderr, "dpdk init failed\n");
+    return EXIT_FAILURE;
+  }
+  if (shm_init(fp_cores_max) != 0) {
+    fprintf(stderr, "dma init failed\n");
+    return EXIT_FAILURE;
+  }
+  if (network_init(fp_cores_max) != 0) {
+    fprintf(stderr, "network init failed\n");
+    goto error_shm_cleanup;
+  }
+  if (dataplane_init() != 0) {
+    fprintf(stderr, "dpinit failed\n");
+    goto error_network_cleanup;
+  }
+
+  if ((kernel_notifyfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+    perror("eventfd failed");
+    goto error_network_cleanup;
+  }
+  if ((ctx = rte_zmalloc("bench ctx", sizeof(*ctx), 64)) == NULL) {
+    fprintf(stderr, "allocating context failed\n");
+    goto error_network_cleanup;
+  }
+  ctxs = &ctx;
+  if (dataplane_context_init(ctx) != 0)
+    goto error_network_cleanup;
+
+  if (appctx_setup() != 0 || flows_setup() != 0)
+    goto error_network_cleanup;
+
+  printf("%u flows, %u byte segments, %u per flow in a row, %u rounds\n",
+      opt_flows, opt_payload, opt_run, opt_rounds);
+  pmu_init();
+  printf("%-12s %12s %12s %12s", "op", "ops", "cycles/op", "ns/op");
+  if (pmu_ok)
+    printf(" %8s %10s", "ipc", "icmiss/op");
+  printf("\n");
+  if (((opt_benches & (1 << BENCH_LOOKUP)) && bench_lookup() != 0) ||
+      ((opt_benches & (1 << BENCH_GRO)) && bench_gro() != 0) ||
+      ((opt_benches & (1 << BENCH_RX)) && bench_rx() != 0) ||
+      ((opt_benches & (1 << BENCH_ARX)) && bench_arx() != 0) ||
+      ((opt_benches & (1 << BENCH_QMAN)) && bench_qman() != 0) ||
+      ((opt_benches & (1 << BENCH_QMANRL)) && bench_qmanrl() != 0) ||
+      ((opt_benches & (1 << BENCH_FSCONTEND)) && bench_fscontend() != 0))
+  {
+    goto error_network_cleanup;
+  }
+
+  network_cleanup();
+  shm_cleanup();
+  return EXIT_SUCCESS;
+
+error_network_cleanup:
+  network_cleanup();
+error_shm_cleanup:
+  shm_cleanup();
+  return EXIT_FAILURE;
+}
@@ -37,8 +37,53 @@ enum config_cc_algorithm {
   CONFIG_CC_TIMELY,
   /** Constant connection rate */
   CONFIG_CC_CONST_RATE,
+  /** BBR: bottleneck bandwidth and min. rtt estimation */
+  CONFIG_CC_BBR,
+  /** Swift: delay-based window with target delay */
+  CONFIG_CC_SWIFT,
+  /** Number of algorithms */
+  CONFIG_CC_NUM,
 };
 
+/** When listeners answer SYNs with SYN cookies. */
+enum config_syn_cookies {
+  /** Never, SYNs are dropped when the backlog is full */
+  CONFIG_SYN_COOKIES_OFF,
+  /** Only when the listener backlog is full */
+  CONFIG_SYN_COOKIES_OVERFLOW,
+  /** For all SYNs, state is only created on the final ACK */
+  CONFIG_SYN_COOKIES_ALWAYS,
+};
+
+/** Fast path stage scheduling policies. */
+enum config_fp_sched {
+  /** Fixed batch size for all stages */
+  CONFIG_FP_SCHED_FIXED,
+  /** Batch sizes adapted to stage occupancy and latency target */
+  CONFIG_FP_SCHED_ADAPTIVE,
+};
+
+/** Fast path queue manager backends. */
+enum config_fp_qman {
+  /** Skiplist ordered by next transmit time */
+  CONFIG_FP_QMAN_SKIPLIST,
+  /** Two-level timer wheel */
+  CONFIG_FP_QMAN_WHEEL,
+};
+
+/** Fast path autoscaling policies. */
+enum config_fp_autoscale {
+  /** Fixed idle cycle thresholds with a waiting period after scaling */
+  CONFIG_FP_AUTOSCALE_THRESHOLD,
+  /** Predicted load from EWMA and trend, with hysteresis and dwell time */
+  CONFIG_FP_AUTOSCALE_EWMA,
+  /** No automatic scaling */
+  CONFIG_FP_AUTOSCALE_OFF,
+};
+
+/** Max. number of threads for running congestion control */
+#define CONFIG_CC_THREADS_MAX 16
+
 /** Struct containing the parsed configuration parameters */
 struct configuration {
   /** Kernel nic receive queue length. */
@@ -53,6 +98,10 @@ struct configuration {
   uint64_t tcp_rxbuf_len;
   /** TCP transmit buffer size. */
   uint64_t tcp_txbuf_len;
+  /** Max. TCP receive buffer size for autotuning, 0 to disable. */
+  uint64_t tcp_rxbuf_max;
+  /** Max. TCP transmit buffer size for autotuning, 0 to disable. */
+  uint64_t tcp_txbuf_max;
   /** Initial tcp rtt for cc rate [us]*/
   uint32_t tcp_rtt_init;
   /** Link bandwidth for converting window to rate [gbps] */
@@ -61,6 +110,16 @@ struct configuration {
   uint32_t tcp_handshake_to;
   /** # of retries for dropped handshake packets */
   uint32_t tcp_handshake_retries;
+  /** When to use SYN cookies for listeners */
+  enum config_syn_cookies tcp_syn_cookies;
+  /** Negotiate selective acknowledgements (SACK) */
+  uint32_t tcp_sack;
+  /** Server side TCP fast open */
+  uint32_t tcp_fastopen;
+  /** Time closed connections are kept to absorb late segments [us] */
+  uint32_t tcp_close_hold;
+  /** Time after close until the flow state is released [us] */
+  uint32_t tcp_flow_grace;
   /** IP address for this host */
   uint32_t ip;
   /** IP prefix length for this host */
@@ -71,6 +130,10 @@ struct configuration {
   uint32_t arp_to;
   /** Maximum ARP timeout [us] */
   uint32_t arp_to_max;
+  /** Age of resolved ARP entries, 0 for no aging [us] */
+  uint32_t arp_age;
+  /** Static ARP neighbor file, NULL if none */
+  char *arp_file;
   /** Congestion control algorithm */
   enum config_cc_algorithm cc_algorithm;
   /** CC: minimum delay between running control loop [us] */
@@ -109,8 +172,63 @@ struct configuration {
   uint32_t cc_timely_min_rtt;
   /** CC timely: minimal rate to use */
   uint32_t cc_timely_min_rate;
+  /** CC swift: target delay [us] */
+  uint32_t cc_swift_target;
+  /** CC swift: additive increment per rtt [bytes] */
+  uint32_t cc_swift_ai;
+  /** CC swift: multiplicative decrement factor */
+  uint32_t cc_swift_beta;
+  /** CC swift: max. multiplicative decrease per rtt */
+  uint32_t cc_swift_max_mdf;
+  /** CC: number of threads running the control loop, 0 for main thread */
+  uint32_t cc_threads;
   /** FP: maximal number of cores used */
   uint32_t fp_cores_max;
+  /** FP: use TCP segmentation offload if supported by the NIC */
+  uint32_t fp_tso;
+  /** FP: transmit payload directly from the flow tx buffers */
+  uint32_t fp_tx_zerocopy;
+  /** FP: min payload size copied to rx buffers with non-temporal stores */
+  uint32_t fp_rx_nt_threshold;
+  /** FP: NIC rx timestamp clock for rtt samples, 0 to use poll times [kHz] */
+  uint32_t fp_rx_tstamp;
+  /** FP: cores receiving from the NIC and dispatching in software, 0 to
+   * have the NIC spread packets by its RETA */
+  uint32_t fp_sw_rss;
+  /** FP: number of flow state entries (max. concurrent connections) */
+  uint32_t fp_flows;
+  /** FP: stage scheduling policy */
+  enum config_fp_sched fp_sched;
+  /** FP: adaptive scheduling target for one poll loop iteration [us] */
+  uint32_t fp_sched_latency;
+  /** FP: busy spin time before idle cores start pausing [us] */
+  uint32_t fp_idle_spin;
+  /** FP: min. retransmission timeout, 0 for slow path timeouts [us] */
+  uint32_t fp_rto_min;
+  /** FP: max. in-order segments covered by one delayed ack, 1 disables */
+  uint32_t fp_delack_segs;
+  /** FP: max. time acks are delayed for [us] */
+  uint32_t fp_delack_us;
+  /** FP: queue manager backend for rate limited flows */
+  enum config_fp_qman fp_qman;
+  /** FP: use NIC ports as one bonded link, spreading flows over them */
+  uint32_t fp_bond;
+  /** FP: max. number of connections steered with exact match NIC rules */
+  uint32_t fp_flow_rules;
+  /** FP: max. number of flow groups moved per load rebalancing round */
+  uint32_t fp_fg_rebalance;
+  /** FP: autoscaling policy */
+  enum config_fp_autoscale fp_autoscale;
+  /** FP autoscale: min. time between scaling decisions [ms] */
+  uint32_t fp_autoscale_dwell;
+  /** FP autoscale: also scale on nic rx ring and app rx queue occupancy */
+  uint32_t fp_autoscale_queues;
+  /** FP: partition dma memory and flow state over numa nodes */
+  uint32_t fp_numa;
+  /** FP: launch fast path cores on the NIC's numa node first */
+  uint32_t fp_numa_pin;
+  /** Keep shared memory and take over connections of a previous instance */
+  uint32_t fast_restart;
   /** DPDK extra argument vector */
   char **dpdk_argv;
   /** DPDK extra argument count */
@@ -125,6 +243,8 @@ struct config_route {
   uint8_t ip_prefix;
   /** Next hop IP */
   uint32_t next_hop_ip;
+  /** Egress port index, -1 if not fixed */
+  int16_t port;
   /** Next pointer for route list */
   struct config_route *next;
 };
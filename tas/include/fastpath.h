@@ -33,68 +33,229 @@
 #include <tas_memif.h>
 #include <utils_rng.h>
 
-#define BATCH_SIZE 16
-#define BUFCACHE_SIZE 128
+/** Max. number of entries handled in one stage poll */
+#define BATCH_SIZE 32
+/** Stage batch size with the fixed scheduling policy */
+#define BATCH_SIZE_FIXED 16
+/** Smallest batch the adaptive policy will go down to */
+#define BATCH_SIZE_MIN 2
+/** Capacity of the per core buffer cache */
+#define BUFCACHE_SIZE 512
+/** Smallest fill target the buffer cache adapts down to */
+#define BUFCACHE_MIN 32
 #define TXBUF_SIZE (2 * BATCH_SIZE)
+/** Packets held back when the send buffer is full (power of 2) */
+#define TXRETRY_SIZE (2 * TXBUF_SIZE)
+/** Capacity of the per core delayed ack queue (power of 2) */
+#define DACK_QUEUE_SIZE 256
+/** Max. number of cores receiving from the NIC with software steering */
+#define SW_RSS_MAX 4
+/** Capacity of the rings from each of those cores to every core */
+#define SW_RSS_RING_SIZE 1024
 
 
 struct network_thread {
   struct rte_mempool *pool;
+  struct rte_mempool *tso_pool;
+  struct rte_mempool *zc_pool;
   uint16_t queue_id;
+  /* port to poll first on next rx poll */
+  uint8_t rx_port;
+  /* has rx queues on the NIC, with software steering only the first
+   * cores do */
+  uint8_t rx_nic;
 };
 
 /** Skiplist: #levels */
 #define QMAN_SKIPLIST_LEVELS 4
 
+struct qman_wheel;
+struct qman_class;
+struct qman_rto;
+struct qman_rto_wheel;
+
 struct qman_thread {
   /************************************/
   /* read-only */
   struct queue *queues;
+  struct qman_wheel *wheel;
+  struct qman_class *classes;
+  /* retransmission timers, NULL if handled by the slow path */
+  struct qman_rto *rtos;
+  struct qman_rto_wheel *rto_wheel;
+  /* app context registers for this core, for class weights/caps */
+  struct flextcp_pl_appctx *actx;
 
   /************************************/
   /* modified by owner thread */
   uint32_t head_idx[QMAN_SKIPLIST_LEVELS];
-  uint32_t nolimit_head_idx;
-  uint32_t nolimit_tail_idx;
+  /* active classes with no-limit queues */
+  uint16_t cls_head;
+  uint16_t cls_tail;
   uint32_t ts_real;
   uint32_t ts_virtual;
+  /* timer wheel: virtual time of the current level 0 slot */
+  uint32_t wheel_ts;
   struct utils_rng rng;
   bool nolimit_first;
 };
 
 
+/** Dataplane loop stages, in the order they are polled */
+enum dataplane_stage_id {
+  DP_STAGE_RX,
+  DP_STAGE_FWD,
+  DP_STAGE_QMAN,
+  DP_STAGE_QUEUES,
+  DP_STAGE_KERNEL,
+  DP_STAGE_NUM,
+};
+STATIC_ASSERT(DP_STAGE_NUM == FLEXNIC_STATS_STAGE_NUM, stats_stage_num);
+
+struct dataplane_stage {
+  /** current batch size */
+  uint16_t batch;
+  /** entries handled in the last poll */
+  uint16_t last;
+  /** EWMA of entries per poll (fixed point, 8 fractional bits) */
+  uint32_t occ;
+  /** EWMA of cycles per entry */
+  uint32_t cyc_item;
+
+  /** counters: polls, empty polls, polls filling the batch, entries */
+  uint64_t cnt_polls;
+  uint64_t cnt_empty;
+  uint64_t cnt_full;
+  uint64_t cnt_items;
+  /** counter: cycles spent (only measured with adaptive policy) */
+  uint64_t cnt_cycles;
+};
+
+/** Maps NIC rx timestamps of one port to qman time, see rx_tstamp */
+struct dataplane_rx_tstamp {
+  /** smallest qman time at poll minus NIC time, in the last and the current
+   * epoch */
+  uint32_t base;
+  uint32_t next;
+  /** start of the current epoch */
+  uint32_t epoch_ts;
+  uint8_t valid;
+};
+
+/** Per flow group load counters, kept by each core for the groups it owns */
+struct dataplane_fg_stats {
+  uint64_t pkts;
+  uint64_t bytes;
+};
+
 struct dataplane_context {
   struct network_thread net;
   struct qman_thread qman;
-  struct rte_ring *qman_fwd_ring;
+  /* requests for flows owned by this core */
+  struct rte_ring *flow_fwd_ring;
+  /* set when flow groups owned by this core should be handed off */
+  volatile uint8_t fg_handoff;
   uint16_t id;
   int evfd;
   struct rte_epoll_event ev;
+  int timerfd;
+  struct rte_epoll_event timer_ev;
+  uint64_t idle_pause_cycles;
+  /* always on counters in the stats region, see FLEXNIC_NAME_STATS */
+  struct flexnic_stats_core *stats;
+  /* lightweight tracing: mask and sampling copied once per loop iteration,
+   * write position and records of this core */
+  uint32_t ltrace_mask;
+  uint32_t ltrace_sample;
+  struct flexnic_ltrace_core *ltrace_core;
+  struct flexnic_ltrace_rec *ltrace_recs;
+  /* packet capture: directions enabled, copied once per loop iteration,
+   * write position and records of this core, and the first packet in the
+   * transmit buffer not captured yet */
+  uint32_t pcap_enable;
+  struct flexnic_pcap_core *pcap_core;
+  struct flexnic_pcap_rec *pcap_recs;
+  uint16_t pcap_tx_next;
+  /* latency histograms of this core, by app and FLEXNIC_STATS_HIST_* */
+  struct flexnic_stats_hist (*hists)[FLEXNIC_STATS_HIST_NUM];
+  /* cycle counter when the received packets being processed were polled,
+   * 0 outside of NIC rx processing */
+  uint64_t rx_tsc;
+  /* NIC rx timestamp mapping, by port index */
+  struct dataplane_rx_tstamp rx_tstamps[FLEXNIC_PL_NET_PORTS];
 
   /********************************************************/
   /* arx cache */
   struct flextcp_pl_arx arx_cache[BATCH_SIZE];
   uint16_t arx_ctx[BATCH_SIZE];
+  /* rx_tsc of the first packet the entry reports, 0 if not from NIC rx */
+  uint64_t arx_tsc[BATCH_SIZE];
   uint16_t arx_num;
+  /* flushes that left entries behind because an app rx queue was full */
+  uint64_t arx_backlog;
 
   /********************************************************/
   /* send buffer */
   struct network_buf_handle *tx_handles[TXBUF_SIZE];
   uint16_t tx_num;
+  /* overflow of the send buffer, moved into it as the NIC takes packets;
+   * free-running indices */
+  struct network_buf_handle *tx_retry[TXRETRY_SIZE];
+  uint32_t tx_retry_head;
+  uint32_t tx_retry_tail;
+  /* cycle counter when the NIC first did not take all packets, 0 if it
+   * took everything in the last flush */
+  uint64_t tx_stall_tsc;
+
+  /********************************************************/
+  /* delayed acks: flows with unacknowledged segments and when the ack is
+   * due, in deadline order; free-running indices */
+  uint32_t dack_ids[DACK_QUEUE_SIZE];
+  uint32_t dack_ts[DACK_QUEUE_SIZE];
+  uint32_t dack_head;
+  uint32_t dack_tail;
+
+  /********************************************************/
+  /* software steering: packets handed over by each receiving core, single
+   * producer and consumer, and the ring to dequeue from first next time */
+  struct rte_ring *sw_rx_rings[SW_RSS_MAX];
+  uint8_t sw_rx_next;
 
   /********************************************************/
   /* polling queues */
   uint32_t poll_next_ctx;
 
+  /********************************************************/
+  /* stage scheduling */
+  struct dataplane_stage stages[DP_STAGE_NUM];
+  uint64_t sched_lat_cycles;
+
   /********************************************************/
   /* pre-allocated buffers for polling doorbells and queue manager */
   struct network_buf_handle *bufcache_handles[BUFCACHE_SIZE];
   uint16_t bufcache_num;
   uint16_t bufcache_head;
+  /* refilled up to this, flushed to half of it once it is reached */
+  uint16_t bufcache_target;
+  /* cache operations and mempool accesses since the target was adapted */
+  uint16_t bufcache_ops;
+  uint16_t bufcache_misses;
+  /* counters: preallocs served from cache, refills, flushes to mempool */
+  uint64_t bufcache_hit;
+  uint64_t bufcache_miss;
+  uint64_t bufcache_flush;
 
   uint64_t loadmon_cyc_busy;
+  /* indexed by flow group, read by the rebalancer in the slow path */
+  struct dataplane_fg_stats *fg_stats;
 
   uint64_t kernel_drop;
+  /* app contexts with a moderated notification pending, see actx_kick */
+  uint64_t notify_mask[FLEXNIC_PL_APPCTX_NUM / 64];
+  uint16_t notify_num;
+  /* flows to report as active to slow path cc, see fast_kernel_ccactive */
+  uint32_t cc_active[FLEXTCP_PL_KRX_CCACTIVE_MAX];
+  uint16_t cc_active_num;
 #ifdef DATAPLANE_STATS
   /********************************************************/
   /* Stats */
@@ -105,6 +266,7 @@ struct dataplane_context {
   uint64_t stat_rx_poll;
   uint64_t stat_rx_empty;
   uint64_t stat_rx_total;
+  uint64_t stat_rx_gro;
 
   uint64_t stat_qs_poll;
   uint64_t stat_qs_empty;
@@ -118,11 +280,16 @@ struct dataplane_context {
 };
 
 extern struct dataplane_context **ctxs;
+/* per flow: low 32 bits of the cycle counter when a bump made the idle flow
+ * sendable, 0 until then and after its first segment was sent */
+extern uint32_t *dataplane_bump_tsc;
 
 int dataplane_init(void);
 int dataplane_context_init(struct dataplane_context *ctx);
 void dataplane_context_destroy(struct dataplane_context *ctx);
 void dataplane_loop(struct dataplane_context *ctx);
+/** Have all cores check if they need to hand off flows they own */
+void dataplane_handoff(uint32_t ts);
 #ifdef DATAPLANE_STATS
 void dataplane_dump_stats(void);
 #endif
@@ -32,9 +32,27 @@ extern struct configuration config;
 
 extern void *tas_shm;
 extern struct flextcp_pl_mem *fp_state;
+extern struct flextcp_pl_flowst_stats *fp_flowst_stats;
+extern struct flextcp_pl_flowhtb *fp_flowht;
+extern uint32_t fp_flowht_num;
 extern struct flexnic_info *tas_info;
+/** Fast path counters, see FLEXNIC_NAME_STATS */
+extern struct flexnic_stats *fp_stats;
+/** Lightweight trace rings, see FLEXNIC_LTRACE_NAME */
+extern struct flexnic_ltrace *fp_ltrace;
+/** Packet capture rings, see FLEXNIC_PCAP_NAME */
+extern struct flexnic_pcap *fp_pcap;
 extern struct ether_addr eth_addr;
+extern uint8_t net_ports_num;
 extern unsigned fp_cores_max;
+/** Number of numa nodes dma memory and flow state are partitioned over */
+extern unsigned shm_numa_nodes;
+/** Size of each node's arena in dma memory, node n starts at n * size */
+extern size_t shm_numa_dma_size;
+/** Number of flow ids in each node's flow state range */
+extern uint32_t shm_numa_flows;
+/** Shared memory was taken over from a previous instance (--fast-restart) */
+extern int shm_reattached;
 
 
 int slowpath_main(void);
@@ -46,13 +64,50 @@ void shm_set_ready(void);
 
 int network_init(unsigned num_threads);
 void network_cleanup(void);
+/** MAC address of NIC port (index) */
+const struct ether_addr *network_port_mac(uint8_t port);
+/**
+ * Steer flow to the fast path core serving app context db with exact match
+ * rules on all ports. Flow state for the flow needs to be filled in already.
+ * If live is set the flow is already visible to the fast path, and its owner
+ * hands it over to the new core, otherwise the caller sets the owner.
+ * Returns the core, or -1 if the flow is not steered.
+ */
+int network_flow_steer(uint32_t flow_id, uint16_t db, int live);
+/** Remove flow rules for flow, if any */
+void network_flow_unsteer(uint32_t flow_id);
+/** Remove flow rules for num flows, taking the rule lock once */
+void network_flow_unsteer_batch(unsigned num, const uint32_t *flow_ids);
+/** Max. occupancy of core's rx queue on all ports [1/1000] */
+unsigned network_rx_queue_fill(uint16_t core);
+/** Number of flow groups (RSS buckets) */
+extern uint16_t rss_reta_size;
+/** Core the NIC steers flow group fg to */
+uint16_t network_flow_group_core(uint16_t fg);
+/** Steer flow groups fgs[i] to cores[i], owners are handed off afterwards */
+int network_flow_groups_move(unsigned num, const uint16_t *fgs,
+    const uint16_t *cores);
+/** Numa node the NIC is attached to, -1 if unknown */
+int network_port_node(void);
+
+/** Numa node of the lcore running fast path core */
+unsigned flexnic_core_node(uint16_t core);
+/**
+ * Numa node of the core connections on doorbell db will be served by, if it
+ * is known when the connection is set up, -1 otherwise.
+ */
+int flexnic_db_node(uint16_t db);
 
 /* used by trace and shm */
 void *util_create_shmsiszed(const char *name, size_t size, void *addr);
+/** Create shm region that keeps its contents if shm_reattached is set */
+void *shm_create_persist(const char *name, size_t size);
 
 /* should become config options */
 #define FLEXNIC_DMA_MEM_SIZE (1024 * 1024 * 1024)
-#define FLEXNIC_INTERNAL_MEM_SIZE (1024 * 1024 * 32)
-#define FLEXNIC_NUM_QMQUEUES (128 * 1024)
+/** Internal memory is sized from config.fp_flows, rounded to this */
+#define FLEXNIC_INTERNAL_MEM_ALIGN (2 * 1024 * 1024)
+/** Max. number of numa nodes memory is partitioned over */
+#define FLEXNIC_NUMA_MAX 8
 
 #endif /* ndef TAS_H_ */
@@ -33,23 +33,46 @@
 #include <errno.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include <utils.h>
 #include <rte_config.h>
 #include <rte_malloc.h>
+#include <rte_cycles.h>
 
 #include <tas.h>
 #include <tas_memif.h>
+#include <tas_trace.h>
 
 void *tas_shm = NULL;
 struct flextcp_pl_mem *fp_state = NULL;
+struct flextcp_pl_flowst_stats *fp_flowst_stats = NULL;
+struct flextcp_pl_flowhtb *fp_flowht = NULL;
+uint32_t fp_flowht_num;
 struct flexnic_info *tas_info = NULL;
-
+struct flexnic_stats *fp_stats = NULL;
+struct flexnic_ltrace *fp_ltrace = NULL;
+struct flexnic_pcap *fp_pcap = NULL;
+unsigned shm_numa_nodes = 1;
+size_t shm_numa_dma_size = FLEXNIC_DMA_MEM_SIZE;
+uint32_t shm_numa_flows;
+int shm_reattached = 0;
+
+static size_t internal_mem_size;
+
+/* partition dma memory and flow state over numa nodes */
+static void numa_place(void);
+
+/* check if regions of a previous instance can be taken over */
+static int shm_reattach_check(void);
+/* create shared memory region, contents are kept if keep is set */
+static void *create_shm(const char *name, size_t size, void *addr, int keep);
 /* destroy shared memory region */
 static void destroy_shm(const char *name, size_t size, void *addr);
 /* create shared memory region using huge pages */
 static void *util_create_shmsiszed_huge(const char *name, size_t size,
-    void *addr) __attribute__((used));
+    void *addr, int keep) __attribute__((used));
 /* destroy shared huge page memory region */
 static void destroy_shm_huge(const char *name, size_t size, void *addr)
     __attribute__((used));
@@ -57,13 +80,31 @@ static void destroy_shm_huge(const char *name, size_t size, void *addr)
 /* Allocate DMA memory before DPDK grabs all huge pages */
 int shm_preinit(void)
 {
+  /* size flow lookup table to the next power of 2 buckets with at least
+   * twice as many entries as flows */
+  fp_flowht_num = 1;
+  while ((uint64_t) fp_flowht_num * FLEXNIC_PL_FLOWHT_NBSZ <
+      2 * (uint64_t) config.fp_flows)
+  {
+    fp_flowht_num *= 2;
+  }
+  internal_mem_size = FLEXNIC_PL_MEM_SIZE(config.fp_flows, fp_flowht_num);
+  internal_mem_size = (internal_mem_size + FLEXNIC_INTERNAL_MEM_ALIGN - 1) &
+    ~((size_t) FLEXNIC_INTERNAL_MEM_ALIGN - 1);
+
+  if (config.fast_restart && shm_reattach_check() == 0) {
+    fprintf(stderr, "shm_preinit: taking over shared memory of previous "
+        "instance\n");
+    shm_reattached = 1;
+  }
+
   /* create shm for dma memory */
 #ifdef FLEXNIC_USE_HUGEPAGES
   tas_shm = util_create_shmsiszed_huge(FLEXNIC_NAME_DMA_MEM,
-      FLEXNIC_DMA_MEM_SIZE, NULL);
+      FLEXNIC_DMA_MEM_SIZE, NULL, shm_reattached);
 #else
-  tas_shm = util_create_shmsiszed(FLEXNIC_NAME_DMA_MEM, FLEXNIC_DMA_MEM_SIZE,
-      NULL);
+  tas_shm = create_shm(FLEXNIC_NAME_DMA_MEM, FLEXNIC_DMA_MEM_SIZE, NULL,
+      shm_reattached);
 #endif
   if (tas_shm == NULL) {
     fprintf(stderr, "mapping flexnic dma memory failed\n");
@@ -73,16 +114,23 @@ int shm_preinit(void)
   /* create shm for internal memory */
 #ifdef FLEXNIC_USE_HUGEPAGES
   fp_state = util_create_shmsiszed_huge(FLEXNIC_NAME_INTERNAL_MEM,
-      FLEXNIC_INTERNAL_MEM_SIZE, NULL);
+      internal_mem_size, NULL, shm_reattached);
 #else
-  fp_state = util_create_shmsiszed(FLEXNIC_NAME_INTERNAL_MEM,
-      FLEXNIC_INTERNAL_MEM_SIZE, NULL);
+  fp_state = create_shm(FLEXNIC_NAME_INTERNAL_MEM, internal_mem_size, NULL,
+      shm_reattached);
 #endif
   if (fp_state == NULL) {
     fprintf(stderr, "mapping flexnic internal memory failed\n");
     shm_cleanup();
     return -1;
   }
+  fp_flowst_stats = FLEXNIC_PL_FLOWST_STATS(fp_state, config.fp_flows);
+  fp_flowht = FLEXNIC_PL_FLOWHT(fp_state, config.fp_flows);
+
+  shm_numa_flows = config.fp_flows;
+  if (config.fp_numa) {
+    numa_place();
+  }
 
   return 0;
 }
@@ -92,17 +140,70 @@ int shm_init(unsigned num)
   umask(0);
 
   /* create shm for tas_info */
-  tas_info = util_create_shmsiszed(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES, NULL);
+  tas_info = create_shm(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES, NULL,
+      shm_reattached);
   if (tas_info == NULL) {
     fprintf(stderr, "mapping flexnic tas_info failed\n");
     shm_cleanup();
     return -1;
   }
 
+  /* applications of the previous instance wait for ready with the new
+   * generation before they reattach */
+  if (shm_reattached) {
+    tas_info->flags &= ~FLEXNIC_FLAG_READY;
+    MEM_BARRIER();
+    tas_info->restart_gen++;
+  }
+  if (config.fast_restart) {
+    tas_info->flags |= FLEXNIC_FLAG_PERSIST;
+  }
+
   tas_info->dma_mem_size = FLEXNIC_DMA_MEM_SIZE;
-  tas_info->internal_mem_size = FLEXNIC_INTERNAL_MEM_SIZE;
-  tas_info->qmq_num = FLEXNIC_NUM_QMQUEUES;
+  tas_info->internal_mem_size = internal_mem_size;
+  tas_info->qmq_num = config.fp_flows;
   tas_info->cores_num = num;
+  tas_info->flow_num = config.fp_flows;
+  tas_info->flowht_num = fp_flowht_num;
+
+  /* counters start from zero on every start, readers only look at rates */
+  fp_stats = create_shm(FLEXNIC_NAME_STATS, sizeof(*fp_stats), NULL, 0);
+  if (fp_stats == NULL) {
+    fprintf(stderr, "mapping flexnic stats failed\n");
+    shm_cleanup();
+    return -1;
+  }
+  fp_stats->cores_num = num;
+  fp_stats->tsc_hz = rte_get_tsc_hz();
+  MEM_BARRIER();
+  fp_stats->version = FLEXNIC_STATS_VERSION;
+
+  /* tracing starts out disabled */
+  fp_ltrace = create_shm(FLEXNIC_LTRACE_NAME, FLEXNIC_LTRACE_BYTES(num), NULL,
+      0);
+  if (fp_ltrace == NULL) {
+    fprintf(stderr, "mapping flexnic trace failed\n");
+    shm_cleanup();
+    return -1;
+  }
+  fp_ltrace->cores_num = num;
+  fp_ltrace->tsc_hz = rte_get_tsc_hz();
+  MEM_BARRIER();
+  fp_ltrace->version = FLEXNIC_LTRACE_VERSION;
+
+  /* so does packet capture */
+  fp_pcap = create_shm(FLEXNIC_PCAP_NAME, FLEXNIC_PCAP_BYTES(num), NULL, 0);
+  if (fp_pcap == NULL) {
+    fprintf(stderr, "mapping flexnic capture failed\n");
+    shm_cleanup();
+    return -1;
+  }
+  fp_pcap->cores_num = num;
+  fp_pcap->tsc_hz = rte_get_tsc_hz();
+  fp_pcap->snaplen = FLEXNIC_PCAP_SNAPLEN;
+  fp_pcap->fg = FLEXNIC_PCAP_FG_ANY;
+  MEM_BARRIER();
+  fp_pcap->version = FLEXNIC_PCAP_VERSION;
 
   return 0;
 }
@@ -112,11 +213,10 @@ void shm_cleanup(void)
   /* cleanup internal memory region */
   if (fp_state != NULL) {
 #ifdef FLEXNIC_USE_HUGEPAGES
-    destroy_shm_huge(FLEXNIC_NAME_INTERNAL_MEM, FLEXNIC_INTERNAL_MEM_SIZE,
+    destroy_shm_huge(FLEXNIC_NAME_INTERNAL_MEM, internal_mem_size,
         fp_state);
 #else
-    destroy_shm(FLEXNIC_NAME_INTERNAL_MEM, FLEXNIC_INTERNAL_MEM_SIZE,
-        fp_state);
+    destroy_shm(FLEXNIC_NAME_INTERNAL_MEM, internal_mem_size, fp_state);
 #endif
   }
 
@@ -129,6 +229,23 @@ void shm_cleanup(void)
 #endif
   }
 
+  /* cleanup trace memory region */
+  if (fp_ltrace != NULL) {
+    destroy_shm(FLEXNIC_LTRACE_NAME, FLEXNIC_LTRACE_BYTES(fp_ltrace->cores_num),
+        fp_ltrace);
+  }
+
+  /* cleanup capture memory region */
+  if (fp_pcap != NULL) {
+    destroy_shm(FLEXNIC_PCAP_NAME, FLEXNIC_PCAP_BYTES(fp_pcap->cores_num),
+        fp_pcap);
+  }
+
+  /* cleanup stats memory region */
+  if (fp_stats != NULL) {
+    destroy_shm(FLEXNIC_NAME_STATS, sizeof(*fp_stats), fp_stats);
+  }
+
   /* cleanup tas_info memory region */
   if (tas_info != NULL) {
     destroy_shm(FLEXNIC_NAME_INFO, FLEXNIC_INFO_BYTES, tas_info);
@@ -141,6 +258,57 @@ void shm_set_ready(void)
 }
 
 void *util_create_shmsiszed(const char *name, size_t size, void *addr)
+{
+  return create_shm(name, size, addr, 0);
+}
+
+void *shm_create_persist(const char *name, size_t size)
+{
+  return create_shm(name, size, NULL, shm_reattached);
+}
+
+static int shm_reattach_check(void)
+{
+  int fd;
+  struct stat st;
+  struct flexnic_info *fi;
+  int ret = -1;
+
+  if ((fd = shm_open(FLEXNIC_NAME_INFO, O_RDONLY, 0)) == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size != FLEXNIC_INFO_BYTES) {
+    close(fd);
+    return -1;
+  }
+  if ((fi = mmap(NULL, FLEXNIC_INFO_BYTES, PROT_READ, MAP_SHARED, fd, 0)) ==
+      (void *) -1)
+  {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  /* layout of all regions has to match exactly */
+  if ((fi->flags & FLEXNIC_FLAG_PERSIST) == 0) {
+    fprintf(stderr, "shm_reattach_check: previous instance did not keep its "
+        "memory\n");
+  } else if (fi->dma_mem_size != FLEXNIC_DMA_MEM_SIZE ||
+      fi->internal_mem_size != internal_mem_size ||
+      fi->flow_num != config.fp_flows || fi->flowht_num != fp_flowht_num ||
+      fi->cores_num != config.fp_cores_max)
+  {
+    fprintf(stderr, "shm_reattach_check: memory layout of previous instance "
+        "differs, starting from scratch\n");
+  } else {
+    ret = 0;
+  }
+
+  munmap(fi, FLEXNIC_INFO_BYTES);
+  return ret;
+}
+
+static void *create_shm(const char *name, size_t size, void *addr, int keep)
 {
   int fd;
   void *p;
@@ -162,7 +330,8 @@ void *util_create_shmsiszed(const char *name, size_t size, void *addr)
     goto error_remove;
   }
 
-  memset(p, 0, size);
+  if (!keep)
+    memset(p, 0, size);
 
   close(fd);
   return p;
@@ -179,11 +348,103 @@ static void destroy_shm(const char *name, size_t size, void *addr)
   if (munmap(addr, size) != 0) {
     fprintf(stderr, "Warning: munmap failed (%s)\n", strerror(errno));
   }
-  shm_unlink(name);
+  /* left for the next instance to take over */
+  if (!config.fast_restart)
+    shm_unlink(name);
+}
+
+/* number of numa nodes, from the list of online node ranges ("0-1,3") */
+static unsigned numa_nodes_online(void)
+{
+  FILE *f;
+  unsigned a, b, n = 0;
+  int c;
+
+  if ((f = fopen("/sys/devices/system/node/online", "r")) == NULL) {
+    return 1;
+  }
+
+  while (fscanf(f, "%u", &a) == 1) {
+    b = a;
+    if ((c = fgetc(f)) == '-') {
+      if (fscanf(f, "%u", &b) != 1)
+        break;
+      c = fgetc(f);
+    }
+    if (b + 1 > n)
+      n = b + 1;
+    if (c != ',')
+      break;
+  }
+  fclose(f);
+
+  return (n > 0 ? n : 1);
+}
+
+/* prefer node for the huge pages fully inside [addr, addr + len), pages
+ * already faulted in are migrated */
+static int numa_bind(void *addr, size_t len, unsigned node)
+{
+  uintptr_t start, end;
+  unsigned long mask = 1UL << node;
+
+  start = ((uintptr_t) addr + FLEXNIC_INTERNAL_MEM_ALIGN - 1) &
+    ~((uintptr_t) FLEXNIC_INTERNAL_MEM_ALIGN - 1);
+  end = ((uintptr_t) addr + len) & ~((uintptr_t) FLEXNIC_INTERNAL_MEM_ALIGN - 1);
+  if (end <= start) {
+    return 0;
+  }
+
+  if (syscall(SYS_mbind, (void *) start, end - start, MPOL_PREFERRED, &mask,
+        sizeof(mask) * 8 + 1, MPOL_MF_MOVE) != 0)
+  {
+    fprintf(stderr, "numa_bind: mbind to node %u failed (%s)\n", node,
+        strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static void numa_place(void)
+{
+  unsigned n, nodes;
+  uint32_t first, num;
+
+  nodes = numa_nodes_online();
+  if (nodes > FLEXNIC_NUMA_MAX) {
+    fprintf(stderr, "numa_place: %u nodes, only using first %u\n", nodes,
+        FLEXNIC_NUMA_MAX);
+    nodes = FLEXNIC_NUMA_MAX;
+  }
+  if (nodes <= 1) {
+    return;
+  }
+
+  shm_numa_nodes = nodes;
+  shm_numa_dma_size = (FLEXNIC_DMA_MEM_SIZE / nodes) &
+    ~((size_t) FLEXNIC_INTERNAL_MEM_ALIGN - 1);
+  shm_numa_flows = (config.fp_flows + nodes - 1) / nodes;
+
+  for (n = 0; n < nodes; n++) {
+    /* one dma arena per node, the last one gets the rounding remainder */
+    numa_bind((uint8_t *) tas_shm + n * shm_numa_dma_size,
+        (n == nodes - 1 ? FLEXNIC_DMA_MEM_SIZE - n * shm_numa_dma_size :
+         shm_numa_dma_size), n);
+
+    /* range of flow ids handed out for flows owned by cores on node n */
+    first = n * shm_numa_flows;
+    if (first >= config.fp_flows)
+      break;
+    num = MIN(shm_numa_flows, config.fp_flows - first);
+    numa_bind(&fp_state->flowst[first], num * sizeof(fp_state->flowst[0]), n);
+    numa_bind(&fp_flowst_stats[first], num * sizeof(fp_flowst_stats[0]), n);
+  }
+
+  fprintf(stderr, "numa_place: partitioned memory over %u nodes\n", nodes);
 }
 
 static void *util_create_shmsiszed_huge(const char *name, size_t size,
-    void *addr)
+    void *addr, int keep)
 {
   int fd;
   void *p;
@@ -208,7 +469,8 @@ static void *util_create_shmsiszed_huge(const char *name, size_t size,
     goto error_remove;
   }
 
-  memset(p, 0, size);
+  if (!keep)
+    memset(p, 0, size);
 
   close(fd);
   return p;
@@ -229,5 +491,6 @@ static void destroy_shm_huge(const char *name, size_t size, void *addr)
   if (munmap(addr, size) != 0) {
     fprintf(stderr, "Warning: munmap failed (%s)\n", strerror(errno));
   }
-  unlink(path);
+  if (!config.fast_restart)
+    unlink(path);
 }
@@ -36,6 +36,12 @@
  *
  * Communication on the application context queues is handled in appif_ctx.c.
  *
+ * After a fast restart (see restart.c) contexts taken over from the previous
+ * instance are owned by placeholder application structs. Applications
+ * reattach them with a KERNEL_UXSOCK_REATTACH request carrying the doorbell
+ * ids and new eventfds, the contexts and their connections then move over to
+ * the new application struct.
+ *
  * The unix socket is handled on a separate thread so a blocking epoll can be
  * used. To avoid synchronization in other kernel parts the ux socket thread
  * just communicates on the sockets and uses two queues #ux_to_poll and
@@ -72,6 +78,13 @@ static void uxsocket_accept(void);
 static void uxsocket_notify(void);
 static void uxsocket_error(struct application *app);
 static void uxsocket_receive(struct application *app);
+static struct app_context *uxsocket_ctx_create(struct application *app,
+    int evfd, struct kernel_uxsock_response *resp);
+static struct app_context *uxsocket_ctx_reattach(struct application *app,
+    uint16_t db, int evfd, struct kernel_uxsock_response *resp);
+static int appif_restore(void);
+static void appif_ctx_reattach(struct application *app,
+    struct app_context *ctx);
 static void uxsocket_notify_app(struct application *app);
 
 /** Listening UX socket for applications to connect to */
@@ -106,8 +119,15 @@ int appif_init(void)
     return -1;
   }
 
+  /* contexts taken over from a previous instance keep their doorbells */
+  if (appif_restore()) {
+    return -1;
+  }
+
   /* create freelist of doorbells (0 is used by kernel) */
-  for (i = FLEXNIC_PL_APPST_CTX_NUM; i > 0; i--) {
+  for (i = FLEXNIC_PL_APPCTX_NUM - 1; i > 0; i--) {
+    if (restart_ctx_lookup(i) != NULL)
+      continue;
     if ((adb = malloc(sizeof(*adb))) == NULL) {
       perror("appif_init: malloc doorbell failed");
       return -1;
@@ -146,20 +166,30 @@ unsigned appif_poll(void)
   }
 
   for (app = applications; app != NULL; app = app->next) {
-    /* register context with NIC */
+    /* register contexts from one request with NIC */
     if (app->need_reg_ctx != NULL) {
       ctx = app->need_reg_ctx;
       app->need_reg_ctx = NULL;
 
-      for (i = 0; i < tas_info->cores_num; i++) {
-        rxq_offs[i] = app->resp->flexnic_qs[i].rxq_off;
-        txq_offs[i] = app->resp->flexnic_qs[i].txq_off;
-      }
+      for (; ctx != NULL; ctx = ctx->reg_next) {
+        if (ctx->app != app) {
+          appif_ctx_reattach(app, ctx);
+          continue;
+        }
+
+        for (i = 0; i < tas_info->cores_num; i++) {
+          rxq_offs[i] = ctx->reg_resp->flexnic_qs[i].rxq_off;
+          txq_offs[i] = ctx->reg_resp->flexnic_qs[i].txq_off;
+        }
 
-      if (nicif_appctx_add(app->id, ctx->doorbell->id, rxq_offs,
-            app->req.rxq_len, txq_offs, app->req.txq_len, ctx->evfd) != 0)
-      {
-        fprintf(stderr, "appif_poll: registering context failed\n");
+        if (nicif_appctx_add(app->id, ctx->doorbell->id, rxq_offs,
+              app->req.rxq_len, txq_offs, app->req.txq_len, ctx->evfd) != 0)
+        {
+          fprintf(stderr, "appif_poll: registering context failed\n");
+          break;
+        }
+      }
+      if (ctx != NULL) {
         uxsocket_error(app);
         continue;
       }
@@ -176,12 +206,42 @@ unsigned appif_poll(void)
         continue;
       }
       n += appif_ctx_poll(app, ctx);
+      if (ctx->notify_pending != 0)
+        n += appif_ctx_notify_poll(ctx);
     }
   }
 
   return n;
 }
 
+void appif_conn_moved(uint32_t f_id, uint16_t db)
+{
+  struct application *app;
+  struct app_context *ctx = NULL;
+  struct connection *c;
+
+  for (app = applications; app != NULL; app = app->next) {
+    for (ctx = app->contexts; ctx != NULL && ctx->doorbell->id != db;
+        ctx = ctx->next);
+    if (ctx != NULL)
+      break;
+  }
+  if (ctx == NULL) {
+    fprintf(stderr, "appif_conn_moved: context for db %u not found\n", db);
+    return;
+  }
+
+  for (c = app->conns; c != NULL; c = c->app_next) {
+    if (c->status == CONN_OPEN && c->flow_id == f_id) {
+      c->ctx = ctx;
+      c->db_id = db;
+      return;
+    }
+  }
+  fprintf(stderr, "appif_conn_moved: connection for flow %u not found\n",
+      f_id);
+}
+
 
 static int uxsocket_init(void)
 {
@@ -385,7 +445,7 @@ static void uxsocket_accept(void)
   sz = sizeof(*app->resp) +
     tas_info->cores_num * sizeof(app->resp->flexnic_qs[0]);
   app->resp_sz = sz;
-  if ((app->resp = malloc(sz)) == NULL) {
+  if ((app->resp = malloc(sz * KERNEL_UXSOCK_CTX_MAX)) == NULL) {
     fprintf(stderr, "uxsocket_accept: malloc of app resp struct failed\n");
     free(app);
     close(cfd);
@@ -404,6 +464,9 @@ static void uxsocket_accept(void)
   }
 
   app->fd = cfd;
+  app->req_rx = 0;
+  app->req_fds_num = 0;
+  app->resp_num = 0;
   app->contexts = NULL;
   app->need_reg_ctx = NULL;
   app->closed = false;
@@ -441,21 +504,20 @@ static void uxsocket_error(struct application *app)
 static void uxsocket_receive(struct application *app)
 {
   ssize_t rx;
-  struct app_context *ctx;
-  struct packetmem_handle *pm_in, *pm_out;
-  uintptr_t off_in, off_out, off_rxq, off_txq;
-  size_t kin_qsize, kout_qsize, ctx_sz;
+  struct app_context *ctx, *first = NULL, *last = NULL;
+  struct kernel_uxsock_response *resp;
+  struct cmsghdr *cmsg;
   struct epoll_event ev;
-  uint16_t i;
-  int evfd = 0;
+  unsigned i, n;
+  int *fds;
 
   /* receive data to hopefully complete request */
   struct iovec iov = {
-    .iov_base = &app->req,
+    .iov_base = (uint8_t *) &app->req + app->req_rx,
     .iov_len = sizeof(app->req) - app->req_rx,
   };
   union {
-    char buf[CMSG_SPACE(sizeof(int))];
+    char buf[CMSG_SPACE(sizeof(int) * KERNEL_UXSOCK_CTX_MAX)];
     struct cmsghdr align;
   } u;
   struct msghdr msg = {
@@ -469,15 +531,21 @@ static void uxsocket_receive(struct application *app)
   };
   rx = recvmsg(app->fd, &msg, 0);
 
-  if(msg.msg_controllen > 0) {
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-    assert(cmsg->cmsg_len == CMSG_LEN(sizeof(int)));
-    int* data = (int*) CMSG_DATA(cmsg);
-    evfd = *data;
+  /* eventfds come with the first part of the request */
+  if (rx > 0 && msg.msg_controllen > 0 &&
+      (cmsg = CMSG_FIRSTHDR(&msg)) != NULL &&
+      cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+  {
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    fds = (int *) CMSG_DATA(cmsg);
+    for (i = 0; i < n && app->req_fds_num < KERNEL_UXSOCK_CTX_MAX; i++) {
+      app->req_fds[app->req_fds_num++] = fds[i];
+    }
   }
 
-  if (rx < 0) {
-    perror("uxsocket_receive: recv failed");
+  if (rx <= 0) {
+    if (rx < 0)
+      perror("uxsocket_receive: recv failed");
     goto error_abort_app;
   } else if (rx + app->req_rx < sizeof(app->req)) {
     /* request not complete yet */
@@ -487,11 +555,67 @@ static void uxsocket_receive(struct application *app)
 
   /* request complete */
   app->req_rx = 0;
+  n = app->req.ctx_num;
+  if (n == 0 || n > KERNEL_UXSOCK_CTX_MAX || n != app->req_fds_num) {
+    fprintf(stderr, "uxsocket_receive: bad request for %u contexts with %u "
+        "fds\n", n, app->req_fds_num);
+    goto error_abort_app;
+  }
+  app->req_fds_num = 0;
+
+  /* create all contexts before handing them to the main loop at once */
+  for (i = 0; i < n; i++) {
+    resp = (struct kernel_uxsock_response *)
+      ((uint8_t *) app->resp + i * app->resp_sz);
+    if ((app->req.flags & KERNEL_UXSOCK_REATTACH) != 0) {
+      ctx = uxsocket_ctx_reattach(app, app->req.db_ids[i], app->req_fds[i],
+          resp);
+    } else {
+      ctx = uxsocket_ctx_create(app, app->req_fds[i], resp);
+    }
+    if (ctx == NULL) {
+      goto error_abort_app;
+    }
+
+    if (first == NULL)
+      first = ctx;
+    else
+      last->reg_next = ctx;
+    last = ctx;
+  }
+  app->resp_num = n;
+
+  /* no longer wait on epoll in for this socket until we get the completion */
+  ev.events = EPOLLRDHUP | EPOLLERR;
+  ev.data.ptr = app;
+  if (epoll_ctl(epfd, EPOLL_CTL_MOD, app->fd, &ev) != 0) {
+    /* not sure how to  handle this */
+    perror("uxsocket_receive: epoll_ctl failed");
+    abort();
+  }
+
+  app->need_reg_ctx_done = first;
+  MEM_BARRIER();
+  app->need_reg_ctx = first;
+  return;
+
+error_abort_app:
+  uxsocket_error(app);
+}
+
+static struct app_context *uxsocket_ctx_create(struct application *app,
+    int evfd, struct kernel_uxsock_response *resp)
+{
+  struct app_context *ctx;
+  struct packetmem_handle *pm_in, *pm_out;
+  uintptr_t off_in, off_out, off_rxq, off_txq;
+  size_t kin_qsize, kout_qsize, ctx_sz;
+  uint16_t i;
 
   /* allocate context struct */
   ctx_sz = sizeof(*ctx) + tas_info->cores_num * sizeof(ctx->handles[0]);
   if ((ctx = malloc(ctx_sz)) == NULL) {
-    perror("uxsocket_receive: ctx malloc failed");
+    perror("uxsocket_ctx_create: ctx malloc failed");
     goto error_ctxmalloc;
   }
 
@@ -501,11 +625,11 @@ static void uxsocket_receive(struct application *app)
 
   /* allocate packet memory for kernel queues */
   if (packetmem_alloc(kin_qsize, &off_in, &pm_in) != 0) {
-    fprintf(stderr, "uxsocket_receive: packetmem_alloc in failed\n");
+    fprintf(stderr, "uxsocket_ctx_create: packetmem_alloc in failed\n");
     goto error_pktmem_in;
   }
   if (packetmem_alloc(kout_qsize, &off_out, &pm_out) != 0) {
-    fprintf(stderr, "uxsocket_receive: packetmem_alloc out failed\n");
+    fprintf(stderr, "uxsocket_ctx_create: packetmem_alloc out failed\n");
     goto error_pktmem_out;
   }
 
@@ -514,28 +638,30 @@ static void uxsocket_receive(struct application *app)
     if (packetmem_alloc(app->req.rxq_len, &off_rxq, &ctx->handles[i].rxq)
         != 0)
     {
-      fprintf(stderr, "uxsocket_receive: packetmem_alloc rxq failed\n");
+      fprintf(stderr, "uxsocket_ctx_create: packetmem_alloc rxq failed\n");
       goto error_pktmem;
     }
     if (packetmem_alloc(app->req.txq_len, &off_txq, &ctx->handles[i].txq)
         != 0)
     {
-      fprintf(stderr, "uxsocket_receive: packetmem_alloc txq failed\n");
+      fprintf(stderr, "uxsocket_ctx_create: packetmem_alloc txq failed\n");
       packetmem_free(ctx->handles[i].rxq);
       goto error_pktmem;
     }
     memset((uint8_t *) tas_shm + off_rxq, 0, app->req.rxq_len);
     memset((uint8_t *) tas_shm + off_txq, 0, app->req.txq_len);
-    app->resp->flexnic_qs[i].rxq_off = off_rxq;
-    app->resp->flexnic_qs[i].txq_off = off_txq;
+    resp->flexnic_qs[i].rxq_off = off_rxq;
+    resp->flexnic_qs[i].txq_off = off_txq;
   }
 
   /* allocate doorbell */
   if ((ctx->doorbell = free_doorbells) == NULL) {
-    fprintf(stderr, "uxsocket_receive: allocating doorbell failed\n");
+    fprintf(stderr, "uxsocket_ctx_create: allocating doorbell failed\n");
     goto error_dballoc;
   }
   free_doorbells = ctx->doorbell->next;
+  ctx->rec = restart_ctx_rec(ctx->doorbell->id);
+  ctx->rec->valid = 0;
 
 
   /* initialize queuepair struct and queues */
@@ -544,59 +670,53 @@ static void uxsocket_receive(struct application *app)
   ctx->kin_handle = pm_in;
   ctx->kin_base = (uint8_t *) tas_shm + off_in;
   ctx->kin_len = kin_qsize / sizeof(struct kernel_appout);
-  ctx->kin_pos = 0;
+  ctx->rec->kin_pos = 0;
   memset(ctx->kin_base, 0, kin_qsize);
 
   ctx->kout_handle = pm_out;
   ctx->kout_base = (uint8_t *) tas_shm + off_out;
   ctx->kout_len = kout_qsize / sizeof(struct kernel_appin);
-  ctx->kout_pos = 0;
+  ctx->rec->kout_pos = 0;
   memset(ctx->kout_base, 0, kout_qsize);
 
   ctx->ready = 0;
-  assert(evfd != 0);	// XXX: Will be 0 if request was broken up
   ctx->evfd = evfd;
+  ctx->last_ts = 0;
+  ctx->notify_delay = 0;
+  ctx->notify_count = 0;
+  ctx->notify_pending = 0;
+  ctx->reg_next = NULL;
+  ctx->reg_resp = resp;
+  ctx->reg_evfd = -1;
 
   ctx->next = app->contexts;
   MEM_BARRIER();
   app->contexts = ctx;
 
   /* initialize response */
-  app->resp->app_out_off = off_in;
-  app->resp->app_out_len = kin_qsize;
-  app->resp->app_in_off = off_out;
-  app->resp->app_in_len = kout_qsize;
-  app->resp->flexnic_db_id = ctx->doorbell->id;
-  app->resp->flexnic_qs_num = tas_info->cores_num;
-  app->resp->status = 0;
-
-  /* no longer wait on epoll in for this socket until we get the completion */
-  ev.events = EPOLLRDHUP | EPOLLERR;
-  ev.data.ptr = app;
-  if (epoll_ctl(epfd, EPOLL_CTL_MOD, app->fd, &ev) != 0) {
-    /* not sure how to  handle this */
-    perror("uxsocket_receive: epoll_ctl failed");
-    abort();
+  resp->app_out_off = off_in;
+  resp->app_out_len = kin_qsize;
+  resp->app_in_off = off_out;
+  resp->app_in_len = kout_qsize;
+  resp->flexnic_db_id = ctx->doorbell->id;
+  resp->flexnic_qs_num = tas_info->cores_num;
+  resp->status = 0;
+
+  /* record for taking the context over after a fast restart */
+  ctx->rec->app_id = app->id;
+  ctx->rec->kin_off = off_in;
+  ctx->rec->kin_size = kin_qsize;
+  ctx->rec->kout_off = off_out;
+  ctx->rec->kout_size = kout_qsize;
+  ctx->rec->rxq_len = app->req.rxq_len;
+  ctx->rec->txq_len = app->req.txq_len;
+  for (i = 0; i < tas_info->cores_num; i++) {
+    ctx->rec->rxq_off[i] = resp->flexnic_qs[i].rxq_off;
+    ctx->rec->txq_off[i] = resp->flexnic_qs[i].txq_off;
   }
-
-  app->need_reg_ctx_done = ctx;
   MEM_BARRIER();
-  app->need_reg_ctx = ctx;
-#if 0
-  /* send out response */
-  tx = send(app->fd, &resp, sizeof(resp), 0);
-  if (tx < 0) {
-    perror("uxsocket_receive: send failed");
-    goto error_abort_app;
-  } else if (tx < sizeof(resp)) {
-    /* FIXME */
-    fprintf(stderr, "uxsocket_receive: short send for response (TODO)\n");
-    goto error_abort_app;
-  }
-#endif
-
-  return;
-
+  ctx->rec->valid = 1;
+  return ctx;
 
 error_dballoc:
   /* TODO: for () packetmem_free(ctx->txq_handle) */
@@ -607,10 +727,160 @@ error_pktmem_out:
 error_pktmem_in:
   free(ctx);
 error_ctxmalloc:
-error_abort_app:
-  uxsocket_error(app);
-  return;
+  return NULL;
+}
+
+static struct app_context *uxsocket_ctx_reattach(struct application *app,
+    uint16_t db, int evfd, struct kernel_uxsock_response *resp)
+{
+  struct app_context *ctx;
+  struct restart_ctx *rc;
+  uint16_t i;
+
+  if ((ctx = restart_ctx_claim(db)) == NULL) {
+    fprintf(stderr, "uxsocket_ctx_reattach: context %u was not taken over or "
+        "is already reattached\n", db);
+    return NULL;
+  }
+
+  /* application keeps its id, the fast path app state refers to it; the id
+   * just handed out is returned if possible */
+  if (app->id != ctx->app->id) {
+    if (app->id + 1 == app_id_next)
+      app_id_next--;
+    app->id = ctx->app->id;
+  }
+
+  /* the main thread switches over the eventfd and ownership */
+  ctx->reg_next = NULL;
+  ctx->reg_resp = resp;
+  ctx->reg_evfd = evfd;
+
+  rc = ctx->rec;
+  resp->app_out_off = rc->kin_off;
+  resp->app_out_len = rc->kin_size;
+  resp->app_in_off = rc->kout_off;
+  resp->app_in_len = rc->kout_size;
+  resp->flexnic_db_id = db;
+  resp->flexnic_qs_num = tas_info->cores_num;
+  for (i = 0; i < tas_info->cores_num; i++) {
+    resp->flexnic_qs[i].rxq_off = rc->rxq_off[i];
+    resp->flexnic_qs[i].txq_off = rc->txq_off[i];
+  }
+  resp->status = 0;
+  return ctx;
+}
+
+/* rebuild contexts taken over from a previous instance, they are owned by
+ * placeholder applications until reattached */
+static int appif_restore(void)
+{
+  struct restart_ctx *rc;
+  struct application *app;
+  struct app_context *ctx;
+  struct app_doorbell *adb;
+  uint16_t db;
+  int evfd = -1;
+
+  for (db = 1; db < RESTART_CTX_NUM; db++) {
+    rc = restart_ctx_rec(db);
+    if (!rc->valid)
+      continue;
+
+    /* notifications go nowhere until the application reattaches */
+    if (evfd == -1 && (evfd = eventfd(0, EFD_NONBLOCK)) == -1) {
+      perror("appif_restore: eventfd failed");
+      return -1;
+    }
+
+    for (app = applications; app != NULL && app->id != rc->app_id;
+        app = app->next);
+    if (app == NULL) {
+      if ((app = calloc(1, sizeof(*app))) == NULL) {
+        perror("appif_restore: calloc app failed");
+        return -1;
+      }
+      app->fd = -1;
+      app->id = rc->app_id;
+      app->next = applications;
+      applications = app;
+      if (app->id >= app_id_next)
+        app_id_next = app->id + 1;
+    }
+
+    if ((ctx = malloc(sizeof(*ctx) +
+            tas_info->cores_num * sizeof(ctx->handles[0]))) == NULL ||
+        (adb = malloc(sizeof(*adb))) == NULL)
+    {
+      perror("appif_restore: malloc failed");
+      return -1;
+    }
+    if (restart_ctx_take(db, ctx) != 0) {
+      fprintf(stderr, "appif_restore: no memory reserved for context %u\n",
+          db);
+      return -1;
+    }
+
+    adb->id = db;
+    adb->next = NULL;
+
+    ctx->app = app;
+    ctx->kin_base = (uint8_t *) tas_shm + rc->kin_off;
+    ctx->kin_len = rc->kin_size / sizeof(struct kernel_appout);
+    ctx->kout_base = (uint8_t *) tas_shm + rc->kout_off;
+    ctx->kout_len = rc->kout_size / sizeof(struct kernel_appin);
+    ctx->rec = rc;
+    ctx->doorbell = adb;
+    ctx->reg_next = NULL;
+    ctx->reg_resp = NULL;
+    ctx->reg_evfd = -1;
+    ctx->ready = 1;
+    ctx->evfd = evfd;
+    ctx->last_ts = 0;
+    ctx->notify_delay = 0;
+    ctx->notify_count = 0;
+    ctx->notify_pending = 0;
+
+    ctx->next = app->contexts;
+    app->contexts = ctx;
+    restart_ctx_set(db, ctx);
+  }
+
+  return 0;
+}
+
+/* move reattached context and its connections over from the placeholder */
+static void appif_ctx_reattach(struct application *app,
+    struct app_context *ctx)
+{
+  struct application *old = ctx->app, **pa;
+  struct app_context **pc;
+  struct connection *c, **pconn;
+
+  for (pc = &old->contexts; *pc != ctx; pc = &(*pc)->next);
+  *pc = ctx->next;
+  ctx->next = app->contexts;
+  app->contexts = ctx;
+
+  for (pconn = &old->conns; (c = *pconn) != NULL; ) {
+    if (c->ctx == ctx) {
+      *pconn = c->app_next;
+      c->app_next = app->conns;
+      app->conns = c;
+    } else {
+      pconn = &c->app_next;
+    }
+  }
 
+  ctx->app = app;
+  ctx->evfd = ctx->reg_evfd;
+  nicif_appctx_evfd(ctx->doorbell->id, ctx->evfd);
+
+  if (old->contexts == NULL) {
+    for (pa = &applications; *pa != old; pa = &(*pa)->next);
+    *pa = old->next;
+    free(old);
+  }
 }
 
 static void uxsocket_notify_app(struct application *app)
@@ -627,15 +897,16 @@ static void uxsocket_notify_app(struct application *app)
     return;
   }
 
-  ctx = app->need_reg_ctx_done;
-  ctx->ready = 1;
+  for (ctx = app->need_reg_ctx_done; ctx != NULL; ctx = ctx->reg_next) {
+    ctx->ready = 1;
+  }
 
-  /* send out response */
-  tx = send(app->fd, app->resp, app->resp_sz, 0);
+  /* send out responses for all contexts in the request */
+  tx = send(app->fd, app->resp, app->resp_sz * app->resp_num, 0);
   if (tx < 0) {
     perror("uxsocket_notify_app: send failed");
     goto error_send;
-  } else if (tx < app->resp_sz) {
+  } else if (tx < app->resp_sz * app->resp_num) {
     /* FIXME */
     fprintf(stderr, "uxsocket_notify_app: short send for response (TODO)\n");
     goto error_send;
@@ -42,17 +42,30 @@ struct app_context {
   struct packetmem_handle *kin_handle;
   void *kin_base;
   uint32_t kin_len;
-  uint32_t kin_pos;
 
   struct packetmem_handle *kout_handle;
   void *kout_base;
   uint32_t kout_len;
-  uint32_t kout_pos;
+
+  /* persisted record, also holds the kin and kout queue positions so they
+   * survive a fast restart */
+  struct restart_ctx *rec;
 
   struct app_doorbell *doorbell;
 
+  /* contexts created by the same request, registered with the NIC together */
+  struct app_context *reg_next;
+  struct kernel_uxsock_response *reg_resp;
+  /* eventfd of the application reattaching the context */
+  int reg_evfd;
+
   int ready, evfd;
   uint32_t last_ts;
+  /* notification moderation for kernel->app queue, see appif_ctx_kick */
+  uint32_t notify_delay;
+  uint32_t notify_ts;
+  uint16_t notify_count;
+  uint16_t notify_pending;
   struct app_context *next;
 
   struct {
@@ -66,7 +79,12 @@ struct application {
   struct nbqueue_el nqe;
   size_t req_rx;
   struct kernel_uxsock_request req;
+  /* eventfds received with the current request */
+  int req_fds[KERNEL_UXSOCK_CTX_MAX];
+  unsigned req_fds_num;
+  /* size of one context response, responses for the current request */
   size_t resp_sz;
+  unsigned resp_num;
   struct kernel_uxsock_response *resp;
 
   struct app_context *contexts;
@@ -91,4 +109,13 @@ struct application {
  */
 unsigned appif_ctx_poll(struct application *app, struct app_context *ctx);
 
+/**
+ * Deliver a moderated notification for context if its delay has passed.
+ * Only called while notify_pending is set, counts as work so the slow path
+ * does not block in the meantime.
+ *
+ * @param ctx Context to check
+ */
+unsigned appif_ctx_notify_poll(struct app_context *ctx);
+
 #endif /* ndef APPIF_H_ */
@@ -47,7 +47,26 @@ static int kin_accept_conn(struct application *app, struct app_context *ctx,
     volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
 static int kin_req_scale(struct application *app, struct app_context *ctx,
     volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
+static int kin_ctx_qos(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
+static int kin_route(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
+static int kin_ctx_notify(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
+static int kin_obj_steer(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout);
+
+static void appif_ctx_notify(struct app_context *ctx, uint32_t now)
+{
+  uint64_t val = 1;
+  int r = write(ctx->evfd, &val, sizeof(uint64_t));
+  assert(r == sizeof(uint64_t));
 
+  ctx->notify_pending = 0;
+  ctx->last_ts = now;
+}
+
+/* same moderation as for fast path notifications, see actx_kick */
 static void appif_ctx_kick(struct app_context *ctx)
 {
   assert(ctx->evfd != 0);
@@ -55,11 +74,27 @@ static void appif_ctx_kick(struct app_context *ctx)
 
   /* fprintf(stderr, "kicking app context?\n"); */
 
+  if (ctx->notify_pending != 0) {
+    if (ctx->notify_pending < UINT16_MAX)
+      ctx->notify_pending++;
+    if ((ctx->notify_count != 0 &&
+          ctx->notify_pending >= ctx->notify_count) ||
+        now - ctx->notify_ts >= ctx->notify_delay)
+    {
+      appif_ctx_notify(ctx, now);
+    }
+    return;
+  }
+
   if(now - ctx->last_ts > POLL_CYCLE) {
-    uint64_t val = 1;
+    if (ctx->notify_delay != 0 && ctx->notify_count != 1) {
+      ctx->notify_pending = 1;
+      ctx->notify_ts = now;
+      return;
+    }
     /* fprintf(stderr, "kicking app context!\n"); */
-    int r = write(ctx->evfd, &val, sizeof(uint64_t));
-    assert(r == sizeof(uint64_t));
+    appif_ctx_notify(ctx, now);
+    return;
   }
 
   ctx->last_ts = now;
@@ -69,7 +104,7 @@ void appif_conn_opened(struct connection *c, int status)
 {
   struct app_context *ctx = c->ctx;
   volatile struct kernel_appin *kout = ctx->kout_base;
-  uint32_t kout_pos = ctx->kout_pos;
+  uint32_t kout_pos = ctx->rec->kout_pos;
 
   kout += kout_pos;
 
@@ -105,7 +140,7 @@ void appif_conn_opened(struct connection *c, int status)
   if (kout_pos >= ctx->kout_len) {
     kout_pos = 0;
   }
-  ctx->kout_pos = kout_pos;
+  ctx->rec->kout_pos = kout_pos;
 }
 
 void appif_conn_closed(struct connection *c, int status)
@@ -114,7 +149,7 @@ void appif_conn_closed(struct connection *c, int status)
   struct application *app = ctx->app;
   struct connection *c_i;
   volatile struct kernel_appin *kout = ctx->kout_base;
-  uint32_t kout_pos = ctx->kout_pos;
+  uint32_t kout_pos = ctx->rec->kout_pos;
 
   kout += kout_pos;
 
@@ -135,7 +170,7 @@ void appif_conn_closed(struct connection *c, int status)
   if (kout_pos >= ctx->kout_len) {
     kout_pos = 0;
   }
-  ctx->kout_pos = kout_pos;
+  ctx->rec->kout_pos = kout_pos;
 
   /* remove from app connection list */
   if (app->conns == c) {
@@ -156,7 +191,7 @@ void appif_listen_newconn(struct listener *l, uint32_t remote_ip,
 {
   struct app_context *ctx = l->ctx;
   volatile struct kernel_appin *kout = ctx->kout_base;
-  uint32_t kout_pos = ctx->kout_pos;
+  uint32_t kout_pos = ctx->rec->kout_pos;
 
   kout += kout_pos;
 
@@ -177,7 +212,7 @@ void appif_listen_newconn(struct listener *l, uint32_t remote_ip,
   if (kout_pos >= ctx->kout_len) {
     kout_pos = 0;
   }
-  ctx->kout_pos = kout_pos;
+  ctx->rec->kout_pos = kout_pos;
 
 }
 
@@ -186,7 +221,7 @@ void appif_accept_conn(struct connection *c, int status)
   struct app_context *ctx = c->ctx;
   struct application *app = ctx->app;
   volatile struct kernel_appin *kout = ctx->kout_base;
-  uint32_t kout_pos = ctx->kout_pos;
+  uint32_t kout_pos = ctx->rec->kout_pos;
 
   kout += kout_pos;
 
@@ -204,8 +239,9 @@ void appif_accept_conn(struct connection *c, int status)
     kout->data.accept_connection.rx_len = c->rx_len;
     kout->data.accept_connection.tx_len = c->tx_len;
 
-    kout->data.accept_connection.seq_rx = c->remote_seq;
+    kout->data.accept_connection.seq_rx = c->remote_seq - c->syn_data_len;
     kout->data.accept_connection.seq_tx = c->local_seq;
+    kout->data.accept_connection.syn_len = c->syn_data_len;
     kout->data.accept_connection.local_ip = config.ip;
     kout->data.accept_connection.remote_ip = c->remote_ip;
     kout->data.accept_connection.remote_port = c->remote_port;
@@ -226,16 +262,25 @@ void appif_accept_conn(struct connection *c, int status)
   if (kout_pos >= ctx->kout_len) {
     kout_pos = 0;
   }
-  ctx->kout_pos = kout_pos;
+  ctx->rec->kout_pos = kout_pos;
 }
 
 
+unsigned appif_ctx_notify_poll(struct app_context *ctx)
+{
+  uint32_t now = util_timeout_time_us();
+
+  if (now - ctx->notify_ts >= ctx->notify_delay)
+    appif_ctx_notify(ctx, now);
+  return 1;
+}
+
 unsigned appif_ctx_poll(struct application *app, struct app_context *ctx)
 {
   volatile struct kernel_appout *kin = ctx->kin_base;
   volatile struct kernel_appin *kout = ctx->kout_base;
-  uint32_t kin_pos = ctx->kin_pos;
-  uint32_t kout_pos = ctx->kout_pos;
+  uint32_t kin_pos = ctx->rec->kin_pos;
+  uint32_t kout_pos = ctx->rec->kout_pos;
   uint8_t type;
   int kout_inc = 0;
 
@@ -285,6 +330,26 @@ unsigned appif_ctx_poll(struct application *app, struct app_context *ctx)
       kout_inc += kin_req_scale(app, ctx, kin, kout);
       break;
 
+    case KERNEL_APPOUT_CTX_QOS:
+      /* context weight / rate cap */
+      kout_inc += kin_ctx_qos(app, ctx, kin, kout);
+      break;
+
+    case KERNEL_APPOUT_ROUTE:
+      /* route add / remove */
+      kout_inc += kin_route(app, ctx, kin, kout);
+      break;
+
+    case KERNEL_APPOUT_CTX_NOTIFY:
+      /* notification moderation */
+      kout_inc += kin_ctx_notify(app, ctx, kin, kout);
+      break;
+
+    case KERNEL_APPOUT_OBJ_STEER:
+      /* object steering table */
+      kout_inc += kin_obj_steer(app, ctx, kin, kout);
+      break;
+
     case KERNEL_APPOUT_LISTEN_CLOSE:
     default:
       fprintf(stderr, "kin_poll: unsupported request type %u\n", kin->type);
@@ -299,7 +364,7 @@ unsigned appif_ctx_poll(struct application *app, struct app_context *ctx)
   if (kin_pos >= ctx->kin_len) {
     kin_pos = 0;
   }
-  ctx->kin_pos = kin_pos;
+  ctx->rec->kin_pos = kin_pos;
 
   /* update kout queue position if the entry was used */
   if (kout_inc > 0) {
@@ -307,22 +372,39 @@ unsigned appif_ctx_poll(struct application *app, struct app_context *ctx)
     if (kout_pos >= ctx->kout_len) {
       kout_pos = 0;
     }
-    ctx->kout_pos = kout_pos;
+    ctx->rec->kout_pos = kout_pos;
   }
 
   return 1;
 }
 
+/* map algorithm requested by app to config algorithm, -1 if invalid */
+static inline int kin_cc_alg(uint8_t cc)
+{
+  if (cc == KERNEL_APPOUT_CC_DEFAULT)
+    return config.cc_algorithm;
+  if (cc >= KERNEL_APPOUT_CC_NUM)
+    return -1;
+  return cc - KERNEL_APPOUT_CC_DCTCP_WIN + CONFIG_CC_DCTCP_WIN;
+}
+
 static int kin_conn_open(struct application *app, struct app_context *ctx,
     volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
 {
   struct connection *conn;
-  int objconn, objnohash;
+  int objconn, objnohash, cc_alg;
+
+  if ((cc_alg = kin_cc_alg(kin->data.conn_open.cc)) < 0) {
+    fprintf(stderr, "kin_conn_open: invalid cc algorithm (%u)\n",
+        kin->data.conn_open.cc);
+    goto error;
+  }
 
   objconn = !!(kin->data.conn_open.flags & KERNEL_APPOUT_OPEN_OBJSOCK);
   objnohash = !!(kin->data.conn_open.flags & KERNEL_APPOUT_OPEN_OBJNOHASH);
   if (tcp_open(ctx, kin->data.conn_open.opaque, kin->data.conn_open.remote_ip,
       kin->data.conn_open.remote_port, ctx->doorbell->id, objconn, objnohash,
+      kin->data.conn_open.rx_len, kin->data.conn_open.tx_len, cc_alg,
       &conn) != 0)
   {
     fprintf(stderr, "kin_conn_open: tcp_open failed\n");
@@ -383,6 +465,8 @@ static int kin_conn_move(struct application *app, struct app_context *ctx,
     fprintf(stderr, "kin_conn_move: nicif_connection_move failed\n");
     goto error;
   }
+  conn->ctx = new_ctx;
+  conn->db_id = new_ctx->doorbell->id;
 
   kout->data.status.opaque = kin->data.conn_move.opaque;
   kout->data.status.status = 0;
@@ -440,12 +524,20 @@ static int kin_listen_open(struct application *app, struct app_context *ctx,
     volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
 {
   struct listener *listen;
+  int cc_alg;
+
+  if ((cc_alg = kin_cc_alg(kin->data.listen_open.cc)) < 0) {
+    fprintf(stderr, "kin_listen_open: invalid cc algorithm (%u)\n",
+        kin->data.listen_open.cc);
+    goto error;
+  }
 
   if (tcp_listen(ctx, kin->data.listen_open.opaque,
         kin->data.listen_open.local_port, kin->data.listen_open.backlog,
         !!(kin->data.listen_open.flags & KERNEL_APPOUT_LISTEN_REUSEPORT),
         !!(kin->data.listen_open.flags & KERNEL_APPOUT_LISTEN_OBJSOCK),
         !!(kin->data.listen_open.flags & KERNEL_APPOUT_LISTEN_OBJNOHASH),
+        kin->data.listen_open.rx_len, kin->data.listen_open.tx_len, cc_alg,
         &listen) != 0)
   {
     fprintf(stderr, "kin_listen_open: tcp_listen failed\n");
@@ -515,3 +607,78 @@ static int kin_req_scale(struct application *app, struct app_context *ctx,
 
   return 0;
 }
+
+static int kin_ctx_qos(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
+{
+  uint16_t weight = kin->data.ctx_qos.weight;
+
+  nicif_appctx_qos(ctx->doorbell->id, (weight == 0 ? 1 : weight),
+      kin->data.ctx_qos.rate);
+
+  return 0;
+}
+
+static int kin_route(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
+{
+  uint32_t ip = kin->data.route.ip;
+  uint8_t prefix = kin->data.route.prefix;
+
+  /* routing reports errors, there is no status message for this */
+  if ((kin->data.route.flags & KERNEL_APPOUT_ROUTE_DEL) != 0) {
+    routing_remove(ip, prefix);
+  } else {
+    routing_add(ip, prefix, kin->data.route.next_hop_ip,
+        kin->data.route.port);
+  }
+
+  return 0;
+}
+
+static int kin_ctx_notify(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
+{
+  uint32_t delay = kin->data.ctx_notify.delay;
+  uint16_t count = kin->data.ctx_notify.count;
+
+  ctx->notify_count = count;
+  ctx->notify_delay = delay;
+  nicif_appctx_notify(ctx->doorbell->id, delay, count);
+
+  return 0;
+}
+
+static int kin_obj_steer(struct application *app, struct app_context *ctx,
+    volatile struct kernel_appout *kin, volatile struct kernel_appin *kout)
+{
+  uint16_t first = kin->data.obj_steer.first;
+  uint16_t last = kin->data.obj_steer.last;
+  uint16_t db = kin->data.obj_steer.db_id;
+  struct app_context *dst;
+
+  if ((kin->data.obj_steer.flags & KERNEL_APPOUT_OBJ_STEER_OFF) != 0) {
+    nicif_appst_steer_off(app->id);
+    return 0;
+  }
+
+  if (first > last || last >= FLEXNIC_PL_APPST_STEER_NUM) {
+    fprintf(stderr, "kin_obj_steer: invalid bucket range (%u-%u)\n", first,
+        last);
+    return 0;
+  }
+
+  /* objects may only be steered to contexts of the same application */
+  for (dst = app->contexts; dst != NULL; dst = dst->next) {
+    if (dst->doorbell->id == db) {
+      break;
+    }
+  }
+  if (dst == NULL) {
+    fprintf(stderr, "kin_obj_steer: context not found (db=%u)\n", db);
+    return 0;
+  }
+
+  nicif_appst_steer(app->id, first, last, db);
+  return 0;
+}
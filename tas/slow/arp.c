@@ -36,47 +36,92 @@
 #define ARP_DEBUG(x...) do { } while (0)
 /*#define ARP_DEBUG(x...) fprintf(stderr, "arp: " x)*/
 
+/** Number of hash table buckets (power of 2) */
+#define ARP_HT_SIZE 4096
+/** Max. number of requests sent per arp_poll() call */
+#define ARP_TX_BATCH 64
+
+enum arp_status {
+  /** resolved, ages out */
+  ARP_ST_RESOLVED,
+  /** request outstanding, not usable yet */
+  ARP_ST_PENDING,
+  /** resolved and usable, refresh request outstanding */
+  ARP_ST_REFRESH,
+  /** resolved and never ages out (local address, neighbor file) */
+  ARP_ST_STATIC,
+};
+
 struct arp_entry {
-    int status;
+    enum arp_status status;
     uint32_t ip;
     uint8_t mac[ETH_ADDR_LEN];
+    /* port requests go out on (-1: all) until resolved, then the port the
+     * response came in on */
+    int16_t port;
+    /* entry was looked up since it was last (re-)resolved */
+    uint8_t used;
+    /* timeout is armed */
+    uint8_t armed;
+    /* entry is on the request send list */
+    uint8_t tx_pending;
     struct nicif_completion *compl;
 
     uint32_t timeout;
     struct timeout to;
 
-    struct arp_entry *prev;
-    struct arp_entry *next;
+    /* hash bucket chain */
+    struct arp_entry *ht_next;
+    /* request send list */
+    struct arp_entry *tx_prev;
+    struct arp_entry *tx_next;
 };
 
-static inline int response_tx(const void *dst_mac, uint32_t dst_ip);
-static inline int request_tx(uint32_t dst_ip);
+static inline int response_tx(const void *dst_mac, uint32_t dst_ip,
+    uint8_t port);
+static inline int request_tx(uint32_t dst_ip, int port);
+static inline int request_tx_port(uint32_t dst_ip, uint8_t port);
 static inline struct arp_entry *ae_lookup(uint32_t ip);
-
-static struct arp_entry *arp_table = NULL;
+static inline struct arp_entry *ae_alloc(uint32_t ip);
+static inline void ae_remove(struct arp_entry *ae);
+static inline void ae_arm(struct arp_entry *ae, uint32_t us,
+    enum timeout_type type);
+static inline void ae_disarm(struct arp_entry *ae);
+static inline void ae_tx_enqueue(struct arp_entry *ae);
+static inline void ae_tx_dequeue(struct arp_entry *ae);
+static inline void ae_notify(struct arp_entry *ae, int status);
+static int static_load(const char *path);
+
+static struct arp_entry *arp_table[ARP_HT_SIZE];
+static struct arp_entry *tx_first = NULL;
+static struct arp_entry *tx_last = NULL;
 
 int arp_init(void)
 {
   uint64_t mac;
-  struct arp_entry *lb = malloc(sizeof(struct arp_entry));
-  assert(lb != NULL);
+  struct arp_entry *lb;
 
-  lb->status = 0;
-  lb->ip = config.ip;
+  if ((lb = ae_alloc(config.ip)) == NULL) {
+    fprintf(stderr, "arp_init: allocating local entry failed\n");
+    return -1;
+  }
+  lb->status = ARP_ST_STATIC;
+  lb->port = 0;
   memcpy(lb->mac, &eth_addr, ETH_ADDR_LEN);
-  lb->compl = NULL;
-  lb->next = NULL;
-  lb->prev = NULL;
-  arp_table = lb;
 
   mac = 0;
   memcpy(&mac, &eth_addr, ETH_ADDR_LEN);
   printf("host ip: %x MAC: %lu\n", config.ip, mac);
 
+  if (config.arp_file != NULL && static_load(config.arp_file) != 0) {
+    return -1;
+  }
+
   return 0;
 }
 
-int arp_request(struct nicif_completion *comp, uint32_t ip, uint64_t *mac)
+int arp_request(struct nicif_completion *comp, uint32_t ip, int port,
+    uint64_t *mac)
 {
   struct arp_entry *ae;
 
@@ -84,12 +129,13 @@ int arp_request(struct nicif_completion *comp, uint32_t ip, uint64_t *mac)
 
   /* found entry */
   if ((ae = ae_lookup(ip)) != NULL) {
-    if (ae->status == 0) {
+    if (ae->status != ARP_ST_PENDING) {
       ARP_DEBUG("lookup succeeded (%x)\n", ip);
       memcpy(mac, ae->mac, 6);
+      ae->used = 1;
       return 0;
     } else {
-      /* request still pending */
+      /* request still pending, coalesce with the outstanding one */
       ARP_DEBUG("request still pending (%x)\n", ip);
       comp->ptr = mac;
       comp->el.next = (void *) ae->compl;
@@ -99,49 +145,61 @@ int arp_request(struct nicif_completion *comp, uint32_t ip, uint64_t *mac)
   }
 
   /* allocate cache entry */
-  if ((ae = malloc(sizeof(*ae))) == NULL) {
+  if ((ae = ae_alloc(ip)) == NULL) {
     fprintf(stderr, "arp_request: malloc failed\n");
     return -1;
   }
 
-  ae->status = 1;
-  ae->ip = ip;
+  ae->status = ARP_ST_PENDING;
+  ae->port = port;
   ae->compl = comp;
   comp->el.next = NULL;
   comp->ptr = mac;
 
-  /* send out request */
-  if (request_tx(ip) != 0) {
-    /* timeout will take care of re-trying */
-    fprintf(stderr, "arp_timeout: sending out request failed\n");
-  }
+  /* request goes out with the next arp_poll() */
+  ae_tx_enqueue(ae);
 
   /* arm timeout */
   ae->timeout = config.arp_to;
-  util_timeout_arm(&timeout_mgr, &ae->to, ae->timeout, TO_ARP_REQ);
+  ae_arm(ae, ae->timeout, TO_ARP_REQ);
+
+  ARP_DEBUG("request queued (%x)\n", ip);
+
+  return 1;
+}
+
+unsigned arp_poll(void)
+{
+  unsigned n;
+  struct arp_entry *ae;
 
-  /* insert into list */
-  ae->prev = NULL;
-  ae->next = arp_table;
-  if (arp_table != NULL) {
-    arp_table->prev = ae;
+  for (n = 0; n < ARP_TX_BATCH && (ae = tx_first) != NULL; n++) {
+    /* tx queue full: leave the rest for the next round */
+    if (request_tx(ae->ip, ae->port) != 0) {
+      break;
+    }
+    ae_tx_dequeue(ae);
   }
-  arp_table = ae;
 
-  ARP_DEBUG("request sent (%x)\n", ip);
+  return n;
+}
 
-  return 1;
+uint8_t arp_port(uint32_t ip)
+{
+  struct arp_entry *ae;
+
+  if ((ae = ae_lookup(ip)) == NULL || ae->status == ARP_ST_PENDING) {
+    return 0;
+  }
+  return ae->port;
 }
 
-void arp_packet(const void *pkt, uint16_t len)
+void arp_packet(const void *pkt, uint16_t len, uint8_t port)
 {
   const struct pkt_arp *parp = pkt;
   const struct arp_hdr *arp = &parp->arp;
   uint16_t op;
-  uint64_t cnt = 1;
-  int fd, ret;
   struct arp_entry *ae;
-  struct nicif_completion *comp, *comp_next;
 
   /* filter out bad packets */
   if (f_beui16(arp->htype) != ARP_HTYPE_ETHERNET ||
@@ -163,7 +221,7 @@ void arp_packet(const void *pkt, uint16_t len)
     }
 
     /* send response */
-    if (response_tx(&arp->sha, f_beui32(arp->spa)) != 0) {
+    if (response_tx(&arp->sha, f_beui32(arp->spa), port) != 0) {
       fprintf(stderr, "arp_packet: sending response failed\n");
       return;
     }
@@ -176,48 +234,62 @@ void arp_packet(const void *pkt, uint16_t len)
       return;
     }
 
-    if (ae->status == 1) {
-      /* disarm timeout */
-      util_timeout_disarm(&timeout_mgr, &ae->to);
+    /* static entries are not overridden */
+    if (ae->status == ARP_ST_STATIC) {
+      return;
     }
 
     /* fill in information on arp entry */
+    ae_disarm(ae);
+    ae_tx_dequeue(ae);
     memcpy(ae->mac, &arp->sha, ETH_ADDR_LEN);
-    ae->status = 0;
-
-    /* notify waiting connections */
-    for (comp = ae->compl; comp != NULL; comp = comp_next) {
-      comp_next = (void *) comp->el.next;
+    ae->port = port;
+    ae->status = ARP_ST_RESOLVED;
+    ae->used = 0;
 
-      memcpy(comp->ptr, ae->mac, ETH_ADDR_LEN);
-      comp->status = 0;
-      fd = comp->notify_fd;
-      nbqueue_enq(comp->q, &comp->el);
-      if (fd != -1) {
-        ret = write(fd, &cnt, sizeof(cnt));
-        if (ret <= 0) {
-          perror("arp_packet: error writing to notify fd");
-        }
-      }
+    /* refresh before the entry ages out */
+    if (config.arp_age != 0) {
+      ae_arm(ae, config.arp_age - config.arp_age / 4, TO_ARP_AGE);
     }
-    ae->compl = NULL;
+
+    /* notify waiting connections */
+    ae_notify(ae, 0);
   }
 }
 
 void arp_timeout(struct timeout *to, enum timeout_type type)
 {
-  int fd;
-  ssize_t ret;
-  uint64_t cnt = 1;
-  struct nicif_completion *comp, *comp_next;
   struct arp_entry *ae = (struct arp_entry *)
     ((uintptr_t) to - offsetof(struct arp_entry, to));
 
-  ARP_DEBUG("arp_timeout(%x): timeout=%uus\n", ae->ip, ae->timeout);
+  ARP_DEBUG("arp_timeout(%x): type=%u timeout=%uus\n", ae->ip, type,
+      ae->timeout);
+
+  ae->armed = 0;
+
+  if (type == TO_ARP_AGE) {
+    if (ae->status == ARP_ST_RESOLVED && ae->used) {
+      /* entry still in use, refresh while it stays valid */
+      ARP_DEBUG("arp_timeout: refreshing %x\n", ae->ip);
+      ae->status = ARP_ST_REFRESH;
+      ae_tx_enqueue(ae);
+      ae_arm(ae, config.arp_age / 4, TO_ARP_AGE);
+    } else if (ae->status == ARP_ST_RESOLVED ||
+        ae->status == ARP_ST_REFRESH)
+    {
+      /* unused or refresh unanswered, next lookup resolves again */
+      ARP_DEBUG("arp_timeout: %x aged out\n", ae->ip);
+      ae_remove(ae);
+    } else {
+      fprintf(stderr, "arp_timeout: age timeout on unresolved entry\n");
+      abort();
+    }
+    return;
+  }
 
   /* the arp entry should not be ready or the timeout would have been
    * cancelled */
-  if (ae->status == 0) {
+  if (ae->status != ARP_ST_PENDING) {
     fprintf(stderr, "arp_timeout: arp entry marked as ready\n");
     abort();
   }
@@ -227,47 +299,25 @@ void arp_timeout(struct timeout *to, enum timeout_type type)
     ARP_DEBUG("arp_timeout: request for %x timed out\n", ae->ip);
 
     /* notify waiting connections */
-    for (comp = ae->compl; comp != NULL; comp = comp_next) {
-      comp_next = (void *) comp->el.next;
-
-      comp->status = -1;
-      fd = comp->notify_fd;
-      nbqueue_enq(comp->q, &comp->el);
-      if (fd != -1) {
-        ret = write(fd, &cnt, sizeof(cnt));
-        if (ret <= 0) {
-          perror("arp_packet: error writing to notify fd");
-        }
-      }
-    }
+    ae_notify(ae, -1);
 
     /* remove arp entry from cache */
-    if (ae->prev != NULL) {
-      ae->prev->next = ae->next;
-    } else {
-      arp_table = ae->next;
-    }
-    if (ae->next != NULL) {
-      ae->next->prev = ae->prev;
-    }
-
-    /* free entry */
-    free(ae);
+    ae_remove(ae);
     return;
   }
 
   /* send out another request */
-  if (request_tx(ae->ip) != 0) {
-    fprintf(stderr, "arp_timeout: sending out request failed\n");
-  }
+  ae_tx_enqueue(ae);
 
   /* rearm timeout */
   ae->timeout *= 2;
-  util_timeout_arm(&timeout_mgr, &ae->to, ae->timeout, TO_ARP_REQ);
+  ae_arm(ae, ae->timeout, TO_ARP_REQ);
 }
 
-static inline int response_tx(const void *dst_mac, uint32_t dst_ip)
+static inline int response_tx(const void *dst_mac, uint32_t dst_ip,
+    uint8_t port)
 {
+  const struct ether_addr *mac = network_port_mac(port);
   struct pkt_arp *parp_out;
   uint32_t new_tail;
 
@@ -277,8 +327,8 @@ static inline int response_tx(const void *dst_mac, uint32_t dst_ip)
   }
 
   /* fill in response */
-  memcpy(&parp_out->eth.src, &eth_addr, ETH_ADDR_LEN);
-  memcpy(&parp_out->arp.sha, &eth_addr, ETH_ADDR_LEN);
+  memcpy(&parp_out->eth.src, mac, ETH_ADDR_LEN);
+  memcpy(&parp_out->arp.sha, mac, ETH_ADDR_LEN);
   memcpy(&parp_out->eth.dest, dst_mac, ETH_ADDR_LEN);
   memcpy(&parp_out->arp.tha, dst_mac, ETH_ADDR_LEN);
   parp_out->arp.spa = t_beui32(config.ip);
@@ -292,13 +342,31 @@ static inline int response_tx(const void *dst_mac, uint32_t dst_ip)
   parp_out->arp.plen = 4;
   parp_out->arp.oper = t_beui16(ARP_OPER_REPLY);
 
-  nicif_tx_send(new_tail);
+  nicif_tx_send(new_tail, port);
 
   return 0;
 }
 
-static inline int request_tx(uint32_t dst_ip)
+/** Send request on port, or on all ports if port is -1 */
+static inline int request_tx(uint32_t dst_ip, int port)
 {
+  uint8_t i;
+  int ret = 0;
+
+  /* bonded ports are one link */
+  if (port >= 0 || config.fp_bond) {
+    return request_tx_port(dst_ip, (port >= 0 ? port : 0));
+  }
+
+  for (i = 0; i < net_ports_num; i++) {
+    ret |= request_tx_port(dst_ip, i);
+  }
+  return ret;
+}
+
+static inline int request_tx_port(uint32_t dst_ip, uint8_t port)
+{
+  const struct ether_addr *mac = network_port_mac(port);
   struct pkt_arp *parp_out;
   uint32_t new_tail;
   uint64_t dst_mac = 0xffffffffffffULL;
@@ -309,8 +377,8 @@ static inline int request_tx(uint32_t dst_ip)
   }
 
   /* fill in response */
-  memcpy(&parp_out->eth.src, &eth_addr, ETH_ADDR_LEN);
-  memcpy(&parp_out->arp.sha, &eth_addr, ETH_ADDR_LEN);
+  memcpy(&parp_out->eth.src, mac, ETH_ADDR_LEN);
+  memcpy(&parp_out->arp.sha, mac, ETH_ADDR_LEN);
   memcpy(&parp_out->eth.dest, &dst_mac, ETH_ADDR_LEN);
   memcpy(&parp_out->arp.tha, &dst_mac, ETH_ADDR_LEN);
   parp_out->arp.spa = t_beui32(config.ip);
@@ -324,19 +392,201 @@ static inline int request_tx(uint32_t dst_ip)
   parp_out->arp.plen = 4;
   parp_out->arp.oper = t_beui16(ARP_OPER_REQUEST);
 
-  nicif_tx_send(new_tail);
+  nicif_tx_send(new_tail, port);
 
   return 0;
 }
 
+static inline uint32_t ae_hash(uint32_t ip)
+{
+  return (ip * 0x9e3779b1U) >> 20;
+}
+
 static inline struct arp_entry *ae_lookup(uint32_t ip)
 {
   struct arp_entry *ae;
 
-  for (ae = arp_table; ae != NULL; ae = ae->next) {
+  for (ae = arp_table[ae_hash(ip)]; ae != NULL; ae = ae->ht_next) {
     if (ae->ip == ip) {
       return ae;
     }
   }
   return NULL;
 }
+
+/** Allocate entry for ip and insert it into the hash table */
+static inline struct arp_entry *ae_alloc(uint32_t ip)
+{
+  struct arp_entry *ae;
+  uint32_t h = ae_hash(ip);
+
+  if ((ae = calloc(1, sizeof(*ae))) == NULL) {
+    return NULL;
+  }
+
+  ae->ip = ip;
+  ae->ht_next = arp_table[h];
+  arp_table[h] = ae;
+  return ae;
+}
+
+/** Remove entry from the hash table and free it */
+static inline void ae_remove(struct arp_entry *ae)
+{
+  struct arp_entry **pae;
+
+  ae_disarm(ae);
+  ae_tx_dequeue(ae);
+
+  for (pae = &arp_table[ae_hash(ae->ip)]; *pae != ae; pae = &(*pae)->ht_next);
+  *pae = ae->ht_next;
+
+  free(ae);
+}
+
+static inline void ae_arm(struct arp_entry *ae, uint32_t us,
+    enum timeout_type type)
+{
+  util_timeout_arm(&timeout_mgr, &ae->to, us, type);
+  ae->armed = 1;
+}
+
+static inline void ae_disarm(struct arp_entry *ae)
+{
+  if (ae->armed) {
+    util_timeout_disarm(&timeout_mgr, &ae->to);
+    ae->armed = 0;
+  }
+}
+
+static inline void ae_tx_enqueue(struct arp_entry *ae)
+{
+  if (ae->tx_pending) {
+    return;
+  }
+
+  ae->tx_next = NULL;
+  ae->tx_prev = tx_last;
+  if (tx_last != NULL) {
+    tx_last->tx_next = ae;
+  } else {
+    tx_first = ae;
+  }
+  tx_last = ae;
+  ae->tx_pending = 1;
+}
+
+static inline void ae_tx_dequeue(struct arp_entry *ae)
+{
+  if (!ae->tx_pending) {
+    return;
+  }
+
+  if (ae->tx_prev != NULL) {
+    ae->tx_prev->tx_next = ae->tx_next;
+  } else {
+    tx_first = ae->tx_next;
+  }
+  if (ae->tx_next != NULL) {
+    ae->tx_next->tx_prev = ae->tx_prev;
+  } else {
+    tx_last = ae->tx_prev;
+  }
+  ae->tx_pending = 0;
+}
+
+/** Complete all requests waiting on entry */
+static inline void ae_notify(struct arp_entry *ae, int status)
+{
+  int fd;
+  ssize_t ret;
+  uint64_t cnt = 1;
+  struct nicif_completion *comp, *comp_next;
+
+  for (comp = ae->compl; comp != NULL; comp = comp_next) {
+    comp_next = (void *) comp->el.next;
+
+    if (status == 0) {
+      memcpy(comp->ptr, ae->mac, ETH_ADDR_LEN);
+    }
+    comp->status = status;
+    fd = comp->notify_fd;
+    nbqueue_enq(comp->q, &comp->el);
+    if (fd != -1) {
+      ret = write(fd, &cnt, sizeof(cnt));
+      if (ret <= 0) {
+        perror("arp: error writing to notify fd");
+      }
+    }
+  }
+  ae->compl = NULL;
+}
+
+/**
+ * Load static neighbor entries from file, one "IP MAC [PORT]" per line,
+ * '#' starts a comment.
+ */
+static int static_load(const char *path)
+{
+  FILE *f;
+  char line[256], ip_s[32], mac_s[32];
+  char *c;
+  unsigned lineno = 0, num = 0;
+  int n, port;
+  uint32_t ip;
+  uint64_t mac;
+  struct arp_entry *ae;
+
+  if ((f = fopen(path, "r")) == NULL) {
+    perror("arp static_load: opening neighbor file failed");
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    lineno++;
+    if ((c = strchr(line, '#')) != NULL) {
+      *c = 0;
+    }
+
+    port = 0;
+    n = sscanf(line, "%31s %31s %d", ip_s, mac_s, &port);
+    if (n <= 0) {
+      continue;
+    }
+
+    if (n < 2 || util_parse_ipv4(ip_s, &ip) != 0 ||
+        util_parse_mac(mac_s, &mac) != 0)
+    {
+      fprintf(stderr, "arp static_load: %s:%u: expected IP MAC [PORT]\n",
+          path, lineno);
+      goto failed;
+    }
+    if (port < 0 || port >= net_ports_num) {
+      fprintf(stderr, "arp static_load: %s:%u: invalid port %d\n", path,
+          lineno, port);
+      goto failed;
+    }
+    if (ae_lookup(ip) != NULL) {
+      fprintf(stderr, "arp static_load: %s:%u: duplicate entry for %s\n",
+          path, lineno, ip_s);
+      goto failed;
+    }
+
+    if ((ae = ae_alloc(ip)) == NULL) {
+      fprintf(stderr, "arp static_load: malloc failed\n");
+      goto failed;
+    }
+    ae->status = ARP_ST_STATIC;
+    ae->port = port;
+    memcpy(ae->mac, &mac, ETH_ADDR_LEN);
+    num++;
+  }
+
+  fclose(f);
+  printf("arp: loaded %u static neighbor entries\n", num);
+  return 0;
+
+failed:
+  fclose(f);
+  return -1;
+}
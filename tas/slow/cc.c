@@ -22,23 +22,61 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <utils.h>
+#include <utils_sync.h>
 
 #include <tas.h>
 #include "internal.h"
 
-#define CONF_MSS 1400
-
-int cc_init(void)
-{
-  return 0;
-}
+/** Max. time a cc thread sleeps when no connections are due [us] */
+#define CC_THREAD_SLEEP_MAX 1000
+/** Max. number of connections updated in one poll */
+#define CC_POLL_BATCH 64
+/** Upper bound for the control interval of a connection [us] */
+#define CC_INTERVAL_MAX 1000000
+/** Time without activity reports after which a connection is no longer
+ * scheduled, the fast path reports at most once per interval [us] */
+#define CC_IDLE_TIMEOUT (2 * FLEXNIC_PL_CC_ACTIVE_INTERVAL)
+/** Largest buffer autotuning picks, without window scaling the 16 bit window
+ * can not advertise more and the peer will not accept more in flight */
+#define CC_BUF_AUTOTUNE_MAX 65536
+
+STATIC_ASSERT(CONFIG_CC_NUM <= FLEXNIC_STATS_CC_NUM, stats_cc_num);
+
+/**
+ * Connections handled by one control loop. Without cc threads shard 0 is
+ * polled from the main slow path loop, otherwise every shard has a thread
+ * and the lock protects the deadlines and the cc state of its connections.
+ * Only congestion control is sharded, packet processing, connection setup
+ * and teardown stay on the main slow path thread.
+ */
+struct cc_shard {
+  volatile uint32_t lock;
+  /* next control loop run of scheduled connections */
+  struct timeout_manager timeouts;
+  /* connections found due in the current poll */
+  struct connection *due[CC_POLL_BATCH];
+  unsigned due_num;
+  uint32_t poll_ts;
+  pthread_t thread;
+} __attribute__((aligned(64)));
 
 static inline void issue_retransmits(struct connection *c,
     struct nicif_connection_stats *stats, uint32_t cur_ts);
+static inline void buf_autotune(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t rx_bytes,
+    uint32_t cur_ts);
+static void rxbuf_resize(struct connection *c);
+static void txbuf_resize(struct connection *c);
+static void buf_resize(struct connection *c);
 
 static inline void dctcp_win_init(struct connection *c);
 static inline void dctcp_win_update(struct connection *c,
@@ -56,59 +94,228 @@ static inline void const_rate_init(struct connection *c);
 static inline void const_rate_update(struct connection *c,
     struct nicif_connection_stats *stats, uint32_t diff_ts, uint32_t cur_ts);
 
-static inline uint32_t window_to_rate(uint32_t window, uint32_t rtt);
+static unsigned shard_poll(struct cc_shard *sh, uint32_t cur_ts,
+    unsigned *updated);
+static uint32_t shard_next_ts(struct cc_shard *sh, uint32_t cur_ts);
+static void shard_timeout(struct timeout *to, uint8_t type, void *opaque);
+static inline void conn_sched(struct cc_shard *sh, struct connection *c,
+    uint32_t cur_ts);
+static void *shard_thread(void *arg);
+static unsigned rexmit_drain(struct connection *skip);
+static unsigned resize_drain(struct connection *skip);
+
+static const struct cc_algorithm cc_dctcp_win = {
+  .name = "dctcp-win",
+  .init = dctcp_win_init,
+  .update = dctcp_win_update,
+};
+
+static const struct cc_algorithm cc_dctcp_rate = {
+  .name = "dctcp-rate",
+  .init = dctcp_rate_init,
+  .update = dctcp_rate_update,
+};
+
+static const struct cc_algorithm cc_timely = {
+  .name = "timely",
+  .init = timely_init,
+  .update = timely_update,
+};
+
+static const struct cc_algorithm cc_const_rate = {
+  .name = "const-rate",
+  .init = const_rate_init,
+  .update = const_rate_update,
+};
+
+const struct cc_algorithm *cc_algorithms[CONFIG_CC_NUM] = {
+  [CONFIG_CC_DCTCP_WIN] = &cc_dctcp_win,
+  [CONFIG_CC_DCTCP_RATE] = &cc_dctcp_rate,
+  [CONFIG_CC_TIMELY] = &cc_timely,
+  [CONFIG_CC_CONST_RATE] = &cc_const_rate,
+  [CONFIG_CC_BBR] = &cc_bbr,
+  [CONFIG_CC_SWIFT] = &cc_swift,
+};
+
+static struct cc_shard shards[CONFIG_CC_THREADS_MAX];
+static unsigned shards_num;
+/* connections by flow id, for activity reports from the fast path; only set
+ * once the connection is open */
+static struct connection **flow_conns;
+/* retransmits requested by cc threads, issued from the main thread since
+ * the kernel tx queues are single producer */
+static struct nbqueue rexmit_q;
+/* rx buffer resizes requested by cc threads, packet memory is only managed
+ * from the main thread */
+static struct nbqueue resize_q;
+
+int cc_init(void)
+{
+  unsigned i;
+  char name[17];
+
+  shards_num = (config.cc_threads > 0 ? config.cc_threads : 1);
+  nbqueue_init(&rexmit_q);
+  nbqueue_init(&resize_q);
+
+  if ((flow_conns = calloc(config.fp_flows, sizeof(*flow_conns))) == NULL) {
+    fprintf(stderr, "cc_init: calloc flow_conns failed\n");
+    return -1;
+  }
+
+  for (i = 0; i < shards_num; i++) {
+    if (util_timeout_init(&shards[i].timeouts, shard_timeout, &shards[i])) {
+      fprintf(stderr, "cc_init: util_timeout_init failed\n");
+      return -1;
+    }
+  }
+
+  for (i = 0; i < config.cc_threads; i++) {
+    if (pthread_create(&shards[i].thread, NULL, shard_thread, &shards[i])
+        != 0)
+    {
+      fprintf(stderr, "cc_init: pthread_create failed\n");
+      return -1;
+    }
+    snprintf(name, sizeof(name), "stcp-cc-%u", i);
+    pthread_setname_np(shards[i].thread, name);
+  }
 
-static uint32_t last_ts = 0;
-static struct connection *cc_conns = NULL;
-static struct connection *next_conn = NULL;
+  return 0;
+}
 
 uint32_t cc_next_ts(uint32_t cur_ts)
+{
+  /* cc threads wake the main thread up if they queue retransmits */
+  if (config.cc_threads > 0)
+    return -1U;
+
+  return shard_next_ts(&shards[0], cur_ts);
+}
+
+unsigned cc_poll(uint32_t cur_ts)
+{
+  unsigned updated;
+
+  if (config.cc_threads > 0)
+    return rexmit_drain(NULL) + resize_drain(NULL);
+
+  return shard_poll(&shards[0], cur_ts, &updated);
+}
+
+void cc_flows_active(const uint32_t *flow_ids, unsigned num)
 {
   struct connection *c;
-  assert(cur_ts >= last_ts);
-  uint32_t ts = -1U;
+  struct cc_shard *sh;
+  unsigned i;
 
-  for (c = cc_conns; c != NULL; c = c->cc_next) {
-    if (c->status != CONN_OPEN)
+  for (i = 0; i < num; i++) {
+    if (flow_ids[i] >= config.fp_flows ||
+        (c = flow_conns[flow_ids[i]]) == NULL)
+    {
       continue;
+    }
 
-    int32_t next_ts = (c->cc_rtt * config.cc_control_interval) - (cur_ts - c->cc_last_ts);
-    if(next_ts >= 0) {
-      ts = MIN(ts, next_ts);
-    } else {
-      ts = 0;
+    sh = &shards[c->cc_shard];
+    util_spin_lock(&sh->lock);
+    c->cc_active_ts = cur_ts;
+    if (c->cc_state == CC_CONN_IDLE) {
+      c->cc_state = CC_CONN_SCHED;
+      conn_sched(sh, c, cur_ts);
     }
+    util_spin_unlock(&sh->lock);
   }
+}
 
-  return (ts == -1U ? -1U : MAX(ts, config.cc_control_granularity - (cur_ts - last_ts)));
+static uint32_t shard_next_ts(struct cc_shard *sh, uint32_t cur_ts)
+{
+  return util_timeout_next(&sh->timeouts, cur_ts);
 }
 
-unsigned cc_poll(uint32_t cur_ts)
+/* control interval of connection */
+static inline uint32_t conn_interval(struct connection *c)
 {
-  struct connection *c, *c_first;
-  struct nicif_connection_stats stats;
-  uint32_t diff_ts;
-  uint32_t last;
-  unsigned n = 0;
+  uint32_t iv = c->cc_rtt * config.cc_control_interval;
+
+  iv = MAX(iv, config.cc_control_granularity);
+  return MIN(iv, CC_INTERVAL_MAX);
+}
 
-  diff_ts = cur_ts - last_ts;
-  if (0 && diff_ts < config.cc_control_granularity)
-    return 0;
+/* arm deadline for next control loop run, one interval after the last */
+static inline void conn_sched(struct cc_shard *sh, struct connection *c,
+    uint32_t cur_ts)
+{
+  uint32_t iv = conn_interval(c), elapsed = cur_ts - c->cc_last_ts;
+
+  util_timeout_arm_ts(&sh->timeouts, &c->cc_to,
+      (elapsed < iv ? iv - elapsed : 0), 0, cur_ts);
+}
+
+static void shard_timeout(struct timeout *to, uint8_t type, void *opaque)
+{
+  struct cc_shard *sh = opaque;
+  struct connection *c = (struct connection *)
+    ((uintptr_t) to - offsetof(struct connection, cc_to));
 
-  c = c_first = (next_conn != NULL ? next_conn : cc_conns);
-  if (c == NULL) {
-    last_ts = cur_ts;
-    return 0;
+  /* batch is full, leave it for the next poll */
+  if (sh->due_num >= CC_POLL_BATCH) {
+    util_timeout_arm_ts(&sh->timeouts, to, 0, 0, sh->poll_ts);
+    return;
   }
 
-  for (; n < 128 && (n == 0 || c != c_first);
-      c = (c->cc_next != NULL ? c->cc_next : cc_conns), n++)
-  {
-    if (c->status != CONN_OPEN)
-      continue;
+  sh->due[sh->due_num++] = c;
+}
+
+/* add per algorithm counters of one poll */
+static void cc_stats_add(struct flexnic_stats_cc *dst,
+    const struct flexnic_stats_cc *src)
+{
+  if (config.cc_threads > 0) {
+    __sync_fetch_and_add(&dst->updates, src->updates);
+    __sync_fetch_and_add(&dst->drops, src->drops);
+    __sync_fetch_and_add(&dst->ecn_bytes, src->ecn_bytes);
+    __sync_fetch_and_add(&dst->ack_bytes, src->ack_bytes);
+    __sync_fetch_and_add(&dst->fast_rto, src->fast_rto);
+  } else {
+    dst->updates += src->updates;
+    dst->drops += src->drops;
+    dst->ecn_bytes += src->ecn_bytes;
+    dst->ack_bytes += src->ack_bytes;
+    dst->fast_rto += src->fast_rto;
+  }
+}
 
-    if (cur_ts - c->cc_last_ts < c->cc_rtt * config.cc_control_interval)
+static unsigned shard_poll(struct cc_shard *sh, uint32_t cur_ts,
+    unsigned *updated)
+{
+  struct connection *c;
+  struct nicif_connection_stats stats;
+  uint32_t diff_ts;
+  uint32_t last, rx_bytes;
+  uint64_t drops = 0, ecnb = 0, ackb = 0, rtos = 0;
+  struct flexnic_stats_cc ccs[CONFIG_CC_NUM], *ccst;
+  unsigned i, n;
+
+  memset(ccs, 0, sizeof(ccs));
+
+  /* collect connections with expired deadlines */
+  sh->due_num = 0;
+  sh->poll_ts = cur_ts;
+  util_timeout_poll_ts(&sh->timeouts, cur_ts);
+  n = sh->due_num;
+
+  *updated = 0;
+  for (i = 0; i < n; i++) {
+    c = sh->due[i];
+
+    /* not registered with the fast path yet */
+    if (c->status != CONN_OPEN) {
+      c->cc_last_ts = cur_ts;
+      conn_sched(sh, c, cur_ts);
       continue;
+    }
+    if (flow_conns[c->flow_id] != c)
+      flow_conns[c->flow_id] = c;
 
     if (nicif_connection_stats(c->flow_id, &stats)) {
       fprintf(stderr, "cc_poll: nicif_connection_stats failed unexpectedly\n");
@@ -132,99 +339,201 @@ unsigned cc_poll(uint32_t cur_ts)
     c->cc_last_ecnb = stats.c_ecnb;
     stats.c_ecnb -= last;
 
-    kstats.drops += stats.c_drops;
-    kstats.ecn_marked += stats.c_ecnb;
-    kstats.acks += stats.c_ackb;
-
-    switch (config.cc_algorithm) {
-      case CONFIG_CC_DCTCP_WIN:
-        dctcp_win_update(c, &stats, diff_ts, cur_ts);
-        break;
+    last = c->cc_last_rtos;
+    c->cc_last_rtos = stats.c_rtos;
+    stats.c_rtos -= last;
+    rtos += stats.c_rtos;
 
-      case CONFIG_CC_DCTCP_RATE:
-        dctcp_rate_update(c, &stats, diff_ts, cur_ts);
-        break;
+    rx_bytes = stats.rx_seq - c->cc_last_rxseq;
+    c->cc_last_rxseq = stats.rx_seq;
 
-      case CONFIG_CC_TIMELY:
-        timely_update(c, &stats, diff_ts, cur_ts);
-        break;
+    drops += stats.c_drops;
+    ecnb += stats.c_ecnb;
+    ackb += stats.c_ackb;
 
-      case CONFIG_CC_CONST_RATE:
-        const_rate_update(c, &stats, diff_ts, cur_ts);
-        break;
+    ccst = &ccs[c->cc_alg];
+    ccst->updates++;
+    ccst->drops += stats.c_drops;
+    ccst->ecn_bytes += stats.c_ecnb;
+    ccst->ack_bytes += stats.c_ackb;
+    ccst->fast_rto += stats.c_rtos;
 
-      default:
-        fprintf(stderr, "cc_poll: unknown CC algorithm (%u)\n",
-            config.cc_algorithm);
-        abort();
-        break;
-    }
+    diff_ts = cur_ts - c->cc_last_ts;
+    cc_algorithms[c->cc_alg]->update(c, &stats, diff_ts, cur_ts);
 
     issue_retransmits(c, &stats, cur_ts);
     nicif_connection_setrate(c->flow_id, c->cc_rate);
+    buf_autotune(c, &stats, rx_bytes, cur_ts);
 
     c->cc_last_ts = cur_ts;
+    (*updated)++;
+
+    /* stop scheduling connections with nothing in flight and no recent
+     * activity, the fast path reports it once there is some */
+    if (stats.c_acks == 0 && stats.c_drops == 0 && !stats.txp &&
+        rx_bytes == 0 && cur_ts - c->cc_active_ts >= CC_IDLE_TIMEOUT)
+    {
+      c->cc_state = CC_CONN_IDLE;
+    } else {
+      conn_sched(sh, c, cur_ts);
+    }
+  }
+
+  if (config.cc_threads > 0) {
+    __sync_fetch_and_add(&kstats->drops, drops);
+    __sync_fetch_and_add(&kstats->ecn_marked, ecnb);
+    __sync_fetch_and_add(&kstats->acks, ackb);
+    __sync_fetch_and_add(&kstats->fast_rto, rtos);
+  } else {
+    kstats->drops += drops;
+    kstats->ecn_marked += ecnb;
+    kstats->acks += ackb;
+    kstats->fast_rto += rtos;
+  }
 
+  for (i = 0; i < CONFIG_CC_NUM; i++) {
+    if (ccs[i].updates != 0)
+      cc_stats_add(&kstats->cc[i], &ccs[i]);
   }
 
-  next_conn = c;
-  last_ts = cur_ts;
   return n;
 }
 
-void cc_conn_init(struct connection *conn)
+static void *shard_thread(void *arg)
 {
-  conn->cc_next = cc_conns;
-  cc_conns = conn;
+  struct cc_shard *sh = arg;
+  uint32_t ts, next;
+  unsigned updated;
 
-  conn->cc_last_ts = cur_ts;
-  conn->cc_rtt = config.tcp_rtt_init;
-  conn->cc_rexmits = 0;
+  while (1) {
+    ts = util_timeout_time_us();
+
+    util_spin_lock(&sh->lock);
+    shard_poll(sh, ts, &updated);
+    next = (updated == 0 ? shard_next_ts(sh, ts) : 0);
+    util_spin_unlock(&sh->lock);
 
-  switch (config.cc_algorithm) {
-    case CONFIG_CC_DCTCP_WIN:
-      dctcp_win_init(conn);
-      break;
+    if (next > 0) {
+      usleep(MIN(next, CC_THREAD_SLEEP_MAX));
+    }
+  }
 
-    case CONFIG_CC_DCTCP_RATE:
-      dctcp_rate_init(conn);
-      break;
+  return NULL;
+}
 
-    case CONFIG_CC_TIMELY:
-      timely_init(conn);
-      break;
+/* issue retransmits queued by cc threads, except for connection skip */
+static unsigned rexmit_drain(struct connection *skip)
+{
+  struct nbqueue_el *el;
+  struct connection *c;
+  unsigned n = 0;
 
-    case CONFIG_CC_CONST_RATE:
-      const_rate_init(conn);
-      break;
+  while ((el = nbqueue_deq(&rexmit_q)) != NULL) {
+    c = (struct connection *)
+      ((uintptr_t) el - offsetof(struct connection, cc_rexmit_el));
+    c->cc_rexmit_queued = 0;
+    n++;
 
-    default:
-      fprintf(stderr, "cc_conn_init: unknown CC algorithm (%u)\n",
-          config.cc_algorithm);
-      abort();
-      break;
+    if (c == skip || c->status != CONN_OPEN)
+      continue;
+
+    if (nicif_connection_retransmit(c->flow_id, c->flow_group) == 0) {
+      kstats->kernel_rexmit++;
+    }
+  }
+
+  return n;
+}
+
+/* resize buffers requested by cc threads, except for connection skip */
+static unsigned resize_drain(struct connection *skip)
+{
+  struct nbqueue_el *el;
+  struct connection *c;
+  unsigned n = 0;
+
+  while ((el = nbqueue_deq(&resize_q)) != NULL) {
+    c = (struct connection *)
+      ((uintptr_t) el - offsetof(struct connection, cc_resize_el));
+    c->cc_resize_queued = 0;
+    n++;
+
+    if (c == skip || c->status != CONN_OPEN)
+      continue;
+
+    buf_resize(c);
+  }
+
+  return n;
+}
+
+void cc_conn_init(struct connection *conn)
+{
+  /* connections are sharded by flow group, the NIC's RSS hash bucket */
+  struct cc_shard *sh = &shards[conn->flow_group % shards_num];
+
+  conn->cc_shard = sh - shards;
+  conn->cc_active_ts = cur_ts;
+  conn->cc_rexmit_queued = 0;
+  conn->cc_resize_queued = 0;
+  conn->cc_last_rxseq = conn->remote_seq;
+  conn->cc_rx_target = 0;
+  conn->cc_tx_target = 0;
+  conn->cc_last_ts = cur_ts;
+  conn->cc_rtt = config.tcp_rtt_init;
+  conn->cc_rexmits = 0;
+  conn->cc_last_rtos = 0;
+
+  if (conn->cc_alg >= CONFIG_CC_NUM) {
+    fprintf(stderr, "cc_conn_init: unknown CC algorithm (%u)\n",
+        conn->cc_alg);
+    abort();
   }
+  cc_algorithms[conn->cc_alg]->init(conn);
+  __sync_fetch_and_add(&kstats->cc[conn->cc_alg].conns, 1);
+
+  util_spin_lock(&sh->lock);
+  conn->cc_state = CC_CONN_SCHED;
+  conn_sched(sh, conn, cur_ts);
+  util_spin_unlock(&sh->lock);
 }
 
 void cc_conn_remove(struct connection *conn)
 {
-  struct connection *cp = NULL;
+  struct cc_shard *sh = &shards[conn->cc_shard];
+
+  if (conn->cc_state == CC_CONN_NONE)
+    return;
+  __sync_fetch_and_sub(&kstats->cc[conn->cc_alg].conns, 1);
 
-  if (next_conn == conn) {
-    next_conn = conn->cc_next;
+  util_spin_lock(&sh->lock);
+  if (conn->cc_state == CC_CONN_SCHED) {
+    util_timeout_disarm(&sh->timeouts, &conn->cc_to);
   }
+  conn->cc_state = CC_CONN_NONE;
+  if (conn->flow_id < config.fp_flows && flow_conns[conn->flow_id] == conn) {
+    flow_conns[conn->flow_id] = NULL;
+  }
+  util_spin_unlock(&sh->lock);
 
-  if (cc_conns == conn) {
-    cc_conns = conn->cc_next;
-  } else {
-    for (cp = cc_conns; cp != NULL && cp->cc_next != conn;
-        cp = cp->cc_next);
-    if (cp == NULL) {
-      fprintf(stderr, "conn_unregister: connection not found\n");
-      abort();
-    }
+  /* the shard is done with conn now, but a retransmit might still be queued
+   * for it */
+  if (conn->cc_rexmit_queued) {
+    rexmit_drain(conn);
+  }
+  if (conn->cc_resize_queued) {
+    resize_drain(conn);
+  }
+}
+
+/* retransmit issued for connection, picked up by the next update */
+static inline void conn_loss(struct connection *c, uint32_t cur_ts)
+{
+  const struct cc_algorithm *alg = cc_algorithms[c->cc_alg];
 
-    cp->cc_next = conn->cc_next;
+  c->cc_rexmits++;
+  if (alg->on_loss != NULL) {
+    alg->on_loss(c, cur_ts);
   }
 }
 
@@ -232,6 +541,15 @@ static inline void issue_retransmits(struct connection *c,
     struct nicif_connection_stats *stats, uint32_t cur_ts)
 {
   uint32_t rtt = (stats->rtt != 0 ? stats->rtt : config.tcp_rtt_init);
+  uint64_t val = 1;
+
+  /* the fast path runs retransmission timers, only account for them */
+  if (config.fp_rto_min != 0) {
+    if (stats->c_rtos > 0) {
+      conn_loss(c, cur_ts);
+    }
+    return;
+  }
 
   /* check for re-transmits */
   if (stats->txp && stats->c_ackb == 0) {
@@ -240,10 +558,22 @@ static inline void issue_retransmits(struct connection *c,
     } else if (c->cnt_tx_pending >= config.cc_rexmit_ints &&
         (cur_ts - c->ts_tx_pending) >= 2 * rtt)
     {
-      if (nicif_connection_retransmit(c->flow_id, c->flow_group) == 0) {
+      if (config.cc_threads > 0) {
+        /* hand retransmit to main thread and wake it up */
+        if (!c->cc_rexmit_queued) {
+          c->cc_rexmit_queued = 1;
+          nbqueue_enq(&rexmit_q, &c->cc_rexmit_el);
+          if (write(kernel_notifyfd, &val, sizeof(val)) != sizeof(val)) {
+            fprintf(stderr, "issue_retransmits: waking up main thread "
+                "failed\n");
+          }
+        }
+        c->cnt_tx_pending = 0;
+        conn_loss(c, cur_ts);
+      } else if (nicif_connection_retransmit(c->flow_id, c->flow_group) == 0) {
         c->cnt_tx_pending = 0;
-        kstats.kernel_rexmit++;
-        c->cc_rexmits++;
+        kstats->kernel_rexmit++;
+        conn_loss(c, cur_ts);
       }
     }
   } else {
@@ -251,6 +581,156 @@ static inline void issue_retransmits(struct connection *c,
   }
 }
 
+/* smallest power of two buffer of at least 4KB that holds `need` bytes, at
+ * most `max` (or CC_BUF_AUTOTUNE_MAX) */
+static inline uint32_t buf_autotune_target(uint64_t need, uint64_t max)
+{
+  uint32_t target;
+
+  max = MIN(max, CC_BUF_AUTOTUNE_MAX);
+  for (target = 4096; target < need && target * 2 <= max; target *= 2);
+  return MIN(target, max);
+}
+
+/* buffers only shrink once they are 4x larger than needed to avoid flapping */
+static inline int buf_autotune_keep(uint32_t target, uint32_t len)
+{
+  return target == len || (target < len && target * 4 > len);
+}
+
+/* size the rx buffer for twice the bytes received per rtt, so the advertised
+ * window does not limit the sender, and the tx buffer for twice the bytes
+ * acknowledged per rtt, so the app can keep the window full. */
+static inline void buf_autotune(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t rx_bytes, uint32_t cur_ts)
+{
+  uint32_t rtt = (stats->rtt != 0 ? stats->rtt : config.tcp_rtt_init);
+  uint32_t diff_ts = cur_ts - c->cc_last_ts;
+  uint32_t target;
+  int resize = 0;
+
+  if (diff_ts == 0 || (c->flags & NICIF_CONN_OBJCONN) != 0)
+    return;
+
+  if (config.tcp_rxbuf_max != 0) {
+    target = buf_autotune_target(2 * (uint64_t) rx_bytes * rtt / diff_ts,
+        config.tcp_rxbuf_max);
+    if (!buf_autotune_keep(target, c->rx_len)) {
+      c->cc_rx_target = target;
+      resize = 1;
+    }
+  }
+
+  if (config.tcp_txbuf_max != 0) {
+    target = buf_autotune_target(
+        2 * (uint64_t) stats->c_ackb * rtt / diff_ts, config.tcp_txbuf_max);
+    if (!buf_autotune_keep(target, c->tx_len)) {
+      c->cc_tx_target = target;
+      resize = 1;
+    }
+    /* check whether the app switched to the offered buffer */
+    if (c->tx_offer_handle != NULL)
+      resize = 1;
+  }
+
+  if (!resize)
+    return;
+
+  if (config.cc_threads > 0) {
+    /* hand resize to main thread, no need to wake it up for this */
+    if (!c->cc_resize_queued) {
+      c->cc_resize_queued = 1;
+      nbqueue_enq(&resize_q, &c->cc_resize_el);
+    }
+  } else {
+    buf_resize(c);
+  }
+}
+
+/* try to move connection to an rx buffer of size cc_rx_target, this only
+ * succeeds if the app has consumed all data in the current one */
+static void rxbuf_resize(struct connection *c)
+{
+  struct packetmem_handle *handle;
+  uintptr_t off;
+  int ret;
+
+  if (c->cc_rx_target == 0 || c->cc_rx_target == c->rx_len)
+    return;
+
+  if (packetmem_alloc_node(c->cc_rx_target, flexnic_db_node(c->db_id), &off,
+        &handle) != 0)
+  {
+    return;
+  }
+
+  ret = nicif_connection_resize(c->flow_id, c->flow_group, off,
+      c->cc_rx_target);
+  if (ret != 0) {
+    /* still in use, try again after the next control interval */
+    packetmem_free(handle);
+    return;
+  }
+
+  packetmem_free(c->rx_handle);
+  c->rx_handle = handle;
+  c->rx_buf = (uint8_t *) tas_shm + off;
+  c->rx_len = c->cc_rx_target;
+  kstats->rxbuf_resizes++;
+}
+
+/* offer the app a tx buffer of size cc_tx_target, the app switches to it once
+ * everything it sent from the old one was acknowledged. One offer is pending
+ * at most, the old buffer is freed once the fast path uses the new one. */
+static void txbuf_resize(struct connection *c)
+{
+  struct nicif_connection_stats stats;
+  struct packetmem_handle *handle;
+  uintptr_t off;
+
+  if (c->tx_offer_handle != NULL) {
+    if (nicif_connection_stats(c->flow_id, &stats) != 0 ||
+        stats.tx_base != c->tx_offer_off)
+    {
+      return;
+    }
+
+    packetmem_free(c->tx_handle);
+    c->tx_handle = c->tx_offer_handle;
+    c->tx_buf = (uint8_t *) tas_shm + c->tx_offer_off;
+    c->tx_len = c->tx_offer_len;
+    c->tx_offer_handle = NULL;
+    kstats->txbuf_resizes++;
+    return;
+  }
+
+  if (c->cc_tx_target == 0 || c->cc_tx_target == c->tx_len)
+    return;
+
+  if (packetmem_alloc_node(c->cc_tx_target, flexnic_db_node(c->db_id), &off,
+        &handle) != 0)
+  {
+    return;
+  }
+
+  if (nicif_connection_txoffer(c->flow_id, c->flow_group, off,
+        c->cc_tx_target) != 0)
+  {
+    packetmem_free(handle);
+    return;
+  }
+
+  c->tx_offer_handle = handle;
+  c->tx_offer_off = off;
+  c->tx_offer_len = c->cc_tx_target;
+}
+
+static void buf_resize(struct connection *c)
+{
+  rxbuf_resize(c);
+  txbuf_resize(c);
+}
+
 /******************************************************************************/
 /* Window-based DCTCP */
 
@@ -258,8 +738,8 @@ static inline void dctcp_win_init(struct connection *c)
 {
   struct connection_cc_dctcp_win *cc = &c->cc.dctcp_win;
 
-  cc->window = 2 * CONF_MSS;
-  c->cc_rate = window_to_rate(cc->window, config.tcp_rtt_init);
+  cc->window = 2 * CC_MSS;
+  c->cc_rate = cc_window_to_rate(cc->window, config.tcp_rtt_init);
   cc->ecn_rate = 0;
   cc->slowstart = 1;
 }
@@ -271,7 +751,7 @@ static inline void dctcp_win_update(struct connection *c,
   uint64_t ecn_rate, incr;
   uint32_t rtt = stats->rtt, win = cc->window;
 
-  assert(win >= CONF_MSS);
+  assert(win >= CC_MSS);
 
   /* If RTT is zero, use estimate */
   if (rtt == 0) {
@@ -316,7 +796,7 @@ static inline void dctcp_win_update(struct connection *c,
       } else {
         /* additive increase */
         assert(win != 0);
-        incr = ((uint64_t) stats->c_ackb * CONF_MSS) / win;
+        incr = ((uint64_t) stats->c_ackb * CC_MSS) / win;
         if ((uint32_t) (win + incr) > win)
           win += incr;
       }
@@ -324,22 +804,22 @@ static inline void dctcp_win_update(struct connection *c,
   }
 
   /* Ensure window is at least 1 mss */
-  if (win < CONF_MSS)
-    win = CONF_MSS;
+  if (win < CC_MSS)
+    win = CC_MSS;
 
   /* A window larger than the send buffer also does not make much sense */
   if (win > c->tx_len)
     win = c->tx_len;
 
   c->cc_rtt = rtt;
-  c->cc_rate = window_to_rate(win, rtt);
-  assert(win >= CONF_MSS);
+  c->cc_rate = cc_window_to_rate(win, rtt);
+  assert(win >= CC_MSS);
   cc->window = win;
   c->cc_rexmits = 0;
 }
 
 /** Convert window in bytes to kbps */
-static inline uint32_t window_to_rate(uint32_t window, uint32_t rtt)
+uint32_t cc_window_to_rate(uint32_t window, uint32_t rtt)
 {
   uint64_t time, rate;
 
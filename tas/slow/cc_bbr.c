@@ -0,0 +1,241 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <utils.h>
+
+#include <tas.h>
+#include "internal.h"
+
+/*
+ * BBR-style congestion control: the rate is paced at a gain around the
+ * estimated bottleneck bandwidth (max. delivery rate over the last rounds),
+ * with periodic probing for more bandwidth and for a lower min. rtt. The fast
+ * path has no congestion window, so in-flight data is only bounded by the
+ * pacing rate.
+ */
+
+/** Gains are fixed point with 8 fractional bits */
+#define BBR_UNIT 256
+/** Startup gain, 2/ln(2) */
+#define BBR_STARTUP_GAIN 739
+/** Drain gain, inverse of startup gain */
+#define BBR_DRAIN_GAIN 88
+/** Number of phases in PROBE_BW gain cycle */
+#define BBR_CYCLE_LEN 8
+/** Startup ends after this many rounds with less than 25% bw growth */
+#define BBR_FULL_BW_ROUNDS 3
+/** Min. rtt estimate expires after this time [us] */
+#define BBR_MIN_RTT_WIN 10000000
+/** Time spent in PROBE_RTT [us] */
+#define BBR_PROBE_RTT_TIME 200000
+/** Min. in-flight data per rtt [segments] */
+#define BBR_MIN_SEGS 4
+/** Initial in-flight data per rtt [segments] */
+#define BBR_INIT_SEGS 10
+
+static const uint16_t cycle_gain[BBR_CYCLE_LEN] = {
+  BBR_UNIT * 5 / 4, BBR_UNIT * 3 / 4, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+  BBR_UNIT, BBR_UNIT,
+};
+
+static void bbr_init(struct connection *c);
+static void bbr_update(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t diff_ts, uint32_t cur_ts);
+static void bbr_on_loss(struct connection *c, uint32_t cur_ts);
+
+const struct cc_algorithm cc_bbr = {
+  .name = "bbr",
+  .init = bbr_init,
+  .update = bbr_update,
+  .on_loss = bbr_on_loss,
+};
+
+static void bbr_init(struct connection *c)
+{
+  struct connection_cc_bbr *cc = &c->cc.bbr;
+  unsigned i;
+
+  for (i = 0; i < CC_BBR_BW_ROUNDS; i++) {
+    cc->bw_samples[i] = 0;
+  }
+  cc->btl_bw = cc->full_bw = 0;
+  cc->min_rtt = config.tcp_rtt_init;
+  cc->min_rtt_ts = cc->round_ts = cc->mode_ts = cur_ts;
+  cc->round = 0;
+  cc->full_bw_cnt = 0;
+  cc->mode = cc->prev_mode = CC_BBR_STARTUP;
+  cc->cycle_idx = 0;
+
+  c->cc_rate = cc_window_to_rate(BBR_INIT_SEGS * CC_MSS, config.tcp_rtt_init);
+}
+
+/* recompute bottleneck bandwidth from samples */
+static inline void bbr_bw_max(struct connection_cc_bbr *cc)
+{
+  uint32_t bw = 0;
+  unsigned i;
+
+  for (i = 0; i < CC_BBR_BW_ROUNDS; i++) {
+    bw = MAX(bw, cc->bw_samples[i]);
+  }
+  cc->btl_bw = bw;
+}
+
+/* startup is done once the bandwidth estimate stops growing */
+static inline void bbr_check_full_bw(struct connection_cc_bbr *cc,
+    int congested, uint32_t cur_ts)
+{
+  if (cc->btl_bw >= (uint64_t) cc->full_bw * 5 / 4 && !congested) {
+    cc->full_bw = cc->btl_bw;
+    cc->full_bw_cnt = 0;
+    return;
+  }
+
+  if (++cc->full_bw_cnt >= BBR_FULL_BW_ROUNDS || congested) {
+    cc->mode = CC_BBR_DRAIN;
+    cc->mode_ts = cur_ts;
+  }
+}
+
+static void bbr_update(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t diff_ts, uint32_t cur_ts)
+{
+  struct connection_cc_bbr *cc = &c->cc.bbr;
+  uint32_t rtt = stats->rtt, bw, gain, min_rate;
+  uint64_t rate;
+  int new_round, congested;
+
+  /* If RTT is zero, use estimate */
+  if (rtt == 0) {
+    rtt = config.tcp_rtt_init;
+  }
+  c->cc_rtt = rtt;
+
+  /* drops and ECN marks only end startup early */
+  congested = stats->c_drops > 0 || stats->c_ecnb > 0 || c->cc_rexmits > 0;
+  c->cc_rexmits = 0;
+
+  /* min. rtt filter, expiry triggers PROBE_RTT */
+  if (rtt <= cc->min_rtt) {
+    cc->min_rtt = rtt;
+    cc->min_rtt_ts = cur_ts;
+  } else if (cur_ts - cc->min_rtt_ts > BBR_MIN_RTT_WIN &&
+      cc->mode != CC_BBR_PROBE_RTT)
+  {
+    cc->prev_mode = cc->mode;
+    cc->mode = CC_BBR_PROBE_RTT;
+    cc->mode_ts = cur_ts;
+    cc->min_rtt = rtt;
+  }
+
+  /* a new round starts every min. rtt */
+  new_round = (cur_ts - cc->round_ts >= cc->min_rtt);
+  if (new_round) {
+    cc->round++;
+    cc->round_ts = cur_ts;
+    cc->bw_samples[cc->round % CC_BBR_BW_ROUNDS] = 0;
+  }
+
+  /* delivery rate sample, samples while the tx buffer ran empty are
+   * application limited and can only raise the estimate */
+  if (diff_ts > 0 && stats->c_ackb > 0) {
+    bw = MIN((uint64_t) stats->c_ackb * 8 * 1000 / diff_ts, UINT32_MAX);
+    if (stats->txp || bw > cc->btl_bw) {
+      cc->bw_samples[cc->round % CC_BBR_BW_ROUNDS] =
+        MAX(cc->bw_samples[cc->round % CC_BBR_BW_ROUNDS], bw);
+    }
+  }
+  bbr_bw_max(cc);
+
+  switch (cc->mode) {
+    case CC_BBR_STARTUP:
+      if (new_round && cc->btl_bw > 0) {
+        bbr_check_full_bw(cc, congested, cur_ts);
+      }
+      break;
+
+    case CC_BBR_DRAIN:
+      if (rtt <= (uint64_t) cc->min_rtt * 5 / 4) {
+        cc->mode = CC_BBR_PROBE_BW;
+        cc->mode_ts = cur_ts;
+        /* start after the drain phase of the gain cycle */
+        cc->cycle_idx = 2;
+      }
+      break;
+
+    case CC_BBR_PROBE_BW:
+      if (cur_ts - cc->mode_ts >= cc->min_rtt) {
+        cc->cycle_idx = (cc->cycle_idx + 1) % BBR_CYCLE_LEN;
+        cc->mode_ts = cur_ts;
+      }
+      break;
+
+    case CC_BBR_PROBE_RTT:
+      if (cur_ts - cc->mode_ts >= BBR_PROBE_RTT_TIME) {
+        cc->min_rtt_ts = cur_ts;
+        cc->mode = (cc->prev_mode == CC_BBR_STARTUP ? CC_BBR_STARTUP :
+            CC_BBR_PROBE_BW);
+        cc->mode_ts = cur_ts;
+      }
+      break;
+  }
+
+  /* no delivery rate samples yet, keep initial rate */
+  if (cc->btl_bw == 0)
+    return;
+
+  switch (cc->mode) {
+    case CC_BBR_STARTUP:
+      gain = BBR_STARTUP_GAIN;
+      break;
+    case CC_BBR_DRAIN:
+      gain = BBR_DRAIN_GAIN;
+      break;
+    case CC_BBR_PROBE_RTT:
+      gain = BBR_UNIT / 2;
+      break;
+    default:
+      gain = cycle_gain[cc->cycle_idx];
+      break;
+  }
+
+  rate = (uint64_t) cc->btl_bw * gain / BBR_UNIT;
+  min_rate = cc_window_to_rate(BBR_MIN_SEGS * CC_MSS, cc->min_rtt);
+  rate = MAX(rate, min_rate);
+  c->cc_rate = MIN(rate, UINT32_MAX);
+}
+
+/* the control loop only retransmits after a stall, do not trust the old
+ * bandwidth samples as much anymore */
+static void bbr_on_loss(struct connection *c, uint32_t cur_ts)
+{
+  struct connection_cc_bbr *cc = &c->cc.bbr;
+  unsigned i;
+
+  for (i = 0; i < CC_BBR_BW_ROUNDS; i++) {
+    cc->bw_samples[i] /= 2;
+  }
+  bbr_bw_max(cc);
+}
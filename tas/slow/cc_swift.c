@@ -0,0 +1,135 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <utils.h>
+
+#include <tas.h>
+#include "internal.h"
+
+/*
+ * Swift-style delay-based congestion control: the window grows additively
+ * while the rtt stays below the target delay and is reduced proportionally to
+ * the excess delay otherwise, at most once per rtt. ECN marks are used as
+ * an additional congestion signal like in DCTCP.
+ */
+
+/** EWMA weight for the fraction of ECN marked bytes, as a shift */
+#define SWIFT_ECN_SHIFT 4
+
+static void swift_init(struct connection *c);
+static void swift_update(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t diff_ts, uint32_t cur_ts);
+
+const struct cc_algorithm cc_swift = {
+  .name = "swift",
+  .init = swift_init,
+  .update = swift_update,
+};
+
+static void swift_init(struct connection *c)
+{
+  struct connection_cc_swift *cc = &c->cc.swift;
+
+  cc->window = 2 * CC_MSS;
+  cc->ecn_rate = 0;
+  cc->last_decrease_ts = cur_ts;
+  cc->slowstart = 1;
+  c->cc_rate = cc_window_to_rate(cc->window, config.tcp_rtt_init);
+}
+
+static void swift_update(struct connection *c,
+    struct nicif_connection_stats *stats, uint32_t diff_ts, uint32_t cur_ts)
+{
+  struct connection_cc_swift *cc = &c->cc.swift;
+  uint32_t rtt = stats->rtt, win = cc->window, target = config.cc_swift_target;
+  uint32_t ecnb, mdf, incr;
+  uint64_t frac;
+  int can_decrease;
+
+  /* If RTT is zero, use estimate */
+  if (rtt == 0) {
+    rtt = config.tcp_rtt_init;
+  }
+
+  /* update fraction of ECN marked bytes */
+  if (stats->c_ackb > 0) {
+    ecnb = MIN(stats->c_ecnb, stats->c_ackb);
+    frac = ((uint64_t) ecnb * UINT32_MAX) / stats->c_ackb;
+    cc->ecn_rate -= cc->ecn_rate >> SWIFT_ECN_SHIFT;
+    cc->ecn_rate += frac >> SWIFT_ECN_SHIFT;
+  }
+
+  can_decrease = (cur_ts - cc->last_decrease_ts >= rtt);
+
+  if (stats->c_drops > 0 || c->cc_rexmits > 0) {
+    /* losses: max. decrease */
+    cc->slowstart = 0;
+    if (can_decrease) {
+      win = ((uint64_t) win * (UINT32_MAX - config.cc_swift_max_mdf)) /
+          UINT32_MAX;
+      cc->last_decrease_ts = cur_ts;
+    }
+  } else if (rtt < target && stats->c_ecnb == 0) {
+    /* below target: increase */
+    if (cc->slowstart) {
+      if (win + stats->c_ackb > win)
+        win += stats->c_ackb;
+    } else {
+      incr = ((uint64_t) stats->c_ackb * config.cc_swift_ai) / win;
+      if (win + incr > win)
+        win += incr;
+    }
+  } else {
+    cc->slowstart = 0;
+    if (can_decrease) {
+      /* mdf = max(beta * (rtt - target) / rtt, ecn_rate / 2), capped by
+       * max_mdf */
+      mdf = 0;
+      if (rtt > target) {
+        mdf = ((uint64_t) config.cc_swift_beta * (rtt - target)) / rtt;
+      }
+      if (stats->c_ecnb > 0) {
+        mdf = MAX(mdf, cc->ecn_rate / 2);
+      }
+      mdf = MIN(mdf, config.cc_swift_max_mdf);
+
+      win = ((uint64_t) win * (UINT32_MAX - mdf)) / UINT32_MAX;
+      cc->last_decrease_ts = cur_ts;
+    }
+  }
+
+  /* Ensure window is at least 1 mss */
+  if (win < CC_MSS)
+    win = CC_MSS;
+
+  /* A window larger than the send buffer also does not make much sense */
+  if (win > c->tx_len)
+    win = c->tx_len;
+
+  cc->window = win;
+  c->cc_rtt = rtt;
+  c->cc_rate = cc_window_to_rate(win, rtt);
+  c->cc_rexmits = 0;
+}
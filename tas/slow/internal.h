@@ -35,15 +35,16 @@
 
 #include <tas_memif.h>
 
+struct app_context;
 struct config_route;
 struct connection;
-struct kernel_statistics;
 struct listener;
 struct timeout;
 enum timeout_type;
 
 extern struct timeout_manager timeout_mgr;
-extern struct kernel_statistics kstats;
+/** Slow path counters, in the shared stats region */
+extern struct flexnic_stats_kernel *kstats;
 extern uint32_t cur_ts;
 extern int kernel_notifyfd;
 
@@ -55,21 +56,12 @@ struct nicif_completion {
   void *ptr;
 };
 
-struct kernel_statistics {
-  /** drops detected by flextcp on NIC */
-  uint64_t drops;
-  /** kernel re-transmission timeouts */
-  uint64_t kernel_rexmit;
-  /** # of ECN marked ACKs */
-  uint64_t ecn_marked;
-  /** total number of ACKs */
-  uint64_t acks;
-};
-
 /** Type of timeout */
 enum timeout_type {
   /** ARP request */
   TO_ARP_REQ,
+  /** ARP entry refresh or expiry */
+  TO_ARP_AGE,
   /** TCP handshake sent */
   TO_TCP_HANDSHAKE,
   /** TCP retransmission timeout */
@@ -107,6 +99,70 @@ unsigned nicif_poll(void);
 int nicif_appctx_add(uint16_t appid, uint32_t db, uint64_t *rxq_base,
     uint32_t rxq_len, uint64_t *txq_base, uint32_t txq_len, int evfd);
 
+/**
+ * Set transmit weight and rate cap for application context.
+ *
+ * @param db       Doorbell ID
+ * @param weight   Relative share for flows without rate limit
+ * @param rate     Rate cap for all flows in context [kbps], 0 for none
+ */
+void nicif_appctx_qos(uint32_t db, uint16_t weight, uint32_t rate);
+
+/**
+ * Set notification moderation for application context on all cores.
+ *
+ * @param db       Doorbell ID
+ * @param delay    Max. delay of notifications [us], 0 to disable
+ * @param count    Notify once this many entries are pending, 0 for no limit
+ */
+void nicif_appctx_notify(uint32_t db, uint32_t delay, uint16_t count);
+
+/**
+ * Point object steering buckets of an application at a context. The first
+ * call switches the application from hash modulo contexts to its steering
+ * table, with all other buckets spread over its contexts.
+ *
+ * @param appid    Application ID
+ * @param first    First bucket
+ * @param last     Last bucket (inclusive)
+ * @param db       Doorbell ID of context
+ */
+void nicif_appst_steer(uint16_t appid, uint16_t first, uint16_t last,
+    uint32_t db);
+
+/**
+ * Switch application back to hash modulo contexts for object steering.
+ *
+ * @param appid    Application ID
+ */
+void nicif_appst_steer_off(uint16_t appid);
+
+/**
+ * Switch the eventfd the fast path uses to ping application context on all
+ * cores, for contexts reattached after a fast restart.
+ *
+ * @param db       Doorbell ID
+ * @param evfd     Event FD used to ping app
+ */
+void nicif_appctx_evfd(uint32_t db, int evfd);
+
+/**
+ * Mark flow id as used by a flow taken over from a previous instance.
+ *
+ * @param f_id ID of flow
+ *
+ * @return 0 on success, <0 if the id is invalid or already in use
+ */
+int nicif_flow_reserve(uint32_t f_id);
+
+/**
+ * Remove flow of a previous instance that can not be taken over from the
+ * flow table. The flow id was not reserved.
+ *
+ * @param f_id ID of flow
+ */
+void nicif_flow_drop(uint32_t f_id);
+
 /** Flags for connections (used in nicif_connection_add()) */
 enum nicif_connection_flags {
   /** Enable object steering for connection. */
@@ -115,6 +171,8 @@ enum nicif_connection_flags {
   NICIF_CONN_OBJNOHASH  = (1 <<  1),
   /** Enable ECN for connection. */
   NICIF_CONN_ECN        = (1 <<  2),
+  /** Peer accepts selective acknowledgements. */
+  NICIF_CONN_SACK       = (1 <<  3),
 };
 
 /**
@@ -122,6 +180,7 @@ enum nicif_connection_flags {
  *
  * @param db          Doorbell ID
  * @param mac_remote  MAC address of the remote host
+ * @param port        NIC port index to transmit on
  * @param ip_local    Local IP address
  * @param port_local  Local port number
  * @param ip_remote   Remote IP address
@@ -141,12 +200,60 @@ enum nicif_connection_flags {
  *
  * @return 0 on success, <0 else
  */
-int nicif_connection_add(uint32_t db, uint64_t mac_remote, uint32_t ip_local,
-    uint16_t port_local, uint32_t ip_remote, uint16_t port_remote,
-    uint64_t rx_base, uint32_t rx_len, uint64_t tx_base, uint32_t tx_len,
-    uint32_t remote_seq, uint32_t local_seq, uint64_t app_opaque,
-    uint32_t flags, uint32_t rate, uint32_t fn_core, uint16_t flow_group,
-    uint32_t *pf_id);
+int nicif_connection_add(uint32_t db, uint64_t mac_remote, uint8_t port,
+    uint32_t ip_local, uint16_t port_local, uint32_t ip_remote,
+    uint16_t port_remote, uint64_t rx_base, uint32_t rx_len, uint64_t tx_base,
+    uint32_t tx_len, uint32_t remote_seq, uint32_t local_seq,
+    uint64_t app_opaque, uint32_t flags, uint32_t rate, uint32_t fn_core,
+    uint16_t flow_group, uint32_t *pf_id);
+
+/** Max. number of requests in one nicif connection add/disable batch */
+#define NICIF_ADMIN_BATCH 64
+/** Max. number of kernel rx queue entries handled per core and round */
+#define NICIF_RX_BATCH 32
+/** Max. number of kernel rx queue entries handled per nicif_poll() */
+#define NICIF_RX_BUDGET 512
+
+/** Request for nicif_connection_add_batch(), see nicif_connection_add(). */
+struct nicif_connection_add_req {
+  uint32_t db;
+  uint64_t mac_remote;
+  uint8_t port;
+  uint32_t ip_local;
+  uint16_t port_local;
+  uint32_t ip_remote;
+  uint16_t port_remote;
+  uint64_t rx_base;
+  uint32_t rx_len;
+  uint64_t tx_base;
+  uint32_t tx_len;
+  uint32_t remote_seq;
+  uint32_t local_seq;
+  /** Bytes already placed at the start of the rx buffer */
+  uint32_t rx_pos;
+  uint64_t app_opaque;
+  uint32_t flags;
+  uint32_t rate;
+  uint32_t fn_core;
+  uint16_t flow_group;
+
+  /** Out: flow id if status is 0 */
+  uint32_t flow_id;
+  /** Out: 0 on success, <0 else */
+  int status;
+};
+
+/**
+ * Register multiple flows (must be called from poll thread). Flow state for
+ * all flows is written before the flows are published in the hash table.
+ *
+ * @param num  Number of requests
+ * @param reqs Requests, flow_id and status are filled in on return
+ *
+ * @return Number of flows registered successfully
+ */
+unsigned nicif_connection_add_batch(unsigned num,
+    struct nicif_connection_add_req *reqs);
 
 /**
  * Disable connection fast path (mark as sp'd and remove from hash table).
@@ -162,6 +269,32 @@ int nicif_connection_add(uint32_t db, uint64_t mac_remote, uint32_t ip_local,
 int nicif_connection_disable(uint32_t f_id, uint32_t *tx_seq, uint32_t *rx_seq,
     int *tx_closed, int *rx_closed);
 
+/** Request for nicif_connection_disable_batch() */
+struct nicif_connection_disable_req {
+  /** Flow state ID */
+  uint32_t flow_id;
+  /** Out: last transmit and receive sequence numbers */
+  uint32_t tx_seq;
+  uint32_t rx_seq;
+  /** Out: last timestamp value received from the peer */
+  uint32_t rx_ts;
+  /** Out: tx/rx stream closed flags */
+  int tx_closed;
+  int rx_closed;
+};
+
+/**
+ * Disable fast path for multiple connections. All requests are posted to the
+ * fast path cores before waiting for any of them, each core is kicked once.
+ *
+ * @param num  Number of requests, at most #NICIF_ADMIN_BATCH
+ * @param reqs Requests, results are filled in on return
+ *
+ * @return 0 on success, <0 else
+ */
+int nicif_connection_disable_batch(unsigned num,
+    struct nicif_connection_disable_req *reqs);
+
 /**
  * Free flow state.
  *
@@ -169,6 +302,14 @@ int nicif_connection_disable(uint32_t f_id, uint32_t *tx_seq, uint32_t *rx_seq,
  */
 void nicif_connection_free(uint32_t f_id);
 
+/**
+ * Free flow state of multiple flows (must be called from poll thread).
+ *
+ * @param num   Number of flows
+ * @param f_ids Flow state IDs
+ */
+void nicif_connection_free_batch(unsigned num, const uint32_t *f_ids);
+
 /**
  * Move flow to new db.
  *
@@ -192,10 +333,16 @@ struct nicif_connection_stats {
   uint32_t c_ackb;
   /** Number of ACKd bytes with ECN marks */
   uint32_t c_ecnb;
+  /** Number of retransmission timeouts in the fast path */
+  uint16_t c_rtos;
   /** Has pending data in transmit buffer */
   int txp;
   /** Current rtt estimate */
   uint32_t rtt;
+  /** Next receive sequence number */
+  uint32_t rx_seq;
+  /** Offset of the transmit buffer the fast path uses */
+  uint64_t tx_base;
 };
 
 /**
@@ -229,6 +376,36 @@ int nicif_connection_setrate(uint32_t f_id, uint32_t rate);
  */
 int nicif_connection_retransmit(uint32_t f_id, uint16_t core);
 
+/**
+ * Replace receive buffer of flow. The fast path only does this if all data in
+ * the old buffer has been consumed by the application, and then tells the
+ * application about the new buffer.
+ *
+ * @param f_id       ID of flow
+ * @param flow_group FlexNIC flow group
+ * @param rx_base    Offset of new receive buffer
+ * @param rx_len     Length of new receive buffer
+ *
+ * @return 0 if replaced, 1 if old buffer is still in use, <0 on error
+ */
+int nicif_connection_resize(uint32_t f_id, uint16_t flow_group,
+    uint64_t rx_base, uint32_t rx_len);
+
+/**
+ * Offer the application a new transmit buffer for the flow. The application
+ * switches the fast path over once everything in the old buffer has been
+ * acknowledged, #nicif_connection_stats reports the buffer in use.
+ *
+ * @param f_id       ID of flow
+ * @param flow_group FlexNIC flow group
+ * @param tx_base    Offset of new transmit buffer
+ * @param tx_len     Length of new transmit buffer, a power of two
+ *
+ * @return 0 if offered, <0 on error
+ */
+int nicif_connection_txoffer(uint32_t f_id, uint16_t flow_group,
+    uint64_t tx_base, uint32_t tx_len);
+
 /**
  * Allocate transmit buffer for raw packet.
  *
@@ -247,10 +424,11 @@ int nicif_tx_alloc(uint16_t len, void **buf, uint32_t *opaque);
  * Actually send out transmit buffer (lens need to match).
  *
  * @param opaque Opaque value returned from nicif_tx_alloc().
+ * @param port   NIC port index to send packet on
  *
  * @return 0 on success, <0 else
  */
-void nicif_tx_send(uint32_t opaque);
+void nicif_tx_send(uint32_t opaque, uint8_t port);
 
 /** @} */
 
@@ -282,6 +460,37 @@ int packetmem_init(void);
 int packetmem_alloc(size_t length, uintptr_t *off,
     struct packetmem_handle **handle);
 
+/**
+ * Allocate packet memory of specified length, preferably from the arena on
+ * the specified numa node. Falls back to other nodes if that arena is full.
+ *
+ * @param length  Required number of bytes
+ * @param node    Preferred numa node, -1 for no preference
+ * @param off     Pointer to location where offset in DMA region should be
+ *                stored
+ * @param handle  Pointer to location where handle for memory region should be
+ *                stored
+ *
+ * @return 0 on success, <0 else
+ */
+int packetmem_alloc_node(size_t length, int node, uintptr_t *off,
+    struct packetmem_handle **handle);
+
+/**
+ * Reserve the region packetmem_alloc() returned for length at offset off
+ * earlier, used to take over buffers of a previous instance. Has to be the
+ * same length as passed to the original allocation.
+ *
+ * @param off     Offset of the region in the DMA region
+ * @param length  Length passed to the original allocation
+ * @param handle  Pointer to location where handle for memory region should be
+ *                stored
+ *
+ * @return 0 on success, <0 if the region is not free (or misaligned)
+ */
+int packetmem_reserve(uintptr_t off, size_t length,
+    struct packetmem_handle **handle);
+
 /**
  * Free packet memory region.
  *
@@ -291,6 +500,9 @@ int packetmem_alloc(size_t length, uintptr_t *off,
  */
 void packetmem_free(struct packetmem_handle *handle);
 
+/** Print allocation and fragmentation statistics for each arena. */
+void packetmem_dump_stats(void);
+
 /** @} */
 
 /*****************************************************************************/
@@ -342,6 +554,15 @@ void appif_listen_newconn(struct listener *l, uint32_t remote_ip,
  */
 void appif_accept_conn(struct connection *c, int status);
 
+/**
+ * Callback from NIC interface: Fast path moved flow to another context of
+ * its application.
+ *
+ * @param f_id  Flow id
+ * @param db    Doorbell of the new context
+ */
+void appif_conn_moved(uint32_t f_id, uint16_t db);
+
 /** @} */
 
 /*****************************************************************************/
@@ -361,6 +582,8 @@ enum connection_status {
   CONN_SYN_SENT,
   /** Opening: SYN received, waiting for NIC registration. */
   CONN_REG_SYNACK,
+  /** Opening: SYN cookie ACK received, waiting for NIC registration. */
+  CONN_REG_COOKIE,
   /** Connection opened. */
   CONN_OPEN,
   /** Connection closed. */
@@ -369,6 +592,16 @@ enum connection_status {
   CONN_FAILED,
 };
 
+/** Congestion control scheduling state of a connection. */
+enum connection_cc_state {
+  /** Not handled by congestion control. */
+  CC_CONN_NONE,
+  /** Control loop deadline armed. */
+  CC_CONN_SCHED,
+  /** No recent fast path activity, waiting for the fast path to report some. */
+  CC_CONN_IDLE,
+};
+
 /** Congestion control data for window-based DCTCP */
 struct connection_cc_dctcp_win {
   /** Rate of ECN bits received. */
@@ -414,6 +647,61 @@ struct connection_cc_timely {
   int slowstart;
 };
 
+/** BBR: number of rounds in the bottleneck bandwidth filter */
+#define CC_BBR_BW_ROUNDS 10
+
+/** BBR operating modes. */
+enum cc_bbr_mode {
+  /** Exponential rate growth until the bandwidth estimate stops growing */
+  CC_BBR_STARTUP,
+  /** Drain the queue built up during startup */
+  CC_BBR_DRAIN,
+  /** Cycle pacing gain around the bandwidth estimate */
+  CC_BBR_PROBE_BW,
+  /** Reduced rate to refresh the min. rtt estimate */
+  CC_BBR_PROBE_RTT,
+};
+
+/** Congestion control data for BBR */
+struct connection_cc_bbr {
+  /** Max. delivery rate samples [kbps], one slot per round. */
+  uint32_t bw_samples[CC_BBR_BW_ROUNDS];
+  /** Estimated bottleneck bandwidth, max. over bw_samples [kbps]. */
+  uint32_t btl_bw;
+  /** Bottleneck bandwidth at start of last startup round [kbps]. */
+  uint32_t full_bw;
+  /** Min. rtt in current window [us]. */
+  uint32_t min_rtt;
+  /** Timestamp when min_rtt was last lowered or refreshed. */
+  uint32_t min_rtt_ts;
+  /** Timestamp when current round started. */
+  uint32_t round_ts;
+  /** Timestamp when current mode or gain cycle phase started. */
+  uint32_t mode_ts;
+  /** Round counter, indexes bw_samples. */
+  uint16_t round;
+  /** Startup rounds without significant bandwidth growth. */
+  uint8_t full_bw_cnt;
+  /** Current mode, see #cc_bbr_mode. */
+  uint8_t mode;
+  /** Phase in PROBE_BW gain cycle. */
+  uint8_t cycle_idx;
+  /** Mode to return to after PROBE_RTT. */
+  uint8_t prev_mode;
+};
+
+/** Congestion control data for Swift */
+struct connection_cc_swift {
+  /** Congestion window [bytes]. */
+  uint32_t window;
+  /** Fraction of ECN marked bytes (EWMA, UINT32_MAX = 1). */
+  uint32_t ecn_rate;
+  /** Timestamp of last window decrease. */
+  uint32_t last_decrease_ts;
+  /** Flag indicating whether flow is in slow start. */
+  int slowstart;
+};
+
 /** TCP connection state */
 struct connection {
   /**
@@ -478,6 +766,17 @@ struct connection {
     uint32_t local_seq;
     /** Timestamp received with SYN/SYN-ACK packet */
     uint32_t syn_ts;
+    /** Payload of a fast open SYN, already placed in the rx buffer */
+    uint16_t syn_data_len;
+    /** Send a fast open cookie with the SYN-ACK */
+    uint8_t tfo_cookie;
+    /** Last timestamp received from the peer, set when closed */
+    uint32_t close_ts;
+    /** Closed connection still holds its flow state id */
+    uint8_t close_flow_held;
+    /** Cycle counter when the handshake started, and its current phase */
+    uint64_t hs_tsc;
+    uint64_t hs_phase_tsc;
   /**@}*/
 
   /**
@@ -510,6 +809,21 @@ struct connection {
     uint32_t cc_last_ackb;
     /** Number of ACKd bytes with ECN marks */
     uint32_t cc_last_ecnb;
+    /** Number of fast path retransmission timeouts */
+    uint16_t cc_last_rtos;
+
+    /** Receive sequence number */
+    uint32_t cc_last_rxseq;
+    /** Receive buffer size requested by autotuning */
+    uint32_t cc_rx_target;
+    /** Transmit buffer size requested by autotuning */
+    uint32_t cc_tx_target;
+    /** Transmit buffer offered to the app, NULL if none */
+    struct packetmem_handle *tx_offer_handle;
+    /** Offset of the offered transmit buffer */
+    uintptr_t tx_offer_off;
+    /** Length of the offered transmit buffer */
+    uint32_t tx_offer_len;
 
     /** Congestion rate limit. */
     uint32_t cc_rate;
@@ -523,13 +837,33 @@ struct connection {
       struct connection_cc_timely timely;
       /** Rate-based dctcp */
       struct connection_cc_dctcp_rate dctcp_rate;
+      /** BBR */
+      struct connection_cc_bbr bbr;
+      /** Swift */
+      struct connection_cc_swift swift;
     } cc;
+    /** Congestion control algorithm, see #config_cc_algorithm */
+    uint8_t cc_alg;
     /** #control intervals with data in tx buffer but no ACKs */
     uint32_t cnt_tx_pending;
     /** Timestamp when flow was first not moving */
     uint32_t ts_tx_pending;
-    /** Linked list for CC connection list. */
-    struct connection *cc_next;
+    /** CC scheduling state, protected by the shard lock. */
+    enum connection_cc_state cc_state;
+    /** Timeout for next control loop run, while #cc_state is scheduled. */
+    struct timeout cc_to;
+    /** Time the fast path last reported activity for the flow. */
+    uint32_t cc_active_ts;
+    /** Queue element for retransmits requested by a cc thread. */
+    struct nbqueue_el cc_rexmit_el;
+    /** CC shard handling the connection. */
+    uint8_t cc_shard;
+    /** 1 if a retransmit is queued on cc_rexmit_el. */
+    volatile uint8_t cc_rexmit_queued;
+    /** Queue element for buffer resizes requested by a cc thread. */
+    struct nbqueue_el cc_resize_el;
+    /** 1 if a resize is queued on cc_resize_el. */
+    volatile uint8_t cc_resize_queued;
   /**@}*/
 
   /** Linked list in hash table. */
@@ -586,6 +920,11 @@ struct listener {
   uint16_t port;
   /** Flags: see #nicif_connection_flags */
   uint32_t flags;
+  /** Buffer sizes for accepted connections */
+  uint32_t rx_len;
+  uint32_t tx_len;
+  /** Congestion control algorithm for accepted connections */
+  uint8_t cc_alg;
 };
 
 /** List of tcp connections */
@@ -610,6 +949,9 @@ void tcp_poll(void);
  * @param db_id       Doorbell ID to use for connection
  * @param objconn     != 0 if opening an object connection
  * @param objnohash   != 0 to disable hashing on object connection
+ * @param rx_len      Receive buffer size, 0 for default
+ * @param tx_len      Transmit buffer size, 0 for default
+ * @param cc_alg      Congestion control algorithm, see #config_cc_algorithm
  * @param conn        Pointer to location for storing pointer of created conn
  *                    struct.
  *
@@ -617,6 +959,7 @@ void tcp_poll(void);
  */
 int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
     uint16_t remote_port, uint32_t db_id, int objconn, int objnohash,
+    uint32_t rx_len, uint32_t tx_len, uint8_t cc_alg,
     struct connection **conn);
 
 /**
@@ -630,6 +973,12 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
  *                    port.
  * @param objconn     != 0 to create a listener for object connections
  * @param objnohash   != 0 to disable hashing for object connections
+ * @param rx_len      Receive buffer size for accepted connections, 0 for
+ *                    default
+ * @param tx_len      Transmit buffer size for accepted connections, 0 for
+ *                    default
+ * @param cc_alg      Congestion control algorithm for accepted connections,
+ *                    see #config_cc_algorithm
  * @param listen      Pointer to location for storing pointer of created
  *                    listener struct.
  *
@@ -637,6 +986,7 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
  */
 int tcp_listen(struct app_context *ctx, uint64_t opaque, uint16_t local_port,
     uint32_t backlog, int reuseport, int objconn, int objnohash,
+    uint32_t rx_len, uint32_t tx_len, uint8_t cc_alg,
     struct listener **listen);
 
 /**
@@ -652,16 +1002,26 @@ int tcp_listen(struct app_context *ctx, uint64_t opaque, uint16_t local_port,
 int tcp_accept(struct app_context *ctx, uint64_t opaque,
         struct listener *listen, uint32_t db_id);
 
+/** TCP packet received from the fast path */
+struct tcp_rx_pkt {
+  /** Pointer to packet */
+  const void *pkt;
+  /** Length of packet */
+  uint16_t len;
+  /** Flow group (rss bucket for steering) */
+  uint16_t flow_group;
+  /** FlexNIC emulator core */
+  uint32_t fn_core;
+};
+
 /**
- * RX processing for a TCP packet.
+ * RX processing for a batch of TCP packets. Packets for the same connection
+ * are processed back to back, in order.
  *
- * @param pkt Pointer to packet
- * @param len Length of packet
- * @param fn_core FlexNIC emulator core
- * @param flow_group Flow group (rss bucket for steering)
+ * @param pkts Packets
+ * @param num  Number of packets, at most #NICIF_RX_BATCH
  */
-void tcp_packet(const void *pkt, uint16_t len, uint32_t fn_core,
-    uint16_t flow_group);
+void tcp_packets(const struct tcp_rx_pkt *pkts, unsigned num);
 
 /**
  * Destroy already closed/failed connection.
@@ -694,6 +1054,42 @@ void tcp_timeout(struct timeout *to, enum timeout_type type);
  * @ingroup kernel
  * @{ */
 
+/** Default MSS assumed by window-based algorithms [bytes] */
+#define CC_MSS 1400
+
+/**
+ * Congestion control algorithm. The control loop calls update() once per
+ * control interval with the counter differences since the last run, the
+ * algorithm then sets c->cc_rate and c->cc_rtt. Per-connection state lives
+ * in the c->cc union.
+ */
+struct cc_algorithm {
+  /** Name used for configuration and TCP_CONGESTION. */
+  const char *name;
+  /** Initialize state for a new connection, also sets initial rate. */
+  void (*init)(struct connection *c);
+  /** Run control loop for connection. */
+  void (*update)(struct connection *c, struct nicif_connection_stats *stats,
+      uint32_t diff_ts, uint32_t cur_ts);
+  /** Optional: the control loop issued a retransmit. */
+  void (*on_loss)(struct connection *c, uint32_t cur_ts);
+};
+
+/** Algorithms indexed by #config_cc_algorithm */
+extern const struct cc_algorithm *cc_algorithms[];
+
+extern const struct cc_algorithm cc_bbr;
+extern const struct cc_algorithm cc_swift;
+
+/**
+ * Convert window in bytes to rate in kbps, also limited by the link
+ * bandwidth.
+ *
+ * @param window Window in bytes.
+ * @param rtt    Round trip time [us].
+ */
+uint32_t cc_window_to_rate(uint32_t window, uint32_t rtt);
+
 /** Initialize congestion control management */
 int cc_init(void);
 
@@ -706,6 +1102,14 @@ unsigned cc_poll(uint32_t cur_ts);
 
 uint32_t cc_next_ts(uint32_t cur_ts);
 
+/**
+ * Schedule flows the fast path reported as active for the control loop.
+ *
+ * @param flow_ids Flow ids of active flows.
+ * @param num      Number of flows.
+ */
+void cc_flows_active(const uint32_t *flow_ids, unsigned num);
+
 /**
  * Initialize congestion state for flow
  *
@@ -736,25 +1140,45 @@ int arp_init(void);
  * Resolve IP address to MAC address using ARP resolution.
  *
  * This function can either return success immediately in case on an ARP cache
- * hit, or return asynchronously if an ARP request was sent out.
+ * hit, or return asynchronously once the reply for a queued ARP request
+ * arrives. Requests for an IP with a request outstanding share it.
  *
  * @param comp  Context for asynchronous return
  * @param ip    IP address to be resolved
+ * @param port  Port index to send request on, -1 for all ports
  * @param mac   Pointer of memory location where destination MAC should be
  *              stored.
  *
  * @return 0 on success, < 0 on error, and > 0 if request was sent but response
  *    is still pending.
  */
-int arp_request(struct nicif_completion *comp, uint32_t ip, uint64_t *mac);
+int arp_request(struct nicif_completion *comp, uint32_t ip, int port,
+    uint64_t *mac);
+
+/**
+ * Send out queued ARP requests, a bounded batch per call.
+ *
+ * @return Number of requests sent.
+ */
+unsigned arp_poll(void);
+
+/**
+ * Port index the ARP response for an IP was received on.
+ *
+ * @param ip    IP address (of resolved entry)
+ *
+ * @return Port index, 0 if IP is not resolved.
+ */
+uint8_t arp_port(uint32_t ip);
 
 /**
  * RX processing for an ARP packet.
  *
- * @param pkt Pointer to packet
- * @param len Length of packet
+ * @param pkt  Pointer to packet
+ * @param len  Length of packet
+ * @param port Port index packet was received on
  */
-void arp_packet(const void *pkt, uint16_t len);
+void arp_packet(const void *pkt, uint16_t len, uint8_t port);
 
 /**
  * ARP timeout triggered.
@@ -776,6 +1200,29 @@ void arp_timeout(struct timeout *to, enum timeout_type type);
 /** Initialize IP routing subsystem */
 int routing_init(void);
 
+/**
+ * Add route at runtime. Lookups pick the longest matching prefix.
+ *
+ * @param ip           Destination network address
+ * @param prefix       Destination prefix length
+ * @param next_hop_ip  Next hop IP, 0 for directly connected networks
+ * @param port         Egress port index, -1 if not fixed
+ *
+ * @return 0 on success, < 0 if invalid or a route for the prefix exists.
+ */
+int routing_add(uint32_t ip, uint8_t prefix, uint32_t next_hop_ip,
+    int16_t port);
+
+/**
+ * Remove route at runtime. Established connections keep their next hop.
+ *
+ * @param ip      Destination network address
+ * @param prefix  Destination prefix length
+ *
+ * @return 0 on success, < 0 if there is no route for the prefix.
+ */
+int routing_remove(uint32_t ip, uint8_t prefix);
+
 /**
  * Resolve IP address to MAC address using routing and ARP.
  *
@@ -790,6 +1237,97 @@ int routing_init(void);
  */
 int routing_resolve(struct nicif_completion *comp, uint32_t ip, uint64_t *mac);
 
+/**
+ * Pick NIC port to send packets for a connection on. With bonded ports
+ * connections are spread by hash, otherwise the port comes from the route or
+ * from where ARP resolved the next hop.
+ *
+ * @param ip           Remote IP address (already resolved)
+ * @param remote_port  Remote TCP port
+ * @param local_port   Local TCP port
+ *
+ * @return Port index
+ */
+uint8_t routing_port(uint32_t ip, uint16_t remote_port, uint16_t local_port);
+
+/** @} */
+
+/*****************************************************************************/
+/**
+ * @addtogroup kernel-restart
+ * @brief Taking over state of a previous instance (--fast-restart).
+ * @ingroup kernel
+ * @{ */
+
+/** Name of the shared memory region with the records below */
+#define RESTART_NAME "tas_restart"
+/** Number of context records, indexed by doorbell id */
+#define RESTART_CTX_NUM FLEXNIC_PL_APPCTX_NUM
+
+/** Persisted application context, written when the context is created. */
+struct restart_ctx {
+  /** Record is in use */
+  uint8_t valid;
+  /** Id of the application owning the context */
+  uint16_t app_id;
+  /** Current positions in kernel queues, updated by appif_ctx.c */
+  uint32_t kin_pos;
+  uint32_t kout_pos;
+  /** Kernel queues: offsets in dma memory and sizes in bytes */
+  uint64_t kin_off;
+  uint64_t kout_off;
+  uint32_t kin_size;
+  uint32_t kout_size;
+  /** Fast path queues for each core */
+  uint32_t rxq_len;
+  uint32_t txq_len;
+  uint64_t rxq_off[FLEXNIC_PL_APPST_CTX_MCS];
+  uint64_t txq_off[FLEXNIC_PL_APPST_CTX_MCS];
+};
+
+/**
+ * Map the record region, and if shared memory was taken over reserve memory
+ * and flow ids of the contexts and flows found in it. Called from
+ * nicif_init() before any other packet memory is allocated.
+ *
+ * @return 0 on success, <0 else
+ */
+int restart_init(void);
+
+/** Record for context with doorbell db */
+struct restart_ctx *restart_ctx_rec(uint16_t db);
+
+/**
+ * Hand reserved memory of a context taken over to ctx (queue handles).
+ *
+ * @return 0 on success, <0 if db was not taken over
+ */
+int restart_ctx_take(uint16_t db, struct app_context *ctx);
+
+/** Remember ctx as the rebuilt context for doorbell db */
+void restart_ctx_set(uint16_t db, struct app_context *ctx);
+
+/** Rebuilt context for doorbell db, NULL if there is none */
+struct app_context *restart_ctx_lookup(uint16_t db);
+
+/**
+ * Claim rebuilt context for doorbell db for an application reattaching, only
+ * succeeds once for each context (called on ux socket thread).
+ *
+ * @return Context, or NULL if db was not taken over or is already claimed
+ */
+struct app_context *restart_ctx_claim(uint16_t db);
+
+/** Number of flows taken over, until restart_done() */
+unsigned restart_flows_num(void);
+
+/** Flow id and reserved buffers of i-th flow taken over */
+void restart_flow(unsigned i, uint32_t *f_id, struct packetmem_handle **rx,
+    struct packetmem_handle **tx);
+
+/** All flows are rebuilt, free temporary state */
+void restart_done(void);
+
 /** @} */
 
 #endif // ndef INTERNAL_H_
@@ -35,19 +35,32 @@
 #include "internal.h"
 
 static void timeout_trigger(struct timeout *to, uint8_t type, void *opaque);
+static inline void kstage_done(unsigned id, uint64_t *pcyc);
 void flexnic_loadmon(uint32_t cur_ts);
 
 struct timeout_manager timeout_mgr;
 static int exited = 0;
-struct kernel_statistics kstats;
+struct flexnic_stats_kernel *kstats;
 uint32_t cur_ts;
 static uint32_t startwait = 0;
 int kernel_notifyfd = 0;
 
+/**
+ * Slow path main loop. Kernel packets from the fast path, the connection
+ * table and listeners, timeouts and the app interface are all handled on this
+ * thread; only the congestion control loop can run on threads of its own
+ * (--cc-threads, see cc.c). Sharding packet processing by connection as well
+ * would need the fast path to queue kernel packets by connection hash instead
+ * of per core, and per shard kernel tx queues, timeouts and app queues.
+ */
 int slowpath_main(void)
 {
   uint32_t last_print = 0;
   uint32_t loadmon_ts = 0;
+  uint64_t cyc = 0, prev_cyc, scyc;
+  int was_idle = 1;
+
+  kstats = &fp_stats->kernel;
 
   kernel_notifyfd = eventfd(0, 0);
   assert(kernel_notifyfd != -1);
@@ -110,12 +123,28 @@ int slowpath_main(void)
   while (exited == 0) {
     unsigned n = 0;
 
+    /* count cycles of previous iteration if it was busy */
+    prev_cyc = cyc;
+    cyc = util_rdtsc();
+    if (!was_idle) {
+      kstats->cyc_busy += cyc - prev_cyc;
+    }
+    kstats->loops++;
+
     cur_ts = util_timeout_time_us();
+    scyc = cyc;
     n += nicif_poll();
+    kstage_done(FLEXNIC_STATS_KSTAGE_NIC, &scyc);
     n += cc_poll(cur_ts);
+    kstage_done(FLEXNIC_STATS_KSTAGE_CC, &scyc);
     n += appif_poll();
+    kstage_done(FLEXNIC_STATS_KSTAGE_APP, &scyc);
+    n += arp_poll();
+    kstage_done(FLEXNIC_STATS_KSTAGE_ARP, &scyc);
     tcp_poll();
+    kstage_done(FLEXNIC_STATS_KSTAGE_TCP, &scyc);
     util_timeout_poll_ts(&timeout_mgr, cur_ts);
+    kstage_done(FLEXNIC_STATS_KSTAGE_TIMEOUT, &scyc);
 
     if (cur_ts - loadmon_ts >= 10000) {
       flexnic_loadmon(cur_ts);
@@ -123,6 +152,9 @@ int slowpath_main(void)
     }
 
     if(UNLIKELY(n == 0)) {
+      was_idle = 1;
+      kstats->loops_idle++;
+
       if(startwait == 0) {
 	startwait = cur_ts;
       } else if(cur_ts - startwait >= POLL_CYCLE) {
@@ -135,9 +167,9 @@ int slowpath_main(void)
 	if(cc_timeout != -1U && util_timeout != -1U) {
 	  timeout_us = MIN(cc_timeout, util_timeout);
 	} else if(cc_timeout != -1U) {
-	  timeout_us = util_timeout;
-	} else {
 	  timeout_us = cc_timeout;
+	} else {
+	  timeout_us = util_timeout;
 	}
 	if(timeout_us != -1U) {
 	  timeout_ms = timeout_us / 1000;
@@ -172,13 +204,23 @@ int slowpath_main(void)
 	}
       }
     } else {
+      was_idle = 0;
       startwait = 0;
     }
 
     if (cur_ts - last_print >= 1000000) {
-      printf("stats: drops=%"PRIu64" k_rexmit=%"PRIu64" ecn=%"PRIu64" acks=%"
-          PRIu64"\n", kstats.drops, kstats.kernel_rexmit, kstats.ecn_marked,
-          kstats.acks);
+      printf("stats: drops=%"PRIu64" k_rexmit=%"PRIu64" fp_rto=%"PRIu64
+          " ecn=%"PRIu64" acks=%"PRIu64" scale_ups=%"PRIu64" scale_downs=%"PRIu64" load=%"PRIu32
+          " load_pred=%"PRIu32" syncookies=(%"PRIu64",%"PRIu64",%"PRIu64
+          ") buf_resizes=(%"PRIu64",%"PRIu64")\n", kstats->drops,
+          kstats->kernel_rexmit,
+          kstats->fast_rto,
+          kstats->ecn_marked, kstats->acks, fp_state->scalest.ups,
+          fp_state->scalest.downs, fp_state->scalest.load,
+          fp_state->scalest.load_pred, kstats->syncookies_sent,
+          kstats->syncookies_ok, kstats->syncookies_failed,
+          kstats->rxbuf_resizes, kstats->txbuf_resizes);
+      packetmem_dump_stats();
       fflush(stdout);
       last_print = cur_ts;
     }
@@ -191,6 +233,7 @@ static void timeout_trigger(struct timeout *to, uint8_t type, void *opaque)
 {
   switch (type) {
     case TO_ARP_REQ:
+    case TO_ARP_AGE:
       arp_timeout(to, type);
       break;
 
@@ -205,3 +248,12 @@ static void timeout_trigger(struct timeout *to, uint8_t type, void *opaque)
       abort();
   }
 }
+
+/* add cycles since *pcyc to loop stage `id` (FLEXNIC_STATS_KSTAGE_*) */
+static inline void kstage_done(unsigned id, uint64_t *pcyc)
+{
+  uint64_t now = util_rdtsc();
+
+  kstats->cyc_stage[id] += now - *pcyc;
+  *pcyc = now;
+}
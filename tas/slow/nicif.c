@@ -22,6 +22,7 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,35 +40,39 @@
 #include <rte_hash_crc.h>
 
 #define PKTBUF_SIZE 1536
+/** Max. number of buckets visited looking for a cuckoo path */
+#define FLOWHT_BFS_MAX 256
 
 struct nic_buffer {
   uint64_t addr;
   void *buf;
 };
 
-struct flow_id_item {
-  uint32_t flow_id;
-  struct flow_id_item *next;
-};
-
 static int adminq_init(void);
 static int adminq_init_core(uint16_t core);
-static inline int rxq_poll(void);
-static inline void process_packet(const void *buf, uint16_t len,
-    uint32_t fn_core, uint16_t flow_group);
+static inline unsigned rxq_poll(uint32_t core);
+static inline int process_packet(const void *buf, uint16_t len,
+    uint8_t port);
 static inline volatile struct flextcp_pl_ktx *ktx_try_alloc(uint32_t core,
     struct nic_buffer **buf, uint32_t *new_tail);
+static int connresize_post(uint32_t f_id, uint16_t flow_group,
+    uint64_t rx_base, uint32_t rx_len, uint64_t tx_base, uint32_t tx_len);
 static inline uint32_t flow_hash(ip_addr_t lip, beui16_t lp,
     ip_addr_t rip, beui16_t rp);
-static inline int flow_slot_alloc(uint32_t h, uint32_t *i, uint32_t *d);
+static inline int flow_slot_alloc(uint32_t h, uint32_t *pb, uint32_t *pi);
 static inline int flow_slot_clear(uint32_t f_id, ip_addr_t lip, beui16_t lp,
     ip_addr_t rip, beui16_t rp);
-static void flow_id_alloc_init(void);
-static int flow_id_alloc(uint32_t *fid);
+static int flow_id_alloc_init(void);
+static int flow_id_alloc(unsigned node, uint32_t *fid);
 static void flow_id_free(uint32_t flow_id);
+static inline uint32_t flow_id_end(unsigned node);
 
-struct flow_id_item flow_id_items[FLEXNIC_PL_FLOWST_NUM];
-struct flow_id_item *flow_id_freelist;
+/* flow ids are split into one range per numa node, see shm_numa_flows */
+/* flow ids below flow_id_next that were freed again */
+static uint32_t *flow_id_freestack[FLEXNIC_NUMA_MAX];
+static uint32_t flow_id_freenum[FLEXNIC_NUMA_MAX];
+/* flow ids starting at flow_id_next have never been used */
+static uint32_t flow_id_next[FLEXNIC_NUMA_MAX];
 
 static uint32_t fn_cores;
 
@@ -96,7 +101,17 @@ int nicif_init(void)
   }
 
   /* prepare flow_id allocator */
-  flow_id_alloc_init();
+  if (flow_id_alloc_init()) {
+    fprintf(stderr, "nicif_init: flow_id_alloc_init failed\n");
+    return -1;
+  }
+
+  /* reserve memory and flow ids taken over from a previous instance before
+   * anything else is allocated */
+  if (restart_init()) {
+    fprintf(stderr, "nicif_init: restart_init failed\n");
+    return -1;
+  }
 
   if (adminq_init()) {
     fprintf(stderr, "nicif_init: initializing admin queue failed\n");
@@ -108,20 +123,112 @@ int nicif_init(void)
 
 unsigned nicif_poll(void)
 {
-  unsigned i, ret = 0/*, nonsuc = 0*/;
-  int x;
+  unsigned x, ret = 0, idle = 0;
+  uint32_t core = rxq_next;
+
+  /* round robin over cores with a batch each, the start core rotates so no
+   * core is always served first */
+  rxq_next = (rxq_next + 1) % fn_cores;
+  while (ret < NICIF_RX_BUDGET && idle < fn_cores) {
+    x = rxq_poll(core);
+    idle = (x == 0 ? idle + 1 : 0);
+    ret += x;
+    core = (core + 1 == fn_cores ? 0 : core + 1);
+  }
 
-  for (i = 0; i < 512; i++) {
-    x = rxq_poll();
-    /*if (x == -1 && ++nonsuc > 2 * fn_cores)
-      break;
-    else if (x != -1)
-      nonsuc = 0;*/
+  return ret;
+}
+
+/** Set context weight and rate cap, picked up by qman on all cores */
+void nicif_appctx_qos(uint32_t db, uint16_t weight, uint32_t rate)
+{
+  uint16_t i;
 
-    ret += (x == -1 ? 0 : 1);
+  for (i = 0; i < tas_info->cores_num; i++) {
+    fp_state->appctx[i][db].qos_weight = weight;
+    fp_state->appctx[i][db].qos_rate = rate;
   }
+}
 
-  return ret;
+/** Set context notification moderation, picked up by all cores */
+void nicif_appctx_notify(uint32_t db, uint32_t delay, uint16_t count)
+{
+  uint16_t i;
+
+  for (i = 0; i < tas_info->cores_num; i++) {
+    fp_state->appctx[i][db].notify_count = count;
+    MEM_BARRIER();
+    fp_state->appctx[i][db].notify_delay = delay;
+  }
+}
+
+void nicif_appst_steer(uint16_t appid, uint16_t first, uint16_t last,
+    uint32_t db)
+{
+  struct flextcp_pl_appst *ast = &fp_state->appst[appid];
+  uint32_t i;
+
+  if (!ast->steer_en) {
+    for (i = 0; i < FLEXNIC_PL_APPST_STEER_NUM; i++) {
+      ast->steer_db[i] = ast->ctx_ids[i % ast->ctx_num];
+    }
+  }
+
+  for (i = first; i <= last; i++) {
+    ast->steer_db[i] = db;
+  }
+
+  MEM_BARRIER();
+  ast->steer_en = 1;
+}
+
+void nicif_appst_steer_off(uint16_t appid)
+{
+  fp_state->appst[appid].steer_en = 0;
+}
+
+void nicif_appctx_evfd(uint32_t db, int evfd)
+{
+  uint16_t i;
+
+  for (i = 0; i < tas_info->cores_num; i++) {
+    fp_state->appctx[i][db].evfd = evfd;
+  }
+}
+
+int nicif_flow_reserve(uint32_t f_id)
+{
+  unsigned n = f_id / shm_numa_flows;
+  uint32_t i;
+
+  if (n >= shm_numa_nodes || f_id >= flow_id_end(n)) {
+    return -1;
+  }
+
+  /* ids skipped over are free */
+  if (f_id >= flow_id_next[n]) {
+    for (i = flow_id_next[n]; i < f_id; i++) {
+      flow_id_freestack[n][flow_id_freenum[n]++] = i;
+    }
+    flow_id_next[n] = f_id + 1;
+    return 0;
+  }
+
+  for (i = 0; i < flow_id_freenum[n]; i++) {
+    if (flow_id_freestack[n][i] == f_id) {
+      flow_id_freestack[n][i] = flow_id_freestack[n][--flow_id_freenum[n]];
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void nicif_flow_drop(uint32_t f_id)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[f_id];
+
+  flow_slot_clear(f_id, fs->local_ip, fs->local_port, fs->remote_ip,
+      fs->remote_port);
 }
 
 /** Register application context */
@@ -144,6 +251,27 @@ int nicif_appctx_add(uint16_t appid, uint32_t db, uint64_t *rxq_base,
 
   }
 
+  if (db >= FLEXNIC_PL_APPCTX_NUM) {
+    fprintf(stderr, "nicif_appctx_add: doorbell id too high (%u, max=%u)\n",
+        db, FLEXNIC_PL_APPCTX_NUM);
+    return -1;
+  }
+
+  /* the fast path fetches tx queue entries a whole cache line at a time with
+   * aligned loads, so queue bases and length must be cache line multiples */
+  if (txq_len % 64 != 0) {
+    fprintf(stderr, "nicif_appctx_add: tx queue length not a multiple of 64 "
+        "(%u)\n", txq_len);
+    return -1;
+  }
+  for (i = 0; i < tas_info->cores_num; i++) {
+    if (txq_base[i] % 64 != 0) {
+      fprintf(stderr, "nicif_appctx_add: tx queue base for core %u not 64 "
+          "byte aligned (%"PRIu64")\n", i, txq_base[i]);
+      return -1;
+    }
+  }
+
   for (i = 0; i < tas_info->cores_num; i++) {
     actx = &fp_state->appctx[i][db];
     actx->appst_id = appid;
@@ -151,6 +279,10 @@ int nicif_appctx_add(uint16_t appid, uint32_t db, uint64_t *rxq_base,
     actx->tx_base = txq_base[i];
     actx->rx_avail = rxq_len;
     actx->evfd = evfd;
+    actx->qos_rate = 0;
+    actx->qos_weight = 1;
+    actx->notify_delay = 0;
+    actx->notify_count = 0;
   }
 
   MEM_BARRIER();
@@ -161,6 +293,10 @@ int nicif_appctx_add(uint16_t appid, uint32_t db, uint64_t *rxq_base,
     actx->rx_len = rxq_len;
   }
 
+  /* let the fast path poll up to this context */
+  if (db >= fp_state->appctx_num)
+    fp_state->appctx_num = db + 1;
+
   MEM_BARRIER();
   ast->ctx_ids[ast->ctx_num] = db;
   MEM_BARRIER();
@@ -170,120 +306,288 @@ int nicif_appctx_add(uint16_t appid, uint32_t db, uint64_t *rxq_base,
 }
 
 /** Register flow */
-int nicif_connection_add(uint32_t db, uint64_t mac_remote, uint32_t ip_local,
-    uint16_t port_local, uint32_t ip_remote, uint16_t port_remote,
-    uint64_t rx_base, uint32_t rx_len, uint64_t tx_base, uint32_t tx_len,
-    uint32_t remote_seq, uint32_t local_seq, uint64_t app_opaque,
-    uint32_t flags, uint32_t rate, uint32_t fn_core, uint16_t flow_group,
-    uint32_t *pf_id)
+int nicif_connection_add(uint32_t db, uint64_t mac_remote, uint8_t port,
+    uint32_t ip_local, uint16_t port_local, uint32_t ip_remote,
+    uint16_t port_remote, uint64_t rx_base, uint32_t rx_len, uint64_t tx_base,
+    uint32_t tx_len, uint32_t remote_seq, uint32_t local_seq,
+    uint64_t app_opaque, uint32_t flags, uint32_t rate, uint32_t fn_core,
+    uint16_t flow_group, uint32_t *pf_id)
+{
+  struct nicif_connection_add_req req = {
+      .db = db, .mac_remote = mac_remote, .port = port,
+      .ip_local = ip_local, .port_local = port_local,
+      .ip_remote = ip_remote, .port_remote = port_remote,
+      .rx_base = rx_base, .rx_len = rx_len,
+      .tx_base = tx_base, .tx_len = tx_len,
+      .remote_seq = remote_seq, .local_seq = local_seq,
+      .app_opaque = app_opaque, .flags = flags, .rate = rate,
+      .fn_core = fn_core, .flow_group = flow_group,
+    };
+
+  if (nicif_connection_add_batch(1, &req) != 1) {
+    return -1;
+  }
+
+  *pf_id = req.flow_id;
+  return 0;
+}
+
+/* allocate flow id and fill in flow state, not visible to fast path yet */
+static int connection_prepare(struct nicif_connection_add_req *r)
 {
   struct flextcp_pl_flowst *fs;
-  beui32_t lip = t_beui32(ip_local), rip = t_beui32(ip_remote);
-  beui16_t lp = t_beui16(port_local), rp = t_beui16(port_remote);
-  uint32_t i, d, f_id, hash;
-  struct flextcp_pl_flowhte *hte = fp_state->flowht;
+  uint64_t rx_base = r->rx_base;
+  uint32_t f_id;
+  int core;
 
   /* allocate flow id */
-  if (flow_id_alloc(&f_id) != 0) {
+  /* flow state goes on the node of the core currently serving the flow
+   * group, flows steered with rules or rebalanced later may move away */
+  if (flow_id_alloc(flexnic_core_node(fp_state->flow_group_steering[
+          r->flow_group]), &f_id) != 0)
+  {
     fprintf(stderr, "nicif_connection_add: allocating flow state\n");
     return -1;
   }
 
-  /* calculate hash and find empty slot */
-  hash = flow_hash(lip, lp, rip, rp);
-  if (flow_slot_alloc(hash, &i, &d) != 0) {
-    flow_id_free(f_id);
-    fprintf(stderr, "nicif_connection_add: allocating slot failed\n");
-    return -1;
-  }
-  assert(i < FLEXNIC_PL_FLOWHT_ENTRIES);
-  assert(d < FLEXNIC_PL_FLOWHT_NBSZ);
-
   /* if this is an object connection, set flag accordingly */
-  if ((flags & NICIF_CONN_OBJCONN) == NICIF_CONN_OBJCONN) {
+  if ((r->flags & NICIF_CONN_OBJCONN) == NICIF_CONN_OBJCONN) {
     rx_base |= FLEXNIC_PL_FLOWST_OBJCONN;
-    if ((flags & NICIF_CONN_OBJNOHASH) == NICIF_CONN_OBJNOHASH) {
+    if ((r->flags & NICIF_CONN_OBJNOHASH) == NICIF_CONN_OBJNOHASH) {
       rx_base |= FLEXNIC_PL_FLOWST_OBJNOHASH;
     }
   }
-  if ((flags & NICIF_CONN_ECN) == NICIF_CONN_ECN) {
+  if ((r->flags & NICIF_CONN_ECN) == NICIF_CONN_ECN) {
     rx_base |= FLEXNIC_PL_FLOWST_ECN;
   }
 
   fs = &fp_state->flowst[f_id];
-  fs->opaque = app_opaque;
+  fs->opaque = r->app_opaque;
   fs->rx_base_sp = rx_base;
-  fs->tx_base = tx_base;
-  fs->rx_len = rx_len;
-  fs->tx_len = tx_len;
-  memcpy(&fs->remote_mac, &mac_remote, ETH_ADDR_LEN);
-  fs->db_id = db;
-
-  fs->local_ip = lip;
-  fs->remote_ip = rip;
-  fs->local_port = lp;
-  fs->remote_port = rp;
-
-  fs->flow_group = flow_group;
-  fs->lock = 0;
+  fs->tx_base = r->tx_base;
+  fs->rx_len = r->rx_len;
+  fs->tx_len = r->tx_len;
+  memcpy(&fs->remote_mac, &r->mac_remote, ETH_ADDR_LEN);
+  fs->db_id = r->db;
+
+  fs->local_ip = t_beui32(r->ip_local);
+  fs->remote_ip = t_beui32(r->ip_remote);
+  fs->local_port = t_beui16(r->port_local);
+  fs->remote_port = t_beui16(r->port_remote);
+
+  fs->flow_group = r->flow_group;
+  fs->port = r->port;
   fs->bump_seq = 0;
+  /* object connections have to send objects in order, skipping over SACKed
+   * data would lose track of object boundaries */
+  fs->tcp_opts = 0;
+  if ((r->flags & (NICIF_CONN_SACK | NICIF_CONN_OBJCONN)) == NICIF_CONN_SACK) {
+    fs->tcp_opts |= FLEXNIC_PL_FLOWST_OPT_SACK;
+  }
 
-  fs->rx_avail = rx_len;
-  fs->rx_next_pos = 0;
-  fs->rx_next_seq = remote_seq;
-  fs->rx_remote_avail = rx_len; /* XXX */
+  fs->rx_avail = r->rx_len - r->rx_pos;
+  fs->rx_next_pos = r->rx_pos;
+  fs->rx_next_seq = r->remote_seq;
+  fs->rx_remote_avail = r->rx_len; /* XXX */
+  fs->rx_dupack_cnt = 0;
+  fs->rx_ack_pending = 0;
+#ifdef FLEXNIC_PL_OOO_RECV
+  fs->rx_ooo_num = 0;
+#endif
 
   fs->tx_sent = 0;
   fs->tx_next_pos = 0;
-  fs->tx_next_seq = local_seq;
+  fs->tx_next_seq = r->local_seq;
   fs->tx_head = 0;
   fs->tx_objrem = 0;
   fs->tx_next_ts = 0;
-  fs->tx_rate = rate;
-  fs->rtt_est = 0;
+  fs->tx_rate = r->rate;
+  fs->tx_sack_num = 0;
+  fs->tx_recover = r->local_seq;
+  fp_flowst_stats[f_id].rtt_est = 0;
+  fp_flowst_stats[f_id].cc_active_ts = 0;
+  fp_flowst_stats[f_id].cnt_tx_rtos = 0;
+  fp_flowst_stats[f_id].rto_backoff = 0;
+  fp_flowst_stats[f_id].tx_offer_base = 0;
+  fp_flowst_stats[f_id].tx_offer_len = 0;
+
+  /* steer packets to the core the app context is served by, if there are
+   * flow rules left; the flow is not visible to the fast path yet, so
+   * ownership can be set directly */
+  fs->steer_core = FLEXNIC_PL_FLOWST_NOSTEER;
+  if ((core = network_flow_steer(f_id, r->db, 0)) >= 0) {
+    fs->steer_core = core;
+  }
 
-  /* write to empty entry first */
-  MEM_BARRIER();
-  hte[i].flow_hash = hash;
+  r->flow_id = f_id;
+  return 0;
+}
+
+unsigned nicif_connection_add_batch(unsigned num,
+    struct nicif_connection_add_req *reqs)
+{
+  struct nicif_connection_add_req *r;
+  struct flextcp_pl_flowhtb *htb;
+  uint32_t b, i, hash;
+  unsigned k, n = 0;
+
+  for (k = 0; k < num; k++) {
+    reqs[k].status = connection_prepare(&reqs[k]);
+  }
+
+  /* flow state for all flows has to be written before any of them can be
+   * found in the hash table */
   MEM_BARRIER();
-  hte[i].flow_id = FLEXNIC_PL_FLOWHTE_VALID |
-      (d << FLEXNIC_PL_FLOWHTE_POSSHIFT) | f_id;
 
-  *pf_id = f_id;
-  return 0;
+  for (k = 0; k < num; k++) {
+    r = &reqs[k];
+    if (r->status != 0)
+      continue;
+
+    /* calculate hash and find empty slot, slots are only reserved once they
+     * are valid, so this is done one flow at a time */
+    hash = flow_hash(t_beui32(r->ip_local), t_beui16(r->port_local),
+        t_beui32(r->ip_remote), t_beui16(r->port_remote));
+    if (flow_slot_alloc(hash, &b, &i) != 0) {
+      network_flow_unsteer(r->flow_id);
+      flow_id_free(r->flow_id);
+      fprintf(stderr, "nicif_connection_add: allocating slot failed\n");
+      r->status = -1;
+      continue;
+    }
+    assert(b < fp_flowht_num);
+    assert(i < FLEXNIC_PL_FLOWHT_NBSZ);
+
+    /* write to empty entry first */
+    htb = &fp_flowht[b];
+    htb->flow_hash[i] = hash;
+    MEM_BARRIER();
+    htb->flow_id[i] = FLEXNIC_PL_FLOWHTE_VALID | r->flow_id;
+    n++;
+  }
+
+  return n;
 }
 
 int nicif_connection_disable(uint32_t f_id, uint32_t *tx_seq, uint32_t *rx_seq,
     int *tx_closed, int *rx_closed)
 {
-  struct flextcp_pl_flowst *fs = &fp_state->flowst[f_id];
+  struct nicif_connection_disable_req req = { .flow_id = f_id };
 
-  util_spin_lock(&fs->lock);
+  if (nicif_connection_disable_batch(1, &req) != 0) {
+    return -1;
+  }
 
-  *tx_seq = fs->tx_next_seq;
-  *rx_seq = fs->rx_next_seq;
-  fs->rx_base_sp |= FLEXNIC_PL_FLOWST_SLOWPATH;
+  *tx_seq = req.tx_seq;
+  *rx_seq = req.rx_seq;
+  *tx_closed = req.tx_closed;
+  *rx_closed = req.rx_closed;
+  return 0;
+}
 
-  *rx_closed = !!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_RXFIN);
-  *tx_closed = !!(fs->rx_base_sp & FLEXNIC_PL_FLOWST_TXFIN) &&
-      fs->tx_sent == 0;
+/* cores to kick are tracked in a 64-bit mask */
+STATIC_ASSERT(FLEXNIC_PL_APPST_CTX_MCS <= 64, disable_core_mask);
 
-  util_spin_unlock(&fs->lock);
+int nicif_connection_disable_batch(unsigned num,
+    struct nicif_connection_disable_req *reqs)
+{
+  struct flextcp_pl_flowst *fs;
+  volatile struct flextcp_pl_ktx *ktxs[NICIF_ADMIN_BATCH];
+  uint16_t cores[NICIF_ADMIN_BATCH];
+  struct nicif_connection_disable_req *r;
+  struct nic_buffer *buf;
+  uint32_t tail, kick_ts;
+  uint64_t kick_mask;
+  uint16_t core;
+  unsigned k, start, end;
+
+  assert(num <= NICIF_ADMIN_BATCH);
+
+  /* the flow state may only be modified by the fast path core owning it, so
+   * have that core disable the flow and report back the sequence numbers.
+   * Post as many requests as fit in the queues and kick every core involved
+   * once, entries are only reused after their results have been read. */
+  for (start = 0; start < num; start = end) {
+    kick_mask = 0;
+    for (end = start; end < num; end++) {
+      fs = &fp_state->flowst[reqs[end].flow_id];
+      core = cores[end] = fp_state->flow_group_steering[fs->flow_group];
+
+      if ((ktxs[end] = ktx_try_alloc(core, &buf, &tail)) == NULL) {
+        if (end > start)
+          break;
+        /* nothing posted in this round, wait for the queue to drain */
+        while ((ktxs[end] = ktx_try_alloc(core, &buf, &tail)) == NULL);
+      }
+      txq_tail[core] = tail;
 
-  flow_slot_clear(f_id, fs->local_ip, fs->local_port, fs->remote_ip,
-      fs->remote_port);
+      ktxs[end]->msg.conndisable.flow_id = reqs[end].flow_id;
+      MEM_BARRIER();
+      ktxs[end]->type = FLEXTCP_PL_KTX_CONNDISABLE;
+      kick_mask |= 1ULL << core;
+    }
+
+    kick_ts = util_timeout_time_us();
+    for (core = 0; kick_mask != 0; core++, kick_mask >>= 1) {
+      if ((kick_mask & 1) != 0)
+        util_flexnic_kick(&fp_state->kctx[core], kick_ts);
+    }
+
+    /* we don't post anything else in the meantime, so just wait for them */
+    for (k = start; k < end; k++) {
+      r = &reqs[k];
+      while (ktxs[k]->type != 0) {
+        if (util_timeout_time_us() - kick_ts > POLL_CYCLE) {
+          kick_ts = util_timeout_time_us();
+          util_flexnic_kick(&fp_state->kctx[cores[k]], kick_ts);
+        }
+      }
+      MEM_BARRIER();
+
+      r->tx_seq = ktxs[k]->msg.conndisable.tx_seq;
+      r->rx_seq = ktxs[k]->msg.conndisable.rx_seq;
+      r->rx_ts = ktxs[k]->msg.conndisable.rx_ts;
+      r->tx_closed = ktxs[k]->msg.conndisable.tx_closed;
+      r->rx_closed = ktxs[k]->msg.conndisable.rx_closed;
+
+      fs = &fp_state->flowst[r->flow_id];
+      flow_slot_clear(r->flow_id, fs->local_ip, fs->local_port, fs->remote_ip,
+          fs->remote_port);
+    }
+  }
   return 0;
 }
 
 void nicif_connection_free(uint32_t f_id)
 {
-  flow_id_free(f_id);
+  nicif_connection_free_batch(1, &f_id);
+}
+
+void nicif_connection_free_batch(unsigned num, const uint32_t *f_ids)
+{
+  unsigned k;
+
+  /* past the grace period the fast path does not look at the flows anymore,
+   * monitoring tools take flows without buffers as unused */
+  for (k = 0; k < num; k++) {
+    fp_state->flowst[f_ids[k]].rx_len = 0;
+    fp_state->flowst[f_ids[k]].tx_len = 0;
+  }
+
+  network_flow_unsteer_batch(num, f_ids);
+  for (k = 0; k < num; k++) {
+    flow_id_free(f_ids[k]);
+  }
 }
 
 /** Move flow to new db */
 int nicif_connection_move(uint32_t dst_db, uint32_t f_id)
 {
   fp_state->flowst[f_id].db_id = dst_db;
+
+  /* point the flow rule at the new context's core, the fast path cores
+   * hand over the flow once the rule points elsewhere */
+  network_flow_steer(f_id, dst_db, 1);
   return 0;
 }
 
@@ -292,19 +596,24 @@ int nicif_connection_stats(uint32_t f_id,
     struct nicif_connection_stats *p_stats)
 {
   struct flextcp_pl_flowst *fs;
+  struct flextcp_pl_flowst_stats *st;
 
-  if (f_id >= FLEXNIC_PL_FLOWST_NUM) {
+  if (f_id >= config.fp_flows) {
     fprintf(stderr, "nicif_connection_stats: bad flow id\n");
     return -1;
   }
 
   fs = &fp_state->flowst[f_id];
-  p_stats->c_drops = fs->cnt_tx_drops;
-  p_stats->c_acks = fs->cnt_rx_acks;
-  p_stats->c_ackb = fs->cnt_rx_ack_bytes;
-  p_stats->c_ecnb = fs->cnt_rx_ecn_bytes;
+  st = &fp_flowst_stats[f_id];
+  p_stats->c_drops = st->cnt_tx_drops;
+  p_stats->c_acks = st->cnt_rx_acks;
+  p_stats->c_ackb = st->cnt_rx_ack_bytes;
+  p_stats->c_ecnb = st->cnt_rx_ecn_bytes;
+  p_stats->c_rtos = st->cnt_tx_rtos;
   p_stats->txp = fs->tx_sent != 0;
-  p_stats->rtt = fs->rtt_est;
+  p_stats->rtt = st->rtt_est;
+  p_stats->rx_seq = fs->rx_next_seq;
+  p_stats->tx_base = fs->tx_base;
 
   return 0;
 }
@@ -321,7 +630,7 @@ int nicif_connection_setrate(uint32_t f_id, uint32_t rate)
 {
   struct flextcp_pl_flowst *fs;
 
-  if (f_id >= FLEXNIC_PL_FLOWST_NUM) {
+  if (f_id >= config.fp_flows) {
     fprintf(stderr, "nicif_connection_stats: bad flow id\n");
     return -1;
   }
@@ -354,6 +663,56 @@ int nicif_connection_retransmit(uint32_t f_id, uint16_t flow_group)
   return 0;
 }
 
+int nicif_connection_resize(uint32_t f_id, uint16_t flow_group,
+    uint64_t rx_base, uint32_t rx_len)
+{
+  return connresize_post(f_id, flow_group, rx_base, rx_len, 0, 0);
+}
+
+int nicif_connection_txoffer(uint32_t f_id, uint16_t flow_group,
+    uint64_t tx_base, uint32_t tx_len)
+{
+  return connresize_post(f_id, flow_group, 0, 0, tx_base, tx_len);
+}
+
+/* post resize request to the core owning the flow group and wait for it, only
+ * one of rx_len and tx_len is set so the core adds one app entry at most */
+static int connresize_post(uint32_t f_id, uint16_t flow_group,
+    uint64_t rx_base, uint32_t rx_len, uint64_t tx_base, uint32_t tx_len)
+{
+  volatile struct flextcp_pl_ktx *ktx;
+  struct nic_buffer *buf;
+  uint32_t tail, kick_ts;
+  uint16_t core = fp_state->flow_group_steering[flow_group];
+
+  if ((ktx = ktx_try_alloc(core, &buf, &tail)) == NULL) {
+    return -1;
+  }
+  txq_tail[core] = tail;
+
+  ktx->msg.connresize.flow_id = f_id;
+  ktx->msg.connresize.rx_base = rx_base;
+  ktx->msg.connresize.rx_len = rx_len;
+  ktx->msg.connresize.tx_base = tx_base;
+  ktx->msg.connresize.tx_len = tx_len;
+  MEM_BARRIER();
+  ktx->type = FLEXTCP_PL_KTX_CONNRESIZE;
+
+  kick_ts = util_timeout_time_us();
+  util_flexnic_kick(&fp_state->kctx[core], kick_ts);
+
+  /* we don't post anything else in the meantime, so just wait for it */
+  while (ktx->type != 0) {
+    if (util_timeout_time_us() - kick_ts > POLL_CYCLE) {
+      kick_ts = util_timeout_time_us();
+      util_flexnic_kick(&fp_state->kctx[core], kick_ts);
+    }
+  }
+  MEM_BARRIER();
+
+  return ktx->msg.connresize.status;
+}
+
 /** Allocate transmit buffer */
 int nicif_tx_alloc(uint16_t len, void **pbuf, uint32_t *opaque)
 {
@@ -371,11 +730,12 @@ int nicif_tx_alloc(uint16_t len, void **pbuf, uint32_t *opaque)
 }
 
 /** Actually send out transmit buffer (lens need to match) */
-void nicif_tx_send(uint32_t opaque)
+void nicif_tx_send(uint32_t opaque, uint8_t port)
 {
   uint32_t tail = (opaque == 0 ? txq_len - 1 : opaque - 1);
   volatile struct flextcp_pl_ktx *ktx = &txq_base[0][tail];
 
+  ktx->msg.packet.port = port;
   MEM_BARRIER();
   ktx->type = FLEXTCP_PL_KTX_PACKET;
   txq_tail[0] = opaque;
@@ -488,53 +848,103 @@ static int adminq_init_core(uint16_t core)
   return 0;
 }
 
-static inline int rxq_poll(void)
+/** Process a batch of up to NICIF_RX_BATCH entries from a core's queue */
+static inline unsigned rxq_poll(uint32_t core)
 {
-  uint32_t old_tail, tail, core;
+  uint32_t tail;
   volatile struct flextcp_pl_krx *krx;
+  volatile struct flextcp_pl_krx *krxs[NICIF_RX_BATCH];
   struct nic_buffer *buf;
+  struct tcp_rx_pkt tcp_pkts[NICIF_RX_BATCH];
+  uint32_t flow_ids[FLEXTCP_PL_KRX_CCACTIVE_MAX];
   uint8_t type;
-  int ret = 0;
+  unsigned i, j, n, num, tcp_num;
+
+  /* collect ready entries and start fetching their packet buffers, they are
+   * only touched once the whole batch is known */
+  tail = rxq_tail[core];
+  for (num = 0; num < NICIF_RX_BATCH; num++) {
+    krx = &rxq_base[core][tail];
+    if (krx->type == FLEXTCP_PL_KRX_INVALID) {
+      break;
+    }
 
-  core = rxq_next;
-  old_tail = tail = rxq_tail[core];
-  krx = &rxq_base[core][tail];
-  buf = &rxq_bufs[core][tail];
-  rxq_next = (core + 1) % fn_cores;
+    krxs[num] = krx;
+    if (krx->type == FLEXTCP_PL_KRX_PACKET) {
+      util_prefetch0(rxq_bufs[core][tail].buf);
+    }
 
-  /* no queue entry here */
-  type = krx->type;
-  if (type == FLEXTCP_PL_KRX_INVALID) {
-    return -1;
+    tail = tail + 1;
+    if (tail == rxq_len) {
+      tail -= rxq_len;
+    }
   }
-
-  /* update tail */
-  tail = tail + 1;
-  if (tail == rxq_len) {
-    tail -= rxq_len;
+  if (num == 0) {
+    return 0;
   }
 
-  /* handle based on queue entry type */
-  type = krx->type;
-  switch (type) {
-    case FLEXTCP_PL_KRX_PACKET:
-      process_packet(buf->buf, krx->msg.packet.len, krx->msg.packet.fn_core,
-          krx->msg.packet.flow_group);
-      break;
+  /* handle based on queue entry type, tcp packets are collected and
+   * processed together */
+  tcp_num = 0;
+  for (i = 0, j = rxq_tail[core]; i < num; i++) {
+    krx = krxs[i];
+    buf = &rxq_bufs[core][j];
+    j = (j + 1 == rxq_len ? 0 : j + 1);
+
+    type = krx->type;
+    switch (type) {
+      case FLEXTCP_PL_KRX_PACKET:
+        if (process_packet(buf->buf, krx->msg.packet.len,
+              krx->msg.packet.port) == 1)
+        {
+          tcp_pkts[tcp_num].pkt = buf->buf;
+          tcp_pkts[tcp_num].len = krx->msg.packet.len;
+          tcp_pkts[tcp_num].fn_core = krx->msg.packet.fn_core;
+          tcp_pkts[tcp_num].flow_group = krx->msg.packet.flow_group;
+          tcp_num++;
+        }
+        break;
+
+      case FLEXTCP_PL_KRX_CCACTIVE:
+        n = MIN(krx->msg.ccactive.num, FLEXTCP_PL_KRX_CCACTIVE_MAX);
+        for (j = 0; j < n; j++) {
+          flow_ids[j] = krx->msg.ccactive.flow_ids[j];
+        }
+        cc_flows_active(flow_ids, n);
+        break;
 
-    default:
-      fprintf(stderr, "rxq_poll: unknown rx type 0x%x old %x len %x\n", type,
-          old_tail, rxq_len);
+      case FLEXTCP_PL_KRX_CONNMOVED:
+        appif_conn_moved(krx->msg.connmoved.flow_id,
+            krx->msg.connmoved.db_id);
+        break;
+
+      default:
+        fprintf(stderr, "rxq_poll: unknown rx type 0x%x len %x\n", type,
+            rxq_len);
+    }
   }
 
-  krx->type = 0;
+  if (tcp_num > 0) {
+    tcp_packets(tcp_pkts, tcp_num);
+  }
+
+  /* buffers go back to the fast path only after the batch is done */
+  for (i = 0; i < num; i++) {
+    krxs[i]->type = 0;
+  }
   rxq_tail[core] = tail;
 
-  return ret;
+  return num;
 }
 
-static inline void process_packet(const void *buf, uint16_t len,
-    uint32_t fn_core, uint16_t flow_group)
+/**
+ * Handle non-TCP packets directly.
+ *
+ * @return 1 if the packet is a TCP packet to be passed to tcp_packets(),
+ *    0 otherwise.
+ */
+static inline int process_packet(const void *buf, uint16_t len,
+    uint8_t port)
 {
   const struct eth_hdr *eth = buf;
   const struct ip_hdr *ip = (struct ip_hdr *) (eth + 1);
@@ -543,25 +953,26 @@ static inline void process_packet(const void *buf, uint16_t len,
   if (f_beui16(eth->type) == ETH_TYPE_ARP) {
     if (len < sizeof(struct pkt_arp)) {
       fprintf(stderr, "process_packet: short arp packet\n");
-      return;
+      return 0;
     }
 
-    arp_packet(buf, len);
+    arp_packet(buf, len, port);
   } else if (f_beui16(eth->type) == ETH_TYPE_IP) {
     if (len < sizeof(*eth) + sizeof(*ip)) {
       fprintf(stderr, "process_packet: short ip packet\n");
-      return;
+      return 0;
     }
 
     if (ip->proto == IP_PROTO_TCP) {
       if (len < sizeof(*eth) + sizeof(*ip) + sizeof(*tcp)) {
         fprintf(stderr, "process_packet: short tcp packet\n");
-        return;
+        return 0;
       }
 
-      tcp_packet(buf, len, fn_core, flow_group);
+      return 1;
     }
   }
+  return 0;
 }
 
 static inline volatile struct flextcp_pl_ktx *ktx_try_alloc(uint32_t core,
@@ -602,115 +1013,137 @@ static inline uint32_t flow_hash(ip_addr_t lip, beui16_t lp,
   return rte_hash_crc(&hk, sizeof(hk), 0);
 }
 
-static inline int flow_slot_alloc(uint32_t h, uint32_t *pi, uint32_t *pd)
+static inline uint32_t flow_slot_free(struct flextcp_pl_flowhtb *htb)
 {
-  uint32_t j, i, l, k, d;
-  struct flextcp_pl_flowhte *hte = fp_state->flowht;
-
-  /* find slot */
-  j = h % FLEXNIC_PL_FLOWHT_ENTRIES;
-  l = (j + FLEXNIC_PL_FLOWHT_NBSZ) % FLEXNIC_PL_FLOWHT_ENTRIES;
+  uint32_t i;
 
-  /* look for empty slot */
-  d = 0;
-  for (i = j; i != l; i = (i + 1) % FLEXNIC_PL_FLOWHT_ENTRIES) {
-    if ((hte[i].flow_id & FLEXNIC_PL_FLOWHTE_VALID) == 0) {
-      *pi = i;
-      *pd = d;
-      return 0;
+  for (i = 0; i < FLEXNIC_PL_FLOWHT_NBSZ; i++) {
+    if ((htb->flow_id[i] & FLEXNIC_PL_FLOWHTE_VALID) == 0) {
+      return i;
     }
-    d++;
   }
+  return FLEXNIC_PL_FLOWHT_NBSZ;
+}
 
-  /* no free slot, try to clear up on */
-  k = (l + 4 * FLEXNIC_PL_FLOWHT_NBSZ) % FLEXNIC_PL_FLOWHT_ENTRIES;
-  /* looking for candidate empty slot to move back */
-  for (; i != k; i = (i + 1) % FLEXNIC_PL_FLOWHT_ENTRIES) {
-    if ((hte[i].flow_id & FLEXNIC_PL_FLOWHTE_VALID) == 0) {
-      break;
+static inline int flow_slot_alloc(uint32_t h, uint32_t *pb, uint32_t *pi)
+{
+  struct {
+    /* bucket */
+    uint32_t b;
+    /* index of the node this bucket was reached from, or -1 */
+    int32_t parent;
+    /* slot in parent bucket whose entry can move to this bucket */
+    uint32_t pslot;
+  } q[FLOWHT_BFS_MAX];
+  uint32_t n, head, b, alt, i, j, eh;
+  int32_t c;
+  struct flextcp_pl_flowhtb *htb = fp_flowht, *src, *dst;
+
+  /* try both candidate buckets first */
+  q[0].b = FLEXNIC_PL_FLOWHT_B1(h, fp_flowht_num);
+  q[1].b = FLEXNIC_PL_FLOWHT_B2(h, fp_flowht_num);
+  n = (q[0].b == q[1].b ? 1 : 2);
+  for (i = 0; i < n; i++) {
+    if ((j = flow_slot_free(&htb[q[i].b])) < FLEXNIC_PL_FLOWHT_NBSZ) {
+      *pb = q[i].b;
+      *pi = j;
+      return 0;
     }
+    q[i].parent = -1;
+    q[i].pslot = 0;
   }
 
-  /* abort if no candidate slot found */
-  if (i == k) {
-    fprintf(stderr, "flow_slot_alloc: no empty slot found\n");
-    return -1;
-  }
-
-  /* move candidate backwards until in range for this insertion */
-  /* j < l -> (i < j || i >= l) */
-  /* j > l -> (i >= l && i < j) */
-  while ((j > l || (i < j || i >= l)) && (j < l || (i >= l && i < j))) {
-    k = i;
-
-    /* look for element to swap */
-    i = (k - FLEXNIC_PL_FLOWHT_NBSZ) % FLEXNIC_PL_FLOWHT_ENTRIES;
-    for (; i != k; i = (i + 1) % FLEXNIC_PL_FLOWHT_ENTRIES) {
-      assert((hte[i].flow_id & FLEXNIC_PL_FLOWHTE_VALID) != 0);
-
-      /* calculate how much further this element can be moved */
-      d = (hte[i].flow_id >> FLEXNIC_PL_FLOWHTE_POSSHIFT) &
-          (FLEXNIC_PL_FLOWHT_NBSZ - 1);
-      d = FLEXNIC_PL_FLOWHT_NBSZ - 1 - d;
-
-      /* check whether element can be moved */
-      if ((k - i) % FLEXNIC_PL_FLOWHT_ENTRIES <= d) {
-        break;
+  /* breadth first search for shortest path of moves to an empty slot */
+  for (head = 0; head < n; head++) {
+    b = q[head].b;
+    for (i = 0; i < FLEXNIC_PL_FLOWHT_NBSZ; i++) {
+      /* alternative bucket for this entry */
+      eh = htb[b].flow_hash[i];
+      alt = FLEXNIC_PL_FLOWHT_B1(eh, fp_flowht_num);
+      if (alt == b)
+        alt = FLEXNIC_PL_FLOWHT_B2(eh, fp_flowht_num);
+      if (alt == b)
+        continue;
+
+      if ((j = flow_slot_free(&htb[alt])) < FLEXNIC_PL_FLOWHT_NBSZ)
+        goto found;
+
+      /* buckets on a path have to be distinct */
+      for (c = 0; c < n && q[c].b != alt; c++);
+      if (c == n && n < FLOWHT_BFS_MAX) {
+        q[n].b = alt;
+        q[n].parent = head;
+        q[n].pslot = i;
+        n++;
       }
     }
+  }
 
-    /* abort if none of the elements can be moved */
-    if (i == k) {
-      fprintf(stderr, "flow_slot_alloc: no element could be moved\n");
-      return -1;
-    }
+  fprintf(stderr, "flow_slot_alloc: no empty slot found\n");
+  return -1;
+
+found:
+  /* move entries along the path starting at the empty end, readers that
+   * miss during the moves retry based on the version */
+  fp_state->flowht_version++;
+  MEM_BARRIER();
 
-    /* move element up */
-    assert((hte[k].flow_id & FLEXNIC_PL_FLOWHTE_VALID) == 0);
-    d = (hte[i].flow_id >> FLEXNIC_PL_FLOWHTE_POSSHIFT) &
-        (FLEXNIC_PL_FLOWHT_NBSZ - 1);
+  c = head;
+  for (;;) {
+    src = &htb[q[c].b];
+    dst = &htb[alt];
+    assert((dst->flow_id[j] & FLEXNIC_PL_FLOWHTE_VALID) == 0);
 
     /* write to empty entry first */
-    hte[k].flow_hash = hte[i].flow_hash;
+    dst->flow_hash[j] = src->flow_hash[i];
     MEM_BARRIER();
-    hte[k].flow_id = FLEXNIC_PL_FLOWHTE_VALID |
-        (d << FLEXNIC_PL_FLOWHTE_POSSHIFT) |
-        (((1 << FLEXNIC_PL_FLOWHTE_POSSHIFT) - 1) & hte[i].flow_id);
+    dst->flow_id[j] = src->flow_id[i];
     MEM_BARRIER();
 
     /* empty original position */
-    hte[i].flow_id = 0;
+    src->flow_id[i] = 0;
     MEM_BARRIER();
+
+    if (q[c].parent < 0)
+      break;
+
+    /* entry from parent bucket moves into the slot we just freed */
+    alt = q[c].b;
+    j = i;
+    i = q[c].pslot;
+    c = q[c].parent;
   }
 
+  MEM_BARRIER();
+  fp_state->flowht_version++;
+
+  *pb = q[c].b;
   *pi = i;
-  *pd = (i - j) % FLEXNIC_PL_FLOWHT_ENTRIES;
   return 0;
 }
 
 static inline int flow_slot_clear(uint32_t f_id, ip_addr_t lip, beui16_t lp,
     ip_addr_t rip, beui16_t rp)
 {
-  uint32_t h, k, j, ffid, eh;
-  struct flextcp_pl_flowhte *e;
+  uint32_t h, j, k, ffid;
+  struct flextcp_pl_flowhtb *htb;
 
   h = flow_hash(lip, lp, rip, rp);
 
-  for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
-    k = (h + j) % FLEXNIC_PL_FLOWHT_ENTRIES;
-    e = &fp_state->flowht[k];
-
-    ffid = e->flow_id;
-    MEM_BARRIER();
-    eh = e->flow_hash;
+  for (k = 0; k < 2; k++) {
+    htb = &fp_flowht[k == 0 ? FLEXNIC_PL_FLOWHT_B1(h, fp_flowht_num) :
+        FLEXNIC_PL_FLOWHT_B2(h, fp_flowht_num)];
 
-    if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0 || eh != h) {
-      continue;
-    }
+    for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
+      ffid = htb->flow_id[j];
+      if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0 || htb->flow_hash[j] != h) {
+        continue;
+      }
 
-    if ((ffid & ((1 << FLEXNIC_PL_FLOWHTE_POSSHIFT) - 1)) == f_id) {
-      e->flow_id &= ~FLEXNIC_PL_FLOWHTE_VALID;
-      return 0;
+      if ((ffid & FLEXNIC_PL_FLOWHTE_IDMASK) == f_id) {
+        htb->flow_id[j] = 0;
+        return 0;
+      }
     }
   }
 
@@ -718,39 +1151,57 @@ static inline int flow_slot_clear(uint32_t f_id, ip_addr_t lip, beui16_t lp,
   return -1;
 }
 
-static void flow_id_alloc_init(void)
+static int flow_id_alloc_init(void)
 {
-  size_t i;
-  struct flow_id_item *it, *prev = NULL;
-  for (i = 0; i < FLEXNIC_PL_FLOWST_NUM; i++) {
-    it = &flow_id_items[i];
-    it->flow_id = i;
-    it->next = NULL;
-
-    if (prev == NULL) {
-      flow_id_freelist = it;
-    } else {
-      prev->next = it;
+  unsigned n;
+
+  for (n = 0; n < shm_numa_nodes; n++) {
+    /* only touched as flows are freed, so this stays mostly unpopulated */
+    if ((flow_id_freestack[n] = malloc(sizeof(*flow_id_freestack[n]) *
+            shm_numa_flows)) == NULL)
+    {
+      fprintf(stderr, "flow_id_alloc_init: malloc failed\n");
+      return -1;
     }
-    prev = it;
+
+    flow_id_freenum[n] = 0;
+    flow_id_next[n] = n * shm_numa_flows;
   }
+  return 0;
 }
 
-static int flow_id_alloc(uint32_t *fid)
+static inline uint32_t flow_id_end(unsigned node)
 {
-  struct flow_id_item *it = flow_id_freelist;
+  return MIN((node + 1) * shm_numa_flows, config.fp_flows);
+}
 
-  if (it == NULL)
-    return -1;
+/* allocate from the range of node, other nodes' ranges if that is full */
+static int flow_id_alloc(unsigned node, uint32_t *fid)
+{
+  unsigned i, n;
 
-  flow_id_freelist = it->next;
-  *fid = it->flow_id;
-  return 0;
+  for (i = 0; i < shm_numa_nodes; i++) {
+    n = (node + i) % shm_numa_nodes;
+
+    if (flow_id_freenum[n] > 0) {
+      *fid = flow_id_freestack[n][--flow_id_freenum[n]];
+      return 0;
+    }
+
+    if (flow_id_next[n] < flow_id_end(n)) {
+      *fid = flow_id_next[n]++;
+      return 0;
+    }
+  }
+
+  return -1;
 }
 
 static void flow_id_free(uint32_t flow_id)
 {
-  struct flow_id_item *it = &flow_id_items[flow_id];
-  it->next = flow_id_freelist;
-  flow_id_freelist = it;
+  unsigned n = flow_id / shm_numa_flows;
+
+  assert(flow_id < flow_id_next[n]);
+  assert(flow_id_freenum[n] < shm_numa_flows);
+  flow_id_freestack[n][flow_id_freenum[n]++] = flow_id;
 }
@@ -24,36 +24,123 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include <tas.h>
 #include "internal.h"
 
+/* Allocations up to a hugepage are served by a buddy allocator with
+ * power-of-two size classes from 4KB to 2MB. Buddy blocks are carved out of
+ * hugepage aligned chunks, so no buffer straddles a hugepage boundary. Larger
+ * allocations are rounded up to whole chunks and taken first-fit from a
+ * sorted list of free chunk runs, which is also where the buddy allocator
+ * gets its chunks from and returns them to once they are completely free. */
+#define PM_PAGE_SHIFT 12
+#define PM_CHUNK_SHIFT 21
+#define PM_CHUNK_SIZE (1ULL << PM_CHUNK_SHIFT)
+#define PM_ORDERS (PM_CHUNK_SHIFT - PM_PAGE_SHIFT + 1)
+/* handle order for allocations taken directly from the chunk runs */
+#define PM_ORDER_RUN 0xff
+#define PM_NONE UINT32_MAX
+
 struct packetmem_handle {
   uintptr_t base;
   size_t len;
+  /* length requested by the caller */
+  size_t req;
+  /* numa node arena the region was allocated from */
+  uint8_t node;
+  /* buddy order, or PM_ORDER_RUN */
+  uint8_t order;
 
   struct packetmem_handle *next;
 };
 
+/* state for each 4KB page in the dma region, only meaningful for the first
+ * page of a buddy block */
+struct pm_page {
+  uint32_t prev;
+  uint32_t next;
+  uint8_t order;
+  uint8_t free;
+};
+
+struct pm_arena {
+  /* free chunk runs, sorted by base */
+  struct packetmem_handle *runs;
+  /* first page of free buddy blocks for each order */
+  uint32_t free_blocks[PM_ORDERS];
+
+  /* stats */
+  /* bytes requested by and handed out to callers */
+  size_t bytes_req;
+  size_t bytes_alloc;
+  /* number of free buddy blocks per order */
+  uint32_t free_num[PM_ORDERS];
+  /* chunks currently split by the buddy allocator */
+  uint32_t chunks_split;
+};
+
 static inline struct packetmem_handle *ph_alloc(void);
 static inline void ph_free(struct packetmem_handle *ph);
-static inline void merge_items(struct packetmem_handle *ph_prev);
+static inline void merge_items(struct packetmem_handle **freelist,
+    struct packetmem_handle *ph_prev);
+static int run_alloc(struct pm_arena *a, size_t length, uintptr_t *base);
+static int run_free(struct pm_arena *a, uintptr_t base, size_t length);
+static int run_reserve(struct pm_arena *a, uintptr_t base, size_t length);
+static int buddy_alloc(struct pm_arena *a, unsigned order, uintptr_t *base);
+static int buddy_reserve(struct pm_arena *a, unsigned order, uintptr_t base);
+static void buddy_free(struct pm_arena *a, uintptr_t base, unsigned order);
+static inline void block_push(struct pm_arena *a, uint32_t idx,
+    unsigned order);
+static inline void block_remove(struct pm_arena *a, uint32_t idx);
 
-static struct packetmem_handle *freelist;
+/* one arena per numa node */
+static struct pm_arena arenas[FLEXNIC_NUMA_MAX];
+static struct pm_page *pages;
+/* arena to start with for allocations without node preference */
+static unsigned node_next;
 
 int packetmem_init(void)
 {
   struct packetmem_handle *ph;
+  uintptr_t start, end;
+  unsigned n, o;
 
-  if ((ph = ph_alloc()) == NULL) {
-    fprintf(stderr, "packetmem_init: ph_alloc failed\n");
+  if ((pages = calloc(tas_info->dma_mem_size >> PM_PAGE_SHIFT,
+          sizeof(*pages))) == NULL)
+  {
+    fprintf(stderr, "packetmem_init: allocating page state failed\n");
     return -1;
   }
 
-  ph->base = 0;
-  ph->len = tas_info->dma_mem_size;
-  ph->next = NULL;
-  freelist = ph;
+  for (n = 0; n < shm_numa_nodes; n++) {
+    for (o = 0; o < PM_ORDERS; o++) {
+      arenas[n].free_blocks[o] = PM_NONE;
+    }
+
+    /* arenas only consist of whole chunks */
+    start = n * shm_numa_dma_size;
+    end = (n == shm_numa_nodes - 1 ? tas_info->dma_mem_size :
+        start + shm_numa_dma_size);
+    start = (start + PM_CHUNK_SIZE - 1) & ~(PM_CHUNK_SIZE - 1);
+    end &= ~(PM_CHUNK_SIZE - 1);
+    if (start >= end) {
+      continue;
+    }
+
+    if ((ph = ph_alloc()) == NULL) {
+      fprintf(stderr, "packetmem_init: ph_alloc failed\n");
+      return -1;
+    }
+
+    ph->base = start;
+    ph->len = ph->req = end - start;
+    ph->node = n;
+    ph->order = PM_ORDER_RUN;
+    ph->next = NULL;
+    arenas[n].runs = ph;
+  }
 
   return 0;
 }
@@ -61,11 +148,181 @@ int packetmem_init(void)
 int packetmem_alloc(size_t length, uintptr_t *off,
     struct packetmem_handle **handle)
 {
-  struct packetmem_handle *ph, *ph_prev, *ph_new;
+  return packetmem_alloc_node(length, -1, off, handle);
+}
+
+int packetmem_alloc_node(size_t length, int node, uintptr_t *off,
+    struct packetmem_handle **handle)
+{
+  struct packetmem_handle *ph;
+  struct pm_arena *a;
+  unsigned i, n, order;
+  size_t alloc_len;
+  uintptr_t base;
+  int ret;
+
+  if (node < 0 || (unsigned) node >= shm_numa_nodes) {
+    /* spread allocations without preference over the arenas */
+    n = node_next;
+    node_next = (node_next + 1) % shm_numa_nodes;
+  } else {
+    n = node;
+  }
+
+  /* size class */
+  if (length <= PM_CHUNK_SIZE) {
+    for (order = 0; (1ULL << (order + PM_PAGE_SHIFT)) < length; order++);
+    alloc_len = 1ULL << (order + PM_PAGE_SHIFT);
+  } else {
+    order = PM_ORDER_RUN;
+    alloc_len = (length + PM_CHUNK_SIZE - 1) & ~(PM_CHUNK_SIZE - 1);
+  }
+
+  if ((ph = ph_alloc()) == NULL) {
+    fprintf(stderr, "packetmem_alloc: ph_alloc failed\n");
+    return -1;
+  }
+
+  /* fall back to the other arenas if the preferred one is full */
+  for (i = 0; i < shm_numa_nodes; i++) {
+    a = &arenas[(n + i) % shm_numa_nodes];
+    if (order == PM_ORDER_RUN) {
+      ret = run_alloc(a, alloc_len, &base);
+    } else {
+      ret = buddy_alloc(a, order, &base);
+    }
+
+    if (ret == 0) {
+      a->bytes_req += length;
+      a->bytes_alloc += alloc_len;
+
+      ph->base = base;
+      ph->len = alloc_len;
+      ph->req = length;
+      ph->node = (n + i) % shm_numa_nodes;
+      ph->order = order;
+      ph->next = NULL;
+
+      *handle = ph;
+      *off = base;
+      return 0;
+    }
+  }
+
+  ph_free(ph);
+  return -1;
+}
+
+int packetmem_reserve(uintptr_t off, size_t length,
+    struct packetmem_handle **handle)
+{
+  struct packetmem_handle *ph;
+  struct pm_arena *a;
+  unsigned n, order;
+  size_t alloc_len;
+  int ret;
+
+  /* same size class as packetmem_alloc_node */
+  if (length <= PM_CHUNK_SIZE) {
+    for (order = 0; (1ULL << (order + PM_PAGE_SHIFT)) < length; order++);
+    alloc_len = 1ULL << (order + PM_PAGE_SHIFT);
+  } else {
+    order = PM_ORDER_RUN;
+    alloc_len = (length + PM_CHUNK_SIZE - 1) & ~(PM_CHUNK_SIZE - 1);
+  }
+
+  if ((off & (MIN(alloc_len, PM_CHUNK_SIZE) - 1)) != 0 ||
+      off + alloc_len > tas_info->dma_mem_size)
+  {
+    fprintf(stderr, "packetmem_reserve: invalid region %"PRIxPTR"+%zu\n",
+        off, length);
+    return -1;
+  }
+
+  n = MIN(off / shm_numa_dma_size, shm_numa_nodes - 1);
+  a = &arenas[n];
+
+  if ((ph = ph_alloc()) == NULL) {
+    fprintf(stderr, "packetmem_reserve: ph_alloc failed\n");
+    return -1;
+  }
+
+  if (order == PM_ORDER_RUN) {
+    ret = run_reserve(a, off, alloc_len);
+  } else {
+    ret = buddy_reserve(a, order, off);
+  }
+  if (ret != 0) {
+    ph_free(ph);
+    return -1;
+  }
+
+  a->bytes_req += length;
+  a->bytes_alloc += alloc_len;
+
+  ph->base = off;
+  ph->len = alloc_len;
+  ph->req = length;
+  ph->node = n;
+  ph->order = order;
+  ph->next = NULL;
+  *handle = ph;
+  return 0;
+}
+
+void packetmem_free(struct packetmem_handle *handle)
+{
+  struct pm_arena *a = &arenas[handle->node];
+
+  a->bytes_alloc -= handle->len;
+  a->bytes_req -= handle->req;
+  if (handle->order == PM_ORDER_RUN) {
+    if (run_free(a, handle->base, handle->len) != 0) {
+      fprintf(stderr, "packetmem_free: run_free failed, leaking memory\n");
+    }
+  } else {
+    buddy_free(a, handle->base, handle->order);
+  }
+  ph_free(handle);
+}
+
+void packetmem_dump_stats(void)
+{
+  struct packetmem_handle *ph;
+  struct pm_arena *a;
+  size_t run_bytes, run_max, buddy_bytes;
+  unsigned n, o, runs;
+
+  for (n = 0; n < shm_numa_nodes; n++) {
+    a = &arenas[n];
+
+    runs = 0;
+    run_bytes = run_max = 0;
+    for (ph = a->runs; ph != NULL; ph = ph->next) {
+      runs++;
+      run_bytes += ph->len;
+      run_max = MAX(run_max, ph->len);
+    }
+
+    buddy_bytes = 0;
+    for (o = 0; o < PM_ORDERS; o++) {
+      buddy_bytes += (size_t) a->free_num[o] << (o + PM_PAGE_SHIFT);
+    }
+
+    printf("packetmem[%u]: alloc=%zu req=%zu buddy_chunks=%u buddy_free=%zu "
+        "runs=%u run_free=%zu run_max=%zu\n", n, a->bytes_alloc, a->bytes_req,
+        a->chunks_split, buddy_bytes, runs, run_bytes, run_max);
+  }
+}
+
+/** Allocate from free chunk runs, first fit. */
+static int run_alloc(struct pm_arena *a, size_t length, uintptr_t *base)
+{
+  struct packetmem_handle *ph, *ph_prev;
 
   /* look for first fit */
   ph_prev = NULL;
-  ph = freelist;
+  ph = a->runs;
   while (ph != NULL && ph->len < length) {
     ph_prev = ph;
     ph = ph->next;
@@ -76,69 +333,242 @@ int packetmem_alloc(size_t length, uintptr_t *off,
     return -1;
   }
 
+  *base = ph->base;
   if (ph->len == length) {
-    /* simple case, don't need to split this handle */
-
-    /* pointer to previous next pointer for removal */
+    /* simple case, remove the whole run */
     if (ph_prev == NULL) {
-      freelist = ph->next;
+      a->runs = ph->next;
     } else {
       ph_prev->next = ph->next;
     }
-
-    ph_new = ph;
+    ph_free(ph);
   } else {
-    /* need to split */
-
-    /* new packetmem handle for splitting */
-    if ((ph_new = ph_alloc()) == NULL) {
-      fprintf(stderr, "packetmem_alloc: ph_alloc failed\n");
-      return -1;
-    }
-
-    ph_new->base = ph->base;
-    ph_new->len = length;
-    ph_new->next = NULL;
-
     ph->base += length;
     ph->len -= length;
   }
 
-  *handle = ph_new;
-  *off = ph_new->base;
-
   return 0;
 }
 
-void packetmem_free(struct packetmem_handle *handle)
+/** Return region to the free chunk runs. */
+static int run_free(struct pm_arena *a, uintptr_t base, size_t length)
 {
-  struct packetmem_handle *ph, *ph_prev;
+  struct packetmem_handle *ph, *ph_prev, *ph_new;
 
-  /* look for first successor */
+  if ((ph_new = ph_alloc()) == NULL) {
+    return -1;
+  }
+  ph_new->base = base;
+  ph_new->len = length;
+  ph_new->req = length;
+  ph_new->node = a - arenas;
+  ph_new->order = PM_ORDER_RUN;
+
+  /* look for last predecessor */
   ph_prev = NULL;
-  ph = freelist;
-  while (ph != NULL && ph->next != NULL && ph->next->base < handle->base) {
+  ph = a->runs;
+  while (ph != NULL && ph->base < base) {
     ph_prev = ph;
     ph = ph->next;
   }
 
   /* add to list */
+  ph_new->next = ph;
   if (ph_prev == NULL) {
-    handle->next = freelist;
-    freelist = handle;
+    a->runs = ph_new;
   } else {
-    handle->next = ph_prev->next;
-    ph_prev->next = handle;
+    ph_prev->next = ph_new;
   }
 
   /* merge items if necessary */
-  merge_items(ph_prev);
+  merge_items(&a->runs, ph_prev);
+  return 0;
+}
+
+/** Remove [base, base + length) from the free run containing it. */
+static int run_reserve(struct pm_arena *a, uintptr_t base, size_t length)
+{
+  struct packetmem_handle *ph, *ph_prev, *ph_new;
+
+  ph_prev = NULL;
+  ph = a->runs;
+  while (ph != NULL && ph->base + ph->len <= base) {
+    ph_prev = ph;
+    ph = ph->next;
+  }
+
+  if (ph == NULL || ph->base > base || ph->base + ph->len < base + length) {
+    return -1;
+  }
+
+  if (ph->base == base && ph->len == length) {
+    if (ph_prev == NULL) {
+      a->runs = ph->next;
+    } else {
+      ph_prev->next = ph->next;
+    }
+    ph_free(ph);
+  } else if (ph->base == base) {
+    ph->base += length;
+    ph->len -= length;
+  } else if (ph->base + ph->len == base + length) {
+    ph->len -= length;
+  } else {
+    /* split run around the reserved region */
+    if ((ph_new = ph_alloc()) == NULL) {
+      return -1;
+    }
+    ph_new->base = base + length;
+    ph_new->len = ph->base + ph->len - ph_new->base;
+    ph_new->req = ph_new->len;
+    ph_new->node = ph->node;
+    ph_new->order = PM_ORDER_RUN;
+    ph_new->next = ph->next;
+    ph->len = base - ph->base;
+    ph->next = ph_new;
+  }
+
+  return 0;
+}
+
+static int buddy_alloc(struct pm_arena *a, unsigned order, uintptr_t *base)
+{
+  unsigned o;
+  uint32_t idx;
+  uintptr_t chunk;
+
+  /* smallest free block that fits */
+  for (o = order; o < PM_ORDERS && a->free_blocks[o] == PM_NONE; o++);
+
+  if (o == PM_ORDERS) {
+    /* none left, split a new chunk */
+    if (run_alloc(a, PM_CHUNK_SIZE, &chunk) != 0) {
+      return -1;
+    }
+    a->chunks_split++;
+    idx = chunk >> PM_PAGE_SHIFT;
+    o = PM_ORDERS - 1;
+  } else {
+    idx = a->free_blocks[o];
+    block_remove(a, idx);
+  }
+
+  /* split down to the requested size, upper halves remain free */
+  while (o > order) {
+    o--;
+    block_push(a, idx + (1U << o), o);
+  }
+
+  pages[idx].order = order;
+  pages[idx].free = 0;
+  *base = (uintptr_t) idx << PM_PAGE_SHIFT;
+  return 0;
+}
+
+/** Take the block of order at base, splitting the free block containing it */
+static int buddy_reserve(struct pm_arena *a, unsigned order, uintptr_t base)
+{
+  uint32_t idx = base >> PM_PAGE_SHIFT, blk = 0;
+  uintptr_t chunk = base & ~(PM_CHUNK_SIZE - 1);
+  unsigned o;
+
+  /* chunk still unsplit, carve it out of the runs first */
+  if (run_reserve(a, chunk, PM_CHUNK_SIZE) == 0) {
+    a->chunks_split++;
+    block_push(a, chunk >> PM_PAGE_SHIFT, PM_ORDERS - 1);
+  }
+
+  /* smallest free block containing the region */
+  for (o = order; o < PM_ORDERS; o++) {
+    blk = idx & ~((1U << o) - 1);
+    if (pages[blk].free && pages[blk].order == o)
+      break;
+  }
+  if (o == PM_ORDERS) {
+    return -1;
+  }
+  block_remove(a, blk);
+
+  /* split down, halves not containing the region remain free */
+  while (o > order) {
+    o--;
+    if ((idx & (1U << o)) != 0) {
+      block_push(a, blk, o);
+      blk += 1U << o;
+    } else {
+      block_push(a, blk + (1U << o), o);
+    }
+  }
+
+  pages[idx].order = order;
+  pages[idx].free = 0;
+  return 0;
+}
+
+static void buddy_free(struct pm_arena *a, uintptr_t base, unsigned order)
+{
+  uint32_t idx = base >> PM_PAGE_SHIFT, buddy;
+
+  /* chunks are aligned, so buddies are found by flipping the order bit */
+  while (order < PM_ORDERS - 1) {
+    buddy = idx ^ (1U << order);
+    if (!pages[buddy].free || pages[buddy].order != order) {
+      break;
+    }
+    block_remove(a, buddy);
+    idx &= ~(1U << order);
+    order++;
+  }
+
+  if (order == PM_ORDERS - 1) {
+    /* whole chunk is free again, make it available for large allocations */
+    pages[idx].free = 0;
+    if (run_free(a, (uintptr_t) idx << PM_PAGE_SHIFT, PM_CHUNK_SIZE) == 0) {
+      a->chunks_split--;
+      return;
+    }
+  }
+
+  block_push(a, idx, order);
+}
+
+static inline void block_push(struct pm_arena *a, uint32_t idx,
+    unsigned order)
+{
+  struct pm_page *pg = &pages[idx];
+
+  pg->order = order;
+  pg->free = 1;
+  pg->prev = PM_NONE;
+  pg->next = a->free_blocks[order];
+  if (pg->next != PM_NONE) {
+    pages[pg->next].prev = idx;
+  }
+  a->free_blocks[order] = idx;
+  a->free_num[order]++;
+}
+
+static inline void block_remove(struct pm_arena *a, uint32_t idx)
+{
+  struct pm_page *pg = &pages[idx];
+
+  if (pg->prev == PM_NONE) {
+    a->free_blocks[pg->order] = pg->next;
+  } else {
+    pages[pg->prev].next = pg->next;
+  }
+  if (pg->next != PM_NONE) {
+    pages[pg->next].prev = pg->prev;
+  }
+  pg->free = 0;
+  a->free_num[pg->order]--;
 }
 
 /** Merge handles around newly inserted item (pointer to predecessor or NULL
  * passed).
  */
-static inline void merge_items(struct packetmem_handle *ph_prev)
+static inline void merge_items(struct packetmem_handle **freelist,
+    struct packetmem_handle *ph_prev)
 {
   struct packetmem_handle *ph, *ph_next;
 
@@ -153,7 +583,7 @@ static inline void merge_items(struct packetmem_handle *ph_prev)
       ph = ph_prev;
     }
   } else {
-    ph = freelist;
+    ph = *freelist;
   }
 
   /* try to merge with successor if there is one */
@@ -0,0 +1,287 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @brief Fast restart: taking over state of a previous instance.
+ * @file restart.c
+ *
+ * With --fast-restart the shared memory regions are kept when TAS exits, and
+ * a new instance with the same memory layout maps them again without clearing
+ * them (see shm_preinit()). The fast path keeps serving flows from the flow
+ * state and app queues in shared memory. The slow path rebuilds its own state
+ * from there: app contexts from the records in the #RESTART_NAME region,
+ * established connections from the flow table. Memory and flow ids used by
+ * them are reserved here before anything else is allocated.
+ *
+ * Listeners and connections still in the handshake only live in slow path
+ * memory and are not carried over. Applications notice the restart through
+ * flexnic_info.restart_gen and reattach their contexts, see appif.c.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include <tas.h>
+#include "internal.h"
+#include "appif.h"
+
+#define RESTART_MAGIC 0x5441535253540001ULL
+
+struct restart_region {
+  uint64_t magic;
+  struct restart_ctx ctxs[RESTART_CTX_NUM];
+};
+
+/* memory reserved for a context taken over */
+struct restart_ctx_mem {
+  struct packetmem_handle *kin;
+  struct packetmem_handle *kout;
+  struct packetmem_handle *rxq[FLEXNIC_PL_APPST_CTX_MCS];
+  struct packetmem_handle *txq[FLEXNIC_PL_APPST_CTX_MCS];
+  struct app_context *ctx;
+  uint8_t reserved;
+  volatile uint8_t claimed;
+};
+
+/* flow taken over, until rebuilt in tcp_init() */
+struct restart_flow {
+  uint32_t flow_id;
+  struct packetmem_handle *rx;
+  struct packetmem_handle *tx;
+};
+
+static int ctx_reserve(uint16_t db);
+static void ctx_release(struct restart_ctx_mem *m);
+static int flows_reserve(void);
+
+static struct restart_region *region;
+static struct restart_ctx_mem ctx_mem[RESTART_CTX_NUM];
+static struct restart_flow *flows = NULL;
+static unsigned flows_num = 0;
+
+int restart_init(void)
+{
+  uint16_t db;
+
+  if ((region = shm_create_persist(RESTART_NAME, sizeof(*region))) == NULL) {
+    fprintf(stderr, "restart_init: mapping record region failed\n");
+    return -1;
+  }
+
+  if (!shm_reattached || region->magic != RESTART_MAGIC) {
+    memset(region, 0, sizeof(*region));
+    region->magic = RESTART_MAGIC;
+    return 0;
+  }
+
+  for (db = 1; db < RESTART_CTX_NUM; db++) {
+    if (!region->ctxs[db].valid)
+      continue;
+
+    if (ctx_reserve(db) != 0) {
+      fprintf(stderr, "restart_init: reserving memory for context %u "
+          "failed, dropping it\n", db);
+      region->ctxs[db].valid = 0;
+    }
+  }
+
+  return flows_reserve();
+}
+
+struct restart_ctx *restart_ctx_rec(uint16_t db)
+{
+  assert(db < RESTART_CTX_NUM);
+  return &region->ctxs[db];
+}
+
+int restart_ctx_take(uint16_t db, struct app_context *ctx)
+{
+  struct restart_ctx_mem *m;
+  uint16_t i;
+
+  if (db >= RESTART_CTX_NUM || !(m = &ctx_mem[db])->reserved)
+    return -1;
+
+  ctx->kin_handle = m->kin;
+  ctx->kout_handle = m->kout;
+  for (i = 0; i < tas_info->cores_num; i++) {
+    ctx->handles[i].rxq = m->rxq[i];
+    ctx->handles[i].txq = m->txq[i];
+  }
+  return 0;
+}
+
+void restart_ctx_set(uint16_t db, struct app_context *ctx)
+{
+  ctx_mem[db].ctx = ctx;
+}
+
+struct app_context *restart_ctx_lookup(uint16_t db)
+{
+  if (db >= RESTART_CTX_NUM)
+    return NULL;
+  return ctx_mem[db].ctx;
+}
+
+struct app_context *restart_ctx_claim(uint16_t db)
+{
+  if (db >= RESTART_CTX_NUM || ctx_mem[db].ctx == NULL ||
+      ctx_mem[db].claimed)
+  {
+    return NULL;
+  }
+
+  ctx_mem[db].claimed = 1;
+  return ctx_mem[db].ctx;
+}
+
+unsigned restart_flows_num(void)
+{
+  return flows_num;
+}
+
+void restart_flow(unsigned i, uint32_t *f_id, struct packetmem_handle **rx,
+    struct packetmem_handle **tx)
+{
+  assert(i < flows_num);
+  *f_id = flows[i].flow_id;
+  *rx = flows[i].rx;
+  *tx = flows[i].tx;
+}
+
+void restart_done(void)
+{
+  free(flows);
+  flows = NULL;
+  flows_num = 0;
+}
+
+static int ctx_reserve(uint16_t db)
+{
+  struct restart_ctx *rc = &region->ctxs[db];
+  struct restart_ctx_mem *m = &ctx_mem[db];
+  uint16_t i;
+
+  memset(m, 0, sizeof(*m));
+  if (packetmem_reserve(rc->kin_off, rc->kin_size, &m->kin) != 0 ||
+      packetmem_reserve(rc->kout_off, rc->kout_size, &m->kout) != 0)
+  {
+    goto error;
+  }
+
+  for (i = 0; i < tas_info->cores_num; i++) {
+    if (packetmem_reserve(rc->rxq_off[i], rc->rxq_len, &m->rxq[i]) != 0 ||
+        packetmem_reserve(rc->txq_off[i], rc->txq_len, &m->txq[i]) != 0)
+    {
+      goto error;
+    }
+  }
+
+  m->reserved = 1;
+  return 0;
+
+error:
+  ctx_release(m);
+  return -1;
+}
+
+static void ctx_release(struct restart_ctx_mem *m)
+{
+  uint16_t i;
+
+  if (m->kin != NULL)
+    packetmem_free(m->kin);
+  if (m->kout != NULL)
+    packetmem_free(m->kout);
+  for (i = 0; i < tas_info->cores_num; i++) {
+    if (m->rxq[i] != NULL)
+      packetmem_free(m->rxq[i]);
+    if (m->txq[i] != NULL)
+      packetmem_free(m->txq[i]);
+  }
+  memset(m, 0, sizeof(*m));
+}
+
+/* established connections are the valid entries in the flow table */
+static int flows_reserve(void)
+{
+  struct flextcp_pl_flowhtb *htb;
+  struct flextcp_pl_flowst *fs;
+  struct restart_flow *f;
+  uint32_t b, j, ffid, f_id;
+  unsigned dropped = 0;
+
+  if ((flows = malloc(sizeof(*flows) * config.fp_flows)) == NULL) {
+    fprintf(stderr, "flows_reserve: malloc failed\n");
+    return -1;
+  }
+
+  for (b = 0; b < fp_flowht_num; b++) {
+    htb = &fp_flowht[b];
+    for (j = 0; j < FLEXNIC_PL_FLOWHT_NBSZ; j++) {
+      ffid = htb->flow_id[j];
+      if ((ffid & FLEXNIC_PL_FLOWHTE_VALID) == 0)
+        continue;
+
+      f_id = ffid & FLEXNIC_PL_FLOWHTE_IDMASK;
+      if (f_id >= config.fp_flows) {
+        htb->flow_id[j] = 0;
+        dropped++;
+        continue;
+      }
+
+      fs = &fp_state->flowst[f_id];
+      f = &flows[flows_num];
+      f->flow_id = f_id;
+      f->rx = f->tx = NULL;
+      if (fs->db_id >= RESTART_CTX_NUM || !ctx_mem[fs->db_id].reserved ||
+          nicif_flow_reserve(f_id) != 0)
+      {
+        nicif_flow_drop(f_id);
+        dropped++;
+        continue;
+      }
+
+      if (packetmem_reserve(fs->rx_base_sp & FLEXNIC_PL_FLOWST_RX_MASK,
+            fs->rx_len, &f->rx) != 0 ||
+          packetmem_reserve(fs->tx_base, fs->tx_len, &f->tx) != 0)
+      {
+        /* id stays reserved, the flow state could still be in use */
+        if (f->rx != NULL)
+          packetmem_free(f->rx);
+        nicif_flow_drop(f_id);
+        dropped++;
+        continue;
+      }
+
+      flows_num++;
+    }
+  }
+
+  fprintf(stderr, "restart: took over %u flows, dropped %u\n", flows_num,
+      dropped);
+  return 0;
+}
@@ -24,10 +24,25 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <tas.h>
 #include "internal.h"
 
+/*
+ * Longest prefix match with a three level DIR-16-8-8 table: the first level
+ * is indexed by the top 16 bits of the address, prefixes longer than 16 (24)
+ * bits expand into 256 entry groups for the next 8 bits. Lookups touch at
+ * most three entries, independent of the number of routes.
+ *
+ * Entries hold the route index + 1, 0 if no route matches, or a group index
+ * with LPM_GROUP_FLAG set.
+ */
+#define LPM_L1_BITS 16
+#define LPM_GROUP_BITS 8
+#define LPM_GROUP_SIZE (1U << LPM_GROUP_BITS)
+#define LPM_GROUP_FLAG (1U << 31)
+
 /** Routing table entry */
 struct routing_table_entry {
   /** Destination IP address */
@@ -36,75 +51,150 @@ struct routing_table_entry {
   uint32_t dest_mask;
   /** Next hop IP address */
   uint32_t next_hop;
+  /** Egress port index, -1 if not fixed */
+  int16_t port;
+  /** Destination prefix length */
+  uint8_t prefix_len;
 };
 
 static inline uint32_t prefix_len_mask(uint8_t len);
 static inline struct routing_table_entry *resolve(uint32_t ip);
+static inline int next_hop(uint32_t *ip, int *port);
+static int route_add(uint32_t ip, uint8_t prefix, uint32_t next_hop,
+    int16_t port);
+static int lpm_insert(uint32_t idx);
+static int lpm_rebuild(void);
 
 /** Routing table */
 static struct routing_table_entry *routing_table = NULL;
 static size_t routing_table_len = 0;
+static size_t routing_table_max = 0;
+
+/** LPM first level, indexed by top 16 bits */
+static uint32_t *lpm_l1 = NULL;
+/** LPM groups for the second and third level */
+static uint32_t (*lpm_groups)[LPM_GROUP_SIZE] = NULL;
+static uint32_t lpm_groups_num = 0;
+static uint32_t lpm_groups_max = 0;
 
 int routing_init(void)
 {
   struct config_route *cr;
-  size_t i;
-  uint32_t mask;
 
-  /* count number of entries to be added */
-  routing_table_len = 1;
-  for (cr = config.routes; cr != NULL; routing_table_len++, cr = cr->next);
-
-  /* allocate table */
-  if ((routing_table = calloc(routing_table_len, sizeof(*routing_table)))
-      == NULL)
-  {
-    fprintf(stderr, "routing_init: allocating routing table failed\n");
+  if ((lpm_l1 = calloc(1 << LPM_L1_BITS, sizeof(*lpm_l1))) == NULL) {
+    fprintf(stderr, "routing_init: allocating lpm table failed\n");
     return -1;
   }
 
   /* first fill in network route based on ip and prefix */
-  mask = prefix_len_mask(config.ip_prefix);
-  routing_table[0].dest_ip = config.ip & mask;
-  routing_table[0].dest_mask = mask;
-  routing_table[0].next_hop = 0;
+  if (route_add(config.ip & prefix_len_mask(config.ip_prefix),
+        config.ip_prefix, 0, -1) != 0)
+  {
+    fprintf(stderr, "routing_init: adding local network route failed\n");
+    return -1;
+  }
 
   /* fill in routing table */
-  for (i = 1, cr = config.routes; cr != NULL; i++, cr = cr->next) {
-    mask = prefix_len_mask(cr->ip_prefix);
-    if ((mask & cr->ip) != cr->ip) {
-      fprintf(stderr, "routing_init: mask removes non-0 bits "
-          "(d=%x m=%x n=%x)\n", cr->ip, mask, cr->next_hop_ip);
+  for (cr = config.routes; cr != NULL; cr = cr->next) {
+    if (route_add(cr->ip, cr->ip_prefix, cr->next_hop_ip, cr->port) != 0) {
+      fprintf(stderr, "routing_init: adding route failed\n");
       return -1;
     }
+  }
 
-    routing_table[i].dest_ip = cr->ip;
-    routing_table[i].dest_mask = mask;
-    routing_table[i].next_hop = cr->next_hop_ip;
+  return 0;
+}
+
+int routing_add(uint32_t ip, uint8_t prefix, uint32_t next_hop_ip,
+    int16_t port)
+{
+  return route_add(ip, prefix, next_hop_ip, port);
+}
+
+int routing_remove(uint32_t ip, uint8_t prefix)
+{
+  size_t i;
+
+  for (i = 0; i < routing_table_len; i++) {
+    if (routing_table[i].dest_ip == ip &&
+        routing_table[i].prefix_len == prefix)
+    {
+      break;
+    }
+  }
+
+  if (i == routing_table_len) {
+    fprintf(stderr, "routing_remove: no route for %08x/%u\n", ip, prefix);
+    return -1;
+  }
+
+  /* route indices change, so the lookup table has to be rebuilt */
+  routing_table[i] = routing_table[--routing_table_len];
+  if (lpm_rebuild() != 0) {
+    fprintf(stderr, "routing_remove: rebuilding lpm table failed\n");
+    return -1;
   }
 
   return 0;
 }
 
 int routing_resolve(struct nicif_completion *comp, uint32_t ip, uint64_t *mac)
+{
+  int port;
+
+  if (next_hop(&ip, &port) != 0) {
+    fprintf(stderr, "routing_resolve: routing failed\n");
+    return -1;
+  }
+
+  return  arp_request(comp, ip, port, mac);
+}
+
+uint8_t routing_port(uint32_t ip, uint16_t remote_port, uint16_t local_port)
+{
+  uint32_t h;
+  int port;
+
+  /* bonded: spread connections over all ports */
+  if (config.fp_bond) {
+    h = ip ^ (ip >> 16) ^ remote_port ^ ((uint32_t) local_port << 3);
+    return (h ^ (h >> 8)) % net_ports_num;
+  }
+
+  if (next_hop(&ip, &port) != 0) {
+    return 0;
+  }
+
+  return (port >= 0 ? port : arp_port(ip));
+}
+
+/** Follow routes to next hop, port is set from the first route fixing it */
+static inline int next_hop(uint32_t *ip, int *port)
 {
   struct routing_table_entry *rte;
+  size_t hops;
 
-  while (1) {
-    rte = resolve(ip);
+  *port = -1;
+  /* a route loop can't visit more routes than there are */
+  for (hops = 0; hops <= routing_table_len; hops++) {
+    rte = resolve(*ip);
     if (rte == NULL) {
-      fprintf(stderr, "routing_resolve: routing failed\n");
       return -1;
     }
 
+    if (*port < 0) {
+      *port = rte->port;
+    }
+
     if (rte->next_hop == 0) {
-      break;
+      return 0;
     }
 
-    ip = rte->next_hop;
+    *ip = rte->next_hop;
   }
 
-  return  arp_request(comp, ip, mac);
+  fprintf(stderr, "next_hop: routing loop\n");
+  return -1;
 }
 
 static inline uint32_t prefix_len_mask(uint8_t len)
@@ -114,13 +204,182 @@ static inline uint32_t prefix_len_mask(uint8_t len)
 
 static inline struct routing_table_entry *resolve(uint32_t ip)
 {
-  size_t i;
+  uint32_t e;
+
+  e = lpm_l1[ip >> LPM_L1_BITS];
+  if ((e & LPM_GROUP_FLAG) != 0) {
+    e = lpm_groups[e & ~LPM_GROUP_FLAG][(ip >> 8) & 0xff];
+    if ((e & LPM_GROUP_FLAG) != 0) {
+      e = lpm_groups[e & ~LPM_GROUP_FLAG][ip & 0xff];
+    }
+  }
+
+  return (e != 0 ? &routing_table[e - 1] : NULL);
+}
+
+/** Validate and append route to table, then add it to the lookup table */
+static int route_add(uint32_t ip, uint8_t prefix, uint32_t next_hop,
+    int16_t port)
+{
+  struct routing_table_entry *rt;
+  size_t i, max;
+
+  if (prefix > 32) {
+    fprintf(stderr, "route_add: invalid prefix length %u\n", prefix);
+    return -1;
+  }
+  if ((prefix_len_mask(prefix) & ip) != ip) {
+    fprintf(stderr, "route_add: mask removes non-0 bits "
+        "(d=%x m=%x n=%x)\n", ip, prefix_len_mask(prefix), next_hop);
+    return -1;
+  }
+  if (port >= (int) net_ports_num) {
+    fprintf(stderr, "route_add: route port %d does not exist\n", port);
+    return -1;
+  }
 
   for (i = 0; i < routing_table_len; i++) {
-    if (routing_table[i].dest_ip == (ip & routing_table[i].dest_mask)) {
-      return &routing_table[i];
+    if (routing_table[i].dest_ip == ip &&
+        routing_table[i].prefix_len == prefix)
+    {
+      fprintf(stderr, "route_add: route for %08x/%u exists\n", ip, prefix);
+      return -1;
+    }
+  }
+
+  if (routing_table_len == routing_table_max) {
+    max = (routing_table_max == 0 ? 16 : routing_table_max * 2);
+    if ((rt = realloc(routing_table, max * sizeof(*rt))) == NULL) {
+      fprintf(stderr, "route_add: allocating routing table failed\n");
+      return -1;
     }
+    routing_table = rt;
+    routing_table_max = max;
+  }
+
+  rt = &routing_table[routing_table_len];
+  rt->dest_ip = ip;
+  rt->dest_mask = prefix_len_mask(prefix);
+  rt->next_hop = next_hop;
+  rt->port = port;
+  rt->prefix_len = prefix;
+
+  if (lpm_insert(routing_table_len) != 0) {
+    return -1;
   }
+  routing_table_len++;
+  return 0;
+}
+
+/** Allocate group with all entries set to e, returns group index or -1 */
+static int64_t lpm_group_alloc(uint32_t e)
+{
+  uint32_t (*g)[LPM_GROUP_SIZE];
+  uint32_t i, max;
 
-  return NULL;
+  if (lpm_groups_num == lpm_groups_max) {
+    max = (lpm_groups_max == 0 ? 16 : lpm_groups_max * 2);
+    if ((g = realloc(lpm_groups, max * sizeof(*g))) == NULL) {
+      fprintf(stderr, "lpm_group_alloc: realloc failed\n");
+      return -1;
+    }
+    lpm_groups = g;
+    lpm_groups_max = max;
+  }
+
+  for (i = 0; i < LPM_GROUP_SIZE; i++) {
+    lpm_groups[lpm_groups_num][i] = e;
+  }
+  return lpm_groups_num++;
+}
+
+/** Entry i in group g, or in the first level if g < 0 */
+static inline uint32_t *lpm_entry(int64_t g, uint32_t i)
+{
+  return (g < 0 ? &lpm_l1[i] : &lpm_groups[g][i]);
+}
+
+/** Return group below entry, splitting the entry into a group if necessary */
+static int64_t lpm_descend(int64_t g, uint32_t i)
+{
+  uint32_t e = *lpm_entry(g, i);
+  int64_t ng;
+
+  if ((e & LPM_GROUP_FLAG) != 0) {
+    return e & ~LPM_GROUP_FLAG;
+  }
+
+  /* group inherits the shorter prefix covering this entry */
+  if ((ng = lpm_group_alloc(e)) < 0) {
+    return -1;
+  }
+  *lpm_entry(g, i) = ng | LPM_GROUP_FLAG;
+  return ng;
+}
+
+/** Point entry and everything below it to route idx, unless covered by a
+ * longer prefix */
+static void lpm_fill(uint32_t *e, uint32_t idx)
+{
+  uint32_t i, g;
+
+  if ((*e & LPM_GROUP_FLAG) != 0) {
+    g = *e & ~LPM_GROUP_FLAG;
+    for (i = 0; i < LPM_GROUP_SIZE; i++) {
+      lpm_fill(&lpm_groups[g][i], idx);
+    }
+  } else if (*e == 0 ||
+      routing_table[*e - 1].prefix_len <= routing_table[idx].prefix_len)
+  {
+    *e = idx + 1;
+  }
+}
+
+/** Add route idx to lookup table */
+static int lpm_insert(uint32_t idx)
+{
+  uint32_t ip = routing_table[idx].dest_ip, first, num, i;
+  uint8_t len = routing_table[idx].prefix_len;
+  int64_t g = -1;
+
+  if (len <= LPM_L1_BITS) {
+    first = ip >> LPM_L1_BITS;
+    num = 1U << (LPM_L1_BITS - len);
+  } else {
+    if ((g = lpm_descend(-1, ip >> LPM_L1_BITS)) < 0) {
+      return -1;
+    }
+
+    if (len <= LPM_L1_BITS + LPM_GROUP_BITS) {
+      first = (ip >> 8) & 0xff;
+      num = 1U << (LPM_L1_BITS + LPM_GROUP_BITS - len);
+    } else {
+      if ((g = lpm_descend(g, (ip >> 8) & 0xff)) < 0) {
+        return -1;
+      }
+      first = ip & 0xff;
+      num = 1U << (32 - len);
+    }
+  }
+
+  for (i = 0; i < num; i++) {
+    lpm_fill(lpm_entry(g, first + i), idx);
+  }
+  return 0;
+}
+
+/** Rebuild lookup table from routing table */
+static int lpm_rebuild(void)
+{
+  size_t i;
+
+  memset(lpm_l1, 0, (1 << LPM_L1_BITS) * sizeof(*lpm_l1));
+  lpm_groups_num = 0;
+
+  for (i = 0; i < routing_table_len; i++) {
+    if (lpm_insert(i) != 0) {
+      return -1;
+    }
+  }
+  return 0;
 }
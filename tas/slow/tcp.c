@@ -31,15 +31,22 @@
 #include <rte_config.h>
 #include <rte_ip.h>
 #include <rte_hash_crc.h>
+#include <emmintrin.h>
 
 #include <tas.h>
 #include <packet_defs.h>
 #include <utils.h>
 #include <utils_rng.h>
 #include "internal.h"
+#include "appif.h"
 
 #define TCP_MSS 1460
-#define TCP_HTSIZE 4096
+/** Connection table: entries per bucket and initial number of buckets */
+#define CONNHT_NBSZ 4
+#define CONNHT_INIT 1024
+/** Bounds for buffer sizes requested by applications */
+#define TCP_BUF_MIN 4096
+#define TCP_BUF_MAX (16 * 1024 * 1024)
 
 #define PORT_MAX ((1u << 16) - 1)
 #define PORT_FIRST_EPH 8192
@@ -49,10 +56,27 @@
 #define PORT_TYPE_LMULTI 0x2ULL
 #define PORT_TYPE_CONN   0x3ULL
 #define PORT_TYPE_MASK   0x3ULL
+/* ports used by outgoing connections hold a count instead of a pointer, the
+ * same local port can be used towards different destinations */
+#define PORT_CONN_ONE    0x4ULL
+
+/* destinations with their own ephemeral port cursor */
+#define PORT_DEST_HTSIZE 1024
 
 /* maximum number of listening sockets per port */
 #define LISTEN_MULTI_MAX 32
 
+/* syn cookie: 5 bit counter of 2^26us periods | ecn | sack | 25 bit keyed
+ * hash. Unlike linux there are no mss or window scale bits: connections
+ * always use TCP_MSS and never negotiate window scaling, cookie or not, so
+ * no other handshake state is lost. */
+#define SYNCOOKIE_CNT_SHIFT 27
+#define SYNCOOKIE_CNT_MASK 0x1fU
+#define SYNCOOKIE_PERIOD_SHIFT 26
+#define SYNCOOKIE_ECN (1U << 26)
+#define SYNCOOKIE_SACK (1U << 25)
+#define SYNCOOKIE_HASH_MASK (SYNCOOKIE_SACK - 1)
+
 #define CONN_DEBUG(c, f, x...) do { } while (0)
 #define CONN_DEBUG0(c, f) do { } while (0)
 /*#define CONN_DEBUG(c, f, x...) fprintf(stderr, "conn(%p): " f, c, x)
@@ -63,24 +87,56 @@ struct listen_multi {
   struct listener *ls[LISTEN_MULTI_MAX];
 };
 
+/**
+ * Bucket of the open addressing connection table, one cache line. Entries are
+ * placed in the first bucket with a free slot starting at the home bucket.
+ */
+struct connht_bucket {
+  /** Hashes of the entries, only meaningful for used slots */
+  uint32_t hash[CONNHT_NBSZ];
+  /** Connections, NULL for free slots */
+  struct connection *conns[CONNHT_NBSZ];
+  /** Entries with a home bucket before this one stored after it */
+  uint32_t overflow;
+} __attribute__((aligned(64)));
+
 struct backlog_slot {
   uint8_t buf[126];
   uint16_t len;
+  /* fast open: copy of the SYN payload, and whether to send a cookie */
+  uint8_t *data;
+  uint16_t data_len;
+  uint8_t tfo_cookie;
+  /* cycle counter when the packet was queued */
+  uint64_t tsc;
 };
 
 struct tcp_opts {
   struct tcp_mss_opt *mss;
   struct tcp_timestamp_opt *ts;
+  struct tcp_sack_perm_opt *sack_perm;
+  struct tcp_fastopen_opt *tfo;
 };
 
 static int conn_arp_done(struct connection *conn);
+static int tcp_packet_check(const struct pkt_tcp *p, uint16_t len,
+    struct tcp_opts *opts);
+static void tcp_packet_dispatch(const struct pkt_tcp *p, uint16_t len,
+    const struct tcp_opts *opts, uint32_t fn_core, uint16_t flow_group);
 static void conn_packet(struct connection *c, const struct pkt_tcp *p,
     const struct tcp_opts *opts, uint32_t fn_core, uint16_t flow_group);
-static inline struct connection *conn_alloc(void);
+static inline struct connection *conn_alloc(int node, uint32_t rx_len,
+    uint32_t tx_len);
 static inline void conn_free(struct connection *conn);
 static void conn_register(struct connection *conn);
 static void conn_unregister(struct connection *conn);
 static struct connection *conn_lookup(const struct pkt_tcp *p);
+static struct connection *conn_lookup_tuple(uint32_t l_ip, uint32_t r_ip,
+    uint16_t l_port, uint16_t r_port);
+static inline void conn_lookup_prefetch(const struct pkt_tcp *p);
+static int connht_resize(uint32_t num);
+static void conn_restore(uint32_t f_id, struct packetmem_handle *rx,
+    struct packetmem_handle *tx);
 static int conn_syn_sent_packet(struct connection *c, const struct pkt_tcp *p,
     const struct tcp_opts *opts);
 static int conn_reg_synack(struct connection *c);
@@ -88,34 +144,107 @@ static void conn_failed(struct connection *c, int status);
 static void conn_timeout_arm(struct connection *c, int type);
 static void conn_timeout_disarm(struct connection *c);
 static void conn_close_timeout(struct connection *c);
+static void conn_close_release(struct connection *c);
+static void conn_close_finish(struct connection *c);
+static int conn_closed_syn(struct connection *c, const struct pkt_tcp *p,
+    const struct tcp_opts *opts);
+static void conn_add_defer(struct connection *c);
+static void conn_add_flush(void);
+static void conn_close_defer(struct connection *c);
+static void conn_close_flush(void);
+static void conn_free_defer(uint32_t flow_id);
+static void conn_free_flush(void);
 
 static struct listener *listener_lookup(const struct pkt_tcp *p);
 static void listener_packet(struct listener *l, const struct pkt_tcp *p,
-    const struct tcp_opts *opts, uint32_t fn_core, uint16_t flow_group);
+    uint16_t pkt_len, const struct tcp_opts *opts, uint32_t fn_core,
+    uint16_t flow_group);
 static void listener_accept(struct listener *l);
-
-static inline uint16_t port_alloc(void);
+static int listener_backlog_add(struct listener *l, const struct pkt_tcp *p,
+    uint16_t len, uint32_t fn_core, uint16_t flow_group, const void *data,
+    uint16_t data_len, int tfo_cookie);
+static int conn_reg_cookie(struct connection *c);
+static void conn_accept_notify(struct connection *c);
+
+static int syncookie_init(void);
+static int syncookie_synack(const struct pkt_tcp *p,
+    const struct tcp_opts *opts);
+static int syncookie_check(const struct pkt_tcp *p);
+static inline void tfo_cookie_gen(uint32_t remote_ip, uint8_t *cookie);
+static inline int tfo_cookie_check(uint32_t remote_ip,
+    const struct tcp_fastopen_opt *opt);
+
+static inline uint16_t port_alloc(uint32_t remote_ip, uint16_t remote_port);
+static inline void port_dest_put(uint32_t ip, uint16_t port, uint32_t n);
+static inline void port_conn_get(struct connection *c);
+static inline void port_conn_put(struct connection *c);
 static inline int send_control(const struct connection *conn, uint16_t flags,
     int ts_opt, uint32_t ts_echo, uint16_t mss_opt);
 static inline int send_reset(const struct pkt_tcp *p,
     const struct tcp_opts *opts);
 static inline int parse_options(const struct pkt_tcp *p, uint16_t len,
     struct tcp_opts *opts);
+static inline void hs_hist_add(unsigned h, uint64_t v);
+
+/** Ephemeral port cursor for connections to one remote ip and port */
+struct port_dest {
+  uint32_t ip;
+  uint16_t port;
+  /* next port to try */
+  uint16_t next;
+  /* connections holding a port towards the destination */
+  uint32_t conns;
+  struct port_dest *ht_next;
+};
 
 static uintptr_t ports[PORT_MAX + 1];
-static uint16_t port_eph_hint = PORT_FIRST_EPH;
+static struct port_dest *port_dests[PORT_DEST_HTSIZE];
 static struct nbqueue conn_async_q;
-struct connection **tcp_hashtable = NULL;
+static struct connht_bucket *conn_ht;
+static uint32_t conn_ht_num;
+static uint32_t conn_ht_used;
 static struct utils_rng rng;
+static uint64_t syncookie_key[2];
+
+/* connections waiting to be registered with / disabled on the fast path,
+ * and flows waiting to be freed, flushed in one batch at the start of the
+ * next tcp_poll() */
+static struct connection *pending_adds[NICIF_ADMIN_BATCH];
+static unsigned pending_adds_num;
+static struct connection *pending_closes[NICIF_ADMIN_BATCH];
+static unsigned pending_closes_num;
+static uint32_t pending_frees[NICIF_ADMIN_BATCH];
+static unsigned pending_frees_num;
 
 int tcp_init(void)
 {
   nbqueue_init(&conn_async_q);
   utils_rng_init(&rng, util_timeout_time_us());
 
-  if ((tcp_hashtable = calloc(TCP_HTSIZE, sizeof(*tcp_hashtable))) == NULL) {
+  /* fast open cookies are keyed with the syn cookie key */
+  if ((config.tcp_syn_cookies != CONFIG_SYN_COOKIES_OFF ||
+        config.tcp_fastopen) && syncookie_init() != 0)
+  {
+    return -1;
+  }
+
+  if (connht_resize(CONNHT_INIT) != 0) {
     return -1;
   }
+
+  /* rebuild connections taken over from a previous instance */
+  if (restart_flows_num() > 0) {
+    struct packetmem_handle *rx, *tx;
+    uint32_t f_id;
+    unsigned i;
+
+    cur_ts = util_timeout_time_us();
+    for (i = 0; i < restart_flows_num(); i++) {
+      restart_flow(i, &f_id, &rx, &tx);
+      conn_restore(f_id, rx, tx);
+    }
+  }
+  restart_done();
   return 0;
 }
 
@@ -125,16 +254,30 @@ void tcp_poll(void)
   uint8_t *p;
   int ret;
 
+  conn_add_flush();
+  conn_close_flush();
+  conn_free_flush();
+
   while ((p = nbqueue_deq(&conn_async_q)) != NULL) {
     conn = (struct connection *) (p - offsetof(struct connection, comp.el));
     if (conn->status == CONN_ARP_PENDING) {
-      if ((ret = conn->comp.status) != 0 || (ret = conn_arp_done(conn)) != 0) {
+      if ((ret = conn->comp.status) == 0) {
+        hs_hist_add(FLEXNIC_STATS_KHIST_ARP, util_rdtsc() - conn->hs_phase_tsc);
+        ret = conn_arp_done(conn);
+      }
+      if (ret != 0) {
         conn_failed(conn, ret);
       }
-    } else if (conn->status == CONN_REG_SYNACK) {
-      if ((ret = conn->comp.status) != 0 ||
-          (ret = conn_reg_synack(conn)) != 0)
-      {
+    } else if (conn->status == CONN_REG_SYNACK ||
+        conn->status == CONN_REG_COOKIE)
+    {
+      if ((ret = conn->comp.status) == 0) {
+        hs_hist_add(FLEXNIC_STATS_KHIST_NICADD,
+            util_rdtsc() - conn->hs_phase_tsc);
+        ret = (conn->status == CONN_REG_SYNACK ? conn_reg_synack(conn) :
+            conn_reg_cookie(conn));
+      }
+      if (ret != 0) {
         conn_failed(conn, ret);
       }
     } else {
@@ -145,24 +288,28 @@ void tcp_poll(void)
 
 int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
     uint16_t remote_port, uint32_t db_id, int objconn, int objnohash,
+    uint32_t rx_len, uint32_t tx_len, uint8_t cc_alg,
     struct connection **pconn)
 {
   int ret;
   struct connection *conn;
   uint16_t local_port;
+  uint64_t tsc = util_rdtsc();
 
   /* allocate connection struct */
-  if ((conn = conn_alloc()) == NULL) {
+  if ((conn = conn_alloc(flexnic_db_node(db_id), rx_len, tx_len)) == NULL) {
     fprintf(stderr, "tcp_open: malloc failed\n");
     return -1;
   }
+  conn->hs_tsc = tsc;
 
   CONN_DEBUG(conn, "opening connection (ctx=%p, op=%"PRIx64", rip=%x, rp=%u, "
       "db=%u)\n", ctx, opaque, remote_ip, remote_port, db_id);
 
   /* allocate local port */
-  if ((local_port = port_alloc()) == 0) {
+  if ((local_port = port_alloc(remote_ip, remote_port)) == 0) {
     fprintf(stderr, "tcp_open: port_alloc failed\n");
+    port_dest_put(remote_ip, remote_port, 0);
     conn_free(conn);
     return -1;
   }
@@ -179,7 +326,9 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
   conn->cnt_tx_pending = 0;
   conn->db_id = db_id;
   conn->flags = (objconn ? NICIF_CONN_OBJCONN : 0) |
-      (objnohash ? NICIF_CONN_OBJNOHASH : 0);
+      (objnohash ? NICIF_CONN_OBJNOHASH : 0) |
+      (config.tcp_sack ? NICIF_CONN_SACK : 0);
+  conn->cc_alg = cc_alg;
 
   conn->comp.q = &conn_async_q;
   conn->comp.notify_fd = -1;
@@ -187,9 +336,15 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
 
 
   /* resolve IP to mac */
+  tsc = util_rdtsc();
   ret = routing_resolve(&conn->comp, remote_ip, &conn->remote_mac);
+  conn->hs_phase_tsc = util_rdtsc();
+  if (ret >= 0) {
+    hs_hist_add(FLEXNIC_STATS_KHIST_ROUTE, conn->hs_phase_tsc - tsc);
+  }
   if (ret < 0) {
     fprintf(stderr, "tcp_open: nicif_arp failed\n");
+    port_dest_put(remote_ip, remote_port, 0);
     conn_free(conn);
     return -1;
   } else if (ret == 0) {
@@ -203,7 +358,7 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
     ret = 0;
   }
 
-  ports[local_port] = (uintptr_t) conn | PORT_TYPE_CONN;
+  port_conn_get(conn);
 
   *pconn = conn;
   return ret;
@@ -211,6 +366,7 @@ int tcp_open(struct app_context *ctx, uint64_t opaque, uint32_t remote_ip,
 
 int tcp_listen(struct app_context *ctx, uint64_t opaque, uint16_t local_port,
     uint32_t backlog, int reuseport, int objconn, int objnohash,
+    uint32_t rx_len, uint32_t tx_len, uint8_t cc_alg,
     struct listener **listen)
 {
   struct listener *lst;
@@ -304,6 +460,9 @@ int tcp_listen(struct app_context *ctx, uint64_t opaque, uint16_t local_port,
   lst->backlog_used = 0;
   lst->flags = (objconn ? NICIF_CONN_OBJCONN : 0) |
       (objnohash ? NICIF_CONN_OBJNOHASH : 0);
+  lst->rx_len = rx_len;
+  lst->tx_len = tx_len;
+  lst->cc_alg = cc_alg;
 
   /* add to port tables */
   if (reuseport == 0) {
@@ -328,7 +487,9 @@ int tcp_accept(struct app_context *ctx, uint64_t opaque,
   struct connection *conn;
 
   /* allocate listener struct */
-  if ((conn = conn_alloc()) == NULL) {
+  if ((conn = conn_alloc(flexnic_db_node(db_id), listen->rx_len,
+          listen->tx_len)) == NULL)
+  {
     fprintf(stderr, "tcp_accept: conn_alloc failed\n");
     return -1;
   }
@@ -339,6 +500,7 @@ int tcp_accept(struct app_context *ctx, uint64_t opaque,
   conn->local_port = listen->port;
   conn->db_id = db_id;
   conn->flags = listen->flags;
+  conn->cc_alg = listen->cc_alg;
   conn->cnt_tx_pending = 0;
 
   conn->ht_next = listen->wait_conns;
@@ -350,76 +512,172 @@ int tcp_accept(struct app_context *ctx, uint64_t opaque,
   return 0;
 }
 
-void tcp_packet(const void *pkt, uint16_t len, uint32_t fn_core,
-    uint16_t flow_group)
+void tcp_packets(const struct tcp_rx_pkt *pkts, unsigned num)
 {
-  struct connection *c;
-  struct listener *l;
-  const struct pkt_tcp *p = pkt;
-  struct tcp_opts opts;
+  struct connection *conns[NICIF_RX_BATCH];
+  struct tcp_opts opts[NICIF_RX_BATCH];
+  uint8_t todo[NICIF_RX_BATCH];
+  unsigned i, j;
+
+  assert(num <= NICIF_RX_BATCH);
+
+  /* validate and look up the whole batch first, with the table buckets
+   * prefetched for all of them */
+  for (i = 0; i < num; i++) {
+    todo[i] = tcp_packet_check(pkts[i].pkt, pkts[i].len, &opts[i]) == 0;
+    if (todo[i])
+      conn_lookup_prefetch(pkts[i].pkt);
+  }
+  for (i = 0; i < num; i++) {
+    conns[i] = (todo[i] ? conn_lookup(pkts[i].pkt) : NULL);
+  }
+
+  for (i = 0; i < num; i++) {
+    if (!todo[i]) {
+      continue;
+    }
+
+    if (conns[i] == NULL) {
+      /* may create a connection for later packets, look up again */
+      tcp_packet_dispatch(pkts[i].pkt, pkts[i].len, &opts[i],
+          pkts[i].fn_core, pkts[i].flow_group);
+      continue;
+    }
+
+    /* then the rest of the batch for this connection while its state is
+     * still in cache */
+    conn_packet(conns[i], pkts[i].pkt, &opts[i], pkts[i].fn_core,
+        pkts[i].flow_group);
+    for (j = i + 1; j < num; j++) {
+      if (todo[j] && conns[j] == conns[i]) {
+        /* connection may have failed on an earlier packet, look up again */
+        tcp_packet_dispatch(pkts[j].pkt, pkts[j].len, &opts[j],
+            pkts[j].fn_core, pkts[j].flow_group);
+        todo[j] = 0;
+      }
+    }
+  }
+}
 
+static int tcp_packet_check(const struct pkt_tcp *p, uint16_t len,
+    struct tcp_opts *opts)
+{
   if (len < sizeof(*p)) {
     fprintf(stderr, "tcp_packet: incomplete TCP receive (%u received, "
         "%u expected)\n", len, (unsigned) sizeof(*p));
-    return;
+    return -1;
   }
 
   if (f_beui32(p->ip.dest) != config.ip) {
     fprintf(stderr, "tcp_packet: unexpected destination IP (%x received, "
         "%x expected)\n", f_beui32(p->ip.dest), config.ip);
-    return;
+    return -1;
   }
 
-  if (parse_options(p, len, &opts) != 0) {
+  if (parse_options(p, len, opts) != 0) {
     fprintf(stderr, "tcp_packet: parsing TCP options failed\n");
-    return;
+    return -1;
   }
 
-  if ((c = conn_lookup(p)) != NULL) {
-    conn_packet(c, p, &opts, fn_core, flow_group);
+  return 0;
+}
+
+static void tcp_packet_dispatch(const struct pkt_tcp *p, uint16_t len,
+    const struct tcp_opts *opts, uint32_t fn_core, uint16_t flow_group)
+{
+  struct connection *c;
+  struct listener *l;
+
+  if ((c = conn_lookup(p)) != NULL && !conn_closed_syn(c, p, opts)) {
+    conn_packet(c, p, opts, fn_core, flow_group);
   } else if ((l = listener_lookup(p)) != NULL) {
-    listener_packet(l, p, &opts, fn_core, flow_group);
+    listener_packet(l, p, len, opts, fn_core, flow_group);
   } else {
     /* send reset if the packet received wasn't a reset */
     if (!(TCPH_FLAGS(&p->tcp) & TCP_RST))
-      send_reset(p, &opts);
+      send_reset(p, opts);
   }
 }
 
 int tcp_close(struct connection *conn)
 {
-  uint32_t tx_seq, rx_seq;
-  int tx_c, rx_c;
-
   if (conn->status != CONN_OPEN) {
     fprintf(stderr, "tcp_close: currently no support for non-opened conns.\n");
     return -1;
   }
 
-  /* disable connection on fastpath */
-  if (nicif_connection_disable(conn->flow_id, &tx_seq, &rx_seq, &tx_c, &rx_c)
-      != 0)
-  {
-    fprintf(stderr, "tcp_close: nicif_connection_disable failed unexpected\n");
-    return -1;
+  cc_conn_remove(conn);
+
+  conn->status = CONN_CLOSED;
+
+  /* disable connection on fastpath, batched with other closes */
+  conn_close_defer(conn);
+  return 0;
+}
+
+static void conn_close_defer(struct connection *c)
+{
+  if (pending_closes_num == NICIF_ADMIN_BATCH) {
+    conn_close_flush();
+  }
+  pending_closes[pending_closes_num++] = c;
+}
+
+static void conn_close_flush(void)
+{
+  struct nicif_connection_disable_req reqs[NICIF_ADMIN_BATCH];
+  struct connection *c;
+  unsigned i, n = pending_closes_num;
+
+  if (n == 0)
+    return;
+  pending_closes_num = 0;
+
+  for (i = 0; i < n; i++) {
+    reqs[i].flow_id = pending_closes[i]->flow_id;
   }
 
-  conn->remote_seq = rx_seq;
-  conn->local_seq = tx_seq;
+  if (nicif_connection_disable_batch(n, reqs) != 0) {
+    fprintf(stderr, "conn_close_flush: nicif_connection_disable_batch failed "
+        "unexpected\n");
+    abort();
+  }
+
+  for (i = 0; i < n; i++) {
+    c = pending_closes[i];
+    c->remote_seq = reqs[i].rx_seq;
+    c->local_seq = reqs[i].tx_seq;
+    c->close_ts = reqs[i].rx_ts;
+    c->close_flow_held = 1;
 
-  if (!tx_c || !rx_c) {
-    send_control(conn, TCP_RST, 0, 0, 0);
+    if (!reqs[i].tx_closed || !reqs[i].rx_closed) {
+      send_control(c, TCP_RST, 0, 0, 0);
+    }
+
+    /* set timer to release the flow state once the fast path is done with
+     * it, the connection itself is kept for the rest of the close hold time */
+    assert(c->to_armed == 0);
+    util_timeout_arm(&timeout_mgr, &c->to, config.tcp_flow_grace,
+        TO_TCP_CLOSED);
+    c->to_armed = 1;
   }
+}
 
-  cc_conn_remove(conn);
+static void conn_free_defer(uint32_t flow_id)
+{
+  if (pending_frees_num == NICIF_ADMIN_BATCH) {
+    conn_free_flush();
+  }
+  pending_frees[pending_frees_num++] = flow_id;
+}
 
-  conn->status = CONN_CLOSED;
+static void conn_free_flush(void)
+{
+  if (pending_frees_num == 0)
+    return;
 
-  /* set timer to free connection state */
-  assert(conn->to_armed == 0);
-  util_timeout_arm(&timeout_mgr, &conn->to, 10000, TO_TCP_CLOSED);
-  conn->to_armed = 1;
-  return 0;
+  nicif_connection_free_batch(pending_frees_num, pending_frees);
+  pending_frees_num = 0;
 }
 
 void tcp_destroy(struct connection *conn)
@@ -534,6 +792,7 @@ static int conn_syn_sent_packet(struct connection *c, const struct pkt_tcp *p,
     const struct tcp_opts *opts)
 {
   uint32_t ecn_flags = TCPH_FLAGS(&p->tcp) & (TCP_ECE | TCP_CWR);
+  uint64_t tsc, now;
 
   /* dis-arm timeout */
   conn_timeout_disarm(c);
@@ -559,13 +818,21 @@ static int conn_syn_sent_packet(struct connection *c, const struct pkt_tcp *p,
     c->flags |= NICIF_CONN_ECN;
   }
 
+  /* we offered SACK in the SYN, only use it if the peer agreed */
+  if (opts->sack_perm == NULL) {
+    c->flags &= ~NICIF_CONN_SACK;
+  }
+
   cc_conn_init(c);
 
   c->comp.q = &conn_async_q;
   c->comp.notify_fd = -1;
   c->comp.status = 0;
 
-  if (nicif_connection_add(c->db_id, c->remote_mac, c->local_ip, c->local_port,
+  tsc = util_rdtsc();
+  if (nicif_connection_add(c->db_id, c->remote_mac,
+        routing_port(c->remote_ip, c->remote_port, c->local_port),
+        c->local_ip, c->local_port,
         c->remote_ip, c->remote_port, c->rx_buf - (uint8_t *) tas_shm,
         c->rx_len, c->tx_buf - (uint8_t *) tas_shm, c->tx_len,
         c->remote_seq, c->local_seq, c->opaque, c->flags, c->cc_rate,
@@ -575,6 +842,7 @@ static int conn_syn_sent_packet(struct connection *c, const struct pkt_tcp *p,
     fprintf(stderr, "conn_syn_sent_packet: nicif_connection_add failed\n");
     return -1;
   }
+  hs_hist_add(FLEXNIC_STATS_KHIST_NICADD, util_rdtsc() - tsc);
 
   CONN_DEBUG0(c, "conn_syn_sent_packet: connection registered\n");
 
@@ -585,7 +853,11 @@ static int conn_syn_sent_packet(struct connection *c, const struct pkt_tcp *p,
 
   CONN_DEBUG0(c, "conn_syn_sent_packet: ACK sent\n");
 
+  tsc = util_rdtsc();
   appif_conn_opened(c, 0);
+  now = util_rdtsc();
+  hs_hist_add(FLEXNIC_STATS_KHIST_NOTIFY, now - tsc);
+  hs_hist_add(FLEXNIC_STATS_KHIST_OPEN, now - c->hs_tsc);
 
   return 0;
 }
@@ -603,22 +875,108 @@ static int conn_reg_synack(struct connection *c)
   /* send ACK */
   send_control(c, TCP_SYN | TCP_ACK | ecn_flags, 1, c->syn_ts, TCP_MSS);
 
-  appif_accept_conn(c, 0);
+  conn_accept_notify(c);
+
+  return 0;
+}
 
+/* peer already completed the handshake with a cookie ACK, no SYN-ACK */
+static int conn_reg_cookie(struct connection *c)
+{
+  c->status = CONN_OPEN;
+  conn_accept_notify(c);
   return 0;
 }
 
-static inline uint16_t port_alloc(void)
+static void conn_accept_notify(struct connection *c)
+{
+  uint64_t tsc, now;
+
+  tsc = util_rdtsc();
+  appif_accept_conn(c, 0);
+  now = util_rdtsc();
+  hs_hist_add(FLEXNIC_STATS_KHIST_NOTIFY, now - tsc);
+  hs_hist_add(FLEXNIC_STATS_KHIST_ACCEPT, now - c->hs_tsc);
+}
+
+static inline uint32_t port_dest_hash(uint32_t ip, uint16_t port)
+{
+  return crc32c_sse42_u64(ip | ((uint64_t) port << 32), 0);
+}
+
+static inline struct port_dest *port_dest_get(uint32_t ip, uint16_t port)
+{
+  struct port_dest *pd;
+  uint32_t h;
+
+  h = port_dest_hash(ip, port);
+  for (pd = port_dests[h % PORT_DEST_HTSIZE]; pd != NULL; pd = pd->ht_next) {
+    if (pd->ip == ip && pd->port == port)
+      return pd;
+  }
+
+  if ((pd = malloc(sizeof(*pd))) == NULL) {
+    fprintf(stderr, "port_dest_get: malloc failed\n");
+    return NULL;
+  }
+  pd->ip = ip;
+  pd->port = port;
+  /* spread destinations over the ephemeral range */
+  pd->next = PORT_FIRST_EPH + h % (PORT_MAX + 1 - PORT_FIRST_EPH);
+  pd->conns = 0;
+  pd->ht_next = port_dests[h % PORT_DEST_HTSIZE];
+  port_dests[h % PORT_DEST_HTSIZE] = pd;
+  return pd;
+}
+
+/* drop n connections from the destination, and free it once it has none.
+ * The last connection is gone only after its close hold, so starting over
+ * with a fresh cursor can't hand out a tuple that is still held. */
+static inline void port_dest_put(uint32_t ip, uint16_t port, uint32_t n)
+{
+  struct port_dest *pd, **ppd;
+  uint32_t h;
+
+  h = port_dest_hash(ip, port);
+  for (ppd = &port_dests[h % PORT_DEST_HTSIZE]; (pd = *ppd) != NULL;
+      ppd = &pd->ht_next)
+  {
+    if (pd->ip != ip || pd->port != port)
+      continue;
+
+    assert(pd->conns >= n);
+    pd->conns -= n;
+    if (pd->conns == 0) {
+      *ppd = pd->ht_next;
+      free(pd);
+    }
+    return;
+  }
+}
+
+/* The local port only has to be unique for the 4-tuple, so each destination
+ * walks the ephemeral range with its own cursor. A tuple is only handed out
+ * again after all other ports towards that destination have been used, and
+ * never while the old connection is still registered for its close hold. */
+static inline uint16_t port_alloc(uint32_t remote_ip, uint16_t remote_port)
 {
+  struct port_dest *pd;
   uint16_t p, p_start, p_next;
+  uintptr_t type;
 
-  p = p_start = port_eph_hint;
+  if ((pd = port_dest_get(remote_ip, remote_port)) == NULL)
+    return 0;
+
+  p = p_start = pd->next;
   do {
     p_next = (((uint16_t) (p + 1)) < (uint16_t) PORT_FIRST_EPH ?
         PORT_FIRST_EPH : p + 1);
 
-    if ((ports[p] & PORT_TYPE_MASK) == PORT_TYPE_UNUSED) {
-      port_eph_hint = p_next;
+    type = ports[p] & PORT_TYPE_MASK;
+    if (type == PORT_TYPE_UNUSED || (type == PORT_TYPE_CONN &&
+          conn_lookup_tuple(config.ip, remote_ip, p, remote_port) == NULL))
+    {
+      pd->next = p_next;
       return p;
     }
 
@@ -628,23 +986,69 @@ static inline uint16_t port_alloc(void)
   return 0;
 }
 
-static inline struct connection *conn_alloc(void)
+/* active open c holds its local port, and a reference on the destination */
+static inline void port_conn_get(struct connection *c)
+{
+  struct port_dest *pd;
+  uint16_t port = c->local_port;
+
+  if ((ports[port] & PORT_TYPE_MASK) == PORT_TYPE_UNUSED)
+    ports[port] = PORT_TYPE_CONN;
+  ports[port] += PORT_CONN_ONE;
+
+  if ((pd = port_dest_get(c->remote_ip, c->remote_port)) != NULL)
+    pd->conns++;
+}
+
+static inline void port_conn_put(struct connection *c)
+{
+  uint16_t port = c->local_port;
+
+  if ((ports[port] & PORT_TYPE_MASK) != PORT_TYPE_CONN)
+    return;
+
+  ports[port] -= PORT_CONN_ONE;
+  if ((ports[port] & ~PORT_TYPE_MASK) == 0)
+    ports[port] = PORT_TYPE_UNUSED;
+
+  port_dest_put(c->remote_ip, c->remote_port, 1);
+}
+
+/* buffer size requested by the application, 0 for the default */
+static inline uint32_t conn_buf_len(uint32_t hint, uint64_t def)
+{
+  if (hint == 0)
+    return def;
+  return MIN(MAX(hint, TCP_BUF_MIN), TCP_BUF_MAX);
+}
+
+/* buffers are placed on numa node, -1 spreads them over all nodes */
+static inline struct connection *conn_alloc(int node, uint32_t rx_len,
+    uint32_t tx_len)
 {
   struct connection *conn;
   uintptr_t off_rx, off_tx;
+  uint64_t tsc = util_rdtsc();
+
+  rx_len = conn_buf_len(rx_len, config.tcp_rxbuf_len);
+  tx_len = conn_buf_len(tx_len, config.tcp_txbuf_len);
 
   if ((conn = malloc(sizeof(*conn))) == NULL) {
     fprintf(stderr, "conn_alloc: malloc failed\n");
     return NULL;
   }
 
-  if (packetmem_alloc(config.tcp_rxbuf_len, &off_rx, &conn->rx_handle) != 0) {
+  if (packetmem_alloc_node(rx_len, node, &off_rx,
+        &conn->rx_handle) != 0)
+  {
     fprintf(stderr, "conn_alloc: packetmem_alloc rx failed\n");
     free(conn);
     return NULL;
   }
 
-  if (packetmem_alloc(config.tcp_txbuf_len, &off_tx, &conn->tx_handle) != 0) {
+  if (packetmem_alloc_node(tx_len, node, &off_tx,
+        &conn->tx_handle) != 0)
+  {
     fprintf(stderr, "conn_alloc: packetmem_alloc tx failed\n");
     packetmem_free(conn->rx_handle);
     free(conn);
@@ -652,16 +1056,93 @@ static inline struct connection *conn_alloc(void)
   }
 
   conn->rx_buf = (uint8_t *) tas_shm + off_rx;
-  conn->rx_len = config.tcp_rxbuf_len;
+  conn->rx_len = rx_len;
   conn->tx_buf = (uint8_t *) tas_shm + off_tx;
-  conn->tx_len = config.tcp_txbuf_len;
+  conn->tx_len = tx_len;
+  conn->tx_offer_handle = NULL;
   conn->to_armed = 0;
+  conn->cc_state = CC_CONN_NONE;
+  conn->syn_data_len = 0;
+  conn->tfo_cookie = 0;
+  conn->close_ts = 0;
+  conn->close_flow_held = 0;
 
+  hs_hist_add(FLEXNIC_STATS_KHIST_ALLOC, util_rdtsc() - tsc);
   return conn;
 }
 
+/* established connection from flow state left by a previous instance, cc
+ * state starts over with the default algorithm */
+static void conn_restore(uint32_t f_id, struct packetmem_handle *rx,
+    struct packetmem_handle *tx)
+{
+  struct flextcp_pl_flowst *fs = &fp_state->flowst[f_id];
+  struct app_context *ctx;
+  struct connection *conn;
+  uint64_t rx_base = fs->rx_base_sp;
+
+  if ((ctx = restart_ctx_lookup(fs->db_id)) == NULL ||
+      (conn = calloc(1, sizeof(*conn))) == NULL)
+  {
+    fprintf(stderr, "conn_restore: dropping flow %u\n", f_id);
+    packetmem_free(rx);
+    packetmem_free(tx);
+    nicif_flow_drop(f_id);
+    return;
+  }
+
+  conn->opaque = fs->opaque;
+  conn->ctx = ctx;
+  conn->db_id = fs->db_id;
+  conn->rx_handle = rx;
+  conn->tx_handle = tx;
+  conn->rx_buf = (uint8_t *) tas_shm + (rx_base & FLEXNIC_PL_FLOWST_RX_MASK);
+  conn->rx_len = fs->rx_len;
+  conn->tx_buf = (uint8_t *) tas_shm + fs->tx_base;
+  conn->tx_len = fs->tx_len;
+
+  memcpy(&conn->remote_mac, &fs->remote_mac, ETH_ADDR_LEN);
+  conn->remote_ip = f_beui32(fs->remote_ip);
+  conn->local_ip = f_beui32(fs->local_ip);
+  conn->remote_port = f_beui16(fs->remote_port);
+  conn->local_port = f_beui16(fs->local_port);
+
+  conn->status = CONN_OPEN;
+  conn->remote_seq = fs->rx_next_seq;
+  conn->local_seq = fs->tx_next_seq - fs->tx_sent;
+  conn->flags = ((rx_base & FLEXNIC_PL_FLOWST_OBJCONN) ?
+        NICIF_CONN_OBJCONN : 0) |
+      ((rx_base & FLEXNIC_PL_FLOWST_OBJNOHASH) ? NICIF_CONN_OBJNOHASH : 0) |
+      ((rx_base & FLEXNIC_PL_FLOWST_ECN) ? NICIF_CONN_ECN : 0) |
+      ((fs->tcp_opts & FLEXNIC_PL_FLOWST_OPT_SACK) ? NICIF_CONN_SACK : 0);
+  conn->cc_alg = config.cc_algorithm;
+  conn->cc_rate = fs->tx_rate;
+  conn->cc_state = CC_CONN_NONE;
+  conn->flow_id = f_id;
+  conn->flow_group = fs->flow_group;
+  conn->fn_core = fp_state->flow_group_steering[fs->flow_group];
+  conn->comp.q = &conn_async_q;
+  conn->comp.notify_fd = -1;
+
+  conn_register(conn);
+  /* listener ports are not carried over, only active opens hold theirs */
+  if (conn->local_port >= PORT_FIRST_EPH)
+    port_conn_get(conn);
+
+  conn->app_next = ctx->app->conns;
+  ctx->app->conns = conn;
+
+  cc_conn_init(conn);
+
+  /* the queue manager state is gone, this requeues flows with data to send;
+   * if the queue is full the cc retransmit timeout catches up */
+  nicif_connection_retransmit(f_id, conn->flow_group);
+}
+
 static inline void conn_free(struct connection *conn)
 {
+  if (conn->tx_offer_handle != NULL)
+    packetmem_free(conn->tx_offer_handle);
   packetmem_free(conn->tx_handle);
   packetmem_free(conn->rx_handle);
   free(conn);
@@ -674,60 +1155,162 @@ static inline uint32_t conn_hash(uint32_t l_ip, uint32_t r_ip, uint16_t l_po,
       crc32c_sse42_u64(l_ip | (((uint64_t) r_ip) << 32), 0));
 }
 
+/* bitmask of slots in bucket with hash h */
+static inline uint32_t connht_match(const struct connht_bucket *b, uint32_t h)
+{
+#ifdef __SSE2__
+  __m128i hs = _mm_load_si128((const __m128i *) b->hash);
+  return _mm_movemask_ps(_mm_castsi128_ps(
+        _mm_cmpeq_epi32(hs, _mm_set1_epi32(h))));
+#else
+  uint32_t j, m = 0;
+  for (j = 0; j < CONNHT_NBSZ; j++) {
+    m |= (uint32_t) (b->hash[j] == h) << j;
+  }
+  return m;
+#endif
+}
+
+static void connht_insert(struct connht_bucket *ht, uint32_t num, uint32_t h,
+    struct connection *conn)
+{
+  uint32_t b, j;
+
+  for (b = h & (num - 1); ; b = (b + 1) & (num - 1)) {
+    for (j = 0; j < CONNHT_NBSZ; j++) {
+      if (ht[b].conns[j] == NULL) {
+        ht[b].hash[j] = h;
+        ht[b].conns[j] = conn;
+        return;
+      }
+    }
+    ht[b].overflow++;
+  }
+}
+
+/* re-hash all connections into num (power of 2) buckets */
+static int connht_resize(uint32_t num)
+{
+  struct connht_bucket *ht;
+  struct connection *c;
+  uint32_t b, j;
+
+  if (posix_memalign((void **) &ht, 64, num * sizeof(*ht)) != 0) {
+    fprintf(stderr, "connht_resize: allocating %u buckets failed\n", num);
+    return -1;
+  }
+  memset(ht, 0, num * sizeof(*ht));
+
+  for (b = 0; b < conn_ht_num; b++) {
+    for (j = 0; j < CONNHT_NBSZ; j++) {
+      if ((c = conn_ht[b].conns[j]) != NULL)
+        connht_insert(ht, num, conn_ht[b].hash[j], c);
+    }
+  }
+
+  free(conn_ht);
+  conn_ht = ht;
+  conn_ht_num = num;
+  return 0;
+}
+
 static void conn_register(struct connection *conn)
 {
   uint32_t h;
 
-  h = conn_hash(conn->local_ip, conn->remote_ip, conn->local_port,
-      conn->remote_port) % TCP_HTSIZE;
+  /* grow at 3/4 load, a failed resize just leaves probe sequences longer */
+  if (conn_ht_used + 1 > conn_ht_num * CONNHT_NBSZ / 4 * 3 &&
+      connht_resize(conn_ht_num * 2) != 0 &&
+      conn_ht_used + 1 > conn_ht_num * CONNHT_NBSZ)
+  {
+    fprintf(stderr, "conn_register: connection table full\n");
+    abort();
+  }
 
-  conn->ht_next = tcp_hashtable[h];
-  tcp_hashtable[h] = conn;
+  h = conn_hash(conn->local_ip, conn->remote_ip, conn->local_port,
+      conn->remote_port);
+  connht_insert(conn_ht, conn_ht_num, h, conn);
+  conn_ht_used++;
 }
 
 static void conn_unregister(struct connection *conn)
 {
-  struct connection *cp = NULL;
-  uint32_t h;
+  uint32_t h, b, home, j;
 
   h = conn_hash(conn->local_ip, conn->remote_ip, conn->local_port,
-      conn->remote_port) % TCP_HTSIZE;
-  if (tcp_hashtable[h] == conn) {
-    tcp_hashtable[h] = conn->ht_next;
-  } else {
-    for (cp = tcp_hashtable[h]; cp != NULL && cp->ht_next != conn;
-        cp = cp->ht_next);
-    if (cp == NULL) {
+      conn->remote_port);
+  home = h & (conn_ht_num - 1);
+
+  for (b = home; ; b = (b + 1) & (conn_ht_num - 1)) {
+    for (j = 0; j < CONNHT_NBSZ; j++) {
+      if (conn_ht[b].conns[j] == conn)
+        goto found;
+    }
+    if (conn_ht[b].overflow == 0) {
       fprintf(stderr, "conn_unregister: connection not found in ht\n");
       abort();
     }
+  }
+
+found:
+  conn_ht[b].conns[j] = NULL;
+  conn_ht[b].hash[j] = 0;
+  conn_ht_used--;
 
-    cp->ht_next = conn->ht_next;
+  /* buckets passed on insert do not have to be probed for it anymore */
+  for (; home != b; home = (home + 1) & (conn_ht_num - 1)) {
+    conn_ht[home].overflow--;
   }
 }
 
 static struct connection *conn_lookup(const struct pkt_tcp *p)
 {
-  uint32_t h;
+  return conn_lookup_tuple(f_beui32(p->ip.dest), f_beui32(p->ip.src),
+      f_beui16(p->tcp.dest), f_beui16(p->tcp.src));
+}
+
+static struct connection *conn_lookup_tuple(uint32_t l_ip, uint32_t r_ip,
+    uint16_t l_port, uint16_t r_port)
+{
+  uint32_t h, b, m, j;
+  struct connht_bucket *bkt;
   struct connection *c;
 
-  h = conn_hash(f_beui32(p->ip.dest), f_beui32(p->ip.src),
-      f_beui16(p->tcp.dest), f_beui16(p->tcp.src)) % TCP_HTSIZE;
+  h = conn_hash(l_ip, r_ip, l_port, r_port);
 
-  for (c = tcp_hashtable[h]; c != NULL; c = c->ht_next) {
-    if (f_beui32(p->ip.src) == c->remote_ip &&
-        f_beui16(p->tcp.dest) == c->local_port &&
-        f_beui16(p->tcp.src) == c->remote_port)
-    {
-      return c;
+  for (b = h & (conn_ht_num - 1); ; b = (b + 1) & (conn_ht_num - 1)) {
+    bkt = &conn_ht[b];
+    m = connht_match(bkt, h);
+    while (m != 0) {
+      j = __builtin_ctz(m);
+      m &= m - 1;
+
+      c = bkt->conns[j];
+      if (c != NULL && r_ip == c->remote_ip && l_port == c->local_port &&
+          r_port == c->remote_port)
+      {
+        return c;
+      }
     }
+    if (bkt->overflow == 0)
+      return NULL;
   }
-  return NULL;
+}
+
+static inline void conn_lookup_prefetch(const struct pkt_tcp *p)
+{
+  uint32_t h;
+
+  h = conn_hash(f_beui32(p->ip.dest), f_beui32(p->ip.src),
+      f_beui16(p->tcp.dest), f_beui16(p->tcp.src));
+  util_prefetch0(&conn_ht[h & (conn_ht_num - 1)]);
 }
 
 static void conn_failed(struct connection *c, int status)
 {
   conn_unregister(c);
+  port_conn_put(c);
+  cc_conn_remove(c);
   if (c->to_armed) {
     conn_timeout_disarm(c);
   }
@@ -759,32 +1342,80 @@ static void conn_timeout_disarm(struct connection *c)
 
 static void conn_close_timeout(struct connection *c)
 {
-  /* free port */
-  if ((ports[c->local_port] & PORT_TYPE_MASK) == PORT_TYPE_CONN) {
-    ports[c->local_port] = 0;
+  if (c->close_flow_held) {
+    conn_close_release(c);
+
+    /* keep tuple registered for the rest of the hold time */
+    if (config.tcp_close_hold > config.tcp_flow_grace) {
+      util_timeout_arm(&timeout_mgr, &c->to,
+          config.tcp_close_hold - config.tcp_flow_grace, TO_TCP_CLOSED);
+      c->to_armed = 1;
+      return;
+    }
   }
 
-  /* remove from global connection list */
-  conn_unregister(c);
+  conn_close_finish(c);
+}
 
+/* After the grace period no forwarded fast path request or zero-copy transmit
+ * references the flow anymore, so flow id and buffers can be reused. */
+static void conn_close_release(struct connection *c)
+{
   /* free connection data buffers */
+  if (c->tx_offer_handle != NULL)
+    packetmem_free(c->tx_offer_handle);
   packetmem_free(c->tx_handle);
   packetmem_free(c->rx_handle);
 
-  /* free connection id */
-  nicif_connection_free(c->flow_id);
-
-  /* free ephemeral port */
-  if ((ports[c->local_port] & PORT_TYPE_MASK) == PORT_TYPE_CONN) {
-    ports[c->local_port] = PORT_TYPE_UNUSED;
-  }
+  /* free connection id, batched with other releases */
+  conn_free_defer(c->flow_id);
+  c->close_flow_held = 0;
 
   /* notify application */
   appif_conn_closed(c, 0);
+}
+
+static void conn_close_finish(struct connection *c)
+{
+  /* remove from global connection list */
+  conn_unregister(c);
+
+  /* free ephemeral port */
+  port_conn_put(c);
 
   free(c);
 }
 
+/* A SYN for the 4-tuple of a connection in its close hold, returns 1 if the
+ * old connection was freed and the SYN should go to the listener. Like
+ * RFC 6191 the SYN has to carry a newer timestamp than the last segment of
+ * the old connection, or a sequence number beyond it without timestamps. */
+static int conn_closed_syn(struct connection *c, const struct pkt_tcp *p,
+    const struct tcp_opts *opts)
+{
+  /* flow state still held or not flushed to the fast path yet */
+  if (c->status != CONN_CLOSED || !c->to_armed || c->close_flow_held)
+    return 0;
+
+  if ((TCPH_FLAGS(&p->tcp) & (TCP_SYN | TCP_ACK | TCP_RST)) != TCP_SYN ||
+      listener_lookup(p) == NULL)
+  {
+    return 0;
+  }
+
+  if (opts->ts != NULL && c->close_ts != 0) {
+    if ((int32_t) (f_beui32(opts->ts->ts_val) - c->close_ts) <= 0)
+      return 0;
+  } else if ((int32_t) (f_beui32(p->tcp.seqno) - c->remote_seq) <= 0) {
+    return 0;
+  }
+
+  CONN_DEBUG0(c, "conn_closed_syn: reusing tuple of closed connection\n");
+  conn_timeout_disarm(c);
+  conn_close_finish(c);
+  return 1;
+}
+
 /** simple hash of 64-bits to 32 bits */
 static inline uint32_t hash_64_to_32(uint64_t key)
 {
@@ -822,27 +1453,66 @@ static struct listener *listener_lookup(const struct pkt_tcp *p)
 }
 
 static void listener_packet(struct listener *l, const struct pkt_tcp *p,
-    const struct tcp_opts *opts, uint32_t fn_core, uint16_t flow_group)
+    uint16_t pkt_len, const struct tcp_opts *opts, uint32_t fn_core,
+    uint16_t flow_group)
 {
   struct backlog_slot *bls;
-  uint16_t len;
+  uint16_t len, data_len, flags;
+  int tfo_cookie;
   uint32_t bp, n;
   struct pkt_tcp *bl_p;
 
-  if ((TCPH_FLAGS(&p->tcp) & ~(TCP_ECE | TCP_CWR)) != TCP_SYN) {
+  flags = TCPH_FLAGS(&p->tcp) & ~(TCP_ECE | TCP_CWR);
+  if (flags != TCP_SYN) {
+    /* final ACK answering a SYN cookie: only the headers are queued, the
+     * peer retransmits any payload once the connection is registered */
+    if (config.tcp_syn_cookies != CONFIG_SYN_COOKIES_OFF &&
+        (flags & (TCP_SYN | TCP_RST | TCP_FIN | TCP_ACK)) == TCP_ACK &&
+        syncookie_check(p) == 0)
+    {
+      listener_backlog_add(l, p, sizeof(*p) + TCPH_HDRLEN(&p->tcp) * 4 - 20,
+          fn_core, flow_group, NULL, 0, 0);
+      return;
+    }
+
     fprintf(stderr, "listener_packet: Not a SYN (flags %x)\n",
             TCPH_FLAGS(&p->tcp));
     send_reset(p, opts);
     return;
   }
 
-  /* make sure packet is not too long */
-  len = sizeof(p->eth) + f_beui16(p->ip.len);
+  if (config.tcp_syn_cookies == CONFIG_SYN_COOKIES_ALWAYS) {
+    syncookie_synack(p, opts);
+    return;
+  }
+
+  /* only headers are queued, payload is dropped unless it comes with a
+   * valid fast open cookie */
+  len = sizeof(*p) + TCPH_HDRLEN(&p->tcp) * 4 - 20;
   if (len > sizeof(bls->buf)) {
     fprintf(stderr, "listener_packet: SYN larger than backlog buffer, "
         "dropping\n");
     return;
   }
+  /* ip length comes from the peer, the payload can't extend past what was
+   * received */
+  data_len = MIN(sizeof(p->eth) + f_beui16(p->ip.len), pkt_len);
+  data_len = (data_len > len ? data_len - len : 0);
+
+  tfo_cookie = 0;
+  if (config.tcp_fastopen && opts->tfo != NULL &&
+      (l->flags & NICIF_CONN_OBJCONN) == 0)
+  {
+    if (tfo_cookie_check(f_beui32(p->ip.src), opts->tfo) != 0) {
+      /* cookie request or stale cookie: hand out a fresh one */
+      tfo_cookie = 1;
+      data_len = 0;
+    } else if (data_len > TCP_MSS) {
+      data_len = 0;
+    }
+  } else {
+    data_len = 0;
+  }
 
   /* make sure we don't already have this 4-tuple */
   for (n = 0, bp = l->backlog_pos; n < l->backlog_used;
@@ -860,10 +1530,53 @@ static void listener_packet(struct listener *l, const struct pkt_tcp *p,
   }
 
   if (l->backlog_len == l->backlog_used) {
+    if (config.tcp_syn_cookies == CONFIG_SYN_COOKIES_OVERFLOW) {
+      syncookie_synack(p, opts);
+      return;
+    }
+
     fprintf(stderr, "listener_packet: backlog queue full\n");
     return;
   }
 
+  listener_backlog_add(l, p, len, fn_core, flow_group,
+      (const uint8_t *) p + len, data_len, tfo_cookie);
+}
+
+/* copy packet into the next backlog slot and notify the application */
+static int listener_backlog_add(struct listener *l, const struct pkt_tcp *p,
+    uint16_t len, uint32_t fn_core, uint16_t flow_group, const void *data,
+    uint16_t data_len, int tfo_cookie)
+{
+  struct backlog_slot *bls;
+  struct pkt_tcp *bl_p;
+  uint32_t bp, n;
+
+  if (len > sizeof(bls->buf)) {
+    fprintf(stderr, "listener_backlog_add: packet larger than backlog "
+        "buffer, dropping\n");
+    return -1;
+  }
+
+  /* a retransmitted cookie ACK may already be queued */
+  if ((TCPH_FLAGS(&p->tcp) & TCP_SYN) == 0) {
+    for (n = 0, bp = l->backlog_pos; n < l->backlog_used;
+        n++, bp = (bp + 1) % l->backlog_len)
+    {
+      bl_p = (struct pkt_tcp *) ((struct backlog_slot *)
+          l->backlog_ptrs[bp])->buf;
+      if (f_beui32(p->ip.src) == f_beui32(bl_p->ip.src) &&
+          f_beui16(p->tcp.src) == f_beui16(bl_p->tcp.src))
+      {
+        return 0;
+      }
+    }
+  }
+
+  if (l->backlog_len == l->backlog_used) {
+    fprintf(stderr, "listener_backlog_add: backlog queue full\n");
+    return -1;
+  }
 
   bp = l->backlog_pos + l->backlog_used;
   if (bp >= l->backlog_len) {
@@ -876,6 +1589,14 @@ static void listener_packet(struct listener *l, const struct pkt_tcp *p,
   bls = l->backlog_ptrs[bp];
   memcpy(bls->buf, p, len);
   bls->len = len;
+  bls->tfo_cookie = tfo_cookie;
+  bls->tsc = util_rdtsc();
+  bls->data = NULL;
+  bls->data_len = 0;
+  if (data_len > 0 && (bls->data = malloc(data_len)) != NULL) {
+    memcpy(bls->data, data, data_len);
+    bls->data_len = data_len;
+  }
 
   l->backlog_used++;
 
@@ -885,6 +1606,7 @@ static void listener_packet(struct listener *l, const struct pkt_tcp *p,
   if (l->wait_conns != NULL) {
     listener_accept(l);
   }
+  return 0;
 }
 
 static void listener_accept(struct listener *l)
@@ -920,40 +1642,62 @@ static void listener_accept(struct listener *l)
   c->remote_port = f_beui16(p->tcp.src);
   c->local_port = l->port;
 
-  c->remote_seq = f_beui32(p->tcp.seqno) + 1;
-  c->local_seq = 1; /* TODO: generate random */
   c->syn_ts = f_beui32(opts.ts->ts_val);
 
-  /* check if ECN is offered */
-  ecn_flags = TCPH_FLAGS(&p->tcp) & (TCP_ECE | TCP_CWR);
-  if (ecn_flags == (TCP_ECE | TCP_CWR)) {
-    c->flags |= NICIF_CONN_ECN;
+  if ((TCPH_FLAGS(&p->tcp) & TCP_SYN) == 0) {
+    /* validated cookie ACK, the cookie is our initial sequence number */
+    c->remote_seq = f_beui32(p->tcp.seqno);
+    c->local_seq = f_beui32(p->tcp.ackno) - 1;
+    if ((c->local_seq & SYNCOOKIE_ECN) != 0) {
+      c->flags |= NICIF_CONN_ECN;
+    }
+    if ((c->local_seq & SYNCOOKIE_SACK) != 0) {
+      c->flags |= NICIF_CONN_SACK;
+    }
+  } else {
+    c->remote_seq = f_beui32(p->tcp.seqno) + 1;
+    c->local_seq = 1; /* TODO: generate random */
+
+    /* check if ECN is offered */
+    ecn_flags = TCPH_FLAGS(&p->tcp) & (TCP_ECE | TCP_CWR);
+    if (ecn_flags == (TCP_ECE | TCP_CWR)) {
+      c->flags |= NICIF_CONN_ECN;
+    }
+
+    /* accept SACK if offered */
+    if (config.tcp_sack && opts.sack_perm != NULL) {
+      c->flags |= NICIF_CONN_SACK;
+    }
+
+    /* fast open: payload is acked with the SYN-ACK and already in the rx
+     * buffer when the connection is registered */
+    c->tfo_cookie = bls->tfo_cookie;
+    if (bls->data != NULL && bls->data_len < c->rx_len) {
+      memcpy(c->rx_buf, bls->data, bls->data_len);
+      c->syn_data_len = bls->data_len;
+      c->remote_seq += bls->data_len;
+    }
   }
 
   cc_conn_init(c);
 
-  c->status = CONN_REG_SYNACK;
+  c->status = ((TCPH_FLAGS(&p->tcp) & TCP_SYN) == 0 ? CONN_REG_COOKIE :
+      CONN_REG_SYNACK);
 
   c->comp.q = &conn_async_q;
   c->comp.notify_fd = -1;
   c->comp.status = 0;
 
-  if (nicif_connection_add(c->db_id, c->remote_mac, c->local_ip, c->local_port,
-        c->remote_ip, c->remote_port, c->rx_buf - (uint8_t *) tas_shm,
-        c->rx_len, c->tx_buf - (uint8_t *) tas_shm, c->tx_len,
-        c->remote_seq, c->local_seq + 1, c->opaque, c->flags, c->cc_rate,
-        c->fn_core, c->flow_group, &c->flow_id)
-      != 0)
-  {
-    fprintf(stderr, "listener_packet: nicif_connection_add failed\n");
-    goto out;
-  }
-
+  /* flow is registered with the fast path in the next batch */
+  c->hs_tsc = bls->tsc;
+  c->hs_phase_tsc = util_rdtsc();
   l->wait_conns = c->ht_next;
   conn_register(c);
-  nbqueue_enq(&conn_async_q, &c->comp.el);
+  conn_add_defer(c);
 
 out:
+  free(bls->data);
+  bls->data = NULL;
   l->backlog_used--;
   l->backlog_pos++;
   if (l->backlog_pos >= l->backlog_len) {
@@ -961,24 +1705,79 @@ out:
   }
 }
 
+static void conn_add_defer(struct connection *c)
+{
+  if (pending_adds_num == NICIF_ADMIN_BATCH) {
+    conn_add_flush();
+  }
+  pending_adds[pending_adds_num++] = c;
+}
+
+static void conn_add_flush(void)
+{
+  struct nicif_connection_add_req reqs[NICIF_ADMIN_BATCH];
+  struct connection *c;
+  unsigned i, n = pending_adds_num;
+
+  if (n == 0)
+    return;
+  pending_adds_num = 0;
+
+  for (i = 0; i < n; i++) {
+    c = pending_adds[i];
+    reqs[i] = (struct nicif_connection_add_req) {
+        .db = c->db_id, .mac_remote = c->remote_mac,
+        .port = routing_port(c->remote_ip, c->remote_port, c->local_port),
+        .ip_local = c->local_ip, .port_local = c->local_port,
+        .ip_remote = c->remote_ip, .port_remote = c->remote_port,
+        .rx_base = c->rx_buf - (uint8_t *) tas_shm, .rx_len = c->rx_len,
+        .tx_base = c->tx_buf - (uint8_t *) tas_shm, .tx_len = c->tx_len,
+        .remote_seq = c->remote_seq, .local_seq = c->local_seq + 1,
+        .rx_pos = c->syn_data_len, .app_opaque = c->opaque,
+        .flags = c->flags, .rate = c->cc_rate,
+        .fn_core = c->fn_core, .flow_group = c->flow_group,
+      };
+  }
+
+  nicif_connection_add_batch(n, reqs);
+
+  for (i = 0; i < n; i++) {
+    c = pending_adds[i];
+    if (reqs[i].status != 0) {
+      fprintf(stderr, "conn_add_flush: nicif_connection_add failed\n");
+      conn_failed(c, -1);
+      continue;
+    }
+
+    c->flow_id = reqs[i].flow_id;
+    nbqueue_enq(&conn_async_q, &c->comp.el);
+  }
+}
+
 static inline int send_control_raw(uint64_t remote_mac, uint32_t remote_ip,
     uint16_t remote_port, uint16_t local_port, uint32_t local_seq,
     uint32_t remote_seq, uint16_t flags, int ts_opt, uint32_t ts_echo,
-    uint16_t mss_opt)
+    uint16_t mss_opt, int sack_opt, int tfo_opt)
 {
   uint32_t new_tail;
   struct pkt_tcp *p;
   struct tcp_mss_opt *opt_mss;
+  struct tcp_sack_perm_opt *opt_sack;
   struct tcp_timestamp_opt *opt_ts;
-  uint8_t optlen;
-  uint16_t len, off_ts, off_mss;
+  struct tcp_fastopen_opt *opt_tfo;
+  uint8_t optlen, port;
+  uint16_t len, off_ts, off_mss, off_sack, off_tfo;
 
   /* calculate header length depending on options */
   optlen = 0;
   off_mss = optlen;
   optlen += (mss_opt ? sizeof(*opt_mss) : 0);
+  off_sack = optlen;
+  optlen += (sack_opt ? sizeof(*opt_sack) : 0);
   off_ts = optlen;
   optlen += (ts_opt ? sizeof(*opt_ts) : 0);
+  off_tfo = optlen;
+  optlen += (tfo_opt ? sizeof(*opt_tfo) + TCP_FASTOPEN_COOKIE_LEN : 0);
   optlen = (optlen + 3) & ~3;
   len = sizeof(*p) + optlen;
 
@@ -989,8 +1788,9 @@ static inline int send_control_raw(uint64_t remote_mac, uint32_t remote_ip,
   }
 
   /* fill ethernet header */
+  port = routing_port(remote_ip, remote_port, local_port);
   memcpy(&p->eth.dest, &remote_mac, ETH_ADDR_LEN);
-  memcpy(&p->eth.src, &eth_addr, ETH_ADDR_LEN);
+  memcpy(&p->eth.src, network_port_mac(port), ETH_ADDR_LEN);
   p->eth.type = t_beui16(ETH_TYPE_IP);
 
   /* fill ipv4 header */
@@ -1014,6 +1814,7 @@ static inline int send_control_raw(uint64_t remote_mac, uint32_t remote_ip,
   p->tcp.wnd = t_beui16(11680); /* TODO */
   p->tcp.chksum = 0;
   p->tcp.urgp = t_beui16(0);
+  memset(p + 1, 0, optlen);
 
   /* if requested: add mss option */
   if (mss_opt) {
@@ -1023,31 +1824,48 @@ static inline int send_control_raw(uint64_t remote_mac, uint32_t remote_ip,
     opt_mss->mss = t_beui16(mss_opt);
   }
 
+  /* if requested: add sack permitted option */
+  if (sack_opt) {
+    opt_sack = (struct tcp_sack_perm_opt *) ((uint8_t *) (p + 1) + off_sack);
+    opt_sack->kind = TCP_OPT_SACK_PERM;
+    opt_sack->length = sizeof(*opt_sack);
+  }
+
   /* if requested: add timestamp option */
   if (ts_opt) {
     opt_ts = (struct tcp_timestamp_opt *) ((uint8_t *) (p + 1) + off_ts);
-    memset(opt_ts, 0, optlen);
     opt_ts->kind = TCP_OPT_TIMESTAMP;
     opt_ts->length = sizeof(*opt_ts);
     opt_ts->ts_val = t_beui32(0);
     opt_ts->ts_ecr = t_beui32(ts_echo);
   }
 
+  /* if requested: add fast open cookie for the peer */
+  if (tfo_opt) {
+    opt_tfo = (struct tcp_fastopen_opt *) ((uint8_t *) (p + 1) + off_tfo);
+    opt_tfo->kind = TCP_OPT_FASTOPEN;
+    opt_tfo->length = sizeof(*opt_tfo) + TCP_FASTOPEN_COOKIE_LEN;
+    tfo_cookie_gen(remote_ip, opt_tfo->cookie);
+  }
+
   /* calculate header checksums */
   p->ip.chksum = rte_ipv4_cksum((void *) &p->ip);
   p->tcp.chksum = rte_ipv4_udptcp_cksum((void *) &p->ip, (void *) &p->tcp);
   
   /* send packet */
-  nicif_tx_send(new_tail);
+  nicif_tx_send(new_tail, port);
   return 0;
 }
 
 static inline int send_control(const struct connection *conn, uint16_t flags,
     int ts_opt, uint32_t ts_echo, uint16_t mss_opt)
 {
+  /* SACK permitted and fast open cookies go with the MSS in SYN segments
+   * only */
   return send_control_raw(conn->remote_mac, conn->remote_ip, conn->remote_port,
       conn->local_port, conn->local_seq, conn->remote_seq, flags, ts_opt,
-      ts_echo, mss_opt);
+      ts_echo, mss_opt, mss_opt && (conn->flags & NICIF_CONN_SACK) != 0,
+      mss_opt && conn->tfo_cookie);
 }
 
 static inline int send_reset(const struct pkt_tcp *p,
@@ -1065,7 +1883,146 @@ static inline int send_reset(const struct pkt_tcp *p,
   memcpy(&remote_mac, &p->eth.src, ETH_ADDR_LEN);
   return send_control_raw(remote_mac, f_beui32(p->ip.src), f_beui16(p->tcp.src),
       f_beui16(p->tcp.dest), f_beui32(p->tcp.ackno), f_beui32(p->tcp.seqno) + 1,
-      TCP_RST | TCP_ACK, ts_opt, ts_val, 0);
+      TCP_RST | TCP_ACK, ts_opt, ts_val, 0, 0, 0);
+}
+
+/******************************************************************************/
+/* SYN cookies */
+
+static inline uint64_t sip_rotl(uint64_t x, unsigned b)
+{
+  return (x << b) | (x >> (64 - b));
+}
+
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = sip_rotl(v1, 13); v1 ^= v0; v0 = sip_rotl(v0, 32); \
+    v2 += v3; v3 = sip_rotl(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = sip_rotl(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = sip_rotl(v1, 17); v1 ^= v2; v2 = sip_rotl(v2, 32); \
+  } while (0)
+
+/** SipHash-2-4 of two words with the cookie key */
+static uint64_t syncookie_siphash(uint64_t m0, uint64_t m1)
+{
+  uint64_t v0 = 0x736f6d6570736575ULL ^ syncookie_key[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ syncookie_key[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ syncookie_key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ syncookie_key[1];
+  uint64_t b = 16ULL << 56;
+
+  v3 ^= m0; SIP_ROUND(v0, v1, v2, v3); SIP_ROUND(v0, v1, v2, v3); v0 ^= m0;
+  v3 ^= m1; SIP_ROUND(v0, v1, v2, v3); SIP_ROUND(v0, v1, v2, v3); v0 ^= m1;
+  v3 ^= b; SIP_ROUND(v0, v1, v2, v3); SIP_ROUND(v0, v1, v2, v3); v0 ^= b;
+
+  v2 ^= 0xff;
+  SIP_ROUND(v0, v1, v2, v3); SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3); SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static int syncookie_init(void)
+{
+  FILE *f;
+  size_t n;
+
+  if ((f = fopen("/dev/urandom", "r")) == NULL) {
+    perror("syncookie_init: opening /dev/urandom failed");
+    return -1;
+  }
+  n = fread(syncookie_key, sizeof(syncookie_key), 1, f);
+  fclose(f);
+
+  if (n != 1) {
+    fprintf(stderr, "syncookie_init: reading key failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* cookie for the SYN with sequence number isn from the peer */
+static inline uint32_t syncookie_gen(uint32_t remote_ip, uint16_t remote_port,
+    uint16_t local_port, uint32_t isn, uint32_t cnt, int ecn, int sack)
+{
+  uint64_t h;
+
+  cnt &= SYNCOOKIE_CNT_MASK;
+  h = syncookie_siphash(remote_ip | ((uint64_t) remote_port << 32) |
+      ((uint64_t) local_port << 48), isn | ((uint64_t) cnt << 32));
+
+  return (cnt << SYNCOOKIE_CNT_SHIFT) | (ecn ? SYNCOOKIE_ECN : 0) |
+    (sack ? SYNCOOKIE_SACK : 0) | (h & SYNCOOKIE_HASH_MASK);
+}
+
+/* answer SYN with a SYN-ACK carrying a cookie, without keeping state */
+static int syncookie_synack(const struct pkt_tcp *p,
+    const struct tcp_opts *opts)
+{
+  uint32_t cookie;
+  uint64_t remote_mac = 0;
+  int ecn, sack;
+
+  if (opts->ts == NULL) {
+    fprintf(stderr, "syncookie_synack: SYN without timestamp option\n");
+    return -1;
+  }
+
+  ecn = (TCPH_FLAGS(&p->tcp) & (TCP_ECE | TCP_CWR)) == (TCP_ECE | TCP_CWR);
+  sack = config.tcp_sack && opts->sack_perm != NULL;
+  cookie = syncookie_gen(f_beui32(p->ip.src), f_beui16(p->tcp.src),
+      f_beui16(p->tcp.dest), f_beui32(p->tcp.seqno),
+      cur_ts >> SYNCOOKIE_PERIOD_SHIFT, ecn, sack);
+  kstats->syncookies_sent++;
+
+  memcpy(&remote_mac, &p->eth.src, ETH_ADDR_LEN);
+  return send_control_raw(remote_mac, f_beui32(p->ip.src),
+      f_beui16(p->tcp.src), f_beui16(p->tcp.dest), cookie,
+      f_beui32(p->tcp.seqno) + 1, TCP_SYN | TCP_ACK | (ecn ? TCP_ECE : 0), 1,
+      f_beui32(opts->ts->ts_val), TCP_MSS, sack, 0);
+}
+
+/* fast open cookie for a client ip */
+static inline void tfo_cookie_gen(uint32_t remote_ip, uint8_t *cookie)
+{
+  uint64_t h = syncookie_siphash(remote_ip, TCP_OPT_FASTOPEN);
+
+  memcpy(cookie, &h, TCP_FASTOPEN_COOKIE_LEN);
+}
+
+static inline int tfo_cookie_check(uint32_t remote_ip,
+    const struct tcp_fastopen_opt *opt)
+{
+  uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+
+  if (opt->length != sizeof(*opt) + TCP_FASTOPEN_COOKIE_LEN) {
+    return -1;
+  }
+
+  tfo_cookie_gen(remote_ip, cookie);
+  return (memcmp(cookie, opt->cookie, sizeof(cookie)) == 0 ? 0 : -1);
+}
+
+/* check if ACK acknowledges a cookie from the current or last period */
+static int syncookie_check(const struct pkt_tcp *p)
+{
+  uint32_t cookie = f_beui32(p->tcp.ackno) - 1, cnt, now;
+
+  cnt = cookie >> SYNCOOKIE_CNT_SHIFT;
+  now = cur_ts >> SYNCOOKIE_PERIOD_SHIFT;
+  if (((now - cnt) & SYNCOOKIE_CNT_MASK) > 1) {
+    return -1;
+  }
+
+  if (syncookie_gen(f_beui32(p->ip.src), f_beui16(p->tcp.src),
+        f_beui16(p->tcp.dest), f_beui32(p->tcp.seqno) - 1, cnt,
+        (cookie & SYNCOOKIE_ECN) != 0, (cookie & SYNCOOKIE_SACK) != 0) !=
+      cookie)
+  {
+    kstats->syncookies_failed++;
+    return -1;
+  }
+
+  kstats->syncookies_ok++;
+  return 0;
 }
 
 static inline int parse_options(const struct pkt_tcp *p, uint16_t len,
@@ -1078,6 +2035,8 @@ static inline int parse_options(const struct pkt_tcp *p, uint16_t len,
 
   opts->ts = NULL;
   opts->mss = NULL;
+  opts->sack_perm = NULL;
+  opts->tfo = NULL;
 
   /* whole header not in buf */
   if (TCPH_HDRLEN(&p->tcp) < 5 || opts_len > (len - sizeof(*p))) {
@@ -1114,6 +2073,23 @@ static inline int parse_options(const struct pkt_tcp *p, uint16_t len,
         }
 
         opts->ts = (struct tcp_timestamp_opt *) (opt + off);
+      } else if (opt_kind == TCP_OPT_SACK_PERM) {
+        if (opt_len != sizeof(struct tcp_sack_perm_opt)) {
+          fprintf(stderr, "parse_options: sack permitted option size wrong "
+              "(expect %zu got %u)\n", sizeof(struct tcp_sack_perm_opt),
+              opt_len);
+          return -1;
+        }
+
+        opts->sack_perm = (struct tcp_sack_perm_opt *) (opt + off);
+      } else if (opt_kind == TCP_OPT_FASTOPEN) {
+        if (opt_len < sizeof(struct tcp_fastopen_opt) || opt_len > opt_avail) {
+          fprintf(stderr, "parse_options: fast open option size wrong "
+              "(got %u)\n", opt_len);
+          return -1;
+        }
+
+        opts->tfo = (struct tcp_fastopen_opt *) (opt + off);
       }
     }
     off += opt_len;
@@ -1121,3 +2097,13 @@ static inline int parse_options(const struct pkt_tcp *p, uint16_t len,
 
   return 0;
 }
+
+/* add sample to handshake phase histogram `h` (FLEXNIC_STATS_KHIST_*) */
+static inline void hs_hist_add(unsigned h, uint64_t v)
+{
+  struct flexnic_stats_hist *hist = &kstats->hists[h];
+
+  hist->count++;
+  hist->sum += v;
+  hist->buckets[flexnic_stats_hist_bucket(v)]++;
+}
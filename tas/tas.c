@@ -29,6 +29,7 @@
 #include <signal.h>
 #include <assert.h>
 #include <pthread.h>
+#include <inttypes.h>
 
 #include <rte_config.h>
 #include <rte_eal.h>
@@ -38,13 +39,40 @@
 #include <rte_malloc.h>
 
 #include <tas_memif.h>
+#include <utils.h>
 #include <utils_timeout.h>
 
 #include <tas.h>
 #include <fastpath.h>
 
+/** Interval flexnic_loadmon is called at [ms] */
+#define LOADMON_INTERVAL_MS 10
+/** Ewma autoscaling: scale up with less predicted idle capacity
+ * [1/1000 cores] */
+#define SCALE_UP_IDLE 200
+/** Ewma autoscaling: scale down with more predicted idle capacity */
+#define SCALE_DOWN_IDLE 1250
+/** Ewma autoscaling: rounds the scale up condition has to hold */
+#define SCALE_UP_ROUNDS 2
+/** Ewma autoscaling: nic rx ring and app rx queue fill counted as
+ * pressure [1/1000] */
+#define SCALE_RXQ_FILL 500
+#define SCALE_ARXQ_FILL 750
+
+/** flexnic_loadmon rounds between flow group rebalancing */
+#define FG_REBALANCE_ROUNDS 10
+/** Max. flow groups moved in one rebalancing round */
+#define FG_REBALANCE_MAX 64
+/** Payload bytes weighted like one packet when estimating flow group load */
+#define FG_REBALANCE_PKT_BYTES 1024
+
 struct core_load {
   uint64_t cyc_busy;
+  /* rebalancing: busy cycles at last round, busy cycles and flow group
+   * weight during the last interval */
+  uint64_t rb_cyc_busy;
+  uint64_t rb_busy;
+  uint64_t rb_weight;
 };
 
 struct configuration config;
@@ -58,10 +86,19 @@ int exited;
 
 struct dataplane_context **ctxs = NULL;
 struct core_load *core_loads = NULL;
+/* numa node of the lcore each fast path core runs on */
+static uint8_t *core_nodes = NULL;
+
+/* flow group counters at last rebalancing round, weight during interval */
+static struct dataplane_fg_stats fg_last[FLEXNIC_PL_MAX_FLOWGROUPS];
+static uint64_t fg_weight[FLEXNIC_PL_MAX_FLOWGROUPS];
 
 static int start_threads(void);
 static void thread_error(void);
 static int common_thread(void *arg);
+static void fg_rebalance(void);
+static void loadmon_ewma(uint32_t ts, unsigned num_cores, uint64_t cyc_busy,
+    uint64_t cycles);
 
 
 static void *slowpath_thread(void *arg)
@@ -210,7 +247,8 @@ error_alloc:
 
 static int start_threads(void)
 {
-  unsigned cores_avail, cores_needed, core;
+  unsigned cores_avail, cores_needed, core, node, pass;
+  int nic_node;
   void *arg;
 
 #ifdef DATAPLANE_STATS
@@ -232,9 +270,31 @@ static int start_threads(void)
     return -1;
   }
 
+  if ((core_nodes = rte_calloc("core nodes", fp_cores_max,
+          sizeof(*core_nodes), 0)) == NULL)
+  {
+    fprintf(stderr, "start_threads: allocating core nodes failed\n");
+    return -1;
+  }
+
+  /* with pinning, cores on the NIC's node get the lowest ids, as the ones
+   * used when scaled down, the rest only fill up what is left */
+  nic_node = (config.fp_numa_pin ? network_port_node() : -1);
+  if (config.fp_numa_pin && nic_node < 0) {
+    fprintf(stderr, "start_threads: NIC numa node unknown, not pinning\n");
+  }
+
   /* start common threads */
-  RTE_LCORE_FOREACH_SLAVE(core) {
-    if (threads_launched < fp_cores_max) {
+  for (pass = (nic_node >= 0 ? 0 : 1); pass < 2; pass++) {
+    RTE_LCORE_FOREACH_SLAVE(core) {
+      if (threads_launched >= fp_cores_max)
+        break;
+
+      node = rte_lcore_to_socket_id(core);
+      if (nic_node >= 0 && (pass == 0) != (node == (unsigned) nic_node))
+        continue;
+
+      core_nodes[threads_launched] = node;
       arg = (void *) (uintptr_t) threads_launched;
       if (rte_eal_remote_launch(common_thread, arg, core) != 0) {
 	fprintf(stderr, "ERROR\n");
@@ -247,6 +307,24 @@ static int start_threads(void)
   return 0;
 }
 
+unsigned flexnic_core_node(uint16_t core)
+{
+  unsigned node = (core_nodes != NULL && core < fp_cores_max ?
+      core_nodes[core] : 0);
+  return (node < shm_numa_nodes ? node : 0);
+}
+
+int flexnic_db_node(uint16_t db)
+{
+  /* only connections steered with flow rules are known to end up on the
+   * core derived from their doorbell */
+  if (shm_numa_nodes <= 1 || config.fp_flow_rules == 0 ||
+      config.fp_sw_rss > 0) {
+    return -1;
+  }
+  return flexnic_core_node(db % fp_cores_cur);
+}
+
 static void thread_error(void)
 {
   fprintf(stderr, "thread_error\n");
@@ -266,11 +344,25 @@ int flexnic_scale_to(uint32_t cores)
   return 0;
 }
 
+static void scale_record(uint32_t ts, unsigned cores, uint8_t reason, int up)
+{
+  struct flextcp_pl_scalest *ss = &fp_state->scalest;
+
+  if (up)
+    ss->ups++;
+  else
+    ss->downs++;
+  ss->last_ts = ts;
+  ss->last_cores = cores;
+  ss->last_reason = reason;
+}
+
 void flexnic_loadmon(uint32_t ts)
 {
   uint64_t cyc_busy = 0, x, tsc, cycles, id_cyc;
   unsigned i, num_cores;
-  static uint64_t ewma_busy = 0, ewma_cycles = 0, last_tsc = 0, kdrops = 0;
+  static uint64_t ewma_busy = 0, ewma_cycles = 0, last_tsc = 0, kdrops = 0,
+                  arx_backlog = 0;
   static int waiting = 1, waiting_n = 0, count = 0;
 
   num_cores = fp_cores_cur;
@@ -286,8 +378,12 @@ void flexnic_loadmon(uint32_t ts)
 
     kdrops += ctxs[i]->kernel_drop;
     ctxs[i]->kernel_drop = 0;
+    arx_backlog += ctxs[i]->arx_backlog;
+    ctxs[i]->arx_backlog = 0;
   }
 
+  fg_rebalance();
+
   /* measure cpu cycles since last call */
   tsc = rte_get_tsc_cycles();
   if (last_tsc == 0) {
@@ -304,8 +400,18 @@ void flexnic_loadmon(uint32_t ts)
   /* periodically print out staticstics */
   if (count++ % 100 == 0) {
     fprintf(stderr, "flexnic_loadmon: status cores = %u   busy = %lu  "
-        "cycles =%lu  kdrops=%lu\n", num_cores, ewma_busy, ewma_cycles, kdrops);
+        "cycles =%lu  kdrops=%lu  arx_backlog=%lu  ups=%lu  downs=%lu\n",
+        num_cores, ewma_busy, ewma_cycles, kdrops, arx_backlog,
+        fp_state->scalest.ups, fp_state->scalest.downs);
     kdrops = 0;
+    arx_backlog = 0;
+  }
+
+  if (config.fp_autoscale == CONFIG_FP_AUTOSCALE_OFF) {
+    return;
+  } else if (config.fp_autoscale == CONFIG_FP_AUTOSCALE_EWMA) {
+    loadmon_ewma(ts, num_cores, cyc_busy, cycles);
+    return;
   }
 
   /* waiting period after scaling decsions */
@@ -323,7 +429,8 @@ void flexnic_loadmon(uint32_t ts)
   if (num_cores > 1 && id_cyc > ewma_cycles * 5 / 4) {
     fprintf(stderr, "flexnic_loadmon: down cores = %u   idle_cyc = %lu  "
         "1.2 cores = %lu\n", num_cores, id_cyc, ewma_cycles * 5 / 4);
-    flexnic_scale_to(num_cores - 1);
+    if (flexnic_scale_to(num_cores - 1) == 0)
+      scale_record(ts, num_cores - 1, FLEXNIC_PL_SCALE_LOAD, 0);
     waiting = 1;
     waiting_n = 0;
     return;
@@ -333,9 +440,219 @@ void flexnic_loadmon(uint32_t ts)
   if (num_cores < fp_cores_max && id_cyc < ewma_cycles / 5) {
     fprintf(stderr, "flexnic_loadmon: up cores = %u   idle_cyc = %lu  "
         "0.2 cores = %lu\n", num_cores, id_cyc,  ewma_cycles / 5);
-    flexnic_scale_to(num_cores + 1);
+    if (flexnic_scale_to(num_cores + 1) == 0)
+      scale_record(ts, num_cores + 1, FLEXNIC_PL_SCALE_LOAD, 1);
     waiting = 1;
     waiting_n = 0;
     return;
   }
 }
+
+/* max. app rx queue fill on active cores [1/1000] */
+static unsigned arx_fill(unsigned num_cores)
+{
+  struct flextcp_pl_appctx *actx;
+  unsigned c, db, f, max = 0;
+
+  for (c = 0; c < num_cores; c++) {
+    for (db = 0; db < FLEXNIC_PL_APPCTX_NUM; db++) {
+      actx = &fp_state->appctx[c][db];
+      if (actx->rx_len == 0)
+        continue;
+
+      f = (uint64_t) (actx->rx_len - actx->rx_avail) * 1000 / actx->rx_len;
+      max = MAX(max, f);
+    }
+  }
+  return max;
+}
+
+/**
+ * Predictive policy: the load in cores is smoothed and extrapolated with its
+ * trend to when the next decision could be made. Scaling up needs the
+ * prediction (or queues filling up) to hold for a few rounds, scaling down
+ * for a whole dwell period, and decisions are at least a dwell period apart.
+ */
+static void loadmon_ewma(uint32_t ts, unsigned num_cores, uint64_t cyc_busy,
+    uint64_t cycles)
+{
+  static int64_t ewma_load = 0, ewma_trend = 0;
+  static unsigned rounds = 0, up_n = 0, down_n = 0;
+  struct flextcp_pl_scalest *ss = &fp_state->scalest;
+  unsigned i, f, dwell, rxq = 0, arxq;
+  int64_t load, prev, pred, cap;
+  int pressure = 0;
+
+  dwell = MAX(config.fp_autoscale_dwell / LOADMON_INTERVAL_MS, 1);
+
+  load = (cycles > 0 ? cyc_busy * 1000 / cycles : 0);
+  prev = ewma_load;
+  ewma_load = (7 * ewma_load + load) / 8;
+  ewma_trend = (7 * ewma_trend + (ewma_load - prev)) / 8;
+  pred = MAX(ewma_load + ewma_trend * (int64_t) dwell, 0);
+  ss->load = ewma_load;
+  ss->load_pred = pred;
+
+  if (config.fp_autoscale_queues) {
+    for (i = 0; i < num_cores; i++) {
+      f = network_rx_queue_fill(i);
+      rxq = MAX(rxq, f);
+    }
+    arxq = arx_fill(num_cores);
+    ss->rxq_fill = rxq;
+    ss->arxq_fill = arxq;
+    pressure = (rxq >= SCALE_RXQ_FILL || arxq >= SCALE_ARXQ_FILL);
+  }
+
+  if (++rounds < dwell)
+    return;
+
+  cap = num_cores * 1000;
+  if (num_cores < fp_cores_max && (pred > cap - SCALE_UP_IDLE || pressure))
+    up_n++;
+  else
+    up_n = 0;
+
+  if (num_cores > 1 && !pressure && pred < cap - SCALE_DOWN_IDLE)
+    down_n++;
+  else
+    down_n = 0;
+
+  if (up_n >= SCALE_UP_ROUNDS) {
+    fprintf(stderr, "flexnic_loadmon: up cores = %u   load = %"PRId64
+        "  pred = %"PRId64"  rxq = %u  arxq = %u\n", num_cores, ewma_load,
+        pred, ss->rxq_fill, ss->arxq_fill);
+    if (flexnic_scale_to(num_cores + 1) == 0) {
+      scale_record(ts, num_cores + 1, (pred > cap - SCALE_UP_IDLE ?
+            FLEXNIC_PL_SCALE_LOAD : FLEXNIC_PL_SCALE_QUEUES), 1);
+    }
+    rounds = up_n = down_n = 0;
+  } else if (down_n >= dwell) {
+    fprintf(stderr, "flexnic_loadmon: down cores = %u   load = %"PRId64
+        "  pred = %"PRId64"\n", num_cores, ewma_load, pred);
+    if (flexnic_scale_to(num_cores - 1) == 0) {
+      scale_record(ts, num_cores - 1, FLEXNIC_PL_SCALE_LOAD, 0);
+    }
+    rounds = up_n = down_n = 0;
+  }
+}
+
+/**
+ * Move the hottest flow groups off the busiest core, a few at a time. The
+ * load of a group is estimated from its share of the packets and bytes its
+ * core handled, applied to the busy cycles of that core.
+ */
+static void fg_rebalance(void)
+{
+  static uint64_t last_tsc = 0;
+  static unsigned rounds = 0;
+  uint16_t fgs[FG_REBALANCE_MAX], cores[FG_REBALANCE_MAX];
+  uint64_t tsc, cycles, x, w, cost, best_cost, gap, pkts, bytes;
+  unsigned i, n, num_cores, max, c_max, c_min;
+  struct core_load *cl;
+  uint16_t fg, best;
+
+  if (config.fp_fg_rebalance == 0 || ++rounds < FG_REBALANCE_ROUNDS)
+    return;
+  rounds = 0;
+
+  /* cores may not have registered their contexts yet, like in
+   * flexnic_loadmon; checked up front so no counters are half sampled */
+  for (i = 0; i < fp_cores_max; i++) {
+    if (ctxs[i] == NULL)
+      return;
+  }
+
+  tsc = rte_get_tsc_cycles();
+  cycles = tsc - last_tsc;
+
+  /* busy cycles during interval for all cores */
+  num_cores = fp_cores_cur;
+  for (i = 0; i < fp_cores_max; i++) {
+    cl = &core_loads[i];
+    x = ctxs[i]->loadmon_cyc_busy;
+    cl->rb_busy = x - cl->rb_cyc_busy;
+    cl->rb_cyc_busy = x;
+    cl->rb_weight = 0;
+  }
+
+  /* sum up flow group counters from all cores, as groups may have moved */
+  for (fg = 0; fg < rss_reta_size; fg++) {
+    pkts = bytes = 0;
+    for (i = 0; i < fp_cores_max; i++) {
+      pkts += ctxs[i]->fg_stats[fg].pkts;
+      bytes += ctxs[i]->fg_stats[fg].bytes;
+    }
+
+    w = (pkts - fg_last[fg].pkts) +
+      (bytes - fg_last[fg].bytes) / FG_REBALANCE_PKT_BYTES;
+    fg_last[fg].pkts = pkts;
+    fg_last[fg].bytes = bytes;
+
+    fg_weight[fg] = w;
+    if ((i = network_flow_group_core(fg)) < num_cores) {
+      core_loads[i].rb_weight += w;
+    }
+  }
+
+  /* the reta is only changed by one side at a time */
+  if (last_tsc == 0 || fp_scale_to != 0 || num_cores < 2) {
+    last_tsc = tsc;
+    return;
+  }
+  last_tsc = tsc;
+
+  max = MIN(config.fp_fg_rebalance, FG_REBALANCE_MAX);
+  for (n = 0; n < max; n++) {
+    c_max = c_min = 0;
+    for (i = 1; i < num_cores; i++) {
+      if (core_loads[i].rb_busy > core_loads[c_max].rb_busy)
+        c_max = i;
+      if (core_loads[i].rb_busy < core_loads[c_min].rb_busy)
+        c_min = i;
+    }
+
+    /* only worth it if the busiest core gets loaded and is well ahead */
+    gap = core_loads[c_max].rb_busy - core_loads[c_min].rb_busy;
+    if (core_loads[c_max].rb_busy < cycles / 2 || gap < cycles / 10 ||
+        core_loads[c_max].rb_weight == 0)
+    {
+      break;
+    }
+
+    /* hottest group that doesn't just make the other core the busiest */
+    best = UINT16_MAX;
+    best_cost = 0;
+    for (fg = 0; fg < rss_reta_size; fg++) {
+      if (fg_weight[fg] == 0 || network_flow_group_core(fg) != c_max)
+        continue;
+
+      cost = core_loads[c_max].rb_busy * fg_weight[fg] /
+        core_loads[c_max].rb_weight;
+      if (cost <= gap / 2 && cost > best_cost) {
+        best = fg;
+        best_cost = cost;
+      }
+    }
+    if (best == UINT16_MAX)
+      break;
+
+    fgs[n] = best;
+    cores[n] = c_min;
+
+    core_loads[c_max].rb_busy -= best_cost;
+    core_loads[c_min].rb_busy += best_cost;
+    core_loads[c_max].rb_weight -= fg_weight[best];
+    core_loads[c_min].rb_weight += fg_weight[best];
+    fg_weight[best] = 0;
+  }
+
+  if (n > 0) {
+    fprintf(stderr, "flexnic_loadmon: moving %u flow groups, busiest core %u "
+        "busy = %" PRIu64 "  cycles = %" PRIu64 "\n", n, c_max,
+        core_loads[c_max].rb_busy, cycles);
+    if (network_flow_groups_move(n, fgs, cores) != 0) {
+      fprintf(stderr, "flexnic_loadmon: moving flow groups failed\n");
+    }
+  }
+}
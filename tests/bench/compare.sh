@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Compares two results files from tests/bench/run.sh point by point and
+# lists the metrics that got worse by more than THRESHOLD percent: lower
+# throughput, or higher latency and cycles per packet. Exits with 1 if any
+# did, so it can gate a CI job.
+#
+# Usage: tests/bench/compare.sh BASELINE.tsv NEW.tsv [THRESHOLD]
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+  echo "Usage: $0 BASELINE.tsv NEW.tsv [THRESHOLD]" >&2
+  exit 2
+fi
+
+awk -F '\t' -v thr="${3:-5}" '
+  # columns up to cc identify a point, everything after is a metric
+  FNR == 1 {
+    for (i = 1; i <= NF; i++) {
+      col[i] = $i
+      if ($i == "cc")
+        nkey = i
+    }
+    nf = NF
+    next
+  }
+  {
+    key = col[2] "=" $2
+    for (i = 3; i <= nkey; i++)
+      key = key " " col[i] "=" $i
+  }
+  FILENAME == ARGV[1] {
+    for (i = nkey + 1; i <= nf; i++)
+      base[key, i] = $i
+    seen[key] = 1
+    next
+  }
+  !(key in seen) {
+    print "new point: " key
+    next
+  }
+  {
+    for (i = nkey + 1; i <= nf; i++) {
+      b = base[key, i]
+      if (b == 0)
+        continue
+      d = ($i - b) * 100 / b
+      # throughput metrics are better when higher
+      if (col[i] == "mops" || col[i] == "mpps" || col[i] == "gbps")
+        d = -d
+      if (d > thr) {
+        printf "%s: %s %s -> %s (%.1f%% worse)\n", key, col[i], b, $i, d
+        worse = 1
+      }
+    }
+  }
+  END { exit worse }
+' "$1" "$2"
@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# Fast path benchmark matrix, run on the client host from the top of the
+# tree (make bench). For every fast path core count the local TAS is
+# restarted, then tests/bench_ll_client runs each combination of connection
+# count, message size and congestion control algorithm against the server,
+# appending one tab-separated row per point to the results file. Compare two
+# results files with tests/bench/compare.sh.
+#
+# The server host runs TAS and one tests/bench_ll_echo per port, e.g. for
+# PORTS=32: for p in $(seq 1234 1265); do tests/bench_ll_echo $p 1 65536 & done
+#
+# Settings (environment):
+#   SERVER    server IP (required)
+#   TAS_ARGS  arguments for the local TAS, at least --ip-addr (required)
+#   CONNS     connection counts [1 64 4096 65536 1048576]
+#   SIZES     message sizes [64 1024 16384]
+#   CORES     fast path core counts [1 2 4]
+#   CCS       congestion control algorithms [default]
+#   THREADS   application threads [4]
+#   PORT      first server port [1234]
+#   PORTS     server ports to spread connections over [32]
+#   WARMUP    seconds before measuring each point [5]
+#   DURATION  seconds measured per point [10]
+#   LABEL     label for the rows [git describe]
+#   OUT       results file [bench-LABEL.tsv]
+
+set -e
+
+: "${SERVER:?set SERVER to the server IP}"
+: "${TAS_ARGS:?set TAS_ARGS to the local TAS arguments, e.g. --ip-addr=10.0.0.2/24}"
+CONNS=${CONNS:-"1 64 4096 65536 1048576"}
+SIZES=${SIZES:-"64 1024 16384"}
+CORES=${CORES:-"1 2 4"}
+CCS=${CCS:-"default"}
+THREADS=${THREADS:-4}
+PORT=${PORT:-1234}
+PORTS=${PORTS:-32}
+WARMUP=${WARMUP:-5}
+DURATION=${DURATION:-10}
+LABEL=${LABEL:-$(git describe --always --dirty 2>/dev/null || echo unknown)}
+OUT=${OUT:-bench-$LABEL.tsv}
+LOG=bench-tas.log
+
+tas_pid=
+tas_stop() {
+  if [ -n "$tas_pid" ]; then
+    kill "$tas_pid" 2>/dev/null || true
+    wait "$tas_pid" 2>/dev/null || true
+    tas_pid=
+  fi
+}
+trap tas_stop EXIT
+trap 'exit 1' INT TERM
+
+# flow state for the largest point
+flows=1024
+for c in $CONNS; do
+  [ "$c" -ge "$flows" ] && flows=$((c + 1024))
+done
+
+for cores in $CORES; do
+  # fixed core count, autoscaling would make points incomparable
+  ./tas/tas $TAS_ARGS --fp-cores-max="$cores" --fp-autoscale=off \
+    --fp-flows="$flows" >"$LOG" 2>&1 &
+  tas_pid=$!
+  until grep -q "kernel ready" "$LOG"; do
+    if ! kill -0 "$tas_pid" 2>/dev/null; then
+      echo "tas exited during startup, see $LOG" >&2
+      exit 1
+    fi
+    sleep 1
+  done
+
+  for cc in $CCS; do
+    for conns in $CONNS; do
+      for size in $SIZES; do
+        threads=$THREADS
+        [ "$conns" -lt "$threads" ] && threads=$conns
+        tests/bench_ll_client -p "$PORT" -n "$PORTS" -c "$conns" \
+          -m "$size" -t "$threads" -C "$cc" -w "$WARMUP" -d "$DURATION" \
+          -o "$OUT" -l "$LABEL" "$SERVER"
+      done
+    done
+  done
+
+  tas_stop
+done
+
+echo "results in $OUT"
@@ -0,0 +1,440 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Closed-loop request/response load against bench_ll_echo, for the
+ * benchmark suite (see tests/bench/run.sh). Each connection keeps one
+ * message in flight. After warmup, throughput and latency are measured over
+ * a fixed interval, together with the fast path counters from the local
+ * statistics region, and written as one tab-separated row.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <tas_ll.h>
+#include <tas_ll_connect.h>
+#include <tas_memif.h>
+#include <utils.h>
+
+/* connections being opened at the same time per thread */
+#define OPEN_WINDOW 64
+
+static uint32_t server_ip;
+static uint16_t server_port = 1234;
+static uint16_t server_ports = 1;
+static uint32_t num_conns = 1;
+static uint32_t msg_size = 64;
+static unsigned num_threads = 1;
+static unsigned warmup = 5;
+static unsigned duration = 10;
+static int cc_alg = FLEXTCP_CC_DEFAULT;
+static const char *cc_name = "default";
+static const char *out_path = NULL;
+static const char *label = "-";
+static uint16_t max_events = 64;
+
+static volatile int measuring = 0;
+static volatile int stopping = 0;
+static uint32_t conns_open = 0;
+
+struct connection {
+    struct flextcp_connection conn;
+    /* message bytes left to send and to receive */
+    uint32_t tx_rem;
+    uint32_t rx_rem;
+    /* cycle counter when the message was sent */
+    uint64_t tsc;
+    /* on list of connections waiting for tx buffer space */
+    struct connection *tx_next;
+    uint8_t tx_queued;
+};
+
+struct core {
+    struct flextcp_context context;
+    struct connection *conns;
+    uint32_t conns_num;
+    uint32_t opened;
+    uint32_t pending;
+    struct connection *tx_wait;
+    int cn;
+
+    /* only updated while measuring */
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t lat_buckets[FLEXNIC_STATS_HIST_BUCKETS];
+} __attribute__((aligned((64))));
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Usage: ./bench_ll_client [OPTIONS] SERVER-IP\n"
+        "  -p PORT     First server port [1234]\n"
+        "  -n PORTS    Spread connections over PORTS consecutive ports [1]\n"
+        "  -c CONNS    Total connections [1]\n"
+        "  -m BYTES    Message size [64]\n"
+        "  -t THREADS  Application threads, one context each [1]\n"
+        "  -C CC       Congestion control algorithm [TAS default]\n"
+        "  -w SECONDS  Warmup before measuring [5]\n"
+        "  -d SECONDS  Measurement duration [10]\n"
+        "  -o FILE     Append results as tab-separated row to FILE\n"
+        "  -l LABEL    Label for the results row, e.g. the version [-]\n");
+}
+
+static inline void conn_send(struct core *co, struct connection *c)
+{
+    ssize_t ret;
+    void *buf_1, *buf_2;
+    size_t len_1;
+
+    ret = flextcp_connection_tx_alloc2(&c->conn, c->tx_rem, &buf_1, &len_1,
+            &buf_2);
+    if (ret > 0) {
+        if (flextcp_connection_tx_send(&co->context, &c->conn, ret) != 0) {
+            fprintf(stderr, "[%d] flextcp_connection_tx_send failed\n", co->cn);
+            abort();
+        }
+        c->tx_rem -= ret;
+    }
+
+    /* retry once the buffer opens up */
+    if (c->tx_rem > 0 && !c->tx_queued) {
+        c->tx_queued = 1;
+        c->tx_next = co->tx_wait;
+        co->tx_wait = c;
+    }
+}
+
+static inline void msg_start(struct core *co, struct connection *c)
+{
+    c->tx_rem = msg_size;
+    c->rx_rem = msg_size;
+    c->tsc = util_rdtsc();
+    conn_send(co, c);
+}
+
+static void connections_open(struct core *co)
+{
+    struct connection *c;
+    uint16_t port;
+
+    while (co->opened < co->conns_num && co->pending < OPEN_WINDOW) {
+        c = &co->conns[co->opened];
+        port = server_port + (co->opened * num_threads + co->cn) %
+            server_ports;
+        if (flextcp_connection_open_cc(&co->context, &c->conn, server_ip, port,
+                    0, 0, cc_alg) != 0)
+        {
+            fprintf(stderr, "[%d] flextcp_connection_open failed\n", co->cn);
+            abort();
+        }
+        co->opened++;
+        co->pending++;
+    }
+}
+
+static inline void conn_received(struct core *co, struct connection *c,
+        size_t len)
+{
+    uint64_t lat;
+
+    if (flextcp_connection_rx_done(&co->context, &c->conn, len) != 0) {
+        fprintf(stderr, "[%d] flextcp_connection_rx_done failed\n", co->cn);
+        abort();
+    }
+
+    if (len > c->rx_rem) {
+        fprintf(stderr, "[%d] received more than was sent\n", co->cn);
+        abort();
+    }
+    c->rx_rem -= len;
+    if (c->rx_rem > 0)
+        return;
+
+    if (measuring) {
+        lat = util_rdtsc() - c->tsc;
+        co->lat_buckets[flexnic_stats_hist_bucket(lat)]++;
+        co->msgs++;
+        co->bytes += msg_size;
+    }
+
+    if (!stopping)
+        msg_start(co, c);
+}
+
+static void *thread_run(void *arg)
+{
+    struct core *co = arg;
+    int n, i, cn = co->cn;
+    struct flextcp_event *evs, *ev;
+    struct connection *c, *next;
+
+    evs = calloc(max_events, sizeof(*evs));
+    if (evs == NULL) {
+        fprintf(stderr, "[%d] Allocating event buffer failed\n", cn);
+        abort();
+    }
+
+    connections_open(co);
+    while (1) {
+        if ((n = flextcp_context_poll(&co->context, max_events, evs)) < 0) {
+            fprintf(stderr, "[%d] flextcp_context_poll failed\n", cn);
+            abort();
+        }
+
+        for (i = 0; i < n; i++) {
+            ev = evs + i;
+
+            switch (ev->event_type) {
+                case FLEXTCP_EV_CONN_OPEN:
+                    if (ev->ev.conn_open.status != 0) {
+                        fprintf(stderr, "[%d] connection open failed\n", cn);
+                        abort();
+                    }
+                    c = (struct connection *) ev->ev.conn_open.conn;
+                    co->pending--;
+                    __sync_fetch_and_add(&conns_open, 1);
+                    connections_open(co);
+                    msg_start(co, c);
+                    break;
+
+                case FLEXTCP_EV_CONN_RECEIVED:
+                    c = (struct connection *) ev->ev.conn_received.conn;
+                    conn_received(co, c, ev->ev.conn_received.len);
+                    break;
+
+                case FLEXTCP_EV_CONN_SENDBUF:
+                    /* picked up from the wait list below */
+                    break;
+
+                default:
+                    fprintf(stderr, "[%d] Unexpected flextcp event: %u\n", cn,
+                            ev->event_type);
+            }
+        }
+
+        /* retry sends that didn't fit in the buffer */
+        c = co->tx_wait;
+        co->tx_wait = NULL;
+        for (; c != NULL; c = next) {
+            next = c->tx_next;
+            c->tx_queued = 0;
+            conn_send(co, c);
+        }
+    }
+
+    return NULL;
+}
+
+static void stats_sample(const struct flexnic_stats *stats, uint64_t *pkts,
+        uint64_t *cyc)
+{
+    uint32_t i, j;
+
+    *pkts = 0;
+    memset(cyc, 0, FLEXNIC_STATS_STAGE_NUM * sizeof(*cyc));
+    for (i = 0; i < stats->cores_num; i++) {
+        *pkts += stats->cores[i].rx_pkts + stats->cores[i].tx_pkts;
+        for (j = 0; j < FLEXNIC_STATS_STAGE_NUM; j++) {
+            cyc[j] += stats->cores[i].cyc_stage[j];
+        }
+    }
+}
+
+/* upper end of the bucket the quantile falls in, in microseconds */
+static double lat_quantile(const uint64_t *buckets, uint64_t cnt, double q,
+        uint64_t tsc_hz)
+{
+    uint64_t c = 0, v;
+    unsigned b;
+
+    for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS - 1; b++) {
+        c += buckets[b];
+        if (c >= q * cnt)
+            break;
+    }
+    v = (b + 1 < FLEXNIC_STATS_HIST_BUCKETS ?
+            flexnic_stats_hist_low(b + 1) - 1 : flexnic_stats_hist_low(b));
+    return v * 1e6 / tsc_hz;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct flexnic_stats *stats;
+    struct core *cs;
+    pthread_t *pts;
+    struct in_addr addr;
+    uint64_t buckets[FLEXNIC_STATS_HIST_BUCKETS];
+    uint64_t pkts[2], cyc[2][FLEXNIC_STATS_STAGE_NUM], msgs = 0, bytes = 0;
+    uint32_t per_thread;
+    struct stat st;
+    FILE *f;
+    double secs, gbps, p50, p99, p999;
+    unsigned i, j;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:c:m:t:C:w:d:o:l:h")) != -1) {
+        switch (opt) {
+            case 'p': server_port = atoi(optarg); break;
+            case 'n': server_ports = atoi(optarg); break;
+            case 'c': num_conns = atoi(optarg); break;
+            case 'm': msg_size = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'C': cc_name = optarg; break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'l': label = optarg; break;
+            default:
+                print_usage();
+                return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (optind + 1 != argc || inet_aton(argv[optind], &addr) == 0) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    server_ip = ntohl(addr.s_addr);
+
+    if (num_threads == 0 || num_conns < num_threads || msg_size == 0 ||
+            server_ports == 0 || duration == 0)
+    {
+        fprintf(stderr, "need at least one connection per thread, and a "
+            "non-zero message size, port count and duration\n");
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(cc_name, "default") &&
+            (cc_alg = flextcp_cc_lookup(cc_name)) < 0)
+    {
+        fprintf(stderr, "unknown congestion control algorithm %s\n", cc_name);
+        return EXIT_FAILURE;
+    }
+
+    if (flextcp_init() != 0) {
+        fprintf(stderr, "flextcp_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (flexnic_driver_stats(&stats) != 0) {
+        fprintf(stderr, "flexnic_driver_stats failed\n");
+        return EXIT_FAILURE;
+    }
+
+    pts = calloc(num_threads, sizeof(*pts));
+    cs = calloc(num_threads, sizeof(*cs));
+    if (pts == NULL || cs == NULL) {
+        fprintf(stderr, "allocating thread handles failed\n");
+        return EXIT_FAILURE;
+    }
+
+    per_thread = num_conns / num_threads;
+    for (i = 0; i < num_threads; i++) {
+        cs[i].cn = i;
+        cs[i].conns_num = per_thread + (i < num_conns % num_threads);
+        if ((cs[i].conns = calloc(cs[i].conns_num, sizeof(*cs[i].conns)))
+                == NULL)
+        {
+            fprintf(stderr, "allocating connections failed\n");
+            return EXIT_FAILURE;
+        }
+        if (flextcp_context_create(&cs[i].context) != 0) {
+            fprintf(stderr, "flextcp_context_create failed %d\n", i);
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(pts + i, NULL, thread_run, cs + i)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (conns_open < num_conns) {
+        sleep(1);
+    }
+    sleep(warmup);
+
+    stats_sample(stats, &pkts[0], cyc[0]);
+    measuring = 1;
+    sleep(duration);
+    measuring = 0;
+    stats_sample(stats, &pkts[1], cyc[1]);
+    stopping = 1;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i = 0; i < num_threads; i++) {
+        msgs += cs[i].msgs;
+        bytes += cs[i].bytes;
+        for (j = 0; j < FLEXNIC_STATS_HIST_BUCKETS; j++) {
+            buckets[j] += cs[i].lat_buckets[j];
+        }
+    }
+    pkts[1] -= pkts[0];
+    for (j = 0; j < FLEXNIC_STATS_STAGE_NUM; j++) {
+        cyc[1][j] -= cyc[0][j];
+    }
+
+    secs = duration;
+    /* payload goes both ways */
+    gbps = bytes * 2 * 8 / secs / 1e9;
+    p50 = lat_quantile(buckets, msgs, 0.5, stats->tsc_hz);
+    p99 = lat_quantile(buckets, msgs, 0.99, stats->tsc_hz);
+    p999 = lat_quantile(buckets, msgs, 0.999, stats->tsc_hz);
+
+    printf("conns=%u size=%u threads=%u fp_cores=%u cc=%s: %.3f Mops "
+        "%.3f Mpps %.3f Gbps p50=%.1fus p99=%.1fus p999=%.1fus\n",
+        num_conns, msg_size, num_threads, stats->cores_num, cc_name,
+        msgs / secs / 1e6, pkts[1] / secs / 1e6, gbps,
+        p50, p99, p999);
+
+    if (out_path == NULL)
+        return EXIT_SUCCESS;
+
+    if ((f = fopen(out_path, "a")) == NULL) {
+        perror("opening results file failed");
+        return EXIT_FAILURE;
+    }
+    if (fstat(fileno(f), &st) == 0 && st.st_size == 0) {
+        fprintf(f, "label\tconns\tsize\tthreads\tfp_cores\tcc\tmops\tmpps\t"
+            "gbps\tp50_us\tp99_us\tp999_us\tcyc_pkt_rx\tcyc_pkt_fwd\t"
+            "cyc_pkt_qman\tcyc_pkt_queues\tcyc_pkt_kernel\n");
+    }
+    fprintf(f, "%s\t%u\t%u\t%u\t%u\t%s\t%.4f\t%.4f\t%.4f\t%.2f\t%.2f\t%.2f",
+        label, num_conns, msg_size, num_threads, stats->cores_num, cc_name,
+        msgs / secs / 1e6, pkts[1] / secs / 1e6, gbps,
+        p50, p99, p999);
+    for (j = 0; j < FLEXNIC_STATS_STAGE_NUM; j++) {
+        fprintf(f, "\t%.1f", (pkts[1] > 0 ? (double) cyc[1][j] / pkts[1] : 0));
+    }
+    fprintf(f, "\n");
+    fclose(f);
+
+    return EXIT_SUCCESS;
+}
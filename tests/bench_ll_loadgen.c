@@ -0,0 +1,788 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Open-loop request/response load against bench_ll_rpcsrv. Requests are
+ * issued at their scheduled arrival times whether or not earlier responses
+ * are back, and latency is measured from the scheduled time, so a server
+ * falling behind shows up as latency instead of lowering the offered load
+ * (coordinated omission). Arrivals are Poisson or replayed from a trace, and
+ * request and response sizes are drawn from configurable distributions.
+ * Latencies can be written in the HdrHistogram percentile format.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tas_ll.h>
+#include <tas_ll_connect.h>
+#include <tas_memif.h>
+#include <utils.h>
+#include <utils_rng.h>
+
+/* connections being opened at the same time per thread */
+#define OPEN_WINDOW 64
+/* max. outstanding requests per connection, power of two */
+#define QUEUE_LEN 128
+/* max. requests issued per loop iteration, the rest in the next one */
+#define ISSUE_BATCH 256
+
+/* latency histogram [ns]: linear sub-buckets per power of two as in
+ * flexnic_stats_hist, but finer (< 1% wide), up to 2^40 ns */
+#define LAT_SUB_BITS 7
+#define LAT_BUCKETS (34 << LAT_SUB_BITS)
+
+/* request header, see bench_ll_rpcsrv.c */
+struct rpc_hdr {
+    /* request length including this header */
+    uint32_t req_len;
+    /* response length */
+    uint32_t resp_len;
+} __attribute__((packed));
+
+enum dist_type {
+    DIST_FIXED,
+    DIST_UNIFORM,
+    DIST_EXP,
+    DIST_BIMODAL,
+};
+
+struct dist {
+    enum dist_type type;
+    double a;
+    double b;
+    double p;
+};
+
+struct trace_ent {
+    /* arrival time relative to the start of the trace */
+    uint64_t tsc;
+    uint32_t req_len;
+    uint32_t resp_len;
+};
+
+struct request {
+    /* cycle counter at the scheduled arrival */
+    uint64_t tsc;
+    uint32_t req_len;
+    uint32_t resp_len;
+    uint8_t measure;
+};
+
+struct connection {
+    struct flextcp_connection conn;
+    /* requests issued, sent and answered; reqs[tx] is sent up to tx_off,
+     * the response to reqs[rx] is received up to rx_off */
+    struct request reqs[QUEUE_LEN];
+    uint32_t head;
+    uint32_t tx;
+    uint32_t rx;
+    uint32_t tx_off;
+    uint32_t rx_off;
+    /* on list of connections waiting for tx buffer space */
+    struct connection *tx_next;
+    uint8_t tx_queued;
+};
+
+struct core {
+    struct flextcp_context context;
+    struct connection *conns;
+    uint32_t conns_num;
+    uint32_t opened;
+    uint32_t pending;
+    uint32_t next_conn;
+    struct connection *tx_wait;
+    struct utils_rng rng;
+    int cn;
+
+    /* next arrival, and position in the trace */
+    uint64_t next_tsc;
+    uint64_t trace_base;
+    size_t trace_pos;
+
+    /* only updated for requests scheduled while measuring */
+    uint64_t issued;
+    uint64_t overflows;
+    uint64_t done;
+    uint64_t bytes;
+    double lat_sum;
+    double lat_sq;
+    uint64_t *lat_buckets;
+} __attribute__((aligned((64))));
+
+static uint32_t server_ip;
+static uint16_t server_port = 1234;
+static uint16_t server_ports = 1;
+static uint32_t num_conns = 1;
+static unsigned num_threads = 1;
+static double rate = 10000;
+static struct dist req_dist = { .type = DIST_FIXED, .a = 64 };
+static struct dist resp_dist = { .type = DIST_FIXED, .a = 64 };
+static const char *trace_path = NULL;
+static const char *hdr_path = NULL;
+static unsigned warmup = 5;
+static unsigned duration = 10;
+static uint64_t seed = 1;
+static int cc_alg = FLEXTCP_CC_DEFAULT;
+static const char *cc_name = "default";
+static uint16_t max_events = 64;
+
+static struct trace_ent *trace;
+static size_t trace_num;
+static uint64_t trace_span;
+static uint64_t tsc_hz;
+static double mean_gap;
+static double ns_per_cyc;
+
+static volatile int running = 0;
+static volatile int measuring = 0;
+static uint32_t conns_open = 0;
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Usage: ./bench_ll_loadgen [OPTIONS] SERVER-IP\n"
+        "  -p PORT     First server port [1234]\n"
+        "  -n PORTS    Spread connections over PORTS consecutive ports [1]\n"
+        "  -c CONNS    Total connections [1]\n"
+        "  -t THREADS  Application threads, one context each [1]\n"
+        "  -r RATE     Poisson arrivals, requests per second in total "
+            "[10000]\n"
+        "  -T FILE     Replay arrivals from FILE instead, one request per "
+            "line:\n"
+        "              TIME-US REQ-BYTES RESP-BYTES, repeated in a loop\n"
+        "  -q DIST     Request size distribution [fixed:64]\n"
+        "  -s DIST     Response size distribution [fixed:64]\n"
+        "              DIST: fixed:N, uniform:MIN:MAX, exp:MEAN, "
+            "bimodal:A:B:P (A with\n"
+        "              probability P)\n"
+        "  -C CC       Congestion control algorithm [TAS default]\n"
+        "  -w SECONDS  Warmup before measuring [5]\n"
+        "  -d SECONDS  Measurement duration [10]\n"
+        "  -S SEED     Random seed [1]\n"
+        "  -H FILE     Write latencies in HdrHistogram percentile format "
+            "[us]\n");
+}
+
+/* histogram bucket for latency v [ns] */
+static inline unsigned lat_bucket(uint64_t v)
+{
+    unsigned e, b;
+
+    if (v < (1 << LAT_SUB_BITS))
+        return v;
+
+    e = 63 - __builtin_clzll(v);
+    b = ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) |
+        ((v >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+    return (b < LAT_BUCKETS ? b : LAT_BUCKETS - 1);
+}
+
+/* largest latency in bucket b [ns] */
+static uint64_t lat_high(unsigned b)
+{
+    unsigned e;
+
+    if (b < (1 << LAT_SUB_BITS))
+        return b;
+
+    e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    return ((1ULL << e) | ((uint64_t) (b & ((1 << LAT_SUB_BITS) - 1)) <<
+            (e - LAT_SUB_BITS))) + (1ULL << (e - LAT_SUB_BITS)) - 1;
+}
+
+static int dist_parse(const char *s, struct dist *d)
+{
+    int n;
+
+    memset(d, 0, sizeof(*d));
+    if (sscanf(s, "fixed:%lf%n", &d->a, &n) == 1 && s[n] == 0) {
+        d->type = DIST_FIXED;
+    } else if (sscanf(s, "uniform:%lf:%lf%n", &d->a, &d->b, &n) == 2 &&
+            s[n] == 0 && d->a <= d->b)
+    {
+        d->type = DIST_UNIFORM;
+    } else if (sscanf(s, "exp:%lf%n", &d->a, &n) == 1 && s[n] == 0) {
+        d->type = DIST_EXP;
+    } else if (sscanf(s, "bimodal:%lf:%lf:%lf%n", &d->a, &d->b, &d->p, &n)
+            == 3 && s[n] == 0 && d->p >= 0 && d->p <= 1)
+    {
+        d->type = DIST_BIMODAL;
+    } else {
+        fprintf(stderr, "invalid distribution: %s\n", s);
+        return -1;
+    }
+    return 0;
+}
+
+static inline uint32_t dist_sample(const struct dist *d,
+        struct utils_rng *rng, uint32_t min)
+{
+    double v;
+
+    switch (d->type) {
+        case DIST_UNIFORM:
+            v = d->a + utils_rng_gend(rng) * (d->b - d->a + 1);
+            break;
+        case DIST_EXP:
+            v = -log(1 - utils_rng_gend(rng)) * d->a;
+            break;
+        case DIST_BIMODAL:
+            v = (utils_rng_gend(rng) < d->p ? d->a : d->b);
+            break;
+        default:
+            v = d->a;
+            break;
+    }
+
+    if (v < min)
+        return min;
+    return (v > UINT32_MAX / 2 ? UINT32_MAX / 2 : v);
+}
+
+static int trace_load(const char *path)
+{
+    FILE *f;
+    char line[256];
+    double t;
+    unsigned req, resp;
+    size_t cap = 0;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        perror("opening trace failed");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%lf %u %u", &t, &req, &resp) != 3 || t < 0) {
+            fprintf(stderr, "invalid trace line: %s", line);
+            fclose(f);
+            return -1;
+        }
+
+        if (trace_num == cap) {
+            cap = (cap == 0 ? 1024 : cap * 2);
+            if ((trace = realloc(trace, cap * sizeof(*trace))) == NULL) {
+                perror("trace realloc failed");
+                fclose(f);
+                return -1;
+            }
+        }
+        trace[trace_num].tsc = t * tsc_hz / 1e6;
+        trace[trace_num].req_len = MAX(req, sizeof(struct rpc_hdr));
+        trace[trace_num].resp_len = MAX(resp, 1);
+        if (trace_num > 0 && trace[trace_num].tsc < trace[trace_num - 1].tsc) {
+            fprintf(stderr, "trace not sorted by time: %s", line);
+            fclose(f);
+            return -1;
+        }
+        trace_num++;
+    }
+    fclose(f);
+
+    if (trace_num == 0) {
+        fprintf(stderr, "trace is empty\n");
+        return -1;
+    }
+
+    /* loop with the mean gap between the last and first arrival */
+    trace_span = trace[trace_num - 1].tsc +
+        MAX(trace[trace_num - 1].tsc / trace_num, 1);
+    return 0;
+}
+
+/* tx buffer may wrap, write n bytes from src at pos in the allocation */
+static inline void tx_copy(void *buf_1, size_t len_1, void *buf_2, size_t pos,
+        const void *src, size_t n)
+{
+    const uint8_t *s = src;
+
+    for (; n > 0; n--, pos++, s++) {
+        if (pos < len_1)
+            ((uint8_t *) buf_1)[pos] = *s;
+        else
+            ((uint8_t *) buf_2)[pos - len_1] = *s;
+    }
+}
+
+static inline void conn_send(struct core *co, struct connection *c)
+{
+    struct request *r;
+    struct rpc_hdr hdr;
+    ssize_t ret;
+    void *buf_1, *buf_2;
+    size_t len_1;
+
+    while (c->tx != c->head) {
+        r = &c->reqs[c->tx % QUEUE_LEN];
+        ret = flextcp_connection_tx_alloc2(&c->conn, r->req_len - c->tx_off,
+                &buf_1, &len_1, &buf_2);
+        if (ret <= 0)
+            break;
+
+        /* only the header matters, the rest is whatever is in the buffer */
+        if (c->tx_off < sizeof(hdr)) {
+            hdr.req_len = r->req_len;
+            hdr.resp_len = r->resp_len;
+            tx_copy(buf_1, len_1, buf_2, 0, (uint8_t *) &hdr + c->tx_off,
+                    MIN(sizeof(hdr) - c->tx_off, (size_t) ret));
+        }
+
+        if (flextcp_connection_tx_send(&co->context, &c->conn, ret) != 0) {
+            fprintf(stderr, "[%d] flextcp_connection_tx_send failed\n", co->cn);
+            abort();
+        }
+        c->tx_off += ret;
+        if (c->tx_off < r->req_len)
+            break;
+        c->tx++;
+        c->tx_off = 0;
+    }
+
+    /* retry once the buffer opens up */
+    if (c->tx != c->head && !c->tx_queued) {
+        c->tx_queued = 1;
+        c->tx_next = co->tx_wait;
+        co->tx_wait = c;
+    }
+}
+
+static inline void req_issue(struct core *co, uint64_t tsc,
+        uint32_t req_len, uint32_t resp_len)
+{
+    struct connection *c = &co->conns[co->next_conn];
+    struct request *r;
+    int m = measuring;
+
+    if (++co->next_conn >= co->conns_num)
+        co->next_conn = 0;
+
+    if (m)
+        co->issued++;
+
+    /* the request is lost, but it still counts as offered load */
+    if (c->head - c->rx >= QUEUE_LEN) {
+        if (m)
+            co->overflows++;
+        return;
+    }
+
+    r = &c->reqs[c->head % QUEUE_LEN];
+    r->tsc = tsc;
+    r->req_len = req_len;
+    r->resp_len = resp_len;
+    r->measure = m;
+    c->head++;
+
+    conn_send(co, c);
+}
+
+/* issue requests scheduled up to now and pick the next arrival */
+static inline void arrivals(struct core *co, uint64_t now)
+{
+    const struct trace_ent *te;
+    unsigned n;
+
+    for (n = 0; n < ISSUE_BATCH && co->next_tsc <= now; n++) {
+        if (trace != NULL) {
+            te = &trace[co->trace_pos];
+            req_issue(co, co->next_tsc, te->req_len, te->resp_len);
+
+            /* threads take turns on trace entries */
+            co->trace_pos += num_threads;
+            while (co->trace_pos >= trace_num) {
+                co->trace_pos -= trace_num;
+                co->trace_base += trace_span;
+            }
+            co->next_tsc = co->trace_base + trace[co->trace_pos].tsc;
+        } else {
+            req_issue(co, co->next_tsc,
+                    dist_sample(&req_dist, &co->rng, sizeof(struct rpc_hdr)),
+                    dist_sample(&resp_dist, &co->rng, 1));
+            co->next_tsc += -log(1 - utils_rng_gend(&co->rng)) * mean_gap;
+        }
+    }
+}
+
+static void connections_open(struct core *co)
+{
+    struct connection *c;
+    uint16_t port;
+
+    while (co->opened < co->conns_num && co->pending < OPEN_WINDOW) {
+        c = &co->conns[co->opened];
+        port = server_port + (co->opened * num_threads + co->cn) %
+            server_ports;
+        if (flextcp_connection_open_cc(&co->context, &c->conn, server_ip, port,
+                    0, 0, cc_alg) != 0)
+        {
+            fprintf(stderr, "[%d] flextcp_connection_open failed\n", co->cn);
+            abort();
+        }
+        co->opened++;
+        co->pending++;
+    }
+}
+
+static inline void conn_received(struct core *co, struct connection *c,
+        size_t len)
+{
+    struct request *r;
+    uint64_t now;
+    double lat;
+    size_t n;
+
+    if (flextcp_connection_rx_done(&co->context, &c->conn, len) != 0) {
+        fprintf(stderr, "[%d] flextcp_connection_rx_done failed\n", co->cn);
+        abort();
+    }
+
+    now = util_rdtsc();
+    while (len > 0) {
+        if (c->rx == c->tx) {
+            fprintf(stderr, "[%d] response without request\n", co->cn);
+            abort();
+        }
+
+        r = &c->reqs[c->rx % QUEUE_LEN];
+        n = MIN(len, r->resp_len - c->rx_off);
+        c->rx_off += n;
+        len -= n;
+        if (c->rx_off < r->resp_len)
+            break;
+
+        if (r->measure) {
+            lat = (now - r->tsc) * ns_per_cyc;
+            co->lat_buckets[lat_bucket(lat)]++;
+            co->lat_sum += lat;
+            co->lat_sq += lat * lat;
+            co->done++;
+            co->bytes += r->req_len + r->resp_len;
+        }
+        c->rx++;
+        c->rx_off = 0;
+    }
+}
+
+static void *thread_run(void *arg)
+{
+    struct core *co = arg;
+    int n, i, cn = co->cn, started = 0;
+    struct flextcp_event *evs, *ev;
+    struct connection *c, *next;
+    uint64_t now;
+
+    evs = calloc(max_events, sizeof(*evs));
+    if (evs == NULL) {
+        fprintf(stderr, "[%d] Allocating event buffer failed\n", cn);
+        abort();
+    }
+
+    connections_open(co);
+    while (1) {
+        if ((n = flextcp_context_poll(&co->context, max_events, evs)) < 0) {
+            fprintf(stderr, "[%d] flextcp_context_poll failed\n", cn);
+            abort();
+        }
+
+        for (i = 0; i < n; i++) {
+            ev = evs + i;
+
+            switch (ev->event_type) {
+                case FLEXTCP_EV_CONN_OPEN:
+                    if (ev->ev.conn_open.status != 0) {
+                        fprintf(stderr, "[%d] connection open failed\n", cn);
+                        abort();
+                    }
+                    co->pending--;
+                    __sync_fetch_and_add(&conns_open, 1);
+                    connections_open(co);
+                    break;
+
+                case FLEXTCP_EV_CONN_RECEIVED:
+                    c = (struct connection *) ev->ev.conn_received.conn;
+                    conn_received(co, c, ev->ev.conn_received.len);
+                    break;
+
+                case FLEXTCP_EV_CONN_SENDBUF:
+                    /* picked up from the wait list below */
+                    break;
+
+                default:
+                    fprintf(stderr, "[%d] Unexpected flextcp event: %u\n", cn,
+                            ev->event_type);
+            }
+        }
+
+        if (running) {
+            now = util_rdtsc();
+            if (!started) {
+                /* spread the first arrivals of the threads */
+                started = 1;
+                if (trace != NULL) {
+                    co->trace_base = now;
+                    co->trace_pos = cn % trace_num;
+                    co->next_tsc = now + trace[co->trace_pos].tsc;
+                } else {
+                    co->next_tsc = now +
+                        -log(1 - utils_rng_gend(&co->rng)) * mean_gap;
+                }
+            }
+            arrivals(co, now);
+        }
+
+        /* retry sends that didn't fit in the buffer */
+        c = co->tx_wait;
+        co->tx_wait = NULL;
+        for (; c != NULL; c = next) {
+            next = c->tx_next;
+            c->tx_queued = 0;
+            conn_send(co, c);
+        }
+    }
+
+    return NULL;
+}
+
+/* smallest latency [us] that at least fraction q of the requests stay below */
+static double lat_quantile(const uint64_t *buckets, uint64_t cnt, double q)
+{
+    uint64_t c = 0;
+    unsigned b;
+
+    for (b = 0; b < LAT_BUCKETS - 1; b++) {
+        c += buckets[b];
+        if (c >= q * cnt)
+            break;
+    }
+    return lat_high(b) / 1e3;
+}
+
+/* percentile distribution as written by hdr_percentiles_print() */
+static int hdr_write(const char *path, const uint64_t *buckets, uint64_t cnt,
+        double mean, double stddev)
+{
+    FILE *f;
+    uint64_t c = 0;
+    unsigned b, max = 0;
+    double q;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        perror("opening histogram file failed");
+        return -1;
+    }
+
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+            "1/(1-Percentile)");
+    for (b = 0; b < LAT_BUCKETS; b++) {
+        if (buckets[b] == 0)
+            continue;
+        c += buckets[b];
+        max = b;
+        q = (double) c / cnt;
+        if (c < cnt) {
+            fprintf(f, "%12.3f %2.12f %10"PRIu64" %14.2f\n", lat_high(b) / 1e3,
+                    q, c, 1 / (1 - q));
+        } else {
+            fprintf(f, "%12.3f %2.12f %10"PRIu64"\n", lat_high(b) / 1e3, q, c);
+        }
+    }
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean, stddev);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12"PRIu64"]\n",
+            lat_high(max) / 1e3, cnt);
+    fprintf(f, "#[Buckets = %12u, SubBuckets     = %12u]\n",
+            LAT_BUCKETS >> LAT_SUB_BITS, 1 << LAT_SUB_BITS);
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct flexnic_stats *stats;
+    struct core *cs;
+    pthread_t *pts;
+    struct in_addr addr;
+    uint64_t *buckets, issued = 0, overflows = 0, done = 0, bytes = 0;
+    uint32_t per_thread;
+    double secs, sum = 0, sq = 0, mean, stddev;
+    unsigned i, j, max = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:c:t:r:T:q:s:C:w:d:S:H:h")) != -1) {
+        switch (opt) {
+            case 'p': server_port = atoi(optarg); break;
+            case 'n': server_ports = atoi(optarg); break;
+            case 'c': num_conns = atoi(optarg); break;
+            case 't': num_threads = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'T': trace_path = optarg; break;
+            case 'q':
+                if (dist_parse(optarg, &req_dist) != 0)
+                    return EXIT_FAILURE;
+                break;
+            case 's':
+                if (dist_parse(optarg, &resp_dist) != 0)
+                    return EXIT_FAILURE;
+                break;
+            case 'C': cc_name = optarg; break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'S': seed = strtoull(optarg, NULL, 0); break;
+            case 'H': hdr_path = optarg; break;
+            default:
+                print_usage();
+                return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (optind + 1 != argc || inet_aton(argv[optind], &addr) == 0) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+    server_ip = ntohl(addr.s_addr);
+
+    if (num_threads == 0 || num_conns < num_threads || server_ports == 0 ||
+            duration == 0 || rate <= 0)
+    {
+        fprintf(stderr, "need at least one connection per thread, and a "
+            "non-zero port count, duration and rate\n");
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(cc_name, "default") &&
+            (cc_alg = flextcp_cc_lookup(cc_name)) < 0)
+    {
+        fprintf(stderr, "unknown congestion control algorithm %s\n", cc_name);
+        return EXIT_FAILURE;
+    }
+
+    if (flextcp_init() != 0) {
+        fprintf(stderr, "flextcp_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    /* latencies use the same cycle counter as TAS */
+    if (flexnic_driver_stats(&stats) != 0) {
+        fprintf(stderr, "flexnic_driver_stats failed\n");
+        return EXIT_FAILURE;
+    }
+    tsc_hz = stats->tsc_hz;
+    ns_per_cyc = 1e9 / tsc_hz;
+    mean_gap = (double) tsc_hz * num_threads / rate;
+
+    if (trace_path != NULL && trace_load(trace_path) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    pts = calloc(num_threads, sizeof(*pts));
+    cs = calloc(num_threads, sizeof(*cs));
+    buckets = calloc(LAT_BUCKETS, sizeof(*buckets));
+    if (pts == NULL || cs == NULL || buckets == NULL) {
+        fprintf(stderr, "allocating thread handles failed\n");
+        return EXIT_FAILURE;
+    }
+
+    per_thread = num_conns / num_threads;
+    for (i = 0; i < num_threads; i++) {
+        cs[i].cn = i;
+        cs[i].conns_num = per_thread + (i < num_conns % num_threads);
+        utils_rng_init(&cs[i].rng, seed + i);
+        if ((cs[i].conns = calloc(cs[i].conns_num, sizeof(*cs[i].conns)))
+                == NULL ||
+            (cs[i].lat_buckets = calloc(LAT_BUCKETS,
+                sizeof(*cs[i].lat_buckets))) == NULL)
+        {
+            fprintf(stderr, "allocating connections failed\n");
+            return EXIT_FAILURE;
+        }
+        if (flextcp_context_create(&cs[i].context) != 0) {
+            fprintf(stderr, "flextcp_context_create failed %d\n", i);
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(pts + i, NULL, thread_run, cs + i)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (conns_open < num_conns) {
+        sleep(1);
+    }
+    running = 1;
+    sleep(warmup);
+
+    measuring = 1;
+    sleep(duration);
+    measuring = 0;
+
+    /* give responses to the last requests a moment to come back */
+    sleep(1);
+
+    for (i = 0; i < num_threads; i++) {
+        issued += cs[i].issued;
+        overflows += cs[i].overflows;
+        done += cs[i].done;
+        bytes += cs[i].bytes;
+        sum += cs[i].lat_sum;
+        sq += cs[i].lat_sq;
+        for (j = 0; j < LAT_BUCKETS; j++) {
+            buckets[j] += cs[i].lat_buckets[j];
+            if (buckets[j] != 0 && j > max)
+                max = j;
+        }
+    }
+
+    secs = duration;
+    if (done == 0) {
+        fprintf(stderr, "no responses received while measuring\n");
+        return EXIT_FAILURE;
+    }
+    mean = sum / done / 1e3;
+    stddev = sqrt(MAX(sq / done - (sum / done) * (sum / done), 0)) / 1e3;
+
+    printf("conns=%u threads=%u cc=%s: offered=%.0f/s done=%.0f/s "
+        "overflows=%"PRIu64" unanswered=%"PRIu64" %.3f Gbps mean=%.1fus "
+        "p50=%.1fus p90=%.1fus p99=%.1fus p999=%.1fus p9999=%.1fus "
+        "max=%.1fus\n", num_conns, num_threads, cc_name, issued / secs,
+        done / secs, overflows, issued - overflows - done,
+        bytes * 8 / secs / 1e9, mean, lat_quantile(buckets, done, 0.5),
+        lat_quantile(buckets, done, 0.9), lat_quantile(buckets, done, 0.99),
+        lat_quantile(buckets, done, 0.999),
+        lat_quantile(buckets, done, 0.9999), lat_high(max) / 1e3);
+
+    if (hdr_path != NULL &&
+            hdr_write(hdr_path, buckets, done, mean, stddev) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
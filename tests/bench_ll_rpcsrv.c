@@ -0,0 +1,313 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Request/response server for bench_ll_loadgen. Each request starts with a
+ * struct rpc_hdr carrying the request length and the response length the
+ * client wants back, requests on a connection are answered in order with
+ * that many bytes.
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tas_ll.h>
+#include <utils.h>
+
+/* request header, see bench_ll_loadgen.c */
+struct rpc_hdr {
+    /* request length including this header */
+    uint32_t req_len;
+    /* response length */
+    uint32_t resp_len;
+} __attribute__((packed));
+
+static uint32_t max_flows = 4096;
+static uint16_t max_events = 64;
+static uint16_t listen_port;
+
+struct connection {
+    struct flextcp_connection conn;
+    struct connection *next;
+    /* header of the current request, and bytes of it received */
+    struct rpc_hdr hdr;
+    uint32_t hdr_off;
+    /* body bytes left of the current request */
+    uint32_t req_rem;
+    /* response bytes not allocated in the transmit buffer yet */
+    uint64_t to_alloc;
+};
+
+struct core {
+    struct flextcp_context context;
+    struct flextcp_listener listen;
+    struct connection *conns;
+    int cn;
+    uint64_t reqs;
+} __attribute__((aligned((64))));
+
+static void prepare_core(struct core *c)
+{
+    int i, cn = c->cn;
+    struct connection *co;
+
+    if (flextcp_listen_open(&c->context, &c->listen, listen_port, max_flows,
+                FLEXTCP_LISTEN_REUSEPORT) != 0)
+    {
+        fprintf(stderr, "[%d] flextcp_listen_open failed\n", cn);
+        abort();
+    }
+
+    c->conns = NULL;
+    for (i = 0; i < max_flows; i++) {
+        if ((co = calloc(1, sizeof(*co))) == NULL) {
+            fprintf(stderr, "[%d] alloc of connection structs failed\n", cn);
+            abort();
+        }
+
+        co->next = c->conns;
+        c->conns = co;
+    }
+}
+
+static inline void accept_connection(struct core *co)
+{
+    struct connection *c;
+
+    c = co->conns;
+    if (c == NULL) {
+        fprintf(stderr, "[%d] no connection struct available for new conn\n",
+                co->cn);
+        return;
+    }
+
+    if (flextcp_listen_accept(&co->context, &co->listen, &c->conn) != 0) {
+        fprintf(stderr, "[%d] flextcp_listen_accept failed\n", co->cn);
+        return;
+    }
+    co->conns = c->next;
+}
+
+static inline void accepted_connection(struct core *co,
+        struct flextcp_event *ev)
+{
+    struct connection *c = (struct connection *) ev->ev.listen_accept.conn;
+
+    if (ev->ev.listen_accept.status != 0) {
+        fprintf(stderr, "[%d] flextcp_listen_accept async failure\n", co->cn);
+        c->next = co->conns;
+        co->conns = c;
+        return;
+    }
+
+    c->hdr_off = 0;
+    c->req_rem = 0;
+    c->to_alloc = 0;
+}
+
+static inline void conn_send(struct core *co, struct connection *c)
+{
+    ssize_t ret;
+    size_t allocd = 0;
+    void *buf;
+
+    /* response contents don't matter, only their length */
+    while (allocd < c->to_alloc) {
+        ret = flextcp_connection_tx_alloc(&c->conn, c->to_alloc - allocd, &buf);
+        if (ret <= 0) {
+            break;
+        }
+        allocd += ret;
+    }
+
+    if (allocd > 0) {
+        if (flextcp_connection_tx_send(&co->context, &c->conn, allocd) != 0) {
+            fprintf(stderr, "[%d] flextcp_connection_tx_send failed\n", co->cn);
+            abort();
+        }
+        c->to_alloc -= allocd;
+    }
+}
+
+static inline void conn_received(struct core *co, struct connection *c,
+        const uint8_t *buf, size_t len)
+{
+    size_t n, done = len;
+
+    while (len > 0) {
+        /* header may be split over receive events */
+        if (c->hdr_off < sizeof(c->hdr)) {
+            n = MIN(len, sizeof(c->hdr) - c->hdr_off);
+            memcpy((uint8_t *) &c->hdr + c->hdr_off, buf, n);
+            c->hdr_off += n;
+            buf += n;
+            len -= n;
+            if (c->hdr_off < sizeof(c->hdr))
+                break;
+
+            if (c->hdr.req_len < sizeof(c->hdr)) {
+                fprintf(stderr, "[%d] invalid request length %u\n", co->cn,
+                        c->hdr.req_len);
+                abort();
+            }
+            c->req_rem = c->hdr.req_len - sizeof(c->hdr);
+        }
+
+        n = MIN(len, c->req_rem);
+        c->req_rem -= n;
+        buf += n;
+        len -= n;
+        if (c->req_rem == 0) {
+            c->to_alloc += c->hdr.resp_len;
+            c->hdr_off = 0;
+            co->reqs++;
+        }
+    }
+
+    if (flextcp_connection_rx_done(&co->context, &c->conn, done) != 0) {
+        fprintf(stderr, "[%d] flextcp_connection_rx_done failed\n", co->cn);
+        abort();
+    }
+    conn_send(co, c);
+}
+
+static void *thread_run(void *arg)
+{
+    struct core *co = arg;
+    int n, i, cn;
+    struct flextcp_event *evs, *ev;
+    struct connection *c;
+
+    cn = co->cn;
+    prepare_core(co);
+
+    evs = calloc(max_events, sizeof(*evs));
+    if (evs == NULL) {
+        fprintf(stderr, "Allocating event buffer failed\n");
+        abort();
+    }
+
+    printf("[%d] Starting event loop\n", cn);
+    fflush(stdout);
+    while (1) {
+        if ((n = flextcp_context_poll(&co->context, max_events, evs)) < 0) {
+            fprintf(stderr, "[%d] flextcp_context_poll failed\n", cn);
+            abort();
+        }
+
+        for (i = 0; i < n; i++) {
+            ev = evs + i;
+
+            switch (ev->event_type) {
+                case FLEXTCP_EV_LISTEN_OPEN:
+                    break;
+
+                case FLEXTCP_EV_LISTEN_NEWCONN:
+                    accept_connection(co);
+                    break;
+
+                case FLEXTCP_EV_LISTEN_ACCEPT:
+                    accepted_connection(co, ev);
+                    break;
+
+                case FLEXTCP_EV_CONN_RECEIVED:
+                    c = (struct connection *) ev->ev.conn_received.conn;
+                    conn_received(co, c, ev->ev.conn_received.buf,
+                            ev->ev.conn_received.len);
+                    break;
+
+                case FLEXTCP_EV_CONN_SENDBUF:
+                    c = (struct connection *) ev->ev.conn_sendbuf.conn;
+                    conn_send(co, c);
+                    break;
+
+                default:
+                    fprintf(stderr, "[%d] Unexpected flextcp event: %u\n", cn,
+                            ev->event_type);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned num_threads, i;
+    struct core *cs;
+    pthread_t *pts;
+    uint64_t reqs, last = 0;
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: ./bench_ll_rpcsrv PORT THREADS "
+            "[MAX-FLOWS]\n");
+        return EXIT_FAILURE;
+    }
+
+    listen_port = atoi(argv[1]);
+    num_threads = atoi(argv[2]);
+    if (argc >= 4) {
+        max_flows = atoi(argv[3]);
+    }
+
+    if (flextcp_init() != 0) {
+        fprintf(stderr, "flextcp_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    pts = calloc(num_threads, sizeof(*pts));
+    cs = calloc(num_threads, sizeof(*cs));
+    if (pts == NULL || cs == NULL) {
+        fprintf(stderr, "allocating thread handles failed\n");
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        cs[i].cn = i;
+        if (flextcp_context_create(&cs[i].context) != 0) {
+            fprintf(stderr, "flextcp_context_create failed %d\n", i);
+            return EXIT_FAILURE;
+        }
+        if (pthread_create(pts + i, NULL, thread_run, cs + i)) {
+            fprintf(stderr, "pthread_create failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    while (1) {
+        sleep(1);
+        for (reqs = 0, i = 0; i < num_threads; i++) {
+            reqs += cs[i].reqs;
+        }
+        printf("requests/s: %"PRIu64"\n", reqs - last);
+        fflush(stdout);
+        last = reqs;
+    }
+
+    return EXIT_SUCCESS;
+}
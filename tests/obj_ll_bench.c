@@ -23,21 +23,29 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <tas_ll.h>
 #include <utils.h>
 
 #define MAX_CORES 32
+#define MAX_BATCH 64
 
 static volatile int ready = 0;
 static struct flextcp_obj_connection *one_conn;
+/* objects per batch in throughput mode, 0 for the ping pong test */
+static unsigned batch = 0;
 
 static void print_usage(void)
 {
-  fprintf(stderr, "Usage: obj_ll_echo CORES IP PORT\n");
+  fprintf(stderr, "Usage: obj_ll_bench [-t BATCH] CORES [IP] PORT\n"
+      "  -t BATCH  measure objects/sec per core, sending BATCH objects at "
+      "once\n");
 }
 
 static int init_connect(struct flextcp_context *ctx, uint32_t ip,
@@ -246,6 +254,77 @@ static void *worker_loop(void *arg)
   return NULL;
 }
 
+static uint64_t time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* keep up to batch objects in flight per round, and report received objects
+ * per second for this context */
+static void *worker_bench(void *arg)
+{
+  struct flextcp_context *ctx = arg;
+  struct flextcp_obj_connection *conn = one_conn;
+  struct flextcp_obj_alloc allocs[MAX_BATCH];
+  struct flextcp_event evs[2 * MAX_BATCH];
+  uint64_t rxed = 0, txed = 0, t_last, t_now;
+  uint32_t x = 0x12345678;
+  uint8_t bbuf[16];
+  unsigned j, n;
+  int num, i;
+
+  memcpy(bbuf + 4, "Hello World!", 12);
+
+  t_last = time_us();
+  while (1) {
+    for (j = 0; j < batch; j++) {
+      allocs[j].dstlen = 4;
+      allocs[j].len = 12;
+    }
+    n = flextcp_obj_connection_tx_alloc_n(conn, allocs, batch);
+
+    for (j = 0; j < n; j++, x++) {
+      memcpy(bbuf, &x, 4);
+      memcpy(allocs[j].buf_1, bbuf, allocs[j].len_1);
+      memcpy(allocs[j].buf_2, bbuf + allocs[j].len_1, 16 - allocs[j].len_1);
+    }
+
+    if (n > 0) {
+      flextcp_obj_connection_tx_send_n(ctx, conn, allocs, n);
+      txed += n;
+    }
+
+    num = flextcp_context_poll(ctx, 2 * MAX_BATCH, evs);
+    for (i = 0; i < num; i++) {
+      if (evs[i].event_type != FLEXTCP_EV_OBJ_CONN_RECEIVED)
+        continue;
+
+      flextcp_obj_connection_rx_done(ctx, evs[i].ev.obj_conn_received.conn,
+          &evs[i].ev.obj_conn_received.handle);
+      rxed++;
+    }
+
+    if (flextcp_obj_connection_bump(ctx, conn) != 0) {
+      fprintf(stderr, "flextcp_obj_connection_bump failed\n");
+      abort();
+    }
+
+    t_now = time_us();
+    if (t_now - t_last >= 1000000) {
+      printf("ctx %p: rx %"PRIu64" objs/s tx %"PRIu64" objs/s\n", ctx,
+          rxed * 1000000 / (t_now - t_last), txed * 1000000 / (t_now - t_last));
+      fflush(stdout);
+      rxed = txed = 0;
+      t_last = t_now;
+    }
+  }
+
+  return NULL;
+}
+
 int main(int argc, char *argv[])
 {
   struct flextcp_context *ctxs[MAX_CORES], *ctx;
@@ -254,10 +333,31 @@ int main(int argc, char *argv[])
   pthread_t threads[MAX_CORES];
   uint32_t ip;
   uint16_t port, cores;
-  int connect = 0;
+  void *(*worker)(void *) = worker_loop;
+  int connect = 0, opt;
   size_t j;
 
   /* parse parameters */
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+      case 't':
+        batch = atoi(optarg);
+        if (batch < 1 || batch > MAX_BATCH) {
+          fprintf(stderr, "obj_ll_bench: invalid batch size (%u, max=%u)\n",
+              batch, MAX_BATCH);
+          return -1;
+        }
+        worker = worker_bench;
+        break;
+
+      default:
+        print_usage();
+        return -1;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc < 3 || argc > 4) {
     print_usage();
     return -1;
@@ -323,14 +423,14 @@ int main(int argc, char *argv[])
   /* start worker threads */
   printf("Starting worker threads\n");
   for (j = 1; j < cores; j++) {
-    if (pthread_create(threads + j, NULL, worker_loop, ctxs[j]) != 0) {
+    if (pthread_create(threads + j, NULL, worker, ctxs[j]) != 0) {
       fprintf(stderr, "obj_ll_echo: pthread_create %zu failed\n", j);
       return -1;
     }
   }
   printf("Started worker threads\n");
 
-  worker_loop(ctxs[0]);
+  worker(ctxs[0]);
 
   return 0;
 }
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <tas_ll.h>
+#include <utils.h>
+
+int flextcp_kernel_route(struct flextcp_context *ctx, uint32_t ip,
+    uint8_t prefix, uint32_t next_hop_ip, int16_t port, int del);
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./routetool add IP/PREFIX,NEXTHOP[,PORT]\n"
+        "       ./routetool del IP/PREFIX\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct flextcp_context ctx;
+    uint32_t ip, next_hop_ip = 0;
+    char *slash, *comma, *port_s;
+    int del, port = -1, prefix = 32;
+
+    if (argc != 3 || (strcmp(argv[1], "add") && strcmp(argv[1], "del"))) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    del = !strcmp(argv[1], "del");
+
+    /* split off next hop and port */
+    if ((comma = strchr(argv[2], ',')) != NULL) {
+        *comma = 0;
+        if ((port_s = strchr(comma + 1, ',')) != NULL) {
+            *port_s = 0;
+            port = atoi(port_s + 1);
+        }
+        if (util_parse_ipv4(comma + 1, &next_hop_ip) != 0) {
+            fprintf(stderr, "parsing next hop (%s) failed\n", comma + 1);
+            return EXIT_FAILURE;
+        }
+    } else if (!del) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if ((slash = strchr(argv[2], '/')) != NULL) {
+        *slash = 0;
+        prefix = atoi(slash + 1);
+    }
+    if (util_parse_ipv4(argv[2], &ip) != 0 || prefix < 0 || prefix > 32) {
+        fprintf(stderr, "parsing destination (%s) failed\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    if (flextcp_init() != 0) {
+        fprintf(stderr, "flextcp_init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (flextcp_context_create(&ctx) != 0) {
+        fprintf(stderr, "flextcp_context_create failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (flextcp_kernel_route(&ctx, ip, prefix, next_hop_ip, port, del) != 0) {
+        fprintf(stderr, "flextcp_kernel_route failed\n");
+        return EXIT_FAILURE;
+    }
+
+    /* errors are reported by the slow path */
+    sleep(1);
+
+    return EXIT_SUCCESS;
+}
@@ -31,6 +31,9 @@
 #include <tas_memif.h>
 
 struct flextcp_pl_mem *plm;
+struct flextcp_pl_flowst_stats *stats;
+uint32_t flow_num;
+uint32_t cores_num;
 
 /** connect to flexnic shared memory regions */
 static int connect_flexnic(void)
@@ -49,10 +52,15 @@ static int connect_flexnic(void)
   }
   plm = int_mem_start;
 
-  if (info->internal_mem_size < sizeof(*plm)) {
+  if (info->internal_mem_size <
+      FLEXNIC_PL_MEM_SIZE(info->flow_num, info->flowht_num))
+  {
     fprintf(stderr, "internal memory smaller than expected\n");
     return -1;
   }
+  flow_num = info->flow_num;
+  cores_num = info->cores_num;
+  stats = FLEXNIC_PL_FLOWST_STATS(plm, flow_num);
 
   return 0;
 }
@@ -105,7 +113,7 @@ static int dump_flow(uint32_t flow_id)
   struct flextcp_pl_flowst *fs;
   uint64_t mac = 0;
 
-  if (flow_id >= FLEXNIC_PL_FLOWST_NUM) {
+  if (flow_id >= flow_num) {
     fprintf(stderr, "dump_appctx: invalid doorbell id %u\n", flow_id);
     return -1;
   }
@@ -145,6 +153,7 @@ static int dump_flow(uint32_t flow_id)
          "          objrem=%08x\n"
          "      dupack_cnt=%08x\n"
 #ifdef FLEXNIC_PL_OOO_RECV
+         "         ooo_num=%08x\n"
          "       ooo_start=%08x\n"
          "         ooo_len=%08x\n"
 #endif
@@ -158,6 +167,7 @@ static int dump_flow(uint32_t flow_id)
          "        next_seq=%010u\n"
          "          objrem=%08x\n"
          "         next_ts=%08x\n"
+         "        sack_num=%08x\n"
          "  }\n"
          "  cc {\n"
          "         tx_rate=%10u\n"
@@ -181,16 +191,33 @@ static int dump_flow(uint32_t flow_id)
       fs->rx_remote_avail, fs->rx_next_pos, fs->rx_next_seq, fs->rx_objrem,
       fs->rx_dupack_cnt,
 #ifdef FLEXNIC_PL_OOO_RECV
-      fs->rx_ooo_start, fs->rx_ooo_len,
+      fs->rx_ooo_num, fs->rx_ooo[0].start, fs->rx_ooo[0].len,
 #endif
       fs->tx_base, fs->tx_len, fs->tx_sent, fs->tx_head, fs->tx_next_pos,
-      fs->tx_next_seq, fs->tx_objrem, fs->tx_next_ts,
-      fs->tx_rate, fs->cnt_tx_drops, fs->cnt_rx_acks, fs->cnt_rx_ack_bytes,
-      fs->cnt_rx_ecn_bytes, fs->rtt_est);
+      fs->tx_next_seq, fs->tx_objrem, fs->tx_next_ts, fs->tx_sack_num,
+      fs->tx_rate, stats[flow_id].cnt_tx_drops, stats[flow_id].cnt_rx_acks,
+      stats[flow_id].cnt_rx_ack_bytes, stats[flow_id].cnt_rx_ecn_bytes,
+      stats[flow_id].rtt_est);
 
   return 0;
 }
 
+static int dump_core(uint32_t core)
+{
+  static const char *states[] = { "busy", "spin", "pause", "sleep" };
+  /* copy, the state region is packed */
+  struct flextcp_pl_corest cs = plm->corest[core];
+
+  printf("core %u {\n"
+         "  idle_state=%s\n"
+         "  idle_sleeps=%"PRIu64"\n"
+         "  idle_sleep_us=%"PRIu64"\n"
+         "}\n", core,
+         (cs.idle_state <= FLEXNIC_PL_CORE_SLEEP ? states[cs.idle_state] :
+          "?"), cs.idle_sleeps, cs.idle_sleep_us);
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   uint32_t i;
@@ -199,10 +226,13 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  for (i = 0; i < cores_num; i++) {
+    dump_core(i);
+  }
   for (i = 0; i < FLEXNIC_PL_APPCTX_NUM; i++) {
     dump_appctx(i);
   }
-  for (i = 0; i < FLEXNIC_PL_FLOWST_NUM; i++) {
+  for (i = 0; i < flow_num; i++) {
     dump_flow(i);
   }
 
@@ -0,0 +1,456 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Drains the fast path packet capture rings (see FLEXNIC_PCAP_NAME) into a
+ * pcapng file, with one interface per fast path core. Capture is enabled
+ * while this runs and off again once it exits.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <tas_trace.h>
+#include <utils.h>
+
+/** Interval between draining the rings [us] */
+#define DRAIN_INTERVAL 1000
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_EPB_FLAGS 2
+/** Classic pcap with nanosecond timestamps */
+#define PCAP_MAGIC_NS 0xa1b23c4d
+
+static volatile int stop = 0;
+static FILE *out;
+static int classic = 0;
+/* realtime [ns] and timestamp counter when the capture started */
+static uint64_t start_ns;
+static uint64_t start_tsc;
+static uint64_t tsc_hz;
+
+static void usage(const char *progname)
+{
+  fprintf(stderr, "Usage: %s [OPTION]...\n"
+      "  -w FILE    Write capture to FILE [default: tas.pcapng]\n"
+      "  -i DIR     Capture rx, tx or both [default: both]\n"
+      "  -f FILTER  Only packets between IP[:PORT][,IP[:PORT]] (both "
+          "directions)\n"
+      "  -g FG      Only packets of flow group FG\n"
+      "  -s BYTES   Bytes captured per packet [default/max: %u]\n"
+      "  -c COUNT   Stop after COUNT packets\n"
+      "  -t SECS    Stop after SECS seconds\n"
+      "  -P         Write classic pcap with packets zero-filled to their "
+          "original\n"
+      "             length, to replay rx captures through a net_pcap "
+          "virtual device\n",
+      progname, FLEXNIC_PCAP_SNAPLEN);
+}
+
+static struct flexnic_pcap *pcap_connect(void)
+{
+  int fd;
+  void *m;
+  struct flexnic_pcap *pc;
+  struct stat sb;
+
+  if ((fd = shm_open(FLEXNIC_PCAP_NAME, O_RDWR, 0)) == -1) {
+    perror("pcap_connect: shm_open failed");
+    return NULL;
+  }
+
+  if (fstat(fd, &sb) != 0) {
+    perror("pcap_connect: fstat failed");
+    close(fd);
+    return NULL;
+  }
+
+  if (sb.st_size < sizeof(*pc)) {
+    fprintf(stderr, "pcap_connect: region too small\n");
+    close(fd);
+    return NULL;
+  }
+
+  m = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    perror("pcap_connect: mmap failed");
+    return NULL;
+  }
+
+  pc = m;
+  if (pc->version != FLEXNIC_PCAP_VERSION) {
+    fprintf(stderr, "pcap_connect: version mismatch (%u, expected %u)\n",
+        pc->version, FLEXNIC_PCAP_VERSION);
+    return NULL;
+  }
+  if (sb.st_size < FLEXNIC_PCAP_BYTES(pc->cores_num)) {
+    fprintf(stderr, "pcap_connect: region too small for %u cores\n",
+        pc->cores_num);
+    return NULL;
+  }
+
+  return pc;
+}
+
+/* IP[:PORT] */
+static int parse_ep(char *str, uint32_t *ip, uint16_t *port)
+{
+  struct in_addr a;
+  char *colon, *end;
+  unsigned long p = 0;
+
+  if ((colon = strchr(str, ':')) != NULL) {
+    *colon = 0;
+    p = strtoul(colon + 1, &end, 10);
+    if (colon[1] == 0 || *end != 0 || p > UINT16_MAX) {
+      fprintf(stderr, "parse_ep: invalid port %s\n", colon + 1);
+      return -1;
+    }
+  }
+
+  if (*str == 0 || strcmp(str, "*") == 0) {
+    *ip = 0;
+  } else if (inet_pton(AF_INET, str, &a) == 1) {
+    *ip = ntohl(a.s_addr);
+  } else {
+    fprintf(stderr, "parse_ep: invalid address %s\n", str);
+    return -1;
+  }
+  *port = p;
+  return 0;
+}
+
+/* IP[:PORT][,IP[:PORT]] */
+static int parse_filter(char *str, uint32_t *ips, uint16_t *ports)
+{
+  char *comma;
+
+  ips[1] = 0;
+  ports[1] = 0;
+  if ((comma = strchr(str, ',')) != NULL) {
+    *comma = 0;
+    if (parse_ep(comma + 1, &ips[1], &ports[1]) != 0)
+      return -1;
+  }
+  return parse_ep(str, &ips[0], &ports[0]);
+}
+
+static void write_pad(size_t len)
+{
+  static const uint8_t zeros[4] = { 0 };
+  fwrite(zeros, 1, (4 - (len % 4)) % 4, out);
+}
+
+static void write_header(uint32_t cores_num, uint32_t snaplen)
+{
+  char name[32];
+  uint32_t c, len, name_len, u32;
+  uint16_t u16;
+  uint8_t u8;
+  uint64_t u64;
+
+  if (classic) {
+    u32 = PCAP_MAGIC_NS; fwrite(&u32, 4, 1, out);
+    u16 = 2; fwrite(&u16, 2, 1, out);
+    u16 = 4; fwrite(&u16, 2, 1, out);
+    u32 = 0; fwrite(&u32, 4, 1, out);
+    u32 = 0; fwrite(&u32, 4, 1, out);
+    u32 = UINT16_MAX; fwrite(&u32, 4, 1, out);
+    u32 = PCAPNG_LINKTYPE_ETHERNET; fwrite(&u32, 4, 1, out);
+    return;
+  }
+
+  /* section header: byte order magic, version 1.0, unknown section length */
+  len = 28;
+  u32 = PCAPNG_SHB; fwrite(&u32, 4, 1, out);
+  fwrite(&len, 4, 1, out);
+  u32 = 0x1A2B3C4D; fwrite(&u32, 4, 1, out);
+  u16 = 1; fwrite(&u16, 2, 1, out);
+  u16 = 0; fwrite(&u16, 2, 1, out);
+  u64 = UINT64_MAX; fwrite(&u64, 8, 1, out);
+  fwrite(&len, 4, 1, out);
+
+  /* interface per core, with name and nanosecond timestamps */
+  for (c = 0; c < cores_num; c++) {
+    name_len = snprintf(name, sizeof(name), "tas core %u", c);
+    len = 20 + 4 + ((name_len + 3) & ~3) + 8 + 4;
+
+    u32 = PCAPNG_IDB; fwrite(&u32, 4, 1, out);
+    fwrite(&len, 4, 1, out);
+    u16 = PCAPNG_LINKTYPE_ETHERNET; fwrite(&u16, 2, 1, out);
+    u16 = 0; fwrite(&u16, 2, 1, out);
+    fwrite(&snaplen, 4, 1, out);
+
+    u16 = PCAPNG_OPT_IF_NAME; fwrite(&u16, 2, 1, out);
+    u16 = name_len; fwrite(&u16, 2, 1, out);
+    fwrite(name, 1, name_len, out);
+    write_pad(name_len);
+
+    u16 = PCAPNG_OPT_IF_TSRESOL; fwrite(&u16, 2, 1, out);
+    u16 = 1; fwrite(&u16, 2, 1, out);
+    u8 = 9; fwrite(&u8, 1, 1, out);
+    write_pad(1);
+
+    u32 = PCAPNG_OPT_END; fwrite(&u32, 4, 1, out);
+    fwrite(&len, 4, 1, out);
+  }
+}
+
+static void write_rec(uint16_t core, const struct flexnic_pcap_rec *r)
+{
+  static const uint8_t zeros[UINT16_MAX] = { 0 };
+  uint64_t ts;
+  uint32_t len, u32;
+  uint16_t u16;
+
+  ts = start_ns + (uint64_t) ((double) (int64_t) (r->tsc - start_tsc) *
+      1e9 / tsc_hz);
+
+  if (classic) {
+    u32 = ts / 1000000000ULL; fwrite(&u32, 4, 1, out);
+    u32 = ts % 1000000000ULL; fwrite(&u32, 4, 1, out);
+    u32 = r->len; fwrite(&u32, 4, 1, out);
+    fwrite(&u32, 4, 1, out);
+    fwrite(r->data, 1, r->caplen, out);
+    fwrite(zeros, 1, r->len - r->caplen, out);
+    return;
+  }
+
+  len = 28 + ((r->caplen + 3) & ~3) + 8 + 4;
+  u32 = PCAPNG_EPB; fwrite(&u32, 4, 1, out);
+  fwrite(&len, 4, 1, out);
+  u32 = core; fwrite(&u32, 4, 1, out);
+  u32 = ts >> 32; fwrite(&u32, 4, 1, out);
+  u32 = ts; fwrite(&u32, 4, 1, out);
+  u32 = r->caplen; fwrite(&u32, 4, 1, out);
+  u32 = r->len; fwrite(&u32, 4, 1, out);
+  fwrite(r->data, 1, r->caplen, out);
+  write_pad(r->caplen);
+
+  /* direction: 1 inbound, 2 outbound */
+  u16 = PCAPNG_OPT_EPB_FLAGS; fwrite(&u16, 2, 1, out);
+  u16 = 4; fwrite(&u16, 2, 1, out);
+  u32 = (r->dir == FLEXNIC_PCAP_RX ? 1 : 2); fwrite(&u32, 4, 1, out);
+  u32 = PCAPNG_OPT_END; fwrite(&u32, 4, 1, out);
+  fwrite(&len, 4, 1, out);
+}
+
+/* write records added to the ring of core c since tail, returns the number
+ * written and counts records that were overwritten before we got to them */
+static uint64_t drain(struct flexnic_pcap *pc, uint16_t c, uint64_t *tail,
+    struct flexnic_pcap_rec *buf, uint64_t max, uint64_t *lost)
+{
+  struct flexnic_pcap_rec *ring = FLEXNIC_PCAP_RING(pc, c);
+  uint64_t h, h2, start, valid, i;
+
+  h = FLEXNIC_PCAP_CORE(pc, c)->head;
+  MEM_BARRIER();
+  start = *tail;
+  if (h - start > FLEXNIC_PCAP_RECS) {
+    *lost += h - start - FLEXNIC_PCAP_RECS;
+    start = h - FLEXNIC_PCAP_RECS;
+  }
+  if (h - start > max)
+    h = start + max;
+
+  for (i = start; i < h; i++) {
+    buf[i - start] = ring[i % FLEXNIC_PCAP_RECS];
+  }
+
+  /* drop records the fast path may have overwritten while we copied */
+  MEM_BARRIER();
+  h2 = FLEXNIC_PCAP_CORE(pc, c)->head;
+  valid = (h2 > FLEXNIC_PCAP_RECS ? h2 - FLEXNIC_PCAP_RECS : 0);
+  if (valid > h)
+    valid = h;
+  if (valid > start) {
+    *lost += valid - start;
+  } else {
+    valid = start;
+  }
+
+  for (i = valid; i < h; i++) {
+    write_rec(c, &buf[i - start]);
+  }
+  *tail = h;
+  return h - valid;
+}
+
+static void sig_handler(int sig)
+{
+  stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+  struct flexnic_pcap *pc;
+  struct flexnic_pcap_rec *buf;
+  struct timespec now;
+  const char *path = "tas.pcapng";
+  uint64_t *tails, count = 0, max = UINT64_MAX, lost = 0, duration = 0;
+  uint32_t ips[2] = { 0, 0 }, enable = FLEXNIC_PCAP_RX | FLEXNIC_PCAP_TX;
+  uint32_t snaplen = FLEXNIC_PCAP_SNAPLEN;
+  uint16_t ports[2] = { 0, 0 }, fg = FLEXNIC_PCAP_FG_ANY;
+  uint16_t c;
+  unsigned long v;
+  char *end;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:i:f:g:s:c:t:Ph")) != -1) {
+    switch (opt) {
+      case 'w':
+        path = optarg;
+        break;
+      case 'i':
+        if (strcmp(optarg, "rx") == 0) {
+          enable = FLEXNIC_PCAP_RX;
+        } else if (strcmp(optarg, "tx") == 0) {
+          enable = FLEXNIC_PCAP_TX;
+        } else if (strcmp(optarg, "both") == 0) {
+          enable = FLEXNIC_PCAP_RX | FLEXNIC_PCAP_TX;
+        } else {
+          fprintf(stderr, "invalid direction %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'f':
+        if (parse_filter(optarg, ips, ports) != 0)
+          return EXIT_FAILURE;
+        break;
+      case 'g':
+      case 's':
+      case 'c':
+      case 't':
+        v = strtoul(optarg, &end, 10);
+        if (*optarg == 0 || *end != 0) {
+          fprintf(stderr, "invalid number %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        if (opt == 'g' && v < FLEXNIC_PCAP_FG_ANY) {
+          fg = v;
+        } else if (opt == 's' && v > 0 && v <= FLEXNIC_PCAP_SNAPLEN) {
+          snaplen = v;
+        } else if (opt == 'c') {
+          max = v;
+        } else if (opt == 't') {
+          duration = v;
+        } else {
+          fprintf(stderr, "value out of range: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'P':
+        classic = 1;
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if ((pc = pcap_connect()) == NULL)
+    return EXIT_FAILURE;
+  if (pc->enable != 0) {
+    fprintf(stderr, "capture already running\n");
+    return EXIT_FAILURE;
+  }
+
+  tails = calloc(pc->cores_num, sizeof(*tails));
+  buf = calloc(FLEXNIC_PCAP_RECS, sizeof(*buf));
+  if (tails == NULL || buf == NULL) {
+    perror("calloc failed");
+    return EXIT_FAILURE;
+  }
+
+  if ((out = fopen(path, "w")) == NULL) {
+    perror("fopen failed");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, sig_handler);
+  signal(SIGTERM, sig_handler);
+
+  /* filter has to be in place before capture is enabled */
+  pc->snaplen = snaplen;
+  pc->ip[0] = ips[0];
+  pc->ip[1] = ips[1];
+  pc->port[0] = ports[0];
+  pc->port[1] = ports[1];
+  pc->fg = fg;
+  for (c = 0; c < pc->cores_num; c++) {
+    tails[c] = FLEXNIC_PCAP_CORE(pc, c)->head;
+  }
+  tsc_hz = pc->tsc_hz;
+  clock_gettime(CLOCK_REALTIME, &now);
+  start_tsc = util_rdtsc();
+  start_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+  MEM_BARRIER();
+  pc->enable = enable;
+
+  write_header(pc->cores_num, snaplen);
+
+  while (!stop && count < max) {
+    usleep(DRAIN_INTERVAL);
+    for (c = 0; c < pc->cores_num && count < max; c++) {
+      count += drain(pc, c, &tails[c], buf, max - count, &lost);
+    }
+
+    if (duration != 0 && (util_rdtsc() - start_tsc) / tsc_hz >= duration)
+      break;
+  }
+
+  pc->enable = 0;
+  /* pick up what was written until the cores saw capture disabled */
+  usleep(DRAIN_INTERVAL);
+  for (c = 0; c < pc->cores_num && count < max; c++) {
+    count += drain(pc, c, &tails[c], buf, max - count, &lost);
+  }
+
+  if (ferror(out) || fclose(out) != 0) {
+    perror("writing capture failed");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "%"PRIu64" packets captured, %"PRIu64" lost\n", count,
+      lost);
+  return EXIT_SUCCESS;
+}
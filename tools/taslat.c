@@ -0,0 +1,157 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Prints latency percentiles from the histograms in the TAS statistics
+ * region, either since TAS started or over an interval.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <tas_ll_connect.h>
+#include <tas_memif.h>
+
+/* indexed by FLEXNIC_STATS_HIST_* */
+static const char *hist_names[FLEXNIC_STATS_HIST_NUM] = {
+  "rx_arx", "arx_app", "atx_tx", "rtt" };
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+#define QUANTILES_NUM (sizeof(quantiles) / sizeof(quantiles[0]))
+
+struct hist_sum {
+  uint64_t sum;
+  uint64_t buckets[FLEXNIC_STATS_HIST_BUCKETS];
+};
+
+static struct hist_sum snap[2][FLEXNIC_PL_APPST_NUM][FLEXNIC_STATS_HIST_NUM];
+
+/* sum histograms over all cores */
+static void snapshot(const struct flexnic_stats *stats,
+    struct hist_sum (*hs)[FLEXNIC_STATS_HIST_NUM])
+{
+  const struct flexnic_stats_hist *h;
+  uint32_t a, k, i, b;
+
+  memset(hs, 0, sizeof(snap[0]));
+  for (a = 0; a < FLEXNIC_PL_APPST_NUM; a++) {
+    for (k = 0; k < FLEXNIC_STATS_HIST_NUM; k++) {
+      for (i = 0; i < stats->cores_num; i++) {
+        h = &stats->hists[i][a][k];
+        hs[a][k].sum += h->sum;
+        for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+          hs[a][k].buckets[b] += h->buckets[b];
+        }
+      }
+    }
+  }
+}
+
+/* largest value in bucket b */
+static uint64_t bucket_high(unsigned b)
+{
+  if (b + 1 >= FLEXNIC_STATS_HIST_BUCKETS)
+    return flexnic_stats_hist_low(b);
+  return flexnic_stats_hist_low(b + 1) - 1;
+}
+
+static void print_hist(uint32_t a, uint32_t k, const uint64_t *buckets,
+    uint64_t sum, double scale)
+{
+  uint64_t cnt = 0, c;
+  unsigned b, q, max = 0;
+
+  for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+    cnt += buckets[b];
+    if (buckets[b] != 0)
+      max = b;
+  }
+  if (cnt == 0)
+    return;
+
+  printf("%3u %-8s %12"PRIu64" %9.1f", a, hist_names[k], cnt,
+      sum / scale / cnt);
+
+  /* report the upper end of the bucket the quantile falls in */
+  for (q = 0; q < QUANTILES_NUM; q++) {
+    for (b = 0, c = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+      c += buckets[b];
+      if (c >= quantiles[q] * cnt)
+        break;
+    }
+    printf(" %9.1f", bucket_high(b) / scale);
+  }
+  printf(" %9.1f\n", bucket_high(max) / scale);
+}
+
+int main(int argc, char *argv[])
+{
+  const struct flexnic_stats *stats;
+  uint64_t buckets[FLEXNIC_STATS_HIST_BUCKETS];
+  unsigned interval = 0, b;
+  uint32_t a, k;
+  double scale;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "i:")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: ./taslat [-i SECONDS]\n");
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (flexnic_driver_stats(&stats) != 0) {
+    fprintf(stderr, "flexnic_driver_stats failed\n");
+    return EXIT_FAILURE;
+  }
+
+  memset(snap[0], 0, sizeof(snap[0]));
+  if (interval > 0) {
+    snapshot(stats, snap[0]);
+    sleep(interval);
+  }
+  snapshot(stats, snap[1]);
+
+  printf("app kind            count      mean       p50       p90       p99"
+      "     p99.9       max [us]\n");
+  for (a = 0; a < FLEXNIC_PL_APPST_NUM; a++) {
+    for (k = 0; k < FLEXNIC_STATS_HIST_NUM; k++) {
+      for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+        buckets[b] = snap[1][a][k].buckets[b] - snap[0][a][k].buckets[b];
+      }
+
+      scale = (k == FLEXNIC_STATS_HIST_RTT ? 1 : stats->tsc_hz / 1e6);
+      print_hist(a, k, buckets, snap[1][a][k].sum - snap[0][a][k].sum, scale);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,605 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Serves the TAS statistics region and flow state as OpenMetrics over HTTP.
+ * All regions are mapped read-only and only sampled when scraped, the fast
+ * and slow path never notice.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <tas_ll.h>
+#include <tas_ll_connect.h>
+#include <tas_memif.h>
+
+#define DEFAULT_PORT 9391
+#define REQ_MAX 4096
+/** Scrapers that stop reading or writing are dropped after this [s] */
+#define CLIENT_TIMEOUT 5
+
+struct outbuf {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static const struct flexnic_info *info;
+static const struct flextcp_pl_mem *plm;
+static const struct flextcp_pl_flowst_stats *flowst_stats;
+static const struct flexnic_stats *stats;
+
+/* indexed by FLEXNIC_STATS_DROP_* */
+static const char *drop_names[FLEXNIC_STATS_DROP_NUM] = {
+  "rx_seq", "rx_ooo", "rx_fin", "krx_full", "krx_none", "fwd", "tx_full",
+  "rx_csum" };
+/* indexed by enum dataplane_stage_id */
+static const char *stage_names[FLEXNIC_STATS_STAGE_NUM] = {
+  "rx", "fwd", "qman", "queues", "kernel" };
+
+/* indexed by FLEXNIC_STATS_KSTAGE_* */
+static const char *kstage_names[FLEXNIC_STATS_KSTAGE_NUM] = {
+  "nic", "cc", "app", "arp", "tcp", "timeout" };
+
+/* indexed by FLEXNIC_STATS_KHIST_* */
+static const char *khist_names[FLEXNIC_STATS_KHIST_NUM] = {
+  "alloc", "route", "arp", "nicif_add", "notify", "open", "accept" };
+
+/* indexed by FLEXNIC_STATS_HIST_* */
+static const char *hist_names[FLEXNIC_STATS_HIST_NUM] = {
+  "rx_arx", "arx_app", "atx_tx", "rtt" };
+
+/* aggregates over flows, for flow groups and app contexts */
+struct flow_agg {
+  uint32_t flows;
+  uint64_t tx_rate;
+  uint64_t rtt_sum;
+};
+static struct flow_agg fg_agg[FLEXNIC_PL_MAX_FLOWGROUPS];
+static struct flow_agg ctx_agg[FLEXNIC_PL_APPCTX_NUM];
+
+static void out(struct outbuf *ob, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void out(struct outbuf *ob, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  while (1) {
+    va_start(ap, fmt);
+    n = vsnprintf(ob->buf + ob->len, ob->cap - ob->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      abort();
+    }
+    if (ob->len + n < ob->cap) {
+      ob->len += n;
+      return;
+    }
+
+    ob->cap = (ob->cap + n) * 2;
+    if ((ob->buf = realloc(ob->buf, ob->cap)) == NULL) {
+      perror("out: realloc failed");
+      abort();
+    }
+  }
+}
+
+static inline void metric(struct outbuf *ob, const char *name,
+    const char *type, const char *help)
+{
+  out(ob, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+/** connect to flexnic shared memory regions */
+static int connect_flexnic(void)
+{
+  const void *int_mem_start;
+  int ret;
+
+  while ((ret = flexnic_driver_connect_ro(&info)) > 0) {
+    sleep(1);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "flexnic_driver_connect_ro failed\n");
+    return -1;
+  }
+
+  if (flexnic_driver_internal_ro(&int_mem_start) != 0) {
+    fprintf(stderr, "flexnic_driver_internal_ro failed\n");
+    return -1;
+  }
+  plm = int_mem_start;
+
+  if (info->internal_mem_size <
+      FLEXNIC_PL_MEM_SIZE(info->flow_num, info->flowht_num))
+  {
+    fprintf(stderr, "internal memory smaller than expected\n");
+    return -1;
+  }
+  flowst_stats = FLEXNIC_PL_FLOWST_STATS(plm, info->flow_num);
+
+  if (flexnic_driver_stats(&stats) != 0) {
+    fprintf(stderr, "flexnic_driver_stats failed\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void render_cores(struct outbuf *ob)
+{
+  const struct flexnic_stats_core *c;
+  uint32_t i, j, n = stats->cores_num;
+
+#define CORE_COUNTER(name, field, help) \
+  do { \
+    metric(ob, "tas_fp_" name, "counter", help); \
+    for (i = 0; i < n; i++) { \
+      out(ob, "tas_fp_" name "_total{core=\"%u\"} %"PRIu64"\n", i, \
+          stats->cores[i].field); \
+    } \
+  } while (0)
+
+  CORE_COUNTER("rx_packets", rx_pkts, "Packets received from the NIC.");
+  CORE_COUNTER("rx_bytes", rx_bytes, "Bytes received from the NIC.");
+  CORE_COUNTER("tx_packets", tx_pkts, "Packets queued to the NIC.");
+  CORE_COUNTER("tx_bytes", tx_bytes, "Bytes queued to the NIC.");
+  CORE_COUNTER("punts", punts, "Packets handed to the slow path.");
+  CORE_COUNTER("arx_full", arx_full,
+      "Flushes blocked by a full app rx queue.");
+  CORE_COUNTER("qman_served", qm_served, "Queues served by the qman.");
+  CORE_COUNTER("loops", loops, "Dataplane loop iterations.");
+  CORE_COUNTER("idle_loops", loops_idle,
+      "Dataplane loop iterations without work.");
+  CORE_COUNTER("busy_cycles", cyc_busy, "Cycles in busy loop iterations.");
+  CORE_COUNTER("tx_stalls", tx_stalls,
+      "Flushes the NIC did not take all packets of.");
+  CORE_COUNTER("tx_stall_cycles", cyc_tx_stall,
+      "Cycles until a stalled NIC took all packets again.");
+#undef CORE_COUNTER
+
+  metric(ob, "tas_fp_sleeps", "counter", "Times the core went to sleep.");
+  for (i = 0; i < n; i++) {
+    out(ob, "tas_fp_sleeps_total{core=\"%u\"} %"PRIu64"\n", i,
+        plm->corest[i].idle_sleeps);
+  }
+
+  metric(ob, "tas_fp_drops", "counter", "Dropped packets by reason.");
+  for (i = 0; i < n; i++) {
+    c = &stats->cores[i];
+    for (j = 0; j < FLEXNIC_STATS_DROP_NUM; j++) {
+      out(ob, "tas_fp_drops_total{core=\"%u\",reason=\"%s\"} %"PRIu64"\n", i,
+          drop_names[j], c->drops[j]);
+    }
+  }
+
+  metric(ob, "tas_fp_stage_cycles", "counter",
+      "Cycles spent per dataplane stage.");
+  for (i = 0; i < n; i++) {
+    c = &stats->cores[i];
+    for (j = 0; j < FLEXNIC_STATS_STAGE_NUM; j++) {
+      out(ob, "tas_fp_stage_cycles_total{core=\"%u\",stage=\"%s\"} "
+          "%"PRIu64"\n", i, stage_names[j], c->cyc_stage[j]);
+    }
+  }
+
+  metric(ob, "tas_fp_qman_waiting", "gauge",
+      "Rate limited queues waiting in the qman timer wheel.");
+  for (i = 0; i < n; i++) {
+    out(ob, "tas_fp_qman_waiting{core=\"%u\"} %u\n", i,
+        stats->cores[i].qm_waiting);
+  }
+
+  metric(ob, "tas_fp_idle_state", "gauge",
+      "Idle state of the core (0=busy, 1=spin, 2=pause, 3=sleep).");
+  for (i = 0; i < n; i++) {
+    out(ob, "tas_fp_idle_state{core=\"%u\"} %u\n", i,
+        plm->corest[i].idle_state);
+  }
+
+  metric(ob, "tas_fp_tsc_hz", "gauge", "Frequency of the cycle counters.");
+  out(ob, "tas_fp_tsc_hz %"PRIu64"\n", stats->tsc_hz);
+}
+
+static void render_kernel(struct outbuf *ob)
+{
+  const struct flexnic_stats_kernel *k = &stats->kernel;
+  const struct flexnic_stats_cc *cc;
+  const char *name;
+  unsigned i;
+
+#define KERNEL_COUNTER(name, field, help) \
+  do { \
+    metric(ob, "tas_sp_" name, "counter", help); \
+    out(ob, "tas_sp_" name "_total %"PRIu64"\n", k->field); \
+  } while (0)
+
+  KERNEL_COUNTER("drops", drops, "Drops detected by the fast path.");
+  KERNEL_COUNTER("kernel_rexmit", kernel_rexmit,
+      "Retransmission timeouts handled by the slow path.");
+  KERNEL_COUNTER("fast_rto", fast_rto,
+      "Retransmission timeouts handled by the fast path.");
+  KERNEL_COUNTER("ecn_marked_bytes", ecn_marked, "ECN marked bytes acked.");
+  KERNEL_COUNTER("acked_bytes", acks, "Bytes acknowledged.");
+  KERNEL_COUNTER("syncookies_sent", syncookies_sent,
+      "SYN-ACKs sent with a SYN cookie.");
+  KERNEL_COUNTER("syncookies_ok", syncookies_ok,
+      "ACKs with a valid SYN cookie.");
+  KERNEL_COUNTER("syncookies_failed", syncookies_failed,
+      "ACKs with an invalid SYN cookie.");
+  KERNEL_COUNTER("rxbuf_resizes", rxbuf_resizes,
+      "Receive buffers replaced by autotuning.");
+  KERNEL_COUNTER("txbuf_resizes", txbuf_resizes,
+      "Transmit buffers replaced by autotuning.");
+  KERNEL_COUNTER("loops", loops, "Slow path loop iterations.");
+  KERNEL_COUNTER("idle_loops", loops_idle,
+      "Slow path loop iterations without work.");
+  KERNEL_COUNTER("busy_cycles", cyc_busy,
+      "Cycles in busy slow path loop iterations.");
+#undef KERNEL_COUNTER
+
+  metric(ob, "tas_sp_stage_cycles", "counter",
+      "Cycles spent per slow path loop stage.");
+  for (i = 0; i < FLEXNIC_STATS_KSTAGE_NUM; i++) {
+    out(ob, "tas_sp_stage_cycles_total{stage=\"%s\"} %"PRIu64"\n",
+        kstage_names[i], k->cyc_stage[i]);
+  }
+
+  metric(ob, "tas_sp_scale_ups", "counter", "Fast path scale up decisions.");
+  out(ob, "tas_sp_scale_ups_total %"PRIu64"\n", plm->scalest.ups);
+  metric(ob, "tas_sp_scale_downs", "counter",
+      "Fast path scale down decisions.");
+  out(ob, "tas_sp_scale_downs_total %"PRIu64"\n", plm->scalest.downs);
+  metric(ob, "tas_sp_load", "gauge", "Smoothed fast path load [cores].");
+  out(ob, "tas_sp_load %u.%03u\n", plm->scalest.load / 1000,
+      plm->scalest.load % 1000);
+
+  /* the slow path numbers its algorithms from FLEXTCP_CC_DCTCP_WIN */
+  metric(ob, "tas_cc_connections", "gauge", "Connections per algorithm.");
+  for (i = 0; i < FLEXNIC_STATS_CC_NUM &&
+      (name = flextcp_cc_name(i + FLEXTCP_CC_DCTCP_WIN)) != NULL; i++)
+  {
+    out(ob, "tas_cc_connections{algorithm=\"%s\"} %"PRIu64"\n", name,
+        k->cc[i].conns);
+  }
+
+#define CC_COUNTER(mname, field, help) \
+  do { \
+    metric(ob, "tas_cc_" mname, "counter", help); \
+    for (i = 0; i < FLEXNIC_STATS_CC_NUM && \
+        (name = flextcp_cc_name(i + FLEXTCP_CC_DCTCP_WIN)) != NULL; i++) \
+    { \
+      cc = &k->cc[i]; \
+      out(ob, "tas_cc_" mname "_total{algorithm=\"%s\"} %"PRIu64"\n", name, \
+          cc->field); \
+    } \
+  } while (0)
+
+  CC_COUNTER("updates", updates, "Control loop iterations.");
+  CC_COUNTER("drops", drops, "Drops detected by the fast path.");
+  CC_COUNTER("ecn_bytes", ecn_bytes, "ECN marked bytes acked.");
+  CC_COUNTER("acked_bytes", ack_bytes, "Bytes acknowledged.");
+  CC_COUNTER("fast_rto", fast_rto,
+      "Retransmission timeouts handled by the fast path.");
+#undef CC_COUNTER
+}
+
+/* walk flow states, flows in use have buffers */
+static void render_flows(struct outbuf *ob)
+{
+  const struct flextcp_pl_flowst *fs;
+  struct flow_agg *a;
+  uint32_t i, j;
+
+  memset(fg_agg, 0, sizeof(fg_agg));
+  memset(ctx_agg, 0, sizeof(ctx_agg));
+  for (i = 0; i < info->flow_num; i++) {
+    fs = &plm->flowst[i];
+    if (fs->rx_len == 0 && fs->tx_len == 0)
+      continue;
+
+    if (fs->flow_group < FLEXNIC_PL_MAX_FLOWGROUPS) {
+      a = &fg_agg[fs->flow_group];
+      a->flows++;
+      a->tx_rate += fs->tx_rate;
+      a->rtt_sum += flowst_stats[i].rtt_est;
+    }
+    if (fs->db_id < FLEXNIC_PL_APPCTX_NUM) {
+      a = &ctx_agg[fs->db_id];
+      a->flows++;
+      a->tx_rate += fs->tx_rate;
+      a->rtt_sum += flowst_stats[i].rtt_est;
+    }
+  }
+
+#define AGG_GAUGES(prefix, label, arr, num) \
+  do { \
+    metric(ob, prefix "_flows", "gauge", "Open flows."); \
+    for (j = 0; j < (num); j++) { \
+      if (arr[j].flows == 0) \
+        continue; \
+      out(ob, prefix "_flows{" label "=\"%u\"} %u\n", j, \
+          arr[j].flows); \
+    } \
+    metric(ob, prefix "_tx_rate_kbps", "gauge", \
+        "Sum of congestion control rates [kbps]."); \
+    for (j = 0; j < (num); j++) { \
+      if (arr[j].flows == 0) \
+        continue; \
+      out(ob, prefix "_tx_rate_kbps{" label "=\"%u\"} %"PRIu64"\n", \
+          j, arr[j].tx_rate); \
+    } \
+    metric(ob, prefix "_rtt_us", "gauge", "Mean rtt estimate [us]."); \
+    for (j = 0; j < (num); j++) { \
+      if (arr[j].flows == 0) \
+        continue; \
+      out(ob, prefix "_rtt_us{" label "=\"%u\"} %"PRIu64"\n", j, \
+          arr[j].rtt_sum / arr[j].flows); \
+    } \
+  } while (0)
+
+  AGG_GAUGES("tas_flowgroup", "group", fg_agg, FLEXNIC_PL_MAX_FLOWGROUPS);
+  AGG_GAUGES("tas_appctx", "ctx", ctx_agg, FLEXNIC_PL_APPCTX_NUM);
+#undef AGG_GAUGES
+
+  metric(ob, "tas_flowgroup_core", "gauge", "Core owning the flow group.");
+  for (j = 0; j < FLEXNIC_PL_MAX_FLOWGROUPS; j++) {
+    if (fg_agg[j].flows == 0)
+      continue;
+    out(ob, "tas_flowgroup_core{group=\"%u\"} %u\n", j,
+        plm->flow_group_steering[j]);
+  }
+}
+
+static void render_hists(struct outbuf *ob)
+{
+  const struct flexnic_stats_hist *h;
+  uint64_t buckets[FLEXNIC_STATS_HIST_BUCKETS], sum, cnt;
+  uint32_t a, k, i, b;
+  double scale;
+
+  metric(ob, "tas_latency_seconds", "histogram",
+      "Latency in the host by application: NIC rx to app rx queue (rx_arx), "
+      "app rx queue to app (arx_app), app tx bump to first segment (atx_tx), "
+      "and round trip time (rtt).");
+  for (a = 0; a < FLEXNIC_PL_APPST_NUM; a++) {
+    for (k = 0; k < FLEXNIC_STATS_HIST_NUM; k++) {
+      memset(buckets, 0, sizeof(buckets));
+      sum = cnt = 0;
+      for (i = 0; i < stats->cores_num; i++) {
+        h = &stats->hists[i][a][k];
+        sum += h->sum;
+        for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+          buckets[b] += h->buckets[b];
+          cnt += h->buckets[b];
+        }
+      }
+      if (cnt == 0)
+        continue;
+
+      /* only report power of two boundaries, those are exact */
+      scale = (k == FLEXNIC_STATS_HIST_RTT ? 1e6 : (double) stats->tsc_hz);
+      cnt = 0;
+      for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+        if (b > 0 && b % (1 << FLEXNIC_STATS_HIST_SUB_BITS) == 0) {
+          out(ob, "tas_latency_seconds_bucket{app=\"%u\",kind=\"%s\","
+              "le=\"%g\"} %"PRIu64"\n", a, hist_names[k],
+              (flexnic_stats_hist_low(b) - 1) / scale, cnt);
+        }
+        cnt += buckets[b];
+      }
+      out(ob, "tas_latency_seconds_bucket{app=\"%u\",kind=\"%s\","
+          "le=\"+Inf\"} %"PRIu64"\n", a, hist_names[k], cnt);
+      out(ob, "tas_latency_seconds_count{app=\"%u\",kind=\"%s\"} "
+          "%"PRIu64"\n", a, hist_names[k], cnt);
+      out(ob, "tas_latency_seconds_sum{app=\"%u\",kind=\"%s\"} %g\n", a,
+          hist_names[k], sum / scale);
+    }
+  }
+}
+
+static void render_khists(struct outbuf *ob)
+{
+  const struct flexnic_stats_hist *h;
+  uint64_t cnt;
+  uint32_t k, b;
+  double scale = stats->tsc_hz;
+
+  metric(ob, "tas_sp_handshake_seconds", "histogram",
+      "Time spent per connection setup phase in the slow path: buffer "
+      "allocation (alloc), route and ARP cache lookup (route), ARP reply "
+      "(arp), fast path registration (nicif_add), app notification (notify), "
+      "and the whole active (open) and passive (accept) handshake.");
+  for (k = 0; k < FLEXNIC_STATS_KHIST_NUM; k++) {
+    h = &stats->kernel.hists[k];
+    if (h->count == 0)
+      continue;
+
+    /* only report power of two boundaries, those are exact */
+    cnt = 0;
+    for (b = 0; b < FLEXNIC_STATS_HIST_BUCKETS; b++) {
+      if (b > 0 && b % (1 << FLEXNIC_STATS_HIST_SUB_BITS) == 0) {
+        out(ob, "tas_sp_handshake_seconds_bucket{phase=\"%s\",le=\"%g\"} "
+            "%"PRIu64"\n", khist_names[k],
+            (flexnic_stats_hist_low(b) - 1) / scale, cnt);
+      }
+      cnt += h->buckets[b];
+    }
+    out(ob, "tas_sp_handshake_seconds_bucket{phase=\"%s\",le=\"+Inf\"} "
+        "%"PRIu64"\n", khist_names[k], cnt);
+    out(ob, "tas_sp_handshake_seconds_count{phase=\"%s\"} %"PRIu64"\n",
+        khist_names[k], cnt);
+    out(ob, "tas_sp_handshake_seconds_sum{phase=\"%s\"} %g\n",
+        khist_names[k], h->sum / scale);
+  }
+}
+
+static void render(struct outbuf *ob)
+{
+  ob->len = 0;
+  render_cores(ob);
+  render_kernel(ob);
+  render_flows(ob);
+  render_hists(ob);
+  render_khists(ob);
+  out(ob, "# EOF\n");
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+  ssize_t ret;
+
+  while (len > 0) {
+    if ((ret = write(fd, buf, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+static void serve(int cfd, struct outbuf *ob)
+{
+  char req[REQ_MAX + 1], hdr[256];
+  struct timeval tv = { .tv_sec = CLIENT_TIMEOUT, .tv_usec = 0 };
+  size_t len = 0;
+  ssize_t ret;
+  int n;
+
+  /* clients are served one at a time, a stalled one must not block others */
+  if (setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+      setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0)
+  {
+    perror("serve: setting socket timeouts failed");
+    return;
+  }
+
+  /* only the request line matters, read until the end of the headers */
+  while (len < REQ_MAX) {
+    if ((ret = read(cfd, req + len, REQ_MAX - len)) <= 0)
+      return;
+    len += ret;
+    req[len] = 0;
+    if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+      break;
+  }
+
+  if (strncmp(req, "GET /metrics ", 13) != 0 &&
+      strncmp(req, "GET / ", 6) != 0)
+  {
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    write_all(cfd, hdr, n);
+    return;
+  }
+
+  render(ob);
+  n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+      "Content-Type: application/openmetrics-text; version=1.0.0; "
+      "charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+      ob->len);
+  if (write_all(cfd, hdr, n) == 0)
+    write_all(cfd, ob->buf, ob->len);
+}
+
+int main(int argc, char *argv[])
+{
+  struct sockaddr_in sin;
+  struct outbuf ob = { NULL, 0, 0 };
+  int fd, cfd, opt, on = 1;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY);
+  sin.sin_port = htons(DEFAULT_PORT);
+
+  while ((opt = getopt(argc, argv, "l:p:")) != -1) {
+    switch (opt) {
+      case 'l':
+        if (inet_pton(AF_INET, optarg, &sin.sin_addr) != 1) {
+          fprintf(stderr, "invalid listen address: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'p':
+        sin.sin_port = htons(atoi(optarg));
+        break;
+      default:
+        fprintf(stderr, "Usage: ./tasstatd [-l ADDR] [-p PORT]\n");
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (connect_flexnic() != 0) {
+    return EXIT_FAILURE;
+  }
+
+  /* scrapers closing early show up as write errors instead */
+  signal(SIGPIPE, SIG_IGN);
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    perror("socket failed");
+    return EXIT_FAILURE;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)) != 0) {
+    perror("bind failed");
+    return EXIT_FAILURE;
+  }
+  if (listen(fd, 16) != 0) {
+    perror("listen failed");
+    return EXIT_FAILURE;
+  }
+
+  /* scrapes are rare, one at a time is plenty */
+  while (1) {
+    if ((cfd = accept(fd, NULL, NULL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept failed");
+      return EXIT_FAILURE;
+    }
+    serve(cfd, &ob);
+    close(cfd);
+  }
+
+  return EXIT_SUCCESS;
+}
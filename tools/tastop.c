@@ -0,0 +1,337 @@
+/*
+ * Copyright 2019 University of Washington, Max Planck Institute for
+ * Software Systems, and The University of Texas at Austin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Live view of the busiest flows: samples the per-flow counters the fast path
+ * keeps for congestion control and shows rates over the last interval, per
+ * app context and for the top flows.
+ *
+ * Counters live apart from the hot flow state, and the first cache line of
+ * the flow state only changes when a flow is set up, so a sample only reads
+ * lines the fast path does not write per packet. The transmit state lines
+ * (rate and queued bytes) are read only for flows that are shown, unless
+ * flows are sorted by queued bytes.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <tas_ll_connect.h>
+#include <tas_memif.h>
+
+enum sort_key {
+  SORT_TPUT,
+  SORT_RETX,
+  SORT_RTT,
+  SORT_QUEUE,
+};
+
+/* last sample of a flow, counters wrap as in flextcp_pl_flowst_stats */
+struct flow_sample {
+  uint64_t opaque;
+  uint16_t local_port;
+  uint16_t remote_port;
+  uint8_t used;
+  uint16_t drops;
+  uint16_t rtos;
+  uint32_t ack_bytes;
+};
+
+/* rates over the last interval */
+struct flow_delta {
+  uint32_t id;
+  uint64_t ack_bytes;
+  uint32_t retx;
+  uint32_t rtt;
+  uint32_t queued;
+};
+
+struct ctx_sum {
+  uint32_t flows;
+  uint64_t ack_bytes;
+  uint64_t retx;
+  uint64_t rtt_sum;
+};
+
+static const struct flextcp_pl_mem *plm;
+static const struct flextcp_pl_flowst_stats *stats;
+static uint32_t flow_num;
+
+static struct flow_sample *samples;
+static struct flow_delta *deltas;
+static struct ctx_sum ctx_sums[FLEXNIC_PL_APPCTX_NUM];
+static enum sort_key sort_key = SORT_TPUT;
+
+/** connect to flexnic shared memory regions */
+static int connect_flexnic(void)
+{
+  const struct flexnic_info *info;
+  const void *int_mem_start;
+  int ret;
+
+  while ((ret = flexnic_driver_connect_ro(&info)) > 0) {
+    sleep(1);
+  }
+  if (ret != 0) {
+    fprintf(stderr, "flexnic_driver_connect_ro failed\n");
+    return -1;
+  }
+
+  if (flexnic_driver_internal_ro(&int_mem_start) != 0) {
+    fprintf(stderr, "flexnic_driver_internal_ro failed\n");
+    return -1;
+  }
+  plm = int_mem_start;
+
+  if (info->internal_mem_size <
+      FLEXNIC_PL_MEM_SIZE(info->flow_num, info->flowht_num))
+  {
+    fprintf(stderr, "internal memory smaller than expected\n");
+    return -1;
+  }
+  flow_num = info->flow_num;
+  stats = FLEXNIC_PL_FLOWST_STATS(plm, flow_num);
+
+  return 0;
+}
+
+/* unsent bytes in the transmit buffer, see tcp_txavail() */
+static uint32_t flow_queued(const volatile struct flextcp_pl_flowst *fs)
+{
+  uint32_t head = fs->tx_head, pos = fs->tx_next_pos;
+
+  if (pos <= head)
+    return head - pos;
+  return fs->tx_len - pos + head;
+}
+
+/* take a sample of all flows, returns number of flows with deltas */
+static uint32_t sample(int ctx_filter)
+{
+  const volatile struct flextcp_pl_flowst *fs;
+  const volatile struct flextcp_pl_flowst_stats *st;
+  struct flow_sample *s, cur;
+  struct flow_delta *d;
+  struct ctx_sum *cs;
+  uint32_t i, n = 0;
+
+  memset(ctx_sums, 0, sizeof(ctx_sums));
+  for (i = 0; i < flow_num; i++) {
+    fs = &plm->flowst[i];
+    s = &samples[i];
+
+    if (fs->rx_len == 0 && fs->tx_len == 0) {
+      s->used = 0;
+      continue;
+    }
+
+    st = &stats[i];
+    cur.opaque = fs->opaque;
+    cur.local_port = f_beui16(fs->local_port);
+    cur.remote_port = f_beui16(fs->remote_port);
+    cur.used = 1;
+    cur.drops = st->cnt_tx_drops;
+    cur.rtos = st->cnt_tx_rtos;
+    cur.ack_bytes = st->cnt_rx_ack_bytes;
+
+    /* new flow or flow id reused since last sample: no delta yet */
+    if (!s->used || s->opaque != cur.opaque ||
+        s->local_port != cur.local_port || s->remote_port != cur.remote_port ||
+        (ctx_filter >= 0 && fs->db_id != ctx_filter))
+    {
+      *s = cur;
+      if (ctx_filter >= 0 && fs->db_id != ctx_filter)
+        continue;
+    }
+
+    d = &deltas[n++];
+    d->id = i;
+    d->ack_bytes = (uint32_t) (cur.ack_bytes - s->ack_bytes);
+    d->retx = (uint16_t) (cur.drops - s->drops) +
+      (uint16_t) (cur.rtos - s->rtos);
+    d->rtt = st->rtt_est;
+    d->queued = (sort_key == SORT_QUEUE ? flow_queued(fs) : 0);
+    *s = cur;
+
+    if (fs->db_id < FLEXNIC_PL_APPCTX_NUM) {
+      cs = &ctx_sums[fs->db_id];
+      cs->flows++;
+      cs->ack_bytes += d->ack_bytes;
+      cs->retx += d->retx;
+      cs->rtt_sum += d->rtt;
+    }
+  }
+
+  return n;
+}
+
+static int delta_cmp(const void *a, const void *b)
+{
+  const struct flow_delta *x = a, *y = b;
+  uint64_t kx, ky;
+
+  switch (sort_key) {
+    case SORT_RETX:
+      kx = x->retx;
+      ky = y->retx;
+      break;
+    case SORT_RTT:
+      kx = x->rtt;
+      ky = y->rtt;
+      break;
+    case SORT_QUEUE:
+      kx = x->queued;
+      ky = y->queued;
+      break;
+    default:
+      kx = x->ack_bytes;
+      ky = y->ack_bytes;
+      break;
+  }
+
+  if (kx != ky)
+    return (kx > ky ? -1 : 1);
+  return (x->ack_bytes > y->ack_bytes ? -1 : x->ack_bytes < y->ack_bytes);
+}
+
+static void print_addr(char *buf, size_t len, beui32_t ip, beui16_t port)
+{
+  struct in_addr a = { .s_addr = ip.x };
+  char ipbuf[INET_ADDRSTRLEN];
+
+  inet_ntop(AF_INET, &a, ipbuf, sizeof(ipbuf));
+  snprintf(buf, len, "%s:%u", ipbuf, f_beui16(port));
+}
+
+static void print(uint32_t n, uint32_t top, double secs)
+{
+  const volatile struct flextcp_pl_flowst *fs;
+  const struct flow_delta *d;
+  const struct ctx_sum *cs;
+  char local[32], remote[32];
+  uint32_t i;
+
+  printf("ctx    flows   acked Mbps     retx/s  rtt avg [us]\n");
+  for (i = 0; i < FLEXNIC_PL_APPCTX_NUM; i++) {
+    cs = &ctx_sums[i];
+    if (cs->flows == 0)
+      continue;
+    printf("%3u %8u %12.2f %10.1f %13"PRIu64"\n", i, cs->flows,
+        cs->ack_bytes * 8 / secs / 1e6, cs->retx / secs,
+        cs->rtt_sum / cs->flows);
+  }
+
+  qsort(deltas, n, sizeof(deltas[0]), delta_cmp);
+  if (n > top)
+    n = top;
+
+  printf("\n    flow ctx %-21s %-21s   acked Mbps     retx/s  rtt [us]"
+      "  rate [kbps]   queued [B]\n", "local", "remote");
+  for (i = 0; i < n; i++) {
+    d = &deltas[i];
+    fs = &plm->flowst[d->id];
+    print_addr(local, sizeof(local), fs->local_ip, fs->local_port);
+    print_addr(remote, sizeof(remote), fs->remote_ip, fs->remote_port);
+    printf("%8u %3u %-21s %-21s %12.2f %10.1f %9u %12u %12u\n", d->id,
+        fs->db_id, local, remote, d->ack_bytes * 8 / secs / 1e6,
+        d->retx / secs, d->rtt, fs->tx_rate,
+        (sort_key == SORT_QUEUE ? d->queued : flow_queued(fs)));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned interval = 1, top = 20, once = 0;
+  int opt, ctx_filter = -1;
+  uint32_t n;
+
+  while ((opt = getopt(argc, argv, "i:n:s:c:1")) != -1) {
+    switch (opt) {
+      case 'i':
+        interval = atoi(optarg);
+        break;
+      case 'n':
+        top = atoi(optarg);
+        break;
+      case 's':
+        if (!strcmp(optarg, "tput")) {
+          sort_key = SORT_TPUT;
+        } else if (!strcmp(optarg, "retx")) {
+          sort_key = SORT_RETX;
+        } else if (!strcmp(optarg, "rtt")) {
+          sort_key = SORT_RTT;
+        } else if (!strcmp(optarg, "queue")) {
+          sort_key = SORT_QUEUE;
+        } else {
+          fprintf(stderr, "unknown sort key: %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'c':
+        ctx_filter = atoi(optarg);
+        break;
+      case '1':
+        once = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: ./tastop [-i SECONDS] [-n FLOWS] "
+            "[-s tput|retx|rtt|queue] [-c CTX] [-1]\n");
+        return EXIT_FAILURE;
+    }
+  }
+  if (interval == 0) {
+    fprintf(stderr, "interval must be at least one second\n");
+    return EXIT_FAILURE;
+  }
+
+  if (connect_flexnic() != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if ((samples = calloc(flow_num, sizeof(*samples))) == NULL ||
+      (deltas = calloc(flow_num, sizeof(*deltas))) == NULL)
+  {
+    perror("tastop: calloc failed");
+    return EXIT_FAILURE;
+  }
+
+  sample(ctx_filter);
+  while (1) {
+    sleep(interval);
+    n = sample(ctx_filter);
+
+    if (!once)
+      printf("\033[H\033[2J");
+    print(n, top, interval);
+    fflush(stdout);
+    if (once)
+      break;
+  }
+
+  return EXIT_SUCCESS;
+}
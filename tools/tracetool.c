@@ -61,6 +61,111 @@ static void dma_dump(void *buf, size_t len);
 static void pcidb_dump(void *buf, size_t len);
 static void qmset_dump(void *buf, size_t len);
 static void qmevt_dump(void *buf, size_t len);
+static struct flexnic_ltrace *ltrace_connect(int rw);
+static int ltrace_dump(struct flexnic_ltrace *lt);
+static void ltrace_rec_dump(struct flexnic_ltrace_rec *r);
+
+static const char *ltrace_evnames[FLEXNIC_LTRACE_EV_NUM] = {
+  [FLEXNIC_LTRACE_EV_RXSEG] = "rxseg",
+  [FLEXNIC_LTRACE_EV_TXSEG] = "txseg",
+  [FLEXNIC_LTRACE_EV_TXACK] = "txack",
+  [FLEXNIC_LTRACE_EV_BUMP]  = "bump",
+  [FLEXNIC_LTRACE_EV_ARX]   = "arx",
+  [FLEXNIC_LTRACE_EV_RTO]   = "rto",
+  [FLEXNIC_LTRACE_EV_PUNT]  = "punt",
+};
+
+static void usage(const char *argv0)
+{
+  unsigned i;
+
+  fprintf(stderr, "Usage: %s [N]\n"
+      "  Dump debug trace of fast path core N (FLEXNIC_TRACING builds)\n"
+      "Usage: %s [-e EVENTS] [-s N] [-l]\n"
+      "  -e EVENTS  Enable lightweight trace events: comma separated names,\n"
+      "             \"all\", \"none\", or a bit mask\n"
+      "  -s N       Only trace flows with flow id %% N == 0 (0 or 1: all)\n"
+      "  -l         Dump lightweight trace records of all cores\n"
+      "Events:", argv0, argv0);
+  for (i = 0; i < FLEXNIC_LTRACE_EV_NUM; i++) {
+    fprintf(stderr, " %s=0x%x", ltrace_evnames[i], 1U << i);
+  }
+  fprintf(stderr, "\n");
+}
+
+static int parse_events(const char *str, uint32_t *mask)
+{
+  char *buf, *tok, *save, *end;
+  unsigned i;
+  int ret = 0;
+
+  *mask = strtoul(str, &end, 0);
+  if (*str != 0 && *end == 0) {
+    return 0;
+  }
+
+  *mask = 0;
+  if ((buf = strdup(str)) == NULL) {
+    perror("parse_events: strdup failed");
+    return -1;
+  }
+
+  for (tok = strtok_r(buf, ",", &save); tok != NULL;
+      tok = strtok_r(NULL, ",", &save))
+  {
+    if (!strcmp(tok, "all")) {
+      *mask |= (1U << FLEXNIC_LTRACE_EV_NUM) - 1;
+      continue;
+    } else if (!strcmp(tok, "none")) {
+      continue;
+    }
+
+    for (i = 0; i < FLEXNIC_LTRACE_EV_NUM; i++) {
+      if (!strcmp(tok, ltrace_evnames[i])) {
+        *mask |= 1U << i;
+        break;
+      }
+    }
+    if (i == FLEXNIC_LTRACE_EV_NUM) {
+      fprintf(stderr, "parse_events: unknown event %s\n", tok);
+      ret = -1;
+      break;
+    }
+  }
+
+  free(buf);
+  return ret;
+}
+
+static int ltrace_main(const char *events, const char *sample, int dump)
+{
+  struct flexnic_ltrace *lt;
+  uint32_t mask;
+
+  if ((lt = ltrace_connect(events != NULL || sample != NULL)) == NULL) {
+    fprintf(stderr, "ltrace_connect failed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (sample != NULL) {
+    lt->sample = strtoul(sample, NULL, 0);
+  }
+  if (events != NULL) {
+    if (parse_events(events, &mask) != 0) {
+      return EXIT_FAILURE;
+    }
+    lt->mask = mask;
+  }
+
+  if (dump && ltrace_dump(lt) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (!dump) {
+    printf("mask=0x%x sample=%u\n", lt->mask, lt->sample);
+  }
+  return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -69,11 +174,33 @@ int main(int argc, char *argv[])
   uint64_t ts;
   uint16_t type;
   uint32_t seq;
-  int ret;
+  int ret, opt, dump = 0;
   unsigned n = 0;
+  const char *events = NULL, *sample = NULL;
+
+  while ((opt = getopt(argc, argv, "e:s:lh")) != -1) {
+    switch (opt) {
+      case 'e':
+        events = optarg;
+        break;
+      case 's':
+        sample = optarg;
+        break;
+      case 'l':
+        dump = 1;
+        break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : EXIT_FAILURE;
+    }
+  }
 
-  if (argc >= 2) {
-    n = atoi(argv[1]);
+  if (events != NULL || sample != NULL || dump) {
+    return ltrace_main(events, sample, dump);
+  }
+
+  if (optind < argc) {
+    n = atoi(argv[optind]);
   }
 
   if ((t = trace_connect(n)) == NULL) {
@@ -547,3 +674,161 @@ static void qmevt_dump(void *buf, size_t len)
 
   printf(" cfg={id=%u bytes=%u opaque=%x}", hdr->id, hdr->bytes, hdr->opaque);
 }
+
+static struct flexnic_ltrace *ltrace_connect(int rw)
+{
+  int fd;
+  void *m;
+  struct flexnic_ltrace *lt;
+  struct stat sb;
+
+  if ((fd = shm_open(FLEXNIC_LTRACE_NAME, rw ? O_RDWR : O_RDONLY, 0)) == -1) {
+    perror("ltrace_connect: shm_open failed");
+    return NULL;
+  }
+
+  if (fstat(fd, &sb) != 0) {
+    perror("ltrace_connect: fstat failed");
+    close(fd);
+    return NULL;
+  }
+
+  if (sb.st_size < sizeof(*lt)) {
+    fprintf(stderr, "ltrace_connect: region too small\n");
+    close(fd);
+    return NULL;
+  }
+
+  m = mmap(NULL, sb.st_size, PROT_READ | (rw ? PROT_WRITE : 0), MAP_SHARED,
+      fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    perror("ltrace_connect: mmap failed");
+    return NULL;
+  }
+
+  lt = m;
+  if (lt->version != FLEXNIC_LTRACE_VERSION) {
+    fprintf(stderr, "ltrace_connect: version mismatch (%u, expected %u)\n",
+        lt->version, FLEXNIC_LTRACE_VERSION);
+    return NULL;
+  }
+  if (sb.st_size < FLEXNIC_LTRACE_BYTES(lt->cores_num)) {
+    fprintf(stderr, "ltrace_connect: region too small for %u cores\n",
+        lt->cores_num);
+    return NULL;
+  }
+
+  return lt;
+}
+
+struct ltrace_ent {
+  struct flexnic_ltrace_rec rec;
+  uint16_t core;
+};
+
+static int ltrace_ent_cmp(const void *a, const void *b)
+{
+  const struct ltrace_ent *ea = a, *eb = b;
+
+  if (ea->rec.tsc != eb->rec.tsc)
+    return ea->rec.tsc < eb->rec.tsc ? -1 : 1;
+  return (int) ea->core - (int) eb->core;
+}
+
+static int ltrace_dump(struct flexnic_ltrace *lt)
+{
+  struct flexnic_ltrace_rec *ring;
+  struct ltrace_ent *ents;
+  uint64_t h, h2, start, valid, i, t0;
+  size_t num = 0, k;
+  uint16_t c;
+
+  ents = calloc((size_t) lt->cores_num * FLEXNIC_LTRACE_RECS, sizeof(*ents));
+  if (ents == NULL) {
+    perror("ltrace_dump: calloc failed");
+    return -1;
+  }
+
+  for (c = 0; c < lt->cores_num; c++) {
+    ring = FLEXNIC_LTRACE_RING(lt, c);
+    h = FLEXNIC_LTRACE_CORE(lt, c)->head;
+    MEM_BARRIER();
+    start = (h > FLEXNIC_LTRACE_RECS ? h - FLEXNIC_LTRACE_RECS : 0);
+
+    k = num;
+    for (i = start; i < h; i++, k++) {
+      ents[k].rec = ring[i % FLEXNIC_LTRACE_RECS];
+      ents[k].core = c;
+    }
+
+    /* drop records the fast path may have overwritten while we copied,
+     * including the slot of record h2 that may be half written */
+    MEM_BARRIER();
+    h2 = FLEXNIC_LTRACE_CORE(lt, c)->head;
+    valid = (h2 + 1 > FLEXNIC_LTRACE_RECS ? h2 + 1 - FLEXNIC_LTRACE_RECS : 0);
+    if (valid > start) {
+      if (valid > h)
+        valid = h;
+      memmove(&ents[num], &ents[num + (valid - start)],
+          (h - valid) * sizeof(*ents));
+      start = valid;
+    }
+    num += h - start;
+  }
+
+  qsort(ents, num, sizeof(*ents), ltrace_ent_cmp);
+
+  t0 = (num > 0 ? ents[0].rec.tsc : 0);
+  for (k = 0; k < num; k++) {
+    printf("ns=%14.0f core=%2u ",
+        (double) (ents[k].rec.tsc - t0) * 1e9 / lt->tsc_hz, ents[k].core);
+    ltrace_rec_dump(&ents[k].rec);
+  }
+
+  free(ents);
+  return 0;
+}
+
+static void ltrace_rec_dump(struct flexnic_ltrace_rec *r)
+{
+  if (r->flow_id == FLEXNIC_LTRACE_NOFLOW) {
+    printf("flow=     - ");
+  } else {
+    printf("flow=%6u ", r->flow_id);
+  }
+
+  switch (r->type) {
+    case FLEXNIC_LTRACE_EV_RXSEG:
+    case FLEXNIC_LTRACE_EV_TXSEG:
+      printf("%s seq=%u ack=%u len=%u flags=%x %s=%u\n",
+          ltrace_evnames[r->type], r->a, r->b, r->c & 0xffff, r->c >> 16,
+          (r->type == FLEXNIC_LTRACE_EV_RXSEG ? "rx_avail" : "wnd"), r->d);
+      break;
+
+    case FLEXNIC_LTRACE_EV_TXACK:
+      printf("txack seq=%u ack=%u wnd=%u sack=%u\n", r->a, r->b, r->c, r->d);
+      break;
+
+    case FLEXNIC_LTRACE_EV_BUMP:
+      printf("bump rx_tail=%u tx_head=%u bump_seq=%u flags=%x\n", r->a, r->b,
+          r->c & 0xffff, r->c >> 16);
+      break;
+
+    case FLEXNIC_LTRACE_EV_ARX:
+      printf("arx rx_bump=%u tx_bump=%u db=%u\n", r->a, r->b, r->c);
+      break;
+
+    case FLEXNIC_LTRACE_EV_RTO:
+      printf("rto tx_next_seq=%u tx_sent=%u backoff=%u\n", r->a, r->b, r->c);
+      break;
+
+    case FLEXNIC_LTRACE_EV_PUNT:
+      printf("punt len=%u\n", r->a);
+      break;
+
+    default:
+      printf("unknown event=%u\n", r->type);
+      break;
+  }
+}